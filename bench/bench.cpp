@@ -0,0 +1,325 @@
+// Benchmark for the rendering code of browservice: the ImageSlice primitives,
+// text layout and rendering, and the rendering and event routing of the
+// control bar widgets. The widgets are run in isolation without initializing
+// CEF or connecting to an X display: the tasks posted by the widgets are run
+// by the benchmark loop and the clipboard is unavailable. Prints one JSON
+// object per line for each benchmark:
+//
+// {"bench":"control_bar_render","iterations":2000,"p50_us":...,
+//  "p99_us":...,"min_us":...}
+//
+// Each benchmark is first run for a tenth of its iterations to warm up the
+// caches, after which every iteration is timed separately; the median and
+// minimum are the most stable numbers for comparing builds.
+//
+// Usage: bench [--iterations-scale X] [--filter SUBSTRING]
+//
+// --iterations-scale multiplies the default iteration counts (e.g. 0.1 for a
+// quick run) and --filter only runs the benchmarks whose name contains the
+// given string.
+
+#include "../src/control_bar.hpp"
+#include "../src/globals.hpp"
+#include "../src/image_slice.hpp"
+#include "../src/key.hpp"
+#include "../src/quality_selector.hpp"
+#include "../src/text.hpp"
+
+namespace browservice {
+
+namespace {
+
+deque<function<void()>> pendingTasks;
+
+void runPendingTasks() {
+    while(!pendingTasks.empty()) {
+        function<void()> task = move(pendingTasks.front());
+        pendingTasks.pop_front();
+        task();
+    }
+}
+
+// Root of the widget trees under test; the view dirty and cursor
+// notifications are ignored as the benchmarks render explicitly.
+class BenchWidgetParent : public WidgetParent {
+SHARED_ONLY_CLASS(BenchWidgetParent);
+public:
+    BenchWidgetParent(CKey) {}
+
+    virtual void onWidgetViewDirty() override {}
+    virtual void onWidgetCursorChanged() override {}
+    virtual void onGlobalHotkeyPressed(GlobalHotkey key) override {}
+};
+
+class BenchEventHandler :
+    public ControlBarEventHandler,
+    public QualitySelectorEventHandler
+{
+SHARED_ONLY_CLASS(BenchEventHandler);
+public:
+    BenchEventHandler(CKey) {}
+
+    virtual void onAddressSubmitted(string url) override {}
+    virtual void onQualityChanged(size_t idx) override {}
+    virtual void onPendingDownloadAccepted() override {}
+    virtual void onFind(string text, bool forward, bool findNext) override {}
+    virtual void onStopFind(bool clearSelection) override {}
+    virtual void onClipboardButtonPressed() override {}
+    virtual void onOpenBookmarksButtonPressed() override {}
+};
+
+struct Options {
+    double iterationsScale = 1.0;
+    string filter;
+};
+
+void runBench(
+    const Options& options,
+    const char* name,
+    int iterations,
+    function<void()> func
+) {
+    if(!options.filter.empty() && string(name).find(options.filter) == string::npos) {
+        return;
+    }
+
+    iterations = max((int)(options.iterationsScale * (double)iterations), 1);
+
+    for(int i = 0; i < max(iterations / 10, 1); ++i) {
+        func();
+        runPendingTasks();
+    }
+
+    vector<double> samples;
+    samples.reserve(iterations);
+    for(int i = 0; i < iterations; ++i) {
+        steady_clock::time_point start = steady_clock::now();
+        func();
+        runPendingTasks();
+        steady_clock::time_point end = steady_clock::now();
+        samples.push_back(
+            (double)duration_cast<std::chrono::nanoseconds>(end - start).count()
+            / 1000.0
+        );
+    }
+
+    sort(samples.begin(), samples.end());
+    auto quantile = [&](double q) {
+        size_t idx = min(
+            (size_t)(q * (double)(samples.size() - 1) + 0.5), samples.size() - 1
+        );
+        return samples[idx];
+    };
+
+    cout << "{\"bench\":\"" << name << "\"";
+    cout << ",\"iterations\":" << iterations;
+    cout << ",\"p50_us\":" << quantile(0.5);
+    cout << ",\"p99_us\":" << quantile(0.99);
+    cout << ",\"min_us\":" << samples.front();
+    cout << "}" << endl;
+}
+
+// A long URL of the kind produced by single sign-on redirects.
+string longURL() {
+    string url = "https://sso.example.com/auth/realms/corp/protocol/openid-connect/auth?";
+    for(int i = 0; i < 24; ++i) {
+        url += "param" + toString(i) + "=abcdefghijklmnopqrstuvwxyz0123456789&";
+    }
+    url += "state=end";
+    return url;
+}
+
+void runImageSliceBenches(const Options& options) {
+    ImageSlice image = ImageSlice::createImage(1920, 1080);
+
+    runBench(options, "image_slice_fill_1920x1080", 500, [&]() {
+        image.fill(0, image.width(), 0, image.height(), 12, 34, 56);
+    });
+
+    runBench(options, "image_slice_fill_rows_1920x27", 20000, [&]() {
+        image.fill(0, image.width(), 0, 27, 192);
+    });
+
+    ImageSlice src = ImageSlice::createImage(800, 600, 200, 100, 50);
+    runBench(options, "image_slice_put_image_800x600", 2000, [&]() {
+        image.putImage(src, 100, 100);
+    });
+
+    vector<uint8_t> mask(400 * 16);
+    for(size_t i = 0; i < mask.size(); ++i) {
+        mask[i] = (i * 7919) % 3 == 0 ? 255 : 0;
+    }
+    runBench(options, "image_slice_fill_mask_400x16", 20000, [&]() {
+        image.fillMask(10, 10, mask.data(), 400, 16, 400, 0, 0, 0);
+    });
+
+    vector<uint8_t> rowA(4 * 1920, 1);
+    vector<uint8_t> rowB(4 * 1920, 2);
+    bool flip = false;
+    runBench(options, "image_slice_compare_and_copy_row", 100000, [&]() {
+        flip = !flip;
+        ImageSlice::compareAndCopy(
+            rowA.data(), flip ? rowB.data() : rowA.data(), rowA.size()
+        );
+    });
+}
+
+void runTextBenches(const Options& options) {
+    ImageSlice image = ImageSlice::createImage(1280, 27);
+
+    shared_ptr<TextLayout> layout = TextLayout::create();
+    layout->setText("Address");
+    runBench(options, "text_layout_render_cached", 20000, [&]() {
+        layout->render(image, 0, 0);
+    });
+
+    uint64_t counter = 0;
+    runBench(options, "text_layout_set_text_render", 2000, [&]() {
+        layout->setText("Example page title " + toString(++counter));
+        layout->render(image, 0, 0);
+    });
+
+    string url = longURL();
+    shared_ptr<OverflowTextLayout> overflow = OverflowTextLayout::create();
+    overflow->setWidth(800);
+    overflow->setText(url);
+    int idx = (int)url.size() / 2;
+    bool insert = true;
+    runBench(options, "overflow_text_layout_edit_long_url", 2000, [&]() {
+        // Alternately type and erase a character in the middle of the URL
+        // like TextField does
+        if(insert) {
+            overflow->replaceText(idx, idx, "x");
+            overflow->makeVisible(idx + 1);
+        } else {
+            overflow->replaceText(idx, idx + 1, "");
+            overflow->makeVisible(idx);
+        }
+        insert = !insert;
+        overflow->indexToXCoord(idx);
+        overflow->render(image);
+    });
+
+    runBench(options, "overflow_text_layout_x_to_index_long_url", 20000, [&]() {
+        overflow->xCoordToIndex(counter++ % 800);
+    });
+}
+
+void runWidgetBenches(const Options& options) {
+    shared_ptr<BenchWidgetParent> parent = BenchWidgetParent::create();
+    shared_ptr<BenchEventHandler> eventHandler = BenchEventHandler::create();
+
+    ImageSlice image = ImageSlice::createImage(1280, ControlBar::Height);
+
+    shared_ptr<ControlBar> controlBar =
+        ControlBar::create(parent, eventHandler, true);
+    controlBar->enableQualitySelector(
+        {"10", "20", "30", "40", "50", "60", "70", "80", "90", "100", "PNG"},
+        6
+    );
+    controlBar->enableClipboardButton();
+    controlBar->setAddress(longURL());
+    controlBar->setPageTitle("Example page");
+    controlBar->setViewport(image);
+    controlBar->render();
+    runPendingTasks();
+
+    runBench(options, "control_bar_render", 2000, [&]() {
+        controlBar->setViewport(image);
+        controlBar->render();
+    });
+
+    runBench(options, "control_bar_render_clean", 20000, [&]() {
+        controlBar->render();
+    });
+
+    bool loading = false;
+    runBench(options, "control_bar_set_loading_render", 5000, [&]() {
+        loading = !loading;
+        controlBar->setLoading(loading);
+        controlBar->render();
+    });
+
+    // Sweep the mouse over the control bar, which moves the hover state
+    // between the buttons and updates the cursor
+    int x = 0;
+    controlBar->sendMouseEnterEvent(0, 10);
+    runBench(options, "widget_mouse_move_routing", 100000, [&]() {
+        x = (x + 7) % image.width();
+        controlBar->sendMouseMoveEvent(x, 10);
+    });
+    runBench(options, "widget_mouse_move_routing_render", 20000, [&]() {
+        x = (x + 7) % image.width();
+        controlBar->sendMouseMoveEvent(x, 10);
+        controlBar->render();
+    });
+    controlBar->sendMouseLeaveEvent(0, 10);
+
+    ImageSlice selectorImage = ImageSlice::createImage(
+        QualitySelector::Width, QualitySelector::Height
+    );
+    shared_ptr<QualitySelector> qualitySelector = QualitySelector::create(
+        parent,
+        eventHandler,
+        vector<string>{"10", "20", "30", "40", "50", "60", "70", "80", "90", "100"},
+        5
+    );
+    qualitySelector->setViewport(selectorImage);
+    qualitySelector->render();
+    runPendingTasks();
+
+    runBench(options, "quality_selector_render", 20000, [&]() {
+        qualitySelector->setViewport(selectorImage);
+        qualitySelector->render();
+    });
+}
+
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    using namespace browservice;
+
+    Options options;
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if(arg == "--iterations-scale" && i + 1 < argc) {
+            options.iterationsScale = atof(argv[++i]);
+            if(!(options.iterationsScale > 0.0)) {
+                cerr << "Invalid iteration scale\n";
+                return 1;
+            }
+        } else if(arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--iterations-scale X] [--filter SUBSTRING]\n";
+            return 1;
+        }
+    }
+
+    // The widgets read their settings from the global config; animations are
+    // disabled so that the widgets never set up timers
+    vector<string> configArgs = {argv[0], "--ui-animations=no"};
+    vector<char*> configArgv;
+    for(string& configArg : configArgs) {
+        configArgv.push_back(&configArg[0]);
+    }
+    shared_ptr<Config> config =
+        Config::read((int)configArgv.size(), configArgv.data());
+    if(!config) {
+        return 1;
+    }
+
+    setPostTaskHandler([](function<void()> task) {
+        pendingTasks.push_back(move(task));
+    });
+    globals = Globals::create(config, false);
+
+    runImageSliceBenches(options);
+    runTextBenches(options);
+    runWidgetBenches(options);
+
+    globals.reset();
+    return 0;
+}
@@ -4,25 +4,28 @@
 
 #include "include/cef_request.h"
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <unordered_map>
 
 namespace browservice {
 
 namespace {
 
-mutex bookmarkCacheMutex;
-bool bookmarkCacheInitialized = false;
-std::map<string, uint64_t> bookmarkCache;
+const uint64_t BookmarkFileSignature = 0xBA0F5EAF1CEB00C3;
+const uint64_t JournalFileSignature = 0xBA0F5EAF1CEB00C4;
 
-// Caller needs to lock bookmarkCacheMutex
-void populateBookmarkCache(const Bookmarks& bookmarks) {
-    bookmarkCache.clear();
-    for(const auto& item : bookmarks.getData()) {
-        bookmarkCache[item.second.url] = item.first;
-    }
-    bookmarkCacheInitialized = true;
-}
+const uint64_t JournalPut = 1;
+const uint64_t JournalRemove = 2;
+
+// The journal is compacted into the bookmark file once it has at least this
+// many records and more records than there are bookmarks.
+const uint64_t MinCompactJournalRecords = 256;
 
 bool tryCreateDotDir() {
     if(mkdir(globals->dotDirPath.c_str(), 0700) == 0) {
@@ -38,242 +41,669 @@ bool tryCreateDotDir() {
     }
 }
 
-void writeLE(ofstream& fp, uint64_t val) {
-    uint8_t bytes[8];
+void writeLE(string& buf, uint64_t val) {
+    char bytes[8];
     for(int i = 0; i < 8; ++i) {
-        bytes[i] = (uint8_t)val;
+        bytes[i] = (char)(uint8_t)val;
         val >>= 8;
     }
-    fp.write((char*)bytes, 8);
+    buf.append(bytes, 8);
 }
 
-void writeStr(ofstream& fp, const string& val) {
-    writeLE(fp, val.size());
-    fp.write(val.data(), val.size());
+void writeStr(string& buf, const string& val) {
+    writeLE(buf, val.size());
+    buf.append(val);
 
     size_t padCount = (-val.size()) & (size_t)7;
-    if(padCount) {
-        char zeros[8] = {};
-        fp.write(zeros, padCount);
-    }
+    buf.append(padCount, '\0');
 }
 
-bool readLE(ifstream& fp, uint64_t& val) {
-    uint8_t bytes[8];
-    fp.read((char*)bytes, 8);
-    if(!fp.good()) {
-        return false;
-    }
-
-    val = 0;
-    for(int i = 7; i >= 0; --i) {
-        val <<= 8;
-        val |= (uint64_t)bytes[i];
-    }
-    return true;
+void writeBookmark(string& buf, uint64_t id, const Bookmark& bookmark) {
+    writeLE(buf, id);
+    writeStr(buf, bookmark.url);
+    writeStr(buf, bookmark.title);
+    writeLE(buf, bookmark.time);
 }
 
-bool readStr(ifstream& fp, string& val) {
-    uint64_t size;
-    if(!readLE(fp, size)) {
-        return false;
+// Read-only memory mapping of a whole file, parsed using the read functions.
+class MappedFile {
+public:
+    MappedFile() : data_(nullptr), size_(0), pos_(0) {}
+    ~MappedFile() {
+        if(data_ != nullptr) {
+            munmap((void*)data_, size_);
+        }
     }
+    DISABLE_COPY_MOVE(MappedFile);
 
-    size_t padCount = (-size) & (size_t)7;
-    size_t paddedSize = size + padCount;
+    // Returns false if opening or mapping the file failed.
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size_ = (size_t)st.st_size;
+        if(size_ != 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            data_ = (const char*)data;
+            madvise(data, size_, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        return true;
+    }
 
-    vector<char> buf(paddedSize);
-    fp.read(buf.data(), paddedSize);
-    if(!fp.good()) {
-        return false;
+    bool atEnd() const {
+        return pos_ == size_;
+    }
+    size_t pos() const {
+        return pos_;
     }
 
-    val.assign(buf.begin(), buf.begin() + size);
-    return true;
-}
+    bool readLE(uint64_t& val) {
+        if(size_ - pos_ < 8) {
+            return false;
+        }
+        val = 0;
+        for(int i = 7; i >= 0; --i) {
+            val <<= 8;
+            val |= (uint64_t)(uint8_t)data_[pos_ + i];
+        }
+        pos_ += 8;
+        return true;
+    }
 
-}
+    bool readStr(string& val) {
+        uint64_t size;
+        if(!readLE(size)) {
+            return false;
+        }
+        uint64_t padCount = (-size) & (uint64_t)7;
+        if(size > size_ - pos_ || padCount > size_ - pos_ - size) {
+            return false;
+        }
+        val.assign(data_ + pos_, (size_t)size);
+        pos_ += (size_t)(size + padCount);
+        return true;
+    }
 
-Bookmarks::Bookmarks(CKey) {}
+    bool readBookmark(uint64_t& id, Bookmark& bookmark) {
+        return
+            readLE(id) &&
+            readStr(bookmark.url) &&
+            readStr(bookmark.title) &&
+            readLE(bookmark.time);
+    }
 
-shared_ptr<Bookmarks> Bookmarks::load() {
-    if(!tryCreateDotDir()) {
-        ERROR_LOG(
-            "Loading bookmarks failed: "
-            "Directory '", globals->dotDirPath, "' does not exist and creating it failed"
-        );
-        return {};
+private:
+    const char* data_;
+    size_t size_;
+    size_t pos_;
+};
+
+// Identifies the version of a file by its inode, size and modification time,
+// used to detect modifications by other processes.
+struct FileStamp {
+    bool exists = false;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtimeNs;
+
+    static FileStamp get(const string& path) {
+        FileStamp ret;
+        struct stat st;
+        if(stat(path.c_str(), &st) == 0) {
+            ret.exists = true;
+            ret.dev = st.st_dev;
+            ret.ino = st.st_ino;
+            ret.size = st.st_size;
+            ret.mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        }
+        return ret;
     }
 
-    string bookmarkPath = globals->dotDirPath + "/bookmarks";
+    bool operator==(const FileStamp& other) const {
+        if(!exists || !other.exists) {
+            return exists == other.exists;
+        }
+        return
+            dev == other.dev && ino == other.ino &&
+            size == other.size && mtimeNs == other.mtimeNs;
+    }
+    bool operator!=(const FileStamp& other) const {
+        return !(*this == other);
+    }
+};
+
+// Exclusive advisory lock (flock) on an open file, released on destruction.
+class FileLock {
+public:
+    FileLock() : fd_(-1) {}
+    ~FileLock() {
+        if(fd_ != -1) {
+            flock(fd_, LOCK_UN);
+        }
+    }
+    DISABLE_COPY_MOVE(FileLock);
+
+    // Blocks until the lock on the file open as fd is taken. Returns false if
+    // locking failed.
+    bool lock(int fd) {
+        REQUIRE(fd_ == -1);
+        while(flock(fd, LOCK_EX) != 0) {
+            if(errno != EINTR) {
+                return false;
+            }
+        }
+        fd_ = fd;
+        return true;
+    }
 
-    shared_ptr<Bookmarks> ret = Bookmarks::create();
+private:
+    int fd_;
+};
+
+// The bookmarks shared by the whole process. The state consists of the
+// bookmark file (a snapshot) and the journal of changes appended after it;
+// the journal is replayed on load and periodically compacted into the
+// bookmark file. All access goes through the mutex. As several processes may
+// share the files (such as the workers in supervisor mode), the files are
+// only inspected, read and written while holding the lock on the lock file,
+// and the stamps are checked again after taking it, so that appends and
+// compactions are always based on the latest state on disk.
+class BookmarkStore {
+public:
+    BookmarkStore()
+        : lockFd_(-1), loaded_(false), journalRecords_(0), generation_(0) {}
+
+    mutex mtx;
+
+    // Returns the current bookmarks, (re)loading the files if they have not
+    // been loaded yet or another process has modified them. Returns an empty
+    // pointer and writes to log if loading failed.
+    shared_ptr<const BookmarkMap> get() {
+        FileLock lock;
+        if(!lockFiles_(lock, "Loading bookmarks failed")) {
+            return {};
+        }
+        return getLocked_();
+    }
 
-    struct stat st;
-    if(stat(bookmarkPath.c_str(), &st) == -1 && errno == ENOENT) {
-        INFO_LOG("Bookmark file '", bookmarkPath, "' does not exist, using empty set of bookmarks");
-        return ret;
+    // Incremented whenever the state returned by get() changes; only valid
+    // after a successful call to get().
+    uint64_t generation() const {
+        return generation_;
     }
 
-    auto readError = [&]() -> shared_ptr<Bookmarks> {
-        ERROR_LOG(
-            "Loading bookmarks failed: Reading file '", bookmarkPath, "' failed"
-        );
-        return {};
-    };
-    auto formatError = [&]() -> shared_ptr<Bookmarks> {
-        ERROR_LOG(
-            "Loading bookmarks failed: File '", bookmarkPath, "' has invalid format"
-        );
-        return {};
-    };
+    // Applies given changes (null bookmark for removal) and appends them to the
+    // journal. Returns false and writes to log if saving failed; in that case,
+    // the in-memory state is left unchanged.
+    bool apply(const vector<pair<uint64_t, optional<Bookmark>>>& changes) {
+        FileLock lock;
+        if(!lockFiles_(lock, "Saving bookmarks failed") || !getLocked_()) {
+            return false;
+        }
+        if(changes.empty()) {
+            return true;
+        }
 
-    ifstream fp;
-    fp.open(bookmarkPath);
-    if(!fp.good()) return readError();
+        // As the journal was checked while holding the lock, no other process
+        // can have started it in the meantime
+        string records;
+        if(!journalStamp_.exists || journalStamp_.size == 0) {
+            writeLE(records, JournalFileSignature);
+            writeLE(records, 0);
+        }
+        for(const pair<uint64_t, optional<Bookmark>>& change : changes) {
+            if(change.second.has_value()) {
+                writeLE(records, JournalPut);
+                writeBookmark(records, change.first, *change.second);
+            } else {
+                writeLE(records, JournalRemove);
+                writeLE(records, change.first);
+            }
+        }
 
-    uint64_t signature;
-    if(!readLE(fp, signature)) return readError();
-    if(signature != 0xBA0F5EAF1CEB00C3) return formatError();
+        string path = journalPath_();
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if(fd == -1 || !writeAll_(fd, records)) {
+            ERROR_LOG("Saving bookmarks failed: Could not append to journal '", path, "'");
+            if(fd != -1) {
+                close(fd);
+            }
+            // The journal may now end with a partial record, so it has to be
+            // reloaded and compacted on the next access
+            loaded_ = false;
+            return false;
+        }
+        close(fd);
+        journalStamp_ = FileStamp::get(path);
 
-    uint64_t version;
-    if(!readLE(fp, version)) return readError();
-    if(version != (uint64_t)0) return formatError();
+        // Modify the map in place if no Bookmarks object is using it
+        if(data_.use_count() != 1) {
+            data_ = make_shared<BookmarkMap>(*data_);
+        }
+        for(const pair<uint64_t, optional<Bookmark>>& change : changes) {
+            applyChange_(change.first, change.second);
+        }
+        journalRecords_ += changes.size();
+        ++generation_;
 
-    while(true) {
-        uint64_t hasNext;
-        if(!readLE(fp, hasNext)) return readError();
-        if(hasNext != (uint64_t)0 && hasNext != (uint64_t)1) return formatError();
+        if(
+            journalRecords_ >= MinCompactJournalRecords &&
+            journalRecords_ > data_->size()
+        ) {
+            compact_();
+        }
+        return true;
+    }
 
-        if(!hasNext) {
-            break;
+    // Returns the ID of a bookmark with given URL in the current state.
+    optional<uint64_t> findByURL(const string& url) {
+        if(!get()) {
+            return {};
         }
+        auto it = urlIndex_.find(url);
+        if(it == urlIndex_.end()) {
+            return {};
+        }
+        return it->second;
+    }
 
-        uint64_t id;
-        Bookmark bookmark;
-        if(!readLE(fp, id) || !readStr(fp, bookmark.url) || !readStr(fp, bookmark.title) || !readLE(fp, bookmark.time)) {
-            return readError();
+private:
+    static string bookmarkPath_() {
+        return globals->dotDirPath + "/bookmarks";
+    }
+    static string journalPath_() {
+        return globals->dotDirPath + "/bookmarks.journal";
+    }
+    static string lockPath_() {
+        return globals->dotDirPath + "/bookmarks.lock";
+    }
+
+    // Creates the directory and takes the lock on the lock file, opening the
+    // lock file if necessary. Returns false and writes to log (prefixed with
+    // errorPrefix) on failure.
+    bool lockFiles_(FileLock& lock, const char* errorPrefix) {
+        if(!tryCreateDotDir()) {
+            ERROR_LOG(
+                errorPrefix, ": "
+                "Directory '", globals->dotDirPath, "' does not exist and creating it failed"
+            );
+            return false;
         }
 
-        if(!ret->data_.emplace(id, move(bookmark)).second) {
-            return formatError();
+        string path = lockPath_();
+        if(lockFd_ == -1) {
+            lockFd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
         }
+        if(lockFd_ == -1 || !lock.lock(lockFd_)) {
+            ERROR_LOG(errorPrefix, ": Could not lock file '", path, "'");
+            if(lockFd_ != -1) {
+                close(lockFd_);
+                lockFd_ = -1;
+            }
+            return false;
+        }
+        return true;
     }
 
-    fp.close();
+    // Implementation of get() for when the lock is already held.
+    shared_ptr<const BookmarkMap> getLocked_() {
+        if(
+            !loaded_ ||
+            FileStamp::get(bookmarkPath_()) != bookmarkStamp_ ||
+            FileStamp::get(journalPath_()) != journalStamp_
+        ) {
+            if(!load_()) {
+                return {};
+            }
+        }
+        return data_;
+    }
 
-    INFO_LOG("Bookmarks successfully read from '", bookmarkPath, "'");
-    return ret;
-}
+    static bool writeAll_(int fd, const string& data) {
+        size_t pos = 0;
+        while(pos < data.size()) {
+            ssize_t count = write(fd, data.data() + pos, data.size() - pos);
+            if(count > 0) {
+                pos += (size_t)count;
+            } else if(count == -1 && errno == EINTR) {
+                continue;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
 
-bool Bookmarks::save() {
-    if(!tryCreateDotDir()) {
-        ERROR_LOG(
-            "Saving bookmarks failed: "
-            "Directory '", globals->dotDirPath, "' does not exist and creating it failed"
-        );
-        return false;
+    void applyChange_(uint64_t id, const optional<Bookmark>& bookmark) {
+        auto it = data_->find(id);
+        if(it != data_->end()) {
+            auto indexIt = urlIndex_.find(it->second.url);
+            if(indexIt != urlIndex_.end() && indexIt->second == id) {
+                urlIndex_.erase(indexIt);
+            }
+            data_->erase(it);
+        }
+        if(bookmark.has_value()) {
+            data_->emplace(id, *bookmark);
+            urlIndex_[bookmark->url] = id;
+        }
     }
 
-    string bookmarkPath = globals->dotDirPath + "/bookmarks";
+    bool load_() {
+        string bookmarkPath = bookmarkPath_();
+        string journalPath = journalPath_();
+
+        // Take the stamps before reading so that modifications made during
+        // reading are detected on the next access
+        FileStamp bookmarkStamp = FileStamp::get(bookmarkPath);
+        FileStamp journalStamp = FileStamp::get(journalPath);
+
+        data_ = make_shared<BookmarkMap>();
+        urlIndex_.clear();
+        journalRecords_ = 0;
+        loaded_ = false;
+
+        auto readError = [&](const string& path) {
+            ERROR_LOG("Loading bookmarks failed: Reading file '", path, "' failed");
+            return false;
+        };
+        auto formatError = [&](const string& path) {
+            ERROR_LOG("Loading bookmarks failed: File '", path, "' has invalid format");
+            return false;
+        };
+
+        if(!bookmarkStamp.exists && !journalStamp.exists) {
+            INFO_LOG(
+                "Bookmark file '", bookmarkPath, "' does not exist, using empty set of bookmarks"
+            );
+        }
 
-    string bookmarkTmpPath = globals->dotDirPath + "/.tmp.bookmarks.";
-    string charPalette = "abcdefghijklmnopqrstuvABCDEFGHIJKLMNOPQRSTUV0123456789";
-    for(int i = 0; i < 16; ++i) {
-        char c = charPalette[uniform_int_distribution<size_t>(0, charPalette.size() - 1)(rng)];
-        bookmarkTmpPath.push_back(c);
-    }
+        if(bookmarkStamp.exists) {
+            MappedFile fp;
+            if(!fp.open(bookmarkPath)) return readError(bookmarkPath);
+
+            uint64_t signature;
+            if(!fp.readLE(signature)) return readError(bookmarkPath);
+            if(signature != BookmarkFileSignature) return formatError(bookmarkPath);
 
-    ofstream fp;
-    fp.open(bookmarkTmpPath);
+            uint64_t version;
+            if(!fp.readLE(version)) return readError(bookmarkPath);
+            if(version != (uint64_t)0) return formatError(bookmarkPath);
 
-    // File signature
-    writeLE(fp, 0xBA0F5EAF1CEB00C3);
+            while(true) {
+                uint64_t hasNext;
+                if(!fp.readLE(hasNext)) return readError(bookmarkPath);
+                if(hasNext != (uint64_t)0 && hasNext != (uint64_t)1) {
+                    return formatError(bookmarkPath);
+                }
 
-    // Format version
-    writeLE(fp, 0);
+                if(!hasNext) {
+                    break;
+                }
 
-    for(const auto& item : data_) {
-        uint64_t id = item.first;
-        const Bookmark& bookmark = item.second;
+                uint64_t id;
+                Bookmark bookmark;
+                if(!fp.readBookmark(id, bookmark)) return readError(bookmarkPath);
 
-        // One more item
-        writeLE(fp, 1);
+                string url = bookmark.url;
+                if(!data_->emplace(id, move(bookmark)).second) {
+                    return formatError(bookmarkPath);
+                }
+                urlIndex_[move(url)] = id;
+            }
+        }
 
-        writeLE(fp, id);
-        writeStr(fp, bookmark.url);
-        writeStr(fp, bookmark.title);
-        writeLE(fp, bookmark.time);
+        // An empty journal is left behind if the first append to it failed
+        bool compactNow = false;
+        if(journalStamp.exists && journalStamp.size != 0) {
+            MappedFile fp;
+            if(!fp.open(journalPath)) return readError(journalPath);
+
+            uint64_t signature, version;
+            if(
+                !fp.readLE(signature) || signature != JournalFileSignature ||
+                !fp.readLE(version) || version != (uint64_t)0
+            ) {
+                return formatError(journalPath);
+            }
+
+            while(!fp.atEnd()) {
+                size_t recordStart = fp.pos();
+                uint64_t op, id;
+                optional<Bookmark> bookmark;
+                bool ok = fp.readLE(op);
+                if(ok && op == JournalPut) {
+                    bookmark.emplace();
+                    ok = fp.readBookmark(id, *bookmark);
+                } else if(ok && op == JournalRemove) {
+                    ok = fp.readLE(id);
+                } else if(ok) {
+                    return formatError(journalPath);
+                }
+                if(!ok) {
+                    // A write was interrupted; drop the partial record by
+                    // compacting the journal
+                    WARNING_LOG(
+                        "Ignoring partial record at offset ", recordStart,
+                        " of bookmark journal '", journalPath, "'"
+                    );
+                    compactNow = true;
+                    break;
+                }
+                applyChange_(id, bookmark);
+                ++journalRecords_;
+            }
+        }
+
+        bookmarkStamp_ = bookmarkStamp;
+        journalStamp_ = journalStamp;
+        loaded_ = true;
+        ++generation_;
+
+        if(compactNow) {
+            compact_();
+        }
+
+        INFO_LOG("Bookmarks successfully read from '", bookmarkPath, "'");
+        return true;
     }
 
-    // No more items
-    writeLE(fp, 0);
+    // Writes the current state to the bookmark file and removes the journal.
+    // If writing fails, the journal is kept, so no data is lost. Must be
+    // called while holding the lock, right after the state has been checked
+    // to be up to date with the files.
+    void compact_() {
+        string bookmarkPath = bookmarkPath_();
+
+        string bookmarkTmpPath = globals->dotDirPath + "/.tmp.bookmarks.";
+        string charPalette = "abcdefghijklmnopqrstuvABCDEFGHIJKLMNOPQRSTUV0123456789";
+        for(int i = 0; i < 16; ++i) {
+            char c = charPalette[uniform_int_distribution<size_t>(0, charPalette.size() - 1)(rng)];
+            bookmarkTmpPath.push_back(c);
+        }
+
+        string buf;
+
+        // File signature
+        writeLE(buf, BookmarkFileSignature);
 
-    fp.close();
+        // Format version
+        writeLE(buf, 0);
+
+        for(const auto& item : *data_) {
+            // One more item
+            writeLE(buf, 1);
+            writeBookmark(buf, item.first, item.second);
+        }
 
-    if(!fp.good()) {
-        ERROR_LOG(
-            "Saving bookmarks failed: "
-            "Could not write temporary file '", bookmarkTmpPath, "'"
+        // No more items
+        writeLE(buf, 0);
+
+        int fd = open(
+            bookmarkTmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600
         );
-        return false;
+        bool ok = fd != -1 && writeAll_(fd, buf);
+        if(fd != -1 && close(fd) != 0) {
+            ok = false;
+        }
+        if(!ok) {
+            ERROR_LOG(
+                "Compacting bookmarks failed: "
+                "Could not write temporary file '", bookmarkTmpPath, "'"
+            );
+            unlink(bookmarkTmpPath.c_str());
+            return;
+        }
+
+        if(rename(bookmarkTmpPath.c_str(), bookmarkPath.c_str()) != 0) {
+            ERROR_LOG(
+                "Compacting bookmarks failed: "
+                "Renaming temporary file '", bookmarkTmpPath, "' to '", bookmarkPath, "' failed"
+            );
+            unlink(bookmarkTmpPath.c_str());
+            return;
+        }
+
+        // Replaying the journal on top of the new bookmark file would be
+        // harmless, so a failure here does not lose data
+        string journalPath = journalPath_();
+        if(unlink(journalPath.c_str()) != 0 && errno != ENOENT) {
+            WARNING_LOG("Removing bookmark journal '", journalPath, "' failed");
+        }
+
+        bookmarkStamp_ = FileStamp::get(bookmarkPath);
+        journalStamp_ = FileStamp::get(journalPath);
+        journalRecords_ = 0;
+
+        INFO_LOG("Bookmarks successfully written to '", bookmarkPath, "'");
     }
 
-    if(rename(bookmarkTmpPath.c_str(), bookmarkPath.c_str()) != 0) {
-        ERROR_LOG(
-            "Saving bookmarks failed: "
-            "Renaming temporary file '", bookmarkTmpPath, "' to '", bookmarkPath, "' failed"
-        );
-        unlink(bookmarkTmpPath.c_str());
-        return false;
+    int lockFd_;
+    bool loaded_;
+    FileStamp bookmarkStamp_;
+    FileStamp journalStamp_;
+    uint64_t journalRecords_;
+    uint64_t generation_;
+
+    shared_ptr<BookmarkMap> data_;
+    std::unordered_map<string, uint64_t> urlIndex_;
+};
+
+BookmarkStore bookmarkStore;
+
+}
+
+Bookmarks::Bookmarks(CKey) : baseGeneration_(0) {}
+
+shared_ptr<Bookmarks> Bookmarks::load() {
+    shared_ptr<const BookmarkMap> data;
+    uint64_t generation;
+    {
+        lock_guard<mutex> lock(bookmarkStore.mtx);
+        data = bookmarkStore.get();
+        generation = bookmarkStore.generation();
+    }
+    if(!data) {
+        return {};
     }
 
-    INFO_LOG("Bookmarks successfully written to '", bookmarkPath, "'");
+    shared_ptr<Bookmarks> ret = Bookmarks::create();
+    ret->base_ = data;
+    ret->baseGeneration_ = generation;
+    return ret;
+}
 
+bool Bookmarks::save() {
+    shared_ptr<const BookmarkMap> data;
+    uint64_t generation;
     {
-        lock_guard lock(bookmarkCacheMutex);
-        populateBookmarkCache(*this);
+        lock_guard<mutex> lock(bookmarkStore.mtx);
+        if(!bookmarkStore.apply(changes_)) {
+            return false;
+        }
+        data = bookmarkStore.get();
+        generation = bookmarkStore.generation();
+    }
+    if(!data) {
+        return false;
     }
 
+    base_ = data;
+    baseGeneration_ = generation;
+    changes_.clear();
+    view_.reset();
     return true;
 }
 
-const map<uint64_t, Bookmark>& Bookmarks::getData() const {
-    return data_;
+const BookmarkMap& Bookmarks::getData() const {
+    if(changes_.empty()) {
+        return *base_;
+    }
+    if(!view_) {
+        shared_ptr<BookmarkMap> view = make_shared<BookmarkMap>(*base_);
+        for(const pair<uint64_t, optional<Bookmark>>& change : changes_) {
+            view->erase(change.first);
+            if(change.second.has_value()) {
+                view->emplace(change.first, *change.second);
+            }
+        }
+        view_ = view;
+    }
+    return *view_;
+}
+
+optional<uint64_t> Bookmarks::generation() const {
+    optional<uint64_t> empty;
+    if(changes_.empty()) {
+        return baseGeneration_;
+    } else {
+        return empty;
+    }
 }
 
 uint64_t Bookmarks::putBookmark(Bookmark bookmark) {
     uint64_t id;
-    do {
+    while(true) {
         id = uniform_int_distribution<uint64_t>()(rng);
-    } while(data_.count(id));
+        if(base_->count(id)) {
+            continue;
+        }
+        bool usedInChanges = false;
+        for(const pair<uint64_t, optional<Bookmark>>& change : changes_) {
+            if(change.first == id) {
+                usedInChanges = true;
+            }
+        }
+        if(!usedInChanges) {
+            break;
+        }
+    }
 
-    data_.emplace(id, move(bookmark));
+    changes_.emplace_back(id, move(bookmark));
+    view_.reset();
     return id;
 }
 
 void Bookmarks::removeBookmark(uint64_t id) {
-    data_.erase(id);
+    changes_.emplace_back(id, optional<Bookmark>());
+    view_.reset();
 }
 
 optional<uint64_t> getCachedBookmarkIDByURL(string url) {
-    lock_guard lock(bookmarkCacheMutex);
-    if(!bookmarkCacheInitialized) {
-        shared_ptr<Bookmarks> bookmarks = Bookmarks::load();
-        if(bookmarks) {
-            populateBookmarkCache(*bookmarks);
-        } else {
-            bookmarkCache.clear();
-            bookmarkCacheInitialized = true;
-        }
-    }
-    auto it = bookmarkCache.find(url);
-    if(it == bookmarkCache.end()) {
-        optional<uint64_t> empty;
-        return empty;
-    } else {
-        return it->second;
-    }
+    lock_guard<mutex> lock(bookmarkStore.mtx);
+    return bookmarkStore.findByURL(url);
 }
 
 namespace {
@@ -330,9 +760,116 @@ void parseSelectedBookmarks(string formData, std::set<uint64_t>& selectedBookmar
     }
 }
 
+const char* BookmarksPageHeader =
+    "<!DOCTYPE html>\n<html lang=\"en\"><head><meta charset=\"UTF-8\">"
+    "<title>Bookmarks</title></head><body>\n"
+    "<h1>Bookmarks</h1>\n"
+    "<form action=\"browservice:bookmarks\" method=\"POST\">\n";
+const char* BookmarksPageFooter =
+    "</form>\n"
+    "</body></html>\n";
+
+string renderBookmarkRow(uint64_t id, const Bookmark& bookmark) {
+    string row = "<p style=\"margin-bottom:3px; margin-top:3px;\">\n";
+    row +=
+        "<input type=\"checkbox\" id=\"bookmark" + toString(id) + "\" "
+        "name=\"bookmark" + toString(id) + "\">\n";
+    row += "<label for=\"bookmark" + toString(id) + "\">\n";
+    row +=
+        "<a href=\"" + htmlEscapeString(bookmark.url) + "\">" +
+        htmlEscapeString(bookmark.title) + "</a>\n";
+    row += "</label>\n";
+    row += "</p>\n";
+    return row;
+}
+
+// The last rendered bookmarks page along with the rendered rows, so that when
+// the bookmarks change, only the rows of the changed bookmarks have to be
+// rendered again. Only accessed from the CEF IO thread.
+struct BookmarksPageCache {
+    struct Row {
+        Bookmark bookmark;
+        string html;
+    };
+
+    optional<uint64_t> generation;
+    map<uint64_t, Row> rows;
+    shared_ptr<const string> page;
+    string etag;
+};
+
+BookmarksPageCache bookmarksPageCache;
+
+// Identifies this process in the ETags, as the generations start from zero
+// in every process.
+uint64_t etagNonce() {
+    static uint64_t nonce = uniform_int_distribution<uint64_t>()(rng);
+    return nonce;
 }
 
-string handleBookmarksRequest(CefRefPtr<CefRequest> request) {
+void updateBookmarksPageCache(const BookmarkMap& data, uint64_t generation) {
+    BookmarksPageCache& cache = bookmarksPageCache;
+    if(cache.generation == generation) {
+        return;
+    }
+
+    map<uint64_t, BookmarksPageCache::Row> rows;
+    for(const auto& item : data) {
+        uint64_t id = item.first;
+        const Bookmark& bookmark = item.second;
+
+        auto it = cache.rows.find(id);
+        if(
+            it != cache.rows.end() &&
+            it->second.bookmark.url == bookmark.url &&
+            it->second.bookmark.title == bookmark.title
+        ) {
+            it->second.bookmark.time = bookmark.time;
+            rows.emplace(id, move(it->second));
+        } else {
+            rows.emplace(id, BookmarksPageCache::Row {
+                bookmark, renderBookmarkRow(id, bookmark)
+            });
+        }
+    }
+
+    vector<const BookmarksPageCache::Row*> items;
+    size_t pageSize = strlen(BookmarksPageHeader) + strlen(BookmarksPageFooter) + 64;
+    for(const auto& item : rows) {
+        items.push_back(&item.second);
+        pageSize += item.second.html.size();
+    }
+    sort(
+        items.begin(), items.end(),
+        [](const BookmarksPageCache::Row* a, const BookmarksPageCache::Row* b) {
+            return
+                make_tuple(a->bookmark.time, a->bookmark.title, a->bookmark.url) <
+                make_tuple(b->bookmark.time, b->bookmark.title, b->bookmark.url);
+        }
+    );
+
+    shared_ptr<string> page = make_shared<string>();
+    page->reserve(pageSize);
+    page->append(BookmarksPageHeader);
+    for(const BookmarksPageCache::Row* item : items) {
+        page->append(item->html);
+    }
+    if(items.empty()) {
+        page->append("<p>You have no bookmarks</p>\n");
+    } else {
+        page->append("<p><input type=\"submit\" value=\"Remove selected\"></p>\n");
+    }
+    page->append(BookmarksPageFooter);
+
+    cache.generation = generation;
+    cache.rows = move(rows);
+    cache.page = page;
+    cache.etag = "\"" + toString(etagNonce()) + "-" + toString(generation) + "\"";
+}
+
+}
+
+BookmarksResponse handleBookmarksRequest(CefRefPtr<CefRequest> request) {
     CEF_REQUIRE_IO_THREAD();
 
     shared_ptr<Bookmarks> bookmarks = Bookmarks::load();
@@ -357,59 +894,30 @@ string handleBookmarksRequest(CefRefPtr<CefRequest> request) {
             for(uint64_t id : selectedBookmarks) {
                 bookmarks->removeBookmark(id);
             }
-            bookmarks->save();
+            if(!bookmarks->save()) {
+                // Show the bookmarks without the unsaved removals
+                bookmarks = Bookmarks::load();
+            }
         }
     }
 
-    string page =
-        "<!DOCTYPE html>\n<html lang=\"en\"><head><meta charset=\"UTF-8\">"
-        "<title>Bookmarks</title></head><body>\n"
-        "<h1>Bookmarks</h1>\n"
-        "<form action=\"browservice:bookmarks\" method=\"POST\">\n";
-
     if(bookmarks) {
-        const map<uint64_t, Bookmark>& bookmarkData = bookmarks->getData();
-        vector<const pair<const uint64_t, Bookmark>*> items;
-        for(const auto& item : bookmarkData) {
-            items.push_back(&item);
-        }
-        sort(
-            items.begin(), items.end(),
-            [](
-                const pair<const uint64_t, Bookmark>* a,
-                const pair<const uint64_t, Bookmark>* b
-            ) {
-                return
-                    make_tuple(a->second.time, a->second.title, a->second.url) <
-                    make_tuple(b->second.time, b->second.title, b->second.url);
-            }
-        );
-        for(const auto* item : items) {
-            uint64_t id = item->first;
-            const Bookmark& bookmark = item->second;
-            page += "<p style=\"margin-bottom:3px; margin-top:3px;\">\n";
-            page +=
-                "<input type=\"checkbox\" id=\"bookmark" + toString(id) + "\" "
-                "name=\"bookmark" + toString(id) + "\">\n";
-            page += "<label for=\"bookmark" + toString(id) + "\">\n";
-            page +=
-                "<a href=\"" + htmlEscapeString(bookmark.url) + "\">" +
-                htmlEscapeString(bookmark.title) + "</a>\n";
-            page += "</label>\n";
-            page += "</p>\n";
-        }
-        if(items.empty()) {
-            page += "<p>You have no bookmarks</p>\n";
-        } else {
-            page += "<p><input type=\"submit\" value=\"Remove selected\"></p>\n";
+        optional<uint64_t> generation = bookmarks->generation();
+        REQUIRE(generation.has_value());
+        updateBookmarksPageCache(bookmarks->getData(), *generation);
+
+        BookmarksPageCache& cache = bookmarksPageCache;
+        string ifNoneMatch = request->GetHeaderByName("If-None-Match");
+        if(request->GetMethod() == "GET" && ifNoneMatch == cache.etag) {
+            return {304, "Not Modified", cache.etag, make_shared<string>()};
         }
+        return {200, "OK", cache.etag, cache.page};
     } else {
+        string page = BookmarksPageHeader;
         page += "<p style=\"color:#FF0000;\">Loading bookmarks failed (see log)</p>\n";
+        page += BookmarksPageFooter;
+        return {200, "OK", "", make_shared<string>(move(page))};
     }
-
-    page += "</form>\n";
-    page += "</body></html>\n";
-    return page;
 }
 
 }
@@ -12,31 +12,69 @@ struct Bookmark {
     uint64_t time;
 };
 
+typedef map<uint64_t, Bookmark> BookmarkMap;
+
+// A view of the bookmarks of the process. The bookmarks are kept in memory,
+// shared by all the Bookmarks objects; on disk, they are stored as a bookmark
+// file and an append-only journal of the changes made after it was written,
+// which is compacted into the bookmark file once it grows large enough.
+// Processes sharing the files (such as the workers in supervisor mode)
+// serialize their access using the lock file bookmarks.lock.
 class Bookmarks {
 SHARED_ONLY_CLASS(Bookmarks);
 public:
     Bookmarks(CKey);
 
-    // Returns empty pointer and writes to log if loading failed
+    // Returns empty pointer and writes to log if loading failed. The files are
+    // only read on the first call and if another process has modified them.
     static shared_ptr<Bookmarks> load();
 
-    // Returns false and writes to log if saving failed
+    // Appends the changes made using putBookmark and removeBookmark to the
+    // journal and applies them to the shared bookmarks, after which this
+    // object reflects the shared state. Returns false and writes to log if
+    // saving failed.
     bool save();
 
-    const map<uint64_t, Bookmark>& getData() const;
+    const BookmarkMap& getData() const;
+
+    // Identifies the state returned by getData among the states of the
+    // bookmarks during the lifetime of the process. Returns an empty optional
+    // if there are unsaved changes.
+    optional<uint64_t> generation() const;
 
     uint64_t putBookmark(Bookmark bookmark);
     void removeBookmark(uint64_t id);
 
 private:
-    map<uint64_t, Bookmark> data_;
+    // The state when loaded or last saved, and the changes made after that
+    // (an empty bookmark denotes a removal).
+    shared_ptr<const BookmarkMap> base_;
+    uint64_t baseGeneration_;
+    vector<pair<uint64_t, optional<Bookmark>>> changes_;
+
+    // base_ with changes_ applied, created on demand by getData.
+    mutable shared_ptr<const BookmarkMap> view_;
 };
 
 // Returns the bookmark ID if given url is bookmarked in the last state saved
 // using Bookmarks::save, or if no bookmarks have yet been saved, the state
-// loaded on the first call to this function. Safe to call from any thread.
+// loaded from the files. Looked up from an in-memory index shared by all
+// windows. Safe to call from any thread.
 optional<uint64_t> getCachedBookmarkIDByURL(string url);
 
-string handleBookmarksRequest(CefRefPtr<CefRequest> request);
+struct BookmarksResponse {
+    int status;
+    string statusText;
+
+    // Empty if the response may not be cached.
+    string etag;
+
+    shared_ptr<const string> body;
+};
+
+// Handles a request to browservice:bookmarks. The page is cached until the
+// bookmarks change, and as long as the client has the current version (as
+// identified by the ETag), responds with 304 Not Modified.
+BookmarksResponse handleBookmarksRequest(CefRefPtr<CefRequest> request);
 
 }
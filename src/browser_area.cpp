@@ -1,6 +1,8 @@
 #include "browser_area.hpp"
 
+#include "globals.hpp"
 #include "key.hpp"
+#include "probe.hpp"
 #include "text.hpp"
 
 #include "include/cef_render_handler.h"
@@ -9,10 +11,21 @@ namespace browservice {
 
 namespace {
 
-CefMouseEvent createMouseEvent(int x, int y, uint32_t eventModifiers) {
+// Conversions between viewport pixels and the device-independent pixels of
+// CEF at given render scale (in percent).
+int pixelsToDIP(int val, int scale) {
+    return (val * 100 + scale / 2) / scale;
+}
+int dipToPixels(int val, int scale) {
+    return (val * scale + 50) / 100;
+}
+
+CefMouseEvent createMouseEvent(
+    int x, int y, uint32_t eventModifiers, int scale
+) {
     CefMouseEvent event;
-    event.x = x;
-    event.y = y;
+    event.x = pixelsToDIP(x, scale);
+    event.y = pixelsToDIP(y, scale);
     event.modifiers = eventModifiers;
     return event;
 }
@@ -103,7 +116,8 @@ public:
         int width = max(min(viewport.width(), 4096), 64);
         int height = max(min(viewport.height(), 4096), 64);
 
-        rect.Set(0, 0, width, height);
+        int scale = browserArea_->renderScale_;
+        rect.Set(0, 0, pixelsToDIP(width, scale), pixelsToDIP(height, scale));
     }
 
     virtual bool GetScreenInfo(CefRefPtr<CefBrowser> browser, CefScreenInfo& info) override {
@@ -112,39 +126,78 @@ public:
         CefRect rect;
         GetViewRect(browser, rect);
 
-        info.device_scale_factor = 1.0;
+        info.device_scale_factor = (float)browserArea_->renderScale_ / 100.0f;
         info.rect = rect;
         info.available_rect = rect;
 
         return true;
     }
 
-    virtual void OnPopupShow(CefRefPtr<CefBrowser> browser, bool show) override {
+    virtual void OnPopupShow(CefRefPtr<CefBrowser>, bool show) override {
         REQUIRE_UI_THREAD();
 
-        browserArea_->popupOpen_ = show;
+        Rect oldRect = browserArea_->popupRect_;
 
-        if(show) {
-            browserArea_->popupRect_ = Rect();
-        } else {
-            browser->GetHost()->Invalidate(PET_VIEW);
+        browserArea_->popupOpen_ = show;
+        browserArea_->popupRect_ = Rect();
+        browserArea_->popupLayer_ = ImageSlice();
+
+        if(!show) {
+            // Restore the view underneath the popup from the underlay
+            ImageSlice viewport = browserArea_->getViewport();
+            TileBitmap changedTiles = createTileBitmap_(viewport);
+            restoreUnderlay_(viewport, changedTiles, oldRect, Rect());
+            postChangedTiles_(move(changedTiles));
         }
     }
 
     virtual void OnPopupSize(CefRefPtr<CefBrowser> browser, const CefRect& rect) override {
         REQUIRE_UI_THREAD();
 
-        browserArea_->popupRect_ = Rect(
-            rect.x,
-            rect.x + rect.width,
-            rect.y,
-            rect.y + rect.height
+        int scale = browserArea_->renderScale_;
+        Rect oldRect = browserArea_->popupRect_;
+        Rect newRect = Rect(
+            dipToPixels(rect.x, scale),
+            dipToPixels(rect.x + rect.width, scale),
+            dipToPixels(rect.y, scale),
+            dipToPixels(rect.y + rect.height, scale)
         );
+        browserArea_->popupRect_ = newRect;
 
-        if(browserArea_->popupOpen_) {
-            browser->GetHost()->Invalidate(PET_VIEW);
+        if(!browserArea_->popupOpen_) {
+            return;
+        }
+
+        ImageSlice viewport = browserArea_->getViewport();
+        TileBitmap changedTiles = createTileBitmap_(viewport);
+        restoreUnderlay_(viewport, changedTiles, oldRect, newRect);
+
+        // If only the position of the popup changed, we can draw the saved
+        // popup layer to the new position; otherwise we need a new paint for
+        // the popup (but not for the view).
+        ImageSlice& layer = browserArea_->popupLayer_;
+        if(
+            !layer.isEmpty() &&
+            layer.width() == newRect.endX - newRect.startX &&
+            layer.height() == newRect.endY - newRect.startY
+        ) {
+            if(!browserArea_->errorActive_) {
+                copyToViewport_(
+                    viewport,
+                    changedTiles,
+                    layer.buf(),
+                    layer.pitch(),
+                    newRect.startX,
+                    newRect.startY,
+                    newRect,
+                    Rect()
+                );
+            }
+        } else {
             browser->GetHost()->Invalidate(PET_POPUP);
         }
+
+        postChangedTiles_(move(changedTiles));
     }
 
     virtual void OnPaint(
@@ -156,87 +209,212 @@ public:
         int bufHeight
     ) override {
         REQUIRE_UI_THREAD();
+        PROBE(paint, (int)type, bufWidth, bufHeight, dirtyRects.size());
+
+        const uint8_t* src = (const uint8_t*)buffer;
+
+        // The view is stored to the underlay and the popup to the popup layer
+        // in full, so that the view under the popup can be restored and the
+        // popup can be moved without repainting.
+        ImageSlice* layer;
+        if(type == PET_VIEW) {
+            layer = &browserArea_->viewUnderlay_;
+        } else if(type == PET_POPUP && browserArea_->popupOpen_) {
+            layer = &browserArea_->popupLayer_;
+        } else {
+            return;
+        }
+        if(layer->width() != bufWidth || layer->height() != bufHeight) {
+            *layer = ImageSlice::createImage(bufWidth, bufHeight);
+            copyToLayer_(*layer, src, Rect(0, bufWidth, 0, bufHeight));
+        } else {
+            for(const CefRect& dirtyRect : dirtyRects) {
+                copyToLayer_(*layer, src, Rect(
+                    dirtyRect.x,
+                    dirtyRect.x + dirtyRect.width,
+                    dirtyRect.y,
+                    dirtyRect.y + dirtyRect.height
+                ));
+            }
+        }
 
         ImageSlice viewport = browserArea_->getViewport();
-        bool updated = false;
+        TileBitmap changedTiles = createTileBitmap_(viewport);
 
         if(browserArea_->errorActive_) {
             viewport.fill(0, viewport.width(), 0, viewport.height(), 255);
             browserArea_->errorLayout_->render(
                 viewport.splitY(20).first, 7, 0, 96, 0, 0
             );
-            updated = true;
+            changedTiles.markRect(Rect(
+                viewport.globalX(), viewport.globalX() + viewport.width(),
+                viewport.globalY(), viewport.globalY() + viewport.height()
+            ));
         } else {
             int offsetX = 0;
             int offsetY = 0;
-
-            Rect bounds(0, viewport.width(), 0, viewport.height());
             Rect cutout;
 
             if(type == PET_VIEW) {
                 if(browserArea_->popupOpen_) {
                     cutout = browserArea_->popupRect_;
                 }
-            } else if(type == PET_POPUP && browserArea_->popupOpen_) {
+            } else {
                 offsetX = browserArea_->popupRect_.startX;
                 offsetY = browserArea_->popupRect_.startY;
+            }
 
+            Rect bounds = Rect::translate(
+                Rect(0, bufWidth, 0, bufHeight), offsetX, offsetY
+            );
+            if(type == PET_POPUP) {
                 bounds = Rect::intersection(bounds, browserArea_->popupRect_);
-                bounds = Rect::translate(bounds, -offsetX, -offsetY);
-            } else {
-                return;
             }
 
-            auto copyRange = [&](int y, int ax, int bx) {
-                if(ax >= bx) {
-                    return;
-                }
-
-                uint8_t* src = &((uint8_t*)buffer)[4 * (y * bufWidth + ax)];
-                uint8_t* dest = viewport.getPixelPtr(ax + offsetX, y + offsetY);
-                int byteCount = 4 * (bx - ax);
-
-                if(updated) {
-                    memcpy(dest, src, byteCount);
-                } else {
-                    if(memcmp(src, dest, byteCount)) {
-                        updated = true;
-                        memcpy(dest, src, byteCount);
-                    }
-                }
-            };
-
             for(const CefRect& dirtyRect : dirtyRects) {
-                Rect rect = Rect(
-                    dirtyRect.x,
-                    dirtyRect.x + dirtyRect.width,
-                    dirtyRect.y,
-                    dirtyRect.y + dirtyRect.height
+                Rect rect = Rect::translate(
+                    Rect(
+                        dirtyRect.x,
+                        dirtyRect.x + dirtyRect.width,
+                        dirtyRect.y,
+                        dirtyRect.y + dirtyRect.height
+                    ),
+                    offsetX,
+                    offsetY
+                );
+                copyToViewport_(
+                    viewport,
+                    changedTiles,
+                    src,
+                    bufWidth,
+                    offsetX,
+                    offsetY,
+                    Rect::intersection(rect, bounds),
+                    cutout
                 );
-                rect = Rect::intersection(rect, bounds);
-
-                if(!rect.isEmpty()) {
-                    for(int y = rect.startY; y < rect.endY; ++y) {
-                        if(y >= cutout.startY && y < cutout.endY) {
-                            copyRange(y, rect.startX, min(rect.endX, cutout.startX));
-                            copyRange(y, max(rect.startX, cutout.endX), rect.endX);
-                        } else {
-                            copyRange(y, rect.startX, rect.endX);
-                        }
-                    }
-                }
             }
         }
 
-        if(updated) {
+        postChangedTiles_(move(changedTiles));
+    }
+
+private:
+    static TileBitmap createTileBitmap_(ImageSlice viewport) {
+        return TileBitmap(
+            viewport.globalX() + viewport.width(),
+            viewport.globalY() + viewport.height()
+        );
+    }
+
+    void postChangedTiles_(TileBitmap changedTiles) {
+        if(!changedTiles.isEmpty()) {
             postTask(
                 browserArea_->eventHandler_,
-                &BrowserAreaEventHandler::onBrowserAreaViewDirty
+                &BrowserAreaEventHandler::onBrowserAreaViewDirty,
+                move(changedTiles)
             );
         }
     }
 
-private:
+    // Copies given rectangle of the CEF paint buffer src (of the same size as
+    // layer) to layer.
+    static void copyToLayer_(ImageSlice layer, const uint8_t* src, Rect rect) {
+        rect = Rect::intersection(
+            rect, Rect(0, layer.width(), 0, layer.height())
+        );
+        for(int y = rect.startY; y < rect.endY; ++y) {
+            memcpy(
+                layer.getPixelPtr(rect.startX, y),
+                &src[4 * (y * layer.width() + rect.startX)],
+                4 * (rect.endX - rect.startX)
+            );
+        }
+    }
+
+    // Copies given rectangle (in viewport coordinates) of the view underlay
+    // except for the pixels in cutout to the viewport.
+    void restoreUnderlay_(
+        ImageSlice viewport,
+        TileBitmap& changedTiles,
+        Rect rect,
+        Rect cutout
+    ) {
+        if(browserArea_->errorActive_) {
+            return;
+        }
+        ImageSlice& underlay = browserArea_->viewUnderlay_;
+        copyToViewport_(
+            viewport,
+            changedTiles,
+            underlay.buf(),
+            underlay.pitch(),
+            0,
+            0,
+            Rect::intersection(
+                rect, Rect(0, underlay.width(), 0, underlay.height())
+            ),
+            cutout
+        );
+    }
+
+    // Copies the pixels in rect (in viewport coordinates) except for those in
+    // cutout to the viewport from the image src with given pitch, in which
+    // the pixel (x - offsetX, y - offsetY) corresponds to the viewport pixel
+    // (x, y). The copy is done one tile at a time, marking the tiles in which
+    // the pixels change; once a tile has been marked, the rest of it is copied
+    // without comparison.
+    static void copyToViewport_(
+        ImageSlice viewport,
+        TileBitmap& changedTiles,
+        const uint8_t* src,
+        int srcPitch,
+        int offsetX,
+        int offsetY,
+        Rect rect,
+        Rect cutout
+    ) {
+        rect = Rect::intersection(
+            rect, Rect(0, viewport.width(), 0, viewport.height())
+        );
+        if(rect.isEmpty()) {
+            return;
+        }
+
+        int globalX = viewport.globalX();
+        int globalY = viewport.globalY();
+
+        auto copyRange = [&](int y, int ax, int bx) {
+            int ty = (y + globalY) / TileBitmap::TileSize;
+            int x = ax;
+            while(x < bx) {
+                int tx = (x + globalX) / TileBitmap::TileSize;
+                int endX = min(bx, TileBitmap::TileSize * (tx + 1) - globalX);
+
+                const uint8_t* srcPos =
+                    &src[4 * ((y - offsetY) * srcPitch + (x - offsetX))];
+                uint8_t* dest = viewport.getPixelPtr(x, y);
+                int byteCount = 4 * (endX - x);
+
+                if(changedTiles.tile(tx, ty)) {
+                    memcpy(dest, srcPos, byteCount);
+                } else if(ImageSlice::compareAndCopy(dest, srcPos, byteCount)) {
+                    changedTiles.markTile(tx, ty);
+                }
+
+                x = endX;
+            }
+        };
+
+        for(int y = rect.startY; y < rect.endY; ++y) {
+            if(y >= cutout.startY && y < cutout.endY) {
+                copyRange(y, rect.startX, min(rect.endX, cutout.startX));
+                copyRange(y, max(rect.startX, cutout.endX), rect.endX);
+            } else {
+                copyRange(y, rect.startX, rect.endX);
+            }
+        }
+    }
+
     shared_ptr<BrowserArea> browserArea_;
 
     IMPLEMENT_REFCOUNTING(RenderHandler);
@@ -250,6 +428,7 @@ BrowserArea::BrowserArea(CKey,
 {
     REQUIRE_UI_THREAD();
     eventHandler_ = eventHandler;
+    renderScale_ = globals->config->pageZoom;
     popupOpen_ = false;
     eventModifiers_ = 0;
     errorActive_ = false;
@@ -269,6 +448,12 @@ void BrowserArea::setBrowser(CefRefPtr<CefBrowser> browser) {
 
     if(browser_) {
         browser_->GetHost()->WasResized();
+    } else {
+        // The layers are repainted by the next browser
+        popupOpen_ = false;
+        popupRect_ = Rect();
+        viewUnderlay_ = ImageSlice();
+        popupLayer_ = ImageSlice();
     }
 }
 
@@ -280,7 +465,8 @@ void BrowserArea::refreshStatusEvents() {
 
     int x, y;
     tie(x, y) = getLastMousePos_();
-    CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+    CefMouseEvent event =
+        createMouseEvent(x, y, eventModifiers_, renderScale_);
     browser_->GetHost()->SendMouseMoveEvent(event, !isMouseOver_());
 }
 
@@ -313,6 +499,28 @@ void BrowserArea::setCursor(int cursor) {
     setCursor_(cursor);
 }
 
+int BrowserArea::renderScale() {
+    REQUIRE_UI_THREAD();
+    return renderScale_;
+}
+
+void BrowserArea::setRenderScale(int scale) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(scale > 0);
+
+    if(scale == renderScale_) {
+        return;
+    }
+    renderScale_ = scale;
+
+    if(browser_) {
+        browser_->GetHost()->NotifyScreenInfoChanged();
+        browser_->GetHost()->WasResized();
+        browser_->GetHost()->Invalidate(PET_VIEW);
+        browser_->GetHost()->Invalidate(PET_POPUP);
+    }
+}
+
 void BrowserArea::widgetViewportUpdated_() {
     REQUIRE_UI_THREAD();
 
@@ -331,7 +539,8 @@ void BrowserArea::widgetMouseDownEvent_(int x, int y, int button) {
     tie(buttonType, buttonFlag) = getMouseButtonInfo(button);
 
     if(browser_) {
-        CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+        CefMouseEvent event =
+            createMouseEvent(x, y, eventModifiers_, renderScale_);
         browser_->GetHost()->SendMouseClickEvent(event, buttonType, false, 1);
     }
 
@@ -346,7 +555,8 @@ void BrowserArea::widgetMouseUpEvent_(int x, int y, int button) {
     tie(buttonType, buttonFlag) = getMouseButtonInfo(button);
 
     if(browser_) {
-        CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+        CefMouseEvent event =
+            createMouseEvent(x, y, eventModifiers_, renderScale_);
         browser_->GetHost()->SendMouseClickEvent(event, buttonType, true, 1);
     }
 
@@ -357,7 +567,8 @@ void BrowserArea::widgetMouseDoubleClickEvent_(int x, int y) {
     REQUIRE_UI_THREAD();
     if(!browser_) return;
 
-    CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+    CefMouseEvent event =
+        createMouseEvent(x, y, eventModifiers_, renderScale_);
     browser_->GetHost()->SendMouseClickEvent(event, MBT_LEFT, false, 2);
     browser_->GetHost()->SendMouseClickEvent(event, MBT_LEFT, true, 2);
 }
@@ -366,7 +577,8 @@ void BrowserArea::widgetMouseWheelEvent_(int x, int y, int delta) {
     REQUIRE_UI_THREAD();
     if(!browser_) return;
 
-    CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+    CefMouseEvent event =
+        createMouseEvent(x, y, eventModifiers_, renderScale_);
     browser_->GetHost()->SendMouseWheelEvent(event, 0, delta);
 }
 
@@ -374,7 +586,8 @@ void BrowserArea::widgetMouseMoveEvent_(int x, int y) {
     REQUIRE_UI_THREAD();
     if(!browser_) return;
 
-    CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+    CefMouseEvent event =
+        createMouseEvent(x, y, eventModifiers_, renderScale_);
     browser_->GetHost()->SendMouseMoveEvent(event, false);
 }
 
@@ -382,7 +595,8 @@ void BrowserArea::widgetMouseEnterEvent_(int x, int y) {
     REQUIRE_UI_THREAD();
     if(!browser_) return;
 
-    CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+    CefMouseEvent event =
+        createMouseEvent(x, y, eventModifiers_, renderScale_);
     browser_->GetHost()->SendMouseMoveEvent(event, false);
 }
 
@@ -390,7 +604,8 @@ void BrowserArea::widgetMouseLeaveEvent_(int x, int y) {
     REQUIRE_UI_THREAD();
     if(!browser_) return;
 
-    CefMouseEvent event = createMouseEvent(x, y, eventModifiers_);
+    CefMouseEvent event =
+        createMouseEvent(x, y, eventModifiers_, renderScale_);
     browser_->GetHost()->SendMouseMoveEvent(event, true);
 }
 
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "rect.hpp"
+#include "tile_bitmap.hpp"
 #include "widget.hpp"
 
 class CefBrowser;
@@ -10,7 +10,9 @@ namespace browservice {
 
 class BrowserAreaEventHandler {
 public:
-    virtual void onBrowserAreaViewDirty() = 0;
+    // dirtyTiles contains the changed tiles of the viewport image buffer (in
+    // its global coordinates).
+    virtual void onBrowserAreaViewDirty(TileBitmap dirtyTiles) = 0;
 };
 
 class TextLayout;
@@ -52,6 +54,14 @@ public:
     // Notify the browser area that the browser has changed the cursor type.
     void setCursor(int cursor);
 
+    // The device scale factor of the browser in percent, used to implement
+    // page zoom (initially the page-zoom option, 100 by default). The browser
+    // lays out the page in a view of (viewport size) * 100 / scale
+    // device-independent pixels and paints it at the scale, so that the paint
+    // still covers the viewport; the mouse events are mapped accordingly.
+    int renderScale();
+    void setRenderScale(int scale);
+
 private:
     class RenderHandler;
 
@@ -72,9 +82,20 @@ private:
     weak_ptr<BrowserAreaEventHandler> eventHandler_;
     CefRefPtr<CefBrowser> browser_;
 
+    int renderScale_;
+
     bool popupOpen_;
+
+    // In viewport pixels (CEF gives it in device-independent pixels).
     Rect popupRect_;
 
+    // Copies of the latest contents painted by CEF for the view and the popup
+    // (in CEF buffer coordinates); the popup is composited on top of the view
+    // in the viewport, and the underlay is used to restore the view when the
+    // popup is moved or closed.
+    ImageSlice viewUnderlay_;
+    ImageSlice popupLayer_;
+
     uint32_t eventModifiers_;
 
     bool errorActive_;
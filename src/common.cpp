@@ -92,9 +92,129 @@ vector<int> sanitizeUTF8StringToCodePoints(string str) {
     return ret;
 }
 
+namespace {
+
+// Lines waiting to be written to stderr by the log writer thread, which is
+// started with the first message. To keep a flood of messages from using
+// unbounded memory, at most MaxQueuedLogLines lines are queued and the rest
+// are dropped (and counted). Never destroyed, so that logging works during
+// static destruction.
+class LogQueue {
+public:
+    static const size_t MaxQueuedLogLines = 4096;
+
+    LogQueue() {
+        writerStarted_ = false;
+        writing_ = false;
+        droppedCount_ = 0;
+    }
+
+    void push(string line) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if(!writerStarted_) {
+                writerStarted_ = true;
+                thread([this]() { runWriter_(); }).detach();
+            }
+            if(lines_.size() >= MaxQueuedLogLines) {
+                ++droppedCount_;
+                return;
+            }
+            lines_.push_back(move(line));
+        }
+        cv_.notify_one();
+    }
+
+    void flush() {
+        unique_lock<mutex> lock(mutex_);
+        flushedCv_.wait_for(lock, milliseconds(1000), [&]() {
+            return lines_.empty() && !writing_;
+        });
+    }
+
+private:
+    void runWriter_() {
+        unique_lock<mutex> lock(mutex_);
+        while(true) {
+            cv_.wait(lock, [&]() { return !lines_.empty(); });
+
+            deque<string> lines;
+            swap(lines, lines_);
+            uint64_t droppedCount = droppedCount_;
+            droppedCount_ = 0;
+            writing_ = true;
+            lock.unlock();
+
+            string output;
+            for(const string& line : lines) {
+                output.append(line);
+            }
+            if(droppedCount) {
+                output.append(
+                    "WARNING @ logging -- " + toString(droppedCount) +
+                    " log messages dropped because the log queue was full\n"
+                );
+            }
+            cerr << output;
+            cerr.flush();
+
+            lock.lock();
+            writing_ = false;
+            if(lines_.empty()) {
+                flushedCv_.notify_all();
+            }
+        }
+    }
+
+    mutex mutex_;
+    condition_variable cv_;
+    condition_variable flushedCv_;
+    bool writerStarted_;
+    bool writing_;
+    deque<string> lines_;
+    uint64_t droppedCount_;
+};
+
+LogQueue& logQueue() {
+    static LogQueue* queue = new LogQueue();
+    return *queue;
+}
+
+}
+
+bool LogRateLimiter::allow(uint64_t& suppressedCount) {
+    int64_t now = duration_cast<milliseconds>(
+        steady_clock::now().time_since_epoch()
+    ).count();
+    int64_t windowStart = windowStart_.load(memory_order_relaxed);
+    if(
+        now - windowStart >= Window &&
+        windowStart_.compare_exchange_strong(windowStart, now)
+    ) {
+        windowCount_.store(0, memory_order_relaxed);
+    }
+    if(windowCount_.fetch_add(1, memory_order_relaxed) < Burst) {
+        suppressedCount = suppressedCount_.exchange(0, memory_order_relaxed);
+        return true;
+    } else {
+        suppressedCount_.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+}
+
+void LogWriter::write_(string line) {
+    logQueue().push(move(line));
+}
+
+void flushLogs() {
+    logQueue().flush();
+}
+
 static atomic<bool> panicUsingCEFFatalError_(false);
 
 void Panicker::panic_(string msg) {
+    flushLogs();
+
     stringstream output;
     output << "PANIC @ " << location_;
     if(!msg.empty()) {
@@ -116,7 +236,22 @@ void enablePanicUsingCEFFatalError() {
     panicUsingCEFFatalError_.store(true);
 }
 
+namespace {
+
+function<void(function<void()>)> postTaskHandler_;
+
+}
+
+void setPostTaskHandler(function<void(function<void()>)> handler) {
+    postTaskHandler_ = move(handler);
+}
+
 void postTask(function<void()> func) {
+    if(postTaskHandler_) {
+        postTaskHandler_(move(func));
+        return;
+    }
+
     void (*call)(function<void()>) = [](function<void()> func) {
         func();
     };
@@ -6,7 +6,9 @@
 #include <cctype>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <exception>
 #include <fstream>
 #include <functional>
@@ -36,8 +38,10 @@ using std::array;
 using std::atomic;
 using std::binary_search;
 using std::cerr;
+using std::condition_variable;
 using std::cout;
 using std::declval;
+using std::deque;
 using std::enable_shared_from_this;
 using std::exception;
 using std::fill;
@@ -54,6 +58,7 @@ using std::memory_order_relaxed;
 using std::min;
 using std::move;
 using std::mt19937;
+using std::multimap;
 using std::mutex;
 using std::ofstream;
 using std::optional;
@@ -77,11 +82,13 @@ using std::thread;
 using std::tie;
 using std::tuple;
 using std::uniform_int_distribution;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using std::weak_ptr;
 
 using std::chrono::duration_cast;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::chrono::steady_clock;
 
@@ -129,38 +136,104 @@ vector<int> sanitizeUTF8StringToCodePoints(string str);
 
 // Logging macros that log given message along with severity, source file and
 // line information to stderr. Message is formed by calling toString for each
-// argument and concatenating the results.
-#define INFO_LOG LogWriter("INFO", __FILE__, __LINE__)
-#define WARNING_LOG LogWriter("WARNING", __FILE__, __LINE__)
-#define ERROR_LOG LogWriter("ERROR", __FILE__, __LINE__)
+// argument and concatenating the results. Each INFO_LOG and WARNING_LOG call
+// site may log at most LogRateLimiter::Burst messages per
+// LogRateLimiter::Window; the rest are dropped before formatting and counted in
+// the next message from the site. Errors are never dropped.
+// The messages are written to stderr by a background thread (see flushLogs).
+#define INFO_LOG LogWriter("INFO", __FILE__, __LINE__, LOG_RATE_LIMITER_())
+#define WARNING_LOG LogWriter("WARNING", __FILE__, __LINE__, LOG_RATE_LIMITER_())
+#define ERROR_LOG LogWriter("ERROR", __FILE__, __LINE__, nullptr)
+
+#define LOG_RATE_LIMITER_() \
+    ([]() -> LogRateLimiter* { \
+        static LogRateLimiter limiter; \
+        return &limiter; \
+    }())
+
+class LogRateLimiter {
+public:
+    static constexpr uint32_t Burst = 20;
+    static constexpr int64_t Window = 10000;
+
+    LogRateLimiter()
+        : windowStart_(0),
+          windowCount_(0),
+          suppressedCount_(0)
+    {}
+
+    // Returns true if a message may be logged now, in which case
+    // suppressedCount is set to the number of messages dropped since the
+    // previous allowed message. Thread-safe; the limit is approximate under
+    // contention.
+    bool allow(uint64_t& suppressedCount);
+
+private:
+    atomic<int64_t> windowStart_;
+    atomic<uint32_t> windowCount_;
+    atomic<uint64_t> suppressedCount_;
+};
 
 class LogWriter {
 public:
-    LogWriter(const char* severity, const char* file, int line)
-        : LogWriter(severity, string(file) + ":" + toString(line))
+    LogWriter(
+        const char* severity,
+        const char* file,
+        int line,
+        LogRateLimiter* rateLimiter
+    )
+        : severity_(severity),
+          file_(file),
+          line_(line),
+          rateLimiter_(rateLimiter)
     {}
     LogWriter(const char* severity, string location)
         : severity_(severity),
-          location_(move(location))
+          file_(nullptr),
+          line_(0),
+          location_(move(location)),
+          rateLimiter_(nullptr)
     {}
 
     template <typename... T>
     void operator()(const T&... args) {
+        uint64_t suppressedCount = 0;
+        if(rateLimiter_ != nullptr && !rateLimiter_->allow(suppressedCount)) {
+            return;
+        }
         vector<string> argStrs = {toString(args)...};
         stringstream msg;
-        msg << severity_ << " @ " << location_ << " -- ";
+        msg << severity_ << " @ ";
+        if(file_ != nullptr) {
+            msg << file_ << ":" << line_;
+        } else {
+            msg << location_;
+        }
+        msg << " -- ";
+        if(suppressedCount) {
+            msg << "(" << suppressedCount << " similar messages suppressed) ";
+        }
         for(const string& argStr : argStrs) {
             msg << argStr;
         }
         msg << "\n";
-        cerr << msg.str();
+        write_(msg.str());
     }
 
 private:
+    static void write_(string line);
+
     const char* severity_;
+    const char* file_;
+    int line_;
     string location_;
+    LogRateLimiter* rateLimiter_;
 };
 
+// Waits (for at most a second) until the log messages written so far have
+// been written to stderr by the background thread.
+void flushLogs();
+
 // Panic and assertion macros for ending the program in the case of
 // irrecoverable errors. By default the program exits using abort(), but after
 // enablePanicUsingCEFFatalError has been called, the program is exited using
@@ -270,6 +343,12 @@ public:
 // loop. May be called from any thread.
 void postTask(function<void()> func);
 
+// Redirects the tasks posted using postTask to given handler instead of the
+// CEF UI thread loop. Only meant for tools that run parts of the program
+// without CEF (such as the rendering benchmark); must be called before any
+// tasks are posted.
+void setPostTaskHandler(function<void(function<void()>)> handler);
+
 template <typename T, typename... Args>
 void postTask(shared_ptr<T> ptr, void (T::*func)(Args...), Args... args) {
     postTask([ptr, func, args...]() {
@@ -1,5 +1,6 @@
 #include "config.hpp"
 
+#include "resource_profile.hpp"
 #include "vice.hpp"
 
 #include "include/cef_version.h"
@@ -273,6 +274,20 @@ shared_ptr<Config> Config::read(int argc, char* argv[]) {
         return {};
     }
 
+    // The frame rate options that are not given default to the values of the
+    // resource profile
+    optional<ResourceProfile> profile = getResourceProfile(src.resourceProfile);
+    REQUIRE(profile);
+    if(!optsSeen.count(CONF_OPT_INFO(maxFps).name)) {
+        src.maxFps = profile->maxFps;
+    }
+    if(!optsSeen.count(CONF_OPT_INFO(renderFps).name)) {
+        src.renderFps = profile->renderFps;
+    }
+    if(!optsSeen.count(CONF_OPT_INFO(idleRenderFps).name)) {
+        src.idleRenderFps = profile->idleRenderFps;
+    }
+
     if(mode == Help) {
         cout << "USAGE: " << argv[0] << " [OPTION]...\n";
         cout << "\n";
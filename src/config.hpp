@@ -26,7 +26,29 @@ public:
     const bool useDedicatedXvfb;
     const string startPage;
     const string dataDir;
+    const int memoryCacheSize;
+    const string cookieSnapshotFile;
+    const int cookieSnapshotInterval;
     const int windowLimit;
+    const int windowPoolSize;
+    const int launchLimit;
+    const pair<int, int> windowHandleShard;
+    const int workers;
+    const int workerBasePort;
+    const string resourceProfile;
+    const int maxFps;
+    const int renderFps;
+    const int idleRenderFps;
+    const int pageZoom;
+    const bool uiAnimations;
+    const int hibernateDelay;
+    const int memoryPressureThreshold;
+    const bool chromiumGpuRasterSwitch;
+    const bool externalMessagePump;
+    const string traceFile;
+    const string frameCaptureFile;
+    const string snapshotFile;
+    const string restoreSnapshot;
     const vector<pair<string, optional<string>>> chromiumArgs;
 };
 
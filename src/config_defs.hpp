@@ -4,7 +4,29 @@
     CONF_FOREACH_OPT_ITEM(useDedicatedXvfb) \
     CONF_FOREACH_OPT_ITEM(startPage) \
     CONF_FOREACH_OPT_ITEM(dataDir) \
+    CONF_FOREACH_OPT_ITEM(memoryCacheSize) \
+    CONF_FOREACH_OPT_ITEM(cookieSnapshotFile) \
+    CONF_FOREACH_OPT_ITEM(cookieSnapshotInterval) \
     CONF_FOREACH_OPT_ITEM(windowLimit) \
+    CONF_FOREACH_OPT_ITEM(windowPoolSize) \
+    CONF_FOREACH_OPT_ITEM(launchLimit) \
+    CONF_FOREACH_OPT_ITEM(windowHandleShard) \
+    CONF_FOREACH_OPT_ITEM(workers) \
+    CONF_FOREACH_OPT_ITEM(workerBasePort) \
+    CONF_FOREACH_OPT_ITEM(resourceProfile) \
+    CONF_FOREACH_OPT_ITEM(maxFps) \
+    CONF_FOREACH_OPT_ITEM(renderFps) \
+    CONF_FOREACH_OPT_ITEM(idleRenderFps) \
+    CONF_FOREACH_OPT_ITEM(pageZoom) \
+    CONF_FOREACH_OPT_ITEM(uiAnimations) \
+    CONF_FOREACH_OPT_ITEM(hibernateDelay) \
+    CONF_FOREACH_OPT_ITEM(memoryPressureThreshold) \
+    CONF_FOREACH_OPT_ITEM(chromiumGpuRasterSwitch) \
+    CONF_FOREACH_OPT_ITEM(externalMessagePump) \
+    CONF_FOREACH_OPT_ITEM(traceFile) \
+    CONF_FOREACH_OPT_ITEM(frameCaptureFile) \
+    CONF_FOREACH_OPT_ITEM(snapshotFile) \
+    CONF_FOREACH_OPT_ITEM(restoreSnapshot) \
     CONF_FOREACH_OPT_ITEM(chromiumArgs)
 
 CONF_DEF_OPT_INFO(vicePlugin) {
@@ -79,6 +101,58 @@ CONF_DEF_OPT_INFO(dataDir) {
     }
 };
 
+CONF_DEF_OPT_INFO(memoryCacheSize) {
+    const char* name = "memory-cache-size";
+    const char* valSpec = "MEGABYTES";
+    string desc() {
+        return
+            "if nonzero and data-dir is empty (the cache, cookies and storage "
+            "are kept in memory), the maximum size of the in-memory HTTP "
+            "cache of the browser";
+    }
+    string defaultValStr() {
+        return "default 0 (Chromium default)";
+    }
+    int defaultVal() {
+        return 0;
+    }
+    bool validate(int val) {
+        return val >= 0 && val <= 65536;
+    }
+};
+
+CONF_DEF_OPT_INFO(cookieSnapshotFile) {
+    const char* name = "cookie-snapshot-file";
+    const char* valSpec = "PATH";
+    string desc() {
+        return
+            "if nonempty, the cookies are restored from this file on startup "
+            "and written to it periodically (see cookie-snapshot-interval) and "
+            "on shutdown, which keeps the cookies across restarts when data-dir "
+            "is empty without writing the cache and storage to disk";
+    }
+    string defaultValStr() {
+        return "default empty";
+    }
+    string defaultVal() {
+        return "";
+    }
+};
+
+CONF_DEF_OPT_INFO(cookieSnapshotInterval) {
+    const char* name = "cookie-snapshot-interval";
+    const char* valSpec = "SECONDS";
+    string desc() {
+        return "interval between the periodic writes of cookie-snapshot-file";
+    }
+    int defaultVal() {
+        return 300;
+    }
+    bool validate(int val) {
+        return val >= 1;
+    }
+};
+
 CONF_DEF_OPT_INFO(windowLimit) {
     const char* name = "window-limit";
     const char* valSpec = "COUNT";
@@ -93,6 +167,371 @@ CONF_DEF_OPT_INFO(windowLimit) {
     }
 };
 
+CONF_DEF_OPT_INFO(windowPoolSize) {
+    const char* name = "window-pool-size";
+    const char* valSpec = "COUNT";
+    string desc() {
+        return
+            "number of browsers kept started in the background (within the "
+            "window limit) to be handed out to new windows, which makes "
+            "opening a window faster";
+    }
+    int defaultVal() {
+        return 0;
+    }
+    bool validate(int val) {
+        return val >= 0;
+    }
+};
+
+CONF_DEF_OPT_INFO(launchLimit) {
+    const char* name = "launch-limit";
+    const char* valSpec = "COUNT";
+    string desc() {
+        return
+            "maximum number of new windows whose browsers are starting at the "
+            "same time; the browsers of further new windows are started in "
+            "order once the earlier ones have painted their first frame, and "
+            "the windows show an empty page until then";
+    }
+    int defaultVal() {
+        return 4;
+    }
+    bool validate(int val) {
+        return val >= 1;
+    }
+};
+
+CONF_DEF_OPT_INFO(windowHandleShard) {
+    const char* name = "window-handle-shard";
+    const char* valSpec = "INDEX/COUNT";
+    string desc() {
+        return
+            "when running COUNT instances behind a router (such as the "
+            "supervisor enabled by workers, which sets this for its workers), "
+            "this instance only allocates window handles equal to INDEX "
+            "modulo COUNT, so that the requests for a window can be routed to "
+            "its instance based on the handle in the path";
+    }
+    string defaultValStr() {
+        return "default: 0/1";
+    }
+    pair<int, int> defaultVal() {
+        return pair<int, int>(0, 1);
+    }
+    optional<pair<int, int>> parse(const string& str) {
+        optional<pair<int, int>> empty;
+        size_t slash = str.find('/');
+        if(slash == string::npos) {
+            return empty;
+        }
+        optional<int> index = parseString<int>(str.substr(0, slash));
+        optional<int> count = parseString<int>(str.substr(slash + 1));
+        if(!index.has_value() || !count.has_value()) {
+            return empty;
+        }
+        return pair<int, int>(*index, *count);
+    }
+    bool validate(const pair<int, int>& val) {
+        return val.second >= 1 && val.first >= 0 && val.first < val.second;
+    }
+};
+
+CONF_DEF_OPT_INFO(workers) {
+    const char* name = "workers";
+    const char* valSpec = "COUNT";
+    string desc() {
+        return
+            "if nonzero, this process runs as a supervisor that starts COUNT "
+            "worker instances (each with its own Xvfb, CEF and vice plugin, "
+            "and its own window-handle-shard) and routes the HTTP requests "
+            "received at vice-opt-http-listen-addr to them: the requests for a "
+            "window go to the worker that owns its handle, and new windows are "
+            "placed on the worker with the fewest recently active windows";
+    }
+    int defaultVal() {
+        return 0;
+    }
+    bool validate(int val) {
+        return val >= 0 && val <= 256;
+    }
+};
+
+CONF_DEF_OPT_INFO(workerBasePort) {
+    const char* name = "worker-base-port";
+    const char* valSpec = "PORT";
+    string desc() {
+        return
+            "if workers is nonzero, worker INDEX (0..COUNT-1) listens on "
+            "127.0.0.1:(PORT + INDEX), to which the supervisor routes its "
+            "requests";
+    }
+    int defaultVal() {
+        return 18080;
+    }
+    bool validate(int val) {
+        return val >= 1 && val <= 65535;
+    }
+};
+
+CONF_DEF_OPT_INFO(resourceProfile) {
+    const char* name = "resource-profile";
+    const char* valSpec = "PROFILE";
+    string desc() {
+        return
+            "preset for the trade-off between memory use and throughput "
+            "(low-memory, balanced or throughput); sets the defaults of the "
+            "frame rate options and the vice plugin thread counts and adds "
+            "matching Chromium switches";
+    }
+    string defaultVal() {
+        return "balanced";
+    }
+    bool validate(const string& val) {
+        return getResourceProfile(val).has_value();
+    }
+};
+
+CONF_DEF_OPT_INFO(maxFps) {
+    const char* name = "max-fps";
+    const char* valSpec = "FPS";
+    string desc() {
+        return
+            "maximum number of frames per second produced for each browser window; "
+            "bursts of paints are merged into a single frame";
+    }
+    string defaultValStr() {
+        return "default: 30, or set by resource-profile";
+    }
+    int defaultVal() {
+        return 30;
+    }
+    bool validate(int val) {
+        return val >= 1 && val <= 1000;
+    }
+};
+
+CONF_DEF_OPT_INFO(renderFps) {
+    const char* name = "render-fps";
+    const char* valSpec = "FPS";
+    string desc() {
+        return
+            "frame rate at which Chromium renders each browser window while "
+            "the client is active";
+    }
+    string defaultValStr() {
+        return "default: 30, or set by resource-profile";
+    }
+    int defaultVal() {
+        return 30;
+    }
+    bool validate(int val) {
+        return val >= 1 && val <= 60;
+    }
+};
+
+CONF_DEF_OPT_INFO(idleRenderFps) {
+    const char* name = "idle-render-fps";
+    const char* valSpec = "FPS";
+    string desc() {
+        return
+            "frame rate at which Chromium renders each browser window after "
+            "the client has neither sent input nor fetched images for a few "
+            "seconds";
+    }
+    string defaultValStr() {
+        return "default: 5, or set by resource-profile";
+    }
+    int defaultVal() {
+        return 5;
+    }
+    bool validate(int val) {
+        return val >= 1 && val <= 60;
+    }
+};
+
+CONF_DEF_OPT_INFO(pageZoom) {
+    const char* name = "page-zoom";
+    const char* valSpec = "PERCENT";
+    string desc() {
+        return
+            "initial zoom level of the pages in each browser window, applied "
+            "as the device scale factor of the browser; the image sent to the "
+            "client always has the size of the window, so zooming out fits "
+            "more of the page in it but does not make the image smaller (can "
+            "be changed per window with Ctrl+Minus, Ctrl+Plus and Ctrl+0 "
+            "if the page does not handle these keys itself)";
+    }
+    int defaultVal() {
+        return 100;
+    }
+    bool validate(int val) {
+        return val >= 25 && val <= 400;
+    }
+};
+
+CONF_DEF_OPT_INFO(uiAnimations) {
+    const char* name = "ui-animations";
+    const char* valSpec = "YES/NO";
+    string desc() {
+        return
+            "if enabled, the loading indicator of the control bar is animated "
+            "and the caret of the text fields blinks; otherwise, they are "
+            "drawn statically, which avoids producing a new frame for every "
+            "animation step of each loading window";
+    }
+    bool defaultVal() {
+        return true;
+    }
+};
+
+CONF_DEF_OPT_INFO(hibernateDelay) {
+    const char* name = "hibernate-delay";
+    const char* valSpec = "SECONDS";
+    string desc() {
+        return
+            "if nonzero, the browser of a window is shut down to free its "
+            "resources after the client has been inactive for this long; the "
+            "page is reopened when the client becomes active again";
+    }
+    string defaultValStr() {
+        return "default 0 (disabled)";
+    }
+    int defaultVal() {
+        return 0;
+    }
+    bool validate(int val) {
+        return val >= 0;
+    }
+};
+
+CONF_DEF_OPT_INFO(memoryPressureThreshold) {
+    const char* name = "memory-pressure-threshold";
+    const char* valSpec = "PERCENT";
+    string desc() {
+        return
+            "if nonzero, the memory pressure of the host (or the cgroup) is "
+            "monitored, and while the share of time stalled on memory exceeds "
+            "this percentage or the cgroup hits its memory limit, the "
+            "least recently used windows are hibernated one by one";
+    }
+    string defaultValStr() {
+        return "default 0 (disabled)";
+    }
+    int defaultVal() {
+        return 0;
+    }
+    bool validate(int val) {
+        return val >= 0 && val <= 100;
+    }
+};
+
+CONF_DEF_OPT_INFO(chromiumGpuRasterSwitch) {
+    const char* name = "chromium-gpu-raster-switch";
+    const char* valSpec = "YES/NO";
+    string desc() {
+        return
+            "if enabled, Chromium is started with GL through EGL and its "
+            "enable-gpu-rasterization switch; this only changes how Chromium "
+            "rasterizes the pages, as the frames are still delivered to the "
+            "vice plugin as CPU pixel buffers (GPUs on Chromium's blocklist "
+            "can be forced with chromium-args=ignore-gpu-blocklist)";
+    }
+    bool defaultVal() {
+        return false;
+    }
+};
+
+CONF_DEF_OPT_INFO(externalMessagePump) {
+    const char* name = "external-message-pump";
+    const char* valSpec = "YES/NO";
+    string desc() {
+        return
+            "if enabled, the main thread runs its own loop that calls CEF "
+            "message loop work when CEF schedules it, and handles the events "
+            "of the vice plugin as soon as they arrive instead of queuing them "
+            "behind the pending Chromium tasks";
+    }
+    bool defaultVal() {
+        return false;
+    }
+};
+
+CONF_DEF_OPT_INFO(traceFile) {
+    const char* name = "trace-file";
+    const char* valSpec = "PATH";
+    string desc() {
+        return
+            "if nonempty, the input latency of the windows is traced through "
+            "the vice plugin, the browser and the image pipeline, and the "
+            "trace is written to this file in the Chrome trace JSON format "
+            "(requires a vice plugin that supports tracing)";
+    }
+    string defaultValStr() {
+        return "default empty";
+    }
+    string defaultVal() {
+        return "";
+    }
+};
+
+CONF_DEF_OPT_INFO(frameCaptureFile) {
+    const char* name = "frame-capture-file";
+    const char* valSpec = "PATH";
+    string desc() {
+        return
+            "debug option: if nonempty, the window images fetched by the vice "
+            "plugin are recorded to this file along with the dirty rectangles "
+            "and timing, for replaying them in the image compression benchmark "
+            "(the file grows quickly)";
+    }
+    string defaultValStr() {
+        return "default empty";
+    }
+    string defaultVal() {
+        return "";
+    }
+};
+
+CONF_DEF_OPT_INFO(snapshotFile) {
+    const char* name = "snapshot-file";
+    const char* valSpec = "PATH";
+    string desc() {
+        return
+            "if nonempty, the pages shown by the open windows and the cookies "
+            "are written to this file on shutdown, such that another instance "
+            "can restore the sessions using restore-snapshot when this "
+            "instance is drained";
+    }
+    string defaultValStr() {
+        return "default empty";
+    }
+    string defaultVal() {
+        return "";
+    }
+};
+
+CONF_DEF_OPT_INFO(restoreSnapshot) {
+    const char* name = "restore-snapshot";
+    const char* valSpec = "PATH";
+    string desc() {
+        return
+            "if nonempty, the cookies of the session snapshot file written by "
+            "another instance (see snapshot-file) are restored on startup, and "
+            "each window of the snapshot is reopened when a client opens "
+            "/goto/browservice:restore/HANDLE/TOKEN with its old handle and "
+            "the secret token recorded for it in the snapshot (the path to "
+            "which the router should redirect the clients of the drained "
+            "instance)";
+    }
+    string defaultValStr() {
+        return "default empty";
+    }
+    string defaultVal() {
+        return "";
+    }
+};
+
 CONF_DEF_OPT_INFO(chromiumArgs) {
     const char* name = "chromium-args";
     const char* valSpec = "NAME(=VAL),...";
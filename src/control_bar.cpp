@@ -1,6 +1,7 @@
 #include "control_bar.hpp"
 
 #include "bookmarks.hpp"
+#include "globals.hpp"
 #include "text.hpp"
 #include "timeout.hpp"
 
@@ -757,7 +758,19 @@ void ControlBar::setPendingDownloadCount(int count) {
 void ControlBar::setDownloadProgress(vector<int> progress) {
     REQUIRE_UI_THREAD();
 
-    if(progress != downloadProgress_) {
+    if(progress == downloadProgress_) {
+        return;
+    }
+
+    if(progress.size() == downloadProgress_.size()) {
+        // The layout does not change, so only the progress bar needs to be
+        // updated
+        downloadProgress_ = move(progress);
+        Layout layout = layout_();
+        signalViewDirty_(Rect(
+            layout.downloadStart, layout.downloadEnd, Height - 9, Height - 4
+        ));
+    } else {
         downloadProgress_ = move(progress);
         signalViewDirty_();
         widgetViewportUpdated_();
@@ -1088,7 +1101,17 @@ void ControlBar::widgetRender_() {
             Height - 7, Height - 6
         );
 
-        if(!slice.isEmpty()) {
+        if(!slice.isEmpty() && !globals->config->uiAnimations) {
+            // Static indicator of dashes; no frames are produced while loading
+            int dashWidth = max(slice.width() / 24, 1);
+            for(int x = 0; x < slice.width(); x += 2 * dashWidth) {
+                slice.fill(
+                    x, min(x + dashWidth, slice.width()),
+                    0, slice.height(),
+                    0, 0, 255
+                );
+            }
+        } else if(!slice.isEmpty()) {
             int barWidth = slice.width() / 12;
             int64_t p = elapsed * (int64_t)slice.width() / (int64_t)5000;
             int barStart = p % slice.width();
@@ -1102,12 +1125,14 @@ void ControlBar::widgetRender_() {
             }
         }
 
-        weak_ptr<ControlBar> selfWeak = shared_from_this();
-        animationTimeout_->set([selfWeak]() {
-            if(shared_ptr<ControlBar> self = selfWeak.lock()) {
-                self->signalViewDirty_();
-            }
-        });
+        if(globals->config->uiAnimations) {
+            weak_ptr<ControlBar> selfWeak = shared_from_this();
+            animationTimeout_->set([selfWeak]() {
+                if(shared_ptr<ControlBar> self = selfWeak.lock()) {
+                    self->signalViewDirty_();
+                }
+            });
+        }
     } else {
         loadingAnimationStartTime_.reset();
     }
@@ -1,11 +1,18 @@
 #include "download_manager.hpp"
 
 #include "temp_dir.hpp"
+#include "timeout.hpp"
 
 #include "include/cef_download_handler.h"
 
 namespace browservice {
 
+namespace {
+
+const int64_t ProgressIntervalMs = 250;
+
+}
+
 CompletedDownload::CompletedDownload(CKey,
     shared_ptr<TempDir> tempDir,
     string path,
@@ -119,6 +126,9 @@ DownloadManager::DownloadManager(CKey,
 
     eventHandler_ = eventHandler;
     nextFileIdx_ = 1;
+
+    lastProgressReportTime_ = steady_clock::now();
+    progressTimeout_ = Timeout::create(ProgressIntervalMs);
 }
 
 /*
@@ -127,6 +137,8 @@ src/download_manager.cpp: In member function 'void browservice::DownloadManager:
 */
 
 DownloadManager::~DownloadManager() {
+    progressTimeout_->clear(false);
+
 //    for(const pair<uint32_t, DownloadInfo>& p : infos_) {
     for(const std::pair<uint32_t, browservice::DownloadManager::DownloadInfo>& p : infos_) {
         const DownloadInfo& info = p.second;
@@ -196,6 +208,32 @@ src/download_manager.cpp:187:45: note: use non-reference type 'const std::pair<u
 */
 
 void DownloadManager::downloadProgressChanged_() {
+    vector<int> progress = currentProgress_();
+    if(progress == reportedProgress_) {
+        progressTimeout_->clear(false);
+        return;
+    }
+
+    if(
+        progress.size() == reportedProgress_.size() &&
+        steady_clock::now() - lastProgressReportTime_ < milliseconds(ProgressIntervalMs)
+    ) {
+        // The latest progress is reported when the timeout expires
+        if(!progressTimeout_->isActive()) {
+            weak_ptr<DownloadManager> selfWeak = shared_from_this();
+            progressTimeout_->set([selfWeak]() {
+                if(shared_ptr<DownloadManager> self = selfWeak.lock()) {
+                    self->downloadProgressChanged_();
+                }
+            });
+        }
+        return;
+    }
+
+    reportProgress_(move(progress));
+}
+
+vector<int> DownloadManager::currentProgress_() {
     vector<pair<int, int>> pairs;
 //    for(const pair<uint32_t, DownloadInfo>& elem : infos_) {
     for(const std::pair<uint32_t, browservice::DownloadManager::DownloadInfo>& elem : infos_) {
@@ -208,6 +246,14 @@ void DownloadManager::downloadProgressChanged_() {
     for(pair<int, int> p : pairs) {
         progress.push_back(p.second);
     }
+    return progress;
+}
+
+void DownloadManager::reportProgress_(vector<int> progress) {
+    progressTimeout_->clear(false);
+    reportedProgress_ = progress;
+    lastProgressReportTime_ = steady_clock::now();
+
     postTask(
         eventHandler_,
         &DownloadManagerEventHandler::onDownloadProgressChanged,
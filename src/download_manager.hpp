@@ -9,6 +9,7 @@ class CefDownloadItemCallback;
 namespace browservice {
 
 class TempDir;
+class Timeout;
 
 class CompletedDownload : public enable_shared_from_this<CompletedDownload> {
 SHARED_ONLY_CLASS(CompletedDownload);
@@ -63,7 +64,14 @@ private:
     void unlinkFile_(int fileIdx);
 
     void pendingDownloadCountChanged_();
+
+    // Reports the progress of the downloads to the event handler if the
+    // percentages have changed. Changes in the percentages only are reported
+    // at most once per ProgressIntervalMs; if a download starts or ends, the
+    // report is immediate.
     void downloadProgressChanged_();
+    vector<int> currentProgress_();
+    void reportProgress_(vector<int> progress);
 
     weak_ptr<DownloadManagerEventHandler> eventHandler_;
 
@@ -72,6 +80,10 @@ private:
     int nextFileIdx_;
     map<uint32_t, DownloadInfo> infos_;
     queue<uint32_t> pending_;
+
+    vector<int> reportedProgress_;
+    steady_clock::time_point lastProgressReportTime_;
+    shared_ptr<Timeout> progressTimeout_;
 };
 
 }
@@ -1,5 +1,7 @@
 #include "find_bar.hpp"
 
+#include "timeout.hpp"
+
 namespace browservice {
 
 namespace {
@@ -149,6 +151,8 @@ MenuButtonIcon closeIcon = {
 
 const int BtnWidth = 19;
 
+const int64_t TextChangeDelayMs = 200;
+
 }
 
 FindBar::FindBar(CKey,
@@ -162,16 +166,21 @@ FindBar::FindBar(CKey,
     eventHandler_ = eventHandler;
 
     isOpen_ = false;
+
+    textChangeTimeout_ = Timeout::create(TextChangeDelayMs);
 }
 
 void FindBar::open() {
     REQUIRE_UI_THREAD();
 
     if(!isOpen_) {
+        textChangeTimeout_->clear(false);
         isOpen_ = true;
         findResult_ = true;
         text_.reset();
+        noMatchText_.reset();
         textField_->setText("");
+        textField_->setBackgroundColor(255, 255, 255);
         lastDirForward_ = true;
     }
 }
@@ -180,6 +189,7 @@ void FindBar::close() {
     REQUIRE_UI_THREAD();
 
     if(isOpen_) {
+        textChangeTimeout_->clear(false);
         isOpen_ = false;
         postTask(eventHandler_, &FindBarEventHandler::onStopFind, false);
         postTask(eventHandler_, &FindBarEventHandler::onFindBarClose);
@@ -202,8 +212,21 @@ void FindBar::findNext() {
 void FindBar::setFindResult(bool found) {
     REQUIRE_UI_THREAD();
 
+    if(isOpen_) {
+        if(found) {
+            noMatchText_.reset();
+        } else if(text_) {
+            noMatchText_ = *text_;
+        }
+    }
+
     if(isOpen_ && findResult_ != found) {
         findResult_ = found;
+        if(found) {
+            textField_->setBackgroundColor(255, 255, 255);
+        } else {
+            textField_->setBackgroundColor(255, 176, 176);
+        }
         signalViewDirty_();
     }
 }
@@ -212,7 +235,23 @@ void FindBar::onTextFieldTextChanged() {
     REQUIRE_UI_THREAD();
     if(!isOpen_) return;
 
-    updateText_(textField_->text());
+    textChangeTimeout_->clear(false);
+
+    // Clearing the text stops the search right away
+    if(textField_->text().empty()) {
+        updateText_("");
+        return;
+    }
+
+    weak_ptr<FindBar> selfWeak = shared_from_this();
+    textChangeTimeout_->set([selfWeak]() {
+        REQUIRE_UI_THREAD();
+        if(shared_ptr<FindBar> self = selfWeak.lock()) {
+            if(self->isOpen_) {
+                self->updateText_(self->textField_->text());
+            }
+        }
+    });
 }
 
 void FindBar::onTextFieldSubmitted(string text) {
@@ -279,6 +318,15 @@ bool FindBar::updateText_(string text) {
     } else {
         if(text_ && *text_ == text) {
             return false;
+        } else if(
+            noMatchText_ &&
+            text.size() > noMatchText_->size() &&
+            !text.compare(0, noMatchText_->size(), *noMatchText_)
+        ) {
+            // Extending a query that has no matches cannot produce matches, so
+            // the page does not need to be searched again
+            text_ = text;
+            return true;
         } else {
             postTask(
                 eventHandler_,
@@ -298,6 +346,7 @@ void FindBar::find_(string text, bool forward) {
 
     lastDirForward_ = forward;
 
+    textChangeTimeout_->clear(false);
     if(!updateText_(text)) {
         postTask(
             eventHandler_,
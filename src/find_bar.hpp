@@ -5,6 +5,8 @@
 
 namespace browservice {
 
+class Timeout;
+
 class FindBarEventHandler {
 public:
     virtual void onFindBarClose() = 0;
@@ -65,6 +67,14 @@ private:
     bool findResult_;
     optional<string> text_;
     bool lastDirForward_;
+
+    // The latest query reported to have no matches; extensions of it are not
+    // searched.
+    optional<string> noMatchText_;
+
+    // Typing restarts the search only after a pause, so that a burst of key
+    // presses results in a single search.
+    shared_ptr<Timeout> textChangeTimeout_;
 };
 
 }
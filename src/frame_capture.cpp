@@ -0,0 +1,199 @@
+#include "frame_capture.hpp"
+
+namespace browservice {
+
+namespace {
+
+const uint32_t DirtyRectRecord = 1;
+const uint32_t FrameRecord = 2;
+
+// Returns the bounding box of the pixels that differ between the image and
+// the previous frame of the same size.
+Rect diffRegion(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    const vector<uint8_t>& prev
+) {
+    int startX = (int)width;
+    int endX = 0;
+    int startY = -1;
+    int endY = 0;
+    for(size_t y = 0; y < height; ++y) {
+        const uint8_t* row = image + 4 * y * pitch;
+        const uint8_t* prevRow = prev.data() + 4 * y * width;
+        if(memcmp(row, prevRow, 4 * width) == 0) {
+            continue;
+        }
+        size_t x0 = 0;
+        while(memcmp(row + 4 * x0, prevRow + 4 * x0, 4) == 0) {
+            ++x0;
+        }
+        size_t x1 = width;
+        while(memcmp(row + 4 * (x1 - 1), prevRow + 4 * (x1 - 1), 4) == 0) {
+            --x1;
+        }
+        startX = min(startX, (int)x0);
+        endX = max(endX, (int)x1);
+        if(startY == -1) {
+            startY = (int)y;
+        }
+        endY = (int)y + 1;
+    }
+    if(startY == -1) {
+        return Rect();
+    }
+    return Rect(startX, endX, startY, endY);
+}
+
+}
+
+shared_ptr<FrameCapture> FrameCapture::open(const string& path) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if(file == nullptr) {
+        return {};
+    }
+    return FrameCapture::create(CKey(), file);
+}
+
+FrameCapture::FrameCapture(CKey, CKey, FILE* file) {
+    REQUIRE(file != nullptr);
+
+    file_ = file;
+    failed_ = false;
+    startTime_ = steady_clock::now();
+
+    setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+    write_("BSVCAP01", 8);
+}
+
+FrameCapture::~FrameCapture() {
+    if(fclose(file_) != 0 && !failed_) {
+        ERROR_LOG("Closing the frame capture file failed");
+    }
+}
+
+void FrameCapture::recordDirtyRect(uint64_t window, Rect rect) {
+    REQUIRE_UI_THREAD();
+
+    int32_t payload[4] = {
+        (int32_t)rect.startX,
+        (int32_t)rect.endX,
+        (int32_t)rect.startY,
+        (int32_t)rect.endY
+    };
+    writeRecord_(DirtyRectRecord, window, payload, sizeof(payload));
+}
+
+void FrameCapture::recordFrame(
+    uint64_t window,
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch
+) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(width > 0 && height > 0 && pitch >= width);
+
+    PrevFrame& prev = prevFrames_[window];
+    Rect region;
+    if(prev.width == width && prev.height == height) {
+        region = diffRegion(image, width, height, pitch, prev.data);
+    } else {
+        prev.width = width;
+        prev.height = height;
+        prev.data.resize(4 * width * height);
+        region = Rect(0, (int)width, 0, (int)height);
+    }
+    for(int y = region.startY; y < region.endY; ++y) {
+        memcpy(
+            prev.data.data() + 4 * ((size_t)y * width + region.startX),
+            image + 4 * ((size_t)y * pitch + region.startX),
+            4 * (size_t)(region.endX - region.startX)
+        );
+    }
+
+    struct {
+        uint32_t width;
+        uint32_t height;
+        int32_t rect[4];
+    } payload = {
+        (uint32_t)width,
+        (uint32_t)height,
+        {
+            (int32_t)region.startX,
+            (int32_t)region.endX,
+            (int32_t)region.startY,
+            (int32_t)region.endY
+        }
+    };
+    writeRecord_(FrameRecord, window, &payload, sizeof(payload), &prev, region);
+}
+
+void FrameCapture::windowClosed(uint64_t window) {
+    REQUIRE_UI_THREAD();
+    prevFrames_.erase(window);
+}
+
+void FrameCapture::writeRecord_(
+    uint32_t type,
+    uint64_t window,
+    const void* payload,
+    size_t payloadSize,
+    const PrevFrame* pixelSource,
+    Rect region
+) {
+    size_t pixelsSize = 0;
+    if(pixelSource != nullptr) {
+        pixelsSize =
+            4 *
+            (size_t)(region.endX - region.startX) *
+            (size_t)(region.endY - region.startY);
+    }
+    size_t totalSize = payloadSize + pixelsSize;
+    REQUIRE(totalSize <= (size_t)UINT32_MAX);
+
+    struct {
+        uint32_t type;
+        uint32_t size;
+        uint64_t window;
+        uint64_t timestamp;
+    } header = {
+        type,
+        (uint32_t)totalSize,
+        window,
+        (uint64_t)duration_cast<microseconds>(
+            steady_clock::now() - startTime_
+        ).count()
+    };
+    static_assert(sizeof(header) == 24, "Unexpected record header padding");
+
+    write_(&header, sizeof(header));
+    write_(payload, payloadSize);
+    if(pixelSource != nullptr) {
+        size_t rowSize = 4 * (size_t)(region.endX - region.startX);
+        for(int y = region.startY; y < region.endY; ++y) {
+            write_(
+                pixelSource->data.data() +
+                    4 * ((size_t)y * pixelSource->width + region.startX),
+                rowSize
+            );
+        }
+    }
+
+    const char zeros[8] = {};
+    write_(zeros, (8 - totalSize % 8) % 8);
+}
+
+void FrameCapture::write_(const void* data, size_t size) {
+    if(failed_ || size == 0) {
+        return;
+    }
+    if(fwrite(data, 1, size, file_) != size) {
+        ERROR_LOG("Writing to the frame capture file failed, stopping capture");
+        failed_ = true;
+    }
+}
+
+}
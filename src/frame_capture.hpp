@@ -0,0 +1,72 @@
+#pragma once
+
+#include "rect.hpp"
+
+namespace browservice {
+
+// Debug recorder for the window images fetched by the vice plugin (enabled
+// using the frame-capture-file option). The recorded files can be replayed
+// through the image compressors using the retrojsvice benchmark (see
+// viceplugins/retrojsvice/bench/bench.cpp) to measure compressor changes
+// against real traffic.
+//
+// File format: the file starts with the 8-byte magic "BSVCAP01", followed by
+// records. Each record starts with a 24-byte header of little-endian fields
+//   uint32 type (1 for a dirty rectangle, 2 for a frame)
+//   uint32 payload size in bytes
+//   uint64 window handle
+//   uint64 timestamp in microseconds since the start of the capture
+// followed by the payload, padded with zeros to a multiple of 8 bytes to keep
+// the records aligned when the file is memory-mapped. The payload of a dirty
+// rectangle (notified to the plugin) is int32 startX, endX, startY, endY. The
+// payload of a frame is uint32 width, height and int32 startX, endX, startY,
+// endY of the region that differs from the previous frame of the window,
+// followed by the BGRA pixels of the region row by row without padding. The
+// region covers the whole frame for the first frame of a window and when the
+// size changes, and it is empty if the frame is identical to the previous one.
+class FrameCapture {
+SHARED_ONLY_CLASS(FrameCapture);
+public:
+    // Returns an empty pointer if opening the file for writing fails.
+    static shared_ptr<FrameCapture> open(const string& path);
+
+    // Private constructor.
+    FrameCapture(CKey, CKey, FILE* file);
+    ~FrameCapture();
+
+    void recordDirtyRect(uint64_t window, Rect rect);
+    void recordFrame(
+        uint64_t window,
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch
+    );
+
+    // Releases the copy of the previous frame of the window.
+    void windowClosed(uint64_t window);
+
+private:
+    struct PrevFrame {
+        size_t width;
+        size_t height;
+        vector<uint8_t> data;
+    };
+
+    void writeRecord_(
+        uint32_t type,
+        uint64_t window,
+        const void* payload,
+        size_t payloadSize,
+        const PrevFrame* pixelSource = nullptr,
+        Rect region = Rect()
+    );
+    void write_(const void* data, size_t size);
+
+    FILE* file_;
+    bool failed_;
+    steady_clock::time_point startTime_;
+    map<uint64_t, PrevFrame> prevFrames_;
+};
+
+}
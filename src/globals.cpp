@@ -46,9 +46,9 @@ string getDotDirPath() {
 
 }
 
-Globals::Globals(CKey, shared_ptr<Config> config)
+Globals::Globals(CKey, shared_ptr<Config> config, bool createXWindow)
     : config(config),
-      xWindow(XWindow::create()),
+      xWindow(createXWindow ? XWindow::create() : nullptr),
       textRenderContext(TextRenderContext::create()),
       dotDirPath(getDotDirPath())
 {
@@ -10,7 +10,10 @@ class XWindow;
 class Globals {
 SHARED_ONLY_CLASS(Globals);
 public:
-    Globals(CKey, shared_ptr<Config> config);
+    // If createXWindow is false, xWindow is null; this is only meant for tools
+    // that run the widgets without an X display and never use the clipboard
+    // (such as the rendering benchmark).
+    Globals(CKey, shared_ptr<Config> config, bool createXWindow = true);
 
     const shared_ptr<Config> config;
     const shared_ptr<XWindow> xWindow;
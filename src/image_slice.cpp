@@ -1,7 +1,22 @@
 #include "image_slice.hpp"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace browservice {
 
+namespace {
+
+// The lines of the images created by createImage are aligned to cache lines
+const size_t LineAlign = 64;
+
+uint32_t packColor(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint32_t)b | ((uint32_t)g << 8) | ((uint32_t)r << 16);
+}
+
+}
+
 ImageSlice ImageSlice::createImage(int width, int height, uint8_t r, uint8_t g, uint8_t b) {
     ImageSlice slice = createImage(width, height, 0);
     slice.fill(0, width, 0, height, r, g, b);
@@ -16,17 +31,44 @@ ImageSlice ImageSlice::createImage(int width, int height, uint8_t rgb) {
         REQUIRE(width < Limit / height);
     }
 
+    int pitch = (int)(
+        ((size_t)width + LineAlign / 4 - 1) / (LineAlign / 4) * (LineAlign / 4)
+    );
+
+    // Allocate extra space to be able to align the start of the buffer
     ImageSlice slice;
-    slice.globalBuf_.reset(new vector<uint8_t>(4 * width * height, rgb));
-    slice.buf_ = slice.globalBuf_->data();
+    slice.globalBuf_.reset(
+        new vector<uint8_t>(4 * (size_t)pitch * (size_t)height + LineAlign, rgb)
+    );
+    uintptr_t addr = (uintptr_t)slice.globalBuf_->data();
+    slice.buf_ = slice.globalBuf_->data() + (LineAlign - addr % LineAlign) % LineAlign;
     slice.width_ = width;
     slice.height_ = height;
-    slice.pitch_ = width;
+    slice.pitch_ = pitch;
     slice.globalX_ = 0;
     slice.globalY_ = 0;
     return slice;
 }
 
+ImageSlice ImageSlice::reuseImage(ImageSlice& backing, int width, int height) {
+    REQUIRE(width >= 0 && height >= 0);
+
+    // Release the backing buffer if it is more than four times larger than
+    // needed
+    bool tooSmall = backing.width_ < width || backing.height_ < height;
+    bool tooLarge =
+        (int64_t)backing.width_ * (int64_t)backing.height_ >
+        4 * max((int64_t)width * (int64_t)height, (int64_t)65536);
+
+    if(tooSmall || tooLarge) {
+        auto withSpare = [](int size) {
+            return size + min(size / 4, 512);
+        };
+        backing = createImage(withSpare(width), withSpare(height));
+    }
+    return backing.subRect(0, width, 0, height);
+}
+
 ImageSlice ImageSlice::createImageFromStrings(
     const vector<string>& rows,
     const map<char, array<uint8_t, 3>>& colors
@@ -55,4 +97,104 @@ ImageSlice ImageSlice::createImageFromStrings(
     return ret;
 }
 
+bool ImageSlice::compareAndCopy(
+    uint8_t* dest, const uint8_t* src, size_t byteCount
+) {
+    size_t i = 0;
+    bool changed = false;
+
+#ifdef __SSE2__
+    __m128i diff = _mm_setzero_si128();
+    for(; i + 64 <= byteCount; i += 64) {
+        for(size_t j = 0; j < 64; j += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + i + j));
+            __m128i b = _mm_loadu_si128((const __m128i*)(dest + i + j));
+            diff = _mm_or_si128(diff, _mm_xor_si128(a, b));
+            _mm_storeu_si128((__m128i*)(dest + i + j), a);
+        }
+    }
+    for(; i + 16 <= byteCount; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(dest + i));
+        diff = _mm_or_si128(diff, _mm_xor_si128(a, b));
+        _mm_storeu_si128((__m128i*)(dest + i), a);
+    }
+    changed =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF;
+#endif
+
+    uint8_t tailDiff = 0;
+    for(; i < byteCount; ++i) {
+        tailDiff |= dest[i] ^ src[i];
+        dest[i] = src[i];
+    }
+    return changed || tailDiff != 0;
+}
+
+void ImageSlice::fillLine_(
+    uint8_t* dest, int count, uint8_t r, uint8_t g, uint8_t b
+) {
+    uint32_t color = packColor(r, g, b);
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i colorVec = _mm_set1_epi32((int)color);
+    __m128i keepMask = _mm_set1_epi32((int)0xFF000000);
+    for(; i + 4 <= count; i += 4) {
+        __m128i* ptr = (__m128i*)(dest + 4 * i);
+        __m128i pixels = _mm_loadu_si128(ptr);
+        pixels = _mm_or_si128(_mm_and_si128(pixels, keepMask), colorVec);
+        _mm_storeu_si128(ptr, pixels);
+    }
+#endif
+
+    for(; i < count; ++i) {
+        uint32_t pixel;
+        memcpy(&pixel, dest + 4 * i, 4);
+        pixel = (pixel & 0xFF000000) | color;
+        memcpy(dest + 4 * i, &pixel, 4);
+    }
+}
+
+void ImageSlice::fillMaskLine_(
+    uint8_t* dest, const uint8_t* mask, int count,
+    uint8_t r, uint8_t g, uint8_t b
+) {
+    uint32_t color = packColor(r, g, b);
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i colorVec = _mm_set1_epi32((int)color);
+    __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i threshold = _mm_set1_epi32(127);
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 4 <= count; i += 4) {
+        int32_t maskBytes;
+        memcpy(&maskBytes, mask + i, 4);
+        __m128i maskVec = _mm_cvtsi32_si128(maskBytes);
+        maskVec = _mm_unpacklo_epi8(maskVec, zero);
+        maskVec = _mm_unpacklo_epi16(maskVec, zero);
+        __m128i select =
+            _mm_and_si128(_mm_cmpgt_epi32(maskVec, threshold), colorMask);
+
+        __m128i* ptr = (__m128i*)(dest + 4 * i);
+        __m128i pixels = _mm_loadu_si128(ptr);
+        pixels = _mm_or_si128(
+            _mm_andnot_si128(select, pixels),
+            _mm_and_si128(select, colorVec)
+        );
+        _mm_storeu_si128(ptr, pixels);
+    }
+#endif
+
+    for(; i < count; ++i) {
+        if(mask[i] >= 128) {
+            uint8_t* pos = dest + 4 * i;
+            *(pos + 2) = r;
+            *(pos + 1) = g;
+            *(pos + 0) = b;
+        }
+    }
+}
+
 }
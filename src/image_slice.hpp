@@ -18,10 +18,19 @@ public:
     {}
 
     // Create a new independent width x height image buffer with background
-    // color (r, g, b)
+    // color (r, g, b). The lines of the buffer start at 64-byte aligned
+    // addresses, i.e. the pitch is rounded up to a multiple of 16 pixels.
     static ImageSlice createImage(int width, int height, uint8_t r, uint8_t g, uint8_t b);
     static ImageSlice createImage(int width, int height, uint8_t rgb = 255);
 
+    // Returns a width x height slice in the upper left corner of backing, which
+    // should be an image created by this function or createImage. If backing
+    // is too small (or much larger than needed), it is first replaced by a new
+    // image that has some capacity to spare in both dimensions, so that
+    // repeatedly resizing the slice by small amounts reuses the same buffer.
+    // The contents of the returned slice are unspecified.
+    static ImageSlice reuseImage(ImageSlice& backing, int width, int height);
+
     // Create new buffer with contents given by strings. In rows, each element
     // contains the pixels of each row as characters. The colors mapping
     // describes which color each character represents (given as RGB triplet).
@@ -144,13 +153,7 @@ public:
         endY = max(endY, startY);
 
         for(int y = startY; y < endY; ++y) {
-            uint8_t* pos = getPixelPtr(startX, y);
-            for(int x = startX; x < endX; ++x) {
-                *(pos + 2) = r;
-                *(pos + 1) = g;
-                *(pos + 0) = b;
-                pos += 4;
-            }
+            fillLine_(getPixelPtr(startX, y), endX - startX, r, g, b);
         }
     }
     void fill(int startX, int endX, int startY, int endY, uint8_t rgb) {
@@ -168,31 +171,57 @@ public:
         }
     }
 
+    // Set the pixels of the slice covered by the given width x height mask
+    // positioned with its top left corner at (x, y) to color (r, g, b) where
+    // the mask value is at least 128; mask[y * maskPitch + x] is the mask
+    // value of pixel (x, y) of the mask. The parts of the mask outside the
+    // slice are ignored.
+    void fillMask(
+        int x, int y,
+        const uint8_t* mask, int maskWidth, int maskHeight, int maskPitch,
+        uint8_t r, uint8_t g, uint8_t b
+    ) {
+        Rect rect = Rect::intersection(
+            Rect(0, maskWidth, 0, maskHeight),
+            Rect::translate(Rect(0, width_, 0, height_), -x, -y)
+        );
+
+        for(int lineY = rect.startY; lineY < rect.endY; ++lineY) {
+            fillMaskLine_(
+                getPixelPtr(rect.startX + x, lineY + y),
+                &mask[lineY * maskPitch + rect.startX],
+                rect.endX - rect.startX,
+                r, g, b
+            );
+        }
+    }
+
+    // Copy byteCount bytes from src to dest (which may not overlap) and
+    // return true if the contents of dest changed. Faster than a separate
+    // memcmp and memcpy as both buffers are read only once.
+    static bool compareAndCopy(uint8_t* dest, const uint8_t* src, size_t byteCount);
+
     // Create an a copy of the contents of the slice as a new independent image
     // buffer (globalX() and globalY() are reset to zero). It is safe to move
     // the resulting slice to another thread and modify it there independently
     // of the modifications to the current slice in the current thread.
     ImageSlice clone() {
-        ImageSlice ret;
-
-        ret.globalBuf_.reset(new vector<uint8_t>());
-        ret.globalBuf_->reserve(4 * width_ * height_);
-        for(int y = 0; y < height_; ++y) {
-            ret.globalBuf_->insert(
-                ret.globalBuf_->end(), getPixelPtr(0, y), getPixelPtr(width_, y)
-            );
-        }
-
-        ret.buf_ = ret.globalBuf_->data();
-        ret.width_ = width_;
-        ret.height_ = height_;
-        ret.pitch_ = width_;
-        ret.globalX_ = 0;
-        ret.globalY_ = 0;
+        ImageSlice ret = createImage(width_, height_);
+        ret.putImage(*this, 0, 0);
         return ret;
     }
 
 private:
+    // Set count pixels starting from dest to color (r, g, b) (the fourth
+    // byte of each pixel is left untouched)
+    static void fillLine_(uint8_t* dest, int count, uint8_t r, uint8_t g, uint8_t b);
+
+    // Line of fillMask
+    static void fillMaskLine_(
+        uint8_t* dest, const uint8_t* mask, int count,
+        uint8_t r, uint8_t g, uint8_t b
+    );
+
     void clampBoundX_(int& x) {
         x = max(min(x, width_), 0);
     }
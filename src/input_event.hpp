@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+// Input event relayed by the vice plugin to a window. The fields have the same
+// meaning as the arguments of the corresponding Window::send*Event functions;
+// the fields not used by the type of the event are ignored.
+struct InputEvent {
+    enum Type {
+        MouseDown,
+        MouseUp,
+        MouseMove,
+        MouseDoubleClick,
+        MouseWheel,
+        MouseLeave,
+        KeyDown,
+        KeyUp,
+        LoseFocus
+    };
+    Type type;
+    int x;
+    int y;
+    int button;
+    int dx;
+    int dy;
+    int key;
+};
+
+}
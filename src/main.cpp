@@ -1,12 +1,18 @@
 #include "globals.hpp"
+#include "message_pump.hpp"
+#include "resource_profile.hpp"
 #include "server.hpp"
 #include "scheme.hpp"
+#include "supervisor.hpp"
+#include "trace.hpp"
 #include "vice.hpp"
 #include "xvfb.hpp"
 
 #include <csignal>
 #include <cstdlib>
 
+#include <unistd.h>
+
 #include "include/wrapper/cef_closure_task.h"
 #include "include/base/cef_callback.h"
 #include "include/cef_app.h"
@@ -17,6 +23,13 @@ namespace browservice {
 
 namespace {
 
+shared_ptr<MessagePump> messagePump;
+steady_clock::time_point startTime;
+
+int64_t msSinceStart() {
+    return duration_cast<milliseconds>(steady_clock::now() - startTime).count();
+}
+
 class AppServerEventHandler : public ServerEventHandler {
 SHARED_ONLY_CLASS(AppServerEventHandler);
 public:
@@ -24,7 +37,11 @@ public:
 
     virtual void onServerShutdownComplete() override {
         INFO_LOG("Quitting CEF message loop");
-        CefQuitMessageLoop();
+        if(messagePump) {
+            messagePump->quit();
+        } else {
+            CefQuitMessageLoop();
+        }
     }
 };
 
@@ -70,21 +87,48 @@ public:
         }
 
         commandLine->AppendSwitch("disable-smooth-scrolling");
-        commandLine->AppendSwitchWithValue("use-gl", "desktop");
+        if(globals->config->chromiumGpuRasterSwitch) {
+            commandLine->AppendSwitchWithValue("use-gl", "egl");
+            commandLine->AppendSwitch("enable-gpu-rasterization");
+        } else {
+            commandLine->AppendSwitchWithValue("use-gl", "desktop");
+        }
 
-        for(const pair<string, optional<string>>& arg : globals->config->chromiumArgs) {
-            if(arg.second) {
-                commandLine->AppendSwitchWithValue(arg.first, *arg.second);
-            } else {
-                commandLine->AppendSwitch(arg.first);
+        auto appendSwitches = [&](const vector<pair<string, optional<string>>>& args) {
+            for(const pair<string, optional<string>>& arg : args) {
+                if(arg.second) {
+                    commandLine->AppendSwitchWithValue(arg.first, *arg.second);
+                } else {
+                    commandLine->AppendSwitch(arg.first);
+                }
             }
+        };
+
+        // Without a data directory, the HTTP cache is kept in memory, where
+        // Chromium applies the disk cache size limit
+        if(globals->config->dataDir.empty() && globals->config->memoryCacheSize > 0) {
+            commandLine->AppendSwitchWithValue(
+                "disk-cache-size",
+                toString((int64_t)globals->config->memoryCacheSize << 20)
+            );
         }
+
+        optional<ResourceProfile> profile =
+            getResourceProfile(globals->config->resourceProfile);
+        REQUIRE(profile);
+        appendSwitches(profile->chromiumSwitches);
+        appendSwitches(globals->config->chromiumArgs);
     }
     virtual void OnRegisterCustomSchemes(CefRawPtr<CefSchemeRegistrar> registrar) {
         registrar->AddCustomScheme("browservice", CEF_SCHEME_OPTION_LOCAL | CEF_SCHEME_OPTION_DISPLAY_ISOLATED);
     }
 
     // CefBrowserProcessHandler (may be used with initialized_ = false in other processes):
+    virtual void OnScheduleMessagePumpWork(int64 delayMs) override {
+        if(messagePump) {
+            messagePump->scheduleWork((int64_t)delayMs);
+        }
+    }
     virtual void OnContextInitialized() override {
         if(!initialized_) {
             return;
@@ -96,8 +140,11 @@ public:
         CefRefPtr<BrowserviceSchemeHandlerFactory> schemeHandlerFactory = new BrowserviceSchemeHandlerFactory();
         CefRegisterSchemeHandlerFactory("browservice", "", schemeHandlerFactory);
 
+        INFO_LOG("CEF initialized in ", msSinceStart(), " ms since startup");
+
         server_ = Server::create(serverEventHandler_, viceCtx_);
         viceCtx_.reset();
+        INFO_LOG("Startup completed in ", msSinceStart(), " ms");
         if(shutdown_) {
             server_->shutdown();
         }
@@ -116,13 +163,21 @@ private:
 CefRefPtr<App> app;
 bool termSignalReceived = false;
 
+// The log queue uses a mutex, so it cannot be used in signal handlers; the
+// message is written directly instead.
+void logTermSignal() {
+    const char msg[] = "INFO @ main -- Got termination signal, initiating shutdown\n";
+    ssize_t ignored = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)ignored;
+}
+
 void handleTermSignalSetFlag(int signalID) {
-    INFO_LOG("Got signal ", signalID, ", initiating shutdown");
+    logTermSignal();
     termSignalReceived = true;
 }
 
 void handleTermSignalInApp(int signalID) {
-    INFO_LOG("Got signal ", signalID, ", initiating shutdown");
+    logTermSignal();
     CefPostTask(TID_UI, base::Bind(&App::shutdown, app));
 }
 
@@ -139,37 +194,85 @@ int main(int argc, char* argv[]) {
 
     int exitCode = CefExecuteProcess(mainArgs, app, nullptr);
     if(exitCode >= 0) {
+        flushLogs();
         return exitCode;
     }
 
     signal(SIGINT, handleTermSignalSetFlag);
     signal(SIGTERM, handleTermSignalSetFlag);
 
+    startTime = steady_clock::now();
+
     shared_ptr<Config> config = Config::read(argc, argv);
     if(!config) {
         return 1;
     }
 
+    if(config->workers > 0) {
+        int supervisorExitCode = runSupervisor(config, argc, argv);
+        flushLogs();
+        return supervisorExitCode;
+    }
+
+    // Xvfb starts up in the background while we load the vice plugin; we only
+    // wait for it right before initializing CEF. The plugin binds its HTTP
+    // socket when its context is initialized, so clients connecting during
+    // the rest of the startup are held instead of refused.
+    shared_ptr<Xvfb> xvfb;
+    if(config->useDedicatedXvfb) {
+        xvfb = Xvfb::create();
+    }
+
+    if(!config->traceFile.empty()) {
+        if(!startTracing(config->traceFile)) {
+            flushLogs();
+            cerr << "ERROR: Opening trace file " << config->traceFile << " failed\n";
+            return 1;
+        }
+        INFO_LOG("Writing input latency trace to ", config->traceFile);
+    }
+
     INFO_LOG("Loading vice plugin ", config->vicePlugin);
     shared_ptr<VicePlugin> vicePlugin = VicePlugin::load(config->vicePlugin);
     if(!vicePlugin) {
+        flushLogs();
         cerr << "ERROR: Loading vice plugin " << config->vicePlugin << " failed\n";
         return 1;
     }
 
+    // Add the vice plugin option defaults of the resource profile for the
+    // options that the plugin supports and that were not given
+    vector<pair<string, string>> viceOpts = config->viceOpts;
+    optional<ResourceProfile> profile = getResourceProfile(config->resourceProfile);
+    REQUIRE(profile);
+    set<string> supportedViceOpts;
+    for(const VicePlugin::OptionDocsItem& item : vicePlugin->getOptionDocs()) {
+        supportedViceOpts.insert(item.name);
+    }
+    set<string> givenViceOpts;
+    for(const pair<string, string>& opt : viceOpts) {
+        givenViceOpts.insert(opt.first);
+    }
+    for(const pair<string, string>& opt : profile->viceOpts) {
+        if(supportedViceOpts.count(opt.first) && !givenViceOpts.count(opt.first)) {
+            viceOpts.push_back(opt);
+        }
+    }
+
     INFO_LOG("Initializing vice plugin ", config->vicePlugin);
     shared_ptr<ViceContext> viceCtx =
-        ViceContext::init(vicePlugin, config->viceOpts);
+        ViceContext::init(vicePlugin, viceOpts);
     if(!viceCtx) {
+        flushLogs();
         return 1;
     }
 
     vicePlugin.reset();
+    INFO_LOG("Vice plugin initialized in ", msSinceStart(), " ms since startup");
 
-    shared_ptr<Xvfb> xvfb;
-    if(config->useDedicatedXvfb) {
-        xvfb = Xvfb::create();
+    if(xvfb) {
         xvfb->setupEnv();
+        INFO_LOG("Xvfb ready in ", msSinceStart(), " ms since startup");
     }
 
     globals = Globals::create(config);
@@ -185,6 +288,10 @@ int main(int argc, char* argv[]) {
         CefSettings settings;
         settings.windowless_rendering_enabled = true;
         settings.command_line_args_disabled = true;
+        if(globals->config->externalMessagePump) {
+            settings.external_message_pump = true;
+            messagePump = MessagePump::create();
+        }
         CefString(&settings.cache_path).FromString(globals->config->dataDir);
         CefString(&settings.user_agent).FromString(globals->config->userAgent);
 
@@ -202,7 +309,11 @@ int main(int argc, char* argv[]) {
         }
 
         setRequireUIThreadEnabled(true);
-        CefRunMessageLoop();
+        if(messagePump) {
+            messagePump->run();
+        } else {
+            CefRunMessageLoop();
+        }
         setRequireUIThreadEnabled(false);
 
         signal(SIGINT, [](int) {});
@@ -211,10 +322,14 @@ int main(int argc, char* argv[]) {
         CefShutdown();
 
         app = nullptr;
+        messagePump.reset();
     }
 
     globals.reset();
     xvfb.reset();
 
+    stopTracing();
+
+    flushLogs();
     return 0;
 }
@@ -0,0 +1,135 @@
+#include "memory_pressure.hpp"
+
+namespace browservice {
+
+namespace {
+
+// Returns the directory of the cgroup v2 hierarchy of this process, or an
+// empty string if it cannot be determined.
+string findCgroupDir() {
+    ifstream fp("/proc/self/cgroup");
+    string line;
+    while(getline(fp, line)) {
+        // cgroup v2 entries are of the form "0::/path"
+        if(line.size() >= 3 && line.substr(0, 3) == "0::") {
+            string path = line.substr(3);
+            if(path == "/") {
+                path.clear();
+            }
+            return "/sys/fs/cgroup" + path;
+        }
+    }
+    return "";
+}
+
+bool fileExists(const string& path) {
+    ifstream fp(path);
+    return fp.good();
+}
+
+}
+
+MemoryPressureMonitor::MemoryPressureMonitor(CKey, double thresholdPercent) {
+    thresholdPercent_ = thresholdPercent;
+
+    string cgroupDir = findCgroupDir();
+    if(!cgroupDir.empty() && fileExists(cgroupDir + "/memory.pressure")) {
+        pressurePath_ = cgroupDir + "/memory.pressure";
+    } else if(fileExists("/proc/pressure/memory")) {
+        pressurePath_ = "/proc/pressure/memory";
+    }
+    if(!cgroupDir.empty() && fileExists(cgroupDir + "/memory.events")) {
+        eventsPath_ = cgroupDir + "/memory.events";
+    }
+
+    if(pressurePath_.empty() && eventsPath_.empty()) {
+        WARNING_LOG(
+            "Memory pressure information is not available (neither PSI nor "
+            "cgroup v2 memory events found), memory pressure monitoring disabled"
+        );
+    } else {
+        INFO_LOG(
+            "Monitoring memory pressure using ",
+            pressurePath_.empty() ? "(no PSI)" : pressurePath_, " and ",
+            eventsPath_.empty() ? "(no cgroup events)" : eventsPath_
+        );
+    }
+
+    lastLimitEventCount_ = readLimitEventCount_();
+}
+
+bool MemoryPressureMonitor::check() {
+    bool high = false;
+
+    optional<double> stallPercent = readStallPercent_();
+    if(stallPercent && *stallPercent >= thresholdPercent_) {
+        high = true;
+    }
+
+    optional<uint64_t> limitEventCount = readLimitEventCount_();
+    if(
+        limitEventCount &&
+        lastLimitEventCount_ &&
+        *limitEventCount > *lastLimitEventCount_
+    ) {
+        high = true;
+    }
+    if(limitEventCount) {
+        lastLimitEventCount_ = limitEventCount;
+    }
+
+    return high;
+}
+
+optional<double> MemoryPressureMonitor::readStallPercent_() {
+    if(pressurePath_.empty()) {
+        return {};
+    }
+
+    // The line we need is of the form
+    // "some avg10=1.23 avg60=0.45 avg300=0.12 total=123456"
+    ifstream fp(pressurePath_);
+    string line;
+    while(getline(fp, line)) {
+        stringstream ss(line);
+        string kind;
+        ss >> kind;
+        if(kind != "some") {
+            continue;
+        }
+        string item;
+        while(ss >> item) {
+            if(item.size() > 6 && item.substr(0, 6) == "avg10=") {
+                optional<double> val = parseString<double>(item.substr(6));
+                if(val) {
+                    return val;
+                }
+            }
+        }
+    }
+    return {};
+}
+
+optional<uint64_t> MemoryPressureMonitor::readLimitEventCount_() {
+    if(eventsPath_.empty()) {
+        return {};
+    }
+
+    // Sum of the "high" and "max" counters, which are incremented when the
+    // cgroup memory usage hits the corresponding limits
+    ifstream fp(eventsPath_);
+    if(!fp.good()) {
+        return {};
+    }
+    uint64_t count = 0;
+    string name;
+    uint64_t val;
+    while(fp >> name >> val) {
+        if(name == "high" || name == "max") {
+            count += val;
+        }
+    }
+    return count;
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+// Monitors the memory pressure of the cgroup of the process (or the whole
+// system if the cgroup files are not available) using the pressure stall
+// information (memory.pressure) and the memory.events counters of cgroup v2.
+class MemoryPressureMonitor {
+SHARED_ONLY_CLASS(MemoryPressureMonitor);
+public:
+    // thresholdPercent is the share of time (averaged over the last 10
+    // seconds) during which some tasks must have been stalled waiting for
+    // memory for the pressure to be considered high.
+    MemoryPressureMonitor(CKey, double thresholdPercent);
+
+    // Returns true if the memory pressure is high, i.e. the stall time share
+    // is over the threshold, or the cgroup has hit its memory.high or
+    // memory.max limit since the previous call.
+    bool check();
+
+private:
+    optional<double> readStallPercent_();
+    optional<uint64_t> readLimitEventCount_();
+
+    double thresholdPercent_;
+
+    string pressurePath_;
+    string eventsPath_;
+
+    optional<uint64_t> lastLimitEventCount_;
+};
+
+}
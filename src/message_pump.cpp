@@ -0,0 +1,132 @@
+#include "message_pump.hpp"
+
+#include "include/cef_app.h"
+
+namespace browservice {
+
+namespace {
+
+// The pump that is currently in run(), if any.
+mutex activePumpMutex;
+weak_ptr<MessagePump> activePump;
+
+// Number of CefDoMessageLoopWork calls made after quitting to let CEF finish
+// the pending work before CefShutdown.
+const int ShutdownWorkIterations = 10;
+
+}
+
+MessagePump::MessagePump(CKey) {
+    workTime_ = steady_clock::now();
+    running_ = false;
+    quit_ = false;
+}
+
+MessagePump::~MessagePump() {
+    REQUIRE(!running_);
+}
+
+void MessagePump::run() {
+    REQUIRE_UI_THREAD();
+    REQUIRE(!running_ && !quit_);
+
+    running_ = true;
+    {
+        lock_guard<mutex> lock(activePumpMutex);
+        activePump = shared_from_this();
+    }
+
+    unique_lock<mutex> lock(mutex_);
+    while(!quit_) {
+        if(urgentTasks_.empty() && steady_clock::now() < workTime_) {
+            steady_clock::time_point workTime = workTime_;
+            cv_.wait_until(lock, workTime);
+            continue;
+        }
+
+        if(!urgentTasks_.empty()) {
+            deque<function<void()>> tasks;
+            swap(tasks, urgentTasks_);
+            lock.unlock();
+            for(function<void()>& task : tasks) {
+                task();
+            }
+            lock.lock();
+            continue;
+        }
+
+        // CEF may schedule the next work earlier during the call
+        workTime_ = steady_clock::now() + milliseconds(MaxWorkDelayMs);
+        lock.unlock();
+        CefDoMessageLoopWork();
+        lock.lock();
+    }
+
+    // As quit_ is set, the urgent tasks posted from now on go to the CEF task
+    // queue, which is still run by the calls below
+    deque<function<void()>> tasks;
+    swap(tasks, urgentTasks_);
+    lock.unlock();
+
+    {
+        lock_guard<mutex> lock(activePumpMutex);
+        activePump.reset();
+    }
+
+    for(function<void()>& task : tasks) {
+        postTask(move(task));
+    }
+    for(int i = 0; i < ShutdownWorkIterations; ++i) {
+        CefDoMessageLoopWork();
+    }
+
+    running_ = false;
+}
+
+void MessagePump::quit() {
+    REQUIRE_UI_THREAD();
+
+    lock_guard<mutex> lock(mutex_);
+    REQUIRE(running_);
+    quit_ = true;
+}
+
+void MessagePump::scheduleWork(int64_t delayMs) {
+    steady_clock::time_point time =
+        steady_clock::now() + milliseconds(max(delayMs, (int64_t)0));
+    {
+        lock_guard<mutex> lock(mutex_);
+        if(time >= workTime_) {
+            return;
+        }
+        workTime_ = time;
+    }
+    cv_.notify_one();
+}
+
+void MessagePump::postUrgentTask(function<void()> func) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if(!quit_) {
+            urgentTasks_.push_back(move(func));
+            cv_.notify_one();
+            return;
+        }
+    }
+    postTask(move(func));
+}
+
+void postUrgentTask(function<void()> func) {
+    shared_ptr<MessagePump> pump;
+    {
+        lock_guard<mutex> lock(activePumpMutex);
+        pump = activePump.lock();
+    }
+    if(pump) {
+        pump->postUrgentTask(move(func));
+    } else {
+        postTask(move(func));
+    }
+}
+
+}
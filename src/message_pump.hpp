@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+// Message loop used instead of CefRunMessageLoop when CEF is initialized with
+// external_message_pump (option external-message-pump). The main thread calls
+// CefDoMessageLoopWork when CEF has scheduled work through
+// OnScheduleMessagePumpWork, and at least every MaxWorkDelayMs. Between the
+// calls, it runs the tasks posted using postUrgentTask as soon as they are
+// posted, instead of queuing them behind the pending Chromium tasks in the CEF
+// UI thread task queue.
+class MessagePump : public enable_shared_from_this<MessagePump> {
+SHARED_ONLY_CLASS(MessagePump);
+public:
+    static constexpr int64_t MaxWorkDelayMs = 1000 / 30;
+
+    MessagePump(CKey);
+    ~MessagePump();
+
+    // Runs the loop in the calling thread (the CEF UI thread) until quit is
+    // called. May be called only once.
+    void run();
+
+    // Ends run after the current iteration. Must be called from the loop.
+    void quit();
+
+    // Called by CefBrowserProcessHandler::OnScheduleMessagePumpWork; may be
+    // called from any thread.
+    void scheduleWork(int64_t delayMs);
+
+    // May be called from any thread.
+    void postUrgentTask(function<void()> func);
+
+private:
+    mutex mutex_;
+    condition_variable cv_;
+    steady_clock::time_point workTime_;
+    deque<function<void()>> urgentTasks_;
+    bool running_;
+    bool quit_;
+};
+
+// Posts func to be run in the UI thread ahead of the queued CEF tasks if a
+// MessagePump is running; otherwise, same as postTask.
+void postUrgentTask(function<void()> func);
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Static tracepoints (USDT) at the hot points of the rendering pipeline, for
+// example for use with bpftrace:
+//
+//   bpftrace -e 'usdt:./browservice:browservice:paint { @[arg0] = count(); }'
+//
+// A probe compiles to a single nop instruction and a note section entry, so it
+// has no measurable overhead when nobody is tracing. The probes are compiled
+// out if <sys/sdt.h> (provided by systemtap-sdt-dev) is not available. Probe
+// arguments must be integers or pointers.
+
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BROWSERVICE_HAS_PROBES
+#endif
+#endif
+
+#ifdef BROWSERVICE_HAS_PROBES
+#define PROBE(name, ...) STAP_PROBEV(browservice, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do {} while(false)
+#endif
@@ -53,6 +53,32 @@ struct Rect {
             min(rect1.endY, rect2.endY)
         );
     }
+
+    // Smallest rectangle containing both rectangles (empty rectangles are
+    // ignored)
+    static Rect boundingBox(Rect rect1, Rect rect2) {
+        if(rect1.isEmpty()) {
+            return rect2;
+        }
+        if(rect2.isEmpty()) {
+            return rect1;
+        }
+        return Rect(
+            min(rect1.startX, rect2.startX),
+            max(rect1.endX, rect2.endX),
+            min(rect1.startY, rect2.startY),
+            max(rect1.endY, rect2.endY)
+        );
+    }
+
+    // Returns true if other is contained in this rectangle (the empty rectangle
+    // is contained in every rectangle)
+    bool contains(Rect other) const {
+        return other.isEmpty() || (
+            other.startX >= startX && other.endX <= endX &&
+            other.startY >= startY && other.endY <= endY
+        );
+    }
 };
 
 }
@@ -0,0 +1,45 @@
+#include "resource_profile.hpp"
+
+namespace browservice {
+
+optional<ResourceProfile> getResourceProfile(const string& name) {
+    ResourceProfile profile;
+    if(name == "low-memory") {
+        // Share renderer processes between tabs of the same site and cap their
+        // count, and avoid keeping pages and spare renderers around for
+        // possible later use. Rendering and compression run at a lower rate
+        // with fewer threads.
+        profile.maxFps = 15;
+        profile.renderFps = 15;
+        profile.idleRenderFps = 2;
+        profile.chromiumSwitches = {
+            {"process-per-site", {}},
+            {"renderer-process-limit", string("4")},
+            {
+                "disable-features",
+                string("BackForwardCache,SpareRendererForSitePerProcess")
+            }
+        };
+        profile.viceOpts = {
+            {"compression-threads", "1"},
+            {"http-max-threads", "16"}
+        };
+    } else if(name == "balanced") {
+        // The defaults of the individual options
+        profile.maxFps = 30;
+        profile.renderFps = 30;
+        profile.idleRenderFps = 5;
+    } else if(name == "throughput") {
+        profile.maxFps = 60;
+        profile.renderFps = 60;
+        profile.idleRenderFps = 10;
+        profile.viceOpts = {
+            {"http-max-threads", "200"}
+        };
+    } else {
+        return {};
+    }
+    return profile;
+}
+
+}
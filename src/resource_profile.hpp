@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+// Preset selected by the resource-profile option that trades memory use
+// against throughput.
+struct ResourceProfile {
+    // Defaults for the corresponding options when they are not given.
+    int maxFps;
+    int renderFps;
+    int idleRenderFps;
+
+    // Chromium switches, appended before the ones given in chromium-args.
+    vector<pair<string, optional<string>>> chromiumSwitches;
+
+    // Defaults for vice plugin options, used for the options that the vice
+    // plugin supports and that are not given on the command line.
+    vector<pair<string, string>> viceOpts;
+};
+
+// Returns empty if there is no profile with given name.
+optional<ResourceProfile> getResourceProfile(const string& name);
+
+}
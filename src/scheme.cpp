@@ -8,10 +8,16 @@ namespace {
 
 class StaticResponseResourceHandler : public CefResourceHandler {
 public:
-    StaticResponseResourceHandler(int status, string statusText, string response) {
+    StaticResponseResourceHandler(
+        int status,
+        string statusText,
+        shared_ptr<const string> response,
+        string etag = ""
+    ) {
         status_ = status;
         statusText_ = move(statusText);
         response_ = move(response);
+        etag_ = move(etag);
         pos_ = 0;
     }
 
@@ -29,11 +35,16 @@ public:
         int64_t& responseLength,
         CefString& redirectUrl
     ) override{
-        responseLength = (int64_t)response_.size();
+        responseLength = (int64_t)response_->size();
         response->SetStatus(status_);
         response->SetStatusText(statusText_);
         response->SetMimeType("text/html");
         response->SetCharset("UTF-8");
+        if(!etag_.empty()) {
+            // Require revalidation using the ETag on every navigation
+            response->SetHeaderByName("Cache-Control", "no-cache", true);
+            response->SetHeaderByName("ETag", etag_, true);
+        }
     }
 
     virtual bool Skip(
@@ -41,7 +52,7 @@ public:
         int64_t& bytesSkipped,
         CefRefPtr<CefResourceSkipCallback> callback
     ) override {
-        int64_t maxSkip = (int64_t)(response_.size() - pos_);
+        int64_t maxSkip = (int64_t)(response_->size() - pos_);
         int64_t skipCount = min(bytesToSkip, maxSkip);
         REQUIRE(skipCount >= (int64_t)0);
 
@@ -61,13 +72,13 @@ public:
         int& bytesRead,
         CefRefPtr<CefResourceReadCallback> callback
     ) override {
-        int64_t maxRead = (int64_t)(response_.size() - pos_);
+        int64_t maxRead = (int64_t)(response_->size() - pos_);
         int readCount = (int)min((int64_t)bytesToRead, maxRead);
         REQUIRE(readCount >= 0);
 
         if(readCount > 0) {
             bytesRead = readCount;
-            memcpy(dataOut, response_.data() + pos_, (size_t)readCount);
+            memcpy(dataOut, response_->data() + pos_, (size_t)readCount);
             pos_ += (size_t)readCount;
             return true;
         } else {
@@ -77,14 +88,15 @@ public:
     }
 
     virtual void Cancel() override {
-        response_.clear();
+        response_ = make_shared<string>();
         pos_ = 0;
     }
 
 private:
     int status_;
     string statusText_;
-    string response_;
+    shared_ptr<const string> response_;
+    string etag_;
     size_t pos_;
 
     IMPLEMENT_REFCOUNTING(StaticResponseResourceHandler);
@@ -101,17 +113,22 @@ CefRefPtr<CefResourceHandler> BrowserviceSchemeHandlerFactory::Create(
     CEF_REQUIRE_IO_THREAD();
     REQUIRE(request);
 
-    int status = 404;
-    string statusText = "Not Found";
+    if(request->GetURL() == "browservice:bookmarks") {
+        BookmarksResponse response = handleBookmarksRequest(request);
+        return new StaticResponseResourceHandler(
+            response.status,
+            move(response.statusText),
+            move(response.body),
+            move(response.etag)
+        );
+    }
+
     string response =
         "<!DOCTYPE html>\n<html lang=\"en\"><head><meta charset=\"UTF-8\">"
         "<title>404 Not Found</title></head><body><h1>404 Not Found</h1></body></html>\n";
-    if(request->GetURL() == "browservice:bookmarks") {
-        status = 200;
-        statusText = "OK";
-        response = handleBookmarksRequest(request);
-    }
-    return new StaticResponseResourceHandler(status, move(statusText), move(response));
+    return new StaticResponseResourceHandler(
+        404, "Not Found", make_shared<string>(move(response))
+    );
 }
 
 }
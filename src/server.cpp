@@ -1,10 +1,26 @@
 #include "server.hpp"
 
+#include "frame_capture.hpp"
 #include "globals.hpp"
+#include "memory_pressure.hpp"
+#include "session_snapshot.hpp"
+#include "timeout.hpp"
 #include "xwindow.hpp"
 
 namespace browservice {
 
+namespace {
+
+const int64_t MemoryPressureCheckIntervalMs = 5000;
+const int64_t WatchdogIntervalMs = 1000;
+const int64_t LaunchTimeoutMs = 20000;
+
+// Window creation URI prefix for restoring windows from the session snapshot
+// (see restore-snapshot).
+const string RestoreURIPrefix = "browservice:restore/";
+
+}
+
 Server::Server(CKey,
     weak_ptr<ServerEventHandler> eventHandler,
     shared_ptr<ViceContext> viceCtx
@@ -12,9 +28,15 @@ Server::Server(CKey,
     REQUIRE_UI_THREAD();
     eventHandler_ = eventHandler;
     state_ = Running;
-    nextWindowHandle_ = 1;
+    nextWindowHandle_ = (uint64_t)globals->config->windowHandleShard.first;
+    if(nextWindowHandle_ == 0) {
+        nextWindowHandle_ = (uint64_t)globals->config->windowHandleShard.second;
+    }
     viceCtx_ = viceCtx;
     clipboardContentRequested_ = false;
+    windowPoolRefillScheduled_ = false;
+    pendingSnapshotWrites_ = 0;
+    cookieSnapshotInProgress_ = false;
 
     // Setup is finished in afterConstruct_
 }
@@ -26,6 +48,22 @@ void Server::shutdown() {
         state_ = WaitWindows;
         INFO_LOG("Shutting down server");
 
+        if(memoryPressureTimeout_) {
+            memoryPressureTimeout_->clear(false);
+        }
+        watchdogTimeout_->clear(false);
+
+        launchingWindows_.clear();
+        launchQueue_.clear();
+
+        if(!globals->config->snapshotFile.empty()) {
+            writeSnapshot_();
+        }
+        if(cookieSnapshotTimeout_) {
+            cookieSnapshotTimeout_->clear(false);
+            writeCookieSnapshot_();
+        }
+
         map<uint64_t, shared_ptr<Window>> windows;
         swap(windows, openWindows_);
         for(pair<uint64_t, shared_ptr<Window>> p : windows) {
@@ -34,6 +72,13 @@ void Server::shutdown() {
             REQUIRE(cleanupWindows_.insert(p).second);
         }
 
+        map<uint64_t, shared_ptr<Window>> pooled;
+        swap(pooled, pooledWindows_);
+        for(pair<uint64_t, shared_ptr<Window>> p : pooled) {
+            p.second->close();
+            REQUIRE(cleanupWindows_.insert(p).second);
+        }
+
         checkCleanupComplete_();
     }
 }
@@ -58,12 +103,73 @@ uint64_t Server::onViceContextCreateWindowRequest(string& reason, optional<strin
         return 0;
     }
 
-    uint64_t handle = nextWindowHandle_++;
+    // Clients redirected from a drained instance reopen the pages of their
+    // windows from the session snapshot, proving that the window is theirs
+    // with its token (path /goto/browservice:restore/HANDLE/TOKEN)
+    if(
+        uri.has_value() &&
+        uri->compare(0, RestoreURIPrefix.size(), RestoreURIPrefix) == 0
+    ) {
+        string rest = uri->substr(RestoreURIPrefix.size());
+        uri.reset();
+        size_t sep = rest.find('/');
+        optional<uint64_t> oldHandle;
+        if(sep != string::npos) {
+            oldHandle = parseString<uint64_t>(rest.substr(0, sep));
+        }
+        if(oldHandle.has_value()) {
+            auto it = restorableWindows_.find(*oldHandle);
+            if(
+                it != restorableWindows_.end() &&
+                snapshotTokensEqual(rest.substr(sep + 1), it->second.token)
+            ) {
+                INFO_LOG("Restoring window ", *oldHandle, " of the session snapshot");
+                if(!it->second.uri.empty()) {
+                    uri = it->second.uri;
+                }
+                restorableWindows_.erase(it);
+            } else if(it != restorableWindows_.end()) {
+                WARNING_LOG(
+                    "Denying restoration of window ", *oldHandle,
+                    " of the session snapshot due to wrong token"
+                );
+            }
+        }
+    }
+
+    if(!pooledWindows_.empty()) {
+        auto it = pooledWindows_.begin();
+        uint64_t handle = it->first;
+        shared_ptr<Window> window = it->second;
+        pooledWindows_.erase(it);
+
+        INFO_LOG("Handing out pooled window ", handle);
+        REQUIRE(openWindows_.emplace(handle, window).second);
+        window->activate(uri);
+        refillWindowPool_();
+        return handle;
+    }
+
+    uint64_t handle = allocateWindowHandle_();
     REQUIRE(handle);
 
+    if((int)launchingWindows_.size() >= globals->config->launchLimit) {
+        INFO_LOG(
+            "Queueing the browser launch of window ", handle, " (",
+            launchingWindows_.size(), " launches in progress, ",
+            launchQueue_.size(), " queued before it)"
+        );
+        shared_ptr<Window> window =
+            Window::createQueued(shared_from_this(), handle, uri);
+        REQUIRE(openWindows_.emplace(handle, window).second);
+        launchQueue_.push_back(handle);
+        return handle;
+    }
+
     shared_ptr<Window> window = Window::tryCreate(shared_from_this(), handle, uri);
     if(window) {
         REQUIRE(openWindows_.emplace(handle, window).second);
+        launchingWindows_[handle] = steady_clock::now();
         return handle;
     } else {
         reason = "Creating CEF browser for window failed";
@@ -84,6 +190,8 @@ void Server::onViceContextCloseWindow(uint64_t window) {
 
     windowPtr->close();
     REQUIRE(cleanupWindows_.emplace(handle, windowPtr).second);
+
+    launchFinished_(handle);
 }
 
 void Server::onViceContextResizeWindow(
@@ -112,9 +220,43 @@ void Server::onViceContextFetchWindowImage(
     if(image.width() < 1 || image.height() < 1) {
         image = ImageSlice::createImage(1, 1);
     }
+    if(frameCapture_) {
+        frameCapture_->recordFrame(
+            window, image.buf(), image.width(), image.height(), image.pitch()
+        );
+    }
     putImage(image.buf(), image.width(), image.height(), image.pitch());
 }
 
+void Server::onViceContextFetchWindowFrame(
+    uint64_t window,
+    function<void(
+        const uint8_t*, size_t, size_t, size_t, shared_ptr<void>
+    )> putFrame
+) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+
+    auto it = openWindows_.find(window);
+    REQUIRE(it != openWindows_.end());
+
+    ImageSlice image;
+    shared_ptr<void> owner;
+    tie(image, owner) = it->second->fetchViewFrame();
+    if(image.width() < 1 || image.height() < 1) {
+        image = ImageSlice::createImage(1, 1);
+        owner = make_shared<ImageSlice>(image);
+    }
+    if(frameCapture_) {
+        frameCapture_->recordFrame(
+            window, image.buf(), image.width(), image.height(), image.pitch()
+        );
+    }
+    putFrame(
+        image.buf(), image.width(), image.height(), image.pitch(), move(owner)
+    );
+}
+
 #define FORWARD_INPUT_EVENT(Name, args, call) \
     void Server::onViceContext ## Name args { \
         REQUIRE_UI_THREAD(); \
@@ -172,6 +314,29 @@ FORWARD_INPUT_EVENT(
     ()
 )
 
+void Server::onViceContextInputEvents(
+    uint64_t window,
+    const vector<InputEvent>& events
+) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+
+    auto it = openWindows_.find(window);
+    REQUIRE(it != openWindows_.end());
+
+    it->second->sendInputEvents(events);
+}
+
+void Server::onViceContextInputTraced(uint64_t window, uint64_t traceId) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+
+    auto it = openWindows_.find(window);
+    REQUIRE(it != openWindows_.end());
+
+    it->second->addInputTrace(traceId);
+}
+
 void Server::onViceContextNavigate(uint64_t window, int direction) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ != ShutdownComplete);
@@ -192,6 +357,16 @@ void Server::onViceContextNavigateToURI(uint64_t window, string uri) {
     it->second->navigateToURI(uri);
 }
 
+void Server::onViceContextSetWindowVisible(uint64_t window, bool visible) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+
+    auto it = openWindows_.find(window);
+    REQUIRE(it != openWindows_.end());
+
+    it->second->setVisible(visible);
+}
+
 void Server::onViceContextCopyToClipboard(string text) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ != ShutdownComplete);
@@ -272,6 +447,14 @@ void Server::onWindowClose(uint64_t handle) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ != ShutdownComplete);
 
+    auto poolIt = pooledWindows_.find(handle);
+    if(poolIt != pooledWindows_.end()) {
+        shared_ptr<Window> window = poolIt->second;
+        pooledWindows_.erase(poolIt);
+        REQUIRE(cleanupWindows_.emplace(handle, window).second);
+        return;
+    }
+
     auto it = openWindows_.find(handle);
     REQUIRE(it != openWindows_.end());
 
@@ -280,7 +463,20 @@ void Server::onWindowClose(uint64_t handle) {
 
     REQUIRE(cleanupWindows_.emplace(handle, window).second);
 
+    if(frameCapture_) {
+        frameCapture_->windowClosed(handle);
+    }
+
     viceCtx_->closeWindow(handle);
+
+    launchFinished_(handle);
+}
+
+void Server::onWindowLaunchComplete(uint64_t handle) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+
+    launchFinished_(handle);
 }
 
 void Server::onWindowCleanupComplete(uint64_t handle) {
@@ -289,14 +485,36 @@ void Server::onWindowCleanupComplete(uint64_t handle) {
 
     REQUIRE(cleanupWindows_.erase(handle));
     checkCleanupComplete_();
+    refillWindowPool_();
 }
 
-void Server::onWindowViewImageChanged(uint64_t handle) {
+void Server::onWindowViewImageChanged(uint64_t handle, Rect dirtyRect) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ != ShutdownComplete);
     REQUIRE(openWindows_.count(handle));
 
-    viceCtx_->notifyWindowViewChanged(handle);
+    if(frameCapture_) {
+        frameCapture_->recordDirtyRect(handle, dirtyRect);
+    }
+    viceCtx_->notifyWindowViewChanged(handle, dirtyRect);
+}
+
+void Server::onWindowViewTraced(uint64_t handle, uint64_t traceId) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+    REQUIRE(openWindows_.count(handle));
+
+    viceCtx_->traceWindowView(handle, traceId);
+}
+
+void Server::onWindowMediaStateChanged(uint64_t handle, bool playing) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ != ShutdownComplete);
+
+    // Standby windows in the pool are not open in the vice plugin yet
+    if(openWindows_.count(handle)) {
+        viceCtx_->setWindowMediaPlaying(handle, playing);
+    }
 }
 
 void Server::onWindowCursorChanged(uint64_t handle, int cursor) {
@@ -390,7 +608,7 @@ void Server::onWindowCreatePopupRequest(
         return;
     }
 
-    uint64_t newHandle = nextWindowHandle_++;
+    uint64_t newHandle = allocateWindowHandle_();
     REQUIRE(newHandle);
 
     INFO_LOG(
@@ -407,6 +625,7 @@ void Server::onWindowCreatePopupRequest(
         shared_ptr<Window> newWindow = accept(newHandle);
         if(newWindow) {
             REQUIRE(openWindows_.emplace(newHandle, newWindow).second);
+            trimWindowPool_();
         } else {
             WARNING_LOG("Creating popup window ", newHandle, " failed, closing it in vice plugin");
             viceCtx_->closeWindow(newHandle);
@@ -420,11 +639,350 @@ void Server::onWindowCreatePopupRequest(
 }
 
 void Server::afterConstruct_(shared_ptr<Server> self) {
+    const string& frameCaptureFile = globals->config->frameCaptureFile;
+    if(!frameCaptureFile.empty()) {
+        frameCapture_ = FrameCapture::open(frameCaptureFile);
+        if(frameCapture_) {
+            INFO_LOG("Recording the window frames to ", frameCaptureFile);
+        } else {
+            ERROR_LOG(
+                "Opening frame capture file ", frameCaptureFile,
+                " failed, frames will not be recorded"
+            );
+        }
+    }
+
+    if(!globals->config->restoreSnapshot.empty()) {
+        restoreSnapshot_();
+    }
+
+    const string& cookieSnapshotFile = globals->config->cookieSnapshotFile;
+    if(!cookieSnapshotFile.empty()) {
+        if(ifstream(cookieSnapshotFile).good()) {
+            optional<SessionSnapshot> snapshot =
+                readSessionSnapshot(cookieSnapshotFile);
+            if(snapshot.has_value()) {
+                restoreSnapshotCookies(snapshot->cookies);
+            } else {
+                ERROR_LOG(
+                    "Reading cookie snapshot ", cookieSnapshotFile,
+                    " failed, cookies not restored"
+                );
+            }
+        }
+        cookieSnapshotTimeout_ = Timeout::create(
+            1000 * (int64_t)globals->config->cookieSnapshotInterval
+        );
+        scheduleCookieSnapshot_();
+    }
+
     viceCtx_->start(self);
+    refillWindowPool_();
+
+    watchdogTimeout_ = Timeout::create(WatchdogIntervalMs);
+    runWatchdogs_();
+
+    if(globals->config->memoryPressureThreshold > 0) {
+        memoryPressureMonitor_ = MemoryPressureMonitor::create(
+            (double)globals->config->memoryPressureThreshold
+        );
+        memoryPressureTimeout_ = Timeout::create(MemoryPressureCheckIntervalMs);
+        checkMemoryPressure_();
+    }
+}
+
+void Server::refillWindowPool_() {
+    REQUIRE_UI_THREAD();
+
+    if(windowPoolRefillScheduled_) {
+        return;
+    }
+    windowPoolRefillScheduled_ = true;
+
+    // Create the windows one at a time in separate tasks to avoid stalling the
+    // event loop
+    shared_ptr<Server> self = shared_from_this();
+    postTask([self]() {
+        self->windowPoolRefillScheduled_ = false;
+
+        if(
+            self->state_ != Running ||
+            (int)self->pooledWindows_.size() >= globals->config->windowPoolSize ||
+            self->windowCount_() >= globals->config->windowLimit
+        ) {
+            return;
+        }
+
+        uint64_t handle = self->allocateWindowHandle_();
+        REQUIRE(handle);
+
+        shared_ptr<Window> window = Window::tryCreateStandby(self, handle);
+        if(window) {
+            REQUIRE(self->pooledWindows_.emplace(handle, window).second);
+            self->refillWindowPool_();
+        } else {
+            WARNING_LOG("Creating pooled window failed, not refilling the pool");
+        }
+    });
+}
+
+void Server::trimWindowPool_() {
+    REQUIRE_UI_THREAD();
+
+    // Close the newest pooled windows first, as the oldest ones are the most
+    // likely to have finished starting. The windows in cleanup are not counted
+    // here, as closing pooled windows only moves them to cleanup.
+    while(
+        !pooledWindows_.empty() &&
+        (int)openWindows_.size() + (int)pooledWindows_.size() >
+            globals->config->windowLimit
+    ) {
+        auto it = pooledWindows_.end();
+        --it;
+        uint64_t handle = it->first;
+        shared_ptr<Window> window = it->second;
+        pooledWindows_.erase(it);
+
+        INFO_LOG("Closing pooled window ", handle, " due to window limit");
+        window->close();
+        REQUIRE(cleanupWindows_.emplace(handle, window).second);
+    }
+}
+
+void Server::checkMemoryPressure_() {
+    REQUIRE_UI_THREAD();
+
+    if(state_ != Running) {
+        return;
+    }
+
+    if(memoryPressureMonitor_->check()) {
+        // Hibernate the open window with the oldest client activity that can
+        // be hibernated
+        vector<pair<steady_clock::time_point, uint64_t>> candidates;
+        for(const pair<const uint64_t, shared_ptr<Window>>& p : openWindows_) {
+            candidates.emplace_back(p.second->lastClientActivityTime(), p.first);
+        }
+        sort(candidates.begin(), candidates.end());
+
+        bool hibernated = false;
+        for(const pair<steady_clock::time_point, uint64_t>& candidate : candidates) {
+            if(openWindows_[candidate.second]->hibernate()) {
+                WARNING_LOG(
+                    "Memory pressure is high, hibernated the least recently "
+                    "used window ", candidate.second
+                );
+                hibernated = true;
+                break;
+            }
+        }
+        if(!hibernated) {
+            WARNING_LOG("Memory pressure is high, but no window can be hibernated");
+        }
+    }
+
+    weak_ptr<Server> selfWeak = shared_from_this();
+    memoryPressureTimeout_->set([selfWeak]() {
+        if(shared_ptr<Server> self = selfWeak.lock()) {
+            self->checkMemoryPressure_();
+        }
+    });
+}
+
+void Server::runWatchdogs_() {
+    REQUIRE_UI_THREAD();
+
+    if(state_ != Running) {
+        return;
+    }
+
+    // Collect the windows first in case a watchdog changes the window maps
+    vector<shared_ptr<Window>> windows;
+    windows.reserve(openWindows_.size() + pooledWindows_.size());
+    for(const pair<const uint64_t, shared_ptr<Window>>& p : openWindows_) {
+        windows.push_back(p.second);
+    }
+    for(const pair<const uint64_t, shared_ptr<Window>>& p : pooledWindows_) {
+        windows.push_back(p.second);
+    }
+    for(const shared_ptr<Window>& window : windows) {
+        window->watchdog();
+    }
+
+    // Do not let a browser that never paints hold its launch slot forever
+    steady_clock::time_point now = steady_clock::now();
+    vector<uint64_t> timedOut;
+    for(const pair<const uint64_t, steady_clock::time_point>& p : launchingWindows_) {
+        if(now - p.second >= milliseconds(LaunchTimeoutMs)) {
+            timedOut.push_back(p.first);
+        }
+    }
+    for(uint64_t handle : timedOut) {
+        WARNING_LOG("Browser launch of window ", handle, " timed out");
+        launchFinished_(handle);
+    }
+
+    weak_ptr<Server> selfWeak = shared_from_this();
+    watchdogTimeout_->set([selfWeak]() {
+        if(shared_ptr<Server> self = selfWeak.lock()) {
+            self->runWatchdogs_();
+        }
+    });
+}
+
+void Server::launchFinished_(uint64_t handle) {
+    REQUIRE_UI_THREAD();
+
+    auto queueIt = find(launchQueue_.begin(), launchQueue_.end(), handle);
+    if(queueIt != launchQueue_.end()) {
+        launchQueue_.erase(queueIt);
+    }
+
+    if(launchingWindows_.erase(handle) && !launchQueue_.empty()) {
+        // Launching may close the window and thus call us again
+        postTask(shared_from_this(), &Server::admitLaunches_);
+    }
+}
+
+void Server::admitLaunches_() {
+    REQUIRE_UI_THREAD();
+
+    while(
+        state_ == Running &&
+        !launchQueue_.empty() &&
+        (int)launchingWindows_.size() < globals->config->launchLimit
+    ) {
+        uint64_t handle = launchQueue_.front();
+        launchQueue_.pop_front();
+
+        auto it = openWindows_.find(handle);
+        REQUIRE(it != openWindows_.end());
+        shared_ptr<Window> window = it->second;
+
+        launchingWindows_[handle] = steady_clock::now();
+        window->launch();
+    }
+}
+
+int Server::windowCount_() {
+    return
+        (int)openWindows_.size() +
+        (int)cleanupWindows_.size() +
+        (int)pooledWindows_.size();
+}
+
+uint64_t Server::allocateWindowHandle_() {
+    uint64_t handle = nextWindowHandle_;
+    nextWindowHandle_ += (uint64_t)globals->config->windowHandleShard.second;
+    return handle;
+}
+
+void Server::writeSnapshot_() {
+    REQUIRE_UI_THREAD();
+
+    shared_ptr<SessionSnapshot> snapshot = make_shared<SessionSnapshot>();
+    for(const pair<uint64_t, shared_ptr<Window>>& p : openWindows_) {
+        SnapshotWindow window;
+        window.handle = p.first;
+        window.token = generateSnapshotToken();
+        window.uri = p.second->currentURI();
+        snapshot->windows.push_back(move(window));
+    }
+
+    ++pendingSnapshotWrites_;
+    shared_ptr<Server> self = shared_from_this();
+    collectSnapshotCookies([self, snapshot](vector<SnapshotCookie> cookies) {
+        REQUIRE_UI_THREAD();
+
+        snapshot->cookies = move(cookies);
+        const string& path = globals->config->snapshotFile;
+        if(writeSessionSnapshot(path, *snapshot)) {
+            INFO_LOG(
+                "Wrote session snapshot of ", snapshot->windows.size(),
+                " windows and ", snapshot->cookies.size(), " cookies to ", path
+            );
+        } else {
+            ERROR_LOG("Writing session snapshot to ", path, " failed");
+        }
+
+        --self->pendingSnapshotWrites_;
+        self->checkCleanupComplete_();
+    });
+}
+
+void Server::restoreSnapshot_() {
+    REQUIRE_UI_THREAD();
+
+    const string& path = globals->config->restoreSnapshot;
+    optional<SessionSnapshot> snapshot = readSessionSnapshot(path);
+    if(!snapshot.has_value()) {
+        ERROR_LOG(
+            "Reading session snapshot ", path, " failed, no sessions restored"
+        );
+        return;
+    }
+
+    restoreSnapshotCookies(snapshot->cookies);
+    for(SnapshotWindow& window : snapshot->windows) {
+        uint64_t handle = window.handle;
+        restorableWindows_[handle] = move(window);
+    }
+    INFO_LOG(
+        "Loaded ", restorableWindows_.size(), " restorable windows from ",
+        "session snapshot ", path
+    );
+}
+
+void Server::writeCookieSnapshot_() {
+    REQUIRE_UI_THREAD();
+
+    // The final snapshot on shutdown is collected even if a periodic one is
+    // still in progress
+    if(cookieSnapshotInProgress_ && state_ == Running) {
+        return;
+    }
+
+    cookieSnapshotInProgress_ = true;
+    ++pendingSnapshotWrites_;
+    shared_ptr<Server> self = shared_from_this();
+    collectSnapshotCookies([self](vector<SnapshotCookie> cookies) {
+        REQUIRE_UI_THREAD();
+
+        SessionSnapshot snapshot;
+        snapshot.cookies = move(cookies);
+        const string& path = globals->config->cookieSnapshotFile;
+        if(!writeSessionSnapshot(path, snapshot)) {
+            ERROR_LOG("Writing cookie snapshot to ", path, " failed");
+        }
+
+        self->cookieSnapshotInProgress_ = false;
+        --self->pendingSnapshotWrites_;
+        self->scheduleCookieSnapshot_();
+        self->checkCleanupComplete_();
+    });
+}
+
+void Server::scheduleCookieSnapshot_() {
+    REQUIRE_UI_THREAD();
+
+    if(state_ != Running || !cookieSnapshotTimeout_) {
+        return;
+    }
+
+    weak_ptr<Server> selfWeak = shared_from_this();
+    cookieSnapshotTimeout_->set([selfWeak]() {
+        if(shared_ptr<Server> self = selfWeak.lock()) {
+            self->writeCookieSnapshot_();
+        }
+    });
 }
 
 void Server::checkCleanupComplete_() {
-    if(state_ == WaitWindows && cleanupWindows_.empty()) {
+    if(
+        state_ == WaitWindows &&
+        cleanupWindows_.empty() &&
+        pendingSnapshotWrites_ == 0
+    ) {
         REQUIRE(openWindows_.empty());
         state_ = WaitViceContext;
         viceCtx_->shutdown();
@@ -1,10 +1,14 @@
 #pragma once
 
+#include "session_snapshot.hpp"
 #include "window.hpp"
 #include "vice.hpp"
 
 namespace browservice {
 
+class FrameCapture;
+class MemoryPressureMonitor;
+
 class ServerEventHandler {
 public:
     virtual void onServerShutdownComplete() = 0;
@@ -38,6 +42,12 @@ public:
         uint64_t window,
         function<void(const uint8_t*, size_t, size_t, size_t)> putImage
     ) override;
+    virtual void onViceContextFetchWindowFrame(
+        uint64_t window,
+        function<void(
+            const uint8_t*, size_t, size_t, size_t, shared_ptr<void>
+        )> putFrame
+    ) override;
     virtual void onViceContextMouseDown(
         uint64_t window, int x, int y, int button
     ) override;
@@ -55,8 +65,19 @@ public:
     virtual void onViceContextKeyDown(uint64_t window, int key) override;
     virtual void onViceContextKeyUp(uint64_t window, int key) override;
     virtual void onViceContextLoseFocus(uint64_t window) override;
+    virtual void onViceContextInputEvents(
+        uint64_t window,
+        const vector<InputEvent>& events
+    ) override;
+    virtual void onViceContextInputTraced(
+        uint64_t window,
+        uint64_t traceId
+    ) override;
     virtual void onViceContextNavigate(uint64_t window, int direction) override;
     virtual void onViceContextNavigateToURI(uint64_t window, string uri) override;
+    virtual void onViceContextSetWindowVisible(
+        uint64_t window, bool visible
+    ) override;
     virtual void onViceContextCopyToClipboard(string text) override;
     virtual void onViceContextRequestClipboardContent() override;
     virtual void onViceContextUploadFile(
@@ -68,7 +89,15 @@ public:
     // WindowEventHandler:
     virtual void onWindowClose(uint64_t handle) override;
     virtual void onWindowCleanupComplete(uint64_t handle) override;
-    virtual void onWindowViewImageChanged(uint64_t handle) override;
+    virtual void onWindowViewImageChanged(
+        uint64_t handle, Rect dirtyRect
+    ) override;
+    virtual void onWindowViewTraced(uint64_t handle, uint64_t traceId) override;
+    virtual void onWindowLaunchComplete(uint64_t handle) override;
+    virtual void onWindowMediaStateChanged(
+        uint64_t handle,
+        bool playing
+    ) override;
     virtual void onWindowCursorChanged(uint64_t handle, int cursor) override;
     virtual optional<pair<vector<string>, size_t>> onWindowQualitySelectorQuery(
         uint64_t handle
@@ -91,6 +120,54 @@ private:
 
     void checkCleanupComplete_();
 
+    // Session snapshots (see session_snapshot.hpp): on shutdown, writeSnapshot_
+    // records the pages of the open windows and collects the cookies
+    // asynchronously, and the shutdown does not proceed past closing the
+    // windows until the pending snapshot writes (pendingSnapshotWrites_) are
+    // done. restorableWindows_ maps the handles of the windows in the
+    // snapshot given by restore-snapshot to their tokens and URLs until they
+    // are restored.
+    void writeSnapshot_();
+    void restoreSnapshot_();
+
+    // Cookie snapshots (see cookie-snapshot-file): the cookies are restored
+    // from the file on startup and written to it every
+    // cookie-snapshot-interval seconds and on shutdown. A periodic write is
+    // skipped if the previous one is still collecting the cookies.
+    void writeCookieSnapshot_();
+    void scheduleCookieSnapshot_();
+
+    // Window pool: up to windowPoolSize standby windows are kept ready to be
+    // handed out by onViceContextCreateWindowRequest. The pool is refilled one
+    // window at a time in the background, such that the total number of
+    // windows does not exceed windowLimit. Pooled windows are not known to the
+    // vice plugin.
+    void refillWindowPool_();
+    void trimWindowPool_();
+    int windowCount_();
+
+    // Launch admission: at most launchLimit windows created through
+    // onViceContextCreateWindowRequest may have their browsers starting at
+    // the same time (launchingWindows_, with the launch start times); further
+    // windows are created using Window::createQueued and launched in order
+    // from launchQueue_ as the earlier launches complete, fail or time out
+    // (after LaunchTimeoutMs).
+    void launchFinished_(uint64_t handle);
+    void admitLaunches_();
+
+    // Returns the next window handle in the shard of this instance given by
+    // the window-handle-shard option.
+    uint64_t allocateWindowHandle_();
+
+    // Called periodically if memory-pressure-threshold is set; while the
+    // memory pressure is high, hibernates the open window that has been
+    // inactive for the longest time on each call.
+    void checkMemoryPressure_();
+
+    // Calls Window::watchdog for all the open and pooled windows; called every
+    // WatchdogIntervalMs while running.
+    void runWatchdogs_();
+
     weak_ptr<ServerEventHandler> eventHandler_;
 
     uint64_t nextWindowHandle_;
@@ -99,6 +176,21 @@ private:
     shared_ptr<ViceContext> viceCtx_;
     map<uint64_t, shared_ptr<Window>> openWindows_;
     map<uint64_t, shared_ptr<Window>> cleanupWindows_;
+    map<uint64_t, shared_ptr<Window>> pooledWindows_;
+    bool windowPoolRefillScheduled_;
+
+    map<uint64_t, steady_clock::time_point> launchingWindows_;
+    deque<uint64_t> launchQueue_;
+
+    shared_ptr<MemoryPressureMonitor> memoryPressureMonitor_;
+    shared_ptr<FrameCapture> frameCapture_;
+    shared_ptr<Timeout> memoryPressureTimeout_;
+    shared_ptr<Timeout> watchdogTimeout_;
+
+    int pendingSnapshotWrites_;
+    map<uint64_t, SnapshotWindow> restorableWindows_;
+    bool cookieSnapshotInProgress_;
+    shared_ptr<Timeout> cookieSnapshotTimeout_;
 
     bool clipboardContentRequested_;
 };
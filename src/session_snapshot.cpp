@@ -0,0 +1,360 @@
+#include "session_snapshot.hpp"
+
+#include "include/cef_cookie.h"
+
+#include <fcntl.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <ctime>
+
+namespace browservice {
+
+namespace {
+
+const char* SnapshotHeader = "browservice-snapshot 2";
+const char* SnapshotHeaderV1 = "browservice-snapshot 1";
+
+// Length of the window tokens in bytes (encoded as twice as many hex digits).
+const size_t SnapshotTokenBytes = 16;
+
+string escapeField(const string& str) {
+    string ret;
+    ret.reserve(str.size());
+    for(char c : str) {
+        if(c == '%' || c == '\t' || c == '\r' || c == '\n') {
+            const char* hex = "0123456789ABCDEF";
+            ret.push_back('%');
+            ret.push_back(hex[(uint8_t)c >> 4]);
+            ret.push_back(hex[(uint8_t)c & 15]);
+        } else {
+            ret.push_back(c);
+        }
+    }
+    return ret;
+}
+
+bool writeAll(int fd, const string& data) {
+    size_t pos = 0;
+    while(pos < data.size()) {
+        ssize_t count = write(fd, data.data() + pos, data.size() - pos);
+        if(count > 0) {
+            pos += (size_t)count;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+optional<string> unescapeField(const string& str) {
+    auto hexVal = [](char c) -> int {
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    };
+
+    string ret;
+    ret.reserve(str.size());
+    for(size_t i = 0; i < str.size(); ++i) {
+        if(str[i] == '%') {
+            if(i + 2 >= str.size()) {
+                return {};
+            }
+            int high = hexVal(str[i + 1]);
+            int low = hexVal(str[i + 2]);
+            if(high < 0 || low < 0) {
+                return {};
+            }
+            ret.push_back((char)(uint8_t)(16 * high + low));
+            i += 2;
+        } else {
+            ret.push_back(str[i]);
+        }
+    }
+    return ret;
+}
+
+optional<vector<string>> splitRecord(const string& line) {
+    vector<string> fields;
+    size_t start = 0;
+    while(true) {
+        size_t end = line.find('\t', start);
+        optional<string> field = unescapeField(
+            line.substr(start, end == string::npos ? string::npos : end - start)
+        );
+        if(!field.has_value()) {
+            return {};
+        }
+        fields.push_back(move(*field));
+        if(end == string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    return fields;
+}
+
+class SnapshotCookieVisitor : public CefCookieVisitor {
+public:
+    SnapshotCookieVisitor(function<void(vector<SnapshotCookie>)> func) {
+        func_ = func;
+    }
+
+    // The visitor is released once all the cookies have been visited (or
+    // immediately if the cookies cannot be accessed), so we report the
+    // result upon destruction
+    ~SnapshotCookieVisitor() {
+        function<void(vector<SnapshotCookie>)> func = move(func_);
+        vector<SnapshotCookie> cookies = move(cookies_);
+        postTask([func, cookies]() {
+            func(cookies);
+        });
+    }
+
+    virtual bool Visit(
+        const CefCookie& cookie,
+        int count,
+        int total,
+        bool& deleteCookie
+    ) override {
+        SnapshotCookie item;
+        item.name = CefString(&cookie.name);
+        item.value = CefString(&cookie.value);
+        item.domain = CefString(&cookie.domain);
+        item.path = CefString(&cookie.path);
+        item.secure = (bool)cookie.secure;
+        item.httpOnly = (bool)cookie.httponly;
+        if(cookie.has_expires) {
+            item.expires = (int64_t)CefTime(cookie.expires).GetTimeT();
+        }
+        cookies_.push_back(move(item));
+        return true;
+    }
+
+private:
+    function<void(vector<SnapshotCookie>)> func_;
+    vector<SnapshotCookie> cookies_;
+
+    IMPLEMENT_REFCOUNTING(SnapshotCookieVisitor);
+};
+
+}
+
+bool writeSessionSnapshot(const string& path, const SessionSnapshot& snapshot) {
+    // The temporary file has a unique name, as the snapshots written to the
+    // same path may overlap (such as the periodic and final cookie snapshots),
+    // and it is only readable by the owner, as it contains the cookies
+    string tmpPath = path + ".tmp." + toString(getpid()) + ".";
+    string charPalette = "abcdefghijklmnopqrstuvABCDEFGHIJKLMNOPQRSTUV0123456789";
+    for(int i = 0; i < 16; ++i) {
+        char c = charPalette[uniform_int_distribution<size_t>(0, charPalette.size() - 1)(rng)];
+        tmpPath.push_back(c);
+    }
+
+    stringstream buf;
+    buf << SnapshotHeader << '\n';
+    for(const SnapshotWindow& window : snapshot.windows) {
+        buf << "window\t" << window.handle;
+        buf << '\t' << escapeField(window.token);
+        buf << '\t' << escapeField(window.uri) << '\n';
+    }
+    for(const SnapshotCookie& cookie : snapshot.cookies) {
+        buf << "cookie";
+        buf << '\t' << escapeField(cookie.name);
+        buf << '\t' << escapeField(cookie.value);
+        buf << '\t' << escapeField(cookie.domain);
+        buf << '\t' << escapeField(cookie.path);
+        buf << '\t' << (cookie.secure ? 1 : 0);
+        buf << '\t' << (cookie.httpOnly ? 1 : 0);
+        buf << '\t';
+        if(cookie.expires.has_value()) {
+            buf << *cookie.expires;
+        }
+        buf << '\n';
+    }
+
+    int fd = open(
+        tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600
+    );
+    bool ok = fd != -1 && writeAll(fd, buf.str());
+    if(fd != -1 && close(fd) != 0) {
+        ok = false;
+    }
+    if(!ok) {
+        if(fd != -1) {
+            unlink(tmpPath.c_str());
+        }
+        return false;
+    }
+
+    // Replace the old snapshot atomically so that a reader never sees a
+    // partially written file
+    if(rename(tmpPath.c_str(), path.c_str())) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+optional<SessionSnapshot> readSessionSnapshot(const string& path) {
+    ifstream fp;
+    fp.open(path.c_str(), fp.in | fp.binary);
+    if(!fp.good()) {
+        return {};
+    }
+
+    string line;
+    if(!std::getline(fp, line)) {
+        return {};
+    }
+    bool isV1 = line == SnapshotHeaderV1;
+    if(line != SnapshotHeader && !isV1) {
+        return {};
+    }
+
+    SessionSnapshot snapshot;
+    while(std::getline(fp, line)) {
+        if(line.empty()) {
+            continue;
+        }
+        optional<vector<string>> fields = splitRecord(line);
+        if(!fields.has_value()) {
+            return {};
+        }
+        const vector<string>& f = *fields;
+
+        if(isV1 && f[0] == "window" && f.size() == 3) {
+            // Windows without tokens cannot be restored safely
+            continue;
+        } else if(!isV1 && f[0] == "window" && f.size() == 4) {
+            SnapshotWindow window;
+            optional<uint64_t> handle = parseString<uint64_t>(f[1]);
+            if(!handle.has_value() || f[2].size() != 2 * SnapshotTokenBytes) {
+                return {};
+            }
+            window.handle = *handle;
+            window.token = f[2];
+            window.uri = f[3];
+            snapshot.windows.push_back(move(window));
+        } else if(f[0] == "cookie" && f.size() == 8) {
+            SnapshotCookie cookie;
+            cookie.name = f[1];
+            cookie.value = f[2];
+            cookie.domain = f[3];
+            cookie.path = f[4];
+            cookie.secure = f[5] == "1";
+            cookie.httpOnly = f[6] == "1";
+            if(!f[7].empty()) {
+                cookie.expires = parseString<int64_t>(f[7]);
+                if(!cookie.expires.has_value()) {
+                    return {};
+                }
+            }
+            snapshot.cookies.push_back(move(cookie));
+        } else {
+            return {};
+        }
+    }
+    if(fp.bad()) {
+        return {};
+    }
+
+    return snapshot;
+}
+
+string generateSnapshotToken() {
+    uint8_t bytes[SnapshotTokenBytes];
+    size_t pos = 0;
+    while(pos < SnapshotTokenBytes) {
+        ssize_t count = getrandom(bytes + pos, SnapshotTokenBytes - pos, 0);
+        if(count > 0) {
+            pos += (size_t)count;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            PANIC("Reading random bytes for snapshot token failed: ", strerror(errno));
+        }
+    }
+
+    const char* hex = "0123456789abcdef";
+    string token;
+    for(uint8_t byte : bytes) {
+        token.push_back(hex[byte >> 4]);
+        token.push_back(hex[byte & 15]);
+    }
+    return token;
+}
+
+bool snapshotTokensEqual(const string& a, const string& b) {
+    if(a.size() != b.size()) {
+        return false;
+    }
+    volatile unsigned char agg = 0;
+    for(size_t i = 0; i < a.size(); ++i) {
+        agg |= (unsigned char)a[i] ^ (unsigned char)b[i];
+    }
+    return !agg;
+}
+
+void collectSnapshotCookies(function<void(vector<SnapshotCookie>)> func) {
+    REQUIRE_UI_THREAD();
+
+    CefRefPtr<SnapshotCookieVisitor> visitor = new SnapshotCookieVisitor(func);
+    CefRefPtr<CefCookieManager> manager =
+        CefCookieManager::GetGlobalManager(nullptr);
+    if(manager) {
+        manager->VisitAllCookies(visitor);
+    }
+}
+
+void restoreSnapshotCookies(const vector<SnapshotCookie>& cookies) {
+    REQUIRE_UI_THREAD();
+
+    CefRefPtr<CefCookieManager> manager =
+        CefCookieManager::GetGlobalManager(nullptr);
+    if(!manager) {
+        WARNING_LOG("Cookie store not available, snapshot cookies not restored");
+        return;
+    }
+
+    int64_t now = (int64_t)time(nullptr);
+    size_t restoredCount = 0;
+    for(const SnapshotCookie& item : cookies) {
+        if(item.expires.has_value() && *item.expires <= now) {
+            continue;
+        }
+
+        // The cookie manager requires a URL that matches the cookie
+        string host = item.domain;
+        if(!host.empty() && host[0] == '.') {
+            host = host.substr(1);
+        }
+        string url = (item.secure ? "https://" : "http://") + host + item.path;
+
+        CefCookie cookie;
+        CefString(&cookie.name).FromString(item.name);
+        CefString(&cookie.value).FromString(item.value);
+        CefString(&cookie.domain).FromString(item.domain);
+        CefString(&cookie.path).FromString(item.path);
+        cookie.secure = item.secure;
+        cookie.httponly = item.httpOnly;
+        if(item.expires.has_value()) {
+            cookie.has_expires = true;
+            CefTime expires;
+            expires.SetTimeT((time_t)*item.expires);
+            cookie.expires = expires;
+        }
+
+        if(manager->SetCookie(url, cookie, nullptr)) {
+            ++restoredCount;
+        }
+    }
+    INFO_LOG("Restored ", restoredCount, " cookies from the session snapshot");
+}
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+// Snapshot of the sessions of a browservice instance, written on shutdown if
+// the snapshot-file option is set and loaded by another instance using the
+// restore-snapshot option to move the sessions there when a node is drained.
+// The snapshot contains the page shown by each open window and the cookies of
+// the browser (the windows share a single cookie store).
+//
+// Each window in the snapshot gets a random secret token. On the restoring
+// instance, the window that had handle H and token T is recreated when the
+// client opens the path /goto/browservice:restore/H/T, which is where the
+// router should redirect the requests for the windows of the drained instance
+// (keyed by the handle in the path, with the token looked up from the
+// snapshot). Without the token, a client could claim the page of another
+// user by guessing a handle. Each snapshot window can be restored once;
+// unknown handles and wrong tokens open the start page.
+//
+// File format: text, one record per line, with tab-separated fields in which
+// '%', tab, CR and LF are percent-encoded. The first line is
+// "browservice-snapshot 2"; the records are
+//   window HANDLE TOKEN URL
+//   cookie NAME VALUE DOMAIN PATH SECURE HTTPONLY EXPIRES
+// where TOKEN consists of 32 hexadecimal digits, SECURE and HTTPONLY are 0 or
+// 1 and EXPIRES is the expiry time in seconds since the Unix epoch, or empty
+// for session cookies. The cookies of version 1 files (which have window
+// records without tokens) are still read, but their windows are skipped.
+struct SnapshotWindow {
+    uint64_t handle;
+    string token;
+    string uri;
+};
+
+struct SnapshotCookie {
+    string name;
+    string value;
+    string domain;
+    string path;
+    bool secure;
+    bool httpOnly;
+    optional<int64_t> expires;
+};
+
+struct SessionSnapshot {
+    vector<SnapshotWindow> windows;
+    vector<SnapshotCookie> cookies;
+};
+
+// Returns false if writing the file failed. The file is replaced atomically
+// and is only readable by the owner (mode 0600).
+bool writeSessionSnapshot(const string& path, const SessionSnapshot& snapshot);
+
+// Returns empty if reading or parsing the file failed.
+optional<SessionSnapshot> readSessionSnapshot(const string& path);
+
+// Returns a new random token for a snapshot window, read from the kernel
+// CSPRNG.
+string generateSnapshotToken();
+
+// Constant-time comparison of snapshot window tokens.
+bool snapshotTokensEqual(const string& a, const string& b);
+
+// Reads all the cookies of the browser asynchronously and calls func with
+// them in the UI thread.
+void collectSnapshotCookies(function<void(vector<SnapshotCookie>)> func);
+
+// Adds the given cookies to the cookie store of the browser.
+void restoreSnapshotCookies(const vector<SnapshotCookie>& cookies);
+
+}
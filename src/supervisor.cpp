@@ -0,0 +1,1590 @@
+#include "supervisor.hpp"
+
+#include "config.hpp"
+
+#include <csignal>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace browservice {
+
+namespace {
+
+// Listen address of the supervisor if vice-opt-http-listen-addr is not given
+// (the default of retrojsvice).
+const string DefaultListenAddr = "127.0.0.1:8080";
+
+// A worker that exits is restarted after a delay that doubles (up to the
+// maximum) each time it exits without having run for the maximum delay, so
+// that a worker that cannot start does not keep the supervisor busy.
+const int64_t MinWorkerRestartDelayMs = 1000;
+const int64_t MaxWorkerRestartDelayMs = 60000;
+
+// Time for which the router keeps trying to connect to a worker that is not
+// accepting connections (such as a worker that is restarting).
+const int64_t WorkerConnectTimeoutMs = 10000;
+const int64_t WorkerConnectRetryMs = 100;
+
+// A window counts towards the load of its worker if it has received a request
+// within this time. A new window placed on a worker counts towards its load
+// for PlacementLoadMs, so that a burst of new windows is spread over the
+// workers before the requests of the windows arrive.
+const int64_t ActiveWindowTimeoutMs = 60000;
+const int64_t PlacementLoadMs = 10000;
+
+// The router serves at most MaxClientConnections client connections at a
+// time (fewer if the file descriptor limit is low); the rest wait in the
+// listen queue. Each client connection uses at most one worker connection at
+// a time, and at most MaxIdleWorkerConnections idle connections to each worker
+// are kept open for reuse.
+const size_t MaxClientConnections = 1024;
+const size_t MaxIdleWorkerConnections = 16;
+
+// Limits for the request and response heads, and for the data buffered for
+// one direction of a connection before reading from the other side is paused.
+const size_t MaxHeadSize = 65536;
+const size_t MaxBufferedSize = 1 << 20;
+
+// Requests of at most this size (head and body) are kept until their response
+// starts, so that they can be sent again if the worker connection fails.
+const size_t MaxRetryRequestSize = 2 * MaxHeadSize;
+
+// A client connection waiting for a request for this long is closed.
+const int64_t ClientIdleTimeoutMs = 60000;
+
+// Options that the supervisor sets separately for each worker (including the
+// deprecated alias http-listen-addr); the rest are passed as given.
+const set<string> WorkerOwnOptions = {
+    "workers",
+    "worker-base-port",
+    "window-handle-shard",
+    "http-listen-addr",
+    "vice-opt-http-listen-addr",
+    "data-dir",
+    "cookie-snapshot-file",
+    "snapshot-file",
+    "restore-snapshot",
+    "trace-file",
+    "frame-capture-file"
+};
+
+volatile sig_atomic_t stopRequested = 0;
+
+// The log queue uses a mutex, so it cannot be used in signal handlers; the
+// message is written directly instead.
+void handleTermSignal(int signalID) {
+    const char msg[] =
+        "INFO @ supervisor -- Got termination signal, shutting down the workers\n";
+    ssize_t ignored = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)ignored;
+    stopRequested = 1;
+}
+
+// Chooses the workers for the requests.
+class Router {
+SHARED_ONLY_CLASS(Router);
+public:
+    Router(CKey, int workerCount)
+        : workerRunning_(workerCount, false)
+    {}
+
+    void setWorkerRunning(int worker, bool running) {
+        workerRunning_[worker] = running;
+    }
+
+    // Returns the worker that owns given window handle: the handle shard of
+    // worker i consists of the handles equal to i modulo the worker count.
+    int ownerOf(uint64_t handle) {
+        return (int)(handle % (uint64_t)workerRunning_.size());
+    }
+
+    // Returns the owner of given window handle and counts the window as
+    // active.
+    int routeWindow(uint64_t handle) {
+        activeWindows_[handle] = steady_clock::now();
+        return ownerOf(handle);
+    }
+
+    // Returns the worker on which a new window should be opened: the running
+    // worker with the least active windows and recent placements.
+    int placeWindow() {
+        steady_clock::time_point now = steady_clock::now();
+        int workerCount = (int)workerRunning_.size();
+        vector<int> load(workerCount, 0);
+
+        auto it = activeWindows_.begin();
+        while(it != activeWindows_.end()) {
+            if(now - it->second > milliseconds(ActiveWindowTimeoutMs)) {
+                it = activeWindows_.erase(it);
+            } else {
+                ++load[it->first % (uint64_t)workerCount];
+                ++it;
+            }
+        }
+
+        while(
+            !placements_.empty() &&
+            now - placements_.front().first > milliseconds(PlacementLoadMs)
+        ) {
+            placements_.pop_front();
+        }
+        for(const pair<steady_clock::time_point, int>& placement : placements_) {
+            ++load[placement.second];
+        }
+
+        int best = -1;
+        for(int i = 0; i < workerCount; ++i) {
+            if(workerRunning_[i] && (best == -1 || load[i] < load[best])) {
+                best = i;
+            }
+        }
+        if(best == -1) {
+            // No worker is running; the request waits for worker 0 to be
+            // restarted
+            best = 0;
+        }
+
+        placements_.emplace_back(now, best);
+        return best;
+    }
+
+private:
+    vector<bool> workerRunning_;
+    map<uint64_t, steady_clock::time_point> activeWindows_;
+    deque<pair<steady_clock::time_point, int>> placements_;
+};
+
+string errorResponse(const string& status, const string& msg) {
+    string body = "ERROR: " + msg + "\n";
+    return
+        "HTTP/1.1 " + status + "\r\n"
+        "Content-Type: text/plain; charset=UTF-8\r\n"
+        "Content-Length: " + toString(body.size()) + "\r\n"
+        "Connection: close\r\n"
+        "\r\n" + body;
+}
+
+void setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+string toLower(string str) {
+    for(char& c : str) {
+        c = tolower(c);
+    }
+    return str;
+}
+
+string trim(const string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if(start == string::npos) {
+        return "";
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
+
+// Parses a nonempty string of at most maxDigits digits in given base (10 or
+// 16).
+optional<uint64_t> parseNumber(const string& str, int base, size_t maxDigits) {
+    if(str.empty() || str.size() > maxDigits) {
+        return {};
+    }
+    uint64_t ret = 0;
+    for(char c : str) {
+        int digit;
+        if(c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if(base == 16 && c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if(base == 16 && c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return {};
+        }
+        ret = ret * (uint64_t)base + (uint64_t)digit;
+    }
+    return ret;
+}
+
+// Returns the window handle if the request target is of the form
+// PREFIX HANDLE/...
+optional<uint64_t> parseHandleAfter(const string& target, const string& prefix) {
+    if(target.compare(0, prefix.size(), prefix) != 0) {
+        return {};
+    }
+    size_t start = prefix.size();
+    size_t end = start;
+    while(end < target.size() && target[end] >= '0' && target[end] <= '9') {
+        ++end;
+    }
+    if(end == start || end == target.size() || target[end] != '/') {
+        return {};
+    }
+    return parseString<uint64_t>(target.substr(start, end - start));
+}
+
+// The start line and the header fields of an HTTP request or response head.
+struct MessageHead {
+    string startLine;
+
+    // The header lines as received and the (lower case) names and the values
+    // of the fields.
+    vector<string> lines;
+    vector<string> names;
+    vector<string> values;
+
+    // Parses given head (including the terminating empty line). Returns false
+    // if the head is invalid.
+    bool parse(const string& head) {
+        size_t pos = 0;
+        while(true) {
+            size_t end = head.find("\r\n", pos);
+            if(end == string::npos) {
+                return false;
+            }
+            string line = head.substr(pos, end - pos);
+            pos = end + 2;
+
+            if(line.empty()) {
+                return !startLine.empty();
+            }
+            if(startLine.empty()) {
+                startLine = line;
+            } else if(line[0] == ' ' || line[0] == '\t') {
+                // Obsolete line folding
+                if(lines.empty()) {
+                    return false;
+                }
+                lines.back() += "\r\n" + line;
+                values.back() += " " + trim(line);
+            } else {
+                size_t colon = line.find(':');
+                if(colon == string::npos || colon == 0) {
+                    return false;
+                }
+                lines.push_back(line);
+                names.push_back(toLower(line.substr(0, colon)));
+                values.push_back(trim(line.substr(colon + 1)));
+            }
+        }
+    }
+
+    // Returns the values of the fields with given name joined by commas, or
+    // an empty optional if there are no such fields.
+    optional<string> get(const string& name) const {
+        optional<string> ret;
+        for(size_t i = 0; i < names.size(); ++i) {
+            if(names[i] == name) {
+                if(ret.has_value()) {
+                    *ret += "," + values[i];
+                } else {
+                    ret = values[i];
+                }
+            }
+        }
+        return ret;
+    }
+
+    // Returns true if the comma-separated lists in the fields with given name
+    // contain given (lower case) token.
+    bool hasToken(const string& name, const string& token) const {
+        return tokens_(name).count(token) != 0;
+    }
+
+    // Returns the head with the hop-by-hop fields that concern the connection
+    // removed and a Connection field with given value added.
+    string serialize(const string& connection) const {
+        set<string> dropNames = tokens_("connection");
+        dropNames.insert("connection");
+        dropNames.insert("keep-alive");
+        dropNames.insert("proxy-connection");
+
+        string ret = startLine + "\r\n";
+        for(size_t i = 0; i < lines.size(); ++i) {
+            if(!dropNames.count(names[i])) {
+                ret += lines[i] + "\r\n";
+            }
+        }
+        ret += "Connection: " + connection + "\r\n\r\n";
+        return ret;
+    }
+
+private:
+    set<string> tokens_(const string& name) const {
+        set<string> ret;
+        optional<string> value = get(name);
+        if(value.has_value()) {
+            size_t pos = 0;
+            while(pos <= value->size()) {
+                size_t end = value->find(',', pos);
+                if(end == string::npos) {
+                    end = value->size();
+                }
+                string token = toLower(trim(value->substr(pos, end - pos)));
+                if(!token.empty()) {
+                    ret.insert(token);
+                }
+                pos = end + 1;
+            }
+        }
+        return ret;
+    }
+};
+
+// Returns true if the head of a message with given HTTP version asks to keep
+// the connection open after the message.
+bool isKeepAlive(const MessageHead& head, const string& version) {
+    if(version == "HTTP/1.0") {
+        return head.hasToken("connection", "keep-alive");
+    } else {
+        return !head.hasToken("connection", "close");
+    }
+}
+
+// The HTTP router of the supervisor, run in the main thread as an event loop
+// on the epoll instance. The requests of each client connection are handled
+// one at a time: the head of the request is parsed to choose the worker
+// using the Router, and the request is forwarded to the worker over a
+// keep-alive connection, taken from the idle connections to the worker if
+// there are any. The response is relayed back to the client; its framing is
+// parsed to find where it ends, after which the worker connection becomes idle
+// and the next request of the client is handled. A request of at most
+// MaxRetryRequestSize bytes that fails before any of its response has been
+// received is sent again on a new connection (for example if the worker had
+// just closed an idle connection), and while a worker is not accepting
+// connections or drops new connections without responding (such as when it
+// is restarting), the router keeps trying to connect to it for
+// WorkerConnectTimeoutMs.
+class Proxy {
+SHARED_ONLY_CLASS(Proxy);
+public:
+    // The listen socket must be nonblocking. At most clientLimit client
+    // connections are open at a time; the rest wait in the listen queue.
+    Proxy(CKey,
+        int epollFd,
+        int listenFd,
+        size_t clientLimit,
+        shared_ptr<Router> router,
+        int workerCount,
+        int workerBasePort
+    )
+        : epollFd_(epollFd),
+          listenFd_(listenFd),
+          listening_(false),
+          clientLimit_(clientLimit),
+          router_(router),
+          workerBasePort_(workerBasePort),
+          idleConns_(workerCount),
+          nextID_(1),
+          lastTimeoutCheck_(steady_clock::now()),
+          buf_(new char[BufSize])
+    {
+        REQUIRE(clientLimit_ > 0);
+        updateListening_();
+    }
+
+    ~Proxy() {
+        for(const pair<const uint64_t, Client>& item : clients_) {
+            close(item.second.fd);
+        }
+        for(const pair<const uint64_t, WorkerConn>& item : conns_) {
+            close(item.second.fd);
+        }
+        setListening_(false);
+    }
+
+    // Waits for events for at most timeoutMs milliseconds and handles them.
+    void run(int timeoutMs) {
+        const int MaxEvents = 64;
+        epoll_event events[MaxEvents];
+        int count = epoll_wait(epollFd_, events, MaxEvents, timeoutMs);
+        for(int i = 0; i < count; ++i) {
+            uint64_t id = events[i].data.u64;
+            uint32_t flags = events[i].events;
+            if(id == ListenID) {
+                accept_();
+            } else if(clients_.count(id)) {
+                handleClientEvent_(id, flags);
+            } else if(conns_.count(id)) {
+                handleConnEvent_(id, flags);
+            }
+            flushDirty_();
+        }
+
+        steady_clock::time_point now = steady_clock::now();
+        while(!connectRetries_.empty() && connectRetries_.begin()->first <= now) {
+            uint64_t id = connectRetries_.begin()->second;
+            connectRetries_.erase(connectRetries_.begin());
+            clients_.at(id).retryScheduled = false;
+            connectWorker_(id, false);
+        }
+
+        if(now - lastTimeoutCheck_ >= milliseconds(1000)) {
+            lastTimeoutCheck_ = now;
+            vector<uint64_t> expired;
+            for(const pair<const uint64_t, Client>& item : clients_) {
+                const Client& client = item.second;
+                if(
+                    client.state == Client::ReadingHead &&
+                    now - client.idleSince >= milliseconds(ClientIdleTimeoutMs)
+                ) {
+                    expired.push_back(item.first);
+                }
+            }
+            for(uint64_t id : expired) {
+                closeClient_(id);
+            }
+            if(now >= acceptPausedUntil_) {
+                updateListening_();
+            }
+        }
+
+        flushDirty_();
+    }
+
+private:
+    static constexpr uint64_t ListenID = 0;
+    static constexpr size_t BufSize = 65536;
+
+    struct Client {
+        int fd;
+        uint32_t events;
+
+        // Data received from the client that has not been handled yet, and
+        // data to be sent to the client, starting from outPos.
+        string in;
+        string out;
+        size_t outPos;
+        bool inputClosed;
+
+        // ReadingHead: waiting for the head of the next request (since
+        // idleSince).
+        // Forwarding: the current request is forwarded to the worker and its
+        // response is relayed back.
+        // Closing: the connection is closed once out has been sent.
+        enum {ReadingHead, Forwarding, Closing} state;
+        steady_clock::time_point idleSince;
+
+        // The current request. The request data to be sent to the worker is
+        // kept in pending while there is no worker connection (conn == 0).
+        // If retryable, retryData contains all the request data sent so far.
+        int worker;
+        bool headRequest;
+        bool keepAlive;
+        uint64_t bodyLeft;
+        uint64_t conn;
+        string pending;
+        bool retryable;
+        string retryData;
+        bool retried;
+        bool responseStarted;
+        steady_clock::time_point connectDeadline;
+        bool retryScheduled;
+        steady_clock::time_point retryTime;
+    };
+
+    struct WorkerConn {
+        int fd;
+        uint32_t events;
+        int worker;
+        bool connecting;
+
+        // True if the connection has been idle (and thus may have been closed
+        // by the worker before it received the current request).
+        bool reused;
+
+        // The client whose request is being served, or 0 if the connection is
+        // idle.
+        uint64_t client;
+
+        // Data to be sent to the worker (starting from outPos), and data
+        // received from the worker that has not been relayed yet.
+        string out;
+        size_t outPos;
+        string in;
+
+        // The state of parsing the response to the current request: the
+        // framing of the body, and the bytes left in the body or chunk.
+        bool received;
+        bool reusable;
+        enum {Head, Body, ChunkSize, ChunkData, ChunkEnd, Trailer, UntilClose} state;
+        uint64_t left;
+    };
+
+    void accept_() {
+        while(clients_.size() < clientLimit_) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                if(errno == EMFILE || errno == ENFILE) {
+                    // Leave the connections in the queue for a while instead of
+                    // busy looping
+                    WARNING_LOG("Accepting client connection failed: Too many open files");
+                    acceptPausedUntil_ = steady_clock::now() + milliseconds(1000);
+                    setListening_(false);
+                }
+                break;
+            }
+            setNoDelay(fd);
+
+            uint64_t id = nextID_++;
+            Client& client = clients_[id];
+            client.fd = fd;
+            client.events = 0;
+            client.outPos = 0;
+            client.inputClosed = false;
+            client.state = Client::ReadingHead;
+            client.idleSince = steady_clock::now();
+            client.conn = 0;
+            client.retryScheduled = false;
+            registerFd_(fd, id);
+            markDirty_(id);
+        }
+        updateListening_();
+    }
+
+    void handleClientEvent_(uint64_t id, uint32_t flags) {
+        if(flags & EPOLLERR) {
+            closeClient_(id);
+            return;
+        }
+        if(flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+            Client& client = clients_.at(id);
+            size_t limit = client.in.size() + MaxBufferedSize;
+            while(!client.inputClosed && client.in.size() < limit) {
+                ssize_t count = recv(client.fd, buf_.get(), BufSize, 0);
+                if(count > 0) {
+                    client.in.append(buf_.get(), (size_t)count);
+                } else if(count == 0) {
+                    client.inputClosed = true;
+                } else if(errno == EINTR) {
+                    continue;
+                } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                } else {
+                    closeClient_(id);
+                    return;
+                }
+            }
+            if((flags & EPOLLRDHUP) && !client.inputClosed) {
+                // The client has shut down its side, but there is more data
+                // than fits in the buffer; we cannot serve the rest
+                closeClient_(id);
+                return;
+            }
+            handleClientInput_(id);
+        }
+        if(clients_.count(id)) {
+            markDirty_(id);
+        }
+    }
+
+    // Handles the data received from the client in its current state.
+    void handleClientInput_(uint64_t id) {
+        Client& client = clients_.at(id);
+        markDirty_(id);
+
+        if(client.state == Client::Closing) {
+            client.in.clear();
+            return;
+        }
+
+        if(client.state == Client::Forwarding) {
+            forwardBody_(client);
+            if(client.inputClosed && client.bodyLeft > 0) {
+                // The client will never send the rest of the request
+                closeClient_(id);
+            }
+            return;
+        }
+
+        // Empty lines before a request are ignored
+        size_t start = 0;
+        while(client.in.compare(start, 2, "\r\n") == 0) {
+            start += 2;
+        }
+        client.in.erase(0, start);
+
+        size_t headEnd = client.in.find("\r\n\r\n");
+        if(headEnd == string::npos) {
+            if(client.in.size() > MaxHeadSize) {
+                failRequest_(id, "431 Request Header Fields Too Large", "Request head too large");
+            } else if(client.inputClosed) {
+                // Closed once the previous responses have been sent
+                client.state = Client::Closing;
+                client.in.clear();
+            }
+            return;
+        }
+        size_t headSize = headEnd + 4;
+        if(headSize > MaxHeadSize) {
+            failRequest_(id, "431 Request Header Fields Too Large", "Request head too large");
+            return;
+        }
+
+        MessageHead head;
+        if(!head.parse(client.in.substr(0, headSize))) {
+            failRequest_(id, "400 Bad Request", "Invalid request head");
+            return;
+        }
+        size_t methodEnd = head.startLine.find(' ');
+        size_t targetEnd =
+            methodEnd == string::npos ? string::npos : head.startLine.find(' ', methodEnd + 1);
+        if(
+            targetEnd == string::npos ||
+            head.startLine.compare(targetEnd + 1, 5, "HTTP/") != 0
+        ) {
+            failRequest_(id, "400 Bad Request", "Invalid request line");
+            return;
+        }
+        string method = head.startLine.substr(0, methodEnd);
+        string target = head.startLine.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+        string version = head.startLine.substr(targetEnd + 1);
+
+        if(head.get("transfer-encoding").has_value()) {
+            failRequest_(id, "501 Not Implemented", "Chunked request bodies are not supported");
+            return;
+        }
+        uint64_t bodySize = 0;
+        optional<string> contentLength = head.get("content-length");
+        if(contentLength.has_value()) {
+            optional<uint64_t> parsed = parseNumber(*contentLength, 10, 18);
+            if(!parsed.has_value()) {
+                failRequest_(id, "400 Bad Request", "Invalid Content-Length");
+                return;
+            }
+            bodySize = *parsed;
+        }
+
+        int worker;
+        optional<uint64_t> handle = parseHandleAfter(target, "/");
+        optional<uint64_t> restoreHandle =
+            parseHandleAfter(target, "/goto/browservice:restore/");
+        if(handle.has_value()) {
+            worker = router_->routeWindow(*handle);
+        } else if(restoreHandle.has_value()) {
+            // The window is in the session snapshot of the worker in the same
+            // position of the drained supervisor
+            worker = router_->ownerOf(*restoreHandle);
+        } else if(target == "/" || target.compare(0, 6, "/goto/") == 0) {
+            worker = router_->placeWindow();
+        } else {
+            worker = 0;
+        }
+
+        client.in.erase(0, headSize);
+        client.state = Client::Forwarding;
+        client.worker = worker;
+        client.headRequest = method == "HEAD";
+        client.keepAlive = isKeepAlive(head, version);
+        client.bodyLeft = bodySize;
+        client.pending.clear();
+        client.retryable = true;
+        client.retryData.clear();
+        client.retried = false;
+        client.responseStarted = false;
+        client.connectDeadline = steady_clock::now() + milliseconds(WorkerConnectTimeoutMs);
+
+        // The connection to the worker is kept alive regardless of the client
+        sendToWorker_(client, head.serialize("keep-alive"));
+        forwardBody_(client);
+        connectWorker_(id, true);
+    }
+
+    // Moves the part of the request body received from the client towards the
+    // worker.
+    void forwardBody_(Client& client) {
+        if(client.bodyLeft == 0 || client.in.empty()) {
+            return;
+        }
+        size_t count = (size_t)min(client.bodyLeft, (uint64_t)client.in.size());
+        sendToWorker_(client, client.in.substr(0, count));
+        client.in.erase(0, count);
+        client.bodyLeft -= (uint64_t)count;
+    }
+
+    void sendToWorker_(Client& client, const string& data) {
+        if(client.retryable) {
+            if(client.retryData.size() + data.size() > MaxRetryRequestSize) {
+                client.retryable = false;
+                client.retryData = string();
+            } else {
+                client.retryData.append(data);
+            }
+        }
+        if(client.conn != 0) {
+            conns_.at(client.conn).out.append(data);
+            markDirty_(client.conn);
+        } else {
+            client.pending.append(data);
+        }
+    }
+
+    // Finds a connection to the worker of the current request of the client
+    // (an idle one if allowIdle is true and there is one, otherwise a new
+    // one) and sends the pending request data to it.
+    void connectWorker_(uint64_t id, bool allowIdle) {
+        Client& client = clients_.at(id);
+        REQUIRE(client.conn == 0);
+
+        vector<uint64_t>& idle = idleConns_[client.worker];
+        if(allowIdle && !idle.empty()) {
+            uint64_t connID = idle.back();
+            idle.pop_back();
+            attach_(id, connID);
+            return;
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd == -1) {
+            failRequest_(id, "502 Bad Gateway", "Worker is not available");
+            return;
+        }
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)(workerBasePort_ + client.worker));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int result = connect(fd, (const sockaddr*)&addr, sizeof(addr));
+        if(result != 0 && errno != EINPROGRESS) {
+            close(fd);
+            retryConnect_(id);
+            return;
+        }
+        setNoDelay(fd);
+
+        uint64_t connID = nextID_++;
+        WorkerConn& conn = conns_[connID];
+        conn.fd = fd;
+        conn.events = 0;
+        conn.worker = client.worker;
+        conn.connecting = result != 0;
+        conn.reused = false;
+        conn.client = 0;
+        conn.outPos = 0;
+        registerFd_(fd, connID);
+        attach_(id, connID);
+    }
+
+    // Schedules another attempt to connect to the worker of the current
+    // request, or fails the request if the worker has not been reachable for
+    // WorkerConnectTimeoutMs.
+    void retryConnect_(uint64_t id) {
+        Client& client = clients_.at(id);
+        steady_clock::time_point retryTime =
+            steady_clock::now() + milliseconds(WorkerConnectRetryMs);
+        if(retryTime >= client.connectDeadline) {
+            failRequest_(id, "502 Bad Gateway", "Worker is not available");
+            return;
+        }
+        client.retryScheduled = true;
+        client.retryTime = retryTime;
+        connectRetries_.emplace(retryTime, id);
+    }
+
+    void attach_(uint64_t id, uint64_t connID) {
+        Client& client = clients_.at(id);
+        WorkerConn& conn = conns_.at(connID);
+        REQUIRE(conn.client == 0);
+
+        client.conn = connID;
+        conn.client = id;
+        conn.out.append(client.pending);
+        client.pending.clear();
+        conn.in.clear();
+        conn.received = false;
+        conn.reusable = false;
+        conn.state = WorkerConn::Head;
+        markDirty_(connID);
+    }
+
+    void handleConnEvent_(uint64_t connID, uint32_t flags) {
+        WorkerConn& conn = conns_.at(connID);
+        if(conn.connecting) {
+            int error = 0;
+            socklen_t errorSize = sizeof(error);
+            if(
+                getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &errorSize) != 0 ||
+                error != 0
+            ) {
+                failConn_(connID, true);
+                return;
+            }
+            conn.connecting = false;
+            markDirty_(connID);
+            return;
+        }
+
+        if(flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if(conn.client == 0) {
+                // The worker closed the idle connection (any data would be
+                // unexpected)
+                closeConn_(connID);
+                return;
+            }
+
+            const Client& client = clients_.at(conn.client);
+            bool eof = false;
+            while(client.out.size() - client.outPos < MaxBufferedSize) {
+                ssize_t count = recv(conn.fd, buf_.get(), BufSize, 0);
+                if(count > 0) {
+                    conn.received = true;
+                    conn.in.append(buf_.get(), (size_t)count);
+                    if(!relayResponse_(connID)) {
+                        // The response ended or failed
+                        return;
+                    }
+                } else if(count == 0) {
+                    eof = true;
+                    break;
+                } else if(errno == EINTR) {
+                    continue;
+                } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                } else {
+                    failConn_(connID, false);
+                    return;
+                }
+            }
+            if(eof) {
+                if(conn.state == WorkerConn::UntilClose) {
+                    finishResponse_(connID);
+                } else {
+                    failConn_(connID, false);
+                }
+                return;
+            }
+        }
+        markDirty_(connID);
+    }
+
+    // Relays the data received from the worker to the client, parsing the
+    // response as it goes. Returns false if the response has ended or failed,
+    // in which case the connection no longer serves the client (and may have
+    // been closed).
+    bool relayResponse_(uint64_t connID) {
+        WorkerConn& conn = conns_.at(connID);
+        Client& client = clients_.at(conn.client);
+        markDirty_(connID);
+
+        while(true) {
+            if(conn.state == WorkerConn::Head) {
+                size_t headEnd = conn.in.find("\r\n\r\n");
+                if(headEnd == string::npos) {
+                    if(conn.in.size() > MaxHeadSize) {
+                        failConn_(connID, false);
+                        return false;
+                    }
+                    return true;
+                }
+                size_t headSize = headEnd + 4;
+
+                MessageHead head;
+                size_t versionEnd = string::npos;
+                optional<uint64_t> status;
+                if(
+                    head.parse(conn.in.substr(0, headSize)) &&
+                    head.startLine.compare(0, 5, "HTTP/") == 0
+                ) {
+                    versionEnd = head.startLine.find(' ');
+                }
+                if(versionEnd != string::npos) {
+                    status = parseNumber(head.startLine.substr(versionEnd + 1, 3), 10, 3);
+                }
+                if(!status.has_value()) {
+                    failConn_(connID, false);
+                    return false;
+                }
+                string version = head.startLine.substr(0, versionEnd);
+
+                if(*status >= 100 && *status < 200 && *status != 101) {
+                    // Interim response (such as 100 Continue), relayed as is
+                    client.out.append(conn.in, 0, headSize);
+                    conn.in.erase(0, headSize);
+                    client.responseStarted = true;
+                    continue;
+                }
+                conn.in.erase(0, headSize);
+
+                optional<string> contentLength = head.get("content-length");
+                optional<uint64_t> bodySize;
+                if(contentLength.has_value()) {
+                    bodySize = parseNumber(*contentLength, 10, 18);
+                }
+                if(client.headRequest || *status == 204 || *status == 304) {
+                    conn.state = WorkerConn::Body;
+                    conn.left = 0;
+                } else if(head.hasToken("transfer-encoding", "chunked")) {
+                    conn.state = WorkerConn::ChunkSize;
+                } else if(bodySize.has_value()) {
+                    conn.state = WorkerConn::Body;
+                    conn.left = *bodySize;
+                } else if(contentLength.has_value()) {
+                    failConn_(connID, false);
+                    return false;
+                } else {
+                    conn.state = WorkerConn::UntilClose;
+                }
+
+                bool delimited = conn.state != WorkerConn::UntilClose;
+                conn.reusable = delimited && isKeepAlive(head, version);
+                client.keepAlive =
+                    client.keepAlive && delimited &&
+                    !client.inputClosed && client.bodyLeft == 0;
+                client.out.append(head.serialize(client.keepAlive ? "keep-alive" : "close"));
+                client.responseStarted = true;
+
+                if(conn.state == WorkerConn::Body && conn.left == 0) {
+                    finishResponse_(connID);
+                    return false;
+                }
+            } else if(
+                conn.state == WorkerConn::Body ||
+                conn.state == WorkerConn::ChunkData ||
+                conn.state == WorkerConn::ChunkEnd
+            ) {
+                size_t count = (size_t)min(conn.left, (uint64_t)conn.in.size());
+                client.out.append(conn.in, 0, count);
+                conn.in.erase(0, count);
+                conn.left -= (uint64_t)count;
+                if(conn.left != 0) {
+                    return true;
+                }
+                if(conn.state == WorkerConn::Body) {
+                    finishResponse_(connID);
+                    return false;
+                }
+                if(conn.state == WorkerConn::ChunkData) {
+                    // The CRLF after the chunk data
+                    conn.state = WorkerConn::ChunkEnd;
+                    conn.left = 2;
+                } else {
+                    conn.state = WorkerConn::ChunkSize;
+                }
+            } else if(
+                conn.state == WorkerConn::ChunkSize ||
+                conn.state == WorkerConn::Trailer
+            ) {
+                size_t lineEnd = conn.in.find("\r\n");
+                if(lineEnd == string::npos) {
+                    if(conn.in.size() > MaxHeadSize) {
+                        failConn_(connID, false);
+                        return false;
+                    }
+                    return true;
+                }
+                string line = conn.in.substr(0, lineEnd);
+                client.out.append(conn.in, 0, lineEnd + 2);
+                conn.in.erase(0, lineEnd + 2);
+
+                if(conn.state == WorkerConn::ChunkSize) {
+                    optional<uint64_t> chunkSize =
+                        parseNumber(trim(line.substr(0, line.find(';'))), 16, 15);
+                    if(!chunkSize.has_value()) {
+                        failConn_(connID, false);
+                        return false;
+                    }
+                    if(*chunkSize == 0) {
+                        conn.state = WorkerConn::Trailer;
+                    } else {
+                        conn.state = WorkerConn::ChunkData;
+                        conn.left = *chunkSize;
+                    }
+                } else if(line.empty()) {
+                    finishResponse_(connID);
+                    return false;
+                }
+            } else {
+                REQUIRE(conn.state == WorkerConn::UntilClose);
+                client.out.append(conn.in);
+                conn.in.clear();
+                return true;
+            }
+        }
+    }
+
+    // Called when the response to the current request of the client has been
+    // relayed completely; the worker connection becomes idle (or is closed)
+    // and the client connection continues with the next request (or is
+    // closed).
+    void finishResponse_(uint64_t connID) {
+        WorkerConn& conn = conns_.at(connID);
+        uint64_t id = conn.client;
+        Client& client = clients_.at(id);
+
+        conn.client = 0;
+        client.conn = 0;
+        client.retryData = string();
+
+        vector<uint64_t>& idle = idleConns_[conn.worker];
+        if(
+            conn.reusable &&
+            conn.in.empty() &&
+            conn.outPos == conn.out.size() &&
+            client.bodyLeft == 0 &&
+            idle.size() < MaxIdleWorkerConnections
+        ) {
+            conn.out.clear();
+            conn.outPos = 0;
+            conn.reused = true;
+            idle.push_back(connID);
+            markDirty_(connID);
+        } else {
+            closeConn_(connID);
+        }
+
+        if(client.keepAlive) {
+            client.state = Client::ReadingHead;
+            client.idleSince = steady_clock::now();
+            handleClientInput_(id);
+        } else {
+            client.state = Client::Closing;
+            client.in.clear();
+            markDirty_(id);
+        }
+    }
+
+    // Closes a worker connection that has failed; if it was serving a request,
+    // the request is retried if possible (see Proxy).
+    void failConn_(uint64_t connID, bool connectFailed) {
+        WorkerConn& conn = conns_.at(connID);
+        uint64_t id = conn.client;
+        bool received = conn.received;
+        bool reused = conn.reused;
+        closeConn_(connID);
+        if(id == 0) {
+            return;
+        }
+
+        Client& client = clients_.at(id);
+        client.conn = 0;
+        if(client.responseStarted) {
+            // The response has been cut short; the client can only see this
+            // from the connection closing
+            client.state = Client::Closing;
+            client.in.clear();
+            markDirty_(id);
+            return;
+        }
+        if(!received && client.retryable) {
+            client.pending = client.retryData;
+            if(connectFailed || !reused) {
+                // A new connection failing before the response has started
+                // means that the worker is not accepting requests (it may be
+                // exiting), so it is treated like a failed connection attempt
+                retryConnect_(id);
+                return;
+            }
+            if(!client.retried) {
+                client.retried = true;
+                connectWorker_(id, false);
+                return;
+            }
+        }
+        failRequest_(id, "502 Bad Gateway", "Worker is not available");
+    }
+
+    // Responds to the current request of the client with an error and closes
+    // the connection after that.
+    void failRequest_(uint64_t id, const string& status, const string& msg) {
+        Client& client = clients_.at(id);
+        if(client.conn != 0) {
+            uint64_t connID = client.conn;
+            client.conn = 0;
+            closeConn_(connID);
+        }
+        client.out.append(errorResponse(status, msg));
+        client.state = Client::Closing;
+        client.in.clear();
+        client.pending = string();
+        client.retryData = string();
+        markDirty_(id);
+    }
+
+    void closeClient_(uint64_t id) {
+        Client& client = clients_.at(id);
+        if(client.conn != 0) {
+            closeConn_(client.conn);
+        }
+        if(client.retryScheduled) {
+            connectRetries_.erase(make_pair(client.retryTime, id));
+        }
+        close(client.fd);
+        clients_.erase(id);
+        dirty_.erase(id);
+        updateListening_();
+    }
+
+    void closeConn_(uint64_t connID) {
+        WorkerConn& conn = conns_.at(connID);
+        if(conn.client == 0) {
+            vector<uint64_t>& idle = idleConns_[conn.worker];
+            auto it = std::find(idle.begin(), idle.end(), connID);
+            if(it != idle.end()) {
+                idle.erase(it);
+            }
+        } else {
+            clients_.at(conn.client).conn = 0;
+        }
+        close(conn.fd);
+        conns_.erase(connID);
+        dirty_.erase(connID);
+    }
+
+    // Marks the connection (and the connection on the other side of it) to
+    // have its buffered data sent and its epoll events updated.
+    void markDirty_(uint64_t id) {
+        dirty_.insert(id);
+        auto clientIt = clients_.find(id);
+        if(clientIt != clients_.end()) {
+            if(clientIt->second.conn != 0) {
+                dirty_.insert(clientIt->second.conn);
+            }
+            return;
+        }
+        auto connIt = conns_.find(id);
+        if(connIt != conns_.end() && connIt->second.client != 0) {
+            dirty_.insert(connIt->second.client);
+        }
+    }
+
+    void flushDirty_() {
+        while(!dirty_.empty()) {
+            uint64_t id = *dirty_.begin();
+            dirty_.erase(dirty_.begin());
+            if(clients_.count(id)) {
+                flushClient_(id);
+            } else if(conns_.count(id)) {
+                flushConn_(id);
+            }
+        }
+    }
+
+    void flushClient_(uint64_t id) {
+        Client& client = clients_.at(id);
+        size_t bufferedBefore = client.out.size() - client.outPos;
+        if(!sendBuffered_(client.fd, client.out, client.outPos)) {
+            closeClient_(id);
+            return;
+        }
+        if(client.outPos == client.out.size() && client.state == Client::Closing) {
+            closeClient_(id);
+            return;
+        }
+        if(
+            client.conn != 0 &&
+            bufferedBefore >= MaxBufferedSize &&
+            client.out.size() - client.outPos < MaxBufferedSize
+        ) {
+            // Resume reading the response
+            dirty_.insert(client.conn);
+        }
+
+        uint32_t events = 0;
+        if(!client.inputClosed && client.state != Client::Closing) {
+            events |= EPOLLRDHUP;
+            size_t toWorker =
+                client.conn != 0 ?
+                    conns_.at(client.conn).out.size() - conns_.at(client.conn).outPos :
+                    client.pending.size();
+            if(
+                client.state == Client::ReadingHead ||
+                (client.bodyLeft > 0 && toWorker < MaxBufferedSize)
+            ) {
+                events |= EPOLLIN;
+            }
+        }
+        if(client.outPos < client.out.size()) {
+            events |= EPOLLOUT;
+        }
+        setEvents_(client.fd, id, client.events, events);
+    }
+
+    void flushConn_(uint64_t connID) {
+        WorkerConn& conn = conns_.at(connID);
+        if(!conn.connecting) {
+            size_t bufferedBefore = conn.out.size() - conn.outPos;
+            if(!sendBuffered_(conn.fd, conn.out, conn.outPos)) {
+                failConn_(connID, false);
+                return;
+            }
+            if(
+                conn.client != 0 &&
+                bufferedBefore >= MaxBufferedSize &&
+                conn.out.size() - conn.outPos < MaxBufferedSize
+            ) {
+                // Resume reading the request body
+                dirty_.insert(conn.client);
+            }
+        }
+
+        uint32_t events = 0;
+        if(conn.connecting || conn.outPos < conn.out.size()) {
+            events |= EPOLLOUT;
+        }
+        if(!conn.connecting) {
+            if(conn.client == 0) {
+                events |= EPOLLIN;
+            } else {
+                const Client& client = clients_.at(conn.client);
+                if(client.out.size() - client.outPos < MaxBufferedSize) {
+                    events |= EPOLLIN;
+                }
+            }
+        }
+        setEvents_(conn.fd, connID, conn.events, events);
+    }
+
+    // Sends as much of data (starting from pos) as the socket accepts without
+    // blocking. Returns false if sending failed.
+    static bool sendBuffered_(int fd, string& data, size_t& pos) {
+        while(pos < data.size()) {
+            ssize_t count = send(fd, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+            if(count > 0) {
+                pos += (size_t)count;
+            } else if(count == -1 && errno == EINTR) {
+                continue;
+            } else if(count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        if(pos == data.size()) {
+            data.clear();
+            pos = 0;
+        } else if(pos >= BufSize && 2 * pos >= data.size()) {
+            data.erase(0, pos);
+            pos = 0;
+        }
+        return true;
+    }
+
+    void registerFd_(int fd, uint64_t id) {
+        epoll_event event;
+        event.events = 0;
+        event.data.u64 = id;
+        REQUIRE(epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) == 0);
+    }
+
+    void setEvents_(int fd, uint64_t id, uint32_t& current, uint32_t events) {
+        if(events != current) {
+            epoll_event event;
+            event.events = events;
+            event.data.u64 = id;
+            REQUIRE(epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event) == 0);
+            current = events;
+        }
+    }
+
+    void updateListening_() {
+        setListening_(
+            clients_.size() < clientLimit_ && steady_clock::now() >= acceptPausedUntil_
+        );
+    }
+
+    void setListening_(bool listening) {
+        if(listening == listening_) {
+            return;
+        }
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = ListenID;
+        if(listening) {
+            REQUIRE(epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event) == 0);
+        } else {
+            REQUIRE(epoll_ctl(epollFd_, EPOLL_CTL_DEL, listenFd_, &event) == 0);
+        }
+        listening_ = listening;
+    }
+
+    int epollFd_;
+    int listenFd_;
+    bool listening_;
+    steady_clock::time_point acceptPausedUntil_;
+    size_t clientLimit_;
+    shared_ptr<Router> router_;
+    int workerBasePort_;
+
+    map<uint64_t, Client> clients_;
+    map<uint64_t, WorkerConn> conns_;
+    vector<vector<uint64_t>> idleConns_;
+    uint64_t nextID_;
+
+    set<pair<steady_clock::time_point, uint64_t>> connectRetries_;
+    set<uint64_t> dirty_;
+    steady_clock::time_point lastTimeoutCheck_;
+
+    unique_ptr<char[]> buf_;
+};
+
+int createListenSocket(const string& listenAddr) {
+    size_t colon = listenAddr.rfind(':');
+    if(colon == string::npos) {
+        return -1;
+    }
+    string host = listenAddr.substr(0, colon);
+    string port = listenAddr.substr(colon + 1);
+    if(host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    addrinfo* result;
+    if(getaddrinfo(
+        host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result
+    )) {
+        return -1;
+    }
+
+    int fd = -1;
+    for(addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(
+            ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol
+        );
+        if(fd == -1) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(
+            bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0
+        ) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+struct Worker {
+    int index;
+    vector<string> args;
+    pid_t pid;
+    steady_clock::time_point startTime;
+    steady_clock::time_point restartTime;
+    int64_t restartDelayMs;
+};
+
+vector<string> workerArgs(const Config& config, int argc, char* argv[], int index) {
+    vector<string> args = {argv[0]};
+    for(int argi = 1; argi < argc; ++argi) {
+        string arg = argv[argi];
+        size_t eqSignPos = arg.find('=');
+        if(
+            arg.substr(0, 2) == "--" &&
+            eqSignPos != string::npos &&
+            WorkerOwnOptions.count(arg.substr(2, eqSignPos - 2))
+        ) {
+            continue;
+        }
+        args.push_back(arg);
+    }
+
+    string indexStr = toString(index);
+    args.push_back("--workers=0");
+    args.push_back(
+        "--window-handle-shard=" + indexStr + "/" + toString(config.workers)
+    );
+    args.push_back(
+        "--vice-opt-http-listen-addr=127.0.0.1:" +
+        toString(config.workerBasePort + index)
+    );
+    if(!config.dataDir.empty()) {
+        args.push_back("--data-dir=" + config.dataDir + "/worker-" + indexStr);
+    }
+
+    auto addPathOpt = [&](const string& name, const string& path) {
+        if(!path.empty()) {
+            args.push_back("--" + name + "=" + path + "." + indexStr);
+        }
+    };
+    addPathOpt("cookie-snapshot-file", config.cookieSnapshotFile);
+    addPathOpt("snapshot-file", config.snapshotFile);
+    addPathOpt("restore-snapshot", config.restoreSnapshot);
+    addPathOpt("trace-file", config.traceFile);
+    addPathOpt("frame-capture-file", config.frameCaptureFile);
+
+    return args;
+}
+
+pid_t spawnWorker(const vector<string>& args) {
+    // The arguments are prepared before forking, as only async-signal-safe
+    // functions may be called in the child of a multithreaded process
+    vector<char*> argv;
+    for(const string& arg : args) {
+        argv.push_back((char*)arg.c_str());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        // Worker process:
+
+        // Move the worker to its own process group, as otherwise Ctrl+C sent
+        // to the supervisor would also reach the workers; the supervisor
+        // shuts them down itself
+        setpgid(0, 0);
+
+        execv("/proc/self/exe", argv.data());
+        _exit(1);
+    }
+    return pid;
+}
+
+}
+
+int runSupervisor(shared_ptr<Config> config, int argc, char* argv[]) {
+    REQUIRE(config->workers > 0);
+
+    int workerCount = config->workers;
+    if(config->workerBasePort + workerCount - 1 > 65535) {
+        flushLogs();
+        cerr << "ERROR: The ports of the workers exceed 65535, decrease --worker-base-port\n";
+        return 1;
+    }
+
+    string listenAddr = DefaultListenAddr;
+    for(const pair<string, string>& opt : config->viceOpts) {
+        if(opt.first == "http-listen-addr") {
+            listenAddr = opt.second;
+        }
+    }
+    int listenFd = createListenSocket(listenAddr);
+    if(listenFd == -1) {
+        flushLogs();
+        cerr << "ERROR: Listening for HTTP connections at " << listenAddr << " failed\n";
+        return 1;
+    }
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd == -1) {
+        close(listenFd);
+        flushLogs();
+        cerr << "ERROR: Creating epoll instance for the router failed\n";
+        return 1;
+    }
+
+    // Each client connection may use a worker connection in addition to its
+    // own file descriptor
+    size_t clientLimit = MaxClientConnections;
+    rlimit fdLimit;
+    if(getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur != RLIM_INFINITY) {
+        size_t reserved = 64 + MaxIdleWorkerConnections * (size_t)workerCount;
+        size_t available = (size_t)fdLimit.rlim_cur;
+        available = available > reserved ? (available - reserved) / 2 : 0;
+        clientLimit = max(min(clientLimit, available), (size_t)1);
+    }
+
+    signal(SIGINT, handleTermSignal);
+    signal(SIGTERM, handleTermSignal);
+
+    if(!config->dataDir.empty()) {
+        for(int i = 0; i < workerCount; ++i) {
+            string path = config->dataDir + "/worker-" + toString(i);
+            if(mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+                WARNING_LOG("Creating data directory ", path, " for worker ", i, " failed");
+            }
+        }
+    }
+
+    shared_ptr<Router> router = Router::create(workerCount);
+    shared_ptr<Proxy> proxy = Proxy::create(
+        epollFd, listenFd, clientLimit, router, workerCount, config->workerBasePort
+    );
+    vector<Worker> workers(workerCount);
+    for(int i = 0; i < workerCount; ++i) {
+        workers[i].index = i;
+        workers[i].args = workerArgs(*config, argc, argv, i);
+        workers[i].pid = 0;
+        workers[i].restartTime = steady_clock::now();
+        workers[i].restartDelayMs = MinWorkerRestartDelayMs;
+    }
+
+    INFO_LOG(
+        "Supervisor routing HTTP requests from ", listenAddr, " to ",
+        workerCount, " workers (at most ", clientLimit, " client connections)"
+    );
+
+    while(!stopRequested) {
+        steady_clock::time_point now = steady_clock::now();
+        for(Worker& worker : workers) {
+            if(worker.pid != 0 && waitpid(worker.pid, nullptr, WNOHANG) == worker.pid) {
+                if(now - worker.startTime >= milliseconds(MaxWorkerRestartDelayMs)) {
+                    worker.restartDelayMs = MinWorkerRestartDelayMs;
+                }
+                ERROR_LOG(
+                    "Worker ", worker.index, " (PID ", worker.pid, ") exited, ",
+                    "restarting it in ", worker.restartDelayMs, " ms"
+                );
+                worker.pid = 0;
+                worker.restartTime = now + milliseconds(worker.restartDelayMs);
+                worker.restartDelayMs =
+                    min(2 * worker.restartDelayMs, MaxWorkerRestartDelayMs);
+                router->setWorkerRunning(worker.index, false);
+            }
+
+            if(worker.pid == 0 && now >= worker.restartTime) {
+                pid_t pid = spawnWorker(worker.args);
+                if(pid == -1) {
+                    ERROR_LOG("Starting worker ", worker.index, " failed");
+                    worker.restartTime = now + milliseconds(worker.restartDelayMs);
+                    continue;
+                }
+                INFO_LOG(
+                    "Started worker ", worker.index, " (PID ", pid, ") listening at ",
+                    "127.0.0.1:", config->workerBasePort + worker.index
+                );
+                worker.pid = pid;
+                worker.startTime = now;
+                router->setWorkerRunning(worker.index, true);
+            }
+        }
+
+        proxy->run(100);
+    }
+
+    proxy.reset();
+    close(epollFd);
+    close(listenFd);
+
+    for(const Worker& worker : workers) {
+        if(worker.pid != 0) {
+            INFO_LOG("Sending SIGTERM to worker ", worker.index, " to shut it down");
+            if(kill(worker.pid, SIGTERM) != 0) {
+                WARNING_LOG("Could not send SIGTERM signal to worker ", worker.index);
+            }
+        }
+    }
+    for(const Worker& worker : workers) {
+        if(worker.pid != 0) {
+            while(waitpid(worker.pid, nullptr, 0) == -1 && errno == EINTR) {}
+        }
+    }
+    INFO_LOG("All workers shut down");
+
+    return 0;
+}
+
+}
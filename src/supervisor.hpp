@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+class Config;
+
+// Supervisor mode, enabled by the workers option. Instead of running a
+// browser, the process starts the workers as child processes, running the same
+// executable with the same options except that each worker gets its own
+// window-handle-shard, HTTP listen address (see worker-base-port), data
+// directory (DATA_DIR/worker-INDEX) and output and snapshot files (PATH.INDEX).
+// The supervisor listens at vice-opt-http-listen-addr and routes each request
+// on the keep-alive client connections to a worker over a pool of keep-alive
+// connections to the workers, using a single epoll event loop with a bounded
+// number of client connections:
+//   - /HANDLE/... goes to the worker that owns the window handle; as the
+//     handle shards of the workers are disjoint, the placement of a window is
+//     sticky without a placement table.
+//   - / and /goto/... (which open a new window) go to the running worker with
+//     the fewest windows that have received requests recently, except that
+//     /goto/browservice:restore/HANDLE/... goes to the owner of HANDLE, which
+//     has the window in its session snapshot (if the drained supervisor had
+//     the same number of workers).
+//   - Other paths (such as /clipboard/ and /stats/) go to worker 0.
+// Workers that exit are restarted. Returns the exit code of the program after
+// a termination signal has been received and the workers have shut down.
+int runSupervisor(shared_ptr<Config> config, int argc, char* argv[]);
+
+}
@@ -71,6 +71,37 @@ private:
     string oldValue_;
 };
 
+struct Graymap {
+    int width;
+    int height;
+    vector<uint8_t> buffer;
+    FT_Bitmap ftBitmap;
+
+    Graymap(int pWidth, int pHeight) {
+        width = pWidth;
+        height = pHeight;
+
+        REQUIRE(width >= 1);
+        REQUIRE(height >= 1);
+
+        const int Limit = INT_MAX / 9;
+        REQUIRE(width < Limit / height);
+
+        buffer.resize(width * height);
+        ftBitmap.rows = height;
+        ftBitmap.width = width;
+        ftBitmap.pitch = width;
+        ftBitmap.buffer = buffer.data();
+        ftBitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+    }
+
+    Graymap(const Graymap&) = delete;
+    Graymap& operator=(const Graymap&) = delete;
+
+    Graymap(Graymap&&) = default;
+    Graymap& operator=(Graymap&&) = default;
+};
+
 }
 
 struct TextRenderContext::Impl {
@@ -78,6 +109,14 @@ struct TextRenderContext::Impl {
     PangoContext* pangoCtx;
     PangoFontDescription* fontDesc;
 
+    // Rendered texts shared by all the layouts using this context (all the
+    // layouts use the same font and settings, so the rendering only depends on
+    // the text). The entries are kept as long as some layout uses them;
+    // expired entries are removed once the cache has doubled in size since
+    // the previous cleanup.
+    map<string, weak_ptr<const Graymap>> graymapCache;
+    size_t graymapCacheCleanupSize = 64;
+
     Impl() {
         // Set interpreter version environment variable
         FreeType2SetEnv setEnv;
@@ -122,48 +161,24 @@ struct TextRenderContext::Impl {
     DISABLE_COPY_MOVE(Impl);
 };
 
-namespace {
-
-struct Graymap {
-    int width;
-    int height;
-    vector<uint8_t> buffer;
-    FT_Bitmap ftBitmap;
-
-    Graymap(int pWidth, int pHeight) {
-        width = pWidth;
-        height = pHeight;
-
-        REQUIRE(width >= 1);
-        REQUIRE(height >= 1);
-
-        const int Limit = INT_MAX / 9;
-        REQUIRE(width < Limit / height);
-
-        buffer.resize(width * height);
-        ftBitmap.rows = height;
-        ftBitmap.width = width;
-        ftBitmap.pitch = width;
-        ftBitmap.buffer = buffer.data();
-        ftBitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
-    }
-
-    Graymap(const Graymap&) = delete;
-    Graymap& operator=(const Graymap&) = delete;
-
-    Graymap(Graymap&&) = default;
-    Graymap& operator=(Graymap&&) = default;
-};
-
-}
-
 struct TextLayout::Impl {
     shared_ptr<TextRenderContext> ctx;
     PangoLayout* layout;
 
     string text;
 
-    optional<Graymap> graymap;
+    shared_ptr<const Graymap> graymap;
+
+    // Layout measurements cached until the next edit. For texts consisting
+    // only of printable ASCII (the common case with URLs), caretX contains the
+    // x coordinate (in Pango units) of every character boundary, computed in
+    // one pass over the layout; caret queries are then answered without
+    // calling into Pango.
+    // Other texts may contain bidirectional runs or complex clusters, so for
+    // them the queries are always delegated to Pango.
+    optional<PangoRectangle> extents;
+    bool printableASCII;
+    vector<int> caretX;
 
     Impl(shared_ptr<TextRenderContext> ctx) : ctx(ctx) {
         layout = pango_layout_new(ctx->impl_->pangoCtx);
@@ -172,6 +187,8 @@ struct TextLayout::Impl {
         pango_layout_set_font_description(layout, ctx->impl_->fontDesc);
         pango_layout_set_auto_dir(layout, FALSE);
         pango_layout_set_single_paragraph_mode(layout, TRUE);
+
+        printableASCII = true;
     }
 
     ~Impl() {
@@ -181,17 +198,93 @@ struct TextLayout::Impl {
     DISABLE_COPY_MOVE(Impl);
 
     void setText(string newText) {
+        text = move(newText);
+        textChanged(isPrintableASCII(text.data(), text.size()));
+    }
+
+    void replaceText(int start, int end, const string& replacement) {
+        REQUIRE(start >= 0 && start <= end && end <= (int)text.size());
+
+        // Usually only the replacement needs to be scanned to keep the flag up
+        // to date; the whole text is rescanned only if the flag may become set
+        bool replacementPrintable =
+            isPrintableASCII(replacement.data(), replacement.size());
+        bool newPrintable = printableASCII && replacementPrintable;
+
+        text.replace(start, end - start, replacement);
+
+        if(!printableASCII && replacementPrintable) {
+            newPrintable = isPrintableASCII(text.data(), text.size());
+        }
+        textChanged(newPrintable);
+    }
+
+    static bool isPrintableASCII(const char* data, size_t size) {
+        for(size_t i = 0; i < size; ++i) {
+            unsigned char c = (unsigned char)data[i];
+            if(c < 0x20 || c >= 0x7F) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void textChanged(bool newPrintable) {
         graymap.reset();
+        extents.reset();
+        caretX.clear();
+        printableASCII = newPrintable;
 
-        pango_layout_set_text(layout, newText.data(), newText.size());
+        // Pango has no API for patching the text of a layout, so the whole
+        // text is passed and the layout recomputes itself lazily
+        pango_layout_set_text(layout, text.data(), text.size());
 
         // Check that Pango agrees that the text is valid UTF-8
-        REQUIRE(!strcmp(pango_layout_get_text(layout), newText.c_str()));
+        REQUIRE(!strcmp(pango_layout_get_text(layout), text.c_str()));
+    }
 
-        text = move(newText);
+    void ensureCaretXComputed() {
+        REQUIRE(printableASCII);
+        if(!caretX.empty()) return;
+
+        // Each byte is a separate left-to-right character, so the boundary
+        // preceding each character is its left edge
+        caretX.reserve(text.size() + 1);
+        PangoLayoutIter* iter = pango_layout_get_iter(layout);
+        REQUIRE(iter != nullptr);
+        PangoRectangle rect;
+        rect.x = 0;
+        rect.width = 0;
+        for(size_t i = 0; i < text.size(); ++i) {
+            pango_layout_iter_get_char_extents(iter, &rect);
+            caretX.push_back(rect.x);
+            pango_layout_iter_next_char(iter);
+        }
+        pango_layout_iter_free(iter);
+        caretX.push_back(text.empty() ? 0 : rect.x + rect.width);
     }
 
     int xCoordToIndex(int x) {
+        if(printableASCII) {
+            ensureCaretXComputed();
+
+            // Find the character containing x and pick its closer edge, like
+            // pango_layout_line_x_to_index does
+            int px = x * PANGO_SCALE;
+            auto it = upper_bound(caretX.begin(), caretX.end(), px);
+            if(it == caretX.begin()) {
+                return 0;
+            }
+            if(it == caretX.end()) {
+                return (int)text.size();
+            }
+            int idx = (int)(it - caretX.begin()) - 1;
+            if(2 * (px - caretX[idx]) >= caretX[idx + 1] - caretX[idx]) {
+                ++idx;
+            }
+            return idx;
+        }
+
         PangoLayoutLine* line = pango_layout_get_line_readonly(layout, 0);
         REQUIRE(line != nullptr);
 
@@ -206,6 +299,11 @@ struct TextLayout::Impl {
     int indexToXCoord(int idx) {
         REQUIRE(idx >= 0 && idx <= (int)text.size());
 
+        if(printableASCII) {
+            ensureCaretXComputed();
+            return caretX[idx] / PANGO_SCALE;
+        }
+
         PangoRectangle rect;
         pango_layout_get_cursor_pos(layout, idx, &rect, nullptr);
         return rect.x / PANGO_SCALE;
@@ -214,6 +312,10 @@ struct TextLayout::Impl {
     int visualMoveIdx(int idx, bool forward) {
         REQUIRE(idx >= 0 && idx <= (int)text.size());
 
+        if(printableASCII) {
+            return forward ? min(idx + 1, (int)text.size()) : max(idx - 1, 0);
+        }
+
         int trailing;
         pango_layout_move_cursor_visually(
             layout,
@@ -246,48 +348,53 @@ struct TextLayout::Impl {
 
         offsetY += dest.height() - graymap->height;
 
-        Rect rect = Rect::intersection(
-            Rect(0, graymap->width, 0, graymap->height),
-            Rect::translate(
-                Rect(0, dest.width(), 0, dest.height()),
-                -offsetX, -offsetY
-            )
+        dest.fillMask(
+            offsetX, offsetY,
+            graymap->buffer.data(),
+            graymap->width, graymap->height, graymap->width,
+            r, g, b
         );
-
-        if(!rect.isEmpty()) {
-            for(int y = rect.startY; y < rect.endY; ++y) {
-                uint8_t* graymapPos =
-                    &graymap->buffer[y * graymap->width + rect.startX];
-                uint8_t* destPos =
-                    dest.getPixelPtr(rect.startX + offsetX, y + offsetY);
-
-                for(int x = rect.startX; x < rect.endX; ++x) {
-                    if(*graymapPos >= 128) {
-                        *(destPos + 0) = b;
-                        *(destPos + 1) = g;
-                        *(destPos + 2) = r;
-                    }
-                    ++graymapPos;
-                    destPos += 4;
-                }
-            }
-        }
     }
 
     PangoRectangle getExtents() {
-        PangoRectangle extents;
-        pango_layout_get_pixel_extents(layout, nullptr, &extents);
-        extents.width = max(extents.width, 1);
-        extents.height = max(extents.height, 1);
-        return extents;
+        if(!extents) {
+            PangoRectangle rect;
+            pango_layout_get_pixel_extents(layout, nullptr, &rect);
+            rect.width = max(rect.width, 1);
+            rect.height = max(rect.height, 1);
+            extents = rect;
+        }
+        return *extents;
     }
 
     void ensureGraymapRendered() {
         if(graymap) return;
 
+        map<string, weak_ptr<const Graymap>>& cache = ctx->impl_->graymapCache;
+        weak_ptr<const Graymap>& entry = cache[text];
+        graymap = entry.lock();
+        if(graymap) return;
+
         PangoRectangle extents = getExtents();
-        graymap = Graymap(extents.width, extents.height);
-        pango_ft2_render_layout(&graymap->ftBitmap, layout, -extents.x, -extents.y);
+        shared_ptr<Graymap> newGraymap =
+            make_shared<Graymap>(extents.width, extents.height);
+        pango_ft2_render_layout(
+            &newGraymap->ftBitmap, layout, -extents.x, -extents.y
+        );
+        graymap = newGraymap;
+        entry = graymap;
+
+        size_t& cleanupSize = ctx->impl_->graymapCacheCleanupSize;
+        if(cache.size() >= cleanupSize) {
+            for(auto it = cache.begin(); it != cache.end(); ) {
+                if(it->second.expired()) {
+                    it = cache.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            cleanupSize = max(cleanupSize, 2 * cache.size());
+        }
     }
 };
 
@@ -317,7 +424,12 @@ void TextLayout::setText(string text) {
     impl_->setText(move(text));
 }
 
-string TextLayout::text() {
+void TextLayout::replaceText(int start, int end, const string& replacement) {
+    REQUIRE_UI_THREAD();
+    impl_->replaceText(start, end, replacement);
+}
+
+const string& TextLayout::text() {
     REQUIRE_UI_THREAD();
     return impl_->text;
 }
@@ -383,7 +495,16 @@ void OverflowTextLayout::setText(string text) {
     clampOffset_();
 }
 
-string OverflowTextLayout::text() {
+void OverflowTextLayout::replaceText(
+    int start, int end, const string& replacement
+) {
+    REQUIRE_UI_THREAD();
+
+    textLayout_->replaceText(start, end, replacement);
+    clampOffset_();
+}
+
+const string& OverflowTextLayout::text() {
     return textLayout_->text();
 }
 
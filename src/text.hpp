@@ -33,7 +33,12 @@ public:
     // Set the text to be laid out. Must be valid UTF-8.
     void setText(string text);
 
-    string text();
+    // Replace the bytes [start, end) of the text by given replacement, which
+    // is cheaper than setText for small edits of long texts. The resulting
+    // text must be valid UTF-8.
+    void replaceText(int start, int end, const string& replacement);
+
+    const string& text();
 
     // The logical size of the current text when rendered.
     int width();
@@ -71,7 +76,8 @@ public:
     OverflowTextLayout(CKey);
 
     void setText(string text);
-    string text();
+    void replaceText(int start, int end, const string& replacement);
+    const string& text();
 
     // Set/get the width to which the text is clamped
     void setWidth(int width);
@@ -23,6 +23,8 @@ TextField::TextField(CKey,
     removeCaretOnSubmit_ = true;
     allowEmptySubmit_ = true;
 
+    backgroundColor_ = {255, 255, 255};
+
     hasFocus_ = false;
     leftMouseButtonDown_ = false;
     shiftKeyDown_ = false;
@@ -71,6 +73,16 @@ void TextField::setAllowEmptySubmit(bool value) {
     allowEmptySubmit_ = value;
 }
 
+void TextField::setBackgroundColor(uint8_t r, uint8_t g, uint8_t b) {
+    REQUIRE_UI_THREAD();
+
+    array<uint8_t, 3> color = {r, g, b};
+    if(color != backgroundColor_) {
+        backgroundColor_ = color;
+        signalViewDirty_();
+    }
+}
+
 void TextField::unsetCaret_() {
     if(caretActive_) {
         caretActive_ = false;
@@ -106,6 +118,11 @@ void TextField::scheduleBlinkCaret_() {
 
     caretBlinkTimeout_->clear(false);
 
+    // Without UI animations, the caret stays visible and produces no frames
+    if(!globals->config->uiAnimations) {
+        return;
+    }
+
     weak_ptr<TextField> selfWeak = shared_from_this();
     caretBlinkTimeout_->set([selfWeak]() {
         REQUIRE_UI_THREAD();
@@ -126,15 +143,8 @@ void TextField::typeText_(const char* textPtr, int textLength) {
         int idx2 = max(caretStart_, caretEnd_);
         unsetCaret_();
 
-        string oldText = textLayout_->text();
-        REQUIRE(idx1 >= 0 && idx2 <= (int)oldText.size());
-
-        string newText;
-        newText.append(oldText, 0, idx1);
-        newText.append(textPtr, textLength);
-        newText.append(oldText, idx2, (int)oldText.size() - idx2);
-
-        textLayout_->setText(newText);
+        REQUIRE(idx1 >= 0 && idx2 <= (int)textLayout_->text().size());
+        textLayout_->replaceText(idx1, idx2, string(textPtr, textLength));
 
         int idx = idx1 + textLength;
         setCaret_(idx, idx);
@@ -156,13 +166,8 @@ void TextField::eraseRange_() {
         int idx2 = max(caretStart_, caretEnd_);
         unsetCaret_();
 
-        string oldText = textLayout_->text();
-        REQUIRE(idx1 >= 0 && idx2 <= (int)oldText.size());
-
-        string newText =
-            oldText.substr(0, idx1) +
-            oldText.substr(idx2, (int)oldText.size() - idx2);
-        textLayout_->setText(newText);
+        REQUIRE(idx1 >= 0 && idx2 <= (int)textLayout_->text().size());
+        textLayout_->replaceText(idx1, idx2, "");
 
         setCaret_(idx1, idx1);
 
@@ -187,7 +192,7 @@ void TextField::copyToClipboard_() {
         int idx1 = min(caretStart_, caretEnd_);
         int idx2 = max(caretStart_, caretEnd_);
         if(idx1 < idx2) {
-            string text = textLayout_->text();
+            const string& text = textLayout_->text();
             REQUIRE(idx1 >= 0 && idx2 <= (int)text.size());
             globals->xWindow->copyToClipboard(text.substr(idx1, idx2 - idx1));
         }
@@ -204,6 +209,10 @@ void TextField::widgetRender_() {
 
     ImageSlice viewport = getViewport();
 
+    viewport.fill(
+        0, viewport.width(), 0, viewport.height(),
+        backgroundColor_[0], backgroundColor_[1], backgroundColor_[2]
+    );
     textLayout_->render(viewport);
 
     int caretStartY = viewport.height() - 14;
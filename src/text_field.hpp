@@ -42,6 +42,11 @@ public:
     void setRemoveCaretOnSubmit(bool value);
     void setAllowEmptySubmit(bool value);
 
+    // The text field fills its viewport with the background color (default
+    // white) so that it can be rendered independently of its parent; the
+    // color should match the background drawn by the parent.
+    void setBackgroundColor(uint8_t r, uint8_t g, uint8_t b);
+
 private:
     void unsetCaret_();
     void setCaret_(int start, int end);
@@ -74,6 +79,8 @@ private:
     bool removeCaretOnSubmit_;
     bool allowEmptySubmit_;
 
+    array<uint8_t, 3> backgroundColor_;
+
     bool hasFocus_;
     bool leftMouseButtonDown_;
     bool shiftKeyDown_;
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "rect.hpp"
+
+namespace browservice {
+
+// Set of TileSize x TileSize tiles of an image of given size, used to track
+// which parts of the image have changed. The tile (tx, ty) covers the pixels
+// [TileSize * tx, TileSize * (tx + 1)) x [TileSize * ty, TileSize * (ty + 1))
+// clipped to the image.
+class TileBitmap {
+public:
+    static constexpr int TileSize = 64;
+
+    TileBitmap() {
+        width_ = 0;
+        height_ = 0;
+        tilesX_ = 0;
+        tilesY_ = 0;
+        count_ = 0;
+    }
+    TileBitmap(int width, int height) : TileBitmap() {
+        reset(width, height);
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    bool isEmpty() const { return count_ == 0; }
+
+    // Resizes the bitmap to an image of given size and clears all the tiles.
+    void reset(int width, int height) {
+        REQUIRE(width >= 0 && height >= 0);
+        width_ = width;
+        height_ = height;
+        tilesX_ = (width + TileSize - 1) / TileSize;
+        tilesY_ = (height + TileSize - 1) / TileSize;
+        bits_.assign((size_t)tilesX_ * (size_t)tilesY_, 0);
+        count_ = 0;
+    }
+
+    void clear() {
+        if(count_ != 0) {
+            fill(bits_.begin(), bits_.end(), (uint8_t)0);
+            count_ = 0;
+        }
+    }
+
+    bool tile(int tx, int ty) const {
+        return
+            tx >= 0 && tx < tilesX_ && ty >= 0 && ty < tilesY_ &&
+            bits_[(size_t)ty * tilesX_ + tx] != 0;
+    }
+    void markTile(int tx, int ty) {
+        if(tx >= 0 && tx < tilesX_ && ty >= 0 && ty < tilesY_) {
+            uint8_t& bit = bits_[(size_t)ty * tilesX_ + tx];
+            if(!bit) {
+                bit = 1;
+                ++count_;
+            }
+        }
+    }
+
+    // Returns true if the tile containing pixel (x, y) is marked.
+    bool tileAt(int x, int y) const {
+        return x >= 0 && y >= 0 && tile(x / TileSize, y / TileSize);
+    }
+
+    // Marks all the tiles intersecting given rectangle.
+    void markRect(Rect rect) {
+        rect = Rect::intersection(rect, Rect(0, width_, 0, height_));
+        if(rect.isEmpty()) {
+            return;
+        }
+        int endTX = (rect.endX + TileSize - 1) / TileSize;
+        int endTY = (rect.endY + TileSize - 1) / TileSize;
+        for(int ty = rect.startY / TileSize; ty < endTY; ++ty) {
+            for(int tx = rect.startX / TileSize; tx < endTX; ++tx) {
+                markTile(tx, ty);
+            }
+        }
+    }
+
+    void markAll() {
+        markRect(Rect(0, width_, 0, height_));
+    }
+
+    // Marks the tiles marked in other; the bitmaps may be of different sizes,
+    // in which case the tiles outside this bitmap are ignored.
+    void merge(const TileBitmap& other) {
+        if(other.count_ == 0) {
+            return;
+        }
+        int tilesX = min(tilesX_, other.tilesX_);
+        int tilesY = min(tilesY_, other.tilesY_);
+        for(int ty = 0; ty < tilesY; ++ty) {
+            for(int tx = 0; tx < tilesX; ++tx) {
+                if(other.bits_[(size_t)ty * other.tilesX_ + tx]) {
+                    markTile(tx, ty);
+                }
+            }
+        }
+    }
+
+    // Smallest rectangle (clipped to the image) containing all the marked
+    // tiles.
+    Rect boundingBox() const {
+        Rect ret;
+        forEachRect([&](Rect rect) {
+            ret = Rect::boundingBox(ret, rect);
+        });
+        return ret;
+    }
+
+    // Calls func(Rect) for disjoint rectangles (clipped to the image) that
+    // together cover exactly the marked tiles; consecutive marked tiles on the
+    // same row of tiles are combined into a single rectangle.
+    template <typename Func>
+    void forEachRect(Func func) const {
+        if(count_ == 0) {
+            return;
+        }
+        for(int ty = 0; ty < tilesY_; ++ty) {
+            const uint8_t* row = &bits_[(size_t)ty * tilesX_];
+            int tx = 0;
+            while(tx < tilesX_) {
+                if(!row[tx]) {
+                    ++tx;
+                    continue;
+                }
+                int startTX = tx;
+                while(tx < tilesX_ && row[tx]) {
+                    ++tx;
+                }
+                func(Rect(
+                    TileSize * startTX,
+                    min(TileSize * tx, width_),
+                    TileSize * ty,
+                    min(TileSize * (ty + 1), height_)
+                ));
+            }
+        }
+    }
+
+private:
+    int width_;
+    int height_;
+    int tilesX_;
+    int tilesY_;
+    vector<uint8_t> bits_;
+    size_t count_;
+};
+
+}
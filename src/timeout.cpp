@@ -5,12 +5,106 @@
 
 namespace browservice {
 
+// The timer service shared by all the timeouts, keeping the active timeouts
+// ordered by expiration time. Only the earliest expiration has a CEF delayed
+// task; when it runs, all the timeouts that have expired by then are run in
+// one sweep.
+class TimeoutService {
+public:
+    static TimeoutService& get() {
+        REQUIRE_UI_THREAD();
+
+        // Intentionally leaked to avoid destruction order issues with
+        // timeouts destroyed at exit
+        static TimeoutService* service = new TimeoutService();
+        return *service;
+    }
+
+    typedef multimap<steady_clock::time_point, Timeout*> Entries;
+
+    Entries::iterator add(steady_clock::time_point time, Timeout* timeout) {
+        Entries::iterator it = entries_.emplace(time, timeout);
+        schedule_();
+        return it;
+    }
+
+    // The delayed task for the removed entry (if any) is left to run; it
+    // will find nothing to do.
+    void remove(Entries::iterator it) {
+        entries_.erase(it);
+    }
+
+private:
+    void schedule_() {
+        if(entries_.empty()) {
+            return;
+        }
+        steady_clock::time_point time = entries_.begin()->first;
+        if(scheduledTime_ && *scheduledTime_ <= time) {
+            return;
+        }
+        scheduledTime_ = time;
+
+        steady_clock::duration delay = time - steady_clock::now();
+        int64_t delayMs = (int64_t)duration_cast<milliseconds>(
+            delay + milliseconds(1) - steady_clock::duration(1)
+        ).count();
+        delayMs = max(delayMs, (int64_t)0);
+
+        function<void()> task = [this, time]() {
+            tick_(time);
+        };
+        void (*call)(function<void()>) = [](function<void()> func) {
+            func();
+        };
+        CefPostDelayedTask(TID_UI, base::Bind(call, task), delayMs);
+    }
+
+    void tick_(steady_clock::time_point taskTime) {
+        REQUIRE_UI_THREAD();
+
+        if(scheduledTime_ == taskTime) {
+            scheduledTime_.reset();
+        }
+
+        // The callbacks may set and clear timeouts, so we only rely on the
+        // first entry staying valid until we remove it
+        steady_clock::time_point now = steady_clock::now();
+        while(!entries_.empty() && entries_.begin()->first <= now) {
+            shared_ptr<Timeout> timeout =
+                entries_.begin()->second->shared_from_this();
+            entries_.erase(entries_.begin());
+            timeout->expire_();
+        }
+
+        schedule_();
+    }
+
+    Entries entries_;
+
+    // Expiration time of the latest CEF delayed task posted; it is the
+    // earliest among the tasks that have not run yet.
+    optional<steady_clock::time_point> scheduledTime_;
+};
+
 Timeout::Timeout(CKey, int64_t delayMs) {
     REQUIRE_UI_THREAD();
 
     delayMs_ = max(delayMs, (int64_t)1);
+
+    int64_t granularityMs = 1;
+    while(granularityMs < 256 && 16 * granularityMs <= delayMs_) {
+        granularityMs *= 2;
+    }
+    granularity_ = milliseconds(granularityMs);
+
     active_ = false;
-    delayedTaskScheduled_ = false;
+}
+
+Timeout::~Timeout() {
+    if(active_) {
+        TimeoutService::get().remove(entry_);
+    }
 }
 
 void Timeout::set(Func func) {
@@ -19,22 +113,14 @@ void Timeout::set(Func func) {
 
     active_ = true;
     func_ = func;
-    funcTime_ = steady_clock::now() + milliseconds(delayMs_);
-
-    if(!delayedTaskScheduled_) {
-        delayedTaskScheduled_ = true;
-        delayedTaskTime_ = funcTime_;
 
-        shared_ptr<Timeout> self = shared_from_this();
-        function<void()> task = [self]() {
-            self->delayedTask_();
-        };
+    // Round the expiration time up to a multiple of the granularity
+    steady_clock::duration time =
+        (steady_clock::now() + milliseconds(delayMs_)).time_since_epoch();
+    time = (time + granularity_ - steady_clock::duration(1)) / granularity_ *
+        granularity_;
 
-        void (*call)(function<void()>) = [](function<void()> func) {
-            func();
-        };
-        CefPostDelayedTask(TID_UI, base::Bind(call, task), delayMs_);
-    }
+    entry_ = TimeoutService::get().add(steady_clock::time_point(time), this);
 }
 
 void Timeout::clear(bool runFunc) {
@@ -45,6 +131,7 @@ void Timeout::clear(bool runFunc) {
     }
 
     active_ = false;
+    TimeoutService::get().remove(entry_);
 
     Func func;
     swap(func_, func);
@@ -59,40 +146,15 @@ bool Timeout::isActive() {
     return active_;
 }
 
-void Timeout::delayedTask_() {
+void Timeout::expire_() {
     REQUIRE_UI_THREAD();
+    REQUIRE(active_);
 
-    REQUIRE(delayedTaskScheduled_);
-    delayedTaskScheduled_ = false;
-
-    if(!active_) {
-        return;
-    }
-
-    if(funcTime_ == delayedTaskTime_) {
-        active_ = false;
-        Func func;
-        swap(func_, func);
-        func();
-    } else {
-        int64_t addDelayMs = (int64_t)(duration_cast<milliseconds>(
-            funcTime_ - delayedTaskTime_
-        ).count());
-        addDelayMs = max(addDelayMs, (int64_t)1);
-
-        delayedTaskScheduled_ = true;
-        delayedTaskTime_ = funcTime_;
-
-        shared_ptr<Timeout> self = shared_from_this();
-        function<void()> task = [self]() {
-            self->delayedTask_();
-        };
-
-        void (*call)(function<void()>) = [](function<void()> func) {
-            func();
-        };
-        CefPostDelayedTask(TID_UI, base::Bind(call, task), addDelayMs);
-    }
+    // The service has already removed our entry
+    active_ = false;
+    Func func;
+    swap(func_, func);
+    func();
 }
 
 }
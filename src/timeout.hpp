@@ -4,14 +4,22 @@
 
 namespace browservice {
 
+class TimeoutService;
+
 // Timeout that runs a given callback from the CEF UI thread event loop after a
-// specified (fixed) delay, unless canceled
+// specified (fixed) delay, unless canceled. All the timeouts share a single
+// timer service that posts one CEF delayed task at a time for the earliest
+// expiration. To let the timeouts expire together, the expiration times are
+// rounded up to a multiple of a granularity of 1/32..1/16 of the delay (a power
+// of two between 1 and 256 milliseconds), so a timeout never fires early but
+// may fire up to that much late.
 class Timeout : public enable_shared_from_this<Timeout> {
 SHARED_ONLY_CLASS(Timeout);
 public:
     typedef function<void()> Func;
 
     Timeout(CKey, int64_t delayMs);
+    ~Timeout();
 
     // Set func to be run in delayMs milliseconds or when cleared with
     // runFunc set to true. Calling when the timeout is active is an error.
@@ -26,16 +34,19 @@ public:
     bool isActive();
 
 private:
-    void delayedTask_();
+    friend class TimeoutService;
+
+    // Called by the timer service once the expiration time has been reached.
+    void expire_();
 
     int64_t delayMs_;
+    steady_clock::duration granularity_;
 
     bool active_;
     Func func_;
-    steady_clock::time_point funcTime_;
 
-    bool delayedTaskScheduled_;
-    steady_clock::time_point delayedTaskTime_;
+    // The entry of the timeout in the timer service while active.
+    multimap<steady_clock::time_point, Timeout*>::iterator entry_;
 };
 
 }
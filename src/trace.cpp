@@ -0,0 +1,106 @@
+#include "trace.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace browservice {
+
+namespace {
+
+mutex traceMutex;
+FILE* traceFile = nullptr;
+bool traceEventWritten = false;
+atomic<bool> tracing(false);
+
+string jsonEscape(const string& str) {
+    string ret;
+    for(char c : str) {
+        if(c == '"' || c == '\\') {
+            ret.push_back('\\');
+            ret.push_back(c);
+        } else if((unsigned char)c < 0x20) {
+            ret.push_back(' ');
+        } else {
+            ret.push_back(c);
+        }
+    }
+    return ret;
+}
+
+}
+
+bool startTracing(const string& path) {
+    lock_guard<mutex> lock(traceMutex);
+    REQUIRE(traceFile == nullptr);
+
+    traceFile = fopen(path.c_str(), "w");
+    if(traceFile == nullptr) {
+        return false;
+    }
+
+    // The closing bracket is optional in the JSON array format, so the trace
+    // stays readable even if the program is killed
+    fputs("[\n", traceFile);
+    traceEventWritten = false;
+    tracing.store(true);
+    return true;
+}
+
+void stopTracing() {
+    lock_guard<mutex> lock(traceMutex);
+    if(traceFile != nullptr) {
+        tracing.store(false);
+        fputs("\n]\n", traceFile);
+        fclose(traceFile);
+        traceFile = nullptr;
+    }
+}
+
+bool isTracing() {
+    return tracing.load(memory_order_relaxed);
+}
+
+void traceStage(
+    uint64_t window,
+    uint64_t traceId,
+    const string& stage,
+    const string& details
+) {
+    if(!isTracing()) {
+        return;
+    }
+
+    int64_t ts = duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()
+    ).count();
+    long tid = syscall(SYS_gettid);
+
+    // Each trace is a nestable async event that begins at the input and ends
+    // once the image reflecting it has been sent
+    const char* phase = "n";
+    if(stage == "input") {
+        phase = "b";
+    } else if(stage == "sent") {
+        phase = "e";
+    }
+
+    stringstream ss;
+    ss << "{\"name\":\"input " << traceId << "\",\"cat\":\"latency\",";
+    ss << "\"ph\":\"" << phase << "\",\"id\":" << traceId << ",";
+    ss << "\"ts\":" << ts << ",\"pid\":" << getpid() << ",\"tid\":" << tid << ",";
+    ss << "\"args\":{\"stage\":\"" << jsonEscape(stage) << "\",";
+    ss << "\"window\":" << window << ",";
+    ss << "\"details\":\"" << jsonEscape(details) << "\"}}";
+    string line = ss.str();
+
+    lock_guard<mutex> lock(traceMutex);
+    if(traceFile != nullptr) {
+        if(traceEventWritten) {
+            fputs(",\n", traceFile);
+        }
+        fputs(line.c_str(), traceFile);
+        traceEventWritten = true;
+    }
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace browservice {
+
+// Input latency tracing: the vice plugin assigns a trace ID to each batch of
+// input events it relays, and the stages of the pipeline that the batch goes
+// through (plugin input, forwarding to CEF, paint, fetch, compression, sending
+// the image) are recorded as events of a Chrome trace JSON file (open it in
+// chrome://tracing or Perfetto), one async track per trace ID. Enabled using
+// the trace-file option.
+
+// Starts writing the trace to the file at given path (truncated); returns
+// false if opening it fails.
+bool startTracing(const string& path);
+
+// Finishes and closes the trace file, if any.
+void stopTracing();
+
+bool isTracing();
+
+// Records that the trace traceId of given window has reached the given stage
+// ("input" begins the trace and "sent" ends it). May be called from any
+// thread; does nothing if tracing has not been started.
+void traceStage(
+    uint64_t window,
+    uint64_t traceId,
+    const string& stage,
+    const string& details = ""
+);
+
+}
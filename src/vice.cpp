@@ -2,7 +2,10 @@
 
 #include "download_manager.hpp"
 #include "globals.hpp"
+#include "message_pump.hpp"
+#include "probe.hpp"
 #include "temp_dir.hpp"
+#include "trace.hpp"
 #include "widget.hpp"
 
 #include "../vice_plugin_api.h"
@@ -42,7 +45,14 @@ struct VicePlugin::APIFuncs {
 #define FOREACH_VICE_API_FUNC \
     FOREACH_REQUIRED_VICE_API_FUNC \
     FOREACH_VICE_API_FUNC_ITEM(isExtensionSupported) \
-    FOREACH_VICE_API_FUNC_ITEM(URINavigation_enable)
+    FOREACH_VICE_API_FUNC_ITEM(URINavigation_enable) \
+    FOREACH_VICE_API_FUNC_ITEM(DirtyRect_notifyWindowViewChanged) \
+    FOREACH_VICE_API_FUNC_ITEM(SharedFrame_enable) \
+    FOREACH_VICE_API_FUNC_ITEM(InputBatch_enable) \
+    FOREACH_VICE_API_FUNC_ITEM(WindowVisibility_enable) \
+    FOREACH_VICE_API_FUNC_ITEM(Trace_enable) \
+    FOREACH_VICE_API_FUNC_ITEM(Trace_windowViewTraced) \
+    FOREACH_VICE_API_FUNC_ITEM(MediaState_setWindowMediaPlaying)
 
 #define FOREACH_VICE_API_FUNC_ITEM(name) \
     decltype(&vicePluginAPI_ ## name) name = nullptr;
@@ -168,6 +178,25 @@ shared_ptr<VicePlugin> VicePlugin::load(string filename) {
         if(apiFuncs->isExtensionSupported(apiVersion, "URINavigation")) {
             LOAD_API_FUNC(URINavigation_enable);
         }
+        if(apiFuncs->isExtensionSupported(apiVersion, "DirtyRect")) {
+            LOAD_API_FUNC(DirtyRect_notifyWindowViewChanged);
+        }
+        if(apiFuncs->isExtensionSupported(apiVersion, "SharedFrame")) {
+            LOAD_API_FUNC(SharedFrame_enable);
+        }
+        if(apiFuncs->isExtensionSupported(apiVersion, "InputBatch")) {
+            LOAD_API_FUNC(InputBatch_enable);
+        }
+        if(apiFuncs->isExtensionSupported(apiVersion, "WindowVisibility")) {
+            LOAD_API_FUNC(WindowVisibility_enable);
+        }
+        if(apiFuncs->isExtensionSupported(apiVersion, "Trace")) {
+            LOAD_API_FUNC(Trace_enable);
+            LOAD_API_FUNC(Trace_windowViewTraced);
+        }
+        if(apiFuncs->isExtensionSupported(apiVersion, "MediaState")) {
+            LOAD_API_FUNC(MediaState_setWindowMediaPlaying);
+        }
     } else {
         apiVersion = BasicAPIVersion;
         if(!apiFuncs->isAPIVersionSupported(apiVersion)) {
@@ -391,6 +420,7 @@ ViceContext::ViceContext(CKey, CKey,
     shutdownPending_ = false;
     pumpEventsInQueue_.store(false);
     shutdownCompleteFlag_.store(false);
+    traceEnabled_ = false;
 
     nextWindowHandle_ = 1;
 
@@ -453,6 +483,196 @@ void ViceContext::start(shared_ptr<ViceContextEventHandler> eventHandler) {
         plugin_->apiFuncs_->URINavigation_enable(ctx_, uriNavigationCallbacks);
     }
 
+    if(plugin_->apiFuncs_->SharedFrame_enable != nullptr) {
+        VicePluginAPI_SharedFrame_Callbacks sharedFrameCallbacks;
+        memset(&sharedFrameCallbacks, 0, sizeof(VicePluginAPI_SharedFrame_Callbacks));
+
+        sharedFrameCallbacks.fetchWindowFrame = CTX_CALLBACK(void, (
+            uint64_t window,
+            void (*putFrameFunc)(
+                void* putFrameFuncData,
+                const uint8_t* image,
+                size_t width,
+                size_t height,
+                size_t pitch,
+                void (*releaseFunc)(void*),
+                void* releaseFuncData
+            ),
+            void* putFrameFuncData
+        ), {
+            REQUIRE(self->openWindows_.count(window));
+
+            bool putFrameCalled = false;
+            self->eventHandler_->onViceContextFetchWindowFrame(
+                window,
+                [&](
+                    const uint8_t* image,
+                    size_t width,
+                    size_t height,
+                    size_t pitch,
+                    shared_ptr<void> owner
+                ) {
+                    REQUIRE(!putFrameCalled);
+                    putFrameCalled = true;
+
+                    REQUIRE(width);
+                    REQUIRE(height);
+                    REQUIRE(owner);
+
+                    // The plugin may release the frame in any thread, even
+                    // after the context has been destroyed, so the release
+                    // data only holds the owner
+                    void (*releaseFunc)(void*) = [](void* releaseFuncData) {
+                        delete (shared_ptr<void>*)releaseFuncData;
+                    };
+                    void* releaseFuncData = (void*)new shared_ptr<void>(move(owner));
+                    putFrameFunc(
+                        putFrameFuncData,
+                        image, width, height, pitch,
+                        releaseFunc, releaseFuncData
+                    );
+                }
+            );
+            REQUIRE(putFrameCalled);
+        });
+
+        plugin_->apiFuncs_->SharedFrame_enable(ctx_, sharedFrameCallbacks);
+    }
+
+    if(plugin_->apiFuncs_->InputBatch_enable != nullptr) {
+        VicePluginAPI_InputBatch_Callbacks inputBatchCallbacks;
+        memset(&inputBatchCallbacks, 0, sizeof(VicePluginAPI_InputBatch_Callbacks));
+
+        inputBatchCallbacks.inputEvents = CTX_CALLBACK(void, (
+            uint64_t window,
+            const VicePluginAPI_InputEvent* events,
+            size_t eventCount
+        ), {
+            REQUIRE(self->openWindows_.count(window));
+            REQUIRE(events != nullptr || eventCount == 0);
+
+            vector<InputEvent> converted;
+            converted.reserve(eventCount);
+            for(size_t i = 0; i < eventCount; ++i) {
+                const VicePluginAPI_InputEvent& src = events[i];
+
+                InputEvent::Type type;
+                switch(src.type) {
+                case VICE_PLUGIN_API_INPUT_EVENT_MOUSE_DOWN:
+                    type = InputEvent::MouseDown;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_MOUSE_UP:
+                    type = InputEvent::MouseUp;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_MOUSE_MOVE:
+                    type = InputEvent::MouseMove;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_MOUSE_DOUBLE_CLICK:
+                    type = InputEvent::MouseDoubleClick;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_MOUSE_WHEEL:
+                    type = InputEvent::MouseWheel;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_MOUSE_LEAVE:
+                    type = InputEvent::MouseLeave;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_KEY_DOWN:
+                    type = InputEvent::KeyDown;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_KEY_UP:
+                    type = InputEvent::KeyUp;
+                    break;
+                case VICE_PLUGIN_API_INPUT_EVENT_LOSE_FOCUS:
+                    type = InputEvent::LoseFocus;
+                    break;
+                default:
+                    // Unknown event types are ignored as required by the API
+                    continue;
+                }
+
+                converted.push_back({
+                    type, src.x, src.y, src.button, src.dx, src.dy, src.key
+                });
+            }
+
+            if(!converted.empty()) {
+                self->eventHandler_->onViceContextInputEvents(window, converted);
+            }
+        });
+
+        plugin_->apiFuncs_->InputBatch_enable(ctx_, inputBatchCallbacks);
+    }
+
+    if(plugin_->apiFuncs_->WindowVisibility_enable != nullptr) {
+        VicePluginAPI_WindowVisibility_Callbacks windowVisibilityCallbacks;
+        memset(
+            &windowVisibilityCallbacks,
+            0,
+            sizeof(VicePluginAPI_WindowVisibility_Callbacks)
+        );
+
+        windowVisibilityCallbacks.setWindowVisible = CTX_CALLBACK(void, (
+            uint64_t window,
+            int visible
+        ), {
+            REQUIRE(self->openWindows_.count(window));
+            REQUIRE(visible == 0 || visible == 1);
+
+            self->eventHandler_->onViceContextSetWindowVisible(
+                window, (bool)visible
+            );
+        });
+
+        plugin_->apiFuncs_->WindowVisibility_enable(
+            ctx_, windowVisibilityCallbacks
+        );
+    }
+
+    if(plugin_->apiFuncs_->Trace_enable != nullptr && isTracing()) {
+        VicePluginAPI_Trace_Callbacks traceCallbacks;
+        memset(&traceCallbacks, 0, sizeof(VicePluginAPI_Trace_Callbacks));
+
+        // May be called from any thread, so the context is only accessed for
+        // the "input" stage, which is reported in pumpEvents right before the
+        // input events of the trace
+        traceCallbacks.traceEvent = [](
+            void* callbackData,
+            uint64_t window,
+            uint64_t traceId,
+            const char* stage,
+            const char* details
+        ) {
+        API_CALLBACK_HANDLE_EXCEPTIONS_START
+            REQUIRE(stage != nullptr);
+            string stageStr = stage;
+            traceStage(
+                window,
+                traceId,
+                stageStr,
+                details != nullptr ? sanitizeUTF8String(details) : ""
+            );
+
+            if(stageStr == "input") {
+                shared_ptr<ViceContext> self = getContext_(callbackData);
+                if(threadActivePumpEventsContext != self.get()) {
+                    PANIC(
+                        "Vice plugin reported the input stage of a trace in a "
+                        "thread that is not currently executing "
+                        "vicePluginAPI_pumpEvents"
+                    );
+                }
+                REQUIRE_UI_THREAD();
+                REQUIRE(self->openWindows_.count(window));
+
+                self->eventHandler_->onViceContextInputTraced(window, traceId);
+            }
+        API_CALLBACK_HANDLE_EXCEPTIONS_END
+        };
+
+        plugin_->apiFuncs_->Trace_enable(ctx_, traceCallbacks);
+        traceEnabled_ = true;
+    }
+
     VicePluginAPI_Callbacks callbacks;
     memset(&callbacks, 0, sizeof(VicePluginAPI_Callbacks));
 
@@ -460,7 +680,7 @@ void ViceContext::start(shared_ptr<ViceContextEventHandler> eventHandler) {
         REQUIRE(!self->shutdownCompleteFlag_.load());
 
         if(!self->pumpEventsInQueue_.exchange(true)) {
-            postTask(self, &ViceContext::pumpEvents_);
+            postUrgentTask([self]() { self->pumpEvents_(); });
         }
     });
 
@@ -702,11 +922,44 @@ void ViceContext::closeWindow(uint64_t window) {
     plugin_->apiFuncs_->closeWindow(ctx_, window);
 }
 
-void ViceContext::notifyWindowViewChanged(uint64_t window) {
+void ViceContext::notifyWindowViewChanged(uint64_t window, Rect dirtyRect) {
     RUNNING_CONTEXT_FUNC_CHECKS();
     REQUIRE(openWindows_.count(window));
+    REQUIRE(!dirtyRect.isEmpty());
+    REQUIRE(dirtyRect.startX >= 0 && dirtyRect.startY >= 0);
 
-    plugin_->apiFuncs_->notifyWindowViewChanged(ctx_, window);
+    if(plugin_->apiFuncs_->DirtyRect_notifyWindowViewChanged != nullptr) {
+        plugin_->apiFuncs_->DirtyRect_notifyWindowViewChanged(
+            ctx_,
+            window,
+            (size_t)dirtyRect.startX,
+            (size_t)dirtyRect.startY,
+            (size_t)(dirtyRect.endX - dirtyRect.startX),
+            (size_t)(dirtyRect.endY - dirtyRect.startY)
+        );
+    } else {
+        plugin_->apiFuncs_->notifyWindowViewChanged(ctx_, window);
+    }
+}
+
+void ViceContext::traceWindowView(uint64_t window, uint64_t traceId) {
+    RUNNING_CONTEXT_FUNC_CHECKS();
+    REQUIRE(openWindows_.count(window));
+
+    if(traceEnabled_) {
+        plugin_->apiFuncs_->Trace_windowViewTraced(ctx_, window, traceId);
+    }
+}
+
+void ViceContext::setWindowMediaPlaying(uint64_t window, bool playing) {
+    RUNNING_CONTEXT_FUNC_CHECKS();
+    REQUIRE(openWindows_.count(window));
+
+    if(plugin_->apiFuncs_->MediaState_setWindowMediaPlaying != nullptr) {
+        plugin_->apiFuncs_->MediaState_setWindowMediaPlaying(
+            ctx_, window, playing ? 1 : 0
+        );
+    }
 }
 
 void ViceContext::setWindowCursor(uint64_t window, int cursor) {
@@ -883,9 +1136,11 @@ void ViceContext::pumpEvents_() {
 
     pumpEventsInQueue_.store(false);
 
+    PROBE(pump_events_start);
     threadActivePumpEventsContext = this;
     plugin_->apiFuncs_->pumpEvents(ctx_);
     threadActivePumpEventsContext = nullptr;
+    PROBE(pump_events_end);
 }
 
 void ViceContext::shutdownComplete_() {
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "input_event.hpp"
+#include "rect.hpp"
 #include "timeout.hpp"
 
 typedef struct VicePluginAPI_Context VicePluginAPI_Context;
@@ -88,6 +90,16 @@ public:
         function<void(const uint8_t*, size_t, size_t, size_t)> putImage
     ) = 0;
 
+    // Variant of onViceContextFetchWindowImage used if the plugin supports the
+    // SharedFrame extension. The image must stay valid and unmodified until
+    // the owner passed to putFrame is released, which may happen in any thread.
+    virtual void onViceContextFetchWindowFrame(
+        uint64_t window,
+        function<void(
+            const uint8_t*, size_t, size_t, size_t, shared_ptr<void>
+        )> putFrame
+    ) = 0;
+
     virtual void onViceContextMouseDown(
         uint64_t window, int x, int y, int button
     ) = 0;
@@ -106,9 +118,29 @@ public:
     virtual void onViceContextKeyUp(uint64_t window, int key) = 0;
     virtual void onViceContextLoseFocus(uint64_t window) = 0;
 
+    // Called with a batch of input events for a window if the plugin supports
+    // the InputBatch extension; equivalent to calling the individual input
+    // event handlers above, except that consecutive mouse move and mouse wheel
+    // events may be coalesced.
+    virtual void onViceContextInputEvents(
+        uint64_t window,
+        const vector<InputEvent>& events
+    ) = 0;
+
+    // Called if input latency tracing is enabled (see trace.hpp) right before
+    // the input events of trace traceId are passed to the handlers above.
+    virtual void onViceContextInputTraced(uint64_t window, uint64_t traceId) {}
+
     virtual void onViceContextNavigate(uint64_t window, int direction) = 0;
     virtual void onViceContextNavigateToURI(uint64_t window, string uri) = 0;
 
+    // Called if the plugin supports the WindowVisibility extension when the
+    // view of the window stops or starts being shown in a client. Windows are
+    // initially visible.
+    virtual void onViceContextSetWindowVisible(
+        uint64_t window, bool visible
+    ) = 0;
+
     virtual void onViceContextCopyToClipboard(string text) = 0;
     virtual void onViceContextRequestClipboardContent() = 0;
 
@@ -157,7 +189,17 @@ public:
     );
     void closeWindow(uint64_t window);
 
-    void notifyWindowViewChanged(uint64_t window);
+    // If the plugin supports the DirtyRect extension, dirtyRect is passed to
+    // the plugin; otherwise, the whole view is reported as changed.
+    void notifyWindowViewChanged(uint64_t window, Rect dirtyRect);
+
+    // Tells the plugin that the next view change notification of the window
+    // reflects trace traceId; does nothing if tracing is not enabled.
+    void traceWindowView(uint64_t window, uint64_t traceId);
+
+    // Tells the plugin whether the window is playing media; does nothing if
+    // the plugin does not support the MediaState extension.
+    void setWindowMediaPlaying(uint64_t window, bool playing);
 
     void setWindowCursor(uint64_t window, int cursor);
 
@@ -191,6 +233,8 @@ private:
 
     shared_ptr<ViceContextEventHandler> eventHandler_;
 
+    bool traceEnabled_;
+
     // For running contexts, we store a shared pointer to self to avoid it being
     // destructed.
     shared_ptr<ViceContext> self_;
@@ -23,6 +23,8 @@ Widget::Widget(weak_ptr<WidgetParent> parent) {
 void Widget::setViewport(ImageSlice viewport) {
     REQUIRE_UI_THREAD();
 
+    // The area of the old viewport must be rendered again as well
+    addDirtyViewport_();
     viewport_ = viewport;
     widgetViewportUpdated_();
     signalViewDirty_();
@@ -33,16 +35,9 @@ ImageSlice Widget::getViewport() {
     return viewport_;
 }
 
-void Widget::render() {
+Rect Widget::render() {
     REQUIRE_UI_THREAD();
-
-    viewDirty_ = false;
-    widgetRender_();
-
-    for(shared_ptr<Widget> child : widgetListChildren_()) {
-        REQUIRE(child);
-        child->render();
-    }
+    return render_(false);
 }
 
 int Widget::cursor() {
@@ -218,7 +213,9 @@ void Widget::sendLoseFocusEvent() {
 
 void Widget::onWidgetViewDirty() {
     REQUIRE_UI_THREAD();
-    signalViewDirty_();
+
+    // The child keeps track of its own dirty region
+    propagateViewDirty_();
 }
 
 void Widget::onWidgetCursorChanged() {
@@ -262,6 +259,59 @@ void Widget::onGlobalHotkeyPressed(GlobalHotkey key) {
 void Widget::signalViewDirty_() {
     REQUIRE_UI_THREAD();
 
+    addDirtyViewport_();
+    propagateViewDirty_();
+}
+
+void Widget::signalViewDirty_(Rect rect) {
+    REQUIRE_UI_THREAD();
+
+    rect = Rect::intersection(
+        rect, Rect(0, viewport_.width(), 0, viewport_.height())
+    );
+    if(!rect.isEmpty()) {
+        dirtyRect_ = Rect::boundingBox(dirtyRect_, Rect::translate(
+            rect, viewport_.globalX(), viewport_.globalY()
+        ));
+        propagateViewDirty_();
+    }
+}
+
+Rect Widget::render_(bool parentRendered) {
+    REQUIRE_UI_THREAD();
+
+    // Subtrees without dirty widgets are skipped altogether
+    if(!parentRendered && !viewDirty_) {
+        return Rect();
+    }
+    viewDirty_ = false;
+
+    bool renderSelf = parentRendered || !dirtyRect_.isEmpty();
+    Rect rendered = dirtyRect_;
+    dirtyRect_ = Rect();
+    if(renderSelf) {
+        widgetRender_();
+    }
+
+    for(shared_ptr<Widget> child : widgetListChildren_()) {
+        REQUIRE(child);
+        rendered = Rect::boundingBox(rendered, child->render_(renderSelf));
+    }
+    return rendered;
+}
+
+void Widget::addDirtyViewport_() {
+    REQUIRE_UI_THREAD();
+
+    dirtyRect_ = Rect::boundingBox(dirtyRect_, Rect(
+        viewport_.globalX(), viewport_.globalX() + viewport_.width(),
+        viewport_.globalY(), viewport_.globalY() + viewport_.height()
+    ));
+}
+
+void Widget::propagateViewDirty_() {
+    REQUIRE_UI_THREAD();
+
     if(!viewDirty_) {
         viewDirty_ = true;
         if(shared_ptr<WidgetParent> parent = parent_.lock()) {
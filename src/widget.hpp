@@ -36,7 +36,13 @@ public:
     void setViewport(ImageSlice viewport);
     ImageSlice getViewport();
 
-    void render();
+    // Render the widgets in the tree that need it: the widgets that have
+    // signaled their view dirty and the descendants of rendered widgets
+    // (as the parent may have drawn over its children). Returns the region of
+    // the original shared image buffer that may have changed since the
+    // previous render, i.e. the bounding box of the viewports of the widgets
+    // that have signaled their view dirty.
+    Rect render();
 
     int cursor();
 
@@ -67,8 +73,10 @@ public:
 
 protected:
     // The widget should call this when its view has updated and the changes
-    // should be rendered
+    // should be rendered. If rect (in the coordinates of the viewport) is
+    // given, the rendered pixels may only change inside it.
     void signalViewDirty_();
+    void signalViewDirty_(Rect rect);
 
     // The widget should call this to update its own cursor; the effects might
     // not be immediately visible if mouse is not over this widget
@@ -94,7 +102,10 @@ protected:
     // allowed to render to the viewport outside this function; however, it
     // is possible that some other widget (such as the parent) is drawing to
     // the same viewport. The children of this widget (in the list returned by
-    // widgetListChildren_) are rendered after this call.
+    // widgetListChildren_) are rendered after this call. The function is only
+    // called if the widget has signaled its view dirty or its parent has been
+    // rendered, so the result may only depend on the pixels drawn by the
+    // ancestors in the same render.
     virtual void widgetRender_() {}
 
     // This function should list the child widgets of this widget; it is used
@@ -128,6 +139,16 @@ private:
 
     void updateCursor_();
 
+    // Adds the current viewport to dirtyRect_
+    void addDirtyViewport_();
+
+    // Implementation of render; parentRendered is set if the parent was
+    // rendered in this render
+    Rect render_(bool parentRendered);
+
+    // Marks this widget and its ancestors as needing rendering
+    void propagateViewDirty_();
+
     void forwardMouseDownEvent_(int x, int y, int button);
     void forwardMouseUpEvent_(int x, int y, int button);
     void forwardMouseDoubleClickEvent_(int x, int y);
@@ -144,6 +165,10 @@ private:
     ImageSlice viewport_;
     bool viewDirty_;
 
+    // Bounding box of the dirty viewports of this widget (excluding the
+    // descendants) in global coordinates since the previous render
+    Rect dirtyRect_;
+
     shared_ptr<Widget> focusChild_;
     shared_ptr<Widget> mouseOverChild_;
 
@@ -5,12 +5,42 @@
 #include "key.hpp"
 #include "root_widget.hpp"
 #include "timeout.hpp"
+#include "trace.hpp"
 #include "vice.hpp"
 
+#include "include/cef_audio_handler.h"
 #include "include/cef_client.h"
 
 namespace browservice {
 
+namespace {
+
+const steady_clock::duration IdleRenderDelay = milliseconds(5000);
+
+// Minimum interval between two resizes of the view; the resizes requested in
+// between are coalesced into one.
+const int64_t ResizeIntervalMs = 100;
+
+// The zoom levels (in percent) stepped through with the zoom keys.
+const int ZoomSteps[] = {
+    25, 33, 50, 67, 75, 80, 90, 100, 110, 125, 150, 175, 200, 250, 300, 400
+};
+
+// Media detection: a browser paint counts towards the media paint rate if its
+// dirty area is at least MediaPaintMinArea pixels (a 160x120 video). The
+// window is considered to be playing media once the rate has been at least
+// MediaPaintRate per second for MediaEnterChecksAudio consecutive watchdog
+// checks while the browser streams audio (or MediaEnterChecks checks without
+// audio, to avoid catching animations and scrolling), and stops playing once
+// the rate has been below the threshold for MediaExitChecks checks.
+const int64_t MediaPaintMinArea = 160 * 120;
+const double MediaPaintRate = 10.0;
+const int MediaEnterChecksAudio = 2;
+const int MediaEnterChecks = 5;
+const int MediaExitChecks = 3;
+
+}
+
 class Window::Client :
     public CefClient,
     public CefLifeSpanHandler,
@@ -19,7 +49,8 @@ class Window::Client :
     public CefRequestHandler,
     public CefFindHandler,
     public CefKeyboardHandler,
-    public CefDialogHandler
+    public CefDialogHandler,
+    public CefAudioHandler
 {
 public:
     Client(shared_ptr<Window> window) {
@@ -33,7 +64,6 @@ public:
         REQUIRE(window->downloadManager_);
         downloadHandler_ = window->downloadManager_->createCefDownloadHandler();
 
-        lastFindID_ = -1;
         certificateErrorPageSignKey_ = generateDataURLSignKey();
     }
 
@@ -65,6 +95,9 @@ public:
     virtual CefRefPtr<CefDialogHandler> GetDialogHandler() override {
         return this;
     }
+    virtual CefRefPtr<CefAudioHandler> GetAudioHandler() override {
+        return this;
+    }
 
     // CefLifeSpanHandler:
     virtual bool OnBeforePopup(
@@ -117,6 +150,7 @@ public:
 
                 windowInfo.SetAsWindowless(kNullWindowHandle);
                 browserSettings.background_color = (cef_color_t)-1;
+                browserSettings.windowless_frame_rate = newWindow->renderFps_;
                 client = new Client(newWindow);
 
                 newWindow->createSuccessful_();
@@ -149,8 +183,22 @@ public:
         window_->browser_ = browser;
         window_->rootWidget_->browserArea()->setBrowser(browser);
 
+        // The render rate and visibility may have changed after the browser
+        // settings were given
+        browser->GetHost()->SetWindowlessFrameRate(window_->renderFps_);
+        if(!window_->visible_) {
+            browser->GetHost()->WasHidden(true);
+        }
+
         window_->updateSecurityStatus_();
 
+        if(window_->state_ == Open && !window_->pendingURI_.empty()) {
+            // Navigation requested before the browser existed.
+            string uri = move(window_->pendingURI_);
+            window_->pendingURI_.clear();
+            window_->navigateToURI(uri);
+        }
+
         if(window_->state_ == Closed) {
             // Browser close deferred from close().
             postTask([browser] {
@@ -171,6 +219,17 @@ public:
     virtual void OnBeforeClose(CefRefPtr<CefBrowser> browser) override {
         BROWSER_EVENT_HANDLER_CHECKS();
 
+        if(window_->state_ == Open && window_->hibernation_ == Hibernating) {
+            INFO_LOG("Window ", window_->handle_, " is now hibernated");
+            window_->hibernation_ = Hibernated;
+            window_->browser_ = nullptr;
+            window_->retainedUploads_.clear();
+            if(window_->wakeRequested_) {
+                postTask(window_, &Window::recreateBrowser_);
+            }
+            return;
+        }
+
         if(window_->state_ == Open) {
             // The window closed on its own (not triggered by close()).
             INFO_LOG(
@@ -190,12 +249,7 @@ public:
             "Cleanup of CEF browser for window ", window_->handle_, " complete"
         );
 
-        window_->state_ = CleanupComplete;
-        window_->browser_ = nullptr;
-        window_->retainedUploads_.clear();
-        window_->rootWidget_->browserArea()->setBrowser(nullptr);
-        window_->eventHandler_->onWindowCleanupComplete(window_->handle_);
-        window_->eventHandler_.reset();
+        window_->cleanupComplete_();
     }
 
     // CefLoadHandler:
@@ -355,11 +409,11 @@ public:
     ) override {
         BROWSER_EVENT_HANDLER_CHECKS();
 
-        if(window_->state_ == Open && identifier >= lastFindID_) {
+        // Results of superseded or stopped searches are ignored
+        if(window_->state_ == Open && identifier == window_->findID_) {
             if(count > 0 || finalUpdate) {
                 window_->rootWidget_->controlBar()->setFindResult(count > 0);
             }
-            lastFindID_ = identifier;
         }
     }
 
@@ -386,6 +440,37 @@ public:
         return false;
     }
 
+    virtual bool OnKeyEvent(
+        CefRefPtr<CefBrowser> browser,
+        const CefKeyEvent& event,
+        CefEventHandle osEvent
+    ) override {
+        BROWSER_EVENT_HANDLER_CHECKS();
+
+        // The zoom keys are only handled here, after the page has had the
+        // chance to handle them itself (key codes of '-', '=' and '0')
+        if(
+            window_->state_ != Open ||
+            event.type != KEYEVENT_RAWKEYDOWN ||
+            !(event.modifiers & EVENTFLAG_CONTROL_DOWN) ||
+            (event.modifiers & EVENTFLAG_ALT_DOWN)
+        ) {
+            return false;
+        }
+        int direction;
+        if(event.windows_key_code == 189) {
+            direction = -1;
+        } else if(event.windows_key_code == 187) {
+            direction = 1;
+        } else if(event.windows_key_code == 48) {
+            direction = 0;
+        } else {
+            return false;
+        }
+        postTask(window_, &Window::stepZoom_, direction);
+        return true;
+    }
+
     // CefDialogHandler:
     virtual bool OnFileDialog(
         CefRefPtr<CefBrowser> browser,
@@ -436,12 +521,44 @@ public:
         return true;
     }
 
+    // CefAudioHandler: we only track whether the browser is streaming audio
+    // for media detection; the audio data itself is discarded. The functions
+    // may be called outside the UI thread, so the state is passed to the
+    // window in a task.
+    virtual bool GetAudioParameters(
+        CefRefPtr<CefBrowser> browser,
+        CefAudioParameters& params
+    ) override {
+        return true;
+    }
+    virtual void OnAudioStreamStarted(
+        CefRefPtr<CefBrowser> browser,
+        const CefAudioParameters& params,
+        int channels
+    ) override {
+        postTask(window_, &Window::setAudioPlaying_, true);
+    }
+    virtual void OnAudioStreamPacket(
+        CefRefPtr<CefBrowser> browser,
+        const float** data,
+        int frames,
+        int64 pts
+    ) override {}
+    virtual void OnAudioStreamStopped(CefRefPtr<CefBrowser> browser) override {
+        postTask(window_, &Window::setAudioPlaying_, false);
+    }
+    virtual void OnAudioStreamError(
+        CefRefPtr<CefBrowser> browser,
+        const CefString& message
+    ) override {
+        postTask(window_, &Window::setAudioPlaying_, false);
+    }
+
 private:
     shared_ptr<Window> window_;
     CefRefPtr<CefRenderHandler> renderHandler_;
     CefRefPtr<CefDownloadHandler> downloadHandler_;
 
-    int lastFindID_;
     optional<string> lastCertificateErrorURL_;
     string certificateErrorPageSignKey_;
 
@@ -452,31 +569,40 @@ shared_ptr<Window> Window::tryCreate(
     shared_ptr<WindowEventHandler> eventHandler,
     uint64_t handle,
     optional<string> uri
+) {
+    return tryCreate_(eventHandler, handle, uri, false);
+}
+
+shared_ptr<Window> Window::tryCreateStandby(
+    shared_ptr<WindowEventHandler> eventHandler,
+    uint64_t handle
+) {
+    return tryCreate_(eventHandler, handle, string("about:blank"), true);
+}
+
+shared_ptr<Window> Window::tryCreate_(
+    shared_ptr<WindowEventHandler> eventHandler,
+    uint64_t handle,
+    optional<string> uri,
+    bool standby
 ) {
     REQUIRE_UI_THREAD();
     REQUIRE(eventHandler);
     REQUIRE(handle);
 
-    INFO_LOG("Creating window ", handle);
+    INFO_LOG("Creating window ", handle, (standby ? " in standby mode" : ""));
 
     shared_ptr<Window> window = Window::create(CKey());
     window->init_(eventHandler, handle);
 
-    CefRefPtr<CefClient> client = new Client(window);
-
-    CefWindowInfo windowInfo;
-    windowInfo.SetAsWindowless(kNullWindowHandle);
-
-    CefBrowserSettings browserSettings;
-    browserSettings.background_color = (cef_color_t)-1;
+    // Standby windows are hidden to keep the browser from rendering
+    if(standby) {
+        window->standby_ = true;
+        window->visible_ = false;
+    }
 
-    if(!CefBrowserHost::CreateBrowser(
-        windowInfo,
-        client,
-        (uri.has_value() && !uri.value().empty()) ? uri.value() : globals->config->startPage,
-        browserSettings,
-        nullptr,
-        nullptr
+    if(!window->createBrowser_(
+        (uri.has_value() && !uri.value().empty()) ? uri.value() : globals->config->startPage
     )) {
         WARNING_LOG(
             "Opening CEF browser for window ", handle, " failed, ",
@@ -486,6 +612,33 @@ shared_ptr<Window> Window::tryCreate(
         return {};
     }
 
+    window->launchPending_ = !standby;
+    window->createSuccessful_();
+
+    return window;
+}
+
+shared_ptr<Window> Window::createQueued(
+    shared_ptr<WindowEventHandler> eventHandler,
+    uint64_t handle,
+    optional<string> uri
+) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(eventHandler);
+    REQUIRE(handle);
+
+    INFO_LOG("Creating window ", handle, " with its browser launch queued");
+
+    shared_ptr<Window> window = Window::create(CKey());
+    window->init_(eventHandler, handle);
+
+    window->hibernation_ = Hibernated;
+    window->launchQueued_ = true;
+    if(uri.has_value() && !uri.value().empty()) {
+        window->pendingURI_ = uri.value();
+    }
+    window->rootWidget_->controlBar()->setLoading(true);
+
     window->createSuccessful_();
 
     return window;
@@ -497,6 +650,42 @@ Window::~Window() {
     REQUIRE(state_ == CleanupComplete);
 }
 
+void Window::activate(optional<string> uri) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+    REQUIRE(standby_);
+
+    INFO_LOG("Activating standby window ", handle_);
+
+    standby_ = false;
+
+    string target =
+        (uri.has_value() && !uri.value().empty()) ?
+            uri.value() : globals->config->startPage;
+    if(target != "about:blank") {
+        navigateToURI(target);
+    }
+
+    setVisible(true);
+    queryClientFeatures_();
+
+    // Send the state accumulated in standby mode to the event handler
+    onWidgetCursorChanged();
+    signalImageChanged_(Rect(0, rootViewport_.width(), 0, rootViewport_.height()));
+}
+
+void Window::launch() {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+    REQUIRE(launchQueued_);
+
+    INFO_LOG("Launching the browser of queued window ", handle_);
+
+    launchQueued_ = false;
+    launchPending_ = true;
+    recreateBrowser_();
+}
+
 void Window::close() {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
@@ -506,12 +695,15 @@ void Window::close() {
     afterClose_();
 
     // If the browser has been created, we start closing it; otherwise, we defer
-    // closing it to Client::OnAfterCreated.
+    // closing it to Client::OnAfterCreated. A hibernated window has no browser
+    // to wait for.
     if(browser_) {
         CefRefPtr<CefBrowser> browser = browser_;
         postTask([browser] {
             browser->GetHost()->CloseBrowser(true);
         });
+    } else if(hibernation_ == Hibernated) {
+        postTask(shared_from_this(), &Window::cleanupComplete_);
     }
 }
 
@@ -521,10 +713,22 @@ void Window::resize(int width, int height) {
 
     width = max(min(width, 4096), 64);
     height = max(min(height, 4096), 64);
+    pendingSize_ = {width, height};
 
-    if(rootViewport_.width() != width || rootViewport_.height() != height) {
-        rootViewport_ = ImageSlice::createImage(width, height);
-        rootWidget_->setViewport(rootViewport_);
+    // If a resize is already waiting, it will use the latest size
+    if(resizeTimeout_->isActive()) {
+        return;
+    }
+
+    if(steady_clock::now() - lastResizeTime_ >= milliseconds(ResizeIntervalMs)) {
+        applyResize_();
+    } else {
+        weak_ptr<Window> selfWeak = shared_from_this();
+        resizeTimeout_->set([selfWeak]() {
+            if(shared_ptr<Window> self = selfWeak.lock()) {
+                self->applyResize_();
+            }
+        });
     }
 }
 
@@ -532,10 +736,69 @@ ImageSlice Window::fetchViewImage() {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     imageChanged_ = false;
+    dirtyTiles_.clear();
+    notifiedRect_ = Rect();
+
+    // The changes not yet notified may now be notified
+    postTask(shared_from_this(), &Window::scheduleFrame_);
+
     return rootViewport_;
 }
 
+pair<ImageSlice, shared_ptr<void>> Window::fetchViewFrame() {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+
+    int width = rootViewport_.width();
+    int height = rootViewport_.height();
+
+    shared_ptr<ViewFrameBuffer> buffer;
+    for(const shared_ptr<ViewFrameBuffer>& candidate : viewFrameBuffers_) {
+        candidate->staleTiles.merge(dirtyTiles_);
+        if(!buffer && !candidate->inUse.load()) {
+            buffer = candidate;
+        }
+    }
+    if(!buffer) {
+        buffer = make_shared<ViewFrameBuffer>();
+        buffer->inUse.store(false);
+        viewFrameBuffers_.push_back(buffer);
+    }
+
+    markClientActive_();
+
+    imageChanged_ = false;
+    dirtyTiles_.clear();
+    notifiedRect_ = Rect();
+
+    // The changes not yet notified may now be notified
+    postTask(shared_from_this(), &Window::scheduleFrame_);
+
+    if(buffer->image.width() != width || buffer->image.height() != height) {
+        buffer->image = ImageSlice::reuseImage(buffer->backing, width, height);
+        buffer->staleTiles.reset(width, height);
+        buffer->staleTiles.markAll();
+    }
+
+    buffer->staleTiles.forEachRect([&](Rect rect) {
+        buffer->image.putImage(
+            rootViewport_.subRect(rect.startX, rect.endX, rect.startY, rect.endY),
+            rect.startX,
+            rect.startY
+        );
+    });
+    buffer->staleTiles.clear();
+
+    buffer->inUse.store(true);
+    shared_ptr<void> owner(buffer.get(), [buffer](void*) {
+        buffer->inUse.store(false);
+    });
+    return {buffer->image, owner};
+}
+
 void Window::navigate(int direction) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
@@ -558,6 +821,15 @@ void Window::navigateToURI(string uri) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    // Without a browser to navigate, the URI is loaded once the browser has
+    // been (re)created.
+    if(!uri.empty() && (!browser_ || hibernation_ != Awake)) {
+        pendingURI_ = uri;
+        rootWidget_->browserArea()->takeFocus();
+        wakeUp_();
+        return;
+    }
+
     if(!uri.empty() && browser_) {
         CefRefPtr<CefFrame> frame = browser_->GetMainFrame();
         if(frame) {
@@ -594,10 +866,41 @@ void Window::cancelFileUpload() {
     fileUploadCallback_ = nullptr;
 }
 
+void Window::addInputTrace(uint64_t traceId) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+
+    // The events of the trace are sent synchronously in the same plugin
+    // event pump, so they have all been forwarded once the task runs
+    postTask(shared_from_this(), &Window::traceForwarded_, traceId);
+}
+
+void Window::setVisible(bool visible) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+
+    if(visible == visible_) {
+        return;
+    }
+    visible_ = visible;
+
+    INFO_LOG("Window ", handle_, (visible ? " shown" : " hidden"));
+
+    if(browser_) {
+        browser_->GetHost()->WasHidden(!visible);
+    }
+    if(visible) {
+        // The client is back; resume rendering at full rate immediately
+        markClientActive_();
+    }
+}
+
 void Window::sendMouseDownEvent(int x, int y, int button) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     if(button >= 0 && button <= 2) {
         clampMouseCoords_(x, y);
         rootWidget_->sendMouseDownEvent(x, y, button);
@@ -608,6 +911,8 @@ void Window::sendMouseUpEvent(int x, int y, int button) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     if(button >= 0 && button <= 2) {
         clampMouseCoords_(x, y);
         rootWidget_->sendMouseUpEvent(x, y, button);
@@ -618,6 +923,8 @@ void Window::sendMouseMoveEvent(int x, int y) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     clampMouseCoords_(x, y);
     rootWidget_->sendMouseMoveEvent(x, y);
 }
@@ -626,6 +933,8 @@ void Window::sendMouseDoubleClickEvent(int x, int y, int button) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     if(button == 0) {
         clampMouseCoords_(x, y);
         rootWidget_->sendMouseDoubleClickEvent(x, y);
@@ -636,6 +945,8 @@ void Window::sendMouseWheelEvent(int x, int y, int dx, int dy) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     clampMouseCoords_(x, y);
     int delta = max(-180, min(180, -dy));
     rootWidget_->sendMouseWheelEvent(x, y, delta);
@@ -645,6 +956,8 @@ void Window::sendMouseLeaveEvent(int x, int y) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     clampMouseCoords_(x, y);
     rootWidget_->sendMouseLeaveEvent(x, y);
 }
@@ -653,6 +966,8 @@ void Window::sendKeyDownEvent(int key) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     if(isValidKey(key)) {
         rootWidget_->sendKeyDownEvent(key);
     }
@@ -662,6 +977,8 @@ void Window::sendKeyUpEvent(int key) {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     if(isValidKey(key)) {
         rootWidget_->sendKeyUpEvent(key);
     }
@@ -671,9 +988,75 @@ void Window::sendLoseFocusEvent() {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Open);
 
+    markClientActive_();
+
     rootWidget_->sendLoseFocusEvent();
 }
 
+void Window::sendInputEvents(const vector<InputEvent>& events) {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+
+    auto isNext = [&](size_t i, InputEvent::Type type) {
+        return i + 1 < events.size() && events[i + 1].type == type;
+    };
+
+    for(size_t i = 0; i < events.size(); ++i) {
+        const InputEvent& event = events[i];
+        switch(event.type) {
+        case InputEvent::MouseDown:
+            sendMouseDownEvent(event.x, event.y, event.button);
+            break;
+        case InputEvent::MouseUp:
+            sendMouseUpEvent(event.x, event.y, event.button);
+            break;
+        case InputEvent::MouseMove:
+            // Only the last position of consecutive moves matters
+            if(!isNext(i, InputEvent::MouseMove)) {
+                sendMouseMoveEvent(event.x, event.y);
+            }
+            break;
+        case InputEvent::MouseDoubleClick:
+            sendMouseDoubleClickEvent(event.x, event.y, event.button);
+            break;
+        case InputEvent::MouseWheel: {
+            // Sum the deltas of consecutive wheel events as long as the sum
+            // stays within the range accepted by sendMouseWheelEvent
+            int dy = max(-180, min(180, event.dy));
+            int x = event.x;
+            int y = event.y;
+            while(isNext(i, InputEvent::MouseWheel)) {
+                const InputEvent& next = events[i + 1];
+                int nextDy = max(-180, min(180, next.dy));
+                if(dy + nextDy < -180 || dy + nextDy > 180) {
+                    break;
+                }
+                dy += nextDy;
+                x = next.x;
+                y = next.y;
+                ++i;
+            }
+            if(dy != 0) {
+                sendMouseWheelEvent(x, y, 0, dy);
+            }
+            break;
+        }
+        case InputEvent::MouseLeave:
+            sendMouseLeaveEvent(event.x, event.y);
+            break;
+        case InputEvent::KeyDown:
+            sendKeyDownEvent(event.key);
+            break;
+        case InputEvent::KeyUp:
+            sendKeyUpEvent(event.key);
+            break;
+        case InputEvent::LoseFocus:
+            sendLoseFocusEvent();
+            break;
+        }
+    }
+}
+
 void Window::onWidgetViewDirty() {
     REQUIRE_UI_THREAD();
 
@@ -684,8 +1067,11 @@ void Window::onWidgetViewDirty() {
     shared_ptr<Window> self = shared_from_this();
     postTask([self]() {
         if(self->state_ == Open) {
-            self->rootWidget_->render();
-            self->signalImageChanged_();
+            // Only the widgets that signaled their view dirty have changed
+            // (typically only the control bar), so the rest of the image
+            // (such as the browser area) does not need to be sent again
+            Rect dirtyRect = self->rootWidget_->render();
+            self->signalImageChanged_(dirtyRect);
         }
     });
 }
@@ -699,7 +1085,7 @@ void Window::onWidgetCursorChanged() {
 
     shared_ptr<Window> self = shared_from_this();
     postTask([self]() {
-        if(self->state_ == Open) {
+        if(self->state_ == Open && !self->standby_) {
             int cursor = self->rootWidget_->cursor();
             REQUIRE(cursor >= 0 && cursor < CursorTypeCount);
 
@@ -735,6 +1121,40 @@ void Window::onGlobalHotkeyPressed(GlobalHotkey key) {
     });
 }
 
+void Window::stepZoom_(int direction) {
+    REQUIRE_UI_THREAD();
+
+    if(state_ != Open) {
+        return;
+    }
+
+    shared_ptr<BrowserArea> browserArea = rootWidget_->browserArea();
+    int zoom = browserArea->renderScale();
+
+    if(direction == 0) {
+        zoom = globals->config->pageZoom;
+    } else if(direction < 0) {
+        for(auto it = rbegin(ZoomSteps); it != rend(ZoomSteps); ++it) {
+            if(*it < zoom) {
+                zoom = *it;
+                break;
+            }
+        }
+    } else {
+        for(int step : ZoomSteps) {
+            if(step > zoom) {
+                zoom = step;
+                break;
+            }
+        }
+    }
+
+    if(zoom != browserArea->renderScale()) {
+        INFO_LOG("Setting zoom level of window ", handle_, " to ", zoom, "%");
+        browserArea->setRenderScale(zoom);
+    }
+}
+
 void Window::onAddressSubmitted(string url) {
     REQUIRE_UI_THREAD();
 
@@ -770,7 +1190,8 @@ void Window::onFind(string text, bool forward, bool findNext) {
     REQUIRE_UI_THREAD();
 
     if(state_ == Open && browser_) {
-        browser_->GetHost()->Find(0, text, forward, false, findNext);
+        ++findID_;
+        browser_->GetHost()->Find(findID_, text, forward, false, findNext);
     }
 }
 
@@ -778,6 +1199,7 @@ void Window::onStopFind(bool clearSelection) {
     REQUIRE_UI_THREAD();
 
     if(state_ == Open && browser_) {
+        ++findID_;
         browser_->GetHost()->StopFinding(clearSelection);
     }
 }
@@ -847,21 +1269,43 @@ void Window::onOpenBookmarksButtonPressed() {
     }
 }
 
-void Window::onBrowserAreaViewDirty() {
+void Window::onBrowserAreaViewDirty(TileBitmap dirtyTiles) {
     REQUIRE_UI_THREAD();
 
     if(state_ == Open) {
-        signalImageChanged_();
+        for(uint64_t traceId : forwardedTraces_) {
+            traceStage(handle_, traceId, "paint");
+            paintedTraces_.push_back(traceId);
+        }
+        forwardedTraces_.clear();
+
+        Rect dirtyRect = dirtyTiles.boundingBox();
+        if(
+            (int64_t)(dirtyRect.endX - dirtyRect.startX) *
+            (int64_t)(dirtyRect.endY - dirtyRect.startY) >= MediaPaintMinArea
+        ) {
+            ++mediaPaintCount_;
+        }
+
+        signalImageChanged_(dirtyRect, &dirtyTiles);
+
+        if(launchPending_) {
+            launchPending_ = false;
+            REQUIRE(eventHandler_);
+            eventHandler_->onWindowLaunchComplete(handle_);
+        }
     }
 }
 
 void Window::onPendingDownloadCountChanged(int count) {
     REQUIRE_UI_THREAD();
+    pendingDownloadCount_ = count;
     rootWidget_->controlBar()->setPendingDownloadCount(count);
 }
 
 void Window::onDownloadProgressChanged(vector<int> progress) {
     REQUIRE_UI_THREAD();
+    downloadsInProgress_ = !progress.empty();
     rootWidget_->controlBar()->setDownloadProgress(move(progress));
 }
 
@@ -884,16 +1328,46 @@ void Window::init_(shared_ptr<WindowEventHandler> eventHandler, uint64_t handle)
     eventHandler_ = eventHandler;
 
     imageChanged_ = false;
+    notifiedRect_ = Rect();
+    pendingRect_ = Rect();
 
     shared_ptr<Window> self = shared_from_this();
 
-    rootViewport_ = ImageSlice::createImage(800, 600);
+    rootViewport_ = ImageSlice::reuseImage(rootBuffer_, 800, 600);
+    rootViewport_.fill(0, 800, 0, 600, 255);
+    dirtyTiles_.reset(800, 600);
+    pendingSize_ = {800, 600};
     rootWidget_ = RootWidget::create(self, self, self, true);
     rootWidget_->setViewport(rootViewport_);
 
     downloadManager_ = DownloadManager::create(self);
 
-    watchdogTimeout_ = Timeout::create(1000);
+    lastFrameTime_ = steady_clock::now() - milliseconds(1000);
+    frameTimeout_ = Timeout::create(1000 / globals->config->maxFps);
+
+    lastResizeTime_ = steady_clock::now() - milliseconds(ResizeIntervalMs);
+    resizeTimeout_ = Timeout::create(ResizeIntervalMs);
+
+    lastClientActivityTime_ = steady_clock::now();
+    renderFps_ = globals->config->renderFps;
+
+    visible_ = true;
+    standby_ = false;
+
+    hibernation_ = Awake;
+    wakeRequested_ = false;
+    launchQueued_ = false;
+    launchPending_ = false;
+    pendingDownloadCount_ = 0;
+    downloadsInProgress_ = false;
+
+    findID_ = 0;
+
+    audioPlaying_ = false;
+    mediaPlaying_ = false;
+    mediaPaintCount_ = 0;
+    mediaCheckStreak_ = 0;
+    lastMediaCheckTime_ = steady_clock::now();
 
     fileUploadAcceptFilter_ = 0;
 }
@@ -903,8 +1377,17 @@ void Window::createSuccessful_() {
 
     shared_ptr<Window> self = shared_from_this();
 
-    postTask(self, &Window::watchdog_);
+    postTask(self, &Window::watchdog);
 
+    if(!standby_) {
+        queryClientFeatures_();
+    }
+}
+
+void Window::queryClientFeatures_() {
+    REQUIRE_UI_THREAD();
+
+    shared_ptr<Window> self = shared_from_this();
     postTask([self]() {
         if(self->state_ != Open) {
             return;
@@ -935,11 +1418,47 @@ void Window::createFailed_() {
     eventHandler_.reset();
 }
 
+bool Window::createBrowser_(string uri) {
+    REQUIRE_UI_THREAD();
+
+    CefRefPtr<CefClient> client = new Client(shared_from_this());
+
+    CefWindowInfo windowInfo;
+    windowInfo.SetAsWindowless(kNullWindowHandle);
+
+    CefBrowserSettings browserSettings;
+    browserSettings.background_color = (cef_color_t)-1;
+    browserSettings.windowless_frame_rate = renderFps_;
+
+    return CefBrowserHost::CreateBrowser(
+        windowInfo,
+        client,
+        uri,
+        browserSettings,
+        nullptr,
+        nullptr
+    );
+}
+
+void Window::cleanupComplete_() {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Closed);
+    REQUIRE(eventHandler_);
+
+    state_ = CleanupComplete;
+    browser_ = nullptr;
+    retainedUploads_.clear();
+    rootWidget_->browserArea()->setBrowser(nullptr);
+    eventHandler_->onWindowCleanupComplete(handle_);
+    eventHandler_.reset();
+}
+
 void Window::afterClose_() {
     REQUIRE_UI_THREAD();
     REQUIRE(state_ == Closed);
 
-    watchdogTimeout_->clear(false);
+    frameTimeout_->clear(false);
+    resizeTimeout_->clear(false);
 
     if(fileUploadCallback_) {
         fileUploadCallback_->Cancel();
@@ -947,8 +1466,7 @@ void Window::afterClose_() {
     }
 }
 
-// Called every 1s for an Open window for various checks.
-void Window::watchdog_() {
+void Window::watchdog() {
     REQUIRE_UI_THREAD();
 
     if(state_ != Open) {
@@ -959,16 +1477,74 @@ void Window::watchdog_() {
     // time just in case our event handlers do not catch all the changes.
     updateSecurityStatus_();
 
-    if(!watchdogTimeout_->isActive()) {
-        weak_ptr<Window> selfWeak = shared_from_this();
-        watchdogTimeout_->set([selfWeak]() {
-            if(shared_ptr<Window> self = selfWeak.lock()) {
-                self->watchdog_();
-            }
-        });
+    updateMediaState_();
+
+    steady_clock::duration idleTime = steady_clock::now() - lastClientActivityTime_;
+    if(idleTime >= IdleRenderDelay) {
+        setRenderFps_(globals->config->idleRenderFps);
+    }
+
+    int64_t hibernateDelayMs = 1000 * (int64_t)globals->config->hibernateDelay;
+    if(hibernateDelayMs > 0 && idleTime >= milliseconds(hibernateDelayMs)) {
+        hibernate();
     }
 }
 
+void Window::setAudioPlaying_(bool playing) {
+    REQUIRE_UI_THREAD();
+    audioPlaying_ = playing;
+}
+
+void Window::updateMediaState_() {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+
+    steady_clock::time_point now = steady_clock::now();
+    double elapsedSec = (double)duration_cast<milliseconds>(
+        now - lastMediaCheckTime_
+    ).count() / 1000.0;
+    lastMediaCheckTime_ = now;
+
+    double paintRate =
+        elapsedSec > 0.0 ? (double)mediaPaintCount_ / elapsedSec : 0.0;
+    mediaPaintCount_ = 0;
+
+    // The streak counts the consecutive checks that disagree with the current
+    // state
+    bool looksPlaying = paintRate >= MediaPaintRate;
+    if(looksPlaying == mediaPlaying_) {
+        mediaCheckStreak_ = 0;
+        return;
+    }
+    ++mediaCheckStreak_;
+
+    int requiredChecks;
+    if(mediaPlaying_) {
+        requiredChecks = MediaExitChecks;
+    } else {
+        requiredChecks = audioPlaying_ ? MediaEnterChecksAudio : MediaEnterChecks;
+    }
+    if(mediaCheckStreak_ < requiredChecks) {
+        return;
+    }
+
+    mediaPlaying_ = !mediaPlaying_;
+    mediaCheckStreak_ = 0;
+
+    if(mediaPlaying_) {
+        INFO_LOG(
+            "Window ", handle_, " is playing media (",
+            (int)paintRate, " large paints per second",
+            audioPlaying_ ? ", audio playing" : "", ")"
+        );
+    } else {
+        INFO_LOG("Window ", handle_, " stopped playing media");
+    }
+
+    REQUIRE(eventHandler_);
+    eventHandler_->onWindowMediaStateChanged(handle_, mediaPlaying_);
+}
+
 void Window::updateSecurityStatus_() {
     REQUIRE_UI_THREAD();
 
@@ -976,6 +1552,11 @@ void Window::updateSecurityStatus_() {
         return;
     }
 
+    // Keep showing the status of the page while hibernating
+    if(hibernation_ != Awake) {
+        return;
+    }
+
     SecurityStatus securityStatus = SecurityStatus::Insecure;
     if(browser_) {
         CefRefPtr<CefNavigationEntry> nav = browser_->GetHost()->GetVisibleNavigationEntry();
@@ -1011,14 +1592,238 @@ void Window::clampMouseCoords_(int& x, int& y) {
     y = min(y, rootViewport_.height() + 1000);
 }
 
-void Window::signalImageChanged_() {
+void Window::traceForwarded_(uint64_t traceId) {
+    REQUIRE_UI_THREAD();
+
+    if(state_ == Open) {
+        traceStage(handle_, traceId, "forward");
+        forwardedTraces_.push_back(traceId);
+    }
+}
+
+void Window::signalImageChanged_(Rect dirtyRect, const TileBitmap* dirtyTiles) {
+    REQUIRE_UI_THREAD();
+
+    dirtyRect = Rect::intersection(
+        dirtyRect, Rect(0, rootViewport_.width(), 0, rootViewport_.height())
+    );
+    if(state_ != Open || dirtyRect.isEmpty()) {
+        return;
+    }
+
+    if(dirtyTiles != nullptr) {
+        dirtyTiles_.merge(*dirtyTiles);
+    } else {
+        dirtyTiles_.markRect(dirtyRect);
+    }
+
+    // If the damage is already covered by a notification that has not been
+    // followed by fetchViewImage yet, there is no need to notify again.
+    if(imageChanged_ && notifiedRect_.contains(dirtyRect)) {
+        return;
+    }
+
+    pendingRect_ = Rect::boundingBox(pendingRect_, dirtyRect);
+    scheduleFrame_();
+}
+
+void Window::scheduleFrame_() {
+    REQUIRE_UI_THREAD();
+
+    if(
+        state_ != Open ||
+        standby_ ||
+        pendingRect_.isEmpty() ||
+        imageChanged_ ||
+        frameTimeout_->isActive()
+    ) {
+        return;
+    }
+
+    steady_clock::time_point now = steady_clock::now();
+    if(now - lastFrameTime_ < milliseconds(1000 / globals->config->maxFps)) {
+        weak_ptr<Window> selfWeak = shared_from_this();
+        frameTimeout_->set([selfWeak]() {
+            if(shared_ptr<Window> self = selfWeak.lock()) {
+                self->scheduleFrame_();
+            }
+        });
+        return;
+    }
+
+    Rect rect = pendingRect_;
+    pendingRect_ = Rect();
+    notifiedRect_ = Rect::boundingBox(notifiedRect_, rect);
+    imageChanged_ = true;
+    lastFrameTime_ = now;
+
+    REQUIRE(eventHandler_);
+    for(uint64_t traceId : paintedTraces_) {
+        eventHandler_->onWindowViewTraced(handle_, traceId);
+    }
+    paintedTraces_.clear();
+    eventHandler_->onWindowViewImageChanged(handle_, rect);
+}
+
+void Window::applyResize_() {
+    REQUIRE_UI_THREAD();
+
+    if(state_ != Open) {
+        return;
+    }
+
+    lastResizeTime_ = steady_clock::now();
+
+    int width = pendingSize_.first;
+    int height = pendingSize_.second;
+    if(rootViewport_.width() != width || rootViewport_.height() != height) {
+        rootViewport_ = ImageSlice::reuseImage(rootBuffer_, width, height);
+        dirtyTiles_.reset(width, height);
+        rootWidget_->setViewport(rootViewport_);
+    }
+}
+
+void Window::markClientActive_() {
+    REQUIRE_UI_THREAD();
+
+    lastClientActivityTime_ = steady_clock::now();
+    setRenderFps_(globals->config->renderFps);
+    wakeUp_();
+}
+
+void Window::setRenderFps_(int fps) {
+    REQUIRE_UI_THREAD();
+
+    if(fps != renderFps_) {
+        renderFps_ = fps;
+        if(browser_) {
+            browser_->GetHost()->SetWindowlessFrameRate(fps);
+        }
+    }
+}
+
+bool Window::hibernate() {
+    REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
+
+    if(
+        hibernation_ != Awake ||
+        !browser_ ||
+        standby_ ||
+        fileUploadCallback_ ||
+        pendingDownloadCount_ > 0 ||
+        downloadsInProgress_
+    ) {
+        return false;
+    }
+
+    hibernatedURI_.clear();
+    CefRefPtr<CefFrame> frame = browser_->GetMainFrame();
+    if(frame) {
+        string url = frame->GetURL();
+        hibernatedURI_ = move(url);
+    }
+
+    INFO_LOG("Hibernating inactive window ", handle_);
+
+    hibernation_ = Hibernating;
+    wakeRequested_ = false;
+
+    // The view image is kept as it is, but the input is no longer passed to
+    // the browser and the browser layers and unused frame buffers are released
+    rootWidget_->browserArea()->setBrowser(nullptr);
+
+    vector<shared_ptr<ViewFrameBuffer>> usedBuffers;
+    for(const shared_ptr<ViewFrameBuffer>& buffer : viewFrameBuffers_) {
+        if(buffer->inUse.load()) {
+            usedBuffers.push_back(buffer);
+        }
+    }
+    swap(viewFrameBuffers_, usedBuffers);
+
+    CefRefPtr<CefBrowser> browser = browser_;
+    postTask([browser] {
+        browser->GetHost()->CloseBrowser(true);
+    });
+    return true;
+}
+
+string Window::currentURI() {
     REQUIRE_UI_THREAD();
+    REQUIRE(state_ == Open);
 
-    if(state_ == Open && !imageChanged_) {
-        imageChanged_ = true;
+    if(!pendingURI_.empty()) {
+        return pendingURI_;
+    }
+    if(hibernation_ != Awake) {
+        return hibernatedURI_;
+    }
+    if(browser_) {
+        CefRefPtr<CefFrame> frame = browser_->GetMainFrame();
+        if(frame) {
+            return frame->GetURL();
+        }
+    }
+    return "";
+}
 
+steady_clock::time_point Window::lastClientActivityTime() {
+    REQUIRE_UI_THREAD();
+    return lastClientActivityTime_;
+}
+
+void Window::wakeUp_() {
+    REQUIRE_UI_THREAD();
+
+    if(
+        state_ != Open ||
+        hibernation_ == Awake ||
+        wakeRequested_ ||
+        launchQueued_
+    ) {
+        return;
+    }
+
+    INFO_LOG("Waking up hibernated window ", handle_);
+
+    // If the browser is still closing, Client::OnBeforeClose schedules
+    // recreateBrowser_
+    wakeRequested_ = true;
+    if(hibernation_ == Hibernated) {
+        postTask(shared_from_this(), &Window::recreateBrowser_);
+    }
+}
+
+void Window::recreateBrowser_() {
+    REQUIRE_UI_THREAD();
+
+    if(state_ != Open || hibernation_ != Hibernated) {
+        return;
+    }
+
+    hibernation_ = Awake;
+    wakeRequested_ = false;
+
+    string uri = pendingURI_;
+    pendingURI_.clear();
+    if(uri.empty()) {
+        uri = hibernatedURI_;
+    }
+    if(uri.empty()) {
+        uri = globals->config->startPage;
+    }
+
+    if(!createBrowser_(uri)) {
+        WARNING_LOG(
+            "Opening CEF browser for window ", handle_, " failed, ",
+            "closing the window"
+        );
+        launchPending_ = false;
         REQUIRE(eventHandler_);
-        eventHandler_->onWindowViewImageChanged(handle_);
+        state_ = Closed;
+        afterClose_();
+        eventHandler_->onWindowClose(handle_);
+        cleanupComplete_();
     }
 }
 
@@ -4,6 +4,7 @@
 #include "control_bar.hpp"
 #include "download_manager.hpp"
 #include "image_slice.hpp"
+#include "input_event.hpp"
 #include "root_widget.hpp"
 
 class CefBrowser;
@@ -17,7 +18,18 @@ class WindowEventHandler {
 public:
     virtual void onWindowClose(uint64_t handle) = 0;
     virtual void onWindowCleanupComplete(uint64_t handle) = 0;
-    virtual void onWindowViewImageChanged(uint64_t handle) = 0;
+    // dirtyRect is the region of the view image that has changed.
+    virtual void onWindowViewImageChanged(uint64_t handle, Rect dirtyRect) = 0;
+    // Called right before onWindowViewImageChanged for each input trace (see
+    // trace.hpp) that the view image change reflects.
+    virtual void onWindowViewTraced(uint64_t handle, uint64_t traceId) {}
+    // Called once the browser started by tryCreate or launch has painted its
+    // first frame (or once it is known that it never will).
+    virtual void onWindowLaunchComplete(uint64_t handle) {}
+    // Called when the window starts (playing = true) or stops playing media
+    // such as a video, as detected from the paint rate of the browser and its
+    // audio streams.
+    virtual void onWindowMediaStateChanged(uint64_t handle, bool playing) {}
     virtual void onWindowCursorChanged(uint64_t handle, int cursor) = 0;
     virtual optional<pair<vector<string>, size_t>> onWindowQualitySelectorQuery(
         uint64_t handle
@@ -78,6 +90,30 @@ public:
         optional<string> uri
     );
 
+    // Creates a window in standby mode, in which the browser is started on
+    // about:blank in the background so that it is ready to be handed out
+    // using activate. In standby mode, the only events sent to the event
+    // handler are onWindowClose and onWindowCleanupComplete. Returns empty
+    // pointer if CEF browser creation fails.
+    static shared_ptr<Window> tryCreateStandby(
+        shared_ptr<WindowEventHandler> eventHandler,
+        uint64_t handle
+    );
+
+    // Creates a window whose browser is not started until launch is called,
+    // used to limit the number of browsers starting at the same time. Until
+    // then, the window shows the control bar in the loading state above an
+    // empty page, and navigation requests only change the page to be opened.
+    static shared_ptr<Window> createQueued(
+        shared_ptr<WindowEventHandler> eventHandler,
+        uint64_t handle,
+        optional<string> uri
+    );
+
+    // Starts the browser of a window created using createQueued. If starting
+    // the browser fails, the window is closed (signaled by onWindowClose).
+    void launch();
+
     // Private constructor.
     Window(CKey, CKey);
 
@@ -85,9 +121,21 @@ public:
     ~Window();
 
     void close();
+
+    // Ends the standby mode of a window created using tryCreateStandby and
+    // navigates it to given URI (or the start page if empty), after which the
+    // window behaves like a window created using tryCreate.
+    void activate(optional<string> uri);
+
     void resize(int width, int height);
     ImageSlice fetchViewImage();
 
+    // Returns a snapshot of the view image that stays unmodified as long as
+    // the returned owner (or a copy of it) exists. The owner may be released
+    // in any thread. The snapshot buffers are reused, such that only the
+    // changed regions are copied.
+    pair<ImageSlice, shared_ptr<void>> fetchViewFrame();
+
     // -1 = back, 0 = refresh, 1 = forward.
     void navigate(int direction);
 
@@ -96,6 +144,29 @@ public:
     void uploadFile(shared_ptr<ViceFileUpload> file);
     void cancelFileUpload();
 
+    // While the window is not visible, the browser is marked hidden, which
+    // stops it from rendering. Windows are initially visible.
+    void setVisible(bool visible);
+
+    // Starts hibernating the window (see hibernate-delay) immediately, unless
+    // it is already hibernating or cannot be hibernated right now. Returns
+    // true if the hibernation was started.
+    bool hibernate();
+
+    // The URL of the page shown in the window (or of the page it will open
+    // once its browser starts or wakes up from hibernation), or empty if not
+    // known.
+    string currentURI();
+
+    // The last time the client sent input to the window or fetched its image.
+    steady_clock::time_point lastClientActivityTime();
+
+    // Runs the periodic checks of an open window (security status, media
+    // detection, idle render rate and hibernation). The server calls this for
+    // all its windows once per second from a single timer instead of each
+    // window running its own.
+    void watchdog();
+
     // Functions for passing input events to the Window. The functions accept
     // all combinations of argument values (the values are sanitized).
     void sendMouseDownEvent(int x, int y, int button);
@@ -108,6 +179,16 @@ public:
     void sendKeyUpEvent(int key);
     void sendLoseFocusEvent();
 
+    // Sends a batch of input events in order, coalescing consecutive mouse
+    // moves and mouse wheel events to reduce the number of events passed to
+    // the browser.
+    void sendInputEvents(const vector<InputEvent>& events);
+
+    // Called right before the input events of trace traceId (see trace.hpp)
+    // are sent to the window. The first browser paint after the events have
+    // been forwarded is attributed to the trace.
+    void addInputTrace(uint64_t traceId);
+
     // WidgetParent:
     virtual void onWidgetViewDirty() override;
     virtual void onWidgetCursorChanged() override;
@@ -123,7 +204,7 @@ public:
     virtual void onOpenBookmarksButtonPressed() override;
 
     // BrowserAreaEventHandler:
-    virtual void onBrowserAreaViewDirty() override;
+    virtual void onBrowserAreaViewDirty(TileBitmap dirtyTiles) override;
 
     // DownloadManagerEventHandler:
     virtual void onPendingDownloadCountChanged(int count) override;
@@ -149,15 +230,81 @@ private:
     void createSuccessful_();
     void createFailed_();
 
+    // Implementation of tryCreate and tryCreateStandby.
+    static shared_ptr<Window> tryCreate_(
+        shared_ptr<WindowEventHandler> eventHandler,
+        uint64_t handle,
+        optional<string> uri,
+        bool standby
+    );
+
+    // Queries the event handler for the optional control bar features; called
+    // once the window is open and not in standby mode.
+    void queryClientFeatures_();
+
+    // Creates a new CEF browser for the window, returning false on failure.
+    bool createBrowser_(string uri);
+
+    // Final step of the window cleanup once there is no browser.
+    void cleanupComplete_();
+
     void afterClose_();
 
-    void watchdog_();
     void updateSecurityStatus_();
 
     void clampMouseCoords_(int& x, int& y);
 
-    // May call onWindowViewImageChanged immediately.
-    void signalImageChanged_();
+    // May call onWindowViewImageChanged immediately. If given, dirtyTiles are
+    // the changed tiles within dirtyRect; otherwise all the tiles intersecting
+    // dirtyRect are marked dirty.
+    void traceForwarded_(uint64_t traceId);
+
+    void signalImageChanged_(
+        Rect dirtyRect,
+        const TileBitmap* dirtyTiles = nullptr
+    );
+
+    // Frame pacing: the changes are notified to the event handler using
+    // onWindowViewImageChanged at most once per frame interval (determined by
+    // the max-fps option), and only after the previously notified image has
+    // been fetched, so that the frame rate follows the rate at which the
+    // images are consumed. The changes in between are merged into a single
+    // notification. May call onWindowViewImageChanged immediately.
+    void scheduleFrame_();
+
+    // Render rate adaptation: the browser renders at the rate given by the
+    // render-fps option while the client is active (sending input or fetching
+    // images), and the watchdog drops the rate to idle-render-fps once the
+    // client has been inactive for IdleRenderDelay.
+    void markClientActive_();
+    void setRenderFps_(int fps);
+
+    // Hibernation: once the client has been inactive for hibernate-delay
+    // seconds, the watchdog calls hibernate to close the browser while
+    // keeping the window open with the last view image. The window is
+    // Hibernating until the browser has closed, after which it is Hibernated.
+    // Client activity (or navigation) calls wakeUp_, which schedules
+    // recreateBrowser_ to open a new browser for the page.
+    void wakeUp_();
+    void recreateBrowser_();
+
+    // Resize coalescing: resize applies the requested size immediately only if
+    // the previous resize was at least ResizeIntervalMs ago; otherwise the
+    // latest requested size is applied by applyResize_ once the interval has
+    // passed.
+    void applyResize_();
+
+    // Steps the zoom level (the render scale of the browser area) to the next
+    // smaller (direction < 0) or larger (direction > 0) value in ZoomSteps, or
+    // resets it to the page-zoom option (direction == 0).
+    void stepZoom_(int direction);
+
+    // Media detection: onBrowserAreaViewDirty counts the paints that cover a
+    // large area, and updateMediaState_ (run by the watchdog) compares their
+    // rate to a threshold to decide whether the window is playing media,
+    // requiring fewer checks while the browser streams audio.
+    void setAudioPlaying_(bool playing);
+    void updateMediaState_();
 
     uint64_t handle_;
     enum {Open, Closed, CleanupComplete} state_;
@@ -165,18 +312,94 @@ private:
     // Empty only in CleanupComplete state.
     shared_ptr<WindowEventHandler> eventHandler_;
 
+    // True if a change has been notified and the image has not been fetched
+    // since.
     bool imageChanged_;
 
+    // The part of the damage that has been notified and the part of the
+    // changes that is still waiting to be notified by scheduleFrame_.
+    Rect notifiedRect_;
+    Rect pendingRect_;
+
+    // Input traces whose events have been forwarded to the browser but not
+    // painted yet, and painted traces waiting for the next view image change.
+    vector<uint64_t> forwardedTraces_;
+    vector<uint64_t> paintedTraces_;
+
+    steady_clock::time_point lastFrameTime_;
+    shared_ptr<Timeout> frameTimeout_;
+
+    steady_clock::time_point lastClientActivityTime_;
+    int renderFps_;
+
+    bool visible_;
+
+    // True while the window has been created using tryCreateStandby and not
+    // yet activated.
+    bool standby_;
+
+    // URI to load as soon as the browser has been created, if navigation is
+    // requested before that.
+    string pendingURI_;
+
+    enum {Awake, Hibernating, Hibernated} hibernation_;
+    bool wakeRequested_;
+
+    // A window created using createQueued is Hibernated with launchQueued_
+    // set (which keeps it from waking up) until launch is called.
+    // launchPending_ is set until the first paint of a browser started by
+    // tryCreate or launch, which is signaled by onWindowLaunchComplete.
+    bool launchQueued_;
+    bool launchPending_;
+
+    // The URL of the page shown when the window started hibernating.
+    string hibernatedURI_;
+
+    // Windows are not hibernated while downloads are pending or in progress.
+    int pendingDownloadCount_;
+    bool downloadsInProgress_;
+
     // Always empty in CleanupComplete state. May be empty in Open and Closed
     // states if the browser has not yet started.
     CefRefPtr<CefBrowser> browser_;
 
+    // rootViewport_ is a slice of rootBuffer_, which may be larger to avoid
+    // reallocating it on every resize.
+    ImageSlice rootBuffer_;
     ImageSlice rootViewport_;
     shared_ptr<RootWidget> rootWidget_;
 
+    pair<int, int> pendingSize_;
+    steady_clock::time_point lastResizeTime_;
+    shared_ptr<Timeout> resizeTimeout_;
+
+    // The tiles of rootViewport_ that have changed since the last
+    // fetchViewImage or fetchViewFrame call.
+    TileBitmap dirtyTiles_;
+
+    // Snapshot buffers of the view image for fetchViewFrame. A buffer is in
+    // use while an owner returned by fetchViewFrame for it exists; staleTiles
+    // are the tiles in which it may differ from rootViewport_. Like
+    // rootViewport_, image is a slice of a possibly larger backing image.
+    struct ViewFrameBuffer {
+        ImageSlice backing;
+        ImageSlice image;
+        TileBitmap staleTiles;
+        atomic<bool> inUse;
+    };
+    vector<shared_ptr<ViewFrameBuffer>> viewFrameBuffers_;
+
     shared_ptr<DownloadManager> downloadManager_;
 
-    shared_ptr<Timeout> watchdogTimeout_;
+    // Identifier of the latest find request; incremented on every Find and
+    // StopFinding call so that late results of earlier requests are ignored.
+    int findID_;
+
+    bool audioPlaying_;
+    bool mediaPlaying_;
+    uint64_t mediaPaintCount_;
+    int mediaCheckStreak_;
+    steady_clock::time_point lastMediaCheckTime_;
 
     // The window is in file upload mode when fileUploadCallback_ is nonempty.
     CefRefPtr<CefFileDialogCallback> fileUploadCallback_;
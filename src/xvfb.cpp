@@ -106,35 +106,7 @@ Xvfb::Xvfb(CKey) {
 
     // Parent process:
     REQUIRE(!close(writeDisplayFd));
-
-    string displayStr;
-    const size_t BufSize = 64;
-    char buf[BufSize];
-
-    while(true) {
-        ssize_t readCount = read(readDisplayFd, buf, BufSize);
-        if(readCount == 0) {
-            break;
-        }
-        if(readCount < 0) {
-            REQUIRE(errno == EINTR);
-            readCount = 0;
-        }
-        displayStr.append(buf, readCount);
-    }
-    REQUIRE(!close(readDisplayFd));
-
-    optional<int> display = parseDisplay(displayStr);
-    if(!display) {
-        PANIC("Starting Xvfb failed");
-    }
-
-    display_ = *display;
-    INFO_LOG("Xvfb X server :", display_, " successfully started");
-
-    // Now that we know the display number, we can add the xauth rule we
-    // actually use
-    addCookieToXAuthFile(xAuthPath_, display_, generateCookie());
+    readDisplayFd_ = readDisplayFd;
 
     running_ = true;
 }
@@ -146,7 +118,11 @@ Xvfb::~Xvfb() {
 }
 
 void Xvfb::setupEnv() {
-    string displayStr = ":" + toString(display_);
+    if(!display_) {
+        waitReady_();
+    }
+
+    string displayStr = ":" + toString(*display_);
     REQUIRE(!setenv("DISPLAY", displayStr.c_str(), true));
     REQUIRE(!setenv("XAUTHORITY", xAuthPath_.c_str(), true));
 }
@@ -156,6 +132,11 @@ void Xvfb::shutdown() {
         return;
     }
 
+    if(readDisplayFd_ != -1) {
+        REQUIRE(!close(readDisplayFd_));
+        readDisplayFd_ = -1;
+    }
+
     INFO_LOG("Sending SIGTERM to the Xvfb X server child process to shut it down");
     if(kill(pid_, SIGTERM) != 0) {
         WARNING_LOG("Could not send SIGTERM signal to Xvfb, maybe it has already shut down?");
@@ -173,4 +154,40 @@ void Xvfb::shutdown() {
     running_ = false;
 }
 
+void Xvfb::waitReady_() {
+    REQUIRE(running_);
+    REQUIRE(readDisplayFd_ != -1);
+
+    string displayStr;
+    const size_t BufSize = 64;
+    char buf[BufSize];
+
+    while(true) {
+        ssize_t readCount = read(readDisplayFd_, buf, BufSize);
+        if(readCount == 0) {
+            break;
+        }
+        if(readCount < 0) {
+            REQUIRE(errno == EINTR);
+            readCount = 0;
+        }
+        displayStr.append(buf, readCount);
+    }
+    REQUIRE(!close(readDisplayFd_));
+    readDisplayFd_ = -1;
+
+    optional<int> display = parseDisplay(displayStr);
+    if(!display) {
+        PANIC("Starting Xvfb failed");
+    }
+
+    INFO_LOG("Xvfb X server :", *display, " successfully started");
+
+    // Now that we know the display number, we can add the xauth rule we
+    // actually use
+    addCookieToXAuthFile(xAuthPath_, *display, generateCookie());
+
+    display_ = *display;
+}
+
 }
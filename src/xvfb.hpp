@@ -8,7 +8,9 @@ namespace browservice {
 
 class TempDir;
 
-// Xvfb X server child process
+// Xvfb X server child process. The constructor only launches the X server,
+// so the program may continue its initialization while it starts up; the
+// first call to setupEnv waits for it to be ready.
 class Xvfb {
 SHARED_ONLY_CLASS(Xvfb);
 public:
@@ -23,10 +25,15 @@ public:
     void shutdown();
 
 private:
+    // Reads the display number from the X server and adds the xauth rule for
+    // it; panics if the server failed to start.
+    void waitReady_();
+
     shared_ptr<TempDir> tempDir_;
     string xAuthPath_;
     pid_t pid_;
-    int display_;
+    int readDisplayFd_;
+    optional<int> display_;
     bool running_;
 };
 
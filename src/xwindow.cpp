@@ -6,6 +6,21 @@
 
 namespace browservice {
 
+namespace {
+
+// Clipboard contents larger than this are not pasted.
+const size_t MaxPasteSize = 16 * 1024 * 1024;
+
+// Clipboard contents larger than this are served to other applications using
+// the INCR protocol in chunks of this size.
+const size_t IncrChunkSize = 64 * 1024;
+
+// Outgoing INCR transfers whose requestor has not consumed a chunk within this
+// time are dropped.
+const steady_clock::duration IncrTransferTimeout = milliseconds(10000);
+
+}
+
 class XWindow::Impl : public enable_shared_from_this<XWindow::Impl> {
 SHARED_ONLY_CLASS(Impl);
 public:
@@ -13,6 +28,10 @@ public:
         mode_ = Idle;
         pasteTimeout_ = Timeout::create(300);
         pasteCallback_ = [](string) {};
+        copyText_ = make_shared<const string>();
+
+        incrPasteActive_ = false;
+        incrPasteOverflow_ = false;
 
         connection_ = xcb_connect(nullptr, nullptr);
         if(connection_ == nullptr || xcb_connection_has_error(connection_)) {
@@ -63,7 +82,7 @@ public:
         pasteCallback_ = [](string) {};
         {
             lock_guard<mutex> lock(copyTextMutex_);
-            copyText_.clear();
+            copyText_ = make_shared<const string>();
         }
 
         REQUIRE(xcb_request_check(connection_,
@@ -82,9 +101,12 @@ public:
         if(mode_ == Pasting) {
             pasteCallback_ = callback;
         } else if(mode_ == Copying) {
-            lock_guard<mutex> lock(copyTextMutex_);
-            string text = copyText_;
-            postTask([callback, text{move(text)}]() { callback(text); });
+            shared_ptr<const string> text;
+            {
+                lock_guard<mutex> lock(copyTextMutex_);
+                text = copyText_;
+            }
+            postTask([callback, text]() { callback(*text); });
         } else {
             REQUIRE(mode_ == Idle);
 
@@ -128,7 +150,7 @@ public:
 
         if(mode_ == Copying) {
             lock_guard<mutex> lock(copyTextMutex_);
-            copyText_ = move(text);
+            copyText_ = make_shared<const string>(move(text));
         } else {
             if(mode_ == Pasting) {
                 pasteTimeout_->clear(false);
@@ -148,7 +170,7 @@ public:
             if(err == nullptr) {
                 mode_ = Copying;
                 lock_guard<mutex> lock(copyTextMutex_);
-                copyText_ = move(text);
+                copyText_ = make_shared<const string>(move(text));
             } else {
                 free(err);
             }
@@ -156,6 +178,14 @@ public:
     }
 
 private:
+    struct IncrTransfer {
+        xcb_atom_t target;
+        shared_ptr<const string> text;
+        size_t pos;
+        steady_clock::time_point lastActivity;
+    };
+    typedef map<pair<xcb_window_t, xcb_atom_t>, IncrTransfer> IncrTransferMap;
+
     void afterConstruct_(shared_ptr<Impl> self) {
         eventHandlerThread_ = thread([self]() {
             self->runEventHandlerThread_();
@@ -182,6 +212,20 @@ private:
         pasteCallback_ = [](string) {};
     }
 
+    void pasteProgressed_() {
+        REQUIRE_UI_THREAD();
+
+        // An incremental transfer is still delivering data; restart the
+        // timeout so that large contents have time to arrive
+        if(mode_ == Pasting) {
+            pasteTimeout_->clear(false);
+            shared_ptr<Impl> self = shared_from_this();
+            pasteTimeout_->set([self]() {
+                self->pasteTimedOut_();
+            });
+        }
+    }
+
     void pasteResponseReceived_(string text) {
         REQUIRE_UI_THREAD();
 
@@ -201,32 +245,60 @@ private:
         if(mode_ == Copying) {
             mode_ = Idle;
             lock_guard<mutex> lock(copyTextMutex_);
-            copyText_.clear();
+            copyText_ = make_shared<const string>();
         }
     }
 
-    void handleSelectionNotifyEvent_(xcb_selection_notify_event_t* event) {
-        if(event->property == 0 || event->target == 0) {
-            return;
-        }
-
-        // Our request for clipboard content has been responded by setting a
-        // property in our window; fetch and delete it
+    // Fetches and deletes given property of our window. Returns nullptr if
+    // the property could not be read; the caller must free the reply.
+    xcb_get_property_reply_t* takeProperty_(xcb_atom_t property) {
+        // Read one unit more than the maximum size to detect oversized values
         xcb_get_property_reply_t* reply = xcb_get_property_reply(
             connection_,
             xcb_get_property(
                 connection_,
                 1,
                 window_,
-                event->property,
-                event->target,
+                property,
+                XCB_GET_PROPERTY_TYPE_ANY,
                 0,
-                INT_MAX / 32
+                MaxPasteSize / 4 + 1
             ),
             nullptr
         );
+        if(reply != nullptr && reply->bytes_after != 0) {
+            // The server only deletes the property if it was read completely
+            xcb_delete_property(connection_, window_, property);
+            xcb_flush(connection_);
+        }
+        return reply;
+    }
+
+    void handleSelectionNotifyEvent_(xcb_selection_notify_event_t* event) {
+        incrPasteActive_ = false;
+        incrPasteText_.clear();
+
+        if(event->property == 0 || event->target == 0) {
+            return;
+        }
+
+        // Our request for clipboard content has been responded by setting a
+        // property in our window; fetch and delete it
+        xcb_get_property_reply_t* reply = takeProperty_(event->property);
         if(reply != nullptr) {
-            if(reply->type != incrAtom_) {
+            if(reply->type == incrAtom_) {
+                // The content is sent incrementally; deleting the property
+                // started the transfer, and the chunks are received in
+                // handlePropertyNotifyEvent_
+                incrPasteActive_ = true;
+                incrPasteOverflow_ = false;
+                incrPasteProperty_ = event->property;
+            } else if(reply->bytes_after != 0) {
+                WARNING_LOG(
+                    "Ignoring clipboard content larger than ",
+                    MaxPasteSize, " bytes"
+                );
+            } else {
                 const char* data = (const char*)xcb_get_property_value(reply);
                 int length = xcb_get_property_value_length(reply);
                 string text(data, length);
@@ -240,6 +312,117 @@ private:
         }
     }
 
+    void handleIncrPasteChunk_() {
+        xcb_get_property_reply_t* reply = takeProperty_(incrPasteProperty_);
+        if(reply == nullptr) {
+            return;
+        }
+        const char* data = (const char*)xcb_get_property_value(reply);
+        size_t length = (size_t)xcb_get_property_value_length(reply);
+        bool overflow = reply->bytes_after != 0;
+
+        if(length == 0 && !overflow) {
+            // Zero-length chunk marks the end of the transfer
+            incrPasteActive_ = false;
+            if(incrPasteOverflow_) {
+                WARNING_LOG(
+                    "Ignoring clipboard content larger than ",
+                    MaxPasteSize, " bytes"
+                );
+            } else {
+                postTask(
+                    shared_from_this(),
+                    &Impl::pasteResponseReceived_,
+                    move(incrPasteText_)
+                );
+            }
+            incrPasteText_.clear();
+        } else {
+            // We keep consuming the chunks of oversized content so that the
+            // owner can finish the transfer
+            if(overflow || incrPasteText_.size() + length > MaxPasteSize) {
+                incrPasteOverflow_ = true;
+                string().swap(incrPasteText_);
+            }
+            if(!incrPasteOverflow_) {
+                incrPasteText_.append(data, length);
+            }
+            postTask(shared_from_this(), &Impl::pasteProgressed_);
+        }
+        free(reply);
+    }
+
+    void handlePropertyNotifyEvent_(xcb_property_notify_event_t* event) {
+        if(
+            event->window == window_ &&
+            event->state == XCB_PROPERTY_NEW_VALUE &&
+            incrPasteActive_ &&
+            event->atom == incrPasteProperty_
+        ) {
+            handleIncrPasteChunk_();
+            return;
+        }
+
+        if(event->state == XCB_PROPERTY_DELETE) {
+            // The requestor of an outgoing incremental transfer has consumed
+            // the previous chunk
+            auto it = incrTransfers_.find({event->window, event->atom});
+            if(it != incrTransfers_.end()) {
+                sendIncrChunk_(it);
+            }
+        }
+    }
+
+    void sendIncrChunk_(IncrTransferMap::iterator it) {
+        IncrTransfer& transfer = it->second;
+        size_t length = min(IncrChunkSize, transfer.text->size() - transfer.pos);
+
+        xcb_change_property(
+            connection_,
+            XCB_PROP_MODE_REPLACE,
+            it->first.first,
+            it->first.second,
+            transfer.target,
+            8,
+            length,
+            transfer.text->data() + transfer.pos
+        );
+        transfer.pos += length;
+        transfer.lastActivity = steady_clock::now();
+
+        if(length == 0) {
+            // The zero-length chunk that ends the transfer has been written
+            xcb_window_t requestor = it->first.first;
+            incrTransfers_.erase(it);
+            stopWatchingRequestor_(requestor);
+        }
+        xcb_flush(connection_);
+    }
+
+    void stopWatchingRequestor_(xcb_window_t requestor) {
+        auto it = incrTransfers_.lower_bound({requestor, 0});
+        if(it == incrTransfers_.end() || it->first.first != requestor) {
+            uint32_t eventMask = XCB_EVENT_MASK_NO_EVENT;
+            xcb_change_window_attributes(
+                connection_, requestor, XCB_CW_EVENT_MASK, &eventMask
+            );
+        }
+    }
+
+    void dropStaleIncrTransfers_() {
+        steady_clock::time_point now = steady_clock::now();
+        auto it = incrTransfers_.begin();
+        while(it != incrTransfers_.end()) {
+            if(now - it->second.lastActivity > IncrTransferTimeout) {
+                xcb_window_t requestor = it->first.first;
+                it = incrTransfers_.erase(it);
+                stopWatchingRequestor_(requestor);
+            } else {
+                ++it;
+            }
+        }
+    }
+
     void handleSelectionRequestEvent_(xcb_selection_request_event_t* event) {
         bool needsNotify = false;
         if(event->selection == clipboardAtom_) {
@@ -262,17 +445,25 @@ private:
             } else if(event->target == utf8StringAtom_) {
                 // We are asked to serve the clipboard content to a property of the
                 // requesting window
-                lock_guard<mutex> lock(copyTextMutex_);
-                xcb_change_property(
-                    connection_,
-                    XCB_PROP_MODE_REPLACE,
-                    event->requestor,
-                    event->property,
-                    event->target,
-                    8,
-                    copyText_.size(),
-                    copyText_.data()
-                );
+                shared_ptr<const string> text;
+                {
+                    lock_guard<mutex> lock(copyTextMutex_);
+                    text = copyText_;
+                }
+                if(text->size() <= IncrChunkSize) {
+                    xcb_change_property(
+                        connection_,
+                        XCB_PROP_MODE_REPLACE,
+                        event->requestor,
+                        event->property,
+                        event->target,
+                        8,
+                        text->size(),
+                        text->data()
+                    );
+                } else {
+                    startIncrTransfer_(event, move(text));
+                }
                 needsNotify = true;
             }
         }
@@ -300,6 +491,40 @@ private:
         }
     }
 
+    void startIncrTransfer_(
+        xcb_selection_request_event_t* event,
+        shared_ptr<const string> text
+    ) {
+        dropStaleIncrTransfers_();
+
+        // Watch for the requestor deleting the property to send the chunks;
+        // the content is sent from the shared snapshot without copying even
+        // if the clipboard changes during the transfer
+        uint32_t eventMask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+        xcb_change_window_attributes(
+            connection_, event->requestor, XCB_CW_EVENT_MASK, &eventMask
+        );
+
+        uint32_t size = (uint32_t)min(text->size(), (size_t)UINT32_MAX);
+        xcb_change_property(
+            connection_,
+            XCB_PROP_MODE_REPLACE,
+            event->requestor,
+            event->property,
+            incrAtom_,
+            32,
+            1,
+            &size
+        );
+
+        IncrTransfer& transfer =
+            incrTransfers_[{event->requestor, event->property}];
+        transfer.target = event->target;
+        transfer.text = move(text);
+        transfer.pos = 0;
+        transfer.lastActivity = steady_clock::now();
+    }
+
     void handleSelectionClearEvent_(xcb_selection_clear_event_t* event) {
         // We do not own the clipboard anymore; change mode accordingly
         if(event->selection == clipboardAtom_) {
@@ -314,7 +539,11 @@ private:
 
             int type = event->response_type & ~0x80;
 
-            if(type == XCB_DESTROY_NOTIFY) {
+            if(
+                type == XCB_DESTROY_NOTIFY &&
+                ((xcb_destroy_notify_event_t*)event)->window == window_
+            ) {
+                free(event);
                 break;
             }
 
@@ -335,6 +564,14 @@ private:
                     (xcb_selection_clear_event_t*)event
                 );
             }
+
+            if(type == XCB_PROPERTY_NOTIFY) {
+                handlePropertyNotifyEvent_(
+                    (xcb_property_notify_event_t*)event
+                );
+            }
+
+            free(event);
         }
     }
 
@@ -354,8 +591,19 @@ private:
     enum {Pasting, Copying, Idle, Closed} mode_;
     shared_ptr<Timeout> pasteTimeout_;
     function<void(string)> pasteCallback_;
-    string copyText_;
+    shared_ptr<const string> copyText_;
     mutex copyTextMutex_;
+
+    // State of the incoming incremental transfer, accessed only from the
+    // event handler thread
+    bool incrPasteActive_;
+    bool incrPasteOverflow_;
+    xcb_atom_t incrPasteProperty_;
+    string incrPasteText_;
+
+    // Outgoing incremental transfers keyed by the requestor window and
+    // property, accessed only from the event handler thread
+    IncrTransferMap incrTransfers_;
 };
 
 XWindow::XWindow(CKey) {
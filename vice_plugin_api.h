@@ -42,7 +42,10 @@ extern "C" {
  *     configuration options should also be specified by the user, because the options are
  *     plugin-specific. The function may also return an error (for example if the configuration
  *     options are invalid); the program should show this error to the user. The program may query
- *     for the documentation of the options by calling vicePluginAPI_getOptionDocs.
+ *     for the documentation of the options by calling vicePluginAPI_getOptionDocs. The plugin may
+ *     already set up its listening sockets in this step, so that clients connecting while the
+ *     program finishes its own initialization are held until the context is started instead of
+ *     being refused.
  *
  *  4. The program starts the operation of the plugin context by calling vicePluginAPI_start,
  *     providing a VicePluginAPI_Callbacks structure that contains function pointers to callbacks to
@@ -741,6 +744,256 @@ void vicePluginAPI_URINavigation_enable(
     VicePluginAPI_URINavigation_Callbacks callbacks
 );
 
+/***************************************************************************************************
+ *** API extension "DirtyRect" ***
+ *********************************/
+
+/* Extension that allows the program to tell the plugin which part of the window view has changed
+ * when notifying it about a view change. The plugin may use this information to avoid processing
+ * the unchanged parts of the view image.
+ */
+
+/* Variant of vicePluginAPI_notifyWindowViewChanged that also specifies that only the pixels in the
+ * rectangle [x, x + width) x [y, y + height) of the view image have changed since the previous
+ * notification. The rectangle is given in the coordinates of the view image and it may extend
+ * beyond the image boundaries; the plugin should clamp it as necessary. Damage that spans multiple
+ * notifications must be accumulated by the plugin until it fetches the image using the
+ * fetchWindowImage callback. The program may freely mix calls to this function and
+ * vicePluginAPI_notifyWindowViewChanged; the latter should be treated as if the whole view image
+ * has changed.
+ */
+void vicePluginAPI_DirtyRect_notifyWindowViewChanged(
+    VicePluginAPI_Context* ctx,
+    uint64_t window,
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height
+);
+
+/***************************************************************************************************
+ *** API extension "SharedFrame" ***
+ ***********************************/
+
+/* Extension that allows the program to hand over window view images to the plugin as
+ * reference-counted immutable buffers, so that the plugin may process the image after the fetch
+ * callback has returned without copying it first. The extension is enabled by the program using
+ * vicePluginAPI_SharedFrame_enable; after that, the plugin may use the fetchWindowFrame callback
+ * in VicePluginAPI_SharedFrame_Callbacks instead of fetchWindowImage in VicePluginAPI_Callbacks.
+ */
+
+struct VicePluginAPI_SharedFrame_Callbacks {
+    /* Variant of fetchWindowImage in VicePluginAPI_Callbacks. The program must call putFrameFunc
+     * exactly once before returning, with the same image arguments as putImageFunc in
+     * fetchWindowImage. In addition, the program gives the function releaseFunc and the pointer
+     * releaseFuncData: the image data must stay valid and unmodified until the plugin calls
+     * releaseFunc(releaseFuncData). The plugin must call releaseFunc exactly once, and it may call it
+     * at any time from any thread (also within putFrameFunc and after the context has been
+     * destroyed).
+     */
+    void (*fetchWindowFrame)(
+        void*,
+        uint64_t window,
+        void (*putFrameFunc)(
+            void* putFrameFuncData,
+            const uint8_t* image,
+            size_t width,
+            size_t height,
+            size_t pitch,
+            void (*releaseFunc)(void*),
+            void* releaseFuncData
+        ),
+        void* putFrameFuncData
+    );
+};
+typedef struct VicePluginAPI_SharedFrame_Callbacks VicePluginAPI_SharedFrame_Callbacks;
+
+/* Enables the SharedFrame callbacks in given context. May only be called once for each context,
+ * after vicePluginAPI_initContext and before vicePluginAPI_start. The vice plugin uses the
+ * callbacks similarly to the callbacks given in vicePluginAPI_start.
+ */
+void vicePluginAPI_SharedFrame_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_SharedFrame_Callbacks callbacks
+);
+
+/***************************************************************************************************
+ *** API extension "InputBatch" ***
+ **********************************/
+
+/* Extension that allows the plugin to relay all the input events it has received for a window at
+ * once in a single callback instead of calling the individual input event callbacks (mouseDown,
+ * mouseUp, ..., loseFocus) in VicePluginAPI_Callbacks for each event. The extension is enabled by
+ * the program using vicePluginAPI_InputBatch_enable.
+ */
+
+/* Type of an input event in VicePluginAPI_InputEvent; each type corresponds to the input event
+ * callback with the same name in VicePluginAPI_Callbacks.
+ */
+enum VicePluginAPI_InputEventType {
+    VICE_PLUGIN_API_INPUT_EVENT_MOUSE_DOWN = 0,
+    VICE_PLUGIN_API_INPUT_EVENT_MOUSE_UP = 1,
+    VICE_PLUGIN_API_INPUT_EVENT_MOUSE_MOVE = 2,
+    VICE_PLUGIN_API_INPUT_EVENT_MOUSE_DOUBLE_CLICK = 3,
+    VICE_PLUGIN_API_INPUT_EVENT_MOUSE_WHEEL = 4,
+    VICE_PLUGIN_API_INPUT_EVENT_MOUSE_LEAVE = 5,
+    VICE_PLUGIN_API_INPUT_EVENT_KEY_DOWN = 6,
+    VICE_PLUGIN_API_INPUT_EVENT_KEY_UP = 7,
+    VICE_PLUGIN_API_INPUT_EVENT_LOSE_FOCUS = 8,
+
+    /* Invalid value that is larger than any valid enum value, used to ensure
+     * binary compatibility when new values are added.
+     */
+    VICE_PLUGIN_API_INPUT_EVENT_HUGE_UNUSED = 1000000000
+};
+typedef enum VicePluginAPI_InputEventType VicePluginAPI_InputEventType;
+
+/* A single input event. The fields have the same meaning as the arguments of the input event
+ * callback corresponding to the type of the event; the fields that are not arguments of that
+ * callback are ignored by the program and should be set to zero.
+ */
+struct VicePluginAPI_InputEvent {
+    VicePluginAPI_InputEventType type;
+    int x;
+    int y;
+    int button;
+    int dx;
+    int dy;
+    int key;
+};
+typedef struct VicePluginAPI_InputEvent VicePluginAPI_InputEvent;
+
+struct VicePluginAPI_InputBatch_Callbacks {
+    /* Relays the input events events[i] for 0 <= i < eventCount for given window in order. The
+     * event list is valid only for the duration of the call. Calling this function is equivalent
+     * to calling the individual input event callbacks for the events in the same order, except
+     * that the program may coalesce consecutive mouse move events and consecutive mouse wheel
+     * events of the batch. The program must tolerate the same argument values as in the
+     * individual callbacks and ignore events with unknown types. The plugin may mix calls to this
+     * function and the individual input event callbacks.
+     */
+    void (*inputEvents)(
+        void*,
+        uint64_t window,
+        const VicePluginAPI_InputEvent* events,
+        size_t eventCount
+    );
+};
+typedef struct VicePluginAPI_InputBatch_Callbacks VicePluginAPI_InputBatch_Callbacks;
+
+/* Enables the InputBatch callbacks in given context. May only be called once for each context,
+ * after vicePluginAPI_initContext and before vicePluginAPI_start. The vice plugin uses the
+ * callbacks similarly to the callbacks given in vicePluginAPI_start.
+ */
+void vicePluginAPI_InputBatch_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_InputBatch_Callbacks callbacks
+);
+
+/***************************************************************************************************
+ *** API extension "WindowVisibility" ***
+ ****************************************/
+
+/* Extension that allows the plugin to tell the program whether the view of a window is currently
+ * being shown to a user, so that the program may stop rendering windows that nobody sees. The
+ * extension is enabled by the program using vicePluginAPI_WindowVisibility_enable.
+ */
+
+struct VicePluginAPI_WindowVisibility_Callbacks {
+    /* Called by the plugin to signal whether the view of given window is currently shown in a
+     * client (visible = 1) or not (visible = 0). All windows are initially visible. While a
+     * window is hidden, the program may stop rendering it and skip calling
+     * vicePluginAPI_notifyWindowViewChanged, but it must still serve the fetchWindowImage calls
+     * (and other callbacks) for it normally. The plugin should mark the window visible again
+     * before it needs an up-to-date view image. The plugin may call this function with the same
+     * value multiple times in a row.
+     */
+    void (*setWindowVisible)(void*, uint64_t window, int visible);
+};
+typedef struct VicePluginAPI_WindowVisibility_Callbacks VicePluginAPI_WindowVisibility_Callbacks;
+
+/* Enables the WindowVisibility callbacks in given context. May only be called once for each
+ * context, after vicePluginAPI_initContext and before vicePluginAPI_start. The vice plugin uses
+ * the callbacks similarly to the callbacks given in vicePluginAPI_start.
+ */
+void vicePluginAPI_WindowVisibility_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_WindowVisibility_Callbacks callbacks
+);
+
+/***************************************************************************************************
+ *** API extension "Trace" ***
+ *****************************/
+
+/* Extension that allows following individual user inputs through the whole pipeline for latency
+ * analysis. The plugin assigns a trace ID (nonzero and unique within the plugin) to each batch of
+ * input events it relays to the program, and both the plugin and the program report the stages
+ * that the trace reaches: the plugin reports the input, and after the program has told it that a
+ * view change reflects the trace (using vicePluginAPI_Trace_windowViewTraced), the stages of
+ * fetching, compressing and sending the view image. The extension is enabled by the program using
+ * vicePluginAPI_Trace_enable.
+ */
+
+struct VicePluginAPI_Trace_Callbacks {
+    /* Called by the plugin to report that trace traceId of given window has reached the stage
+     * given as a null-terminated string; details is a human-readable null-terminated string that
+     * may be empty. The stages reported by the plugin are "input", "fetch", "compressed" and
+     * "sent"; the program should not make assumptions about other stage names. Unlike the other
+     * callbacks, this callback may be called from any thread, including multiple threads
+     * concurrently, and also outside vicePluginAPI_pumpEvents; the program should only record the
+     * event. When the stage is "input", the plugin relays the input events of the trace in the same
+     * thread immediately after the call returns, before relaying any other input events.
+     */
+    void (*traceEvent)(
+        void*,
+        uint64_t window,
+        uint64_t traceId,
+        const char* stage,
+        const char* details
+    );
+};
+typedef struct VicePluginAPI_Trace_Callbacks VicePluginAPI_Trace_Callbacks;
+
+/* Enables the Trace callbacks in given context. May only be called once for each context, after
+ * vicePluginAPI_initContext and before vicePluginAPI_start. If the extension is not enabled, the
+ * plugin does not assign trace IDs.
+ */
+void vicePluginAPI_Trace_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_Trace_Callbacks callbacks
+);
+
+/* Tells the plugin that the view changes of given window notified in the next call of
+ * vicePluginAPI_notifyWindowViewChanged (or vicePluginAPI_DirtyRect_notifyWindowViewChanged) for
+ * the window reflect the input events of trace traceId. May be called multiple times before the
+ * notification, and only for windows that are open.
+ */
+void vicePluginAPI_Trace_windowViewTraced(
+    VicePluginAPI_Context* ctx,
+    uint64_t window,
+    uint64_t traceId
+);
+
+/***************************************************************************************************
+ *** API extension "MediaState" ***
+ **********************************/
+
+/* Extension that allows the program to tell the plugin when a window is playing media (such as a
+ * video), so that the plugin may switch the window to an encoding policy better suited for
+ * continuously changing content (for example, lower image quality and a capped frame rate).
+ */
+
+/* Tells the plugin whether given window is currently playing media (playing = 1) or not
+ * (playing = 0). All windows are initially assumed not to be playing media. May only be called for
+ * windows that are open; the program may call this function with the same value multiple times in
+ * a row.
+ */
+void vicePluginAPI_MediaState_setWindowMediaPlaying(
+    VicePluginAPI_Context* ctx,
+    uint64_t window,
+    int playing
+);
+
 #ifdef __cplusplus
 }
 #endif
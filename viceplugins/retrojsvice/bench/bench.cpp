@@ -0,0 +1,631 @@
+// Benchmark for the image compression pipeline of retrojsvice. Runs
+// PNGCompressor::compress and compressJPEG over a corpus of frames at several
+// thread counts and prints one JSON object per line for each combination of
+// frame, codec and thread count:
+//
+// {"frame":"text_1920x1080","width":1920,"height":1080,"codec":"png",
+//  "quality":101,"threads":4,"iterations":20,"mb_per_s":...,
+//  "p50_ms":...,"p99_ms":...,"compressed_bytes":...}
+//
+// The throughput mb_per_s is computed from the size of the BGRA input image
+// (4 bytes per pixel) and the median compression time.
+//
+// Usage: bench [--iterations N] [--threads T1,T2,...] [FRAME.ppm...]
+//        bench [--threads T1,T2,...] --capture FILE
+//
+// The frames are given as binary PPM (P6) files, e.g. captured screenshots
+// converted using 'convert screenshot.png frame.ppm'. If no frames are given,
+// a built-in corpus of synthetic frames (text-like, gradient and noisy
+// content) at 800x600, 1280x720 and 1920x1080 is used.
+//
+// With --capture, the frame sequence recorded by browservice using the
+// frame-capture-file option (format described in src/frame_capture.hpp of
+// browservice) is replayed instead: each recorded frame is compressed once as
+// a full frame and once as a tile covering the region that changed from the
+// previous frame of the window, like the image compressor does for tile
+// clients. One JSON object is printed for each codec and thread count:
+//
+// {"capture":"session.bsvcap","codec":"jpeg","quality":80,"threads":4,
+//  "frames":812,"mb_per_s":...,"full_p50_ms":...,"full_p99_ms":...,
+//  "full_bytes":...,"tiles":640,"tile_p50_ms":...,"tile_p99_ms":...,
+//  "tile_bytes":...}
+//
+// Frames identical to the previous one are not compressed and tiles are only
+// counted for frames with a partial change.
+
+#include "../src/jpeg.hpp"
+#include "../src/png.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct Frame {
+    std::string name;
+    size_t width;
+    size_t height;
+    std::vector<uint8_t> data; // BGRA
+};
+
+// Minimal fixed-size worker pool implementing PNGCompressor::ParallelFor in
+// the same way as the CompressorPool of the plugin: the calling thread takes
+// part in running the calls.
+class WorkerPool {
+public:
+    WorkerPool(size_t threadCount)
+        : shutdown_(false),
+          count_(0),
+          nextIdx_(0),
+          doneCount_(0)
+    {
+        for(size_t i = 1; i < threadCount; ++i) {
+            threads_.emplace_back([this]() { runWorker_(); });
+        }
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+        }
+        cv_.notify_all();
+        for(std::thread& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void parallelFor(size_t count, std::function<void(size_t)> func) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        func_ = std::move(func);
+        count_ = count;
+        nextIdx_ = 0;
+        doneCount_ = 0;
+        cv_.notify_all();
+
+        while(nextIdx_ < count_) {
+            runCall_(lock);
+        }
+        doneCv_.wait(lock, [&]() { return doneCount_ == count_; });
+        func_ = nullptr;
+    }
+
+private:
+    void runWorker_() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true) {
+            if(func_ && nextIdx_ < count_) {
+                runCall_(lock);
+            } else if(shutdown_) {
+                break;
+            } else {
+                cv_.wait(lock);
+            }
+        }
+    }
+
+    void runCall_(std::unique_lock<std::mutex>& lock) {
+        size_t idx = nextIdx_++;
+        std::function<void(size_t)>& func = func_;
+        lock.unlock();
+        func(idx);
+        lock.lock();
+        if(++doneCount_ == count_) {
+            doneCv_.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable doneCv_;
+    bool shutdown_;
+
+    std::function<void(size_t)> func_;
+    size_t count_;
+    size_t nextIdx_;
+    size_t doneCount_;
+};
+
+uint32_t nextRandom(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Synthetic frame resembling a web page: white background with lines of small
+// dark glyph-like blocks and a colored header bar.
+Frame createTextFrame(size_t width, size_t height) {
+    Frame frame = {"text", width, height, std::vector<uint8_t>(4 * width * height, 255)};
+    uint32_t rng = 1;
+    for(size_t y = 0; y < height; ++y) {
+        for(size_t x = 0; x < width; ++x) {
+            uint8_t* pixel = &frame.data[4 * (y * width + x)];
+            if(y < 40) {
+                pixel[0] = 180;
+                pixel[1] = 120;
+                pixel[2] = 40;
+                continue;
+            }
+            size_t lineY = (y - 40) % 18;
+            size_t glyphX = x % 9;
+            if(lineY >= 4 && lineY < 15 && glyphX < 7) {
+                if(glyphX == 0 && lineY == 4) {
+                    nextRandom(rng);
+                }
+                if((rng >> (lineY + glyphX)) & 1) {
+                    pixel[0] = pixel[1] = pixel[2] = 30;
+                }
+            }
+        }
+    }
+    return frame;
+}
+
+Frame createGradientFrame(size_t width, size_t height) {
+    Frame frame = {"gradient", width, height, std::vector<uint8_t>(4 * width * height, 255)};
+    for(size_t y = 0; y < height; ++y) {
+        for(size_t x = 0; x < width; ++x) {
+            uint8_t* pixel = &frame.data[4 * (y * width + x)];
+            pixel[0] = (uint8_t)(255 * x / width);
+            pixel[1] = (uint8_t)(255 * y / height);
+            pixel[2] = (uint8_t)(255 * (x + y) / (width + height));
+        }
+    }
+    return frame;
+}
+
+// Smooth content with noise, resembling a photo.
+Frame createPhotoFrame(size_t width, size_t height) {
+    Frame frame = createGradientFrame(width, height);
+    frame.name = "photo";
+    uint32_t rng = 2;
+    for(size_t i = 0; i < frame.data.size(); ++i) {
+        if(i % 4 != 3) {
+            int val = (int)frame.data[i] + (int)(nextRandom(rng) % 25) - 12;
+            frame.data[i] = (uint8_t)std::min(std::max(val, 0), 255);
+        }
+    }
+    return frame;
+}
+
+bool readPPM(const std::string& path, Frame& frame) {
+    std::ifstream fp(path, std::ios::binary);
+    std::string magic;
+    size_t width, height;
+    int maxVal;
+    if(!(fp >> magic >> width >> height >> maxVal) || magic != "P6" || maxVal != 255) {
+        return false;
+    }
+    fp.get();
+
+    std::vector<uint8_t> rgb(3 * width * height);
+    if(!fp.read((char*)rgb.data(), rgb.size()) || width == 0 || height == 0) {
+        return false;
+    }
+
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    frame = {name, width, height, std::vector<uint8_t>(4 * width * height, 255)};
+    for(size_t i = 0; i < width * height; ++i) {
+        frame.data[4 * i] = rgb[3 * i + 2];
+        frame.data[4 * i + 1] = rgb[3 * i + 1];
+        frame.data[4 * i + 2] = rgb[3 * i];
+    }
+    return true;
+}
+
+// Read-only memory mapping of a frame capture file.
+class CaptureFile {
+public:
+    CaptureFile() : data_(nullptr), size_(0) {}
+    ~CaptureFile() {
+        if(data_ != nullptr) {
+            munmap((void*)data_, size_);
+        }
+    }
+    CaptureFile(const CaptureFile&) = delete;
+    CaptureFile& operator=(const CaptureFile&) = delete;
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd == -1) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && st.st_size >= 8;
+        if(ok) {
+            void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED) {
+                ok = false;
+            } else {
+                data_ = (const uint8_t*)data;
+                size_ = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+        return ok && memcmp(data_, "BSVCAP01", 8) == 0;
+    }
+
+    struct Record {
+        uint32_t type;
+        uint64_t window;
+        uint64_t timestamp;
+        const uint8_t* payload;
+        size_t payloadSize;
+    };
+
+    // Calls func for each complete record in the file; a truncated record at
+    // the end (if the capture was interrupted) is ignored.
+    void forEachRecord(std::function<void(const Record&)> func) const {
+        size_t pos = 8;
+        while(pos + 24 <= size_) {
+            Record record;
+            uint32_t size;
+            memcpy(&record.type, data_ + pos, 4);
+            memcpy(&size, data_ + pos + 4, 4);
+            memcpy(&record.window, data_ + pos + 8, 8);
+            memcpy(&record.timestamp, data_ + pos + 16, 8);
+            record.payload = data_ + pos + 24;
+            record.payloadSize = size;
+            size_t paddedSize = ((size_t)size + 7) / 8 * 8;
+            if(size_ - pos - 24 < paddedSize) {
+                break;
+            }
+            func(record);
+            pos += 24 + paddedSize;
+        }
+    }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+};
+
+double quantile(std::vector<double> times, int percent) {
+    if(times.empty()) {
+        return 0.0;
+    }
+    std::sort(times.begin(), times.end());
+    return times[(times.size() - 1) * percent / 100];
+}
+
+struct ReplayCodec {
+    const char* codec;
+    int quality;
+    std::vector<double> fullTimes;
+    size_t fullBytes;
+    uint64_t fullPixels;
+    std::vector<double> tileTimes;
+    size_t tileBytes;
+};
+
+// Replays the frames of the capture, calling compress for each codec with the
+// image, width, height and pitch (in pixels) of the full frames and tiles.
+// Returns false if the capture is malformed.
+bool replayCapture(
+    const CaptureFile& capture,
+    std::vector<ReplayCodec>& codecs,
+    std::function<size_t(const ReplayCodec&, const uint8_t*, size_t, size_t, size_t)> compress
+) {
+    const uint32_t FrameRecord = 2;
+
+    struct WindowFrame {
+        size_t width = 0;
+        size_t height = 0;
+        std::vector<uint8_t> data;
+    };
+    std::map<uint64_t, WindowFrame> windows;
+
+    auto measure = [&](
+        const ReplayCodec& codec,
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch,
+        std::vector<double>& times
+    ) {
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = compress(codec, image, width, height, pitch);
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        return bytes;
+    };
+
+    bool ok = true;
+    capture.forEachRecord([&](const CaptureFile::Record& record) {
+        if(!ok || record.type != FrameRecord) {
+            return;
+        }
+        if(record.payloadSize < 24) {
+            ok = false;
+            return;
+        }
+        uint32_t width, height;
+        int32_t rect[4];
+        memcpy(&width, record.payload, 4);
+        memcpy(&height, record.payload + 4, 4);
+        memcpy(rect, record.payload + 8, 16);
+        int32_t startX = rect[0], endX = rect[1], startY = rect[2], endY = rect[3];
+        bool empty = startX >= endX || startY >= endY;
+        if(
+            width == 0 || height == 0 ||
+            (!empty && (
+                startX < 0 || startY < 0 ||
+                (uint32_t)endX > width || (uint32_t)endY > height
+            ))
+        ) {
+            ok = false;
+            return;
+        }
+        size_t regionWidth = empty ? 0 : (size_t)(endX - startX);
+        size_t regionHeight = empty ? 0 : (size_t)(endY - startY);
+        if(record.payloadSize != 24 + 4 * regionWidth * regionHeight) {
+            ok = false;
+            return;
+        }
+
+        WindowFrame& frame = windows[record.window];
+        bool full = regionWidth == width && regionHeight == height;
+        if(frame.width != width || frame.height != height) {
+            if(!full) {
+                ok = false;
+                return;
+            }
+            frame.width = width;
+            frame.height = height;
+            frame.data.assign(4 * (size_t)width * height, 0);
+        }
+        if(empty) {
+            return;
+        }
+        const uint8_t* pixels = record.payload + 24;
+        for(size_t y = 0; y < regionHeight; ++y) {
+            memcpy(
+                frame.data.data() + 4 * ((startY + y) * width + startX),
+                pixels + 4 * y * regionWidth,
+                4 * regionWidth
+            );
+        }
+
+        for(ReplayCodec& codec : codecs) {
+            codec.fullBytes += measure(
+                codec, frame.data.data(), width, height, width, codec.fullTimes
+            );
+            codec.fullPixels += (uint64_t)width * height;
+            if(!full) {
+                codec.tileBytes += measure(
+                    codec,
+                    frame.data.data() + 4 * ((size_t)startY * width + startX),
+                    regionWidth,
+                    regionHeight,
+                    width,
+                    codec.tileTimes
+                );
+            }
+        }
+    });
+    return ok;
+}
+
+void runBenchmark(
+    const Frame& frame,
+    const char* codec,
+    int quality,
+    size_t threads,
+    size_t iterations,
+    std::function<size_t()> compress
+) {
+    // Warm up caches and the allocator before measuring
+    compress();
+
+    std::vector<double> times;
+    size_t compressedBytes = 0;
+    for(size_t i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        compressedBytes = compress();
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    double p50 = times[(times.size() - 1) / 2];
+    double p99 = times[(times.size() - 1) * 99 / 100];
+    double mbPerS = 4.0 * frame.width * frame.height / (p50 / 1000.0) / 1e6;
+
+    printf(
+        "{\"frame\":\"%s_%zux%zu\",\"width\":%zu,\"height\":%zu,"
+        "\"codec\":\"%s\",\"quality\":%d,\"threads\":%zu,\"iterations\":%zu,"
+        "\"mb_per_s\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+        "\"compressed_bytes\":%zu}\n",
+        frame.name.c_str(), frame.width, frame.height,
+        frame.width, frame.height,
+        codec, quality, threads, iterations,
+        mbPerS, p50, p99,
+        compressedBytes
+    );
+    fflush(stdout);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t iterations = 20;
+    std::vector<size_t> threadCounts = {1, 2, 4};
+    std::vector<Frame> frames;
+    std::string capturePath;
+
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if(arg == "--iterations" && i + 1 < argc) {
+            iterations = (size_t)std::max(atoi(argv[++i]), 1);
+        } else if(arg == "--threads" && i + 1 < argc) {
+            threadCounts.clear();
+            std::string list = argv[++i];
+            size_t pos = 0;
+            while(pos <= list.size()) {
+                size_t end = std::min(list.find(',', pos), list.size());
+                int count = atoi(list.substr(pos, end - pos).c_str());
+                if(count > 0) {
+                    threadCounts.push_back((size_t)count);
+                }
+                pos = end + 1;
+            }
+            if(threadCounts.empty()) {
+                std::cerr << "Invalid thread count list '" << list << "'\n";
+                return 1;
+            }
+        } else if(arg == "--capture" && i + 1 < argc) {
+            capturePath = argv[++i];
+        } else {
+            Frame frame;
+            if(!readPPM(arg, frame)) {
+                std::cerr << "Reading binary PPM file '" << arg << "' failed\n";
+                return 1;
+            }
+            frames.push_back(std::move(frame));
+        }
+    }
+
+    if(!capturePath.empty()) {
+        CaptureFile capture;
+        if(!capture.open(capturePath)) {
+            std::cerr << "Opening frame capture file '" << capturePath << "' failed\n";
+            return 1;
+        }
+        std::string name = capturePath.substr(capturePath.find_last_of('/') + 1);
+
+        for(size_t threads : threadCounts) {
+            WorkerPool pool(threads);
+            PNGCompressor pngCompressor(
+                std::min(threads, (size_t)4),
+                [&pool](size_t count, std::function<void(size_t)> func) {
+                    pool.parallelFor(count, std::move(func));
+                }
+            );
+
+            std::vector<ReplayCodec> codecs = {
+                {"png", 101, {}, 0, 0, {}, 0},
+                {"jpeg", 30, {}, 0, 0, {}, 0},
+                {"jpeg", 80, {}, 0, 0, {}, 0}
+            };
+            bool ok = replayCapture(capture, codecs, [&](
+                const ReplayCodec& codec,
+                const uint8_t* image,
+                size_t width,
+                size_t height,
+                size_t pitch
+            ) -> size_t {
+                if(codec.quality == 101) {
+                    std::shared_ptr<const std::vector<std::vector<uint8_t>>> png =
+                        pngCompressor.compress(image, width, height, pitch);
+                    size_t size = 0;
+                    for(const std::vector<uint8_t>& chunk : *png) {
+                        size += chunk.size();
+                    }
+                    return size;
+                }
+                return compressJPEG(
+                    image, width, height, pitch, codec.quality, threads,
+                    [&pool](size_t count, std::function<void(size_t)> func) {
+                        pool.parallelFor(count, std::move(func));
+                    }
+                ).length;
+            });
+            if(!ok) {
+                std::cerr << "Frame capture file '" << capturePath << "' is malformed\n";
+                return 1;
+            }
+
+            for(const ReplayCodec& codec : codecs) {
+                double fullSeconds = 0.0;
+                for(double time : codec.fullTimes) {
+                    fullSeconds += time / 1000.0;
+                }
+                double mbPerS =
+                    fullSeconds > 0.0 ? 4.0 * codec.fullPixels / fullSeconds / 1e6 : 0.0;
+                printf(
+                    "{\"capture\":\"%s\",\"codec\":\"%s\",\"quality\":%d,"
+                    "\"threads\":%zu,\"frames\":%zu,\"mb_per_s\":%.2f,"
+                    "\"full_p50_ms\":%.3f,\"full_p99_ms\":%.3f,\"full_bytes\":%zu,"
+                    "\"tiles\":%zu,\"tile_p50_ms\":%.3f,\"tile_p99_ms\":%.3f,"
+                    "\"tile_bytes\":%zu}\n",
+                    name.c_str(), codec.codec, codec.quality, threads,
+                    codec.fullTimes.size(), mbPerS,
+                    quantile(codec.fullTimes, 50), quantile(codec.fullTimes, 99),
+                    codec.fullBytes,
+                    codec.tileTimes.size(),
+                    quantile(codec.tileTimes, 50), quantile(codec.tileTimes, 99),
+                    codec.tileBytes
+                );
+                fflush(stdout);
+            }
+        }
+        return 0;
+    }
+
+    if(frames.empty()) {
+        const size_t resolutions[][2] = {{800, 600}, {1280, 720}, {1920, 1080}};
+        for(const auto& resolution : resolutions) {
+            frames.push_back(createTextFrame(resolution[0], resolution[1]));
+            frames.push_back(createGradientFrame(resolution[0], resolution[1]));
+            frames.push_back(createPhotoFrame(resolution[0], resolution[1]));
+        }
+    }
+
+    for(size_t threads : threadCounts) {
+        WorkerPool pool(threads);
+
+        // Use the same stripe count as ImageCompressor
+        PNGCompressor pngCompressor(
+            std::min(threads, (size_t)4),
+            [&pool](size_t count, std::function<void(size_t)> func) {
+                pool.parallelFor(count, std::move(func));
+            }
+        );
+
+        for(const Frame& frame : frames) {
+            const uint8_t* image = frame.data.data();
+            size_t width = frame.width;
+            size_t height = frame.height;
+
+            runBenchmark(frame, "png", 101, threads, iterations, [&]() {
+                std::shared_ptr<const std::vector<std::vector<uint8_t>>> png =
+                    pngCompressor.compress(image, width, height, width);
+                size_t size = 0;
+                for(const std::vector<uint8_t>& chunk : *png) {
+                    size += chunk.size();
+                }
+                return size;
+            });
+
+            // Use the same strip count as ImageCompressor
+            for(int quality : {30, 80}) {
+                runBenchmark(frame, "jpeg", quality, threads, iterations, [&]() {
+                    return compressJPEG(
+                        image, width, height, width, quality, threads,
+                        [&pool](size_t count, std::function<void(size_t)> func) {
+                            pool.parallelFor(count, std::move(func));
+                        }
+                    ).length;
+                });
+            }
+        }
+    }
+
+    return 0;
+}
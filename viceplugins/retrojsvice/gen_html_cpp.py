@@ -7,7 +7,7 @@ print('#include "html.hpp"')
 print()
 print('namespace retrojsvice {')
 
-for filename in os.listdir("html"):
+for filename in sorted(os.listdir("html")):
     if not filename.endswith(".html"):
         continue
     
@@ -16,11 +16,28 @@ for filename in os.listdir("html"):
     with open("html/" + filename) as fp:
         code = fp.read()
 
-    code = re.sub(r'%-([a-zA-Z0-9]+)-%', r')DELIM" << data.\1 << R"DELIM(', code)
+    # Split the template into static fragments (even indices) and variable
+    # names (odd indices)
+    parts = re.split(r'%-([a-zA-Z0-9]+)-%', code)
 
     print()
-    print('void write{}HTML(ostream& out, const {}HTMLData& data) {{'.format(name, name))
-    print('    out << R"DELIM(' + code + ')DELIM";')
+    print('namespace {')
+    print()
+    for i in range(0, len(parts), 2):
+        if parts[i]:
+            print('constexpr char {}HTMLFragment{}[] = R"DELIM({})DELIM";'.format(name, i // 2, parts[i]))
+    print()
+    print('}')
+    print()
+    print('void write{}HTML(HTMLScatterList& out, const {}HTMLData& data) {{'.format(name, name))
+    print('    out.reserve({});'.format(len(parts)))
+    for i in range(len(parts)):
+        if i % 2 == 0:
+            if parts[i]:
+                fragment = '{}HTMLFragment{}'.format(name, i // 2)
+                print('    out.appendStatic({}, sizeof({}) - 1);'.format(fragment, fragment))
+        else:
+            print('    out.append(data.{});'.format(parts[i]))
     print('}')
 
 print()
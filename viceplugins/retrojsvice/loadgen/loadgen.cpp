@@ -0,0 +1,1006 @@
+// Load generator for retrojsvice. Simulates a number of clients that speak the
+// same protocol as html/main.html in image polling mode: each client opens a
+// window through the WindowManager ("/" and the prev/next page sequence),
+// polls the frames through /image/<mainIdx>/<imgIdx>/... requests with the
+// same request indexing, retry and event queue logic as main.html, and
+// injects a scripted stream of input events. Event lists longer than
+// maxEventPathLength are sent through the /input/ endpoint like in main.html.
+//
+// When the run ends, the windows are closed and one JSON object per line is
+// printed for each client, followed by a total:
+//
+// {"client":0,"frames":1234,"fps":20.57,"bytes":5678901,"mbit_per_s":0.76,
+//  "events":600,"latency_p50_ms":...,"latency_p99_ms":...,"errors":0}
+//
+// The input-to-frame latency of an event is the time from generating the
+// event to receiving a frame in response to a request that carried it.
+//
+// Usage: loadgen [--clients N] [--duration SECONDS] [--ramp MS] [--rtt MS]
+//                [--bandwidth KBIT_PER_S] [--width W] [--height H]
+//                [--auth USER:PASSWORD] [--script FILE] HOST:PORT
+//
+// The network is simulated per client by delaying each request by half of the
+// RTT and each response by half of the RTT plus its transfer time at the given
+// bandwidth (0 for unlimited); the responses of a client share the bandwidth.
+// The sockets themselves are read at full speed.
+//
+// The script file contains lines of form 'DELAY_MS EVENT', where EVENT is an
+// event in the format used by main.html without the trailing slash (such as
+// MMO_100_200, MDN_100_200_0 or MWH_100_200_120) to be generated DELAY_MS
+// milliseconds after the previous one; lines starting with '#' are ignored.
+// The arguments of KDN, KUP and KPR events are the key codes before the
+// key cipher of main.html, which is applied by the load generator. The script
+// is repeated until the end of the run. By default, the mouse is moved across
+// the window every 50 ms and the wheel is scrolled every 2 seconds.
+//
+// The mouse cursor and iframe signals encoded in the frame dimensions are not
+// decoded, so popups and downloads are not followed.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Configuration constants of main.html
+const int ImgLoadRetryInterval = 3000;
+const int ImgLoadMaxRetries = 10;
+const int EventDelay = 10;
+const size_t MaxEventPathLength = 1000;
+
+struct Options {
+    int clients = 1;
+    int durationS = 30;
+    int rampMs = 100;
+    int rttMs = 0;
+    int bandwidthKbit = 0;
+    int width = 1024;
+    int height = 768;
+    std::string auth;
+    std::string host;
+    std::string port;
+};
+
+Options opts;
+addrinfo* serverAddr = nullptr;
+std::string authHeader;
+
+struct ScriptItem {
+    int delayMs;
+    std::string event;
+};
+std::vector<ScriptItem> script;
+
+double msSince(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+std::string base64(const std::string& str) {
+    const char* chars =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string ret;
+    for(size_t i = 0; i < str.size(); i += 3) {
+        uint32_t val = (uint32_t)(uint8_t)str[i] << 16;
+        if(i + 1 < str.size()) val |= (uint32_t)(uint8_t)str[i + 1] << 8;
+        if(i + 2 < str.size()) val |= (uint32_t)(uint8_t)str[i + 2];
+        ret.push_back(chars[(val >> 18) & 63]);
+        ret.push_back(chars[(val >> 12) & 63]);
+        ret.push_back(i + 1 < str.size() ? chars[(val >> 6) & 63] : '=');
+        ret.push_back(i + 2 < str.size() ? chars[val & 63] : '=');
+    }
+    return ret;
+}
+
+// Timers run from the main loop in the order of their deadlines.
+class TimerQueue {
+public:
+    void post(Clock::time_point time, std::function<void()> func) {
+        queue_.push({time, nextSeq_++, std::move(func)});
+    }
+    void postDelayed(int64_t delayMs, std::function<void()> func) {
+        post(Clock::now() + std::chrono::milliseconds(delayMs), std::move(func));
+    }
+
+    // Runs the due timers and returns the time until the next one in
+    // milliseconds, or -1 if there are no timers.
+    int runDue() {
+        while(!queue_.empty()) {
+            Clock::time_point now = Clock::now();
+            const Timer& top = queue_.top();
+            if(top.time > now) {
+                return (int)std::max(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        top.time - now
+                    ).count() + 1,
+                    (int64_t)1
+                );
+            }
+            std::function<void()> func = std::move(top.func);
+            queue_.pop();
+            func();
+        }
+        return -1;
+    }
+
+private:
+    struct Timer {
+        Clock::time_point time;
+        uint64_t seq;
+        mutable std::function<void()> func;
+
+        bool operator<(const Timer& other) const {
+            return time != other.time ? time > other.time : seq > other.seq;
+        }
+    };
+    std::priority_queue<Timer> queue_;
+    uint64_t nextSeq_ = 0;
+};
+
+TimerQueue timers;
+
+// Minimal non-blocking HTTP/1.1 client connection that runs one request at a
+// time and reuses the connection if the server keeps it alive. Starting a new
+// request while one is running aborts it by reconnecting, like a browser does
+// when the source of an image element changes.
+class Connection {
+public:
+    typedef std::function<void(int status, std::string body)> Callback;
+
+    ~Connection() {
+        close_();
+    }
+
+    bool busy() const {
+        return (bool)callback_;
+    }
+
+    // Calls callback with status 0 if the request fails.
+    void request(
+        const std::string& method,
+        const std::string& path,
+        const std::string& body,
+        Callback callback
+    ) {
+        if(busy()) {
+            close_();
+        }
+        callback_ = std::move(callback);
+
+        std::string req = method + " " + path + " HTTP/1.1\r\n";
+        req += "Host: " + opts.host + ":" + opts.port + "\r\n";
+        req += "User-Agent: Mozilla/5.0 (retrojsvice-loadgen)\r\n";
+        if(!authHeader.empty()) {
+            req += "Authorization: " + authHeader + "\r\n";
+        }
+        if(method == "POST") {
+            req += "Content-Type: text/plain\r\n";
+            req += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        }
+        req += "\r\n";
+        req += body;
+        out_ = std::move(req);
+        outPos_ = 0;
+        in_.clear();
+
+        reused_ = fd_ >= 0;
+        if(!reused_ && !connect_()) {
+            fail_();
+        }
+    }
+
+    // Adds the socket to the poll list if it needs polling.
+    void addPollFd(std::vector<pollfd>& fds, std::vector<Connection*>& conns) {
+        if(fd_ < 0) {
+            return;
+        }
+        pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = (connecting_ || outPos_ < out_.size()) ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        fds.push_back(pfd);
+        conns.push_back(this);
+    }
+
+    void handlePoll(short revents) {
+        if(connecting_) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+            if(err != 0) {
+                fail_();
+                return;
+            }
+            connecting_ = false;
+        }
+        if(outPos_ < out_.size()) {
+            ssize_t count = send(
+                fd_, out_.data() + outPos_, out_.size() - outPos_, MSG_NOSIGNAL
+            );
+            if(count < 0 && errno != EAGAIN && errno != EINTR) {
+                fail_();
+            } else if(count > 0) {
+                outPos_ += (size_t)count;
+            }
+            return;
+        }
+        if(revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buf[65536];
+            ssize_t count = recv(fd_, buf, sizeof(buf), 0);
+            if(count < 0) {
+                if(errno != EAGAIN && errno != EINTR) {
+                    fail_();
+                }
+                return;
+            }
+            if(count == 0) {
+                // The body may be delimited by the end of the connection
+                if(!finishResponse_(true)) {
+                    fail_();
+                }
+                return;
+            }
+            in_.append(buf, (size_t)count);
+            if(!callback_) {
+                // Unexpected data on an idle connection
+                close_();
+                return;
+            }
+            finishResponse_(false);
+        }
+    }
+
+private:
+    bool connect_() {
+        fd_ = socket(serverAddr->ai_family, SOCK_STREAM, 0);
+        if(fd_ < 0) {
+            return false;
+        }
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+        if(
+            connect(fd_, serverAddr->ai_addr, serverAddr->ai_addrlen) != 0 &&
+            errno != EINPROGRESS
+        ) {
+            close_();
+            return false;
+        }
+        connecting_ = true;
+        return true;
+    }
+
+    void close_() {
+        if(fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        connecting_ = false;
+        callback_ = nullptr;
+    }
+
+    void fail_() {
+        if(reused_ && in_.empty() && callback_) {
+            // The server may have closed the idle connection before receiving
+            // the request; retry once using a new connection
+            Callback callback = std::move(callback_);
+            close_();
+            reused_ = false;
+            callback_ = std::move(callback);
+            outPos_ = 0;
+            if(connect_()) {
+                return;
+            }
+        }
+        Callback callback = std::move(callback_);
+        close_();
+        if(callback) {
+            callback(0, "");
+        }
+    }
+
+    // Parses the response in in_; if it is complete, calls the callback and
+    // returns true.
+    bool finishResponse_(bool eof) {
+        size_t headerEnd = in_.find("\r\n\r\n");
+        if(headerEnd == std::string::npos) {
+            return false;
+        }
+        std::string headers = in_.substr(0, headerEnd + 2);
+        int status = 0;
+        if(sscanf(headers.c_str(), "HTTP/%*d.%*d %d", &status) != 1) {
+            return false;
+        }
+
+        long contentLength = -1;
+        bool chunked = false;
+        bool keepAlive = headers.compare(0, 8, "HTTP/1.1") == 0;
+        size_t pos = headers.find("\r\n") + 2;
+        while(pos < headers.size()) {
+            size_t end = headers.find("\r\n", pos);
+            std::string line = headers.substr(pos, end - pos);
+            pos = end + 2;
+            size_t colon = line.find(':');
+            if(colon == std::string::npos) {
+                continue;
+            }
+            std::string name = line.substr(0, colon);
+            std::string value = line.substr(colon + 1);
+            for(char& c : name) c = (char)tolower(c);
+            for(char& c : value) c = (char)tolower(c);
+            if(name == "content-length") {
+                contentLength = atol(value.c_str());
+            } else if(name == "transfer-encoding") {
+                chunked = value.find("chunked") != std::string::npos;
+            } else if(name == "connection") {
+                if(value.find("close") != std::string::npos) {
+                    keepAlive = false;
+                } else if(value.find("keep-alive") != std::string::npos) {
+                    keepAlive = true;
+                }
+            }
+        }
+
+        std::string body;
+        size_t bodyStart = headerEnd + 4;
+        if(chunked) {
+            size_t chunkPos = bodyStart;
+            while(true) {
+                size_t lineEnd = in_.find("\r\n", chunkPos);
+                if(lineEnd == std::string::npos) {
+                    return false;
+                }
+                size_t size = strtoul(in_.c_str() + chunkPos, nullptr, 16);
+                chunkPos = lineEnd + 2;
+                if(size == 0) {
+                    if(in_.find("\r\n", chunkPos) == std::string::npos) {
+                        return false;
+                    }
+                    break;
+                }
+                if(in_.size() < chunkPos + size + 2) {
+                    return false;
+                }
+                body.append(in_, chunkPos, size);
+                chunkPos += size + 2;
+            }
+        } else if(contentLength >= 0) {
+            if(in_.size() < bodyStart + (size_t)contentLength) {
+                return false;
+            }
+            body = in_.substr(bodyStart, (size_t)contentLength);
+        } else {
+            if(!eof) {
+                return false;
+            }
+            body = in_.substr(bodyStart);
+            keepAlive = false;
+        }
+
+        Callback callback = std::move(callback_);
+        callback_ = nullptr;
+        in_.clear();
+        if(!keepAlive || eof) {
+            close_();
+        }
+        if(callback) {
+            callback(status, std::move(body));
+        }
+        return true;
+    }
+
+    int fd_ = -1;
+    bool connecting_ = false;
+    bool reused_ = false;
+    std::string out_;
+    size_t outPos_ = 0;
+    std::string in_;
+    Callback callback_;
+};
+
+class Client {
+public:
+    Client(int idx) : idx_(idx) {}
+
+    void start() {
+        startTime_ = Clock::now();
+        openWindow_();
+    }
+
+    // Stops generating events and closes the window.
+    void stop() {
+        stopped_ = true;
+        endTime_ = Clock::now();
+        if(mainIdx_ != 0) {
+            std::string path = prefix_ + "/close/" + std::to_string(mainIdx_) + "/";
+            conns_[0].request("GET", path, "", [](int, std::string) {});
+        }
+    }
+
+    void addPollFds(std::vector<pollfd>& fds, std::vector<Connection*>& conns) {
+        for(Connection& conn : conns_) {
+            conn.addPollFd(fds, conns);
+        }
+    }
+
+    bool closing() const {
+        return conns_[0].busy();
+    }
+
+    void report() const {
+        double seconds = std::max(msSince(startTime_, endTime_) / 1000.0, 1e-3);
+        printResult(
+            std::to_string(idx_), frames_, frames_ / seconds, bytes_,
+            bytes_ * 8.0 / seconds / 1e6, events_, latencies_, errors_
+        );
+    }
+
+    static void printResult(
+        const std::string& name,
+        uint64_t frames,
+        double fps,
+        uint64_t bytes,
+        double mbitPerS,
+        uint64_t events,
+        std::vector<double> latencies,
+        uint64_t errors
+    ) {
+        double p50 = 0.0;
+        double p99 = 0.0;
+        if(!latencies.empty()) {
+            std::sort(latencies.begin(), latencies.end());
+            p50 = latencies[(latencies.size() - 1) / 2];
+            p99 = latencies[(latencies.size() - 1) * 99 / 100];
+        }
+        printf(
+            "{\"client\":%s,\"frames\":%llu,\"fps\":%.2f,\"bytes\":%llu,"
+            "\"mbit_per_s\":%.2f,\"events\":%llu,\"latency_p50_ms\":%.1f,"
+            "\"latency_p99_ms\":%.1f,\"errors\":%llu}\n",
+            name.c_str(), (unsigned long long)frames, fps,
+            (unsigned long long)bytes, mbitPerS, (unsigned long long)events,
+            p50, p99, (unsigned long long)errors
+        );
+    }
+
+    uint64_t frames_ = 0;
+    uint64_t bytes_ = 0;
+    uint64_t events_ = 0;
+    uint64_t errors_ = 0;
+    std::vector<double> latencies_;
+
+private:
+    struct QueuedEvent {
+        std::string event;
+        Clock::time_point time;
+        bool latencyRecorded;
+    };
+
+    // Runs a request through the simulated network.
+    void request_(
+        int connIdx,
+        const std::string& method,
+        const std::string& path,
+        const std::string& body,
+        std::function<void(int, std::string)> callback
+    ) {
+        if(stopped_) {
+            return;
+        }
+        uint64_t gen = ++connGen_[connIdx];
+        timers.postDelayed(opts.rttMs / 2, [this, connIdx, gen, method, path, body, callback]() {
+            if(stopped_ || gen != connGen_[connIdx]) {
+                return;
+            }
+            conns_[connIdx].request(method, path, body, [this, gen, connIdx, callback](int status, std::string respBody) {
+                if(stopped_ || gen != connGen_[connIdx]) {
+                    return;
+                }
+                deliver_(status, std::move(respBody), callback);
+            });
+        });
+    }
+
+    void deliver_(
+        int status,
+        std::string body,
+        std::function<void(int, std::string)> callback
+    ) {
+        Clock::time_point time = Clock::now();
+        if(opts.bandwidthKbit > 0) {
+            time = std::max(time, linkFreeTime_) + std::chrono::microseconds(
+                (int64_t)(body.size() * 8000 / (uint64_t)opts.bandwidthKbit)
+            );
+            linkFreeTime_ = time;
+        }
+        time += std::chrono::milliseconds(opts.rttMs / 2);
+        timers.post(time, [this, status, body{std::move(body)}, callback]() {
+            if(!stopped_) {
+                callback(status, body);
+            }
+        });
+    }
+
+    void openWindow_() {
+        request_(0, "GET", "/", "", [this](int status, std::string body) {
+            // The new window page redirects to <prefix>/prev/
+            size_t end = body.find("/prev/\"");
+            size_t start = body.rfind('"', end);
+            if(status != 200 || end == std::string::npos || start == std::string::npos) {
+                windowOpenFailed_(status, body);
+                return;
+            }
+            prefix_ = body.substr(start + 1, end - start - 1);
+
+            // Follow the history navigation of the pages to the main page
+            visitInitialPages_({"/prev/", "/", "/next/", "/"});
+        });
+    }
+
+    void visitInitialPages_(std::vector<std::string> paths) {
+        std::string path = paths.front();
+        paths.erase(paths.begin());
+        request_(0, "GET", prefix_ + path, "", [this, paths](int status, std::string body) {
+            if(status != 200) {
+                windowOpenFailed_(status, body);
+            } else if(!paths.empty()) {
+                visitInitialPages_(paths);
+            } else {
+                mainPageLoaded_(body);
+            }
+        });
+    }
+
+    void mainPageLoaded_(const std::string& html) {
+        std::string closePrefix = prefix_ + "/close/";
+        size_t pos = html.find(closePrefix);
+        if(pos == std::string::npos) {
+            windowOpenFailed_(200, "main page has no close path");
+            return;
+        }
+        mainIdx_ = strtoull(html.c_str() + pos + closePrefix.size(), nullptr, 10);
+
+        const std::string snakeOilPrefix = "pushSnakeOil(new Array(";
+        pos = 0;
+        while((pos = html.find(snakeOilPrefix, pos)) != std::string::npos) {
+            pos += snakeOilPrefix.size();
+            size_t end = html.find(')', pos);
+            std::stringstream ss(html.substr(pos, end - pos));
+            std::string item;
+            while(getline(ss, item, ',')) {
+                snakeOilKey_.push_back(atoi(item.c_str()));
+            }
+        }
+        if(mainIdx_ == 0 || snakeOilKey_.empty()) {
+            windowOpenFailed_(200, "could not parse main page");
+            return;
+        }
+
+        scriptPos_ = (size_t)idx_ % script.size();
+        scheduleScriptEvent_();
+        startImgLoad_();
+    }
+
+    void windowOpenFailed_(int status, const std::string& body) {
+        ++errors_;
+        fprintf(
+            stderr, "Client %d: opening window failed (status %d): %s\n",
+            idx_, status, body.substr(0, 200).c_str()
+        );
+        timers.postDelayed(1000, [this]() { openWindow_(); });
+    }
+
+    void scheduleScriptEvent_() {
+        const ScriptItem& item = script[scriptPos_];
+        timers.postDelayed(item.delayMs, [this]() {
+            if(stopped_) {
+                return;
+            }
+            putEvent_(script[scriptPos_].event);
+            scriptPos_ = (scriptPos_ + 1) % script.size();
+            scheduleScriptEvent_();
+        });
+    }
+
+    void putEvent_(std::string event) {
+        // The key events are encrypted with the key index of the event
+        for(const char* name : {"KDN_", "KUP_", "KPR_"}) {
+            if(event.compare(0, 4, name) == 0) {
+                uint64_t idx = eventQueueStartIdx_ + eventQueue_.size();
+                int key = atoi(event.c_str() + 4);
+                key ^= snakeOilKey_[idx % snakeOilKey_.size()];
+                event = event.substr(0, 4) + std::to_string(key);
+            }
+        }
+        eventQueue_.push_back({event, Clock::now(), false});
+        ++events_;
+        newEventNotify_();
+    }
+
+    void newEventNotify_() {
+        if(currentImgLoadIdx_ == 0 || !allowNewEventNotify_) return;
+        allowNewEventNotify_ = false;
+        imgLoadAttempts_ = std::max(imgLoadAttempts_ - 1, 0);
+        scheduleImgReload_(currentImgLoadIdx_, EventDelay);
+    }
+
+    void scheduleImgReload_(uint64_t imgLoadIdx, int delay) {
+        if(imgLoadIdx != currentImgLoadIdx_) return;
+
+        uint64_t imgReloadIdx = ++currentImgReloadIdx_;
+        timers.postDelayed(delay, [this, imgLoadIdx, imgReloadIdx]() {
+            if(
+                stopped_ ||
+                imgLoadIdx != currentImgLoadIdx_ ||
+                imgReloadIdx != currentImgReloadIdx_
+            ) return;
+            sendImgReq_(imgLoadIdx);
+        });
+    }
+
+    void startImgLoad_() {
+        if(stopped_) return;
+
+        uint64_t imgLoadIdx = ++currentImgLoadIdx_;
+        imgLoadEventIncrement_ = eventQueue_.size();
+        firstImgReqSent_ = false;
+        imgLoadAttempts_ = 0;
+        currentImgReloadIdx_ = 0;
+        allowNewEventNotify_ = true;
+
+        sendImgReq_(imgLoadIdx);
+    }
+
+    void sendImgReq_(uint64_t imgLoadIdx) {
+        if(stopped_ || imgLoadIdx != currentImgLoadIdx_) return;
+
+        if(imgLoadAttempts_ > ImgLoadMaxRetries) {
+            // The connection is lost; start over with a new window
+            fprintf(stderr, "Client %d: connection lost\n", idx_);
+            ++errors_;
+            mainIdx_ = 0;
+            imgReqIdx_ = 0;
+            currentImgLoadIdx_ = 0;
+            eventQueueStartIdx_ = 0;
+            eventQueue_.clear();
+            snakeOilKey_.clear();
+            openWindow_();
+            return;
+        }
+        ++imgLoadAttempts_;
+
+        int immediate = (firstImgReqSent_ || imgReqIdx_ == 0) ? 1 : 0;
+        firstImgReqSent_ = true;
+
+        uint64_t reqIdx = ++imgReqIdx_;
+        std::string imgPath =
+            prefix_ + "/image/" +
+            std::to_string(mainIdx_) + "/" +
+            std::to_string(reqIdx) + "/" +
+            std::to_string(immediate) + "/" +
+            std::to_string(opts.width) + "/" +
+            std::to_string(opts.height) + "/";
+        std::string eventPath;
+        for(const QueuedEvent& event : eventQueue_) {
+            eventPath += event.event + "/";
+        }
+        uint64_t startIdx = eventQueueStartIdx_;
+        uint64_t endIdx = eventQueueStartIdx_ + eventQueue_.size();
+
+        // Image requests of the same load replace each other like in the
+        // image element alternation of main.html
+        int connIdx = (int)(imgLoadIdx & 1);
+        if(eventPath.size() > MaxEventPathLength) {
+            std::string inputPath =
+                prefix_ + "/input/" + std::to_string(mainIdx_) + "/" +
+                std::to_string(startIdx) + "/";
+            request_(connIdx, "POST", inputPath, eventPath,
+                [this, connIdx, imgLoadIdx, reqIdx, imgPath, startIdx, endIdx](
+                    int status, std::string body
+                ) {
+                    if(imgLoadIdx != currentImgLoadIdx_) return;
+                    if(status != 200) {
+                        ++errors_;
+                        return;
+                    }
+                    sendImgPath_(
+                        connIdx, imgLoadIdx, reqIdx,
+                        imgPath + std::to_string(endIdx) + "/", startIdx, endIdx
+                    );
+                }
+            );
+        } else {
+            sendImgPath_(
+                connIdx, imgLoadIdx, reqIdx,
+                imgPath + std::to_string(startIdx) + "/" + eventPath,
+                startIdx, endIdx
+            );
+        }
+
+        scheduleImgReload_(imgLoadIdx, ImgLoadRetryInterval);
+    }
+
+    void sendImgPath_(
+        int connIdx,
+        uint64_t imgLoadIdx,
+        uint64_t reqIdx,
+        const std::string& path,
+        uint64_t startIdx,
+        uint64_t endIdx
+    ) {
+        request_(connIdx, "GET", path, "",
+            [this, imgLoadIdx, startIdx, endIdx](int status, std::string body) {
+                if(imgLoadIdx != currentImgLoadIdx_) return;
+                if(status != 200) {
+                    // main.html relies on the reload timeout to retry
+                    ++errors_;
+                    return;
+                }
+                imgLoaded_(startIdx, endIdx, body.size());
+            }
+        );
+    }
+
+    void imgLoaded_(uint64_t startIdx, uint64_t endIdx, size_t size) {
+        ++frames_;
+        bytes_ += size;
+
+        Clock::time_point now = Clock::now();
+        for(uint64_t i = startIdx; i < endIdx; ++i) {
+            if(i < eventQueueStartIdx_ || i - eventQueueStartIdx_ >= eventQueue_.size()) {
+                continue;
+            }
+            QueuedEvent& event = eventQueue_[i - eventQueueStartIdx_];
+            if(!event.latencyRecorded) {
+                event.latencyRecorded = true;
+                latencies_.push_back(msSince(event.time, now));
+            }
+        }
+
+        // beginImgLoadComplete and endImgLoadComplete of main.html
+        allowNewEventNotify_ = false;
+        ++currentImgReloadIdx_;
+
+        eventQueueStartIdx_ += imgLoadEventIncrement_;
+        eventQueue_.erase(
+            eventQueue_.begin(), eventQueue_.begin() + imgLoadEventIncrement_
+        );
+
+        startImgLoad_();
+    }
+
+    int idx_;
+    bool stopped_ = false;
+    Clock::time_point startTime_;
+    Clock::time_point endTime_;
+    Clock::time_point linkFreeTime_;
+
+    Connection conns_[2];
+    uint64_t connGen_[2] = {0, 0};
+
+    std::string prefix_;
+    uint64_t mainIdx_ = 0;
+    std::vector<int> snakeOilKey_;
+    size_t scriptPos_ = 0;
+
+    uint64_t imgReqIdx_ = 0;
+    uint64_t currentImgLoadIdx_ = 0;
+    uint64_t currentImgReloadIdx_ = 0;
+    size_t imgLoadEventIncrement_ = 0;
+    bool firstImgReqSent_ = false;
+    bool allowNewEventNotify_ = false;
+    int imgLoadAttempts_ = 0;
+
+    uint64_t eventQueueStartIdx_ = 0;
+    std::deque<QueuedEvent> eventQueue_;
+};
+
+bool readScript(const std::string& path) {
+    std::ifstream fp(path);
+    if(!fp) {
+        return false;
+    }
+    std::string line;
+    while(getline(fp, line)) {
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::stringstream ss(line);
+        ScriptItem item;
+        if(!(ss >> item.delayMs >> item.event) || item.delayMs < 0) {
+            return false;
+        }
+        script.push_back(item);
+    }
+    return !script.empty();
+}
+
+void createDefaultScript() {
+    const int Steps = 40;
+    for(int i = 0; i < Steps; ++i) {
+        int x = opts.width * i / Steps;
+        int y = opts.height * i / Steps;
+        script.push_back({50, "MMO_" + std::to_string(x) + "_" + std::to_string(y)});
+    }
+    int x = opts.width / 2;
+    int y = opts.height / 2;
+    script.push_back({0, "MWH_" + std::to_string(x) + "_" + std::to_string(y) + "_-120"});
+}
+
+bool parseInt(const char* str, int& val, int minVal) {
+    char* end;
+    long ret = strtol(str, &end, 10);
+    if(*str == '\0' || *end != '\0' || ret < minVal || ret > 1000000000) {
+        return false;
+    }
+    val = (int)ret;
+    return true;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string scriptPath;
+    std::string server;
+
+    for(int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool ok = true;
+        if(arg == "--clients" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.clients, 1);
+        } else if(arg == "--duration" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.durationS, 1);
+        } else if(arg == "--ramp" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.rampMs, 0);
+        } else if(arg == "--rtt" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.rttMs, 0);
+        } else if(arg == "--bandwidth" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.bandwidthKbit, 0);
+        } else if(arg == "--width" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.width, 1);
+        } else if(arg == "--height" && i + 1 < argc) {
+            ok = parseInt(argv[++i], opts.height, 1);
+        } else if(arg == "--auth" && i + 1 < argc) {
+            opts.auth = argv[++i];
+        } else if(arg == "--script" && i + 1 < argc) {
+            scriptPath = argv[++i];
+        } else if(server.empty() && arg.compare(0, 2, "--") != 0) {
+            server = arg;
+        } else {
+            ok = false;
+        }
+        if(!ok) {
+            std::cerr << "Invalid argument '" << arg << "'\n";
+            return 1;
+        }
+    }
+
+    size_t colon = server.rfind(':');
+    if(server.empty() || colon == std::string::npos) {
+        std::cerr << "Usage: loadgen [--clients N] [--duration SECONDS] [--ramp MS] "
+            "[--rtt MS] [--bandwidth KBIT_PER_S] [--width W] [--height H] "
+            "[--auth USER:PASSWORD] [--script FILE] HOST:PORT\n";
+        return 1;
+    }
+    opts.host = server.substr(0, colon);
+    opts.port = server.substr(colon + 1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(opts.host.c_str(), opts.port.c_str(), &hints, &serverAddr) != 0) {
+        std::cerr << "Resolving address '" << server << "' failed\n";
+        return 1;
+    }
+
+    if(!opts.auth.empty()) {
+        authHeader = "Basic " + base64(opts.auth);
+    }
+
+    if(scriptPath.empty()) {
+        createDefaultScript();
+    } else if(!readScript(scriptPath)) {
+        std::cerr << "Reading script file '" << scriptPath << "' failed\n";
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<Client>> clients;
+    for(int i = 0; i < opts.clients; ++i) {
+        clients.emplace_back(new Client(i));
+        Client* client = clients.back().get();
+        timers.postDelayed((int64_t)opts.rampMs * i, [client]() { client->start(); });
+    }
+
+    // Each client runs for the duration after its start
+    bool running = true;
+    timers.postDelayed(
+        (int64_t)opts.rampMs * (opts.clients - 1) + 1000 * (int64_t)opts.durationS,
+        [&running]() { running = false; }
+    );
+    for(int i = 0; i < opts.clients; ++i) {
+        Client* client = clients[i].get();
+        timers.postDelayed(
+            (int64_t)opts.rampMs * i + 1000 * (int64_t)opts.durationS,
+            [client]() { client->stop(); }
+        );
+    }
+
+    // Keep polling after the run to send the window close requests
+    Clock::time_point closeDeadline = Clock::time_point::max();
+    std::vector<pollfd> fds;
+    std::vector<Connection*> conns;
+    while(true) {
+        int timeout = timers.runDue();
+        if(!running && closeDeadline == Clock::time_point::max()) {
+            closeDeadline = Clock::now() + std::chrono::milliseconds(2000);
+        }
+        if(!running) {
+            bool closing = false;
+            for(const std::unique_ptr<Client>& client : clients) {
+                closing = closing || client->closing();
+            }
+            if(!closing || Clock::now() > closeDeadline) {
+                break;
+            }
+            timeout = 100;
+        }
+
+        fds.clear();
+        conns.clear();
+        for(const std::unique_ptr<Client>& client : clients) {
+            client->addPollFds(fds, conns);
+        }
+        if(poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            std::cerr << "poll failed\n";
+            return 1;
+        }
+        for(size_t i = 0; i < fds.size(); ++i) {
+            if(fds[i].revents) {
+                conns[i]->handlePoll(fds[i].revents);
+            }
+        }
+    }
+
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t events = 0;
+    uint64_t errors = 0;
+    std::vector<double> latencies;
+    for(const std::unique_ptr<Client>& client : clients) {
+        client->report();
+        frames += client->frames_;
+        bytes += client->bytes_;
+        events += client->events_;
+        errors += client->errors_;
+        latencies.insert(
+            latencies.end(), client->latencies_.begin(), client->latencies_.end()
+        );
+    }
+    double seconds = (double)opts.durationS;
+    Client::printResult(
+        "\"total\"", frames, frames / seconds, bytes, bytes * 8.0 / seconds / 1e6,
+        events, latencies, errors
+    );
+
+    freeaddrinfo(serverAddr);
+    return 0;
+}
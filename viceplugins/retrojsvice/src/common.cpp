@@ -2,8 +2,24 @@
 
 #include "../../../vice_plugin_api.h"
 
+#include <pthread.h>
+#include <sched.h>
+
 namespace retrojsvice {
 
+void setCurrentThreadCPUs(const vector<int>& cpus) {
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for(int cpu : cpus) {
+        REQUIRE(cpu >= 0 && cpu < CPU_SETSIZE);
+        CPU_SET(cpu, &cpuSet);
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet);
+    if(err != 0) {
+        WARNING_LOG("Setting the CPU affinity of a thread failed: ", strerror(err));
+    }
+}
+
 string sanitizeUTF8String(string str) {
     string ret;
     for(size_t i = 0; i < str.size(); ++i) {
@@ -110,9 +126,30 @@ function<void(const char*, const char*)> panicCallback =
 
 }
 
+bool LogRateLimiter::allow(uint64_t& suppressedCount) {
+    int64_t now = duration_cast<milliseconds>(
+        steady_clock::now().time_since_epoch()
+    ).count();
+    int64_t windowStart = windowStart_.load(memory_order_relaxed);
+    if(
+        now - windowStart >= Window &&
+        windowStart_.compare_exchange_strong(windowStart, now)
+    ) {
+        windowCount_.store(0, memory_order_relaxed);
+    }
+    if(windowCount_.fetch_add(1, memory_order_relaxed) < Burst) {
+        suppressedCount = suppressedCount_.exchange(0, memory_order_relaxed);
+        return true;
+    } else {
+        suppressedCount_.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+}
+
 void LogWriter::log_(string msg) {
+    string location = string(file_) + ":" + toString(line_);
     lock_guard<mutex> lock(logCallbackMutex);
-    logCallback(logLevel_, location_.c_str(), msg.c_str());
+    logCallback(logLevel_, location.c_str(), msg.c_str());
 }
 
 void Panicker::panic_(string msg) {
@@ -4,9 +4,12 @@
 #include <atomic>
 #include <cctype>
 #include <chrono>
+#include <climits>
 #include <condition_variable>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <fstream>
 #include <functional>
@@ -15,24 +18,27 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <optional>
 #include <queue>
 #include <random>
-#include <regex>
 #include <set>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <tuple>
+#include <type_traits>
 #include <utility>
 #include <variant>
 #include <vector>
 
 namespace retrojsvice {
 
+using std::allocate_shared;
 using std::atomic;
 using std::cerr;
 using std::condition_variable;
+using std::deque;
 using std::enable_shared_from_this;
 using std::exception;
 using std::forward;
@@ -44,6 +50,7 @@ using std::get_if;
 using std::ifstream;
 using std::istream;
 using std::lock_guard;
+using std::lower_bound;
 using std::make_pair;
 using std::make_shared;
 using std::make_unique;
@@ -55,6 +62,7 @@ using std::move;
 using std::mt19937;
 using std::multimap;
 using std::mutex;
+using std::nth_element;
 using std::optional;
 using std::ofstream;
 using std::ostream;
@@ -62,12 +70,10 @@ using std::pair;
 using std::promise;
 using std::queue;
 using std::random_device;
-using std::regex;
-using std::regex_match;
 using std::seed_seq;
 using std::set;
 using std::shared_ptr;
-using std::smatch;
+using std::sort;
 using std::string;
 using std::stringstream;
 using std::swap;
@@ -83,6 +89,7 @@ using std::visit;
 using std::weak_ptr;
 
 using std::chrono::duration_cast;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::chrono::steady_clock;
 
@@ -110,16 +117,29 @@ string toString(const T& obj) {
 
 string sanitizeUTF8String(string str);
 
+// Restricts the calling thread to run on the CPUs with given indices; logs a
+// warning on failure.
+void setCurrentThreadCPUs(const vector<int>& cpus);
+
 // Helper class for defining visitors for variants
 template<class... T> struct Overloaded : T... { using T::operator()...; };
 template<class... T> Overloaded(T...) -> Overloaded<T...>;
 
 // Logging macros that log given message along with log level, source file and
 // line information to stderr. Message is formed by calling toString for each
-// argument and concatenating the results.
-#define INFO_LOG LogWriter(LogLevel::Info, __FILE__, __LINE__)
-#define WARNING_LOG LogWriter(LogLevel::Warning, __FILE__, __LINE__)
-#define ERROR_LOG LogWriter(LogLevel::Error, __FILE__, __LINE__)
+// argument and concatenating the results. Each INFO_LOG and WARNING_LOG call
+// site may log at most LogRateLimiter::Burst messages per
+// LogRateLimiter::Window; the rest are dropped before formatting and counted in
+// the next message from the site. Errors are never dropped.
+#define INFO_LOG LogWriter(LogLevel::Info, __FILE__, __LINE__, LOG_RATE_LIMITER_())
+#define WARNING_LOG LogWriter(LogLevel::Warning, __FILE__, __LINE__, LOG_RATE_LIMITER_())
+#define ERROR_LOG LogWriter(LogLevel::Error, __FILE__, __LINE__, nullptr)
+
+#define LOG_RATE_LIMITER_() \
+    ([]() -> LogRateLimiter* { \
+        static LogRateLimiter limiter; \
+        return &limiter; \
+    }())
 
 enum class LogLevel {
     Info,
@@ -127,20 +147,56 @@ enum class LogLevel {
     Error
 };
 
-class LogWriter {
+class LogRateLimiter {
 public:
-    LogWriter(LogLevel logLevel, const char* file, int line)
-        : LogWriter(logLevel, string(file) + ":" + toString(line))
+    static constexpr uint32_t Burst = 20;
+    static constexpr int64_t Window = 10000;
+
+    LogRateLimiter()
+        : windowStart_(0),
+          windowCount_(0),
+          suppressedCount_(0)
     {}
-    LogWriter(LogLevel logLevel, string location)
+
+    // Returns true if a message may be logged now, in which case
+    // suppressedCount is set to the number of messages dropped since the
+    // previous allowed message. Thread-safe; the limit is approximate under
+    // contention.
+    bool allow(uint64_t& suppressedCount);
+
+private:
+    atomic<int64_t> windowStart_;
+    atomic<uint32_t> windowCount_;
+    atomic<uint64_t> suppressedCount_;
+};
+
+class LogWriter {
+public:
+    LogWriter(
+        LogLevel logLevel,
+        const char* file,
+        int line,
+        LogRateLimiter* rateLimiter
+    )
         : logLevel_(logLevel),
-          location_(move(location))
+          file_(file),
+          line_(line),
+          rateLimiter_(rateLimiter)
     {}
 
     template <typename... T>
     void operator()(const T&... args) {
+        uint64_t suppressedCount = 0;
+        if(rateLimiter_ != nullptr && !rateLimiter_->allow(suppressedCount)) {
+            return;
+        }
         vector<string> argStrs = {toString(args)...};
         string msg;
+        if(suppressedCount) {
+            msg.append(
+                "(" + toString(suppressedCount) + " similar messages suppressed) "
+            );
+        }
         for(const string& argStr : argStrs) {
             msg.append(argStr);
         }
@@ -151,7 +207,9 @@ private:
     void log_(string msg);
 
     LogLevel logLevel_;
-    string location_;
+    const char* file_;
+    int line_;
+    LogRateLimiter* rateLimiter_;
 };
 
 // Panic and assertion macros for ending the program in the case of
@@ -247,6 +305,121 @@ public:
     ClassName& operator=(const ClassName&) = delete; \
     ClassName& operator=(ClassName&&) = delete
 
+// Per-thread free lists of memory blocks of given size, used by PoolAllocator.
+// A block freed in a thread is put to the free list of that thread without
+// locking, and each thread keeps at most MaxFreeBlocks blocks for reuse; the
+// rest are returned to the heap. When a thread exits, its free list is
+// returned to the heap, and the blocks freed after that point in the thread
+// (for example during static destruction) go directly to the heap.
+template <size_t Size>
+class BlockPool {
+public:
+    static constexpr size_t MaxFreeBlocks = 256;
+
+    static void* allocate() {
+        FreeList& list = freeList_;
+        if(list.head != nullptr) {
+            Block* block = list.head;
+            list.head = block->next;
+            --list.count;
+            return block;
+        }
+        return ::operator new(Size);
+    }
+
+    static void deallocate(void* ptr) {
+        FreeList& list = freeList_;
+        if(!list.drainerRegistered) {
+            // Constructing the drainer registers its destructor to be run at
+            // thread exit
+            list.drainerRegistered = true;
+            static thread_local Drainer drainer;
+            (void)drainer;
+        }
+        if(!list.closed && list.count < MaxFreeBlocks) {
+            Block* block = (Block*)ptr;
+            block->next = list.head;
+            list.head = block;
+            ++list.count;
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+private:
+    static_assert(Size >= sizeof(void*));
+
+    struct Block {
+        Block* next;
+    };
+
+    // Trivially destructible so that it can be used at any point of the
+    // lifetime of the thread.
+    struct FreeList {
+        Block* head;
+        size_t count;
+        bool drainerRegistered;
+        bool closed;
+    };
+
+    struct Drainer {
+        ~Drainer() {
+            FreeList& list = freeList_;
+            list.closed = true;
+            while(list.head != nullptr) {
+                Block* block = list.head;
+                list.head = block->next;
+                ::operator delete(block);
+            }
+            list.count = 0;
+        }
+    };
+
+    static thread_local FreeList freeList_;
+};
+
+template <size_t Size>
+thread_local typename BlockPool<Size>::FreeList BlockPool<Size>::freeList_ =
+    {nullptr, 0, false, false};
+
+// Allocator that takes single objects from the BlockPool of their size, used
+// by SHARED_ONLY_POOLED_CLASS to recycle the memory of the objects (along with
+// their shared_ptr control blocks) of frequently created classes.
+template <typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    PoolAllocator() {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        if(count == 1) {
+            return (T*)BlockPool<sizeof(T)>::allocate();
+        }
+        return (T*)::operator new(count * sizeof(T));
+    }
+    void deallocate(T* ptr, size_t count) {
+        if(count == 1) {
+            BlockPool<sizeof(T)>::deallocate(ptr);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const {
+        return false;
+    }
+};
+
 #define SHARED_ONLY_CLASS(ClassName) \
     private: \
         SHARED_ONLY_CLASS_LEAK_CHECK(ClassName) \
@@ -262,6 +435,26 @@ public:
         } \
         DISABLE_COPY_MOVE(ClassName)
 
+// Variant of SHARED_ONLY_CLASS for classes with many short-lived objects: the
+// objects are allocated using PoolAllocator, reusing freed memory blocks
+// instead of going through the heap.
+#define SHARED_ONLY_POOLED_CLASS(ClassName) \
+    private: \
+        SHARED_ONLY_CLASS_LEAK_CHECK(ClassName) \
+        struct CKey {}; \
+        template <typename T> \
+        void afterConstruct_(T) {} \
+    public: \
+        template <typename... T> \
+        static shared_ptr<ClassName> create(T&&... args) { \
+            shared_ptr<ClassName> ret = allocate_shared<ClassName>( \
+                PoolAllocator<ClassName>(), CKey(), forward<T>(args)... \
+            ); \
+            ret->afterConstruct_(ret); \
+            return ret; \
+        } \
+        DISABLE_COPY_MOVE(ClassName)
+
 char* createMallocString(string val);
 
 // We call the thread currently executing a plugin API call related to a context
@@ -0,0 +1,216 @@
+#include "compressor_pool.hpp"
+
+#include "task_queue.hpp"
+
+namespace retrojsvice {
+
+CompressorQueue::CompressorQueue(CKey, shared_ptr<CompressorPool> pool) {
+    pool_ = pool;
+    ready_ = false;
+    priority_ = Normal;
+}
+
+void CompressorQueue::post(function<void()> task, Priority priority) {
+    REQUIRE(priority >= 0 && priority < PriorityCount);
+    pool_->post_(shared_from_this(), move(task), priority);
+}
+
+CompressorPool::CompressorPool(CKey, size_t threadCount, vector<int> cpus) {
+    REQUIRE_API_THREAD();
+    REQUIRE(threadCount >= 1);
+
+    threadCount_ = threadCount;
+    cpus_ = move(cpus);
+    shutdown_ = false;
+
+    // Initialization is completed in afterConstruct_
+}
+
+CompressorPool::~CompressorPool() {
+    REQUIRE(shutdown_);
+}
+
+size_t CompressorPool::threadCount() {
+    return threadCount_;
+}
+
+shared_ptr<CompressorQueue> CompressorPool::createQueue() {
+    return CompressorQueue::create(shared_from_this());
+}
+
+void CompressorPool::parallelFor(size_t count, function<void(size_t)> func) {
+    if(count == 0) {
+        return;
+    }
+    if(count == 1 || threadCount_ == 1) {
+        for(size_t i = 0; i < count; ++i) {
+            func(i);
+        }
+        return;
+    }
+
+    shared_ptr<ParallelJob> job = make_shared<ParallelJob>();
+    job->func = move(func);
+    job->count = count;
+    job->nextIdx = 0;
+    job->doneCount = 0;
+
+    unique_lock<mutex> lock(mutex_);
+    parallelJobs_.push_back(job);
+    cv_.notify_all();
+
+    // Run the calls ourselves until all of them have been started, and then
+    // wait for the calls started by the workers to finish
+    while(job->nextIdx < job->count) {
+        runParallelJobCall_(lock, job);
+    }
+    while(job->doneCount < job->count) {
+        job->doneCv.wait(lock);
+    }
+}
+
+void CompressorPool::shutdown() {
+    REQUIRE_API_THREAD();
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        REQUIRE(!shutdown_);
+        shutdown_ = true;
+    }
+    cv_.notify_all();
+
+    for(thread& t : threads_) {
+        t.join();
+    }
+    threads_.clear();
+
+    // Drop the pending tasks (and thus the reference cycles between the pool
+    // and the queues) in the API thread
+    deque<shared_ptr<CompressorQueue>> readyQueues;
+    {
+        lock_guard<mutex> lock(mutex_);
+        REQUIRE(parallelJobs_.empty());
+        for(deque<shared_ptr<CompressorQueue>>& queues : readyQueues_) {
+            for(shared_ptr<CompressorQueue>& queue : queues) {
+                readyQueues.push_back(move(queue));
+            }
+            queues.clear();
+        }
+    }
+    for(shared_ptr<CompressorQueue>& queue : readyQueues) {
+        deque<function<void()>> tasks;
+        {
+            lock_guard<mutex> lock(mutex_);
+            swap(tasks, queue->tasks_);
+            queue->ready_ = false;
+        }
+    }
+    readyQueues.clear();
+}
+
+void CompressorPool::afterConstruct_(shared_ptr<CompressorPool> self) {
+    shared_ptr<TaskQueue> taskQueue = TaskQueue::getActiveQueue();
+    for(size_t i = 0; i < threadCount_; ++i) {
+        threads_.emplace_back([self, taskQueue]() {
+            if(!self->cpus_.empty()) {
+                setCurrentThreadCPUs(self->cpus_);
+            }
+            ActiveTaskQueueLock activeTaskQueueLock(taskQueue);
+            self->runWorker_();
+        });
+    }
+}
+
+void CompressorPool::post_(
+    shared_ptr<CompressorQueue> queue,
+    function<void()> task,
+    CompressorQueue::Priority priority
+) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        if(shutdown_) {
+            return;
+        }
+        queue->tasks_.push_back(move(task));
+        if(queue->ready_ && queue->priority_ != priority) {
+            // Move the queue to the back of its new priority
+            deque<shared_ptr<CompressorQueue>>& oldQueues =
+                readyQueues_[queue->priority_];
+            auto it = find(oldQueues.begin(), oldQueues.end(), queue);
+            REQUIRE(it != oldQueues.end());
+            oldQueues.erase(it);
+            queue->ready_ = false;
+        }
+        queue->priority_ = priority;
+        if(!queue->ready_) {
+            queue->ready_ = true;
+            readyQueues_[priority].push_back(queue);
+        }
+    }
+    cv_.notify_one();
+}
+
+void CompressorPool::runWorker_() {
+    unique_lock<mutex> lock(mutex_);
+    while(true) {
+        deque<shared_ptr<CompressorQueue>>* readyQueues = nullptr;
+        for(deque<shared_ptr<CompressorQueue>>& queues : readyQueues_) {
+            if(!queues.empty()) {
+                readyQueues = &queues;
+                break;
+            }
+        }
+
+        if(!parallelJobs_.empty()) {
+            runParallelJobCall_(lock, parallelJobs_.front());
+        } else if(shutdown_) {
+            break;
+        } else if(readyQueues != nullptr) {
+            shared_ptr<CompressorQueue> queue = readyQueues->front();
+            readyQueues->pop_front();
+
+            REQUIRE(queue->ready_ && !queue->tasks_.empty());
+            function<void()> task = move(queue->tasks_.front());
+            queue->tasks_.pop_front();
+
+            // Move the queue to the back to give other queues their turn
+            if(queue->tasks_.empty()) {
+                queue->ready_ = false;
+            } else {
+                readyQueues->push_back(queue);
+            }
+
+            lock.unlock();
+            task();
+            task = []() {};
+            lock.lock();
+        } else {
+            cv_.wait(lock);
+        }
+    }
+}
+
+void CompressorPool::runParallelJobCall_(
+    unique_lock<mutex>& lock,
+    shared_ptr<ParallelJob> job
+) {
+    REQUIRE(job->nextIdx < job->count);
+
+    size_t idx = job->nextIdx++;
+    if(job->nextIdx == job->count) {
+        auto it = find(parallelJobs_.begin(), parallelJobs_.end(), job);
+        REQUIRE(it != parallelJobs_.end());
+        parallelJobs_.erase(it);
+    }
+
+    lock.unlock();
+    job->func(idx);
+    lock.lock();
+
+    ++job->doneCount;
+    if(job->doneCount == job->count) {
+        job->doneCv.notify_all();
+    }
+}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+class CompressorPool;
+
+// Queue of tasks to be run in a CompressorPool, created by
+// CompressorPool::createQueue. Typically each window has its own queue.
+class CompressorQueue : public enable_shared_from_this<CompressorQueue> {
+SHARED_ONLY_CLASS(CompressorQueue);
+public:
+    // Use CompressorPool::createQueue to create queues.
+    CompressorQueue(CKey, shared_ptr<CompressorPool> pool);
+
+    // Scheduling priorities: the pending tasks of the Interactive queues are
+    // started before those of the Normal queues, which are started before
+    // those of the Background queues.
+    enum Priority {Interactive, Normal, Background};
+    static constexpr int PriorityCount = 3;
+
+    // Post a task to be run in one of the worker threads of the pool. The tasks
+    // of a single queue are started in the order they were posted; the
+    // priority of the queue is set to the given priority, which applies to all
+    // its pending tasks. May be called from any thread; if the pool has been
+    // shut down, the task is dropped.
+    void post(function<void()> task, Priority priority = Normal);
+
+private:
+    shared_ptr<CompressorPool> pool_;
+
+    // Protected by the mutex of the pool.
+    deque<function<void()>> tasks_;
+    bool ready_;
+    Priority priority_;
+
+    friend class CompressorPool;
+};
+
+// Fixed-size pool of worker threads shared by all the image compressors of a
+// context, bounding the number of threads regardless of the number of windows.
+// The pool is fair between queues of the same priority: the workers take tasks
+// from the queues of the highest priority that have pending tasks in
+// round-robin order. The worker threads have the
+// task queue that was active at construction set as their active task queue,
+// so tasks may use postTask to report their results.
+//
+// If cpus is nonempty, the worker threads are restricted to run on the CPUs
+// with the given indices, keeping image compression off the cores used by the
+// program (such as the browser UI thread).
+//
+// Must be shut down using shutdown() prior to destruction.
+class CompressorPool : public enable_shared_from_this<CompressorPool> {
+SHARED_ONLY_CLASS(CompressorPool);
+public:
+    CompressorPool(CKey, size_t threadCount, vector<int> cpus = {});
+    ~CompressorPool();
+
+    size_t threadCount();
+
+    shared_ptr<CompressorQueue> createQueue();
+
+    // Calls func(i) for all 0 <= i < count in parallel using the worker
+    // threads and returns once all the calls have returned. The calling thread
+    // also takes part in running the calls; thus this function may be safely
+    // called from tasks running in the pool.
+    void parallelFor(size_t count, function<void(size_t)> func);
+
+    // Waits for the running tasks to finish and stops the worker threads.
+    // Pending tasks are dropped.
+    void shutdown();
+
+private:
+    void afterConstruct_(shared_ptr<CompressorPool> self);
+
+    void post_(
+        shared_ptr<CompressorQueue> queue,
+        function<void()> task,
+        CompressorQueue::Priority priority
+    );
+    void runWorker_();
+
+    struct ParallelJob {
+        function<void(size_t)> func;
+        size_t count;
+        size_t nextIdx;
+        size_t doneCount;
+        condition_variable doneCv;
+    };
+
+    // Runs the next call of a job in parallelJobs_; must be called with the
+    // lock held.
+    void runParallelJobCall_(
+        unique_lock<mutex>& lock,
+        shared_ptr<ParallelJob> job
+    );
+
+    size_t threadCount_;
+    vector<int> cpus_;
+    vector<thread> threads_;
+
+    mutex mutex_;
+    condition_variable cv_;
+    bool shutdown_;
+
+    // Queues that have pending tasks for each priority, in the order they
+    // will be served.
+    deque<shared_ptr<CompressorQueue>>
+        readyQueues_[CompressorQueue::PriorityCount];
+
+    // Parallel jobs with calls that have not been started; these take
+    // precedence over queued tasks, as they are part of tasks already running.
+    deque<shared_ptr<ParallelJob>> parallelJobs_;
+
+    friend class CompressorQueue;
+};
+
+}
@@ -1,16 +1,63 @@
 #include "context.hpp"
 
+#include "compressor_pool.hpp"
 #include "download.hpp"
 #include "html.hpp"
 #include "secrets.hpp"
+#include "trace.hpp"
 #include "upload.hpp"
 
+#include <sched.h>
+
 namespace retrojsvice {
 
 namespace {
 
 const string defaultHTTPListenAddr = "127.0.0.1:8080";
-const int defaultHTTPMaxThreads = 100;
+
+const char* AuthCookieName = "retrojsvice_auth";
+const steady_clock::duration AuthCookieLifetime = milliseconds(12 * 3600 * 1000);
+
+// Interval of the memory budget checks (see Context::checkMemoryBudget_).
+const steady_clock::duration MemoryCheckInterval = milliseconds(1000);
+
+int defaultCompressionThreads() {
+    return max((int)thread::hardware_concurrency(), 1);
+}
+
+// Parses a list of CPU indices and ranges such as "2-5,8"; returns an empty
+// optional if the list is invalid.
+optional<vector<int>> parseCPUList(const string& value) {
+    optional<vector<int>> empty;
+    vector<int> cpus;
+    size_t pos = 0;
+    while(pos <= value.size()) {
+        size_t end = value.find(',', pos);
+        if(end == string::npos) {
+            end = value.size();
+        }
+        string item = value.substr(pos, end - pos);
+        size_t dash = item.find('-');
+        optional<int> first = parseString<int>(item.substr(0, dash));
+        optional<int> last = first;
+        if(dash != string::npos) {
+            last = parseString<int>(item.substr(dash + 1));
+        }
+        if(
+            !first.has_value() || !last.has_value() ||
+            *first < 0 || *last < *first || *last >= CPU_SETSIZE
+        ) {
+            return empty;
+        }
+        for(int cpu = *first; cpu <= *last; ++cpu) {
+            if(find(cpus.begin(), cpus.end(), cpu) == cpus.end()) {
+                cpus.push_back(cpu);
+            }
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
 
 set<string> trueValues = {"1", "yes", "true", "enable", "enabled"};
 set<string> falseValues = {"0", "no", "false", "disable", "disabled"};
@@ -85,6 +132,19 @@ string htmlEscapeString(string src) {
     return ret;
 }
 
+// The JPEG encoder backends that can be selected by option jpeg-encoder,
+// separated by commas.
+string jpegEncoderList() {
+    string ret;
+    for(const string& name : jpegBackendNames()) {
+        if(!ret.empty()) {
+            ret += ", ";
+        }
+        ret += name;
+    }
+    return ret;
+}
+
 thread_local bool threadRunningPumpEvents = false;
 
 }
@@ -169,9 +229,20 @@ variant<shared_ptr<Context>, string> Context::init(
     int defaultQuality = 101;
     SocketAddress httpListenAddr =
         SocketAddress::parse(defaultHTTPListenAddr).value();
-    int httpMaxThreads = defaultHTTPMaxThreads;
+    HTTPServerOptions httpServerOptions;
     string httpAuthCredentials;
+    bool httpAuthCookie = false;
     bool allowQualitySelector = true;
+    int compressionThreads = defaultCompressionThreads();
+    vector<int> compressionCPUs;
+    ImageCompressorOptions compressorOptions;
+    int frameCacheSize = 64;
+    bool enableStats = false;
+    bool imageStream = false;
+    int memoryBudget = 0;
+    int downloadMemoryMaxFile = 1024;
+    int downloadMemory = 64;
+    string jpegEncoder = "auto";
 
     for(const pair<string, string>& option : options) {
         const string& name = option.first;
@@ -184,6 +255,8 @@ variant<shared_ptr<Context>, string> Context::init(
             }
             if(lowValue == "png") {
                 defaultQuality = 101;
+            } else if(lowValue == "auto") {
+                defaultQuality = ImageCompressor::AutoQuality;
             } else {
                 optional<int> parsed = parseString<int>(value);
                 if(!parsed.has_value() || *parsed < 10 || *parsed > 100) {
@@ -197,12 +270,48 @@ variant<shared_ptr<Context>, string> Context::init(
                 return "Invalid value '" + value + "' for option http-listen-addr";
             }
             httpListenAddr = *parsed;
+        } else if(name == "http-server-mode") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "threaded") {
+                httpServerOptions.eventDriven = false;
+            } else if(lowValue == "event") {
+                httpServerOptions.eventDriven = true;
+            } else {
+                return "Invalid value '" + value + "' for option http-server-mode";
+            }
         } else if(name == "http-max-threads") {
             optional<int> parsed = parseString<int>(value);
             if(!parsed.has_value() || *parsed <= 0) {
                 return "Invalid value '" + value + "' for option http-max-threads";
             }
-            httpMaxThreads = *parsed;
+            httpServerOptions.maxThreads = *parsed;
+        } else if(name == "http-keep-alive-timeout") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0 || *parsed > 3600) {
+                return "Invalid value '" + value + "' for option http-keep-alive-timeout";
+            }
+            httpServerOptions.keepAliveTimeout = milliseconds(1000 * *parsed);
+        } else if(name == "http-max-keep-alive-requests") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0) {
+                return "Invalid value '" + value + "' for option http-max-keep-alive-requests";
+            }
+            httpServerOptions.maxKeepAliveRequests = *parsed;
+        } else if(name == "http-max-upload-size") {
+            optional<uint64_t> parsed = parseString<uint64_t>(value);
+            if(!parsed.has_value() || *parsed > ((uint64_t)1 << 40)) {
+                return "Invalid value '" + value + "' for option http-max-upload-size";
+            }
+            httpServerOptions.maxUploadSize = *parsed << 20;
+        } else if(name == "http-cpus") {
+            optional<vector<int>> parsed = parseCPUList(value);
+            if(!parsed.has_value()) {
+                return "Invalid value '" + value + "' for option http-cpus";
+            }
+            httpServerOptions.cpus = move(*parsed);
         } else if(name == "http-auth") {
             pair<bool, string> result = parseHTTPAuthOption(value);
             if(result.first) {
@@ -210,6 +319,18 @@ variant<shared_ptr<Context>, string> Context::init(
             } else {
                 return result.second;
             }
+        } else if(name == "http-auth-cookie") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(trueValues.count(lowValue)) {
+                httpAuthCookie = true;
+            } else if(falseValues.count(lowValue)) {
+                httpAuthCookie = false;
+            } else {
+                return "Invalid value '" + value + "' for option http-auth-cookie";
+            }
         } else if(name == "quality-selector") {
             string lowValue = value;
             for(char& c : lowValue) {
@@ -222,18 +343,331 @@ variant<shared_ptr<Context>, string> Context::init(
             } else {
                 return "Invalid value '" + value + "' for option quality-selector";
             }
+        } else if(name == "compression-threads") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed <= 0 || *parsed > 1024) {
+                return "Invalid value '" + value + "' for option compression-threads";
+            }
+            compressionThreads = *parsed;
+        } else if(name == "compression-cpus") {
+            optional<vector<int>> parsed = parseCPUList(value);
+            if(!parsed.has_value()) {
+                return "Invalid value '" + value + "' for option compression-cpus";
+            }
+            compressionCPUs = move(*parsed);
+        } else if(name == "png-filter") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "paeth") {
+                compressorOptions.png.adaptiveFilter = false;
+            } else if(lowValue == "adaptive") {
+                compressorOptions.png.adaptiveFilter = true;
+            } else {
+                return "Invalid value '" + value + "' for option png-filter";
+            }
+        } else if(name == "png-compression-level") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 1 || *parsed > 9) {
+                return "Invalid value '" + value + "' for option png-compression-level";
+            }
+            compressorOptions.png.compressionLevel = *parsed;
+        } else if(name == "png-palette") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(trueValues.count(lowValue)) {
+                compressorOptions.png.palette = true;
+            } else if(falseValues.count(lowValue)) {
+                compressorOptions.png.palette = false;
+            } else {
+                return "Invalid value '" + value + "' for option png-palette";
+            }
+        } else if(name == "hybrid-encoding") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(trueValues.count(lowValue)) {
+                compressorOptions.hybrid = true;
+            } else if(falseValues.count(lowValue)) {
+                compressorOptions.hybrid = false;
+            } else {
+                return "Invalid value '" + value + "' for option hybrid-encoding";
+            }
+        } else if(name == "jpeg-progressive") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "never") {
+                compressorOptions.progressiveJPEG =
+                    ImageCompressorOptions::ProgressiveNever;
+            } else if(lowValue == "auto") {
+                compressorOptions.progressiveJPEG =
+                    ImageCompressorOptions::ProgressiveAuto;
+            } else if(lowValue == "always") {
+                compressorOptions.progressiveJPEG =
+                    ImageCompressorOptions::ProgressiveAlways;
+            } else {
+                return "Invalid value '" + value + "' for option jpeg-progressive";
+            }
+        } else if(name == "jpeg-subsampling") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            compressorOptions.jpegAutoSubsampling = false;
+            if(lowValue == "444") {
+                compressorOptions.jpeg.subsampling =
+                    JPEGOptions::Subsampling444;
+            } else if(lowValue == "422") {
+                compressorOptions.jpeg.subsampling =
+                    JPEGOptions::Subsampling422;
+            } else if(lowValue == "420") {
+                compressorOptions.jpeg.subsampling =
+                    JPEGOptions::Subsampling420;
+            } else if(lowValue == "auto") {
+                compressorOptions.jpegAutoSubsampling = true;
+            } else {
+                return "Invalid value '" + value + "' for option jpeg-subsampling";
+            }
+        } else if(name == "jpeg-dct") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "auto") {
+                compressorOptions.jpeg.dctMethod = JPEGOptions::DCTAuto;
+            } else if(lowValue == "fast") {
+                compressorOptions.jpeg.dctMethod = JPEGOptions::DCTFast;
+            } else if(lowValue == "accurate") {
+                compressorOptions.jpeg.dctMethod = JPEGOptions::DCTAccurate;
+            } else {
+                return "Invalid value '" + value + "' for option jpeg-dct";
+            }
+        } else if(name == "jpeg-optimize-coding") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(trueValues.count(lowValue)) {
+                compressorOptions.jpeg.optimizeCoding = true;
+            } else if(falseValues.count(lowValue)) {
+                compressorOptions.jpeg.optimizeCoding = false;
+            } else {
+                return "Invalid value '" + value + "' for option jpeg-optimize-coding";
+            }
+        } else if(name == "jpeg-tables") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "standard") {
+                compressorOptions.jpeg.screenTables = false;
+            } else if(lowValue == "screen") {
+                compressorOptions.jpeg.screenTables = true;
+            } else {
+                return "Invalid value '" + value + "' for option jpeg-tables";
+            }
+        } else if(name == "jpeg-encoder") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            bool found = lowValue == "auto";
+            for(const string& backendName : jpegBackendNames()) {
+                found = found || lowValue == backendName;
+            }
+            if(!found) {
+                return "Invalid value '" + value + "' for option jpeg-encoder";
+            }
+            jpegEncoder = lowValue;
+        } else if(name == "frame-cache-size") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0 || *parsed > 65536) {
+                return "Invalid value '" + value + "' for option frame-cache-size";
+            }
+            frameCacheSize = *parsed;
+        } else if(name == "compression-mode") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "eager") {
+                compressorOptions.demandDriven = false;
+            } else if(lowValue == "demand") {
+                compressorOptions.demandDriven = true;
+            } else {
+                return "Invalid value '" + value + "' for option compression-mode";
+            }
+        } else if(name == "interaction-quality") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "off") {
+                compressorOptions.interactionQuality = 0;
+            } else {
+                optional<int> parsed = parseString<int>(value);
+                if(!parsed.has_value() || *parsed < 10 || *parsed > 100) {
+                    return "Invalid value '" + value + "' for option interaction-quality";
+                }
+                compressorOptions.interactionQuality = *parsed;
+            }
+        } else if(name == "stats") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(trueValues.count(lowValue)) {
+                enableStats = true;
+            } else if(falseValues.count(lowValue)) {
+                enableStats = false;
+            } else {
+                return "Invalid value '" + value + "' for option stats";
+            }
+        } else if(name == "image-stream") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(trueValues.count(lowValue)) {
+                imageStream = true;
+            } else if(falseValues.count(lowValue)) {
+                imageStream = false;
+            } else {
+                return "Invalid value '" + value + "' for option image-stream";
+            }
+        } else if(name == "image-pipeline-depth") {
+            optional<int> parsed = parseString<int>(value);
+            if(
+                !parsed.has_value() ||
+                *parsed < 1 ||
+                *parsed > (int)ImageCompressorOptions::MaxPipelineDepth
+            ) {
+                return "Invalid value '" + value + "' for option image-pipeline-depth";
+            }
+            compressorOptions.pipelineDepth = (size_t)*parsed;
+        } else if(name == "compression-depth") {
+            optional<int> parsed = parseString<int>(value);
+            if(
+                !parsed.has_value() ||
+                *parsed < 1 ||
+                *parsed > (int)ImageCompressorOptions::MaxCompressionDepth
+            ) {
+                return "Invalid value '" + value + "' for option compression-depth";
+            }
+            compressorOptions.compressionDepth = (size_t)*parsed;
+        } else if(name == "window-fps-budget") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0) {
+                return "Invalid value '" + value + "' for option window-fps-budget";
+            }
+            compressorOptions.budgetFPS = *parsed;
+        } else if(name == "window-bandwidth-budget") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0) {
+                return "Invalid value '" + value + "' for option window-bandwidth-budget";
+            }
+            compressorOptions.budgetBytesPerSecond = (uint64_t)*parsed << 10;
+        } else if(name == "window-cpu-budget") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0) {
+                return "Invalid value '" + value + "' for option window-cpu-budget";
+            }
+            compressorOptions.budgetCompressionMsPerSecond = *parsed;
+        } else if(name == "memory-budget") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0 || *parsed > 1048576) {
+                return "Invalid value '" + value + "' for option memory-budget";
+            }
+            memoryBudget = *parsed;
+        } else if(name == "download-memory-max-file") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0 || *parsed > 1048576) {
+                return "Invalid value '" + value + "' for option download-memory-max-file";
+            }
+            downloadMemoryMaxFile = *parsed;
+        } else if(name == "download-memory") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0 || *parsed > 65536) {
+                return "Invalid value '" + value + "' for option download-memory";
+            }
+            downloadMemory = *parsed;
+        } else if(name == "tile-caching") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "off") {
+                compressorOptions.tileCaching = ImageCompressorOptions::TileCachingOff;
+            } else if(lowValue == "private") {
+                compressorOptions.tileCaching = ImageCompressorOptions::TileCachingPrivate;
+            } else if(lowValue == "public") {
+                compressorOptions.tileCaching = ImageCompressorOptions::TileCachingPublic;
+            } else {
+                return "Invalid value '" + value + "' for option tile-caching";
+            }
+        } else if(name == "video-quality") {
+            string lowValue = value;
+            for(char& c : lowValue) {
+                c = tolower(c);
+            }
+            if(lowValue == "off") {
+                compressorOptions.videoQuality = 0;
+            } else {
+                optional<int> parsed = parseString<int>(value);
+                if(!parsed.has_value() || *parsed < 10 || *parsed > 100) {
+                    return "Invalid value '" + value + "' for option video-quality";
+                }
+                compressorOptions.videoQuality = *parsed;
+            }
+        } else if(name == "video-fps") {
+            optional<int> parsed = parseString<int>(value);
+            if(!parsed.has_value() || *parsed < 0) {
+                return "Invalid value '" + value + "' for option video-fps";
+            }
+            compressorOptions.videoFPS = *parsed;
         } else {
             return "Unrecognized option '" + name + "'";
         }
     }
 
+    if(!selectJPEGBackend(jpegEncoder)) {
+        return "JPEG encoder '" + jpegEncoder + "' is not available";
+    }
+
+    if(frameCacheSize != 0) {
+        compressorOptions.frameCache =
+            FrameCache::create((uint64_t)frameCacheSize << 20);
+    }
+
+    shared_ptr<DownloadMemory> downloadMemoryPtr;
+    if(downloadMemoryMaxFile != 0 && downloadMemory != 0) {
+        downloadMemoryPtr = DownloadMemory::create(
+            (uint64_t)downloadMemoryMaxFile << 10,
+            (uint64_t)downloadMemory << 20
+        );
+    }
+
     return Context::create(
         CKey(),
         defaultQuality,
         httpListenAddr,
-        httpMaxThreads,
+        httpServerOptions,
         httpAuthCredentials,
+        httpAuthCookie,
         allowQualitySelector,
+        compressionThreads,
+        compressionCPUs,
+        compressorOptions,
+        enableStats,
+        imageStream,
+        (uint64_t)memoryBudget << 20,
+        downloadMemoryPtr,
         programName
     );
 }
@@ -241,21 +675,40 @@ variant<shared_ptr<Context>, string> Context::init(
 Context::Context(CKey, CKey,
     int defaultQuality,
     SocketAddress httpListenAddr,
-    int httpMaxThreads,
+    HTTPServerOptions httpServerOptions,
     string httpAuthCredentials,
+    bool httpAuthCookie,
     bool allowQualitySelector,
+    int compressionThreads,
+    vector<int> compressionCPUs,
+    ImageCompressorOptions compressorOptions,
+    bool enableStats,
+    bool imageStream,
+    uint64_t memoryBudgetBytes,
+    shared_ptr<DownloadMemory> downloadMemory,
     string programName
-)
-    : httpListenAddr_(httpListenAddr)
-{
+) {
     INFO_LOG("Creating retrojsvice plugin context");
+    INFO_LOG("Using JPEG encoder ", selectedJPEGBackendName());
+
+    httpListenSocket_ = HTTPListenSocket::create(httpListenAddr);
 
     defaultQuality_ = defaultQuality;
-    httpMaxThreads_ = httpMaxThreads;
+    httpServerOptions_ = httpServerOptions;
     httpAuthCredentials_ = httpAuthCredentials;
+    httpAuthCookie_ = httpAuthCookie;
     allowQualitySelector_ = allowQualitySelector;
+    compressionThreads_ = compressionThreads;
+    compressionCPUs_ = compressionCPUs;
+    compressorOptions_ = compressorOptions;
+    enableStats_ = enableStats;
+    imageStream_ = imageStream;
+    memoryBudgetBytes_ = memoryBudgetBytes;
+    downloadMemory_ = downloadMemory;
     programName_ = sanitizeProgramName(programName);
 
+    memoryBudgetShrinks_ = 0;
+
     state_ = Pending;
     shutdownPhase_ = NoPendingShutdown;
     inAPICall_.store(false);
@@ -284,6 +737,58 @@ void Context::URINavigation_enable(VicePluginAPI_URINavigation_Callbacks callbac
     uriNavigationCallbacks_ = callbacks;
 }
 
+void Context::SharedFrame_enable(VicePluginAPI_SharedFrame_Callbacks callbacks) {
+    APILock apiLock(this);
+
+    REQUIRE(state_ == Pending);
+
+    REQUIRE(!sharedFrameCallbacks_.has_value());
+    sharedFrameCallbacks_ = callbacks;
+}
+
+void Context::InputBatch_enable(VicePluginAPI_InputBatch_Callbacks callbacks) {
+    APILock apiLock(this);
+
+    REQUIRE(state_ == Pending);
+
+    REQUIRE(!inputBatchCallbacks_.has_value());
+    inputBatchCallbacks_ = callbacks;
+}
+
+void Context::WindowVisibility_enable(
+    VicePluginAPI_WindowVisibility_Callbacks callbacks
+) {
+    APILock apiLock(this);
+
+    REQUIRE(state_ == Pending);
+
+    REQUIRE(!windowVisibilityCallbacks_.has_value());
+    windowVisibilityCallbacks_ = callbacks;
+}
+
+void Context::Trace_enable(VicePluginAPI_Trace_Callbacks callbacks) {
+    APILock apiLock(this);
+
+    REQUIRE(state_ == Pending);
+
+    REQUIRE(!traceCallbacks_.has_value());
+    traceCallbacks_ = callbacks;
+}
+
+void Context::Trace_windowViewTraced(uint64_t window, uint64_t traceId) {
+    RunningAPILock apiLock(this);
+    REQUIRE(!threadRunningPumpEvents);
+
+    windowManager_->traceView(window, traceId);
+}
+
+void Context::MediaState_setWindowMediaPlaying(uint64_t window, int playing) {
+    RunningAPILock apiLock(this);
+    REQUIRE(!threadRunningPumpEvents);
+
+    windowManager_->setMediaPlaying(window, playing != 0);
+}
+
 void Context::start(
     VicePluginAPI_Callbacks callbacks,
     void* callbackData
@@ -303,6 +808,20 @@ void Context::start(
     callbacks_ = callbacks;
     callbackData_ = callbackData;
 
+    if(traceCallbacks_.has_value()) {
+        REQUIRE(traceCallbacks_->traceEvent != nullptr);
+        void (*traceEvent)(void*, uint64_t, uint64_t, const char*, const char*) =
+            traceCallbacks_->traceEvent;
+        setTraceCallback([traceEvent, callbackData](
+            uint64_t window,
+            uint64_t traceId,
+            const char* stage,
+            const char* details
+        ) {
+            traceEvent(callbackData, window, traceId, stage, details);
+        });
+    }
+
     state_ = Running;
     taskQueue_ = TaskQueue::create(shared_from_this());
 
@@ -310,15 +829,33 @@ void Context::start(
 
     httpServer_ = HTTPServer::create(
         shared_from_this(),
-        httpListenAddr_,
-        httpMaxThreads_
+        httpListenSocket_,
+        httpServerOptions_
     );
     secretGen_ = SecretGenerator::create();
+    if(httpAuthCookie_ && !httpAuthCredentials_.empty()) {
+        authTokenSigner_ = SessionTokenSigner::create(
+            secretGen_->generateHMACKey(), AuthCookieLifetime
+        );
+    }
+    compressorPool_ = CompressorPool::create(
+        (size_t)compressionThreads_, compressionCPUs_
+    );
     windowManager_ = WindowManager::create(
-        shared_from_this(), secretGen_, programName_, defaultQuality_
+        shared_from_this(),
+        secretGen_,
+        compressorPool_,
+        compressorOptions_,
+        programName_,
+        defaultQuality_,
+        imageStream_ && !httpServerOptions_.eventDriven
     );
 
     clipboardCSRFToken_ = secretGen_->generateCSRFToken();
+
+    if(memoryBudgetBytes_ != 0) {
+        scheduleMemoryCheck_();
+    }
 }
 
 void Context::shutdown() {
@@ -332,6 +869,7 @@ void Context::shutdown() {
         clipboardTimeout_->expedite();
         clipboardTimeout_.reset();
     }
+    memoryCheckTag_.reset();
 
     INFO_LOG("Shutting down plugin");
 
@@ -397,6 +935,33 @@ void Context::notifyWindowViewChanged(uint64_t window) {
     windowManager_->notifyViewChanged(window);
 }
 
+void Context::DirtyRect_notifyWindowViewChanged(
+    uint64_t window,
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height
+) {
+    RunningAPILock apiLock(this);
+    REQUIRE(!threadRunningPumpEvents);
+
+    // Images are never larger than 16384x16384, so we can clamp the
+    // coordinates to avoid overflows
+    const size_t Limit = 16384;
+    x = min(x, Limit);
+    y = min(y, Limit);
+    width = min(width, Limit);
+    height = min(height, Limit);
+
+    Rect dirtyRect(
+        (int)x,
+        (int)min(x + width, Limit),
+        (int)y,
+        (int)min(y + height, Limit)
+    );
+    windowManager_->notifyViewChanged(window, dirtyRect);
+}
+
 void Context::setWindowCursor(
     uint64_t window,
     VicePluginAPI_MouseCursor cursor
@@ -513,7 +1078,7 @@ void Context::putFileDownload(
         cleanup(cleanupData);
     };
     shared_ptr<FileDownload> file =
-        FileDownload::create(name, path, cleanupFunc);
+        FileDownload::create(name, path, cleanupFunc, downloadMemory_);
 
     windowManager_->putFileDownload(window, file);
 }
@@ -538,7 +1103,9 @@ vector<tuple<string, string, string, string>> Context::getOptionDocs() {
     ret.emplace_back(
         "default-quality",
         "QUALITY",
-        "initial image quality for each window (10..100 or PNG)",
+        "initial image quality for each window (10..100, PNG or AUTO); "
+        "AUTO adjusts the quality continuously based on how fast the client "
+        "receives the images",
         "default: PNG"
     );
     ret.emplace_back(
@@ -547,11 +1114,51 @@ vector<tuple<string, string, string, string>> Context::getOptionDocs() {
         "bind address and port for the HTTP server",
         "default: " + defaultHTTPListenAddr
     );
+    ret.emplace_back(
+        "http-server-mode",
+        "MODE",
+        "HTTP server implementation: THREADED serves each request in its own "
+        "thread; EVENT serves all connections in a single thread without "
+        "blocking threads for requests waiting for new images, but buffers "
+        "request and response bodies other than uploads and downloads in "
+        "memory",
+        "default: THREADED"
+    );
     ret.emplace_back(
         "http-max-threads",
         "COUNT",
-        "maximum number of HTTP server threads",
-        "default: " + toString(defaultHTTPMaxThreads)
+        "maximum number of HTTP server threads in THREADED mode",
+        "default: " + toString(HTTPServerOptions().maxThreads)
+    );
+    ret.emplace_back(
+        "http-keep-alive-timeout",
+        "SECONDS",
+        "time after which idle persistent HTTP connections are closed; 0 "
+        "disables persistent connections",
+        "default: " + toString(duration_cast<milliseconds>(
+            HTTPServerOptions().keepAliveTimeout
+        ).count() / 1000)
+    );
+    ret.emplace_back(
+        "http-max-keep-alive-requests",
+        "COUNT",
+        "maximum number of HTTP requests served over a single connection "
+        "(0 for unlimited)",
+        "default: " + toString(HTTPServerOptions().maxKeepAliveRequests)
+    );
+    ret.emplace_back(
+        "http-max-upload-size",
+        "MEGABYTES",
+        "maximum total size of the files uploaded in a single request (0 for "
+        "unlimited)",
+        "default: 0"
+    );
+    ret.emplace_back(
+        "http-cpus",
+        "LIST",
+        "comma-separated list of CPU indices and ranges (such as '2-5,8') "
+        "that the HTTP server threads are restricted to",
+        "default: no restriction"
     );
     ret.emplace_back(
         "http-auth",
@@ -563,12 +1170,259 @@ vector<tuple<string, string, string, string>> Context::getOptionDocs() {
         "HTTP_AUTH_CREDENTIALS",
         "default empty"
     );
+    ret.emplace_back(
+        "http-auth-cookie",
+        "YES/NO",
+        "after a successful HTTP basic authentication, give the client a "
+        "signed session cookie that is checked instead of the credentials "
+        "in the subsequent requests; the cookies expire after 12 hours "
+        "and when the plugin is restarted",
+        "default: no"
+    );
     ret.emplace_back(
         "quality-selector",
         "YES/NO",
         "make image quality adjustable using a quality selector widget",
         "default: yes"
     );
+    ret.emplace_back(
+        "compression-threads",
+        "COUNT",
+        "number of threads used for compressing images, shared by all "
+        "windows",
+        "default: number of CPU cores"
+    );
+    ret.emplace_back(
+        "compression-cpus",
+        "LIST",
+        "comma-separated list of CPU indices and ranges (such as '2-5,8') "
+        "that the compression threads are restricted to, to keep them from "
+        "competing with the program for CPU time",
+        "default: no restriction"
+    );
+    ret.emplace_back(
+        "png-filter",
+        "PAETH/ADAPTIVE",
+        "line filter for PNG images: 'paeth' filters all lines with Paeth, "
+        "'adaptive' chooses the filter with the smallest estimated cost for "
+        "each line (smaller images but slower compression)",
+        "default: paeth"
+    );
+    ret.emplace_back(
+        "png-compression-level",
+        "LEVEL",
+        "deflate compression level for PNG images (1..9); level 1 is the "
+        "fastest, higher levels produce smaller images using more CPU time",
+        "default: 1"
+    );
+    ret.emplace_back(
+        "png-palette",
+        "YES/NO",
+        "encode PNG images with at most 256 distinct colors (typically "
+        "text-heavy pages) losslessly as indexed-color images, which are "
+        "considerably smaller than RGB images",
+        "default: yes"
+    );
+    ret.emplace_back(
+        "hybrid-encoding",
+        "YES/NO",
+        "with a JPEG quality selected, send images with at most 256 distinct "
+        "colors (typically text and UI; with tile clients, also the changed "
+        "regions of pages with photos) as lossless PNG images and the other "
+        "images as JPEG",
+        "default: no"
+    );
+    ret.emplace_back(
+        "jpeg-progressive",
+        "MODE",
+        "when to send large JPEG images as progressive JPEGs, which the "
+        "browser shows as a coarse image first while the rest is received: "
+        "NEVER, ALWAYS, or AUTO for only while the automatic quality mode has "
+        "lowered the quality to 40 or below due to a slow connection. "
+        "Progressive images are compressed in a single thread",
+        "default: NEVER"
+    );
+    ret.emplace_back(
+        "jpeg-subsampling",
+        "MODE",
+        "chroma subsampling of JPEG images: 444 (full color resolution, keeps "
+        "colored text readable), 422, 420 (smallest images), or AUTO for "
+        "choosing it by the quality selected for the window: 444 at 80 and "
+        "above, 422 at 50..79 and 420 below",
+        "default: 420"
+    );
+    ret.emplace_back(
+        "jpeg-dct",
+        "MODE",
+        "DCT used for JPEG images: FAST, ACCURATE, or AUTO for FAST at "
+        "quality 90 and below and ACCURATE above",
+        "default: AUTO"
+    );
+    ret.emplace_back(
+        "jpeg-optimize-coding",
+        "YES/NO",
+        "optimize the Huffman tables of each JPEG image, making it a few "
+        "percent smaller; such images are compressed in a single thread",
+        "default: no"
+    );
+    ret.emplace_back(
+        "jpeg-tables",
+        "TABLES",
+        "quantization tables of JPEG images: STANDARD (tuned for photos) or "
+        "SCREEN (flatter tables that keep text and UI edges and colors "
+        "sharper at the same quality, producing larger images)",
+        "default: STANDARD"
+    );
+    ret.emplace_back(
+        "jpeg-encoder",
+        "ENCODER",
+        "JPEG encoder backend: AUTO (the first available backend) or one of: " +
+        jpegEncoderList(),
+        "default: AUTO"
+    );
+    ret.emplace_back(
+        "frame-cache-size",
+        "MEGABYTES",
+        "memory budget of the cache of compressed images shared by all "
+        "windows, which avoids compressing identical frames (such as the same "
+        "start page shown in many windows) again; 0 disables the cache",
+        "default: 64"
+    );
+    ret.emplace_back(
+        "compression-mode",
+        "MODE",
+        "when to compress the next frame of a window: EAGER starts as soon as "
+        "the previous image has been sent, DEMAND only when the client is "
+        "waiting for an image or is expected to poll for one soon, which "
+        "saves CPU time on windows with slow or absent clients",
+        "default: EAGER"
+    );
+    ret.emplace_back(
+        "interaction-quality",
+        "QUALITY",
+        "JPEG quality (10..100) used while the user is interacting with a "
+        "window if it is lower than the selected quality, making the frames "
+        "faster to compress and transfer; once the input has been quiet for "
+        "a moment, the window is refined with a frame at the selected "
+        "quality. OFF disables the feature",
+        "default: OFF"
+    );
+    ret.emplace_back(
+        "stats",
+        "YES/NO",
+        "serve per-window performance statistics in the Prometheus text "
+        "format at the path /stats/ (protected by http-auth like the other "
+        "paths)",
+        "default: no"
+    );
+    ret.emplace_back(
+        "image-stream",
+        "YES/NO",
+        "push the images to capable clients through a single long-lived "
+        "multipart/x-mixed-replace response instead of a request per image, "
+        "falling back to polling if the client cannot show it; each stream "
+        "occupies an HTTP server thread, and the option is ignored if "
+        "http-server-mode is EVENT",
+        "default: no"
+    );
+    ret.emplace_back(
+        "image-pipeline-depth",
+        "DEPTH",
+        "number of image requests (1..8) a client that does not use the "
+        "image stream keeps in flight at a time, each answered with the next "
+        "new frame, such that the frame rate on slow links is not limited by "
+        "the round-trip time; 1 disables pipelining",
+        "default: 1"
+    );
+    ret.emplace_back(
+        "compression-depth",
+        "DEPTH",
+        "number of frames (1..4) of each window that may be compressed or "
+        "waiting to be sent at a time; above 1, the next frame is compressed "
+        "in parallel while the previous one is still being compressed or "
+        "sent, which raises the frame rate at the cost of compressing frames "
+        "that are dropped when a newer one is ready first (tile clients "
+        "always use 1)",
+        "default: 1"
+    );
+    ret.emplace_back(
+        "window-fps-budget",
+        "FPS",
+        "maximum number of frames compressed per second for each window; a "
+        "window over any of its budgets gets fewer frames and yields the "
+        "compression threads to the other windows; 0 for no limit",
+        "default: 0"
+    );
+    ret.emplace_back(
+        "window-bandwidth-budget",
+        "KIB_PER_SECOND",
+        "maximum rate of image data sent to the client of each window in "
+        "KiB per second, enforced by lowering the quality and frame rate of "
+        "the window; 0 for no limit",
+        "default: 0"
+    );
+    ret.emplace_back(
+        "window-cpu-budget",
+        "MS_PER_SECOND",
+        "maximum compression time in milliseconds per second for each window; "
+        "0 for no limit",
+        "default: 0"
+    );
+    ret.emplace_back(
+        "memory-budget",
+        "MIB",
+        "maximum memory in MiB held by the image buffers of all the windows "
+        "and the frame cache (checked once per second); when it is exceeded, "
+        "the frame cache is shrunk and then the windows that no client is "
+        "polling release their buffers; 0 for no limit",
+        "default: 0"
+    );
+    ret.emplace_back(
+        "download-memory-max-file",
+        "KIB",
+        "downloaded files of at most this many KiB are read to memory and "
+        "served from there, and their temporary files are removed right "
+        "away; 0 serves all downloads from their files",
+        "default: 1024"
+    );
+    ret.emplace_back(
+        "download-memory",
+        "MIB",
+        "maximum total memory in MiB held by the downloads kept in memory "
+        "(see download-memory-max-file); downloads that do not fit are "
+        "served from their files",
+        "default: 64"
+    );
+    ret.emplace_back(
+        "tile-caching",
+        "OFF/PRIVATE/PUBLIC",
+        "send the images of tile clients (other than small ones) as "
+        "redirects to URLs derived from their content, served with long-lived "
+        "cache headers so that recurring content is loaded from the HTTP "
+        "cache instead; PRIVATE only allows the browser of the client to "
+        "cache them, PUBLIC also shared proxy caches (the URLs contain the "
+        "secret CSRF token of the window); each image then takes an extra "
+        "round trip",
+        "default: OFF"
+    );
+    ret.emplace_back(
+        "video-quality",
+        "QUALITY",
+        "JPEG quality (10..100) used for a window while the browser reports "
+        "that it is playing media such as a video, if it is lower than the "
+        "selected quality (PNG is also replaced by it); once playback stops, "
+        "the window is refined with a frame at the selected quality. OFF "
+        "disables the feature",
+        "default: 50"
+    );
+    ret.emplace_back(
+        "video-fps",
+        "FPS",
+        "maximum number of frames compressed per second for a window while "
+        "the browser reports that it is playing media, applied like "
+        "window-fps-budget; 0 for no limit",
+        "default: 15"
+    );
 
     return ret;
 }
@@ -578,8 +1432,20 @@ void Context::onHTTPServerRequest(shared_ptr<HTTPRequest> request) {
     REQUIRE(state_ == Running);
 
     if(!httpAuthCredentials_.empty()) {
-        optional<string> reqCred = request->getBasicAuthCredentials();
-        if(!reqCred || !passwordsEqual(*reqCred, httpAuthCredentials_)) {
+        bool issueCookie;
+        bool authorized = isAuthorized_(
+            request->getCookie(AuthCookieName),
+            [&]() { return request->getBasicAuthCredentials(); },
+            issueCookie
+        );
+        if(issueCookie) {
+            request->addResponseHeader(
+                "Set-Cookie",
+                string(AuthCookieName) + "=" + authTokenSigner_->issue() +
+                "; Path=/; HttpOnly"
+            );
+        }
+        if(!authorized) {
             request->sendTextResponse(
                 401,
                 "Unauthorized",
@@ -600,11 +1466,61 @@ void Context::onHTTPServerRequest(shared_ptr<HTTPRequest> request) {
 
     if(request->path() == "/clipboard/") {
         handleClipboardHTTPRequest_(mce, request);
+    } else if(enableStats_ && request->path() == "/stats/") {
+        handleStatsHTTPRequest_(request);
     } else {
         windowManager_->handleHTTPRequest(mce, request);
     }
 }
 
+void Context::onHTTPServerUploadProgress(
+    shared_ptr<HTTPUploadProgress> progress
+) {
+    REQUIRE_API_THREAD();
+    REQUIRE(state_ == Running);
+
+    if(!httpAuthCredentials_.empty()) {
+        // The cookie is only issued in the response to the request
+        bool issueCookie;
+        if(!isAuthorized_(
+            progress->getCookie(AuthCookieName),
+            [&]() { return progress->getBasicAuthCredentials(); },
+            issueCookie
+        )) {
+            return;
+        }
+    }
+
+    if(shutdownPhase_ != NoPendingShutdown) {
+        progress->cancel();
+        return;
+    }
+
+    windowManager_->handleUploadProgress(progress);
+}
+
+bool Context::isAuthorized_(
+    optional<string> cookie,
+    function<optional<string>()> getCredentials,
+    bool& issueCookie
+) {
+    steady_clock::time_point start = steady_clock::now();
+
+    issueCookie = false;
+    bool authorized = false;
+    if(authTokenSigner_ && cookie.has_value()) {
+        authorized = authTokenSigner_->verify(*cookie);
+    }
+    if(!authorized) {
+        optional<string> reqCred = getCredentials();
+        authorized = reqCred && passwordsEqual(*reqCred, httpAuthCredentials_);
+        issueCookie = authorized && authTokenSigner_;
+    }
+
+    authCheckTime_.add(steady_clock::now() - start);
+    return authorized;
+}
+
 void Context::onHTTPServerShutdownComplete() {
     REQUIRE_API_THREAD();
     REQUIRE(state_ == Running);
@@ -612,6 +1528,12 @@ void Context::onHTTPServerShutdownComplete() {
 
     shutdownPhase_ = WaitTaskQueue;
 
+    // The windows have been closed, so no more images will be compressed. The
+    // workers may post tasks, so the pool must be shut down before the task
+    // queue.
+    REQUIRE(compressorPool_);
+    compressorPool_->shutdown();
+
     REQUIRE(taskQueue_);
     taskQueue_->shutdown();
 }
@@ -626,6 +1548,10 @@ void Context::onTaskQueueShutdownComplete() {
     REQUIRE(state_ == Running);
     REQUIRE(shutdownPhase_ == WaitTaskQueue);
 
+    if(traceCallbacks_.has_value()) {
+        setTraceCallback({});
+    }
+
     state_ = ShutdownComplete;
     shutdownPhase_ = NoPendingShutdown;
 
@@ -690,27 +1616,58 @@ void Context::onWindowManagerCloseWindow(uint64_t window) {
 
 void Context::onWindowManagerFetchImage(
     uint64_t window,
-    function<void(const uint8_t*, size_t, size_t, size_t)> func
+    PutImageFunc func
 ) {
     REQUIRE(threadRunningPumpEvents);
     REQUIRE(state_ == Running);
     REQUIRE(window);
 
-    auto callFunc = [](
-        void* funcPtr,
-        const uint8_t* image,
-        size_t width,
-        size_t height,
-        size_t pitch
-    ) {
-        REQUIRE(funcPtr != nullptr);
-        function<void(const uint8_t*, size_t, size_t, size_t)>& func =
-            *(function<void(const uint8_t*, size_t, size_t, size_t)>*)funcPtr;
-        func(image, width, height, pitch);
-    };
+    if(sharedFrameCallbacks_.has_value()) {
+        auto callFunc = [](
+            void* funcPtr,
+            const uint8_t* image,
+            size_t width,
+            size_t height,
+            size_t pitch,
+            void (*releaseFunc)(void*),
+            void* releaseFuncData
+        ) {
+            REQUIRE(funcPtr != nullptr);
+            REQUIRE(releaseFunc != nullptr);
+
+            // The frame is released by the program-provided function when the
+            // last reference to the owner is dropped (in any thread)
+            shared_ptr<const void> owner(
+                (const void*)image,
+                [releaseFunc, releaseFuncData](const void*) {
+                    releaseFunc(releaseFuncData);
+                }
+            );
+
+            PutImageFunc& func = *(PutImageFunc*)funcPtr;
+            func(image, width, height, pitch, move(owner));
+        };
+
+        REQUIRE(sharedFrameCallbacks_->fetchWindowFrame != nullptr);
+        sharedFrameCallbacks_->fetchWindowFrame(
+            callbackData_, window, callFunc, (void*)&func
+        );
+    } else {
+        auto callFunc = [](
+            void* funcPtr,
+            const uint8_t* image,
+            size_t width,
+            size_t height,
+            size_t pitch
+        ) {
+            REQUIRE(funcPtr != nullptr);
+            PutImageFunc& func = *(PutImageFunc*)funcPtr;
+            func(image, width, height, pitch, nullptr);
+        };
 
-    REQUIRE(callbacks_.fetchWindowImage != nullptr);
-    callbacks_.fetchWindowImage(callbackData_, window, callFunc, (void*)&func);
+        REQUIRE(callbacks_.fetchWindowImage != nullptr);
+        callbacks_.fetchWindowImage(callbackData_, window, callFunc, (void*)&func);
+    }
 }
 
 void Context::onWindowManagerResizeWindow(
@@ -729,6 +1686,121 @@ void Context::onWindowManagerResizeWindow(
     callbacks_.resizeWindow(callbackData_, window, width, height);
 }
 
+void Context::onWindowManagerInputEvents(
+    uint64_t window,
+    const vector<InputEvent>& events
+) {
+    REQUIRE(threadRunningPumpEvents);
+    REQUIRE(state_ == Running);
+    REQUIRE(window);
+
+    if(events.empty()) {
+        return;
+    }
+
+    if(inputBatchCallbacks_.has_value()) {
+        inputBatch_.clear();
+        for(const InputEvent& event : events) {
+            VicePluginAPI_InputEvent batchEvent;
+            memset(&batchEvent, 0, sizeof(VicePluginAPI_InputEvent));
+            switch(event.type) {
+            case InputEvent::MouseDown:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_MOUSE_DOWN;
+                break;
+            case InputEvent::MouseUp:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_MOUSE_UP;
+                break;
+            case InputEvent::MouseMove:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_MOUSE_MOVE;
+                break;
+            case InputEvent::MouseDoubleClick:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_MOUSE_DOUBLE_CLICK;
+                break;
+            case InputEvent::MouseWheel:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_MOUSE_WHEEL;
+                break;
+            case InputEvent::MouseLeave:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_MOUSE_LEAVE;
+                break;
+            case InputEvent::KeyDown:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_KEY_DOWN;
+                break;
+            case InputEvent::KeyUp:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_KEY_UP;
+                break;
+            case InputEvent::LoseFocus:
+                batchEvent.type = VICE_PLUGIN_API_INPUT_EVENT_LOSE_FOCUS;
+                break;
+            default:
+                PANIC("Unknown input event type");
+            }
+            batchEvent.x = event.x;
+            batchEvent.y = event.y;
+            batchEvent.button = event.button;
+            batchEvent.dy = -event.delta;
+            batchEvent.key = event.key;
+            inputBatch_.push_back(batchEvent);
+        }
+
+        REQUIRE(inputBatchCallbacks_->inputEvents != nullptr);
+        inputBatchCallbacks_->inputEvents(
+            callbackData_, window, inputBatch_.data(), inputBatch_.size()
+        );
+        return;
+    }
+
+    for(const InputEvent& event : events) {
+        switch(event.type) {
+        case InputEvent::MouseDown:
+            REQUIRE(callbacks_.mouseDown != nullptr);
+            callbacks_.mouseDown(
+                callbackData_, window, event.x, event.y, event.button
+            );
+            break;
+        case InputEvent::MouseUp:
+            REQUIRE(callbacks_.mouseUp != nullptr);
+            callbacks_.mouseUp(
+                callbackData_, window, event.x, event.y, event.button
+            );
+            break;
+        case InputEvent::MouseMove:
+            REQUIRE(callbacks_.mouseMove != nullptr);
+            callbacks_.mouseMove(callbackData_, window, event.x, event.y);
+            break;
+        case InputEvent::MouseDoubleClick:
+            REQUIRE(callbacks_.mouseDoubleClick != nullptr);
+            callbacks_.mouseDoubleClick(
+                callbackData_, window, event.x, event.y, event.button
+            );
+            break;
+        case InputEvent::MouseWheel:
+            REQUIRE(callbacks_.mouseWheel != nullptr);
+            callbacks_.mouseWheel(
+                callbackData_, window, event.x, event.y, 0, -event.delta
+            );
+            break;
+        case InputEvent::MouseLeave:
+            REQUIRE(callbacks_.mouseLeave != nullptr);
+            callbacks_.mouseLeave(callbackData_, window, event.x, event.y);
+            break;
+        case InputEvent::KeyDown:
+            REQUIRE(callbacks_.keyDown != nullptr);
+            callbacks_.keyDown(callbackData_, window, event.key);
+            break;
+        case InputEvent::KeyUp:
+            REQUIRE(callbacks_.keyUp != nullptr);
+            callbacks_.keyUp(callbackData_, window, event.key);
+            break;
+        case InputEvent::LoseFocus:
+            REQUIRE(callbacks_.loseFocus != nullptr);
+            callbacks_.loseFocus(callbackData_, window);
+            break;
+        default:
+            PANIC("Unknown input event type");
+        }
+    }
+}
+
 #define FORWARD_WINDOW_EVENT(src, callback, callbackArgs) \
     void Context::src { \
         REQUIRE(threadRunningPumpEvents); \
@@ -739,42 +1811,6 @@ void Context::onWindowManagerResizeWindow(
         callbacks_.callback callbackArgs; \
     }
 
-FORWARD_WINDOW_EVENT(
-    onWindowManagerMouseDown(uint64_t window, int x, int y, int button),
-    mouseDown, (callbackData_, window, x, y, button)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerMouseUp(uint64_t window, int x, int y, int button),
-    mouseUp, (callbackData_, window, x, y, button)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerMouseMove(uint64_t window, int x, int y),
-    mouseMove, (callbackData_, window, x, y)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerMouseDoubleClick(uint64_t window, int x, int y, int button),
-    mouseDoubleClick, (callbackData_, window, x, y, button)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerMouseWheel(uint64_t window, int x, int y, int delta),
-    mouseWheel, (callbackData_, window, x, y, 0, -delta)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerMouseLeave(uint64_t window, int x, int y),
-    mouseLeave, (callbackData_, window, x, y)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerKeyDown(uint64_t window, int key),
-    keyDown, (callbackData_, window, key)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerKeyUp(uint64_t window, int key),
-    keyUp, (callbackData_, window, key)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowManagerLoseFocus(uint64_t window),
-    loseFocus, (callbackData_, window)
-)
 FORWARD_WINDOW_EVENT(
     onWindowManagerNavigate(uint64_t window, int direction),
     navigate, (callbackData_, window, direction)
@@ -797,6 +1833,21 @@ void Context::onWindowManagerNavigateToURI(uint64_t window, string uri) {
     uriNavigationCallbacks_->navigateWindowToURI(callbackData_, window, uri.c_str());
 }
 
+void Context::onWindowManagerVisibilityChanged(uint64_t window, bool visible) {
+    REQUIRE(threadRunningPumpEvents);
+    REQUIRE(state_ == Running);
+    REQUIRE(window);
+
+    // Without the extension, hiding the window only pauses the image
+    // compressor
+    if(windowVisibilityCallbacks_) {
+        REQUIRE(windowVisibilityCallbacks_->setWindowVisible != nullptr);
+        windowVisibilityCallbacks_->setWindowVisible(
+            callbackData_, window, visible ? 1 : 0
+        );
+    }
+}
+
 void Context::onWindowManagerUploadFile(
     uint64_t window, string name, shared_ptr<FileUpload> file
 ) {
@@ -903,4 +1954,348 @@ void Context::startClipboardTimeout_() {
     );
 }
 
+void Context::scheduleMemoryCheck_() {
+    REQUIRE(state_ == Running);
+
+    shared_ptr<Context> self = shared_from_this();
+    memoryCheckTag_ = postDelayedTask(
+        MemoryCheckInterval,
+        [self]() {
+            REQUIRE(self->memoryCheckTag_);
+            self->memoryCheckTag_.reset();
+
+            if(self->shutdownPhase_ == NoPendingShutdown) {
+                self->checkMemoryBudget_();
+                self->scheduleMemoryCheck_();
+            }
+        }
+    );
+}
+
+void Context::checkMemoryBudget_() {
+    REQUIRE(state_ == Running);
+    REQUIRE(memoryBudgetBytes_ != 0);
+
+    uint64_t windowBytes = windowManager_->memoryUsage();
+    uint64_t cacheBytes = 0;
+    if(compressorOptions_.frameCache) {
+        cacheBytes = compressorOptions_.frameCache->stats().bytes;
+    }
+    if(windowBytes + cacheBytes <= memoryBudgetBytes_) {
+        return;
+    }
+
+    ++memoryBudgetShrinks_;
+    if(compressorOptions_.frameCache) {
+        compressorOptions_.frameCache->shrink(
+            windowBytes < memoryBudgetBytes_ ? memoryBudgetBytes_ - windowBytes : 0
+        );
+    }
+    if(windowBytes > memoryBudgetBytes_) {
+        windowManager_->shrinkIdleBuffers();
+    }
+}
+
+void Context::handleStatsHTTPRequest_(shared_ptr<HTTPRequest> request) {
+    REQUIRE(state_ == Running);
+
+    if(request->method() != "GET") {
+        request->sendTextResponse(400, "ERROR: Invalid request URI or method\n");
+        return;
+    }
+
+    vector<pair<uint64_t, WindowStats>> stats = windowManager_->stats();
+    stringstream out;
+
+    auto writeHeader = [&](const char* name, const char* type, const char* help) {
+        out << "# HELP retrojsvice_window_" << name << " " << help << "\n";
+        out << "# TYPE retrojsvice_window_" << name << " " << type << "\n";
+    };
+    auto writeValues = [&](
+        const char* name,
+        const char* type,
+        const char* help,
+        function<double(const WindowStats&)> getValue
+    ) {
+        writeHeader(name, type, help);
+        for(const pair<uint64_t, WindowStats>& item : stats) {
+            out << "retrojsvice_window_" << name << "{window=\"" << item.first << "\"} ";
+            out << getValue(item.second) << "\n";
+        }
+    };
+    auto writeSummary = [&](
+        const char* name,
+        const char* help,
+        function<const DurationStats&(const WindowStats&)> getDurations
+    ) {
+        writeHeader(name, "summary", help);
+        for(const pair<uint64_t, WindowStats>& item : stats) {
+            const DurationStats& durations = getDurations(item.second);
+            string label = "{window=\"" + toString(item.first) + "\"";
+            for(const char* quantile : {"0.5", "0.99"}) {
+                out << "retrojsvice_window_" << name << label;
+                out << ",quantile=\"" << quantile << "\"} ";
+                out << durations.quantileSeconds(atof(quantile)) << "\n";
+            }
+            out << "retrojsvice_window_" << name << "_sum" << label << "} ";
+            out << durations.sumSeconds() << "\n";
+            out << "retrojsvice_window_" << name << "_count" << label << "} ";
+            out << durations.count() << "\n";
+        }
+    };
+
+    writeValues(
+        "view_changes_total", "counter",
+        "View change notifications received from the program.",
+        [](const WindowStats& s) { return (double)s.viewChanges; }
+    );
+    writeValues(
+        "frames_fetched_total", "counter",
+        "Frames fetched from the program by the image compressor.",
+        [](const WindowStats& s) { return (double)s.compressor.framesFetched; }
+    );
+    writeValues(
+        "frames_compressed_total", "counter",
+        "Frames compressed by the image compressor.",
+        [](const WindowStats& s) { return (double)s.compressor.framesCompressed; }
+    );
+    writeValues(
+        "frames_wasted_total", "counter",
+        "Compressed frames that were discarded without being sent or were "
+        "already outdated when sent.",
+        [](const WindowStats& s) { return (double)s.compressor.framesWasted; }
+    );
+    writeSummary(
+        "compression_seconds",
+        "Time spent compressing a frame.",
+        [](const WindowStats& s) -> const DurationStats& {
+            return s.compressor.compressionTime;
+        }
+    );
+    writeValues(
+        "image_requests_total", "counter",
+        "Image requests received from the client.",
+        [](const WindowStats& s) { return (double)s.imageRequests; }
+    );
+    writeValues(
+        "images_sent_total", "counter",
+        "Images sent to the client.",
+        [](const WindowStats& s) { return (double)s.compressor.imagesSent; }
+    );
+    writeValues(
+        "empty_tiles_sent_total", "counter",
+        "Empty tiles sent to tile clients to deliver the signals only.",
+        [](const WindowStats& s) { return (double)s.compressor.emptyTilesSent; }
+    );
+    writeValues(
+        "cached_tile_redirects_total", "counter",
+        "Images sent to tile clients as redirects to cacheable URLs.",
+        [](const WindowStats& s) { return (double)s.compressor.cachedTileRedirects; }
+    );
+    writeValues(
+        "cached_tile_requests_total", "counter",
+        "Requests for cacheable tile URLs that were not served by an HTTP "
+        "cache.",
+        [](const WindowStats& s) { return (double)s.compressor.cachedTileRequests; }
+    );
+    writeValues(
+        "sent_bytes_total", "counter",
+        "Bytes of compressed image data sent to the client.",
+        [](const WindowStats& s) { return (double)s.compressor.bytesSent; }
+    );
+    writeSummary(
+        "request_wait_seconds",
+        "Time from receiving an image request to sending the response.",
+        [](const WindowStats& s) -> const DurationStats& {
+            return s.compressor.requestWaitTime;
+        }
+    );
+    writeValues(
+        "events_handled_total", "counter",
+        "Input events handled.",
+        [](const WindowStats& s) { return (double)s.eventsHandled; }
+    );
+    writeValues(
+        "events_replayed_total", "counter",
+        "Input events received again from the client and ignored.",
+        [](const WindowStats& s) { return (double)s.eventsReplayed; }
+    );
+    writeValues(
+        "events_lost_total", "counter",
+        "Input events skipped because they never reached the server.",
+        [](const WindowStats& s) { return (double)s.eventsLost; }
+    );
+    writeValues(
+        "event_index", "gauge",
+        "Index of the next input event expected from the client.",
+        [](const WindowStats& s) { return (double)s.curEventIdx; }
+    );
+    writeValues(
+        "quality", "gauge",
+        "Current image quality (10..100 for JPEG, 101 for PNG).",
+        [](const WindowStats& s) { return (double)s.compressor.quality; }
+    );
+    writeValues(
+        "frame_rate", "gauge",
+        "Frames compressed during the latest second.",
+        [](const WindowStats& s) { return s.compressor.frameRate; }
+    );
+    writeValues(
+        "byte_rate", "gauge",
+        "Bytes of compressed image data sent during the latest second.",
+        [](const WindowStats& s) { return s.compressor.byteRate; }
+    );
+    writeValues(
+        "compression_ms_rate", "gauge",
+        "Milliseconds spent compressing frames during the latest second.",
+        [](const WindowStats& s) { return s.compressor.compressionMsRate; }
+    );
+    writeValues(
+        "budget_throttles_total", "counter",
+        "Times the next frame was postponed because a window budget was "
+        "exceeded.",
+        [](const WindowStats& s) { return (double)s.compressor.budgetThrottles; }
+    );
+    writeValues(
+        "hidden", "gauge",
+        "1 if no client is currently polling the window, 0 otherwise.",
+        [](const WindowStats& s) { return s.hidden ? 1.0 : 0.0; }
+    );
+    writeValues(
+        "media_playing", "gauge",
+        "1 if the window is playing media and uses the video policy, 0 "
+        "otherwise.",
+        [](const WindowStats& s) { return s.compressor.mediaPlaying ? 1.0 : 0.0; }
+    );
+    writeValues(
+        "frame_buffer_bytes", "gauge",
+        "Bytes of the copy of the latest frame kept by the image compressor.",
+        [](const WindowStats& s) { return (double)s.compressor.memory.frameBytes; }
+    );
+    writeValues(
+        "shared_frame_bytes", "gauge",
+        "Bytes of the shared frame of the program referenced by the image "
+        "compressor.",
+        [](const WindowStats& s) { return (double)s.compressor.memory.sharedFrameBytes; }
+    );
+    writeValues(
+        "compressed_image_bytes", "gauge",
+        "Bytes of the compressed images kept for sending (may be shared with "
+        "the frame cache).",
+        [](const WindowStats& s) { return (double)s.compressor.memory.compressedBytes; }
+    );
+
+    uint64_t memoryBytes = 0;
+    for(const pair<uint64_t, WindowStats>& item : stats) {
+        memoryBytes += item.second.compressor.memory.total();
+    }
+    if(compressorOptions_.frameCache) {
+        memoryBytes += compressorOptions_.frameCache->stats().bytes;
+    }
+    out << "# HELP retrojsvice_memory_bytes Bytes held by the image buffers "
+        "of all the windows and the frame cache.\n";
+    out << "# TYPE retrojsvice_memory_bytes gauge\n";
+    out << "retrojsvice_memory_bytes " << memoryBytes << "\n";
+    out << "# HELP retrojsvice_memory_budget_bytes The memory budget (0 for "
+        "no limit).\n";
+    out << "# TYPE retrojsvice_memory_budget_bytes gauge\n";
+    out << "retrojsvice_memory_budget_bytes " << memoryBudgetBytes_ << "\n";
+    out << "# HELP retrojsvice_memory_budget_shrinks_total Times buffers were "
+        "released because the memory budget was exceeded.\n";
+    out << "# TYPE retrojsvice_memory_budget_shrinks_total counter\n";
+    out << "retrojsvice_memory_budget_shrinks_total " << memoryBudgetShrinks_ << "\n";
+    if(downloadMemory_) {
+        out << "# HELP retrojsvice_download_memory_bytes Bytes held by the "
+            "downloads kept in memory.\n";
+        out << "# TYPE retrojsvice_download_memory_bytes gauge\n";
+        out << "retrojsvice_download_memory_bytes " << downloadMemory_->usedBytes() << "\n";
+        out << "# HELP retrojsvice_download_memory_capacity_bytes Maximum "
+            "bytes held by the downloads kept in memory.\n";
+        out << "# TYPE retrojsvice_download_memory_capacity_bytes gauge\n";
+        out << "retrojsvice_download_memory_capacity_bytes " << downloadMemory_->capacity() << "\n";
+    }
+
+    auto writeBudget = [&](const char* name, const char* help, double value) {
+        out << "# HELP retrojsvice_window_budget_" << name << " " << help << "\n";
+        out << "# TYPE retrojsvice_window_budget_" << name << " gauge\n";
+        out << "retrojsvice_window_budget_" << name << " " << value << "\n";
+    };
+    writeBudget(
+        "frame_rate",
+        "Frames each window may compress per second (0 for no limit).",
+        (double)compressorOptions_.budgetFPS
+    );
+    writeBudget(
+        "byte_rate",
+        "Bytes of image data each window may send per second (0 for no "
+        "limit).",
+        (double)compressorOptions_.budgetBytesPerSecond
+    );
+    writeBudget(
+        "compression_ms_rate",
+        "Milliseconds each window may spend compressing per second (0 for no "
+        "limit).",
+        (double)compressorOptions_.budgetCompressionMsPerSecond
+    );
+
+    if(compressorOptions_.frameCache) {
+        FrameCacheStats cacheStats = compressorOptions_.frameCache->stats();
+        auto writeCacheValue = [&](
+            const char* name,
+            const char* type,
+            const char* help,
+            uint64_t value
+        ) {
+            out << "# HELP retrojsvice_frame_cache_" << name << " " << help << "\n";
+            out << "# TYPE retrojsvice_frame_cache_" << name << " " << type << "\n";
+            out << "retrojsvice_frame_cache_" << name << " " << value << "\n";
+        };
+        writeCacheValue(
+            "hits_total", "counter",
+            "Compressed images found in the frame cache.",
+            cacheStats.hits
+        );
+        writeCacheValue(
+            "misses_total", "counter",
+            "Images compressed because they were not in the frame cache.",
+            cacheStats.misses
+        );
+        writeCacheValue(
+            "evictions_total", "counter",
+            "Images evicted from the frame cache to stay within the budget.",
+            cacheStats.evictions
+        );
+        writeCacheValue(
+            "entries", "gauge",
+            "Compressed images in the frame cache.",
+            cacheStats.entries
+        );
+        writeCacheValue(
+            "bytes", "gauge",
+            "Total size of the compressed images in the frame cache.",
+            cacheStats.bytes
+        );
+    }
+
+    out << "# HELP retrojsvice_auth_check_seconds Time spent checking the "
+        "authentication of a request.\n";
+    out << "# TYPE retrojsvice_auth_check_seconds summary\n";
+    for(const char* quantile : {"0.5", "0.99"}) {
+        out << "retrojsvice_auth_check_seconds{quantile=\"" << quantile << "\"} ";
+        out << authCheckTime_.quantileSeconds(atof(quantile)) << "\n";
+    }
+    out << "retrojsvice_auth_check_seconds_sum " << authCheckTime_.sumSeconds() << "\n";
+    out << "retrojsvice_auth_check_seconds_count " << authCheckTime_.count() << "\n";
+
+    string body = out.str();
+    request->sendResponse(
+        200,
+        "text/plain; version=0.0.4; charset=utf-8",
+        body.size(),
+        [body{move(body)}](ostream& out) {
+            out << body;
+        }
+    );
+}
+
 }
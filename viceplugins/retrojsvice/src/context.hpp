@@ -7,7 +7,10 @@
 
 namespace retrojsvice {
 
+class CompressorPool;
+class DownloadMemory;
 class SecretGenerator;
+class SessionTokenSigner;
 
 // The implementation of the vice plugin context, exposed through the C API in
 // vice_plugin_api.cpp.
@@ -29,15 +32,36 @@ public:
     Context(CKey, CKey,
         int defaultQuality,
         SocketAddress httpListenAddr,
-        int httpMaxThreads,
+        HTTPServerOptions httpServerOptions,
         string httpAuthCredentials,
+        bool httpAuthCookie,
         bool allowQualitySelector,
+        int compressionThreads,
+        vector<int> compressionCPUs,
+        ImageCompressorOptions compressorOptions,
+        bool enableStats,
+        bool imageStream,
+        uint64_t memoryBudgetBytes,
+        shared_ptr<DownloadMemory> downloadMemory,
         string programName
     );
     ~Context();
 
     // Public API functions:
     void URINavigation_enable(VicePluginAPI_URINavigation_Callbacks callbacks);
+    void DirtyRect_notifyWindowViewChanged(
+        uint64_t window,
+        size_t x,
+        size_t y,
+        size_t width,
+        size_t height
+    );
+    void SharedFrame_enable(VicePluginAPI_SharedFrame_Callbacks callbacks);
+    void InputBatch_enable(VicePluginAPI_InputBatch_Callbacks callbacks);
+    void WindowVisibility_enable(VicePluginAPI_WindowVisibility_Callbacks callbacks);
+    void Trace_enable(VicePluginAPI_Trace_Callbacks callbacks);
+    void Trace_windowViewTraced(uint64_t window, uint64_t traceId);
+    void MediaState_setWindowMediaPlaying(uint64_t window, int playing);
 
     void start(
         VicePluginAPI_Callbacks callbacks,
@@ -84,6 +108,9 @@ public:
 
     // HTTPServerEventHandler:
     virtual void onHTTPServerRequest(shared_ptr<HTTPRequest> request) override;
+    virtual void onHTTPServerUploadProgress(
+        shared_ptr<HTTPUploadProgress> progress
+    ) override;
     virtual void onHTTPServerShutdownComplete() override;
 
     // TaskQueueEventHandler:
@@ -96,40 +123,26 @@ public:
     virtual void onWindowManagerCloseWindow(uint64_t window) override;
     virtual void onWindowManagerFetchImage(
         uint64_t window,
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ) override;
     virtual void onWindowManagerResizeWindow(
         uint64_t window,
         size_t width,
         size_t height
     ) override;
-    virtual void onWindowManagerMouseDown(
-        uint64_t window, int x, int y, int button
-    ) override;
-    virtual void onWindowManagerMouseUp(
-        uint64_t window, int x, int y, int button
-    ) override;
-    virtual void onWindowManagerMouseMove(
-        uint64_t window, int x, int y
-    ) override;
-    virtual void onWindowManagerMouseDoubleClick(
-        uint64_t window, int x, int y, int button
-    ) override;
-    virtual void onWindowManagerMouseWheel(
-        uint64_t window, int x, int y, int delta
-    ) override;
-    virtual void onWindowManagerMouseLeave(
-        uint64_t window, int x, int y
+    virtual void onWindowManagerInputEvents(
+        uint64_t window,
+        const vector<InputEvent>& events
     ) override;
-    virtual void onWindowManagerKeyDown(uint64_t window, int key) override;
-    virtual void onWindowManagerKeyUp(uint64_t window, int key) override;
-    virtual void onWindowManagerLoseFocus(uint64_t window) override;
     virtual void onWindowManagerNavigate(
         uint64_t window, int direction
     ) override;
     virtual void onWindowManagerNavigateToURI(
         uint64_t window, string uri
     ) override;
+    virtual void onWindowManagerVisibilityChanged(
+        uint64_t window, bool visible
+    ) override;
     virtual void onWindowManagerUploadFile(
         uint64_t window, string name, shared_ptr<FileUpload> file
     ) override;
@@ -139,11 +152,43 @@ private:
     void handleClipboardHTTPRequest_(MCE, shared_ptr<HTTPRequest> request);
     void startClipboardTimeout_();
 
+    // Memory budget: once per MemoryCheckInterval, the memory held by the
+    // image buffers of the windows and the frame cache is compared to the
+    // budget; if it is exceeded, the frame cache is shrunk to fit the budget,
+    // and if the windows alone exceed it, the windows that no client is
+    // polling release their buffers.
+    void scheduleMemoryCheck_();
+    void checkMemoryBudget_();
+
+    // Responds with the statistics of all windows in the Prometheus text
+    // exposition format.
+    void handleStatsHTTPRequest_(shared_ptr<HTTPRequest> request);
+
+    // Checks the auth cookie (if enabled) and otherwise the basic auth
+    // credentials obtained using getCredentials. If the credentials were
+    // correct and cookies are enabled, sets issueCookie to signal that the
+    // client should be given a new cookie.
+    bool isAuthorized_(
+        optional<string> cookie,
+        function<optional<string>()> getCredentials,
+        bool& issueCookie
+    );
+
     int defaultQuality_;
-    SocketAddress httpListenAddr_;
-    int httpMaxThreads_;
+    // Bound already in init such that the program may initialize itself
+    // before starting the context without refusing the connections.
+    shared_ptr<HTTPListenSocket> httpListenSocket_;
+    HTTPServerOptions httpServerOptions_;
     string httpAuthCredentials_;
+    bool httpAuthCookie_;
     bool allowQualitySelector_;
+    int compressionThreads_;
+    vector<int> compressionCPUs_;
+    ImageCompressorOptions compressorOptions_;
+    bool enableStats_;
+    bool imageStream_;
+    uint64_t memoryBudgetBytes_;
+    shared_ptr<DownloadMemory> downloadMemory_;
     string programName_;
 
     enum {Pending, Running, ShutdownComplete} state_;
@@ -159,16 +204,30 @@ private:
     void* callbackData_;
 
     optional<VicePluginAPI_URINavigation_Callbacks> uriNavigationCallbacks_;
+    optional<VicePluginAPI_SharedFrame_Callbacks> sharedFrameCallbacks_;
+    optional<VicePluginAPI_InputBatch_Callbacks> inputBatchCallbacks_;
+    optional<VicePluginAPI_WindowVisibility_Callbacks> windowVisibilityCallbacks_;
+    optional<VicePluginAPI_Trace_Callbacks> traceCallbacks_;
+
+    // Buffer for converting the input events for the InputBatch extension,
+    // reused between batches.
+    vector<VicePluginAPI_InputEvent> inputBatch_;
 
     shared_ptr<TaskQueue> taskQueue_;
     shared_ptr<HTTPServer> httpServer_;
     shared_ptr<SecretGenerator> secretGen_;
+    shared_ptr<SessionTokenSigner> authTokenSigner_;
+    DurationStats authCheckTime_;
+    shared_ptr<CompressorPool> compressorPool_;
     shared_ptr<WindowManager> windowManager_;
 
     string clipboardCSRFToken_;
     vector<shared_ptr<HTTPRequest>> clipboardRequests_;
     shared_ptr<DelayedTaskTag> clipboardTimeout_;
 
+    shared_ptr<DelayedTaskTag> memoryCheckTag_;
+    uint64_t memoryBudgetShrinks_;
+
     class APILock;
     class RunningAPILock;
 };
@@ -2,6 +2,10 @@
 
 #include "http.hpp"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace retrojsvice {
 
 namespace {
@@ -74,87 +78,161 @@ string sanitizeFilename(const string& filename) {
     return sanitizedBase + "." + ext;
 }
 
-optional<uint64_t> getFileSize(const string& path) {
-    optional<uint64_t> empty;
-    ifstream fp;
-    fp.open(path, ifstream::binary);
-    if(!fp.good()) return empty;
-    fp.seekg(0, ifstream::end);
-    if(!fp.good()) return empty;
-    uint64_t size = fp.tellg();
-    if(!fp.good()) return empty;
-    fp.close();
-    return size;
 }
 
+// Contents of a downloaded file held in memory; the reservation is released
+// when the last response using the data has been written.
+class FileDownload::MemoryFile {
+public:
+    MemoryFile(shared_ptr<DownloadMemory> memory, uint64_t size)
+        : memory(memory), reserved(size)
+    {}
+    ~MemoryFile() {
+        memory->release(reserved);
+    }
+    DISABLE_COPY_MOVE(MemoryFile);
+
+    const shared_ptr<DownloadMemory> memory;
+    const uint64_t reserved;
+    vector<uint8_t> data;
+};
+
+DownloadMemory::DownloadMemory(CKey, uint64_t maxFileSize, uint64_t capacity)
+    : usedBytes_(0)
+{
+    maxFileSize_ = maxFileSize;
+    capacity_ = capacity;
+}
+
+bool DownloadMemory::reserve(uint64_t size) {
+    if(size > maxFileSize_) {
+        return false;
+    }
+    uint64_t used = usedBytes_.load(memory_order_relaxed);
+    while(true) {
+        if(size > capacity_ || used > capacity_ - size) {
+            return false;
+        }
+        if(usedBytes_.compare_exchange_weak(used, used + size)) {
+            return true;
+        }
+    }
+}
+
+void DownloadMemory::release(uint64_t size) {
+    uint64_t prev = usedBytes_.fetch_sub(size);
+    REQUIRE(prev >= size);
+}
+
+uint64_t DownloadMemory::usedBytes() {
+    return usedBytes_.load(memory_order_relaxed);
+}
+
+uint64_t DownloadMemory::capacity() {
+    return capacity_;
 }
 
 FileDownload::FileDownload(CKey,
-    string name, string path, function<void()> cleanup
+    string name,
+    string path,
+    function<void()> cleanup,
+    shared_ptr<DownloadMemory> memory
 ) {
     REQUIRE_API_THREAD();
 
     name_ = sanitizeFilename(name);
     path_ = move(path);
     cleanup_ = move(cleanup);
+
+    if(memory) {
+        memoryFile_ = readToMemory_(memory);
+        if(memoryFile_) {
+            // The file is not needed anymore
+            function<void()> cleanupFunc = move(cleanup_);
+            cleanup_ = nullptr;
+            cleanupFunc();
+        }
+    }
 }
 
 FileDownload::~FileDownload() {
-    cleanup_();
+    if(cleanup_) {
+        cleanup_();
+    }
 }
 
 string FileDownload::name() {
     return name_;
 }
 
-void FileDownload::serve(shared_ptr<HTTPRequest> request) {
-    REQUIRE_API_THREAD();
+shared_ptr<FileDownload::MemoryFile> FileDownload::readToMemory_(
+    shared_ptr<DownloadMemory> memory
+) {
+    shared_ptr<MemoryFile> empty;
 
-    optional<uint64_t> lengthOpt = getFileSize(path_);
-    if(!lengthOpt) {
-        ERROR_LOG("Determining the size of downloaded file ", path_, " failed");
-        request->sendTextResponse(500, "ERROR: Internal server error\n");
-        return;
+    int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        return empty;
+    }
+    struct stat st;
+    if(
+        fstat(fd, &st) == -1 ||
+        !S_ISREG(st.st_mode) ||
+        !memory->reserve((uint64_t)st.st_size)
+    ) {
+        close(fd);
+        return empty;
     }
-    uint64_t length = *lengthOpt;
-
-    shared_ptr<FileDownload> self = shared_from_this();
-    function<void(ostream&)> body = [self, length](ostream& out) {
-        ifstream fp;
-        fp.open(self->path_, ifstream::binary);
 
-        if(!fp.good()) {
-            ERROR_LOG("Opening downloaded file ", self->path_, " failed");
-            return;
+    shared_ptr<MemoryFile> file =
+        make_shared<MemoryFile>(memory, (uint64_t)st.st_size);
+    file->data.resize((size_t)st.st_size);
+    size_t pos = 0;
+    while(pos < file->data.size()) {
+        ssize_t count = read(fd, file->data.data() + pos, file->data.size() - pos);
+        if(count > 0) {
+            pos += (size_t)count;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            // Fall back to serving the file from disk
+            WARNING_LOG("Reading downloaded file ", path_, " to memory failed");
+            close(fd);
+            return empty;
         }
+    }
+    close(fd);
+    return file;
+}
 
-        const uint64_t BufSize = 1 << 16;
-        char buf[BufSize];
-
-        uint64_t left = length;
-        while(left) {
-            uint64_t readSize = min(left, BufSize);
-            fp.read(buf, readSize);
-
-            if(!fp.good()) {
-                ERROR_LOG("Reading downloaded file ", self->path_, " failed");
-                return;
-            }
+void FileDownload::serve(shared_ptr<HTTPRequest> request) {
+    REQUIRE_API_THREAD();
 
-            out.write(buf, readSize);
-            left -= readSize;
-        }
-        fp.close();
+    vector<pair<string, string>> headers = {
+        {"Content-Disposition", "attachment; filename=\"" + name_ + "\""}
     };
 
-    request->sendResponse(
-        200,
+    if(memoryFile_) {
+        request->sendBuffers(
+            200,
+            "application/download",
+            {{memoryFile_->data.data(), memoryFile_->data.size(), memoryFile_}},
+            false,
+            move(headers)
+        );
+        return;
+    }
+
+    bool ok = request->sendFile(
         "application/download",
-        length,
-        body,
+        path_,
         false,
-        {{"Content-Disposition", "attachment; filename=\"" + name_ + "\""}}
+        move(headers)
     );
+    if(!ok) {
+        ERROR_LOG("Opening downloaded file ", path_, " failed");
+        request->sendTextResponse(500, "ERROR: Internal server error\n");
+    }
 }
 
 }
@@ -6,10 +6,40 @@ namespace retrojsvice {
 
 class HTTPRequest;
 
+// Memory shared by the downloads that are held in memory instead of being
+// served from their files: files of at most maxFileSize bytes are read to
+// memory as long as the total size stays within capacity. Thread-safe.
+class DownloadMemory {
+SHARED_ONLY_CLASS(DownloadMemory);
+public:
+    DownloadMemory(CKey, uint64_t maxFileSize, uint64_t capacity);
+
+    // Reserves memory for a file of given size; returns false if the file is
+    // too large or the capacity would be exceeded.
+    bool reserve(uint64_t size);
+    void release(uint64_t size);
+
+    uint64_t usedBytes();
+    uint64_t capacity();
+
+private:
+    uint64_t maxFileSize_;
+    uint64_t capacity_;
+    atomic<uint64_t> usedBytes_;
+};
+
 class FileDownload : public enable_shared_from_this<FileDownload> {
 SHARED_ONLY_CLASS(FileDownload);
 public:
-    FileDownload(CKey, string name, string path, function<void()> cleanup);
+    // If memory is given and it has room for the file, the file is read to
+    // memory and cleanup is called immediately, so the file is removed before
+    // it is served.
+    FileDownload(CKey,
+        string name,
+        string path,
+        function<void()> cleanup,
+        shared_ptr<DownloadMemory> memory = nullptr
+    );
     ~FileDownload();
 
     string name();
@@ -20,9 +50,17 @@ public:
     void serve(shared_ptr<HTTPRequest> request);
 
 private:
+    class MemoryFile;
+
+    // Returns empty if the file does not fit in memory or reading it fails.
+    shared_ptr<MemoryFile> readToMemory_(shared_ptr<DownloadMemory> memory);
+
     string name_;
     string path_;
     function<void()> cleanup_;
+
+    // The contents of the file if held in memory.
+    shared_ptr<MemoryFile> memoryFile_;
 };
 
 }
@@ -0,0 +1,126 @@
+#include "frame_cache.hpp"
+
+namespace retrojsvice {
+
+namespace {
+
+const uint64_t Prime = UINT64_C(0x9e3779b97f4a7c15);
+
+uint64_t mix(uint64_t state, uint64_t word) {
+    state = (state ^ word) * Prime;
+    return state ^ (state >> 29);
+}
+
+}
+
+FrameCache::FrameCache(CKey, uint64_t budgetBytes) {
+    REQUIRE(budgetBytes > 0);
+
+    budgetBytes_ = budgetBytes;
+    nextUseTick_ = 0;
+}
+
+FrameCacheKey FrameCache::computeKey(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    uint64_t params
+) {
+    // Two 64-bit hashes, each mixing four lanes of 8-byte words in parallel.
+    // The second hash mixes the words rotated by 32 bits, so that the two
+    // hashes together form a 128-bit key.
+    uint64_t lanes[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for(size_t y = 0; y < height; ++y) {
+        const uint8_t* pos = image + 4 * y * pitch;
+        size_t blockCount = 4 * width / 32;
+        for(size_t i = 0; i < blockCount; ++i) {
+            for(int j = 0; j < 4; ++j) {
+                uint64_t word;
+                memcpy(&word, pos + 8 * j, 8);
+                lanes[j] = mix(lanes[j], word);
+                lanes[4 + j] = mix(lanes[4 + j], (word << 32) | (word >> 32));
+            }
+            pos += 32;
+        }
+        for(size_t i = 32 * blockCount; i < 4 * width; i += 4) {
+            uint32_t word;
+            memcpy(&word, image + 4 * y * pitch + i, 4);
+            lanes[i / 4 % 4] = mix(lanes[i / 4 % 4], word);
+            lanes[4 + i / 4 % 4] = mix(lanes[4 + i / 4 % 4], ~(uint64_t)word);
+        }
+    }
+
+    FrameCacheKey key(params, ~params);
+    for(uint64_t* half : {&key.first, &key.second}) {
+        *half = mix(*half, (uint64_t)width);
+        *half = mix(*half, (uint64_t)height);
+    }
+    for(int j = 0; j < 4; ++j) {
+        key.first = mix(key.first, lanes[j]);
+        key.second = mix(key.second, lanes[4 + j]);
+    }
+    return key;
+}
+
+optional<CompressedImage> FrameCache::lookup(FrameCacheKey key) {
+    lock_guard<mutex> lock(mutex_);
+
+    auto it = entries_.find(key);
+    if(it == entries_.end()) {
+        ++stats_.misses;
+        return {};
+    }
+    ++stats_.hits;
+
+    Entry& entry = it->second;
+    useOrder_.erase(entry.useTick);
+    entry.useTick = nextUseTick_++;
+    useOrder_.emplace(entry.useTick, key);
+    return entry.image;
+}
+
+void FrameCache::insert(FrameCacheKey key, CompressedImage image) {
+    lock_guard<mutex> lock(mutex_);
+
+    if(image.size > budgetBytes_ / 4 || entries_.count(key)) {
+        return;
+    }
+
+    while(stats_.bytes + image.size > budgetBytes_) {
+        evictOldest_();
+    }
+
+    uint64_t useTick = nextUseTick_++;
+    stats_.bytes += image.size;
+    ++stats_.entries;
+    entries_.emplace(key, Entry{move(image), useTick});
+    useOrder_.emplace(useTick, key);
+}
+
+void FrameCache::shrink(uint64_t targetBytes) {
+    lock_guard<mutex> lock(mutex_);
+
+    while(stats_.bytes > targetBytes) {
+        evictOldest_();
+    }
+}
+
+void FrameCache::evictOldest_() {
+    REQUIRE(!useOrder_.empty());
+    auto oldest = useOrder_.begin();
+    auto it = entries_.find(oldest->second);
+    REQUIRE(it != entries_.end());
+    stats_.bytes -= it->second.image.size;
+    --stats_.entries;
+    ++stats_.evictions;
+    entries_.erase(it);
+    useOrder_.erase(oldest);
+}
+
+FrameCacheStats FrameCache::stats() {
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "image_stream.hpp"
+
+namespace retrojsvice {
+
+// 128-bit key of a compressed image, computed from the pixels of the image
+// and the parameters of the encoder by FrameCache::computeKey.
+typedef pair<uint64_t, uint64_t> FrameCacheKey;
+
+struct FrameCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+// Cache of compressed images shared by the image compressors of all windows,
+// so that identical frames shown in several windows (such as the same start
+// page or login screen) and frames repeated within a window are only
+// compressed once. The images are keyed by their content and the encoder
+// parameters, and the least recently used images are evicted once their total
+// compressed size exceeds the memory budget. Thread-safe.
+class FrameCache : public enable_shared_from_this<FrameCache> {
+SHARED_ONLY_CLASS(FrameCache);
+public:
+    FrameCache(CKey, uint64_t budgetBytes);
+
+    // The image is specified as in ImageCompressorEventHandler; params should
+    // identify all the encoder parameters that affect the compressed output.
+    static FrameCacheKey computeKey(
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch,
+        uint64_t params
+    );
+
+    // Returns the cached image for the key (if any), marking it as recently
+    // used.
+    optional<CompressedImage> lookup(FrameCacheKey key);
+
+    // Adds a compressed image to the cache, evicting old images if needed.
+    // Images larger than a quarter of the budget are not cached.
+    void insert(FrameCacheKey key, CompressedImage image);
+
+    // Evicts the least recently used images until the total size is at most
+    // targetBytes.
+    void shrink(uint64_t targetBytes);
+
+    FrameCacheStats stats();
+
+private:
+    struct Entry {
+        CompressedImage image;
+        uint64_t useTick;
+    };
+
+    // Evicts the least recently used image; the mutex must be held.
+    void evictOldest_();
+
+    mutex mutex_;
+    uint64_t budgetBytes_;
+
+    // The entries and their keys ordered by the time of the last use.
+    map<FrameCacheKey, Entry> entries_;
+    map<uint64_t, FrameCacheKey> useOrder_;
+    uint64_t nextUseTick_;
+
+    FrameCacheStats stats_;
+};
+
+}
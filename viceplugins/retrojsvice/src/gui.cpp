@@ -77,17 +77,91 @@ size_t uploadModeWidgetPos(size_t width) {
 
 }
 
-void renderUploadModeGUI(
+UploadModeGUI::UploadModeGUI(CKey) {
+    overlayValid_ = false;
+    overlayWidth_ = 0;
+    overlayButtonDown_ = false;
+    overlayFillEnd_ = 0;
+    overlayX_ = 0;
+    overlayRowWidth_ = 0;
+}
+
+void UploadModeGUI::render(
     vector<uint8_t>& data,
     size_t width,
     size_t height,
-    bool cancelButtonDown
+    bool cancelButtonDown,
+    optional<double> progress
 ) {
     REQUIRE(data.size() >= 4 * width * height);
 
-    for(uint8_t& val : data) {
-        val = (val >> 1) | (uint8_t)0x80;
+    // Dim the view, processing eight bytes at a time
+    const uint64_t HighBits = UINT64_C(0x8080808080808080);
+    const uint64_t LowBits = UINT64_C(0x7F7F7F7F7F7F7F7F);
+    uint8_t* pos = data.data();
+    size_t wordCount = data.size() / 8;
+    for(size_t i = 0; i < wordCount; ++i) {
+        uint64_t word;
+        memcpy(&word, pos, 8);
+        word = ((word >> 1) & LowBits) | HighBits;
+        memcpy(pos, &word, 8);
+        pos += 8;
+    }
+    for(size_t i = 8 * wordCount; i < data.size(); ++i) {
+        data[i] = (data[i] >> 1) | (uint8_t)0x80;
+    }
+
+    size_t fillEnd = 0;
+    if(progress.has_value() && !uploadModeWidget.empty()) {
+        size_t barWidth = uploadModeWidget[0].size();
+        fillEnd = (size_t)(
+            max(min(*progress, 1.0), 0.0) * (double)(barWidth - 2)
+        ) + 1;
+    }
+
+    if(
+        !overlayValid_ ||
+        overlayWidth_ != width ||
+        overlayButtonDown_ != cancelButtonDown ||
+        overlayFillEnd_ != fillEnd
+    ) {
+        updateOverlay_(width, cancelButtonDown, fillEnd);
+    }
+
+    size_t rowBytes = 4 * overlayRowWidth_;
+    for(size_t y = 0; y < overlayRows_.size() && y < height; ++y) {
+        const vector<uint8_t>& row = overlayRows_[y];
+        if(!row.empty()) {
+            memcpy(&data[4 * (y * width + overlayX_)], row.data(), rowBytes);
+        }
+    }
+}
+
+void UploadModeGUI::updateOverlay_(
+    size_t width, bool cancelButtonDown, size_t fillEnd
+) {
+    overlayValid_ = true;
+    overlayWidth_ = width;
+    overlayButtonDown_ = cancelButtonDown;
+    overlayFillEnd_ = fillEnd;
+
+    overlayRows_.clear();
+    overlayX_ = uploadModeWidgetPos(width);
+    overlayRowWidth_ = 0;
+    if(uploadModeWidget.empty()) {
+        return;
     }
+    size_t widgetWidth = uploadModeWidget[0].size();
+    overlayRowWidth_ = min(widgetWidth, width - overlayX_);
+
+    // The fourth byte of each pixel is not used by the compressors; we set it
+    // to a constant so that the overlay never depends on the view under it
+    auto setPixel = [&](uint8_t* pos, int color) {
+        *pos++ = (uint8_t)((color >> 16) & 0xFF);
+        *pos++ = (uint8_t)((color >> 8) & 0xFF);
+        *pos++ = (uint8_t)(color & 0xFF);
+        *pos++ = (uint8_t)0xFF;
+    };
 
     int colors[256] = {};
     colors[(int)'.'] = 0xC0C0C0;
@@ -115,24 +189,34 @@ void renderUploadModeGUI(
         colors[(int)'x'] = 0x000000;
     }
 
-    size_t widgetPos = uploadModeWidgetPos(width);
-    for(size_t y = 0; y < uploadModeWidget.size(); ++y) {
-        size_t x = widgetPos;
-        for(char ch : uploadModeWidget[y]) {
-            if(x < width && y < height) {
-                int color = colors[(uint8_t)ch];
-                uint8_t b = (uint8_t)(color & 0xFF);
-                color >>= 8;
-                uint8_t g = (uint8_t)(color & 0xFF);
-                color >>= 8;
-                uint8_t r = (uint8_t)(color & 0xFF);
-                uint8_t* pos = &data[4 * (y * width + x)];
-                *pos++ = r;
-                *pos++ = g;
-                *pos++ = b;
-            }
+    for(const string& line : uploadModeWidget) {
+        vector<uint8_t> row(4 * overlayRowWidth_);
+        for(size_t i = 0; i < overlayRowWidth_; ++i) {
+            setPixel(&row[4 * i], colors[(uint8_t)line[i]]);
+        }
+        overlayRows_.push_back(move(row));
+    }
 
-            ++x;
+    // Upload progress bar below the widget
+    if(fillEnd != 0) {
+        const size_t BarHeight = 12;
+        size_t barWidth = widgetWidth;
+        size_t barY = uploadModeWidget.size() + 4;
+        overlayRows_.resize(barY);
+        for(size_t y = barY; y < barY + BarHeight; ++y) {
+            vector<uint8_t> row(4 * overlayRowWidth_);
+            for(size_t i = 0; i < overlayRowWidth_; ++i) {
+                int color;
+                if(y == barY || y == barY + BarHeight - 1 || i == 0 || i == barWidth - 1) {
+                    color = 0x000000;
+                } else if(i < fillEnd) {
+                    color = 0x000080;
+                } else {
+                    color = 0xFFFFFF;
+                }
+                setPixel(&row[4 * i], color);
+            }
+            overlayRows_.push_back(move(row));
         }
     }
 }
@@ -4,12 +4,41 @@
 
 namespace retrojsvice {
 
-void renderUploadModeGUI(
-    vector<uint8_t>& data,
-    size_t width,
-    size_t height,
-    bool cancelButtonDown
-);
+// Renders the GUI shown on top of the view while a window is in file upload
+// mode: the view is dimmed and the upload widget (and the progress bar if the
+// progress is known) is drawn at the top. The pixels of the widget are cached
+// for the latest view width, button state and progress bar fill, so a frame
+// only costs dimming the view and copying the cached rows on top of it.
+class UploadModeGUI {
+SHARED_ONLY_CLASS(UploadModeGUI);
+public:
+    UploadModeGUI(CKey);
+
+    void render(
+        vector<uint8_t>& data,
+        size_t width,
+        size_t height,
+        bool cancelButtonDown,
+        optional<double> progress
+    );
+
+private:
+    void updateOverlay_(size_t width, bool cancelButtonDown, size_t fillEnd);
+
+    // Parameters of the cached overlay; fillEnd is 0 if there is no progress
+    // bar.
+    bool overlayValid_;
+    size_t overlayWidth_;
+    bool overlayButtonDown_;
+    size_t overlayFillEnd_;
+
+    // The overlay covers the columns [overlayX_, overlayX_ + overlayRowWidth_)
+    // of the rows [0, overlayRows_.size()); the rows that are not covered by
+    // the overlay (between the widget and the progress bar) are empty.
+    size_t overlayX_;
+    size_t overlayRowWidth_;
+    vector<vector<uint8_t>> overlayRows_;
+};
 
 bool isOverUploadModeCancelButton(
     size_t x, size_t y, size_t width, size_t height
@@ -0,0 +1,237 @@
+#include "gzip.hpp"
+
+#include "html.hpp"
+
+// The deflate implementation is selected at build time in the same way as for
+// the PNG compressor: stock zlib by default or zlib-ng (using its native API)
+// if PNG_DEFLATE_ZLIB_NG is defined.
+#ifdef PNG_DEFLATE_ZLIB_NG
+#include <zlib-ng.h>
+#define ZLIB_FUNC(name) zng_ ## name
+typedef zng_stream ZStream;
+#else
+#include <zlib.h>
+#define ZLIB_FUNC(name) name
+typedef z_stream ZStream;
+#endif
+
+namespace retrojsvice {
+
+namespace {
+
+const int CompressionLevel = 6;
+
+// Maximum length of a stored (uncompressed) deflate block.
+const size_t MaxStoredBlockSize = 65535;
+
+// Gzip member header without a file name or modification time.
+const char GzipHeader[] = {
+    '\x1f', '\x8b', '\x08', '\x00', '\x00', '\x00', '\x00', '\x00', '\x00', '\x03'
+};
+
+// Final empty stored deflate block, valid after a byte-aligned block boundary.
+const char FinalBlock[] = {'\x01', '\x00', '\x00', '\xff', '\xff'};
+
+string toLower(string str) {
+    for(char& c : str) {
+        c = tolower(c);
+    }
+    return str;
+}
+
+string trim(const string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if(start == string::npos) {
+        return "";
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
+
+void appendLE32(string& buf, uint32_t val) {
+    for(int i = 0; i < 4; ++i) {
+        buf.push_back((char)(uint8_t)val);
+        val >>= 8;
+    }
+}
+
+uint32_t crc32Of(const char* data, size_t size) {
+    return (uint32_t)ZLIB_FUNC(crc32)(0, (const unsigned char*)data, size);
+}
+
+uint32_t crc32Combine(uint32_t crc1, uint32_t crc2, size_t size2) {
+    return (uint32_t)ZLIB_FUNC(crc32_combine)(crc1, crc2, size2);
+}
+
+// Runs deflate with given window bits (negative for raw deflate, 16 + bits for
+// gzip) over the whole data with given flush mode and returns the output.
+string deflateData(const char* data, size_t size, int windowBits, int flush) {
+    ZStream zStream;
+    memset(&zStream, 0, sizeof(zStream));
+    REQUIRE(ZLIB_FUNC(deflateInit2)(
+        &zStream, CompressionLevel, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY
+    ) == Z_OK);
+
+    string ret;
+    ret.resize(ZLIB_FUNC(deflateBound)(&zStream, size) + 16);
+
+    zStream.next_in = (unsigned char*)data;
+    zStream.avail_in = size;
+    zStream.next_out = (unsigned char*)&ret[0];
+    zStream.avail_out = ret.size();
+
+    int res = ZLIB_FUNC(deflate)(&zStream, flush);
+    REQUIRE(res == (flush == Z_FINISH ? Z_STREAM_END : Z_OK));
+    REQUIRE(zStream.avail_in == 0);
+
+    ret.resize(ret.size() - zStream.avail_out);
+    ZLIB_FUNC(deflateEnd)(&zStream);
+    return ret;
+}
+
+// Static template fragment compressed as a sequence of non-final raw deflate
+// blocks that ends at a byte boundary (using a sync flush) and does not refer
+// to any preceding data, so that it can be concatenated with other such
+// sequences.
+struct CompressedFragment {
+    string data;
+    uint32_t crc;
+};
+
+mutex compressedFragmentCacheMutex;
+map<pair<const char*, size_t>, CompressedFragment> compressedFragmentCache;
+
+const CompressedFragment& getCompressedFragment(const char* data, size_t size) {
+    lock_guard<mutex> lock(compressedFragmentCacheMutex);
+
+    pair<const char*, size_t> key(data, size);
+    auto it = compressedFragmentCache.find(key);
+    if(it == compressedFragmentCache.end()) {
+        CompressedFragment fragment;
+        fragment.data = deflateData(data, size, -15, Z_SYNC_FLUSH);
+        fragment.crc = crc32Of(data, size);
+        it = compressedFragmentCache.emplace(key, move(fragment)).first;
+    }
+
+    // The entries of the map are never removed or modified, so the reference
+    // remains valid
+    return it->second;
+}
+
+}
+
+bool isCompressibleContentType(const string& contentType) {
+    string type = toLower(trim(contentType.substr(0, contentType.find(';'))));
+    return
+        type.compare(0, 5, "text/") == 0 ||
+        type == "application/javascript" ||
+        type == "application/json";
+}
+
+bool acceptsGzipEncoding(const string& acceptEncoding) {
+    size_t pos = 0;
+    while(pos <= acceptEncoding.size()) {
+        size_t end = acceptEncoding.find(',', pos);
+        if(end == string::npos) {
+            end = acceptEncoding.size();
+        }
+        string item = acceptEncoding.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t semicolon = item.find(';');
+        string coding = toLower(trim(item.substr(0, semicolon)));
+        if(coding != "gzip" && coding != "x-gzip") {
+            continue;
+        }
+
+        // The coding is refused only by an explicit zero quality value
+        if(semicolon != string::npos) {
+            string param = toLower(trim(item.substr(semicolon + 1)));
+            if(param.compare(0, 2, "q=") == 0) {
+                string q = trim(param.substr(2));
+                if(!q.empty() && q.find_first_not_of("0.") == string::npos) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+bool hasBrokenGzipSupport(const string& userAgent) {
+    // Netscape 4 does not decompress scripts and style sheets
+    if(
+        userAgent.compare(0, 10, "Mozilla/4.") == 0 &&
+        userAgent.find("compatible") == string::npos
+    ) {
+        return true;
+    }
+
+    // Internet Explorer 4 and 5 and the versions of Internet Explorer 6 before
+    // XP SP2 (identified by the SV1 token) may show a corrupted or empty page
+    // for compressed responses
+    if(
+        userAgent.find("MSIE 4.") != string::npos ||
+        userAgent.find("MSIE 5.") != string::npos ||
+        (
+            userAgent.find("MSIE 6.") != string::npos &&
+            userAgent.find("SV1") == string::npos
+        )
+    ) {
+        return true;
+    }
+
+    return false;
+}
+
+string gzipCompress(const string& data) {
+    return deflateData(data.data(), data.size(), 16 + 15, Z_FINISH);
+}
+
+HTMLScatterList gzipCompressHTML(const HTMLScatterList& html) {
+    HTMLScatterList ret;
+    ret.reserve(2 * html.pieceCount() + 3);
+    ret.appendStatic(GzipHeader, sizeof(GzipHeader));
+
+    uint32_t crc = 0;
+    uint64_t size = 0;
+    html.forEachPiece([&](const char* data, size_t pieceSize, bool isStatic) {
+        if(pieceSize == 0) {
+            return;
+        }
+        if(isStatic) {
+            const CompressedFragment& fragment = getCompressedFragment(data, pieceSize);
+            ret.appendStatic(fragment.data.data(), fragment.data.size());
+            crc = crc32Combine(crc, fragment.crc, pieceSize);
+        } else {
+            string blocks;
+            for(size_t pos = 0; pos < pieceSize; pos += MaxStoredBlockSize) {
+                size_t blockSize = min(pieceSize - pos, MaxStoredBlockSize);
+                char header[5] = {
+                    '\x00',
+                    (char)(uint8_t)blockSize,
+                    (char)(uint8_t)(blockSize >> 8),
+                    (char)(uint8_t)~blockSize,
+                    (char)(uint8_t)(~blockSize >> 8)
+                };
+                blocks.append(header, sizeof(header));
+                blocks.append(data + pos, blockSize);
+            }
+            ret.append(blocks);
+            crc = crc32Combine(crc, crc32Of(data, pieceSize), pieceSize);
+        }
+        size += pieceSize;
+    });
+
+    ret.appendStatic(FinalBlock, sizeof(FinalBlock));
+
+    string trailer;
+    appendLE32(trailer, crc);
+    appendLE32(trailer, (uint32_t)size);
+    ret.append(trailer);
+
+    return ret;
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+class HTMLScatterList;
+
+// Returns true if a response with given Content-Type is worth compressing.
+bool isCompressibleContentType(const string& contentType);
+
+// Returns true if the value of an Accept-Encoding request header allows the
+// gzip content coding.
+bool acceptsGzipEncoding(const string& acceptEncoding);
+
+// Returns true if the browser identified by given User-Agent is known to
+// mishandle gzip-compressed responses (Netscape 4, Internet Explorer 4 and 5
+// and Internet Explorer 6 before XP SP2).
+bool hasBrokenGzipSupport(const string& userAgent);
+
+// Compresses data into the gzip format.
+string gzipCompress(const string& data);
+
+// Compresses the output of an HTML template into the gzip format. The static
+// fragments of the template are compressed once and cached for the lifetime of
+// the program, and the values of the variables are added as uncompressed
+// deflate blocks, so the result refers to the cached fragments and only the
+// values and block headers are copied.
+HTMLScatterList gzipCompressHTML(const HTMLScatterList& html);
+
+}
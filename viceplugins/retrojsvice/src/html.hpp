@@ -4,17 +4,87 @@
 
 namespace retrojsvice {
 
+// The output of an HTML template as a list of pieces to be written in order:
+// the static fragments of the template, which are referenced directly, and
+// the values of the variables, which are copied to a buffer owned by the list.
+// The total size is known before anything is written.
+class HTMLScatterList {
+public:
+    HTMLScatterList() : size_(0) {}
+
+    void reserve(size_t pieceCount) {
+        pieces_.reserve(pieceCount);
+    }
+
+    // The data must remain valid for the lifetime of the list.
+    void appendStatic(const char* data, size_t size) {
+        pieces_.push_back({data, 0, size});
+        size_ += size;
+    }
+
+    void append(const string& value) {
+        pieces_.push_back({nullptr, values_.size(), value.size()});
+        values_.append(value);
+        size_ += value.size();
+    }
+    void append(uint64_t value) {
+        append(toString(value));
+    }
+    void append(bool value) {
+        append(string(value ? "1" : "0"));
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    size_t pieceCount() const {
+        return pieces_.size();
+    }
+
+    // Calls func(const char* data, size_t size, bool isStatic) for each piece
+    // in order; isStatic is true for the pieces added using appendStatic.
+    template <typename Func>
+    void forEachPiece(Func func) const {
+        for(const Piece& piece : pieces_) {
+            if(piece.data != nullptr) {
+                func(piece.data, piece.size, true);
+            } else {
+                func(values_.data() + piece.offset, piece.size, false);
+            }
+        }
+    }
+
+    void writeTo(ostream& out) const {
+        forEachPiece([&](const char* data, size_t size, bool isStatic) {
+            out.write(data, size);
+        });
+    }
+
+private:
+    // If data is null, the piece is in values_ at offset.
+    struct Piece {
+        const char* data;
+        size_t offset;
+        size_t size;
+    };
+
+    vector<Piece> pieces_;
+    string values_;
+    uint64_t size_;
+};
+
 struct NewWindowHTMLData {
     const string& programName;
     const string& pathPrefix;
 };
-void writeNewWindowHTML(ostream& out, const NewWindowHTMLData& data);
+void writeNewWindowHTML(HTMLScatterList& out, const NewWindowHTMLData& data);
 
 struct PreMainHTMLData {
     const string& programName;
     const string& pathPrefix;
 };
-void writePreMainHTML(ostream& out, const PreMainHTMLData& data);
+void writePreMainHTML(HTMLScatterList& out, const PreMainHTMLData& data);
 
 struct MainHTMLData {
     const string& programName;
@@ -22,44 +92,46 @@ struct MainHTMLData {
     uint64_t mainIdx;
     const string& nonCharKeyList;
     const string& snakeOilKeyCipherKeyWrites;
+    bool allowImageStream;
+    uint64_t imagePipelineDepth;
 };
-void writeMainHTML(ostream& out, const MainHTMLData& data);
+void writeMainHTML(HTMLScatterList& out, const MainHTMLData& data);
 
 struct PrePrevHTMLData {
     const string& programName;
     const string& pathPrefix;
 };
-void writePrePrevHTML(ostream& out, const PrePrevHTMLData& data);
+void writePrePrevHTML(HTMLScatterList& out, const PrePrevHTMLData& data);
 
 struct PrevHTMLData {
     const string& programName;
     const string& pathPrefix;
 };
-void writePrevHTML(ostream& out, const PrevHTMLData& data);
+void writePrevHTML(HTMLScatterList& out, const PrevHTMLData& data);
 
 struct NextHTMLData {
     const string& programName;
     const string& pathPrefix;
 };
-void writeNextHTML(ostream& out, const NextHTMLData& data);
+void writeNextHTML(HTMLScatterList& out, const NextHTMLData& data);
 
 struct PopupIframeHTMLData {
     const string& programName;
     const string& popupPathPrefix;
 };
-void writePopupIframeHTML(ostream& out, const PopupIframeHTMLData& data);
+void writePopupIframeHTML(HTMLScatterList& out, const PopupIframeHTMLData& data);
 
 struct ClipboardIframeHTMLData {
     const string& programName;
 };
-void writeClipboardIframeHTML(ostream& out, const ClipboardIframeHTMLData& data);
+void writeClipboardIframeHTML(HTMLScatterList& out, const ClipboardIframeHTMLData& data);
 
 struct ClipboardHTMLData {
     const string& programName;
     const string& escapedText;
     const string& csrfToken;
 };
-void writeClipboardHTML(ostream& out, const ClipboardHTMLData& data);
+void writeClipboardHTML(HTMLScatterList& out, const ClipboardHTMLData& data);
 
 struct DownloadIframeHTMLData {
     const string& programName;
@@ -68,14 +140,14 @@ struct DownloadIframeHTMLData {
     string fileName;
 };
 
-void writeDownloadIframeHTML(ostream& out, const DownloadIframeHTMLData& data);
+void writeDownloadIframeHTML(HTMLScatterList& out, const DownloadIframeHTMLData& data);
 
 struct UploadIframeHTMLData {
     const string& programName;
     const string& pathPrefix;
 };
 
-void writeUploadIframeHTML(ostream& out, const UploadIframeHTMLData& data);
+void writeUploadIframeHTML(HTMLScatterList& out, const UploadIframeHTMLData& data);
 
 struct UploadHTMLData {
     const string& programName;
@@ -83,18 +155,18 @@ struct UploadHTMLData {
     const string& csrfToken;
 };
 
-void writeUploadHTML(ostream& out, const UploadHTMLData& data);
+void writeUploadHTML(HTMLScatterList& out, const UploadHTMLData& data);
 
 struct UploadCancelHTMLData {
     const string& programName;
 };
 
-void writeUploadCancelHTML(ostream& out, const UploadCancelHTMLData& data);
+void writeUploadCancelHTML(HTMLScatterList& out, const UploadCancelHTMLData& data);
 
 struct UploadCompleteHTMLData {
     const string& programName;
 };
 
-void writeUploadCompleteHTML(ostream& out, const UploadCompleteHTMLData& data);
+void writeUploadCompleteHTML(HTMLScatterList& out, const UploadCompleteHTMLData& data);
 
 }
@@ -1,23 +1,54 @@
 #include "http.hpp"
+#include "gzip.hpp"
 
+#include "multipart.hpp"
+#include "probe.hpp"
 #include "task_queue.hpp"
 #include "upload.hpp"
 
 #include <Poco/Base64Decoder.h>
+#include <Poco/Timespan.h>
 
-#include <Poco/Net/HTMLForm.h>
 #include <Poco/Net/HTTPServer.h>
 #include <Poco/Net/HTTPServerResponse.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
 #include <Poco/Net/HTTPRequestHandler.h>
-#include <Poco/Net/PartHandler.h>
+#include <Poco/Net/ServerSocket.h>
 #include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/SocketImpl.h>
+#include <Poco/Net/StreamSocket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 namespace retrojsvice {
 
 namespace {
 
+// Responses with smaller bodies are not compressed, as the gain would not be
+// worth the overhead.
+const uint64_t MinCompressedSize = 512;
+
+// The threaded server writes buffer response bodies (HTTPRequest::sendBuffers)
+// directly to the socket only if they are at least this large; smaller bodies
+// go through the buffered response stream together with the headers, so that
+// they are not delayed by Nagle's algorithm when written separately.
+const uint64_t MinDirectBufferBodySize = 16384;
+
+// Maximum size of a non-multipart request body accepted by the threaded
+// server (the event-driven server has its own limit for buffered bodies).
+const size_t MaxFormBodySize = 16 * 1024 * 1024;
+
 // We use a AliveToken to track that all the relevant Poco HTTP server
 // background threads actually shut down before reporting successful shutdown.
 class AliveToken {
@@ -47,32 +78,418 @@ private:
     weak_ptr<AliveToken::Inner> inner_;
 };
 
+// Open file whose contents are sent as a response body by HTTPRequest::sendFile.
+class FileBody {
+public:
+    FileBody(int fd, uint64_t offset) : fd(fd), offset(offset) {}
+    ~FileBody() {
+        close(fd);
+    }
+    DISABLE_COPY_MOVE(FileBody);
+
+    const int fd;
+    const uint64_t offset;
+};
+
+// Sends length bytes of the file starting from given offset to the socket
+// using sendfile, falling back to copying through a buffer if the file does
+// not support sendfile. Returns false if sending failed, the socket would block
+// or the file ended prematurely (errno is EAGAIN or EWOULDBLOCK if the socket
+// would block); bytes sent so far are subtracted from length and added to
+// offset.
+bool sendFileToSocket(int sockFd, int fileFd, uint64_t& offset, uint64_t& length) {
+    const uint64_t ChunkSize = 1 << 20;
+    while(length) {
+        size_t chunk = (size_t)min(length, ChunkSize);
+        off_t pos = (off_t)offset;
+        ssize_t count = sendfile(sockFd, fileFd, &pos, chunk);
+        if(count == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            char buf[1 << 16];
+            count = pread(fileFd, buf, min(chunk, sizeof(buf)), (off_t)offset);
+            if(count > 0) {
+                count = send(sockFd, buf, (size_t)count, MSG_NOSIGNAL);
+            }
+        }
+        if(count > 0) {
+            offset += (uint64_t)count;
+            length -= (uint64_t)count;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if(count == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends the buffers starting from offset bytes into buffers[idx] to the socket
+// using scatter-gather I/O (sendmsg, which unlike writev allows suppressing
+// SIGPIPE). Returns false if sending failed or the socket would block (errno is
+// EAGAIN or EWOULDBLOCK if the socket would block); the position of the next
+// byte to send is kept in idx and offset.
+bool sendBuffersToSocket(
+    int sockFd,
+    const vector<ResponseBuffer>& buffers,
+    size_t& idx,
+    size_t& offset
+) {
+    const size_t MaxIOVecs = 64;
+    while(idx < buffers.size()) {
+        iovec iov[MaxIOVecs];
+        size_t iovCount = 0;
+        for(
+            size_t i = idx;
+            i < buffers.size() && iovCount < MaxIOVecs;
+            ++i
+        ) {
+            size_t skip = i == idx ? offset : 0;
+            if(buffers[i].size > skip) {
+                iov[iovCount].iov_base =
+                    (void*)((const char*)buffers[i].data + skip);
+                iov[iovCount].iov_len = buffers[i].size - skip;
+                ++iovCount;
+            }
+        }
+        if(iovCount == 0) {
+            idx = buffers.size();
+            offset = 0;
+            break;
+        }
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovCount;
+        ssize_t count = sendmsg(sockFd, &msg, MSG_NOSIGNAL);
+        if(count > 0) {
+            size_t left = (size_t)count;
+            while(idx < buffers.size() && left >= buffers[idx].size - offset) {
+                left -= buffers[idx].size - offset;
+                ++idx;
+                offset = 0;
+            }
+            offset += left;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if(count == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// The response given by the request handler through HTTPRequest::sendResponse.
+struct ResponseSpec {
+    int status;
+    string contentType;
+    uint64_t contentLength;
+    function<void(ostream&)> body;
+    bool noCache;
+    vector<pair<string, string>> extraHeaders;
+
+    // If set, contentLength is ignored and the body is written until the body
+    // function returns, after which the connection is closed.
+    bool stream = false;
+
+    // If set, the body function is ignored and the body consists of
+    // contentLength bytes of the file starting from file->offset, sent
+    // directly from the file to the socket.
+    shared_ptr<FileBody> file;
+
+    // If nonempty (and file is not set), the body consists of these buffers
+    // (contentLength bytes in total), which the server writes directly to the
+    // socket if possible; the body function writes the same data to a stream.
+    vector<ResponseBuffer> buffers;
+
+    void setHeaders(Poco::Net::HTTPResponse& response) const {
+        response.add("Content-Type", contentType);
+        if(stream) {
+            response.setKeepAlive(false);
+        } else {
+            response.setContentLength64(contentLength);
+        }
+        if(noCache) {
+            response.add("Cache-Control", "no-cache, no-store, must-revalidate");
+            response.add("Pragma", "no-cache");
+            response.add("Expires", "0");
+        }
+        for(const pair<string, string>& header : extraHeaders) {
+            response.add(header.first, header.second);
+        }
+        response.setStatus((Poco::Net::HTTPResponse::HTTPStatus)status);
+    }
+};
+
+enum class ByteRange {Ignore, Unsatisfiable, Satisfiable};
+
+// Parses the value of a Range header for a resource of given size. Only single
+// byte ranges are supported; for other valid and invalid values, Ignore is
+// returned, in which case the whole resource should be sent. For satisfiable
+// ranges, the range [start, end) is set, clipped to the resource.
+ByteRange parseByteRange(string value, uint64_t size, uint64_t& start, uint64_t& end) {
+    // Parse a decimal number, saturating on overflow
+    auto parseNumber = [](const string& str, uint64_t& result) {
+        if(str.empty()) {
+            return false;
+        }
+        result = 0;
+        for(char c : str) {
+            if(c < '0' || c > '9') {
+                return false;
+            }
+            uint64_t digit = (uint64_t)(c - '0');
+            if(result > (UINT64_MAX - digit) / 10) {
+                result = UINT64_MAX;
+            } else {
+                result = 10 * result + digit;
+            }
+        }
+        return true;
+    };
+
+    value.erase(remove(value.begin(), value.end(), ' '), value.end());
+    for(size_t i = 0; i < value.size() && value[i] != '='; ++i) {
+        value[i] = tolower(value[i]);
+    }
+    if(value.compare(0, 6, "bytes=") != 0 || value.find(',') != string::npos) {
+        return ByteRange::Ignore;
+    }
+    size_t dash = value.find('-', 6);
+    if(dash == string::npos) {
+        return ByteRange::Ignore;
+    }
+    string firstStr = value.substr(6, dash - 6);
+    string lastStr = value.substr(dash + 1);
+
+    uint64_t first, last;
+    if(firstStr.empty()) {
+        // Suffix range: the last bytes of the resource
+        if(!parseNumber(lastStr, last)) {
+            return ByteRange::Ignore;
+        }
+        if(last == 0 || size == 0) {
+            return ByteRange::Unsatisfiable;
+        }
+        start = size - min(last, size);
+        end = size;
+        return ByteRange::Satisfiable;
+    }
+
+    if(!parseNumber(firstStr, first)) {
+        return ByteRange::Ignore;
+    }
+    if(lastStr.empty()) {
+        last = UINT64_MAX;
+    } else if(!parseNumber(lastStr, last) || last < first) {
+        return ByteRange::Ignore;
+    }
+    if(first >= size) {
+        return ByteRange::Unsatisfiable;
+    }
+    start = first;
+    end = last < size ? last + 1 : size;
+    return ByteRange::Satisfiable;
+}
+
+// Parses the credentials from the value of an Authorization header using
+// HTTP basic authentication.
+optional<string> parseBasicAuthCredentials(const optional<string>& authorization) {
+    optional<string> empty;
+
+    string scheme, authInfoBase64;
+
+    try {
+        if(!authorization.has_value()) {
+            return empty;
+        }
+        Poco::Net::HTTPRequest authRequest;
+        authRequest.set(Poco::Net::HTTPRequest::AUTHORIZATION, *authorization);
+        authRequest.getCredentials(scheme, authInfoBase64);
+    } catch(const Poco::Exception& e) {
+        WARNING_LOG(
+            "Reading HTTP auth credentials with Poco failed with exception ",
+            "(defaulting to none): ", e.displayText()
+        );
+        return empty;
+    }
+
+    for(char& c : scheme) {
+        c = tolower(c);
+    }
+    if(scheme != "basic") {
+        return empty;
+    }
+
+    string authInfo;
+
+    try {
+        stringstream authInfoBase64SS(authInfoBase64);
+        Poco::Base64Decoder decoder(authInfoBase64SS);
+
+        size_t BufSize = 1024;
+        char buf[BufSize];
+        while(decoder.good()) {
+            decoder.read(buf, BufSize);
+            if(decoder.bad()) {
+                return empty;
+            }
+            authInfo.append(buf, decoder.gcount());
+        }
+    } catch(const Poco::Exception& e) {
+        WARNING_LOG(
+            "Parsing HTTP basic auth credentials with Poco failed with exception ",
+            "(defaulting to none): ", e.displayText()
+        );
+        return empty;
+    }
+
+    return authInfo;
+}
+
+// Returns the value of the cookie with given name in the value of a Cookie
+// request header, if any.
+optional<string> parseCookie(const optional<string>& cookieHeader, const string& name) {
+    optional<string> empty;
+    if(!cookieHeader.has_value()) {
+        return empty;
+    }
+
+    const string& header = *cookieHeader;
+    size_t pos = 0;
+    while(pos < header.size()) {
+        size_t end = header.find(';', pos);
+        if(end == string::npos) {
+            end = header.size();
+        }
+        size_t start = header.find_first_not_of(" \t", pos);
+        if(
+            start < end &&
+            end - start > name.size() &&
+            header.compare(start, name.size(), name) == 0 &&
+            header[start + name.size()] == '='
+        ) {
+            start += name.size() + 1;
+            size_t valueEnd = header.find_last_not_of(" \t", end - 1) + 1;
+            return header.substr(start, max(valueEnd, start) - start);
+        }
+        pos = end + 1;
+    }
+    return empty;
+}
+
+int hexDigitValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes '+' and percent-encoded characters of a component of a URL-encoded
+// form; invalid percent-encodings are kept as is.
+string decodeFormComponent(const char* begin, const char* end) {
+    string ret;
+    ret.reserve(end - begin);
+    for(const char* it = begin; it != end; ++it) {
+        if(*it == '+') {
+            ret.push_back(' ');
+        } else if(*it == '%' && end - it >= 3) {
+            int high = hexDigitValue(it[1]);
+            int low = hexDigitValue(it[2]);
+            if(high != -1 && low != -1) {
+                ret.push_back((char)(high * 16 + low));
+                it += 2;
+            } else {
+                ret.push_back(*it);
+            }
+        } else {
+            ret.push_back(*it);
+        }
+    }
+    return ret;
+}
+
+// Appends the parameters of a form in the application/x-www-form-urlencoded
+// format (such as a query string) to params.
+void parseURLEncodedForm(const string& data, vector<pair<string, string>>& params) {
+    const char* pos = data.data();
+    const char* end = pos + data.size();
+    while(pos < end) {
+        const char* itemEnd = std::find(pos, end, '&');
+        if(itemEnd != pos) {
+            const char* eq = std::find(pos, itemEnd, '=');
+            params.emplace_back(
+                decodeFormComponent(pos, eq),
+                eq == itemEnd ? string() : decodeFormComponent(eq + 1, itemEnd)
+            );
+        }
+        pos = itemEnd == end ? end : itemEnd + 1;
+    }
+}
+
+// Called exactly once in the API thread to deliver the response to the server
+// that received the request.
+typedef function<void(ResponseSpec)> Responder;
+
+// Connection reuse statistics of a server, updated by the server threads.
+struct ConnectionStats {
+    atomic<uint64_t> connectionCount{0};
+    atomic<uint64_t> requestCount{0};
+};
+
 }
 
 class HTTPRequest::Impl {
 public:
-    // May throw Poco::Exception.
+    // May throw Poco::Exception. The request object is only used during the
+    // constructor call. The form parameters are either given in formParams (for
+    // multipart bodies, which are parsed while receiving them) or parsed from
+    // the URL-encoded formBody and the query string of the URI when they are
+    // first accessed.
     Impl(
-        Poco::Net::HTTPServerRequest& request,
-        unique_ptr<Poco::Net::HTMLForm> form,
+        const Poco::Net::HTTPRequest& request,
+        optional<vector<pair<string, string>>> formParams,
+        string formBody,
         map<string, shared_ptr<FileUpload>> files,
-        promise<function<void(Poco::Net::HTTPServerResponse&)>> responderPromise,
+        bool uploadCancelled,
+        Responder responder,
+        bool supportsStreaming,
         AliveToken aliveToken
     )
         : aliveToken_(aliveToken),
-          request_(&request),
+          responded_(false),
+          supportsStreaming_(supportsStreaming),
+          uploadCancelled_(uploadCancelled),
           method_(request.getMethod()),
           path_(request.getURI()),
           userAgent_(request.get("User-Agent", "")),
-          form_(move(form)),
+          formParams_(move(formParams)),
+          formBody_(move(formBody)),
           files_(move(files)),
-          responderPromise_(move(responderPromise))
+          responder_(move(responder))
     {
-        REQUIRE(request_ != nullptr);
+        if(request.has(Poco::Net::HTTPRequest::AUTHORIZATION)) {
+            authorization_ = request.get(Poco::Net::HTTPRequest::AUTHORIZATION);
+        }
+        if(request.has("Range")) {
+            range_ = request.get("Range");
+        }
+        hasIfRange_ = request.has("If-Range");
+        if(request.has("Cookie")) {
+            cookie_ = request.get("Cookie");
+        }
+        acceptsGzip_ =
+            acceptsGzipEncoding(request.get("Accept-Encoding", "")) &&
+            !hasBrokenGzipSupport(userAgent_);
     }
 
     ~Impl() {
-        if(request_ != nullptr) {
+        if(!responded_) {
             WARNING_LOG("HTTP response not provided, sending internal server error");
             sendTextResponse(
                 500,
@@ -85,37 +502,58 @@ public:
 
     DISABLE_COPY_MOVE(Impl);
 
-    string method() {
-        REQUIRE(request_ != nullptr);
+    // One Impl is created for every request, so the memory is recycled as
+    // with the HTTPRequest objects (see SHARED_ONLY_POOLED_CLASS).
+    static void* operator new(size_t size) {
+        REQUIRE(size == sizeof(Impl));
+        return BlockPool<sizeof(Impl)>::allocate();
+    }
+    static void operator delete(void* ptr) {
+        BlockPool<sizeof(Impl)>::deallocate(ptr);
+    }
+
+    const string& method() {
+        REQUIRE(!responded_);
         return method_;
     }
-    string path() {
-        REQUIRE(request_ != nullptr);
+    const string& path() {
+        REQUIRE(!responded_);
         return path_;
     }
-    string userAgent() {
-        REQUIRE(request_ != nullptr);
+    const string& userAgent() {
+        REQUIRE(!responded_);
         return userAgent_;
     }
 
-    string getFormParam(string name) {
-        REQUIRE(request_ != nullptr);
+    string getFormParam(const string& name) {
+        REQUIRE(!responded_);
 
-        if(form_) {
-            try {
-                return form_->get(name, "");
-            } catch(const Poco::Exception& e) {
-                WARNING_LOG(
-                    "Reading HTML form with Poco failed with exception ",
-                    "(defaulting to empty): ", e.displayText()
-                );
+        if(!formParams_.has_value()) {
+            // As with Poco::Net::HTMLForm, only POST requests have a form,
+            // and it includes the parameters in the query string
+            formParams_.emplace();
+            size_t queryStart = path_.find('?');
+            if(method_ == "POST" && queryStart != string::npos) {
+                parseURLEncodedForm(path_.substr(queryStart + 1), *formParams_);
+            }
+            parseURLEncodedForm(formBody_, *formParams_);
+        }
+
+        for(const pair<string, string>& param : *formParams_) {
+            if(param.first == name) {
+                return param.second;
             }
         }
         return "";
     }
 
-    shared_ptr<FileUpload> getFormFile(string name) {
-        REQUIRE(request_ != nullptr);
+    const string& body() {
+        REQUIRE(!responded_);
+        return formBody_;
+    }
+
+    shared_ptr<FileUpload> getFormFile(const string& name) {
+        REQUIRE(!responded_);
 
         auto it = files_.find(name);
         if(it == files_.end()) {
@@ -126,57 +564,100 @@ public:
         }
     }
 
+    bool supportsStreaming() {
+        REQUIRE(!responded_);
+        return supportsStreaming_;
+    }
+
     optional<string> getBasicAuthCredentials() {
-        REQUIRE(request_ != nullptr);
+        REQUIRE(!responded_);
+        return parseBasicAuthCredentials(authorization_);
+    }
+
+    optional<string> getCookie(const string& name) {
+        REQUIRE(!responded_);
+        return parseCookie(cookie_, name);
+    }
 
-        optional<string> empty;
+    void addResponseHeader(string name, string value) {
+        REQUIRE(!responded_);
+        responseHeaders_.emplace_back(move(name), move(value));
+    }
 
-        string scheme, authInfoBase64;
+    bool uploadCancelled() {
+        REQUIRE(!responded_);
+        return uploadCancelled_;
+    }
 
-        try {
-            if(!request_->hasCredentials()) {
-                return empty;
+    void sendHTMLResponse(
+        int status,
+        HTMLScatterList html,
+        bool noCache,
+        vector<pair<string, string>> extraHeaders
+    ) {
+        REQUIRE(!responded_);
+
+        // Compress using the cached compressed template fragments instead of
+        // compressing the whole page in sendResponse
+        if(html.size() >= MinCompressedSize) {
+            extraHeaders.emplace_back("Vary", "Accept-Encoding");
+            if(acceptsGzip_) {
+                html = gzipCompressHTML(html);
+                extraHeaders.emplace_back("Content-Encoding", "gzip");
             }
-            request_->getCredentials(scheme, authInfoBase64);
-        } catch(const Poco::Exception& e) {
-            WARNING_LOG(
-                "Reading HTTP auth credentials with Poco failed with exception ",
-                "(defaulting to none): ", e.displayText()
-            );
-            return empty;
         }
 
-        for(char& c : scheme) {
-            c = tolower(c);
-        }
-        if(scheme != "basic") {
-            return empty;
-        }
+        // The pieces point to static data or to the values owned by the list,
+        // so they stay valid as long as the list is kept alive
+        shared_ptr<HTMLScatterList> owner =
+            make_shared<HTMLScatterList>(move(html));
+        vector<ResponseBuffer> buffers;
+        buffers.reserve(owner->pieceCount());
+        owner->forEachPiece([&](const char* data, size_t size, bool isStatic) {
+            buffers.push_back({data, size, owner});
+        });
+        sendBuffers(
+            status,
+            "text/html; charset=UTF-8",
+            move(buffers),
+            noCache,
+            move(extraHeaders)
+        );
+    }
 
-        string authInfo;
+    void sendBuffers(
+        int status,
+        string contentType,
+        vector<ResponseBuffer> buffers,
+        bool noCache,
+        vector<pair<string, string>> extraHeaders
+    ) {
+        REQUIRE(!responded_);
 
-        try {
-            stringstream authInfoBase64SS(authInfoBase64);
-            Poco::Base64Decoder decoder(authInfoBase64SS);
-
-            size_t BufSize = 1024;
-            char buf[BufSize];
-            while(decoder.good()) {
-                decoder.read(buf, BufSize);
-                if(decoder.bad()) {
-                    return empty;
-                }
-                authInfo.append(buf, decoder.gcount());
-            }
-        } catch(const Poco::Exception& e) {
-            WARNING_LOG(
-                "Parsing HTTP basic auth credentials with Poco failed with exception ",
-                "(defaulting to none): ", e.displayText()
-            );
-            return empty;
+        uint64_t contentLength = 0;
+        for(const ResponseBuffer& buffer : buffers) {
+            contentLength += buffer.size;
         }
 
-        return authInfo;
+        responded_ = true;
+        addResponseHeaders_(extraHeaders);
+
+        Responder responder = move(responder_);
+        ResponseSpec spec = {
+            status,
+            move(contentType),
+            contentLength,
+            {},
+            noCache,
+            move(extraHeaders)
+        };
+        spec.body = [buffers](ostream& out) {
+            for(const ResponseBuffer& buffer : buffers) {
+                out.write((const char*)buffer.data, buffer.size);
+            }
+        };
+        spec.buffers = move(buffers);
+        responder(move(spec));
     }
 
     void sendResponse(
@@ -187,37 +668,125 @@ public:
         bool noCache,
         vector<pair<string, string>> extraHeaders
     ) {
-        REQUIRE(request_ != nullptr);
-        request_ = nullptr;
+        REQUIRE(!responded_);
+
+        if(
+            contentLength >= MinCompressedSize &&
+            isCompressibleContentType(contentType)
+        ) {
+            extraHeaders.emplace_back("Vary", "Accept-Encoding");
+            if(acceptsGzip_) {
+                stringstream bodySS;
+                body(bodySS);
+                shared_ptr<string> compressed =
+                    make_shared<string>(gzipCompress(bodySS.str()));
+                contentLength = compressed->size();
+                body = [compressed](ostream& out) {
+                    out << *compressed;
+                };
+                extraHeaders.emplace_back("Content-Encoding", "gzip");
+            }
+        }
 
-        try {
-            responderPromise_.set_value([
-                status,
-                contentType{move(contentType)},
-                contentLength,
-                body{move(body)},
-                noCache,
-                extraHeaders{move(extraHeaders)}
-            ](Poco::Net::HTTPServerResponse& response) {
-                response.add("Content-Type", contentType);
-                response.setContentLength64(contentLength);
-                if(noCache) {
-                    response.add("Cache-Control", "no-cache, no-store, must-revalidate");
-                    response.add("Pragma", "no-cache");
-                    response.add("Expires", "0");
-                }
-                for(const pair<string, string>& header : extraHeaders) {
-                    response.add(header.first, header.second);
-                }
-                response.setStatus((Poco::Net::HTTPResponse::HTTPStatus)status);
-                body(response.send());
-            });
-        } catch(const future_error& e) {
-            PANIC(
-                "Sending HTTP response to background thread failed with ",
-                "std::future error ", e.code(), ": ", e.what()
+        responded_ = true;
+        addResponseHeaders_(extraHeaders);
+
+        Responder responder = move(responder_);
+        responder({
+            status,
+            move(contentType),
+            contentLength,
+            move(body),
+            noCache,
+            move(extraHeaders)
+        });
+    }
+
+    void sendStreamResponse(
+        int status,
+        string contentType,
+        function<void(ostream&)> body,
+        vector<pair<string, string>> extraHeaders
+    ) {
+        REQUIRE(!responded_);
+        REQUIRE(supportsStreaming_);
+        responded_ = true;
+        addResponseHeaders_(extraHeaders);
+
+        Responder responder = move(responder_);
+        responder({
+            status,
+            move(contentType),
+            0,
+            move(body),
+            true,
+            move(extraHeaders),
+            true
+        });
+    }
+
+    bool sendFile(
+        string contentType,
+        string path,
+        bool noCache,
+        vector<pair<string, string>> extraHeaders
+    ) {
+        REQUIRE(!responded_);
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            return false;
+        }
+        struct stat st;
+        if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return false;
+        }
+        uint64_t size = (uint64_t)st.st_size;
+
+        int status = 200;
+        uint64_t start = 0;
+        uint64_t end = size;
+
+        // As we do not send validators, a conditional range request (If-Range)
+        // can never match and the whole file is sent instead
+        ByteRange range = ByteRange::Ignore;
+        if(range_.has_value() && !hasIfRange_) {
+            range = parseByteRange(*range_, size, start, end);
+        }
+
+        extraHeaders.emplace_back("Accept-Ranges", "bytes");
+        if(range == ByteRange::Unsatisfiable) {
+            close(fd);
+            extraHeaders.emplace_back("Content-Range", "bytes */" + toString(size));
+            sendTextResponse(
+                416, "ERROR: Requested range not satisfiable\n", noCache, move(extraHeaders)
             );
+            return true;
         }
+        if(range == ByteRange::Satisfiable) {
+            status = 206;
+            extraHeaders.emplace_back(
+                "Content-Range",
+                "bytes " + toString(start) + "-" + toString(end - 1) + "/" + toString(size)
+            );
+        }
+
+        responded_ = true;
+        addResponseHeaders_(extraHeaders);
+
+        Responder responder = move(responder_);
+        responder({
+            status,
+            move(contentType),
+            end - start,
+            {},
+            noCache,
+            move(extraHeaders),
+            false,
+            make_shared<FileBody>(fd, start)
+        });
+        return true;
     }
 
     void sendTextResponse(
@@ -226,7 +795,7 @@ public:
         bool noCache,
         vector<pair<string, string>> extraHeaders
     ) {
-        REQUIRE(request_ != nullptr);
+        REQUIRE(!responded_);
 
         uint64_t contentLength = text.size();
         sendResponse(
@@ -242,19 +811,34 @@ public:
     }
 
 private:
+    void addResponseHeaders_(vector<pair<string, string>>& extraHeaders) {
+        for(pair<string, string>& header : responseHeaders_) {
+            extraHeaders.push_back(move(header));
+        }
+        responseHeaders_.clear();
+    }
+
     AliveToken aliveToken_;
 
-    // nullptr after the response has been sent.
-    Poco::Net::HTTPServerRequest* request_;
+    bool responded_;
+    bool supportsStreaming_;
+    bool uploadCancelled_;
 
     string method_;
     string path_;
     string userAgent_;
-
-    unique_ptr<Poco::Net::HTMLForm> form_;
+    optional<string> authorization_;
+    optional<string> cookie_;
+    optional<string> range_;
+    bool hasIfRange_;
+    bool acceptsGzip_;
+
+    optional<vector<pair<string, string>>> formParams_;
+    string formBody_;
     map<string, shared_ptr<FileUpload>> files_;
 
-    promise<function<void(Poco::Net::HTTPServerResponse&)>> responderPromise_;
+    vector<pair<string, string>> responseHeaders_;
+    Responder responder_;
 };
 
 HTTPRequest::HTTPRequest(CKey, unique_ptr<Impl> impl)
@@ -263,29 +847,34 @@ HTTPRequest::HTTPRequest(CKey, unique_ptr<Impl> impl)
     REQUIRE(impl_);
 }
 
-string HTTPRequest::method() {
+const string& HTTPRequest::method() {
     REQUIRE_API_THREAD();
     return impl_->method();
 }
 
-string HTTPRequest::path() {
+const string& HTTPRequest::path() {
     REQUIRE_API_THREAD();
     return impl_->path();
 }
 
-string HTTPRequest::userAgent() {
+const string& HTTPRequest::userAgent() {
     REQUIRE_API_THREAD();
     return impl_->userAgent();
 }
 
-string HTTPRequest::getFormParam(string name) {
+string HTTPRequest::getFormParam(const string& name) {
+    REQUIRE_API_THREAD();
+    return impl_->getFormParam(name);
+}
+
+shared_ptr<FileUpload> HTTPRequest::getFormFile(const string& name) {
     REQUIRE_API_THREAD();
-    return impl_->getFormParam(move(name));
+    return impl_->getFormFile(name);
 }
 
-shared_ptr<FileUpload> HTTPRequest::getFormFile(string name) {
+const string& HTTPRequest::body() {
     REQUIRE_API_THREAD();
-    return impl_->getFormFile(move(name));
+    return impl_->body();
 }
 
 optional<string> HTTPRequest::getBasicAuthCredentials() {
@@ -293,6 +882,26 @@ optional<string> HTTPRequest::getBasicAuthCredentials() {
     return impl_->getBasicAuthCredentials();
 }
 
+optional<string> HTTPRequest::getCookie(const string& name) {
+    REQUIRE_API_THREAD();
+    return impl_->getCookie(name);
+}
+
+void HTTPRequest::addResponseHeader(string name, string value) {
+    REQUIRE_API_THREAD();
+    impl_->addResponseHeader(move(name), move(value));
+}
+
+bool HTTPRequest::uploadCancelled() {
+    REQUIRE_API_THREAD();
+    return impl_->uploadCancelled();
+}
+
+bool HTTPRequest::supportsStreaming() {
+    REQUIRE_API_THREAD();
+    return impl_->supportsStreaming();
+}
+
 void HTTPRequest::sendResponse(
     int status,
     string contentType,
@@ -312,56 +921,192 @@ void HTTPRequest::sendResponse(
     );
 }
 
-void HTTPRequest::sendTextResponse(
+void HTTPRequest::sendBuffers(
     int status,
-    string text,
+    string contentType,
+    vector<ResponseBuffer> buffers,
     bool noCache,
     vector<pair<string, string>> extraHeaders
 ) {
     REQUIRE_API_THREAD();
-    impl_->sendTextResponse(
+    impl_->sendBuffers(
         status,
-        move(text),
+        move(contentType),
+        move(buffers),
         noCache,
         move(extraHeaders)
     );
 }
 
-namespace http_ {
-
-struct FormPartHandler : public Poco::Net::PartHandler {
-    virtual void handlePart(
-        const Poco::Net::MessageHeader& header,
-        istream& dataStream
-    ) override {
-        string dispStr = header.get("Content-Disposition", "");
-        string dispVal;
-        Poco::Net::NameValueCollection disp;
-        header.splitParameters(dispStr, dispVal, disp);
-
-        for(char& c : dispVal) {
-            c = tolower(c);
-        }
-        if(dispVal != "form-data") {
-            return;
-        }
-
-        string name = disp.get("name", "");
-        string filename = disp.get("filename", "");
+void HTTPRequest::sendHTMLResponse_(
+    int status,
+    HTMLScatterList html,
+    bool noCache,
+    vector<pair<string, string>> extraHeaders
+) {
+    REQUIRE_API_THREAD();
+    impl_->sendHTMLResponse(
+        status,
+        move(html),
+        noCache,
+        move(extraHeaders)
+    );
+}
 
-        if(filename.empty()) {
-            return;
-        }
+void HTTPRequest::sendStreamResponse(
+    int status,
+    string contentType,
+    function<void(ostream&)> body,
+    vector<pair<string, string>> extraHeaders
+) {
+    REQUIRE_API_THREAD();
+    impl_->sendStreamResponse(
+        status,
+        move(contentType),
+        move(body),
+        move(extraHeaders)
+    );
+}
 
-        REQUIRE(storage);
-        shared_ptr<FileUpload> file = storage->upload(filename, dataStream);
-        if(file) {
-            files->emplace(name, file);
-        }
+bool HTTPRequest::sendFile(
+    string contentType,
+    string path,
+    bool noCache,
+    vector<pair<string, string>> extraHeaders
+) {
+    REQUIRE_API_THREAD();
+    return impl_->sendFile(
+        move(contentType),
+        move(path),
+        noCache,
+        move(extraHeaders)
+    );
+}
+
+void HTTPRequest::sendTextResponse(
+    int status,
+    string text,
+    bool noCache,
+    vector<pair<string, string>> extraHeaders
+) {
+    REQUIRE_API_THREAD();
+    impl_->sendTextResponse(
+        status,
+        move(text),
+        noCache,
+        move(extraHeaders)
+    );
+}
+
+namespace http_ {
+
+// Updates the progress of an upload request and reports it to the event
+// handler, at most once per ProgressInterval, at the start and at the end.
+class UploadProgressReporter {
+public:
+    UploadProgressReporter(
+        weak_ptr<HTTPServerEventHandler> eventHandler,
+        shared_ptr<HTTPUploadProgress> progress
+    )
+        : eventHandler_(eventHandler),
+          progress_(progress)
+    {}
+
+    void update(uint64_t receivedBytes) {
+        progress_->receivedBytes_.store(receivedBytes, memory_order_relaxed);
+
+        steady_clock::time_point now = steady_clock::now();
+        if(
+            !lastReport_.has_value() ||
+            now - *lastReport_ >= ProgressInterval ||
+            receivedBytes >= progress_->totalBytes_
+        ) {
+            lastReport_ = now;
+            postTask(
+                eventHandler_,
+                &HTTPServerEventHandler::onHTTPServerUploadProgress,
+                progress_
+            );
+        }
+    }
+
+    bool isCancelled() {
+        return progress_->isCancelled();
+    }
+
+private:
+    static constexpr steady_clock::duration ProgressInterval = milliseconds(250);
+
+    weak_ptr<HTTPServerEventHandler> eventHandler_;
+    shared_ptr<HTTPUploadProgress> progress_;
+    optional<steady_clock::time_point> lastReport_;
+};
+
+// The state of receiving a multipart/form-data request body.
+struct UploadState {
+    UploadState(
+        weak_ptr<HTTPServerEventHandler> eventHandler,
+        const Poco::Net::HTTPRequest& request,
+        string boundary,
+        shared_ptr<UploadStorage> storage,
+        uint64_t maxUploadSize
+    )
+        : parser(move(boundary), storage, maxUploadSize),
+          reporter(
+              eventHandler,
+              HTTPUploadProgress::create(
+                  request.getURI(),
+                  request.has(Poco::Net::HTTPRequest::AUTHORIZATION)
+                      ? optional<string>(request.get(Poco::Net::HTTPRequest::AUTHORIZATION))
+                      : optional<string>(),
+                  request.has("Cookie")
+                      ? optional<string>(request.get("Cookie"))
+                      : optional<string>(),
+                  (uint64_t)max(request.getContentLength64(), (int64_t)0)
+              )
+          ),
+          receivedBytes(0),
+          failed(false)
+    {}
+
+    // Feeds data received so far to the parser; returns false if receiving
+    // should be stopped.
+    bool feed(const char* data, size_t size) {
+        receivedBytes += size;
+        if(!failed && !parser.feed(data, size)) {
+            if(parser.fileSizeExceeded()) {
+                return false;
+            }
+            WARNING_LOG("Parsing multipart form data failed (ignoring the rest)");
+            failed = true;
+        }
+        reporter.update(receivedBytes);
+        return !reporter.isCancelled();
+    }
+
+    // Completes the upload after the body has been received or receiving was
+    // stopped, returning the form parameters parsed so far. Returns true if
+    // the upload was cancelled, in which case the files are dropped.
+    bool finish(
+        optional<vector<pair<string, string>>>& formParams,
+        map<string, shared_ptr<FileUpload>>& files
+    ) {
+        bool cancelled = reporter.isCancelled();
+        if(!failed && !cancelled && !parser.finish()) {
+            WARNING_LOG("Multipart form data ended prematurely");
+        }
+
+        formParams = parser.params();
+        if(!cancelled) {
+            swap(files, parser.files());
+        }
+        return cancelled;
     }
 
-    shared_ptr<UploadStorage> storage;
-    map<string, shared_ptr<FileUpload>>* files;
+    MultipartFormParser parser;
+    UploadProgressReporter reporter;
+    uint64_t receivedBytes;
+    bool failed;
 };
 
 class HTTPRequestHandler : public Poco::Net::HTTPRequestHandler {
@@ -370,12 +1115,16 @@ public:
         weak_ptr<HTTPServerEventHandler> eventHandler,
         shared_ptr<TaskQueue> taskQueue,
         shared_ptr<UploadStorage> uploadStorage,
+        uint64_t maxUploadSize,
+        shared_ptr<ConnectionStats> stats,
         AliveToken aliveToken
     )
         : aliveToken_(aliveToken),
           eventHandler_(eventHandler),
           taskQueue_(taskQueue),
-          uploadStorage_(uploadStorage)
+          uploadStorage_(uploadStorage),
+          maxUploadSize_(maxUploadSize),
+          stats_(stats)
     {}
 
     virtual void handleRequest(
@@ -384,35 +1133,63 @@ public:
     ) override {
         ActiveTaskQueueLock activeTaskQueueLock(taskQueue_);
 
-        unique_ptr<Poco::Net::HTMLForm> form;
+        stats_->requestCount.fetch_add(1, memory_order_relaxed);
+
+        optional<vector<pair<string, string>>> formParams;
+        string formBody;
         map<string, shared_ptr<FileUpload>> files;
-        try {
-            if(request.getMethod() == "POST") {
-                FormPartHandler partHandler;
-                partHandler.storage = uploadStorage_;
-                partHandler.files = &files;
-                form = make_unique<Poco::Net::HTMLForm>(
-                    request, request.stream(), partHandler
-                );
-            }
-        } catch(const Poco::Exception& e) {
-            WARNING_LOG(
-                "Parsing HTML form with Poco failed with exception ",
-                "(defaulting to empty): ", e.displayText()
+        bool uploadCancelled = false;
+
+        optional<string> boundary;
+        if(request.getMethod() == "POST") {
+            boundary = MultipartFormParser::parseBoundary(request.getContentType());
+        }
+        if(boundary.has_value()) {
+            UploadState upload(
+                eventHandler_, request, move(*boundary), uploadStorage_, maxUploadSize_
             );
+            if(!receiveUpload_(request.stream(), upload)) {
+                response.setKeepAlive(false);
+                response.setStatus((Poco::Net::HTTPResponse::HTTPStatus)413);
+                response.setContentType("text/plain; charset=UTF-8");
+                response.send() << "ERROR: Uploaded file is too large\n";
+                return;
+            }
+            uploadCancelled = upload.finish(formParams, files);
+        } else if(request.getMethod() == "POST") {
+            // The body is only parsed if the form is accessed
+            if(!receiveFormBody_(request.stream(), formBody)) {
+                response.setKeepAlive(false);
+                response.setStatus((Poco::Net::HTTPResponse::HTTPStatus)413);
+                response.setContentType("text/plain; charset=UTF-8");
+                response.send() << "ERROR: Request body is too large\n";
+                return;
+            }
         }
 
-        promise<function<void(Poco::Net::HTTPServerResponse&)>> responderPromise;
-        future<function<void(Poco::Net::HTTPServerResponse&)>> responderFuture =
-            responderPromise.get_future();
+        shared_ptr<promise<ResponseSpec>> responsePromise =
+            make_shared<promise<ResponseSpec>>();
+        future<ResponseSpec> responseFuture = responsePromise->get_future();
 
         {
             shared_ptr<HTTPRequest> reqObj = HTTPRequest::create(
                 make_unique<HTTPRequest::Impl>(
                     request,
-                    move(form),
+                    move(formParams),
+                    move(formBody),
                     move(files),
-                    move(responderPromise),
+                    uploadCancelled,
+                    [responsePromise](ResponseSpec spec) {
+                        try {
+                            responsePromise->set_value(move(spec));
+                        } catch(const future_error& e) {
+                            PANIC(
+                                "Sending HTTP response to background thread failed with ",
+                                "std::future error ", e.code(), ": ", e.what()
+                            );
+                        }
+                    },
+                    true,
                     aliveToken_
                 )
             );
@@ -423,9 +1200,9 @@ public:
             );
         }
 
-        function<void(Poco::Net::HTTPServerResponse&)> responder;
+        ResponseSpec spec;
         try {
-            responder = responderFuture.get();
+            spec = responseFuture.get();
         } catch(const future_error& e) {
             PANIC(
                 "Receiving HTTP response object from the handler failed with ",
@@ -433,20 +1210,892 @@ public:
             );
         }
 
-        responder(response);
+        PROBE(http_response_start, (uint64_t)&response, spec.status);
+        spec.setHeaders(response);
+        if(uploadCancelled) {
+            // The rest of the request body has not been read
+            response.setKeepAlive(false);
+        }
+        if(spec.file) {
+            sendFileBody_(request, response, spec);
+        } else if(!spec.buffers.empty()) {
+            sendBuffersBody_(request, response, spec);
+        } else {
+            spec.body(response.send());
+        }
+        PROBE(http_response_end, (uint64_t)&response);
     }
 
 private:
+    // Returns false if the uploaded files exceeded the size limit.
+    // Reads a non-multipart request body to formBody; returns false if the
+    // body is larger than MaxFormBodySize.
+    bool receiveFormBody_(istream& body, string& formBody) {
+        const size_t BufSize = 1 << 16;
+        char buf[BufSize];
+        try {
+            while(body.good()) {
+                body.read(buf, BufSize);
+                if(body.bad()) {
+                    WARNING_LOG("Reading request body stream failed");
+                    return true;
+                }
+                if(formBody.size() + (size_t)body.gcount() > MaxFormBodySize) {
+                    return false;
+                }
+                formBody.append(buf, (size_t)body.gcount());
+            }
+        } catch(...) {
+            WARNING_LOG("Reading request body stream failed with exception");
+        }
+        return true;
+    }
+
+    bool receiveUpload_(istream& body, UploadState& upload) {
+        const size_t BufSize = 1 << 16;
+        char buf[BufSize];
+        try {
+            while(body.good()) {
+                body.read(buf, BufSize);
+                if(body.bad()) {
+                    WARNING_LOG("Reading file upload stream failed");
+                    return true;
+                }
+                if(!upload.feed(buf, (size_t)body.gcount())) {
+                    return !upload.parser.fileSizeExceeded();
+                }
+            }
+        } catch(...) {
+            WARNING_LOG("Reading file upload stream failed with exception");
+        }
+        return true;
+    }
+
+    void sendFileBody_(
+        Poco::Net::HTTPServerRequest& request,
+        Poco::Net::HTTPServerResponse& response,
+        const ResponseSpec& spec
+    ) {
+        ostream& out = response.send();
+        if(request.getMethod() == Poco::Net::HTTPRequest::HTTP_HEAD) {
+            return;
+        }
+
+        uint64_t offset = spec.file->offset;
+        uint64_t length = spec.contentLength;
+
+        Poco::Net::HTTPServerRequestImpl* requestImpl =
+            dynamic_cast<Poco::Net::HTTPServerRequestImpl*>(&request);
+        if(requestImpl != nullptr) {
+            // Flush the headers and send the body directly to the socket
+            out.flush();
+            int sockFd = requestImpl->socket().impl()->sockfd();
+            if(!sendFileToSocket(sockFd, spec.file->fd, offset, length)) {
+                // The response is incomplete, so the connection cannot be
+                // reused
+                shutdown(sockFd, SHUT_RDWR);
+            }
+            return;
+        }
+
+        const size_t BufSize = 1 << 16;
+        char buf[BufSize];
+        while(length && out.good()) {
+            ssize_t count = pread(
+                spec.file->fd, buf, (size_t)min(length, (uint64_t)BufSize), (off_t)offset
+            );
+            if(count <= 0) {
+                ERROR_LOG("Reading file for HTTP response body failed");
+                return;
+            }
+            out.write(buf, count);
+            offset += (uint64_t)count;
+            length -= (uint64_t)count;
+        }
+    }
+
+    void sendBuffersBody_(
+        Poco::Net::HTTPServerRequest& request,
+        Poco::Net::HTTPServerResponse& response,
+        const ResponseSpec& spec
+    ) {
+        ostream& out = response.send();
+        if(request.getMethod() == Poco::Net::HTTPRequest::HTTP_HEAD) {
+            return;
+        }
+
+        Poco::Net::HTTPServerRequestImpl* requestImpl =
+            dynamic_cast<Poco::Net::HTTPServerRequestImpl*>(&request);
+        if(
+            requestImpl != nullptr &&
+            spec.contentLength >= MinDirectBufferBodySize
+        ) {
+            // Flush the headers and send the body directly to the socket
+            out.flush();
+            int sockFd = requestImpl->socket().impl()->sockfd();
+            size_t idx = 0;
+            size_t offset = 0;
+            if(!sendBuffersToSocket(sockFd, spec.buffers, idx, offset)) {
+                // The response is incomplete, so the connection cannot be
+                // reused
+                shutdown(sockFd, SHUT_RDWR);
+            }
+            return;
+        }
+
+        spec.body(out);
+    }
+
     AliveToken aliveToken_;
     weak_ptr<HTTPServerEventHandler> eventHandler_;
     shared_ptr<TaskQueue> taskQueue_;
     shared_ptr<UploadStorage> uploadStorage_;
+    uint64_t maxUploadSize_;
+    shared_ptr<ConnectionStats> stats_;
+};
+
+// Single-threaded event-driven HTTP server (HTTPServer in event mode). The
+// connections are served by one thread using epoll, and a request waiting for
+// the response from the API thread does not occupy a thread; the response is
+// handed back to the event loop through an eventfd. The request headers are
+// parsed and the response headers are written using Poco, but the request
+// bodies and responses are fully buffered in memory, except for file responses
+// (HTTPRequest::sendFile), which are sent directly from the file using
+// sendfile.
+class EventHTTPServer {
+SHARED_ONLY_CLASS(EventHTTPServer);
+public:
+    EventHTTPServer(CKey,
+        weak_ptr<HTTPServerEventHandler> eventHandler,
+        shared_ptr<TaskQueue> taskQueue,
+        int listenFd,
+        steady_clock::duration keepAliveTimeout,
+        int maxKeepAliveRequests,
+        uint64_t maxUploadSize,
+        vector<int> cpus,
+        shared_ptr<ConnectionStats> stats,
+        AliveToken aliveToken
+    )
+        : aliveToken_(aliveToken),
+          eventHandler_(eventHandler),
+          taskQueue_(taskQueue),
+          keepAliveTimeout_(keepAliveTimeout),
+          maxKeepAliveRequests_(maxKeepAliveRequests),
+          maxUploadSize_(maxUploadSize),
+          cpus_(move(cpus)),
+          stats_(stats),
+          listenFd_(listenFd),
+          stopping_(false),
+          nextConnID_(FirstConnID)
+    {
+        uploadStorage_ = UploadStorage::create();
+
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        if(epollFd_ == -1) {
+            PANIC("Creating epoll instance failed: ", strerror(errno));
+        }
+        wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wakeFd_ == -1) {
+            PANIC("Creating eventfd failed: ", strerror(errno));
+        }
+
+        epollCtl_(EPOLL_CTL_ADD, listenFd_, ListenID, EPOLLIN);
+        epollCtl_(EPOLL_CTL_ADD, wakeFd_, WakeID, EPOLLIN);
+    }
+
+    ~EventHTTPServer() {
+        REQUIRE(!loopThread_.joinable());
+        close(wakeFd_);
+        close(epollFd_);
+    }
+
+    // Stops accepting new connections and waits for the event loop to stop. The
+    // current connections are given a grace time of 1s to finish the requests
+    // before they are closed. Blocks the calling thread.
+    void stop() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_();
+        loopThread_.join();
+    }
+
+private:
+    static constexpr uint64_t ListenID = 0;
+    static constexpr uint64_t WakeID = 1;
+    static constexpr uint64_t FirstConnID = 2;
+
+    static constexpr size_t MaxHeaderSize = 64 * 1024;
+    static constexpr uint64_t MaxBodySize = 256 * 1024 * 1024;
+
+    // Timeout for connections that are receiving a request or sending a
+    // response.
+    static constexpr steady_clock::duration TransferTimeout = milliseconds(60000);
+
+    struct Connection {
+        int fd;
+        int requestCount;
+
+        // Reading: receiving the next request to inBuf.
+        // Waiting: the request has been passed to the event handler and the
+        //     response has not yet been received.
+        // Writing: sending outBuf.
+        enum {Reading, Waiting, Writing} state;
+        steady_clock::time_point lastActivity;
+
+        string inBuf;
+
+        // Set once the client has shut down its side of the connection; the
+        // request in inBuf (if complete) is still served, after which the
+        // connection is closed.
+        bool inputClosed;
+
+        // The headers of the request currently being received (set once they
+        // are complete).
+        unique_ptr<Poco::Net::HTTPRequest> request;
+        size_t bodyStart;
+        uint64_t bodyLength;
+        bool continueSent;
+
+        // Set if the request is a file upload; its body is fed to the parser
+        // and removed from inBuf as it is received.
+        unique_ptr<UploadState> upload;
+
+        string version;
+        bool keepAlive;
+        bool isHead;
+
+        string outBuf;
+        size_t outPos;
+
+        // The file response body sent after outBuf, if any.
+        shared_ptr<FileBody> file;
+        uint64_t fileOffset;
+        uint64_t fileLeft;
+
+        // The buffers of the response body sent after outBuf, if any (see
+        // ResponseSpec::buffers); if nonempty, the first buffer is the unsent
+        // part of outBuf so that the headers and body are sent together.
+        vector<ResponseBuffer> buffers;
+        size_t bufferIdx;
+        size_t bufferOffset;
+    };
+
+    void epollCtl_(int op, int fd, uint64_t id, uint32_t events) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.u64 = id;
+        if(epoll_ctl(epollFd_, op, fd, &event) == -1) {
+            PANIC("Updating epoll interest list failed: ", strerror(errno));
+        }
+    }
+
+    void wake_() {
+        uint64_t val = 1;
+        if(write(wakeFd_, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+            PANIC("Writing to eventfd failed: ", strerror(errno));
+        }
+    }
+
+    // Called through the responder of the request with given connection ID
+    // (from the API thread).
+    void postResponse_(uint64_t connID, ResponseSpec spec) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            responses_.emplace_back(connID, move(spec));
+        }
+        wake_();
+    }
+
+    void runLoop_() {
+        if(!cpus_.empty()) {
+            setCurrentThreadCPUs(cpus_);
+        }
+        ActiveTaskQueueLock activeTaskQueueLock(taskQueue_);
+
+        bool listening = true;
+        bool acceptPaused = false;
+        optional<steady_clock::time_point> stopDeadline;
+        steady_clock::time_point lastTimeoutCheck = steady_clock::now();
+
+        const int MaxEvents = 64;
+        epoll_event events[MaxEvents];
+
+        while(true) {
+            int eventCount = epoll_wait(epollFd_, events, MaxEvents, 100);
+            if(eventCount == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                PANIC("Waiting for epoll events failed: ", strerror(errno));
+            }
+
+            for(int i = 0; i < eventCount; ++i) {
+                uint64_t id = events[i].data.u64;
+                if(id == ListenID) {
+                    if(!acceptConnections_()) {
+                        // Out of file descriptors; retry once a connection
+                        // has been closed or on the next timeout check
+                        epollCtl_(EPOLL_CTL_DEL, listenFd_, ListenID, 0);
+                        acceptPaused = true;
+                    }
+                } else if(id == WakeID) {
+                    uint64_t val;
+                    if(read(wakeFd_, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+                        PANIC("Reading from eventfd failed: ", strerror(errno));
+                    }
+                } else {
+                    handleConnectionEvent_(id, events[i].events);
+                }
+            }
+
+            vector<pair<uint64_t, ResponseSpec>> responses;
+            bool stopping;
+            {
+                lock_guard<mutex> lock(mutex_);
+                swap(responses, responses_);
+                stopping = stopping_;
+            }
+            for(pair<uint64_t, ResponseSpec>& response : responses) {
+                handleResponse_(response.first, move(response.second));
+            }
+
+            steady_clock::time_point now = steady_clock::now();
+
+            if(stopping && listening) {
+                if(!acceptPaused) {
+                    epollCtl_(EPOLL_CTL_DEL, listenFd_, ListenID, 0);
+                }
+                listening = false;
+                stopDeadline = now + milliseconds(1000);
+
+                // Idle keep-alive connections can be closed immediately
+                vector<uint64_t> idleConns;
+                for(const auto& item : conns_) {
+                    const Connection& conn = *item.second;
+                    if(conn.state == Connection::Reading && conn.inBuf.empty() && !conn.request) {
+                        idleConns.push_back(item.first);
+                    }
+                }
+                for(uint64_t connID : idleConns) {
+                    closeConnection_(connID);
+                }
+            }
+            if(stopDeadline.has_value() && (conns_.empty() || now >= *stopDeadline)) {
+                break;
+            }
+
+            if(now - lastTimeoutCheck >= milliseconds(1000)) {
+                lastTimeoutCheck = now;
+                closeTimedOutConnections_(now);
+                if(listening && acceptPaused) {
+                    epollCtl_(EPOLL_CTL_ADD, listenFd_, ListenID, EPOLLIN);
+                    acceptPaused = false;
+                }
+            }
+        }
+
+        while(!conns_.empty()) {
+            closeConnection_(conns_.begin()->first);
+        }
+        {
+            AliveToken dropped = move(aliveToken_);
+        }
+    }
+
+    // Returns false if accepting was stopped due to running out of file
+    // descriptors.
+    bool acceptConnections_() {
+        while(true) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd == -1) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return true;
+                }
+                if(errno == ECONNABORTED || errno == EPROTO) {
+                    continue;
+                }
+                WARNING_LOG("Accepting HTTP connection failed: ", strerror(errno));
+                return !(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM);
+            }
+
+            // The responses are written as a whole, so there is no use in
+            // delaying the last segment
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            stats_->connectionCount.fetch_add(1, memory_order_relaxed);
+
+            uint64_t connID = nextConnID_++;
+            unique_ptr<Connection> conn = make_unique<Connection>();
+            conn->fd = fd;
+            conn->requestCount = 0;
+            conn->lastActivity = steady_clock::now();
+            conn->inputClosed = false;
+            startReading_(*conn);
+            epollCtl_(EPOLL_CTL_ADD, fd, connID, EPOLLIN | EPOLLRDHUP);
+            conns_.emplace(connID, move(conn));
+        }
+    }
+
+    void startReading_(Connection& conn) {
+        conn.state = Connection::Reading;
+        conn.request.reset();
+        conn.bodyStart = 0;
+        conn.bodyLength = 0;
+        conn.continueSent = false;
+        conn.upload.reset();
+        conn.version = Poco::Net::HTTPMessage::HTTP_1_1;
+        conn.keepAlive = false;
+        conn.isHead = false;
+        conn.outBuf.clear();
+        conn.outPos = 0;
+        conn.file.reset();
+        conn.fileOffset = 0;
+        conn.fileLeft = 0;
+        conn.buffers.clear();
+        conn.bufferIdx = 0;
+        conn.bufferOffset = 0;
+    }
+
+    void closeConnection_(uint64_t connID) {
+        auto it = conns_.find(connID);
+        REQUIRE(it != conns_.end());
+        close(it->second->fd);
+        conns_.erase(it);
+    }
+
+    void closeTimedOutConnections_(steady_clock::time_point now) {
+        vector<uint64_t> timedOut;
+        for(const auto& item : conns_) {
+            const Connection& conn = *item.second;
+            steady_clock::duration timeout;
+            if(conn.state == Connection::Reading && conn.inBuf.empty() && !conn.request) {
+                timeout = keepAliveTimeout_;
+            } else if(conn.state == Connection::Waiting) {
+                continue;
+            } else {
+                timeout = TransferTimeout;
+            }
+            if(now - conn.lastActivity >= timeout) {
+                timedOut.push_back(item.first);
+            }
+        }
+        for(uint64_t connID : timedOut) {
+            closeConnection_(connID);
+        }
+    }
+
+    void handleConnectionEvent_(uint64_t connID, uint32_t events) {
+        auto it = conns_.find(connID);
+        if(it == conns_.end()) {
+            return;
+        }
+        Connection& conn = *it->second;
+
+        if(events & (EPOLLERR | EPOLLHUP)) {
+            // The connection is broken; if a response is pending, it will be
+            // dropped once it arrives
+            closeConnection_(connID);
+        } else if(conn.state == Connection::Reading && (events & (EPOLLIN | EPOLLRDHUP))) {
+            if(!readInput_(conn)) {
+                closeConnection_(connID);
+                return;
+            }
+            conn.lastActivity = steady_clock::now();
+            processInput_(connID, conn);
+
+            // processInput_ may have closed the connection
+            it = conns_.find(connID);
+            if(
+                it != conns_.end() &&
+                it->second->state == Connection::Reading &&
+                it->second->inputClosed
+            ) {
+                // The rest of the request is never going to arrive
+                closeConnection_(connID);
+            }
+        } else if(conn.state == Connection::Writing && (events & EPOLLOUT)) {
+            writeOutput_(connID, conn);
+        } else if(conn.state == Connection::Waiting && (events & EPOLLRDHUP)) {
+            // The client has shut down its side of the connection (it may
+            // still be waiting for the response); we stop polling for input
+            // and close the connection after writing the response
+            conn.inputClosed = true;
+            epollCtl_(EPOLL_CTL_MOD, conn.fd, connID, 0);
+        }
+    }
+
+    // Reads all the available input to inBuf, setting inputClosed if the client
+    // has shut down its side. Returns false if the connection should be closed.
+    bool readInput_(Connection& conn) {
+        while(true) {
+            const size_t ChunkSize = 64 * 1024;
+            size_t oldSize = conn.inBuf.size();
+            conn.inBuf.resize(oldSize + ChunkSize);
+            ssize_t count = recv(conn.fd, &conn.inBuf[oldSize], ChunkSize, 0);
+            conn.inBuf.resize(oldSize + (size_t)max(count, (ssize_t)0));
+
+            if(count > 0) {
+                if(conn.inBuf.size() > MaxHeaderSize + MaxBodySize) {
+                    return false;
+                }
+                continue;
+            }
+            if(count == 0) {
+                conn.inputClosed = true;
+                return true;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+
+    // Parses the request in inBuf if it is complete and passes it to the event
+    // handler.
+    void processInput_(uint64_t connID, Connection& conn) {
+        REQUIRE(conn.state == Connection::Reading);
+
+        if(!conn.request) {
+            size_t headerEnd = conn.inBuf.find("\r\n\r\n");
+            if(headerEnd == string::npos) {
+                if(conn.inBuf.size() > MaxHeaderSize) {
+                    sendError_(connID, conn, 431, "ERROR: Request headers too large\n");
+                }
+                return;
+            }
+            conn.bodyStart = headerEnd + 4;
+
+            conn.request = make_unique<Poco::Net::HTTPRequest>();
+            try {
+                stringstream headerStream(conn.inBuf.substr(0, conn.bodyStart));
+                conn.request->read(headerStream);
+                if(conn.request->getChunkedTransferEncoding()) {
+                    sendError_(
+                        connID, conn, 411,
+                        "ERROR: Chunked request bodies are not supported\n"
+                    );
+                    return;
+                }
+                int64_t contentLength = conn.request->getContentLength64();
+                conn.bodyLength = (uint64_t)max(contentLength, (int64_t)0);
+            } catch(const Poco::Exception&) {
+                sendError_(connID, conn, 400, "ERROR: Malformed request\n");
+                return;
+            }
+
+            optional<string> boundary;
+            if(conn.request->getMethod() == "POST") {
+                boundary = MultipartFormParser::parseBoundary(
+                    conn.request->getContentType()
+                );
+            }
+            if(boundary.has_value()) {
+                // File uploads are written to disk as they are received, so
+                // only the upload size limit applies to them
+                conn.upload = make_unique<UploadState>(
+                    eventHandler_,
+                    *conn.request,
+                    move(*boundary),
+                    uploadStorage_,
+                    maxUploadSize_
+                );
+                conn.inBuf.erase(0, conn.bodyStart);
+                conn.bodyStart = 0;
+            } else if(conn.bodyLength > MaxBodySize) {
+                sendError_(connID, conn, 413, "ERROR: Request body too large\n");
+                return;
+            }
+        }
+
+        bool bodyComplete;
+        if(conn.upload) {
+            UploadState& upload = *conn.upload;
+            size_t count = (size_t)min(
+                (uint64_t)conn.inBuf.size(), conn.bodyLength - upload.receivedBytes
+            );
+            if(count != 0) {
+                bool ok = upload.feed(conn.inBuf.data(), count);
+                conn.inBuf.erase(0, count);
+                if(!ok && upload.parser.fileSizeExceeded()) {
+                    sendError_(connID, conn, 413, "ERROR: Uploaded file is too large\n");
+                    return;
+                }
+            }
+            bodyComplete =
+                upload.receivedBytes == conn.bodyLength ||
+                upload.reporter.isCancelled();
+        } else {
+            bodyComplete = conn.inBuf.size() - conn.bodyStart >= conn.bodyLength;
+        }
+
+        if(!bodyComplete) {
+            if(!conn.continueSent && conn.request->getExpectContinue()) {
+                conn.continueSent = true;
+                const char* msg = "HTTP/1.1 100 Continue\r\n\r\n";
+                if(send(conn.fd, msg, strlen(msg), MSG_NOSIGNAL) != (ssize_t)strlen(msg)) {
+                    closeConnection_(connID);
+                }
+            }
+            return;
+        }
+
+        optional<vector<pair<string, string>>> formParams;
+        string formBody;
+        map<string, shared_ptr<FileUpload>> files;
+        bool uploadCancelled = false;
+
+        unique_ptr<UploadState> upload = move(conn.upload);
+        if(upload) {
+            uploadCancelled = upload->finish(formParams, files);
+            upload.reset();
+            if(uploadCancelled) {
+                // The rest of the body is not going to be read
+                conn.inBuf.clear();
+            }
+        } else {
+            formBody = conn.inBuf.substr(conn.bodyStart, conn.bodyLength);
+            conn.inBuf.erase(0, conn.bodyStart + conn.bodyLength);
+        }
+
+        unique_ptr<Poco::Net::HTTPRequest> request = move(conn.request);
+        conn.state = Connection::Waiting;
+        ++conn.requestCount;
+        stats_->requestCount.fetch_add(1, memory_order_relaxed);
+
+        conn.version = request->getVersion();
+        conn.keepAlive =
+            !uploadCancelled &&
+            request->getKeepAlive() &&
+            keepAliveTimeout_ > steady_clock::duration::zero() &&
+            (maxKeepAliveRequests_ == 0 || conn.requestCount < maxKeepAliveRequests_);
+        conn.isHead = request->getMethod() == Poco::Net::HTTPRequest::HTTP_HEAD;
+        epollCtl_(EPOLL_CTL_MOD, conn.fd, connID, conn.inputClosed ? 0 : EPOLLRDHUP);
+
+        if(request->getMethod() != "POST") {
+            formBody.clear();
+        }
+
+        weak_ptr<EventHTTPServer> self = self_;
+        shared_ptr<HTTPRequest> reqObj = HTTPRequest::create(
+            make_unique<HTTPRequest::Impl>(
+                *request,
+                move(formParams),
+                move(formBody),
+                move(files),
+                uploadCancelled,
+                [self, connID](ResponseSpec spec) {
+                    if(shared_ptr<EventHTTPServer> server = self.lock()) {
+                        server->postResponse_(connID, move(spec));
+                    }
+                },
+                false,
+                aliveToken_
+            )
+        );
+        postTask(
+            eventHandler_,
+            &HTTPServerEventHandler::onHTTPServerRequest,
+            reqObj
+        );
+    }
+
+    void handleResponse_(uint64_t connID, ResponseSpec spec) {
+        auto it = conns_.find(connID);
+        if(it == conns_.end()) {
+            // The connection has already been closed
+            return;
+        }
+        Connection& conn = *it->second;
+        REQUIRE(conn.state == Connection::Waiting);
+
+        bool stopping;
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping = stopping_;
+        }
+
+        PROBE(http_response_start, connID, spec.status);
+
+        Poco::Net::HTTPResponse response;
+        response.setVersion(conn.version);
+        spec.setHeaders(response);
+        response.setKeepAlive(conn.keepAlive && !stopping && !conn.inputClosed);
+
+        stringstream out;
+        response.write(out);
+        if(conn.isHead) {
+            // No body
+        } else if(spec.file) {
+            conn.file = spec.file;
+            conn.fileOffset = spec.file->offset;
+            conn.fileLeft = spec.contentLength;
+        } else if(!spec.buffers.empty()) {
+            conn.buffers = move(spec.buffers);
+        } else {
+            try {
+                spec.body(out);
+            } catch(const exception& e) {
+                WARNING_LOG(
+                    "Writing HTTP response body failed with exception: ", e.what()
+                );
+                closeConnection_(connID);
+                return;
+            }
+        }
+
+        conn.keepAlive = response.getKeepAlive();
+        startWriting_(connID, conn, out.str());
+    }
+
+    void sendError_(uint64_t connID, Connection& conn, int status, string text) {
+        Poco::Net::HTTPResponse response;
+        response.setVersion(Poco::Net::HTTPMessage::HTTP_1_1);
+        ResponseSpec spec = {
+            status, "text/plain; charset=UTF-8", text.size(), {}, true, {}
+        };
+        spec.setHeaders(response);
+        response.setKeepAlive(false);
+
+        stringstream out;
+        response.write(out);
+        out << text;
+
+        conn.keepAlive = false;
+        startWriting_(connID, conn, out.str());
+    }
+
+    void startWriting_(uint64_t connID, Connection& conn, string data) {
+        conn.state = Connection::Writing;
+        conn.lastActivity = steady_clock::now();
+        conn.outBuf = move(data);
+        conn.outPos = 0;
+        if(!conn.buffers.empty()) {
+            conn.buffers.insert(
+                conn.buffers.begin(),
+                {conn.outBuf.data(), conn.outBuf.size(), nullptr}
+            );
+            conn.outPos = conn.outBuf.size();
+            conn.bufferIdx = 0;
+            conn.bufferOffset = 0;
+        }
+        epollCtl_(EPOLL_CTL_MOD, conn.fd, connID, EPOLLOUT);
+        writeOutput_(connID, conn);
+    }
+
+    void writeOutput_(uint64_t connID, Connection& conn) {
+        REQUIRE(conn.state == Connection::Writing);
+
+        while(conn.outPos < conn.outBuf.size()) {
+            ssize_t count = send(
+                conn.fd,
+                conn.outBuf.data() + conn.outPos,
+                conn.outBuf.size() - conn.outPos,
+                MSG_NOSIGNAL
+            );
+            if(count > 0) {
+                conn.outPos += (size_t)count;
+                conn.lastActivity = steady_clock::now();
+            } else if(count == -1 && errno == EINTR) {
+                continue;
+            } else if(count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            } else {
+                closeConnection_(connID);
+                return;
+            }
+        }
+
+        if(conn.bufferIdx < conn.buffers.size()) {
+            size_t oldIdx = conn.bufferIdx;
+            size_t oldOffset = conn.bufferOffset;
+            bool done = sendBuffersToSocket(
+                conn.fd, conn.buffers, conn.bufferIdx, conn.bufferOffset
+            );
+            if(conn.bufferIdx != oldIdx || conn.bufferOffset != oldOffset) {
+                conn.lastActivity = steady_clock::now();
+            }
+            if(!done) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    closeConnection_(connID);
+                }
+                return;
+            }
+        }
+
+        if(conn.fileLeft) {
+            uint64_t oldLeft = conn.fileLeft;
+            bool done = sendFileToSocket(
+                conn.fd, conn.file->fd, conn.fileOffset, conn.fileLeft
+            );
+            if(conn.fileLeft != oldLeft) {
+                conn.lastActivity = steady_clock::now();
+            }
+            if(!done) {
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    closeConnection_(connID);
+                }
+                return;
+            }
+        }
+
+        PROBE(http_response_end, connID);
+
+        if(!conn.keepAlive) {
+            closeConnection_(connID);
+            return;
+        }
+
+        startReading_(conn);
+        epollCtl_(EPOLL_CTL_MOD, conn.fd, connID, EPOLLIN | EPOLLRDHUP);
+
+        // The client may have already sent the next request
+        if(!conn.inBuf.empty()) {
+            processInput_(connID, conn);
+        }
+    }
+
+    void afterConstruct_(shared_ptr<EventHTTPServer> self) {
+        self_ = self;
+        loopThread_ = thread([this]() { runLoop_(); });
+    }
+
+    AliveToken aliveToken_;
+    weak_ptr<HTTPServerEventHandler> eventHandler_;
+    shared_ptr<TaskQueue> taskQueue_;
+    shared_ptr<UploadStorage> uploadStorage_;
+    weak_ptr<EventHTTPServer> self_;
+
+    steady_clock::duration keepAliveTimeout_;
+    int maxKeepAliveRequests_;
+    uint64_t maxUploadSize_;
+    vector<int> cpus_;
+    shared_ptr<ConnectionStats> stats_;
+
+    int listenFd_;
+    int epollFd_;
+    int wakeFd_;
+
+    mutex mutex_;
+    bool stopping_;
+    vector<pair<uint64_t, ResponseSpec>> responses_;
+
+    // Only accessed by the event loop thread.
+    map<uint64_t, unique_ptr<Connection>> conns_;
+    uint64_t nextConnID_;
+
+    thread loopThread_;
 };
 
 }
 
 namespace {
 
+using http_::EventHTTPServer;
 using http_::HTTPRequestHandler;
 
 class HTTPRequestHandlerFactory : public Poco::Net::HTTPRequestHandlerFactory {
@@ -454,11 +2103,17 @@ public:
     HTTPRequestHandlerFactory(
         weak_ptr<HTTPServerEventHandler> eventHandler,
         shared_ptr<TaskQueue> taskQueue,
+        uint64_t maxUploadSize,
+        vector<int> cpus,
+        shared_ptr<ConnectionStats> stats,
         AliveToken aliveToken
     )
         : aliveToken_(aliveToken),
           eventHandler_(eventHandler),
-          taskQueue_(taskQueue)
+          taskQueue_(taskQueue),
+          maxUploadSize_(maxUploadSize),
+          cpus_(move(cpus)),
+          stats_(stats)
     {
         uploadStorage_ = UploadStorage::create();
     }
@@ -466,8 +2121,21 @@ public:
     virtual Poco::Net::HTTPRequestHandler* createRequestHandler(
         const Poco::Net::HTTPServerRequest& request
     ) override {
+        // Called in the pooled thread serving the connection; the threads of
+        // the Poco thread pool are pinned as they start serving connections
+        thread_local bool cpusSet = false;
+        if(!cpusSet && !cpus_.empty()) {
+            setCurrentThreadCPUs(cpus_);
+            cpusSet = true;
+        }
+
         return new HTTPRequestHandler(
-            eventHandler_, taskQueue_, uploadStorage_, aliveToken_
+            eventHandler_,
+            taskQueue_,
+            uploadStorage_,
+            maxUploadSize_,
+            stats_,
+            aliveToken_
         );
     }
 
@@ -476,10 +2144,55 @@ private:
     weak_ptr<HTTPServerEventHandler> eventHandler_;
     shared_ptr<TaskQueue> taskQueue_;
     shared_ptr<UploadStorage> uploadStorage_;
+    uint64_t maxUploadSize_;
+    vector<int> cpus_;
+    shared_ptr<ConnectionStats> stats_;
 };
 
 }
 
+HTTPUploadProgress::HTTPUploadProgress(CKey,
+    string path,
+    optional<string> authorization,
+    optional<string> cookie,
+    uint64_t totalBytes
+)
+    : path_(move(path)),
+      authorization_(move(authorization)),
+      cookie_(move(cookie)),
+      totalBytes_(totalBytes),
+      receivedBytes_(0),
+      cancelled_(false)
+{}
+
+const string& HTTPUploadProgress::path() {
+    return path_;
+}
+
+optional<string> HTTPUploadProgress::getBasicAuthCredentials() {
+    return parseBasicAuthCredentials(authorization_);
+}
+
+optional<string> HTTPUploadProgress::getCookie(const string& name) {
+    return parseCookie(cookie_, name);
+}
+
+uint64_t HTTPUploadProgress::receivedBytes() {
+    return receivedBytes_.load(memory_order_relaxed);
+}
+
+uint64_t HTTPUploadProgress::totalBytes() {
+    return totalBytes_;
+}
+
+void HTTPUploadProgress::cancel() {
+    cancelled_.store(true, memory_order_relaxed);
+}
+
+bool HTTPUploadProgress::isCancelled() {
+    return cancelled_.load(memory_order_relaxed);
+}
+
 struct SocketAddress::Impl {
     Poco::Net::SocketAddress addr;
     string addrStr;
@@ -504,33 +2217,76 @@ ostream& operator<<(ostream& out, SocketAddress addr) {
     return out;
 }
 
+struct HTTPListenSocket::Impl {
+    SocketAddress listenAddr;
+    Poco::Net::ServerSocket serverSocket;
+};
+
+HTTPListenSocket::HTTPListenSocket(CKey, SocketAddress listenAddr) {
+    INFO_LOG("Binding HTTP server socket to ", listenAddr);
+
+    try {
+        impl_ = make_shared<Impl>(Impl {
+            listenAddr,
+            Poco::Net::ServerSocket(listenAddr.impl_->addr)
+        });
+    } catch(const Poco::Exception& e) {
+        PANIC("Binding HTTP server socket failed with exception: ", e.displayText());
+    }
+}
+
 class HTTPServer::Impl : public enable_shared_from_this<Impl> {
 SHARED_ONLY_CLASS(Impl);
 public:
     // May throw Poco::Exception if startup fails.
     Impl(CKey,
         weak_ptr<HTTPServerEventHandler> eventHandler,
-        SocketAddress listenAddr,
-        int maxThreads
+        shared_ptr<HTTPListenSocket> listenSocket,
+        HTTPServerOptions options
     )
         : eventHandler_(eventHandler),
           state_(Running),
           aliveToken_(AliveToken::create()),
-          threadPool_(1, maxThreads),
-          socketAddress_(listenAddr.impl_->addr),
-          serverSocket_(socketAddress_)
+          stats_(make_shared<ConnectionStats>()),
+          serverSocket_(listenSocket->impl_->serverSocket)
     {
-        httpServer_.emplace(
-            new HTTPRequestHandlerFactory(
+        if(options.eventDriven) {
+            serverSocket_.setBlocking(false);
+            eventServer_ = EventHTTPServer::create(
                 eventHandler,
                 TaskQueue::getActiveQueue(),
+                serverSocket_.impl()->sockfd(),
+                options.keepAliveTimeout,
+                options.maxKeepAliveRequests,
+                options.maxUploadSize,
+                options.cpus,
+                stats_,
                 aliveToken_
-            ),
-            threadPool_,
-            serverSocket_,
-            new Poco::Net::HTTPServerParams()
-        );
-        httpServer_->start();
+            );
+        } else {
+            Poco::Net::HTTPServerParams* params = new Poco::Net::HTTPServerParams();
+            params->setKeepAlive(options.keepAliveTimeout > steady_clock::duration::zero());
+            params->setKeepAliveTimeout(Poco::Timespan(
+                duration_cast<milliseconds>(options.keepAliveTimeout).count() * 1000
+            ));
+            params->setMaxKeepAliveRequests(options.maxKeepAliveRequests);
+
+            threadPool_.emplace(1, options.maxThreads);
+            httpServer_.emplace(
+                new HTTPRequestHandlerFactory(
+                    eventHandler,
+                    TaskQueue::getActiveQueue(),
+                    options.maxUploadSize,
+                    options.cpus,
+                    stats_,
+                    aliveToken_
+                ),
+                *threadPool_,
+                serverSocket_,
+                params
+            );
+            httpServer_->start();
+        }
     }
     ~Impl() {
         REQUIRE(state_ == ShutdownComplete);
@@ -547,20 +2303,15 @@ public:
         thread([self, taskQueue]() {
             ActiveTaskQueueLock activeTaskQueueLock(taskQueue);
 
-            try {
-                // Do not accept new connections
-                self->httpServer_->stop();
+            if(self->eventServer_) {
+                self->eventServer_->stop();
+                self->eventServer_.reset();
+            }
 
-                // 1s grace time for current connections before abort
-                for(int i = 0; i < 10; ++i) {
-                    if(self->httpServer_->currentConnections() == 0) {
-                        break;
-                    }
-                    sleep_for(milliseconds(100));
+            try {
+                if(self->httpServer_.has_value()) {
+                    self->stopPocoServer_();
                 }
-                self->httpServer_->stopAll(true);
-
-                self->httpServer_.reset();
             } catch(const Poco::Exception& e) {
                 PANIC(
                     "Shutting down Poco HTTP server failed with exception: ",
@@ -569,14 +2320,20 @@ public:
             }
 
             // Just to be safe, use our alive token to wait for possibly
-            // lingering Poco HTTP server background threads to actually shut
-            // down so that we can be sure that we won't get any calls to the
-            // HTTP request handler after shutdown.
+            // lingering HTTP request objects and Poco HTTP server background
+            // threads to actually shut down so that we can be sure that we
+            // won't get any calls to the HTTP request handler after shutdown.
             AliveTokenWatcher watcher(move(self->aliveToken_));
             while(watcher.isTokenAlive()) {
                 sleep_for(milliseconds(100));
             }
 
+            INFO_LOG(
+                "HTTP server served ", self->stats_->requestCount.load(),
+                " requests over ", self->stats_->connectionCount.load(),
+                " connections"
+            );
+
             postTask([self]() {
                 REQUIRE_API_THREAD();
                 REQUIRE(self->state_ == ShutdownPending);
@@ -597,30 +2354,57 @@ public:
     }
 
 private:
+    // May throw Poco::Exception.
+    void stopPocoServer_() {
+        // Do not accept new connections
+        httpServer_->stop();
+        stats_->connectionCount.store(httpServer_->totalConnections());
+
+        // 1s grace time for current connections before abort
+        for(int i = 0; i < 10; ++i) {
+            if(httpServer_->currentConnections() == 0) {
+                break;
+            }
+            sleep_for(milliseconds(100));
+        }
+        httpServer_->stopAll(true);
+
+        httpServer_.reset();
+    }
+
     weak_ptr<HTTPServerEventHandler> eventHandler_;
 
     enum {Running, ShutdownPending, ShutdownComplete} state_;
 
     AliveToken aliveToken_;
+    shared_ptr<ConnectionStats> stats_;
 
-    Poco::ThreadPool threadPool_;
-    Poco::Net::SocketAddress socketAddress_;
     Poco::Net::ServerSocket serverSocket_;
+
+    // Exactly one of the servers is used, depending on the mode.
+    optional<Poco::ThreadPool> threadPool_;
     optional<Poco::Net::HTTPServer> httpServer_;
+    shared_ptr<EventHTTPServer> eventServer_;
 };
 
 HTTPServer::HTTPServer(CKey,
     weak_ptr<HTTPServerEventHandler> eventHandler,
-    SocketAddress listenAddr,
-    int maxThreads
+    shared_ptr<HTTPListenSocket> listenSocket,
+    HTTPServerOptions options
 ) {
     REQUIRE_API_THREAD();
-    REQUIRE(maxThreads > 0);
-
-    INFO_LOG("Starting HTTP server (listen address: ", listenAddr, ")");
+    REQUIRE(options.maxThreads > 0);
+    REQUIRE(options.keepAliveTimeout >= steady_clock::duration::zero());
+    REQUIRE(options.maxKeepAliveRequests >= 0);
+
+    INFO_LOG(
+        "Starting HTTP server (listen address: ",
+        listenSocket->impl_->listenAddr, ", mode: ",
+        options.eventDriven ? "event" : "threaded", ")"
+    );
 
     try {
-        impl_ = Impl::create(eventHandler, listenAddr, maxThreads);
+        impl_ = Impl::create(eventHandler, listenSocket, options);
     } catch(const Poco::Exception& e) {
         PANIC("Starting Poco HTTP server failed with exception: ", e.displayText());
     }
@@ -1,21 +1,33 @@
 #pragma once
 
 #include "common.hpp"
+#include "html.hpp"
 
 namespace retrojsvice {
 
 class FileUpload;
 
 namespace http_ {
+    class EventHTTPServer;
     class HTTPRequestHandler;
+    class UploadProgressReporter;
 }
 
+// Immutable piece of a response body sent using HTTPRequest::sendBuffers. The
+// size bytes at data are kept alive by owner (if data points to memory that is
+// not static) and must not be modified while any copy of the buffer exists.
+struct ResponseBuffer {
+    const void* data;
+    size_t size;
+    shared_ptr<const void> owner;
+};
+
 // State of a single HTTP request. The response should be sent by calling one of
 // the send* functions exactly once. If no response is given, a internal server
 // error response is sent upon object destruction and a warning is logged. No
 // other member functions may be called after sending the response.
 class HTTPRequest {
-SHARED_ONLY_CLASS(HTTPRequest);
+SHARED_ONLY_POOLED_CLASS(HTTPRequest);
 private:
     class Impl;
 
@@ -23,22 +35,49 @@ public:
     // Private constructor.
     HTTPRequest(CKey, unique_ptr<Impl> impl);
 
-    string method();
-    string path();
-    string userAgent();
+    // The returned references are valid until a response is sent.
+    const string& method();
+    const string& path();
+    const string& userAgent();
 
     // Form accessors return empty string/pointer if there is no entry with
     // specified name.
-    string getFormParam(string name);
-    shared_ptr<FileUpload> getFormFile(string name);
+    // The form is parsed from the body when it is first accessed.
+    string getFormParam(const string& name);
+    shared_ptr<FileUpload> getFormFile(const string& name);
+
+    // The raw body of a POST request that is not multipart/form-data. The body
+    // is kept after the form is parsed, so this may be used together with the
+    // form accessors.
+    const string& body();
 
     optional<string> getBasicAuthCredentials();
 
+    // Returns the value of the cookie with given name sent by the client.
+    optional<string> getCookie(const string& name);
+
+    // Adds a header to the response that is eventually sent using one of the
+    // send functions.
+    void addResponseHeader(string name, string value);
+
+    // True if receiving the request body was stopped early using
+    // HTTPUploadProgress::cancel. In that case, the form only contains the
+    // parameters received before the cancellation and no files, and the
+    // connection is closed after the response.
+    bool uploadCancelled();
+
+    // True if sendStreamResponse may be used for this request; streaming is
+    // only supported by the threaded HTTP server (see HTTPServer).
+    bool supportsStreaming();
+
     // The body function will be called to write the body of the response in a
     // different thread. In case of HTTP server internal errors or server
     // shutdown, the body function may not be called or writing to the given
     // ostream may throw an exception. Otherwise, the given content length
-    // should match the number of bytes written.
+    // should match the number of bytes written. If the content type is
+    // textual and the client accepts gzip (and is not known to mishandle it),
+    // the body is compressed; in that case, the body function is called before
+    // sendResponse returns.
     void sendResponse(
         int status,
         string contentType,
@@ -48,6 +87,46 @@ public:
         vector<pair<string, string>> extraHeaders = {}
     );
 
+    // Sends the concatenation of the given buffers as the response body. The
+    // content length is computed from the buffers, and the server writes the
+    // buffers directly to the socket without copying them to an intermediate
+    // buffer. The body is never compressed, so this is meant for data that is
+    // already compressed, such as images.
+    void sendBuffers(
+        int status,
+        string contentType,
+        vector<ResponseBuffer> buffers,
+        bool noCache = true,
+        vector<pair<string, string>> extraHeaders = {}
+    );
+
+    // Sends a response without a content length, used for streaming content
+    // such as multipart/x-mixed-replace image streams. The body function
+    // occupies its server thread until it returns, and it may keep writing to
+    // the ostream (flushing it to push the data to the client) for as long as
+    // it needs; the connection is closed afterwards. Writing fails if the
+    // client has closed the connection. Caching is always disabled.
+    void sendStreamResponse(
+        int status,
+        string contentType,
+        function<void(ostream&)> body,
+        vector<pair<string, string>> extraHeaders = {}
+    );
+
+    // Sends the regular file at given path as the response body with status
+    // 200. Byte range requests (a Range header with a single range) are
+    // supported: a satisfiable range is sent with status 206 and an
+    // unsatisfiable one results in a 416 response. The file is opened before
+    // the function returns, so it may be removed afterwards; the content is
+    // sent from the file directly to the socket using sendfile. Returns false
+    // without sending a response if opening the file fails.
+    bool sendFile(
+        string contentType,
+        string path,
+        bool noCache = true,
+        vector<pair<string, string>> extraHeaders = {}
+    );
+
     void sendTextResponse(
         int status,
         string text,
@@ -55,35 +134,34 @@ public:
         vector<pair<string, string>> extraHeaders = {}
     );
 
+    // Sends the output of an HTML template writer generated from html/. The
+    // response is compressed like in sendResponse, using cached compressed
+    // static fragments of the template, and the pieces are written to the
+    // socket like in sendBuffers.
     template <typename Data>
     void sendHTMLResponse(
         int status,
-        void (*writer)(ostream&, const Data&),
+        void (*writer)(HTMLScatterList&, const Data&),
         const Data& data,
         bool noCache = true,
         vector<pair<string, string>> extraHeaders = {}
     ) {
-        stringstream htmlSS;
-        writer(htmlSS, data);
-
-        string html = htmlSS.str();
-        uint64_t contentLength = html.size();
-
-        sendResponse(
-            status,
-            "text/html; charset=UTF-8",
-            contentLength,
-            [html{move(html)}](ostream& out) {
-                out << html;
-            },
-            noCache,
-            move(extraHeaders)
-        );
+        HTMLScatterList html;
+        writer(html, data);
+        sendHTMLResponse_(status, move(html), noCache, move(extraHeaders));
     }
 
 private:
+    void sendHTMLResponse_(
+        int status,
+        HTMLScatterList html,
+        bool noCache,
+        vector<pair<string, string>> extraHeaders
+    );
+
     unique_ptr<Impl> impl_;
 
+    friend class http_::EventHTTPServer;
     friend class http_::HTTPRequestHandler;
 };
 
@@ -106,22 +184,115 @@ private:
 
 ostream& operator<<(ostream& out, SocketAddress addr);
 
+// Progress of receiving the body of a file upload request (a POST request
+// with a multipart/form-data body). The body is parsed while it is received
+// and the uploaded files are written directly to disk; the progress is
+// reported to the event handler through onHTTPServerUploadProgress while the
+// body is being received, before the request itself is passed to
+// onHTTPServerRequest. Thread-safe.
+class HTTPUploadProgress {
+SHARED_ONLY_CLASS(HTTPUploadProgress);
+public:
+    // Private constructor.
+    HTTPUploadProgress(CKey,
+        string path,
+        optional<string> authorization,
+        optional<string> cookie,
+        uint64_t totalBytes
+    );
+
+    const string& path();
+    optional<string> getBasicAuthCredentials();
+    optional<string> getCookie(const string& name);
+
+    uint64_t receivedBytes();
+    uint64_t totalBytes();
+
+    // Stops receiving the body; the request is passed to the event handler
+    // without the rest of the body (see HTTPRequest::uploadCancelled).
+    void cancel();
+    bool isCancelled();
+
+private:
+    string path_;
+    optional<string> authorization_;
+    optional<string> cookie_;
+    uint64_t totalBytes_;
+    atomic<uint64_t> receivedBytes_;
+    atomic<bool> cancelled_;
+
+    friend class http_::UploadProgressReporter;
+};
+
+// Listening socket bound to an address, created ahead of the HTTPServer that
+// serves it: the connections made in the meantime are held in the listen
+// backlog of the kernel until the server starts accepting them, instead of
+// being refused.
+class HTTPListenSocket {
+SHARED_ONLY_CLASS(HTTPListenSocket);
+public:
+    HTTPListenSocket(CKey, SocketAddress listenAddr);
+
+private:
+    struct Impl;
+    shared_ptr<Impl> impl_;
+
+    friend class HTTPServer;
+};
+
 class HTTPServerEventHandler {
 public:
     virtual void onHTTPServerRequest(shared_ptr<HTTPRequest> request) = 0;
+    virtual void onHTTPServerUploadProgress(
+        shared_ptr<HTTPUploadProgress> progress
+    ) = 0;
     virtual void onHTTPServerShutdownComplete() = 0;
 };
 
+struct HTTPServerOptions {
+    // See HTTPServer.
+    bool eventDriven = false;
+    int maxThreads = 100;
+
+    // Persistent connections are closed after they have been idle for
+    // keepAliveTimeout; if zero, each connection is closed after one request.
+    steady_clock::duration keepAliveTimeout = milliseconds(15000);
+
+    // Maximum number of requests served over a single connection before it is
+    // closed (0 for unlimited).
+    int maxKeepAliveRequests = 0;
+
+    // Maximum total size of the files uploaded in a single request in bytes
+    // (0 for unlimited); larger uploads are rejected while they are being
+    // received.
+    uint64_t maxUploadSize = 0;
+
+    // If nonempty, the server threads are restricted to run on the CPUs with
+    // these indices.
+    vector<int> cpus;
+};
+
 // HTTP server that delegates requests to be handled by given event handler
 // through onHTTPServerRequest. Before destruction, call shutdown and wait for
 // onHTTPServerShutdownComplete event.
+//
+// By default, the server uses a pool of at most options.maxThreads threads,
+// and each request occupies a thread until its response has been written. If
+// options.eventDriven is set, all the connections are instead served by a
+// single event loop thread, and requests waiting for a response (such as image
+// long-polls) do not occupy a thread; in this mode, request and response
+// bodies other than file uploads, downloads and buffer responses (sendBuffers)
+// are buffered in memory, streaming responses are not supported and
+// maxThreads is ignored. In both modes, connections are kept alive between
+// requests as allowed by the client and the keep-alive options, and the
+// connection reuse statistics are logged upon shutdown.
 class HTTPServer {
 SHARED_ONLY_CLASS(HTTPServer);
 public:
     HTTPServer(CKey,
         weak_ptr<HTTPServerEventHandler> eventHandler,
-        SocketAddress listenAddr,
-        int maxThreads
+        shared_ptr<HTTPListenSocket> listenSocket,
+        HTTPServerOptions options
     );
     ~HTTPServer();
 
@@ -1,114 +1,253 @@
 #include "image_compressor.hpp"
 
+#include "compressor_pool.hpp"
 #include "http.hpp"
 #include "jpeg.hpp"
 #include "png.hpp"
+#include "probe.hpp"
 #include "task_queue.hpp"
 
 namespace retrojsvice {
 
 namespace {
 
-void serveWhiteJPEGPixel(shared_ptr<HTTPRequest> request) {
-    REQUIRE_API_THREAD();
+// The qualities between which the automatic quality mode moves, from the
+// fastest to the best. The last one (PNG) is only used if PNG is allowed.
+const int AutoQualityLevels[] = {
+    10, 20, 30, 40, 50, 60, 70, 75, 80, 85, 90, 95, 101
+};
+const size_t AutoQualityLevelCount =
+    sizeof(AutoQualityLevels) / sizeof(AutoQualityLevels[0]);
+const size_t AutoQualityInitialIdx = 8;
+
+// The automatic quality mode aims to keep the time from sending an image to
+// receiving the request for the next one (the transfer and display time of the
+// image in the client) close to this target. Small images are not used as
+// samples, as their latency is dominated by the round trip time.
+const int64_t AutoQualityTargetLatencyMs = 300;
+const uint64_t AutoQualityMinSampleSize = 4096;
+
+// In the Auto mode of ImageCompressorOptions::progressiveJPEG, the images are
+// progressive while the automatic quality is at most this index of
+// AutoQualityLevels.
+const size_t AutoQualityProgressiveMaxIdx = 3;
+
+// With ImageCompressorOptions::jpegAutoSubsampling, the chroma channels are
+// sampled at full resolution from the first quality and at half horizontal
+// resolution from the second quality.
+const int JPEGAutoSubsampling444MinQuality = 80;
+const int JPEGAutoSubsampling422MinQuality = 50;
+
+// In demand-driven mode, the prefetch of the next frame is started this much
+// earlier than strictly needed to complete it before the expected poll.
+const double PrefetchMarginMs = 20.0;
+
+// The time without interaction after which the frames are compressed at the
+// normal quality again.
+const steady_clock::duration InteractionQuietPeriod = milliseconds(400);
+
+// While a window exceeds its byte budget, the quality cap is lowered by
+// BudgetQualityStep for each frame compressed (down to BudgetMinQuality); it
+// is raised again by the same step while the usage is below half of the
+// budget. A window whose usage has reached BudgetLowPriorityFraction of some
+// budget gets the lowest priority in the compressor pool.
+const int BudgetQualityStep = 10;
+const int BudgetMinQuality = 10;
+const double BudgetLowPriorityFraction = 0.75;
+
+const double BudgetPeriodSeconds = (double)duration_cast<microseconds>(
+    ImageCompressorOptions::BudgetPeriod
+).count() / 1e6;
+
+// The Cache-Control header of the cacheable tile URLs: the responses never
+// change, so they may be cached for a year.
+const char* CachedTilePrivateCacheControl = "private, max-age=31536000, immutable";
+const char* CachedTilePublicCacheControl = "public, max-age=31536000, immutable";
+
+// The content key of an image as used in its cacheable tile URL.
+string contentKeyHex(FrameCacheKey key) {
+    const char* digits = "0123456789abcdef";
+    string ret;
+    for(uint64_t part : {key.first, key.second}) {
+        for(int shift = 60; shift >= 0; shift -= 4) {
+            ret.push_back(digits[(part >> shift) & 15]);
+        }
+    }
+    return ret;
+}
+
+// Updates the exponentially smoothed estimate with a new sample; a zero
+// estimate is replaced by the sample.
+void updateEstimate(double& estimate, double sample) {
+    if(estimate == 0.0) {
+        estimate = sample;
+    } else {
+        estimate = 0.7 * estimate + 0.3 * sample;
+    }
+}
+
+// Fast non-cryptographic 64-bit fingerprint of the data. Four independent
+// lanes of 8-byte words are mixed in parallel to keep the multipliers busy.
+uint64_t computeFingerprint(const uint8_t* data, size_t size) {
+    const uint64_t Prime = UINT64_C(0x9e3779b97f4a7c15);
+    uint64_t lanes[4] = {1, 2, 3, 4};
+
+    const uint8_t* pos = data;
+    size_t blockCount = size / 32;
+    for(size_t i = 0; i < blockCount; ++i) {
+        for(int j = 0; j < 4; ++j) {
+            uint64_t word;
+            memcpy(&word, pos + 8 * j, 8);
+            lanes[j] = (lanes[j] ^ word) * Prime;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+        pos += 32;
+    }
+
+    uint64_t ret = (uint64_t)size;
+    for(int j = 0; j < 4; ++j) {
+        ret = (ret ^ lanes[j]) * Prime;
+    }
+    for(size_t i = 32 * blockCount; i < size; ++i) {
+        ret = (ret ^ (uint64_t)data[i]) * Prime;
+    }
+    return ret ^ (ret >> 32);
+}
 
+CompressedImage createWhiteJPEGPixel() {
     // 1x1 white JPEG
-    vector<uint8_t> data = {
-        255, 216, 255, 224, 0, 16, 74, 70, 73, 70, 0, 1, 1, 1, 0, 72, 0, 72,
-        0, 0, 255, 219, 0, 67, 0, 3, 2, 2, 3, 2, 2, 3, 3, 3, 3, 4, 3, 3, 4,
-        5, 8, 5, 5, 4, 4, 5, 10, 7, 7, 6, 8, 12, 10, 12, 12, 11, 10, 11, 11,
-        13, 14, 18, 16, 13, 14, 17, 14, 11, 11, 16, 22, 16, 17, 19, 20, 21,
-        21, 21, 12, 15, 23, 24, 22, 20, 24, 18, 20, 21, 20, 255, 219, 0, 67,
-        1, 3, 4, 4, 5, 4, 5, 9, 5, 5, 9, 20, 13, 11, 13, 20, 20, 20, 20, 20,
-        20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
-        20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
-        20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 255, 192, 0, 17, 8, 0,
-        1, 0, 1, 3, 1, 17, 0, 2, 17, 1, 3, 17, 1, 255, 196, 0, 20, 0, 1, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9, 255, 196, 0, 20, 16, 1,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 196, 0, 20, 1,
-        1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 196, 0, 20,
-        17, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 218, 0,
-        12, 3, 1, 0, 2, 17, 3, 17, 0, 63, 0, 84, 193, 255, 217
-    };
-    uint64_t contentLength = data.size();
-    request->sendResponse(
-        200,
-        "image/jpeg",
-        contentLength,
-        [data{move(data)}](ostream& out) {
-            out.write((const char*)data.data(), data.size());
+    shared_ptr<vector<uint8_t>> data = make_shared<vector<uint8_t>>(
+        vector<uint8_t>{
+            255, 216, 255, 224, 0, 16, 74, 70, 73, 70, 0, 1, 1, 1, 0, 72, 0, 72,
+            0, 0, 255, 219, 0, 67, 0, 3, 2, 2, 3, 2, 2, 3, 3, 3, 3, 4, 3, 3, 4,
+            5, 8, 5, 5, 4, 4, 5, 10, 7, 7, 6, 8, 12, 10, 12, 12, 11, 10, 11, 11,
+            13, 14, 18, 16, 13, 14, 17, 14, 11, 11, 16, 22, 16, 17, 19, 20, 21,
+            21, 21, 12, 15, 23, 24, 22, 20, 24, 18, 20, 21, 20, 255, 219, 0, 67,
+            1, 3, 4, 4, 5, 4, 5, 9, 5, 5, 9, 20, 13, 11, 13, 20, 20, 20, 20, 20,
+            20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+            20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+            20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 255, 192, 0, 17, 8, 0,
+            1, 0, 1, 3, 1, 17, 0, 2, 17, 1, 3, 17, 1, 255, 196, 0, 20, 0, 1, 0,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 9, 255, 196, 0, 20, 16, 1,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 196, 0, 20, 1,
+            1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 196, 0, 20,
+            17, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 218, 0,
+            12, 3, 1, 0, 2, 17, 3, 17, 0, 63, 0, 84, 193, 255, 217
         }
     );
+    return {
+        "image/jpeg",
+        data->size(),
+        [data](ostream& out) {
+            out.write((const char*)data->data(), data->size());
+        },
+        {{data->data(), data->size(), data}}
+    };
 }
 
-function<void(shared_ptr<HTTPRequest>)> compressPNG_(
-    vector<uint8_t> imageData,
-    size_t imageWidth,
-    size_t imageHeight,
-    shared_ptr<PNGCompressor> pngCompressor
+// Wraps the write function of the image such that the first write reports the
+// traces as sent. The buffers are dropped so that the responses use the write
+// function.
+CompressedImage traceSent(CompressedImage image, TraceList traces) {
+    image.buffers.clear();
+    shared_ptr<atomic<bool>> sent = make_shared<atomic<bool>>(false);
+    function<void(ostream&)> write = move(image.write);
+    image.write = [write, traces, sent](ostream& out) {
+        write(out);
+        if(!sent->exchange(true)) {
+            traceStage(traces, "sent");
+        }
+    };
+    return image;
+}
+
+void sendImage(
+    shared_ptr<HTTPRequest> request,
+    const CompressedImage& image,
+    bool noCache = true,
+    vector<pair<string, string>> extraHeaders = {}
 ) {
-    REQUIRE(imageWidth && imageHeight);
-    REQUIRE(imageData.size() == 4 * imageWidth * imageHeight);
-
-    shared_ptr<vector<vector<uint8_t>>> png =
-        make_shared<vector<vector<uint8_t>>>(
-            pngCompressor->compress(
-                imageData.data(),
-                imageWidth,
-                imageHeight,
-                imageWidth
-            )
+    REQUIRE_API_THREAD();
+    if(image.buffers.empty()) {
+        request->sendResponse(
+            200,
+            image.contentType,
+            image.size,
+            image.write,
+            noCache,
+            move(extraHeaders)
         );
+    } else {
+        request->sendBuffers(
+            200, image.contentType, image.buffers, noCache, move(extraHeaders)
+        );
+    }
+}
+
+CompressedImage pngImage_(shared_ptr<const vector<vector<uint8_t>>> png) {
+    REQUIRE(png);
 
     uint64_t length = 0;
+    vector<ResponseBuffer> buffers;
+    buffers.reserve(png->size());
     for(const vector<uint8_t>& chunk : *png) {
         length += chunk.size();
+        buffers.push_back({chunk.data(), chunk.size(), png});
     }
 
-    return [png, length](shared_ptr<HTTPRequest> request) {
-        REQUIRE_API_THREAD();
-
-        request->sendResponse(
-            200,
-            "image/png",
-            length,
-            [png](ostream& out) {
-                for(const vector<uint8_t>& chunk : *png) {
-                    out.write((const char*)chunk.data(), chunk.size());
-                }
+    return {
+        "image/png",
+        length,
+        [png](ostream& out) {
+            for(const vector<uint8_t>& chunk : *png) {
+                out.write((const char*)chunk.data(), chunk.size());
             }
-        );
+        },
+        move(buffers)
     };
 }
 
-function<void(shared_ptr<HTTPRequest>)> compressJPEG_(
-    vector<uint8_t> imageData,
-    size_t imageWidth,
-    size_t imageHeight,
-    int quality
+CompressedImage compressPNG_(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    shared_ptr<PNGCompressor> pngCompressor
+) {
+    REQUIRE(width && height);
+    return pngImage_(pngCompressor->compress(image, width, height, pitch));
+}
+
+CompressedImage compressJPEG_(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    int quality,
+    size_t stripCount,
+    JPEGParallelFor parallelFor,
+    JPEGOptions options
 ) {
-    REQUIRE(imageWidth && imageHeight);
-    REQUIRE(imageData.size() == 4 * imageWidth * imageHeight);
+    REQUIRE(width && height);
     REQUIRE(quality > 0 && quality <= 100);
 
     shared_ptr<JPEGData> jpeg = make_shared<JPEGData>(compressJPEG(
-        imageData.data(),
-        imageWidth,
-        imageHeight,
-        imageWidth,
-        quality
+        image,
+        width,
+        height,
+        pitch,
+        quality,
+        stripCount,
+        move(parallelFor),
+        options
     ));
-    return [jpeg](shared_ptr<HTTPRequest> request) {
-        REQUIRE_API_THREAD();
-
-        request->sendResponse(
-            200,
-            "image/jpeg",
-            jpeg->length,
-            [jpeg](ostream& out) {
-                out.write((const char*)jpeg->data.get(), jpeg->length);
-            }
-        );
+    return {
+        "image/jpeg",
+        jpeg->length,
+        [jpeg](ostream& out) {
+            out.write((const char*)jpeg->data.get(), jpeg->length);
+        },
+        {{jpeg->data.get(), jpeg->length, jpeg}}
     };
 }
 
@@ -116,43 +255,150 @@ function<void(shared_ptr<HTTPRequest>)> compressJPEG_(
 
 ImageCompressor::ImageCompressor(CKey,
     weak_ptr<ImageCompressorEventHandler> eventHandler,
+    shared_ptr<CompressorPool> compressorPool,
+    ImageCompressorOptions compressorOptions,
     steady_clock::duration sendTimeout,
-    int quality
-) {
+    int quality,
+    bool allowPNG
+)
+    : frameMeter_(ImageCompressorOptions::BudgetPeriod),
+      byteMeter_(ImageCompressorOptions::BudgetPeriod),
+      compressionMeter_(ImageCompressorOptions::BudgetPeriod)
+{
     REQUIRE_API_THREAD();
-    REQUIRE(quality >= 10 && quality <= 101);
+    REQUIRE(quality >= 10 && quality <= AutoQuality);
+    REQUIRE(allowPNG || quality != 101);
 
     eventHandler_ = eventHandler;
     sendTimeout_ = sendTimeout;
 
     quality_ = quality;
+    allowPNG_ = allowPNG;
+    hybrid_ = compressorOptions.hybrid && allowPNG;
+    frameCache_ = compressorOptions.frameCache;
+    tileCaching_ = compressorOptions.tileCaching;
+    progressiveJPEG_ = compressorOptions.progressiveJPEG;
+    jpegBaseOptions_ = compressorOptions.jpeg;
+    jpegAutoSubsampling_ = compressorOptions.jpegAutoSubsampling;
+    demandDriven_ = compressorOptions.demandDriven;
+
+    REQUIRE(
+        compressorOptions.pipelineDepth >= 1 &&
+        compressorOptions.pipelineDepth <=
+            ImageCompressorOptions::MaxPipelineDepth
+    );
+    pipelineDepth_ = compressorOptions.pipelineDepth;
+
+    REQUIRE(
+        compressorOptions.compressionDepth >= 1 &&
+        compressorOptions.compressionDepth <=
+            ImageCompressorOptions::MaxCompressionDepth
+    );
+    compressionDepth_ = compressorOptions.compressionDepth;
+
+    REQUIRE(
+        compressorOptions.interactionQuality == 0 || (
+            compressorOptions.interactionQuality >= 10 &&
+            compressorOptions.interactionQuality <= 100
+        )
+    );
+    interactionQuality_ = compressorOptions.interactionQuality;
+    interacting_ = false;
+    lowQualityCompressed_ = false;
+    lastInputTime_.reset();
+
+    REQUIRE(
+        compressorOptions.videoQuality == 0 || (
+            compressorOptions.videoQuality >= 10 &&
+            compressorOptions.videoQuality <= 100
+        )
+    );
+    REQUIRE(compressorOptions.videoFPS >= 0);
+    videoQuality_ = compressorOptions.videoQuality;
+    videoFPS_ = compressorOptions.videoFPS;
+    mediaPlaying_ = false;
+
+    REQUIRE(compressorOptions.budgetFPS >= 0);
+    REQUIRE(compressorOptions.budgetCompressionMsPerSecond >= 0);
+    budgetFPS_ = compressorOptions.budgetFPS;
+    budgetBytesPerSecond_ = compressorOptions.budgetBytesPerSecond;
+    budgetCompressionMsPerSecond_ =
+        compressorOptions.budgetCompressionMsPerSecond;
+    budgetQualityCap_ = 101;
+
+    autoQualityIdx_ = AutoQualityInitialIdx;
+    autoQualitySample_.reset();
+    autoQualityLatencyMs_ = 0.0;
+    autoQualitySampleCount_ = 0;
 
     iframeSignal_ = 1;
     cursorSignal_ = 1;
 
-    int pngThreadCount = (int)thread::hardware_concurrency();
-    pngThreadCount = min(pngThreadCount, 4);
-    pngThreadCount = max(pngThreadCount, 1);
-    pngCompressor_ = make_shared<PNGCompressor>(pngThreadCount);
+    compressorQueue_ = compressorPool->createQueue();
+
+    // Splitting the PNG into more stripes than this has diminishing returns
+    // and worsens the compression ratio
+    size_t pngStripeCount = min(compressorPool->threadCount(), (size_t)4);
+    pngCompressor_ = make_shared<PNGCompressor>(
+        pngStripeCount,
+        [compressorPool](size_t count, function<void(size_t)> func) {
+            compressorPool->parallelFor(count, move(func));
+        },
+        compressorOptions.png
+    );
 
-    compressorShutdownScheduled_ = false;
-    compressorTaskScheduled_ = false;
+    // Unlike PNG stripes, the JPEG strips cost almost nothing in compression
+    // ratio, so we use all the threads
+    jpegStripCount_ = compressorPool->threadCount();
+    jpegParallelFor_ =
+        [compressorPool](size_t count, function<void(size_t)> func) {
+            compressorPool->parallelFor(count, move(func));
+        };
 
-    compressedImage_ = serveWhiteJPEGPixel;
+    frame_ = make_shared<vector<uint8_t>>();
+    frameWidth_ = 0;
+    frameHeight_ = 0;
+    frameImage_ = nullptr;
+    framePitch_ = 0;
+    frameShared_ = false;
+    frameHasSignals_ = true;
+
+    fullyDirty_ = true;
+    guiRowFingerprints_.clear();
+
+    waitPending_ = false;
+    compressedImage_ = createWhiteJPEGPixel();
+    compressedKey_.reset();
+
+    pollIntervalEstimateMs_ = 0.0;
+    compressionTimeEstimateMs_ = 0.0;
+    lastPollSendTime_.reset();
+    prefetchDue_ = false;
+    compressedQuality_ = compressionQuality_();
+
+    streamIdx_ = 0;
+    streamReady_ = false;
+    streamNeedsImage_ = false;
+
+    frameIdx_ = 0;
+    compressedFrameIdx_ = 0;
+    compressedRect_ = Rect(0, 1, 0, 1);
+    compressedIsTile_ = false;
+    compressedShift_.reset();
+
+    tileClientFrameIdx_ = 0;
+    fullFrameNeeded_ = false;
+    pendingResidue_ = Rect();
 
     fetchingStopped_ = false;
+    fetchingPaused_ = false;
     imageUpdated_ = false;
     compressedImageUpdated_ = false;
-    compressionInProgress_ = false;
+    compressionsInFlight_ = 0;
 }
 
 ImageCompressor::~ImageCompressor() {
-    {
-        lock_guard<mutex> lock(compressorMutex_);
-        compressorShutdownScheduled_ = true;
-    }
-    compressorCv_.notify_one();
-    compressorThread_.join();
+    closeStream();
 }
 
 int ImageCompressor::quality() {
@@ -162,49 +408,183 @@ int ImageCompressor::quality() {
 
 void ImageCompressor::setQuality(MCE, int quality) {
     REQUIRE_API_THREAD();
-    REQUIRE(quality >= 10 && quality <= 101);
+    REQUIRE(quality >= 10 && quality <= AutoQuality);
+    REQUIRE(allowPNG_ || quality != 101);
 
     if(quality != quality_) {
         quality_ = quality;
-        updateNotify(mce);
+        autoQualitySample_.reset();
+        autoQualitySampleCount_ = 0;
+        imageUpdated_ = true;
+        pump_(mce);
     }
 }
 
 void ImageCompressor::updateNotify(MCE) {
     REQUIRE_API_THREAD();
 
+    fullyDirty_ = true;
     imageUpdated_ = true;
     pump_(mce);
 }
 
+void ImageCompressor::updateNotify(MCE, Rect dirtyRect) {
+    REQUIRE_API_THREAD();
+
+    if(dirtyRect.isEmpty()) {
+        return;
+    }
+
+    dirtyRect_ = Rect::boundingBox(dirtyRect_, dirtyRect);
+    imageUpdated_ = true;
+    pump_(mce);
+}
+
+void ImageCompressor::addTrace(uint64_t window, uint64_t traceId) {
+    REQUIRE_API_THREAD();
+
+    pendingTraces_.emplace_back(window, traceId);
+}
+
 void ImageCompressor::sendCompressedImageNow(MCE,
     shared_ptr<HTTPRequest> httpRequest
 ) {
     REQUIRE_API_THREAD();
 
-    flush(mce);
+    // The clients send immediate requests mostly to deliver new events
+    lastInputTime_ = steady_clock::now();
+    send_(mce, httpRequest, false, {}, steady_clock::now());
+}
 
-    compressedImage_(httpRequest);
+void ImageCompressor::sendCompressedImageWait(MCE,
+    shared_ptr<HTTPRequest> httpRequest
+) {
+    REQUIRE_API_THREAD();
+    send_(mce, httpRequest, true, {}, steady_clock::now());
+}
 
-    compressedImageUpdated_ = false;
+void ImageCompressor::sendCompressedImagePipelined(MCE,
+    shared_ptr<HTTPRequest> httpRequest
+) {
+    REQUIRE_API_THREAD();
+
+    // Like waiting requests, the client sends a new pipelined request once it
+    // has shown an image
+    requestReceived_(true);
+
+    pipeline_.emplace_back(httpRequest, steady_clock::now());
+    if(pipeline_.size() > pipelineDepth_) {
+        pair<shared_ptr<HTTPRequest>, steady_clock::time_point> oldest =
+            move(pipeline_.front());
+        pipeline_.pop_front();
+        send_(mce, oldest.first, false, {}, oldest.second);
+    }
+
+    servePipeline_(mce);
     pump_(mce);
 }
 
-void ImageCompressor::sendCompressedImageWait(MCE,
+void ImageCompressor::sendCompressedTileNow(MCE,
+    shared_ptr<HTTPRequest> httpRequest,
+    uint64_t baseFrameIdx,
+    TileSentFunc sentFunc,
+    string cachedTilePath
+) {
+    REQUIRE_API_THREAD();
+
+    lastInputTime_ = steady_clock::now();
+    send_(
+        mce,
+        httpRequest,
+        false,
+        TileRequest{baseFrameIdx, move(sentFunc), move(cachedTilePath)},
+        steady_clock::now()
+    );
+}
+
+void ImageCompressor::sendCompressedTileWait(MCE,
+    shared_ptr<HTTPRequest> httpRequest,
+    uint64_t baseFrameIdx,
+    TileSentFunc sentFunc,
+    string cachedTilePath
+) {
+    REQUIRE_API_THREAD();
+    send_(
+        mce,
+        httpRequest,
+        true,
+        TileRequest{baseFrameIdx, move(sentFunc), move(cachedTilePath)},
+        steady_clock::now()
+    );
+}
+
+void ImageCompressor::sendCompressedImageStream(MCE,
     shared_ptr<HTTPRequest> httpRequest
 ) {
     REQUIRE_API_THREAD();
 
-    flush(mce);
+    closeStream();
 
-    if(compressedImageUpdated_) {
-        sendCompressedImageNow(mce, httpRequest);
-    } else {
-        shared_ptr<ImageCompressor> self = shared_from_this();
-        waitTag_ = postDelayedTask(sendTimeout_, [self, httpRequest]() {
-            REQUIRE_API_THREAD();
-            self->sendCompressedImageNow(mce, httpRequest);
-        });
+    weak_ptr<ImageCompressor> self = shared_from_this();
+    uint64_t streamIdx = ++streamIdx_;
+    stream_ = ImageStream::create([self, streamIdx]() {
+        postTask(self, &ImageCompressor::streamImageWritten_, mce, streamIdx);
+    });
+    streamReady_ = true;
+    streamNeedsImage_ = true;
+    autoQualitySample_.reset();
+
+    stream_->start(httpRequest);
+    pushStream_(mce);
+}
+
+void ImageCompressor::closeStream() {
+    REQUIRE_API_THREAD();
+
+    if(stream_) {
+        stream_->close();
+        stream_.reset();
+    }
+}
+
+bool ImageCompressor::isStreaming() {
+    REQUIRE_API_THREAD();
+    return stream_ && !stream_->ended();
+}
+
+void ImageCompressor::notifyInteraction(MCE) {
+    REQUIRE_API_THREAD();
+
+    lastInputTime_ = steady_clock::now();
+
+    if(interactionQuality_ == 0) {
+        return;
+    }
+
+    interacting_ = true;
+    interactionTag_ = postDelayedTask(
+        InteractionQuietPeriod,
+        weak_ptr<ImageCompressor>(shared_from_this()),
+        &ImageCompressor::endInteraction_,
+        mce
+    );
+}
+
+void ImageCompressor::setMediaPlaying(MCE, bool playing) {
+    REQUIRE_API_THREAD();
+
+    if(playing == mediaPlaying_) {
+        return;
+    }
+    mediaPlaying_ = playing;
+
+    // Like at the end of an interaction, refine the image with a full frame
+    // at the normal quality once playback stops
+    if(!mediaPlaying_ && lowQualityCompressed_ && !fetchingStopped_) {
+        lowQualityCompressed_ = false;
+        fullFrameNeeded_ = true;
+        imageUpdated_ = true;
+        pump_(mce);
     }
 }
 
@@ -213,6 +593,15 @@ void ImageCompressor::stopFetching() {
     fetchingStopped_ = true;
 }
 
+void ImageCompressor::setFetchingPaused(MCE, bool paused) {
+    REQUIRE_API_THREAD();
+
+    if(paused != fetchingPaused_) {
+        fetchingPaused_ = paused;
+        pump_(mce);
+    }
+}
+
 void ImageCompressor::flush(MCE) {
     REQUIRE_API_THREAD();
 
@@ -221,57 +610,438 @@ void ImageCompressor::flush(MCE) {
     }
 }
 
+int ImageCompressor::iframeSignal() {
+    REQUIRE_API_THREAD();
+    return iframeSignal_;
+}
+
 void ImageCompressor::setIframeSignal(MCE, int signal) {
     REQUIRE_API_THREAD();
     REQUIRE(signal >= 0 && signal < IframeSignalCount);
 
     if(iframeSignal_ != signal) {
         iframeSignal_ = signal;
-        updateNotify(mce);
+        signalsChanged_(mce);
     }
 }
 
+int ImageCompressor::cursorSignal() {
+    REQUIRE_API_THREAD();
+    return cursorSignal_;
+}
+
 void ImageCompressor::setCursorSignal(MCE, int signal) {
     REQUIRE_API_THREAD();
     REQUIRE(signal >= 0 && signal < CursorSignalCount);
 
     if(cursorSignal_ != signal) {
         cursorSignal_ = signal;
-        updateNotify(mce);
+        signalsChanged_(mce);
     }
 }
 
-void ImageCompressor::afterConstruct_(shared_ptr<ImageCompressor> self) {
-    shared_ptr<TaskQueue> taskQueue = TaskQueue::getActiveQueue();
-    compressorThread_ = thread([this, taskQueue]() {
-        ActiveTaskQueueLock activeTaskQueueLock(taskQueue);
+void ImageCompressor::signalsChanged_(MCE) {
+    REQUIRE_API_THREAD();
 
-        unique_lock<mutex> lock(compressorMutex_);
-        while(true) {
-            if(compressorShutdownScheduled_) {
-                return;
-            } else if(compressorTaskScheduled_) {
-                compressorTaskScheduled_ = false;
-                function<void()> task = compressorTask_;
-                compressorTask_ = []() {};
+    if(tileClientFrameIdx_ == 0) {
+        // The signals are carried in the size of the image
+        imageUpdated_ = true;
+        pump_(mce);
+    } else {
+        // The tile client only needs a response to its pending request to
+        // read the new signals from the tile position
+        flush(mce);
+    }
+}
 
-                lock.unlock();
-                task();
-                lock = unique_lock<mutex>(compressorMutex_);
-            } else {
-                compressorCv_.wait(lock);
+ImageCompressorStats ImageCompressor::stats() {
+    REQUIRE_API_THREAD();
+
+    ImageCompressorStats ret = stats_;
+    ret.quality = compressionQuality_();
+    ret.mediaPlaying = mediaPlaying_;
+    ret.memory = memoryUsage();
+
+    steady_clock::time_point now = steady_clock::now();
+    ret.frameRate = frameMeter_.total(now) / BudgetPeriodSeconds;
+    ret.byteRate = byteMeter_.total(now) / BudgetPeriodSeconds;
+    ret.compressionMsRate = compressionMeter_.total(now) / BudgetPeriodSeconds;
+    return ret;
+}
+
+ImageCompressorMemory ImageCompressor::memoryUsage() {
+    REQUIRE_API_THREAD();
+
+    ImageCompressorMemory ret;
+    ret.frameBytes = (uint64_t)frame_->capacity();
+    if(frameShared_) {
+        ret.sharedFrameBytes =
+            4 * (uint64_t)framePitch_ * (uint64_t)frameHeight_;
+    }
+    ret.compressedBytes = compressedImage_.size;
+    for(const pair<string, CompressedImage>& item : cachedTiles_) {
+        ret.compressedBytes += item.second.size;
+    }
+    return ret;
+}
+
+void ImageCompressor::shrinkBuffers() {
+    REQUIRE_API_THREAD();
+
+    if(compressionsInFlight_ != 0) {
+        return;
+    }
+
+    // The next fetch sees an empty buffer (or an unshared frame) and copies
+    // the whole image again
+    frame_ = make_shared<vector<uint8_t>>();
+    frameImage_ = nullptr;
+    frameOwner_.reset();
+    frameShared_ = false;
+    fullyDirty_ = true;
+    guiRowFingerprints_.clear();
+
+    cachedTiles_.clear();
+}
+
+void ImageCompressor::send_(MCE,
+    shared_ptr<HTTPRequest> httpRequest,
+    bool wait,
+    optional<TileRequest> tileRequest,
+    steady_clock::time_point requestTime
+) {
+    REQUIRE_API_THREAD();
+
+    // The client sends a waiting request for the next image once it has
+    // displayed the previous one
+    requestReceived_(wait);
+
+    flush(mce);
+
+    // A tile can only be sent to a client that shows the frame preceding it
+    // (or the frame itself, in which case compositing it again is harmless).
+    // Clients other than tile clients need an image that carries the current
+    // signals in its size.
+    bool canSend;
+    if(tileRequest.has_value()) {
+        canSend =
+            !compressedIsTile_ ||
+            tileRequest->baseFrameIdx + 1 == compressedFrameIdx_ ||
+            tileRequest->baseFrameIdx == compressedFrameIdx_;
+    } else {
+        canSend = !compressedIsTile_ && compressedImageHasSignals_();
+    }
+
+    if(!canSend) {
+        // Discard the tile such that a full frame is compressed next. If we
+        // cannot wait for it, the client retries with a request for a full
+        // frame.
+        if(!fetchingStopped_) {
+            if(compressedImageUpdated_) {
+                ++stats_.framesWasted;
+            }
+            if(!tileRequest.has_value()) {
+                tileClientFrameIdx_ = 0;
+            }
+            fullFrameNeeded_ = true;
+            imageUpdated_ = true;
+            compressedImageUpdated_ = false;
+            pump_(mce);
+        }
+        if(!wait || fetchingStopped_) {
+            httpRequest->sendTextResponse(503, "ERROR: Image not available\n");
+            return;
+        }
+    }
+
+    if(wait && !compressedImageUpdated_) {
+        shared_ptr<ImageCompressor> self = shared_from_this();
+        waitTag_ = postDelayedTask(
+            sendTimeout_,
+            [self, httpRequest, tileRequest, requestTime]() {
+                REQUIRE_API_THREAD();
+                self->waitPending_ = false;
+                self->send_(mce, httpRequest, false, tileRequest, requestTime);
             }
+        );
+        waitPending_ = true;
+        pump_(mce);
+        return;
+    }
+
+    if(
+        tileRequest.has_value() &&
+        !compressedImageUpdated_ &&
+        tileRequest->baseFrameIdx == compressedFrameIdx_
+    ) {
+        // The client already shows the latest image, so instead of sending it
+        // again, we send an empty tile that only lets the client read the
+        // current signals from the tile position
+        sendImage(httpRequest, createWhiteJPEGPixel());
+        ++stats_.emptyTilesSent;
+        tileRequest->sentFunc(compressedFrameIdx_, Rect(), true, {});
+        pump_(mce);
+        return;
+    }
+
+    if(compressedImageUpdated_ && imageUpdated_) {
+        ++stats_.framesWasted;
+    }
+    if(tileRequest.has_value()) {
+        sendTileImage_(httpRequest, *tileRequest);
+    } else {
+        sendImage(httpRequest, compressedImage_);
+    }
+
+    ++stats_.imagesSent;
+    stats_.bytesSent += compressedImage_.size;
+    byteMeter_.add(steady_clock::now(), (double)compressedImage_.size);
+    stats_.requestWaitTime.add(steady_clock::now() - requestTime);
+
+    if(quality_ == AutoQuality) {
+        autoQualitySample_.emplace(steady_clock::now(), compressedImage_.size);
+    }
+
+    if(tileRequest.has_value()) {
+        tileClientFrameIdx_ = compressedFrameIdx_;
+        tileRequest->sentFunc(
+            compressedFrameIdx_,
+            compressedRect_,
+            compressedIsTile_,
+            compressedShift_
+        );
+    } else {
+        tileClientFrameIdx_ = 0;
+    }
+
+    compressedImageUpdated_ = false;
+    schedulePrefetch_(mce);
+    pump_(mce);
+}
+
+void ImageCompressor::sendTileImage_(
+    shared_ptr<HTTPRequest> httpRequest,
+    const TileRequest& tileRequest
+) {
+    REQUIRE_API_THREAD();
+
+    if(
+        tileCaching_ == ImageCompressorOptions::TileCachingOff ||
+        !compressedKey_.has_value() ||
+        compressedImage_.size < ImageCompressorOptions::TileCachingMinBytes
+    ) {
+        sendImage(httpRequest, compressedImage_);
+        return;
+    }
+
+    string key = contentKeyHex(*compressedKey_);
+    bool found = false;
+    for(const pair<string, CompressedImage>& item : cachedTiles_) {
+        if(item.first == key) {
+            found = true;
+            break;
+        }
+    }
+    if(!found) {
+        cachedTiles_.emplace_back(key, compressedImage_);
+        if(cachedTiles_.size() > MaxCachedTiles) {
+            cachedTiles_.pop_front();
         }
+    }
+
+    ++stats_.cachedTileRedirects;
+    httpRequest->sendTextResponse(
+        302,
+        "Redirecting to the cacheable tile URL\n",
+        true,
+        {{"Location", tileRequest.cachedTilePath + key}}
+    );
+}
+
+void ImageCompressor::sendCachedTile(
+    shared_ptr<HTTPRequest> httpRequest,
+    string key
+) {
+    REQUIRE_API_THREAD();
+
+    for(const pair<string, CompressedImage>& item : cachedTiles_) {
+        if(item.first == key) {
+            ++stats_.cachedTileRequests;
+            sendImage(
+                httpRequest,
+                item.second,
+                false,
+                {{
+                    "Cache-Control",
+                    tileCaching_ == ImageCompressorOptions::TileCachingPublic
+                        ? CachedTilePublicCacheControl
+                        : CachedTilePrivateCacheControl
+                }}
+            );
+            return;
+        }
+    }
+
+    httpRequest->sendTextResponse(404, "ERROR: Tile image not available\n");
+}
+
+void ImageCompressor::requestReceived_(bool sample) {
+    REQUIRE_API_THREAD();
+
+    if(autoQualitySample_.has_value()) {
+        if(sample && quality_ == AutoQuality) {
+            updateAutoQuality_(
+                steady_clock::now() - autoQualitySample_->first,
+                autoQualitySample_->second
+            );
+        }
+        autoQualitySample_.reset();
+    }
+    if(lastPollSendTime_.has_value()) {
+        updateEstimate(
+            pollIntervalEstimateMs_,
+            (double)duration_cast<microseconds>(
+                steady_clock::now() - *lastPollSendTime_
+            ).count() / 1000.0
+        );
+        lastPollSendTime_.reset();
+    }
+}
+
+void ImageCompressor::servePipeline_(MCE) {
+    REQUIRE_API_THREAD();
+
+    if(
+        !pipeline_.empty() &&
+        compressedImageUpdated_ &&
+        !compressedIsTile_ &&
+        compressedImageHasSignals_()
+    ) {
+        pair<shared_ptr<HTTPRequest>, steady_clock::time_point> oldest =
+            move(pipeline_.front());
+        pipeline_.pop_front();
+        send_(mce, oldest.first, false, {}, oldest.second);
+    }
+
+    if(pipeline_.empty()) {
+        pipelineTag_.reset();
+        return;
+    }
+
+    steady_clock::duration delay = max(
+        pipeline_.front().second + sendTimeout_ - steady_clock::now(),
+        steady_clock::duration::zero()
+    );
+    shared_ptr<ImageCompressor> self = shared_from_this();
+    pipelineTag_ = postDelayedTask(delay, [self]() {
+        REQUIRE_API_THREAD();
+
+        // The oldest request has timed out; answer it with the latest image
+        pair<shared_ptr<HTTPRequest>, steady_clock::time_point> oldest =
+            move(self->pipeline_.front());
+        self->pipeline_.pop_front();
+        self->pipelineTag_.reset();
+        self->send_(mce, oldest.first, false, {}, oldest.second);
+        self->servePipeline_(mce);
     });
 }
 
-tuple<vector<uint8_t>, size_t, size_t> ImageCompressor::fetchImage_(MCE) {
+void ImageCompressor::pushStream_(MCE) {
+    REQUIRE_API_THREAD();
+
+    if(
+        !stream_ ||
+        !streamReady_ ||
+        !(streamNeedsImage_ || compressedImageUpdated_)
+    ) {
+        return;
+    }
+
+    if(compressedIsTile_ || !compressedImageHasSignals_()) {
+        // The image was compressed for a polling tile client; the stream needs
+        // a full frame that carries the signals instead
+        if(!fetchingStopped_) {
+            if(compressedImageUpdated_) {
+                ++stats_.framesWasted;
+            }
+            tileClientFrameIdx_ = 0;
+            fullFrameNeeded_ = true;
+            imageUpdated_ = true;
+            compressedImageUpdated_ = false;
+            streamNeedsImage_ = true;
+            pump_(mce);
+        }
+        return;
+    }
+
+    if(compressedImageUpdated_ && imageUpdated_) {
+        ++stats_.framesWasted;
+    }
+    stream_->push(compressedImage_);
+    streamReady_ = false;
+    streamNeedsImage_ = false;
+
+    ++stats_.imagesSent;
+    stats_.bytesSent += compressedImage_.size;
+    byteMeter_.add(steady_clock::now(), (double)compressedImage_.size);
+
+    if(quality_ == AutoQuality) {
+        autoQualitySample_.emplace(steady_clock::now(), compressedImage_.size);
+    }
+
+    tileClientFrameIdx_ = 0;
+    compressedImageUpdated_ = false;
+    pump_(mce);
+}
+
+void ImageCompressor::streamImageWritten_(MCE, uint64_t streamIdx) {
+    REQUIRE_API_THREAD();
+
+    if(!stream_ || streamIdx != streamIdx_) {
+        return;
+    }
+    if(stream_->ended()) {
+        stream_.reset();
+        return;
+    }
+
+    // The image in transit has been written to the connection
+    if(autoQualitySample_.has_value()) {
+        if(quality_ == AutoQuality) {
+            updateAutoQuality_(
+                steady_clock::now() - autoQualitySample_->first,
+                autoQualitySample_->second
+            );
+        }
+        autoQualitySample_.reset();
+    }
+
+    streamReady_ = true;
+    pushStream_(mce);
+
+    // In demand-driven mode, the stream being ready may be what the pending
+    // update was waiting for
+    pump_(mce);
+}
+
+Rect ImageCompressor::fetchImage_(MCE) {
     REQUIRE_API_THREAD();
     REQUIRE(!fetchingStopped_);
+    REQUIRE(compressionsInFlight_ != 0);
 
-    vector<uint8_t> data;
-    size_t width;
-    size_t height;
+    // The compressions of the previous frames (other than the one being
+    // started) may still be reading our copy of the frame, so we update a copy
+    // of it instead
+    if(compressionsInFlight_ > 1 && !frameShared_) {
+        frame_ = make_shared<vector<uint8_t>>(*frame_);
+    }
+
+    vector<uint8_t>& data = *frame_;
+    Rect changed;
+
+    // Tile clients read the signals from the tile positions, so the frames
+    // sent to them need not carry the signals
+    frameHasSignals_ = tileClientFrameIdx_ == 0;
 
     if(shared_ptr<ImageCompressorEventHandler> eventHandler = eventHandler_.lock()) {
         bool funcCalled = false;
@@ -279,7 +1049,8 @@ tuple<vector<uint8_t>, size_t, size_t> ImageCompressor::fetchImage_(MCE) {
             const uint8_t* srcImage,
             size_t srcWidth,
             size_t srcHeight,
-            size_t srcPitch
+            size_t srcPitch,
+            shared_ptr<const void> owner
         ) {
             REQUIRE(!funcCalled);
             funcCalled = true;
@@ -289,101 +1060,802 @@ tuple<vector<uint8_t>, size_t, size_t> ImageCompressor::fetchImage_(MCE) {
             srcWidth = min(srcWidth, (size_t)16384);
             srcHeight = min(srcHeight, (size_t)16384);
 
-            width = srcWidth;
-            height = srcHeight;
+            if(owner) {
+                // We can compress a shared image directly if we crop it to
+                // carry the signals in its size instead of padding it
+                size_t width = srcWidth;
+                size_t height = srcHeight;
+                while(
+                    frameHasSignals_ &&
+                    width &&
+                    (int)(width % (size_t)IframeSignalCount) != iframeSignal_
+                ) {
+                    --width;
+                }
+                while(
+                    frameHasSignals_ &&
+                    height &&
+                    (int)(height % (size_t)CursorSignalCount) != cursorSignal_
+                ) {
+                    --height;
+                }
+
+                if(width && height) {
+                    Rect frameRect(0, (int)width, 0, (int)height);
+                    if(
+                        !frameShared_ ||
+                        fullyDirty_ ||
+                        width != frameWidth_ ||
+                        height != frameHeight_
+                    ) {
+                        changed = frameRect;
+                    } else {
+                        changed = Rect::intersection(dirtyRect_, frameRect);
+                    }
+
+                    frameWidth_ = width;
+                    frameHeight_ = height;
+                    frameImage_ = srcImage;
+                    framePitch_ = srcPitch;
+                    frameOwner_ = move(owner);
+                    frameShared_ = true;
+
+                    // Free the memory of our own copy
+                    vector<uint8_t>().swap(data);
+                    return;
+                }
+            }
+            frameShared_ = false;
 
-            while((int)(width % (size_t)IframeSignalCount) != iframeSignal_) {
+            size_t width = srcWidth;
+            size_t height = srcHeight;
+
+            while(
+                frameHasSignals_ &&
+                (int)(width % (size_t)IframeSignalCount) != iframeSignal_
+            ) {
                 ++width;
             }
-            while((int)(height % (size_t)CursorSignalCount) != cursorSignal_) {
+            while(
+                frameHasSignals_ &&
+                (int)(height % (size_t)CursorSignalCount) != cursorSignal_
+            ) {
                 ++height;
             }
 
-            data.resize(4 * width * height, (uint8_t)255);
+            Rect srcRect(0, (int)srcWidth, 0, (int)srcHeight);
+            bool resized =
+                width != frameWidth_ ||
+                height != frameHeight_ ||
+                data.size() != 4 * width * height;
+            if(resized) {
+                frameWidth_ = width;
+                frameHeight_ = height;
+                data.assign(4 * width * height, (uint8_t)255);
+                changed = Rect(0, (int)width, 0, (int)height);
+            } else if(fullyDirty_) {
+                changed = srcRect;
+            } else {
+                changed = Rect::intersection(dirtyRect_, srcRect);
+            }
+
+            Rect copyRect = Rect::intersection(changed, srcRect);
+            if(!copyRect.isEmpty()) {
+                // The alpha byte of the last pixel of the line is not copied.
+                size_t lineBytes = 4 * (copyRect.endX - copyRect.startX);
+                if((size_t)copyRect.endX == srcWidth) {
+                    --lineBytes;
+                }
+
+                // Only copy the lines that differ, keeping track which lines
+                // actually changed
+                int changedStartY = copyRect.endY;
+                int changedEndY = copyRect.startY;
+
+                const uint8_t* srcLine =
+                    srcImage + 4 * (copyRect.startY * srcPitch + copyRect.startX);
+                uint8_t* line =
+                    data.data() + 4 * (copyRect.startY * width + copyRect.startX);
+                for(int y = copyRect.startY; y < copyRect.endY; ++y) {
+                    if(memcmp(line, srcLine, lineBytes)) {
+                        memcpy(line, srcLine, lineBytes);
+                        changedStartY = min(changedStartY, y);
+                        changedEndY = y + 1;
+                    }
+                    srcLine += 4 * srcPitch;
+                    line += 4 * width;
+                }
 
-            const uint8_t* srcLine = srcImage;
-            uint8_t* line = data.data();
-            for(size_t y = 0; y < srcHeight; ++y) {
-                memcpy(line, srcLine, 4 * srcWidth - 1);
-                srcLine += 4 * srcPitch;
-                line += 4 * width;
+                if(!resized) {
+                    changed = Rect(
+                        copyRect.startX,
+                        copyRect.endX,
+                        changedStartY,
+                        max(changedStartY, changedEndY)
+                    );
+                }
             }
         };
         eventHandler->onImageCompressorFetchImage(func);
         REQUIRE(funcCalled);
 
-        eventHandler->onImageCompressorRenderGUI(data, width, height);
+        dirtyRect_ = Rect();
+        fullyDirty_ = false;
+
+        if(!frameShared_ && eventHandler->onImageCompressorRenderGUI(
+            data, frameWidth_, frameHeight_
+        )) {
+            // The GUI has been drawn on top of the frame, so the next fetch
+            // needs to restore the whole image. As the GUI may cover any part
+            // of the frame, we detect changes by comparing fingerprints of
+            // the rows of the frame; this way, changes to the GUI only cause
+            // the affected rows to be encoded again.
+            fullyDirty_ = true;
+            bool hadFingerprints = guiRowFingerprints_.size() == frameHeight_;
+            guiRowFingerprints_.resize(frameHeight_);
+            int changedStartY = (int)frameHeight_;
+            int changedEndY = 0;
+            size_t rowBytes = 4 * frameWidth_;
+            for(size_t y = 0; y < frameHeight_; ++y) {
+                uint64_t fingerprint =
+                    computeFingerprint(data.data() + y * rowBytes, rowBytes);
+                if(!hadFingerprints || guiRowFingerprints_[y] != fingerprint) {
+                    changedStartY = min(changedStartY, (int)y);
+                    changedEndY = (int)y + 1;
+                }
+                guiRowFingerprints_[y] = fingerprint;
+            }
+            if(changedStartY < changedEndY) {
+                changed = Rect(0, (int)frameWidth_, changedStartY, changedEndY);
+            } else {
+                changed = Rect();
+            }
+        } else {
+            guiRowFingerprints_.clear();
+        }
     } else {
-        data.resize(4, (uint8_t)255);
-        width = 1;
-        height = 1;
+        data.assign(4, (uint8_t)255);
+        frameWidth_ = 1;
+        frameHeight_ = 1;
+        frameShared_ = false;
+        fullyDirty_ = true;
+        guiRowFingerprints_.clear();
+        changed = Rect(0, 1, 0, 1);
     }
 
-    return {move(data), width, height};
+    if(!frameShared_) {
+        frameImage_ = data.data();
+        framePitch_ = frameWidth_;
+        frameOwner_ = frame_;
+    }
+
+    return changed;
+}
+
+bool ImageCompressor::compressedImageHasSignals_() {
+    REQUIRE_API_THREAD();
+
+    int width = compressedRect_.endX - compressedRect_.startX;
+    int height = compressedRect_.endY - compressedRect_.startY;
+    return
+        width % IframeSignalCount == iframeSignal_ &&
+        height % CursorSignalCount == cursorSignal_;
+}
+
+Rect ImageCompressor::computeTileRect_(Rect changed) {
+    REQUIRE(!changed.isEmpty());
+
+    // Align the tile to 16x16 blocks, which avoids misaligned JPEG blocks and
+    // chroma subsampling artifacts at the tile edges.
+    const int Align = 16;
+    int frameWidth = (int)frameWidth_;
+    int frameHeight = (int)frameHeight_;
+
+    Rect rect(
+        changed.startX / Align * Align,
+        min((changed.endX + Align - 1) / Align * Align, frameWidth),
+        changed.startY / Align * Align,
+        min((changed.endY + Align - 1) / Align * Align, frameHeight)
+    );
+
+    if(!frameHasSignals_) {
+        return rect;
+    }
+
+    // The client reads the signals from the tile size, so we grow the tile
+    // until its size matches the signals. As the size of the whole frame has
+    // the right signals, this always terminates.
+    while((rect.endX - rect.startX) % IframeSignalCount != iframeSignal_) {
+        if(rect.endX < frameWidth) {
+            ++rect.endX;
+        } else {
+            --rect.startX;
+        }
+    }
+    while((rect.endY - rect.startY) % CursorSignalCount != cursorSignal_) {
+        if(rect.endY < frameHeight) {
+            ++rect.endY;
+        } else {
+            --rect.startY;
+        }
+    }
+    REQUIRE(rect.startX >= 0 && rect.startY >= 0);
+
+    return rect;
 }
 
 void ImageCompressor::pump_(MCE) {
     REQUIRE_API_THREAD();
 
+    // The frames being compressed and the compressed frame waiting to be sent
+    // count towards the compression depth
+    size_t depth = tileClientFrameIdx_ == 0 ? compressionDepth_ : 1;
+    size_t framesAhead =
+        compressionsInFlight_ + (compressedImageUpdated_ ? 1 : 0);
+
     if(
         fetchingStopped_ ||
-        compressionInProgress_ ||
+        fetchingPaused_ ||
+        framesAhead >= depth ||
         !imageUpdated_ ||
-        compressedImageUpdated_
+        (demandDriven_ && !hasDemand_()) ||
+        budgetTag_ ||
+        !checkBudgets_(mce)
     ) {
         return;
     }
 
-    compressionInProgress_ = true;
+    ++compressionsInFlight_;
     imageUpdated_ = false;
+    prefetchDue_ = false;
+    prefetchTag_.reset();
+
+    int quality = compressionQuality_();
 
-    int quality = quality_;
+    bool tileAllowed =
+        !fullFrameNeeded_ &&
+        tileClientFrameIdx_ != 0 &&
+        tileClientFrameIdx_ == frameIdx_;
 
-    vector<uint8_t> imageData;
-    size_t imageWidth;
-    size_t imageHeight;
-    tie(imageData, imageWidth, imageHeight) = fetchImage_(mce);
+    PROBE(fetch_start, frameWidth_, frameHeight_);
+    Rect changed = fetchImage_(mce);
+    PROBE(
+        fetch_end,
+        changed.startX, changed.endX, changed.startY, changed.endY
+    );
+    ++stats_.framesFetched;
+
+    Rect fullRect(0, (int)frameWidth_, 0, (int)frameHeight_);
+    uint64_t frameArea = (uint64_t)frameWidth_ * (uint64_t)frameHeight_;
+    auto area = [](Rect rect) {
+        return
+            (uint64_t)(rect.endX - rect.startX) *
+            (uint64_t)(rect.endY - rect.startY);
+    };
+
+    // Scroll detection is only attempted if the changed region is too large to
+    // be sent as a tile as such
+    optional<ScrollShift> shift;
+    if(tileClientFrameIdx_ != 0) {
+        bool detect =
+            tileAllowed &&
+            !changed.isEmpty() &&
+            2 * area(computeTileRect_(changed)) > frameArea;
+        shift = scrollDetector_.update(
+            frameImage_,
+            frameWidth_,
+            frameHeight_,
+            framePitch_,
+            changed,
+            detect
+        );
+    } else {
+        scrollDetector_.reset();
+    }
+    if(tileAllowed && !shift.has_value()) {
+        changed = Rect::boundingBox(changed, pendingResidue_);
+        pendingResidue_ = Rect();
+    }
+
+    // If the frame is identical to the one in compressedImage_ or to the
+    // latest frame still being compressed, we can keep using it
+    if(
+        changed.isEmpty() &&
+        !fullFrameNeeded_ &&
+        (compressedFrameIdx_ == frameIdx_ || compressionsInFlight_ > 1) &&
+        compressedQuality_ == quality
+    ) {
+        --compressionsInFlight_;
+        if(!pendingResidue_.isEmpty()) {
+            imageUpdated_ = true;
+        }
+        return;
+    }
+
+    uint64_t frameIdx = ++frameIdx_;
+    compressedQuality_ = quality;
+
+    TraceList traces;
+    swap(traces, pendingTraces_);
+    if(!traces.empty()) {
+        traceStage(traces, "fetch", "frame " + toString(frameIdx));
+    }
+    if(quality != normalQuality_()) {
+        lowQualityCompressed_ = true;
+    }
+
+    // If the frame was scrolled, the client shifts the band of lines covered
+    // by the shift, and the tile only needs to cover the changed lines outside
+    // it. The tile cannot be empty, so if there are no such lines, we use a
+    // rectangle inside the band, which the tile overwrites with the same
+    // content.
+    if(shift.has_value()) {
+        Rect outside = Rect::boundingBox(
+            Rect(changed.startX, changed.endX, changed.startY, shift->startY),
+            Rect(changed.startX, changed.endX, shift->endY, changed.endY)
+        );
+        if(outside.isEmpty()) {
+            outside = Rect(0, 1, shift->startY, shift->startY + 1);
+        }
+        changed = outside;
+    }
+
+    // Only send a tile if it is significantly smaller than the full frame
+    Rect rect = fullRect;
+    bool isTile = false;
+    if(tileAllowed && !changed.isEmpty()) {
+        Rect tileRect = computeTileRect_(changed);
+        if(2 * area(tileRect) <= frameArea) {
+            rect = tileRect;
+            isTile = true;
+        }
+    }
+    if(isTile && shift.has_value()) {
+        // The columns right of the shifted band are sent in a follow-up tile
+        pendingResidue_ = Rect::boundingBox(
+            pendingResidue_,
+            Rect(shift->endX, (int)frameWidth_, shift->startY, shift->endY)
+        );
+    } else {
+        shift.reset();
+    }
+    if(!isTile) {
+        fullFrameNeeded_ = false;
+        pendingResidue_ = Rect();
+    }
+    if(!pendingResidue_.isEmpty()) {
+        imageUpdated_ = true;
+    }
+
+    JPEGOptions jpegOptions = jpegOptions_(quality, area(rect));
+
+    // The frame is not modified until compressTaskDone_ has been called, so the
+    // compressor thread may read it without copying.
+    shared_ptr<const void> imageOwner = frameOwner_;
+    const uint8_t* imageBase = frameImage_;
+    size_t pitch = framePitch_;
 
     shared_ptr<ImageCompressor> self = shared_from_this();
     shared_ptr<PNGCompressor> pngCompressor = pngCompressor_;
+    size_t jpegStripCount = jpegStripCount_;
+    JPEGParallelFor jpegParallelFor = jpegParallelFor_;
+    bool hybrid = hybrid_;
+    shared_ptr<FrameCache> frameCache = frameCache_;
+    bool computeContentKey =
+        frameCache_ || tileCaching_ != ImageCompressorOptions::TileCachingOff;
     function<void()> task = [
         self,
         pngCompressor,
+        hybrid,
+        jpegOptions,
+        frameCache,
+        computeContentKey,
+        jpegStripCount,
+        jpegParallelFor,
         quality,
-        imageData{move(imageData)},
-        imageWidth,
-        imageHeight
+        imageOwner,
+        imageBase,
+        pitch,
+        frameIdx,
+        rect,
+        isTile,
+        shift,
+        traces
     ]() {
+        steady_clock::time_point startTime = steady_clock::now();
+
+        const uint8_t* image =
+            imageBase + 4 * (rect.startY * pitch + rect.startX);
+        size_t width = rect.endX - rect.startX;
+        size_t height = rect.endY - rect.startY;
+
+        PROBE(compress_start, frameIdx, quality, width, height);
+
+        // Images with the same content and encoder parameters, also in other
+        // windows, are only compressed once. The JPEG options other than
+        // progressive and subsampling are the same for all the windows. The
+        // same key identifies the image in its cacheable tile URL.
+        optional<FrameCacheKey> cacheKey;
+        optional<CompressedImage> cachedImage;
+        if(computeContentKey) {
+            uint64_t params =
+                (uint64_t)quality |
+                ((uint64_t)hybrid << 8) |
+                ((uint64_t)jpegOptions.progressive << 9) |
+                ((uint64_t)jpegOptions.subsampling << 10);
+            cacheKey =
+                FrameCache::computeKey(image, width, height, pitch, params);
+        }
+        if(frameCache) {
+            cachedImage = frameCache->lookup(*cacheKey);
+        }
+
         CompressedImage compressedImage;
-        if(quality == 101) {
-            compressedImage =
-                compressPNG_(imageData, imageWidth, imageHeight, pngCompressor);
+        if(cachedImage.has_value()) {
+            compressedImage = move(*cachedImage);
         } else {
-            compressedImage =
-                compressJPEG_(imageData, imageWidth, imageHeight, quality);
+            // In hybrid mode, images with few colors (text and UI) are sent as
+            // lossless indexed-color PNGs instead of JPEGs
+            shared_ptr<const vector<vector<uint8_t>>> indexedPNG;
+            if(hybrid && quality != 101) {
+                indexedPNG =
+                    pngCompressor->compressIndexed(image, width, height, pitch);
+            }
+
+            if(quality == 101) {
+                compressedImage =
+                    compressPNG_(image, width, height, pitch, pngCompressor);
+            } else if(indexedPNG) {
+                compressedImage = pngImage_(move(indexedPNG));
+            } else {
+                compressedImage = compressJPEG_(
+                    image,
+                    width,
+                    height,
+                    pitch,
+                    quality,
+                    jpegStripCount,
+                    jpegParallelFor,
+                    jpegOptions
+                );
+            }
+            if(frameCache) {
+                frameCache->insert(*cacheKey, compressedImage);
+            }
+        }
+
+        PROBE(compress_end, frameIdx, quality, compressedImage.size);
+
+        if(!traces.empty()) {
+            traceStage(
+                traces,
+                "compressed",
+                compressedImage.contentType + ", " +
+                    toString(compressedImage.size) + " bytes"
+            );
+            compressedImage = traceSent(move(compressedImage), traces);
         }
 
-        postTask(self, &ImageCompressor::compressTaskDone_, mce, compressedImage);
+        postTask(
+            self,
+            &ImageCompressor::compressTaskDone_,
+            mce,
+            compressedImage,
+            frameIdx,
+            rect,
+            isTile,
+            shift,
+            steady_clock::now() - startTime,
+            cacheKey
+        );
     };
 
-    {
-        lock_guard<mutex> lock(compressorMutex_);
-        REQUIRE(!compressorTaskScheduled_);
-        compressorTask_ = task;
-        compressorTaskScheduled_ = true;
+    // Frames that may reflect recent input go before the other windows in the
+    // pool, and frames that nobody is waiting for (compressed eagerly) or that
+    // belong to a window close to its budgets go last
+    CompressorQueue::Priority priority;
+    if(nearBudget_()) {
+        priority = CompressorQueue::Background;
+    } else if(
+        lastInputTime_.has_value() &&
+        steady_clock::now() - *lastInputTime_ < InteractionQuietPeriod
+    ) {
+        priority = CompressorQueue::Interactive;
+    } else if(hasDemand_()) {
+        priority = CompressorQueue::Normal;
+    } else {
+        priority = CompressorQueue::Background;
     }
-    compressorCv_.notify_one();
+    compressorQueue_->post(task, priority);
 }
 
-void ImageCompressor::compressTaskDone_(MCE, CompressedImage compressedImage) {
+void ImageCompressor::compressTaskDone_(MCE,
+    CompressedImage compressedImage,
+    uint64_t frameIdx,
+    Rect rect,
+    bool isTile,
+    optional<ScrollShift> shift,
+    steady_clock::duration compressionTime,
+    optional<FrameCacheKey> contentKey
+) {
     REQUIRE_API_THREAD();
-    REQUIRE(compressionInProgress_);
+    REQUIRE(compressionsInFlight_ != 0);
+
+    --compressionsInFlight_;
+    ++stats_.framesCompressed;
+    stats_.compressionTime.add(compressionTime);
+
+    steady_clock::time_point now = steady_clock::now();
+    frameMeter_.add(now, 1.0);
+    compressionMeter_.add(
+        now,
+        (double)duration_cast<microseconds>(compressionTime).count() / 1000.0
+    );
+    updateEstimate(
+        compressionTimeEstimateMs_,
+        (double)duration_cast<microseconds>(compressionTime).count() / 1000.0
+    );
+
+    if(frameIdx < compressedFrameIdx_) {
+        // A newer frame compressed in parallel finished first
+        ++stats_.framesWasted;
+        pump_(mce);
+        return;
+    }
+    if(compressedImageUpdated_) {
+        // The previous compressed frame was replaced before it was sent
+        ++stats_.framesWasted;
+    }
 
-    compressionInProgress_ = false;
     compressedImageUpdated_ = true;
     compressedImage_ = compressedImage;
+    compressedKey_ = contentKey;
+    compressedFrameIdx_ = frameIdx;
+    compressedRect_ = rect;
+    compressedIsTile_ = isTile;
+    compressedShift_ = shift;
 
     flush(mce);
+    servePipeline_(mce);
+    pushStream_(mce);
+
+    // With a compression depth above 1, the next frame may be started while
+    // this one waits to be sent
+    pump_(mce);
+}
+
+bool ImageCompressor::hasDemand_() {
+    REQUIRE_API_THREAD();
+
+    return
+        waitPending_ ||
+        !pipeline_.empty() ||
+        prefetchDue_ ||
+        (stream_ && streamReady_ && !stream_->ended());
+}
+
+void ImageCompressor::schedulePrefetch_(MCE) {
+    REQUIRE_API_THREAD();
+
+    if(!demandDriven_) {
+        return;
+    }
+
+    lastPollSendTime_ = steady_clock::now();
+    prefetchDue_ = false;
+    prefetchTag_.reset();
+
+    // Start the compression so that it completes by the time the client is
+    // expected to poll the next image; until we have measurements, we start
+    // immediately as in the eager mode
+    double delayMs =
+        pollIntervalEstimateMs_ -
+        1.5 * compressionTimeEstimateMs_ -
+        PrefetchMarginMs;
+    if(delayMs <= 0.0) {
+        prefetchDue_ = true;
+        return;
+    }
+
+    shared_ptr<ImageCompressor> self = shared_from_this();
+    prefetchTag_ = postDelayedTask(
+        microseconds((int64_t)(1000.0 * delayMs)),
+        [self]() {
+            REQUIRE_API_THREAD();
+            self->prefetchDue_ = true;
+            self->pump_(mce);
+        }
+    );
+}
+
+int ImageCompressor::compressionQuality_() {
+    int quality = normalQuality_();
+    if(interacting_) {
+        quality = min(quality, interactionQuality_);
+    }
+    if(mediaPlaying_ && videoQuality_ != 0) {
+        quality = min(quality, videoQuality_);
+    }
+    return min(quality, budgetQualityCap_);
+}
+
+int ImageCompressor::normalQuality_() {
+    if(quality_ == AutoQuality) {
+        return AutoQualityLevels[autoQualityIdx_];
+    } else {
+        return quality_;
+    }
+}
+
+bool ImageCompressor::useProgressiveJPEG_(int quality, uint64_t pixelCount) {
+    REQUIRE_API_THREAD();
+
+    if(
+        quality == 101 ||
+        pixelCount < ImageCompressorOptions::ProgressiveJPEGMinPixels
+    ) {
+        return false;
+    }
+    if(progressiveJPEG_ == ImageCompressorOptions::ProgressiveAlways) {
+        return true;
+    }
+    return
+        progressiveJPEG_ == ImageCompressorOptions::ProgressiveAuto &&
+        quality_ == AutoQuality &&
+        autoQualityIdx_ <= AutoQualityProgressiveMaxIdx;
+}
+
+JPEGOptions ImageCompressor::jpegOptions_(int quality, uint64_t pixelCount) {
+    REQUIRE_API_THREAD();
+
+    JPEGOptions options = jpegBaseOptions_;
+    options.progressive = useProgressiveJPEG_(quality, pixelCount);
+    if(jpegAutoSubsampling_) {
+        if(quality >= JPEGAutoSubsampling444MinQuality) {
+            options.subsampling = JPEGOptions::Subsampling444;
+        } else if(quality >= JPEGAutoSubsampling422MinQuality) {
+            options.subsampling = JPEGOptions::Subsampling422;
+        } else {
+            options.subsampling = JPEGOptions::Subsampling420;
+        }
+    }
+    return options;
+}
+
+void ImageCompressor::endInteraction_(MCE) {
+    REQUIRE_API_THREAD();
+
+    interacting_ = false;
+    interactionTag_.reset();
+
+    // Refine the image shown by the client with a full frame at the normal
+    // quality, as the tiles sent after the low quality frames would only
+    // refine the regions that changed
+    if(lowQualityCompressed_ && !fetchingStopped_) {
+        lowQualityCompressed_ = false;
+        fullFrameNeeded_ = true;
+        imageUpdated_ = true;
+        pump_(mce);
+    }
+}
+
+bool ImageCompressor::checkBudgets_(MCE) {
+    REQUIRE_API_THREAD();
+
+    steady_clock::time_point now = steady_clock::now();
+    steady_clock::time_point retryTime = now;
+
+    if(budgetBytesPerSecond_ != 0) {
+        double limit = (double)budgetBytesPerSecond_ * BudgetPeriodSeconds;
+        double bytes = byteMeter_.total(now);
+        if(bytes >= limit) {
+            budgetQualityCap_ = max(
+                min(budgetQualityCap_, min(normalQuality_(), 100)) -
+                    BudgetQualityStep,
+                BudgetMinQuality
+            );
+            retryTime = max(retryTime, byteMeter_.belowLimitTime(now, limit));
+        } else if(2.0 * bytes < limit && budgetQualityCap_ <= 100) {
+            budgetQualityCap_ += BudgetQualityStep;
+            if(budgetQualityCap_ > 100) {
+                budgetQualityCap_ = 101;
+            }
+        }
+    }
+    int fpsLimit = fpsLimit_();
+    if(fpsLimit != 0) {
+        double limit = (double)fpsLimit * BudgetPeriodSeconds;
+        retryTime = max(retryTime, frameMeter_.belowLimitTime(now, limit));
+    }
+    if(budgetCompressionMsPerSecond_ != 0) {
+        double limit =
+            (double)budgetCompressionMsPerSecond_ * BudgetPeriodSeconds;
+        retryTime = max(
+            retryTime, compressionMeter_.belowLimitTime(now, limit)
+        );
+    }
+
+    if(retryTime <= now) {
+        return true;
+    }
+
+    ++stats_.budgetThrottles;
+    shared_ptr<ImageCompressor> self = shared_from_this();
+    budgetTag_ = postDelayedTask(
+        retryTime - now,
+        [self]() {
+            REQUIRE_API_THREAD();
+            self->budgetTag_.reset();
+            self->pump_(mce);
+        }
+    );
+    return false;
+}
+
+bool ImageCompressor::nearBudget_() {
+    REQUIRE_API_THREAD();
+
+    steady_clock::time_point now = steady_clock::now();
+    auto near = [&](RateMeter& meter, double perSecond) {
+        return
+            perSecond != 0.0 &&
+            meter.total(now) >=
+                BudgetLowPriorityFraction * perSecond * BudgetPeriodSeconds;
+    };
+    return
+        near(frameMeter_, (double)fpsLimit_()) ||
+        near(byteMeter_, (double)budgetBytesPerSecond_) ||
+        near(compressionMeter_, (double)budgetCompressionMsPerSecond_);
+}
+
+int ImageCompressor::fpsLimit_() {
+    if(mediaPlaying_ && videoFPS_ != 0) {
+        return budgetFPS_ == 0 ? videoFPS_ : min(budgetFPS_, videoFPS_);
+    }
+    return budgetFPS_;
+}
+
+void ImageCompressor::updateAutoQuality_(
+    steady_clock::duration latency,
+    uint64_t size
+) {
+    REQUIRE_API_THREAD();
+    REQUIRE(quality_ == AutoQuality);
+
+    if(size < AutoQualityMinSampleSize) {
+        return;
+    }
+
+    double latencyMs = (double)duration_cast<milliseconds>(latency).count();
+    if(autoQualitySampleCount_ == 0) {
+        autoQualityLatencyMs_ = latencyMs;
+    } else {
+        autoQualityLatencyMs_ = 0.6 * autoQualityLatencyMs_ + 0.4 * latencyMs;
+    }
+    ++autoQualitySampleCount_;
+
+    size_t maxIdx = AutoQualityLevelCount - (allowPNG_ ? 1 : 2);
+    double target = (double)AutoQualityTargetLatencyMs;
+
+    // Decrease the quality immediately when the images are too slow to
+    // transfer, but only increase it after several fast samples to avoid
+    // oscillation. After a change, the estimate is started from scratch.
+    size_t oldIdx = autoQualityIdx_;
+    if(autoQualityLatencyMs_ > 1.3 * target) {
+        size_t step = autoQualityLatencyMs_ > 2.5 * target ? 2 : 1;
+        autoQualityIdx_ -= min(autoQualityIdx_, step);
+    } else if(
+        autoQualitySampleCount_ >= 3 &&
+        autoQualityLatencyMs_ < 0.6 * target &&
+        autoQualityIdx_ < maxIdx
+    ) {
+        ++autoQualityIdx_;
+    }
+    autoQualityIdx_ = min(autoQualityIdx_, maxIdx);
+
+    if(autoQualityIdx_ != oldIdx) {
+        autoQualitySampleCount_ = 0;
+    }
 }
 
 }
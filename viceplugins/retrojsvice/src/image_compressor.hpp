@@ -1,29 +1,205 @@
 #pragma once
 
-#include "common.hpp"
-
-class PNGCompressor;
+#include "frame_cache.hpp"
+#include "image_stream.hpp"
+#include "jpeg.hpp"
+#include "png.hpp"
+#include "rect.hpp"
+#include "scroll_detector.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 namespace retrojsvice {
 
+// See ImageCompressorEventHandler::onImageCompressorFetchImage.
+typedef function<void(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    shared_ptr<const void> owner
+)> PutImageFunc;
+
 class ImageCompressorEventHandler {
 public:
     // The handler must call func exactly once with the image specs before
     // returning. The image is specified using the argument set
     // (image, width, height, pitch), where width > 0 and height > 0. For all
     // 0 <= y < height and 0 <= x < width, image[4 * (y * pitch + x) + c] is the
-    // value for color blue, green and red for c = 0, 1, 2, respectively. The
-    // callback func will not retain the image pointer; it will copy the data
-    // before returning.
+    // value for color blue, green and red for c = 0, 1, 2, respectively. If
+    // owner is null, the callback func will not retain the image pointer; it
+    // will copy the data before returning. Otherwise, the image data stays
+    // valid and unmodified as long as owner (or a copy of it) exists, and the
+    // compressor may use it directly without copying.
     virtual void onImageCompressorFetchImage(
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ) = 0;
 
-    virtual void onImageCompressorRenderGUI(
+    // Called for each fetched image to draw possible GUI elements on top of it.
+    // Must return true if the image data was modified.
+    virtual bool onImageCompressorRenderGUI(
         vector<uint8_t>& data, size_t width, size_t height
     ) = 0;
 };
 
+// Options for the image compressors, shared by all the windows.
+struct ImageCompressorOptions {
+    PNGOptions png;
+
+    // If true, frames are only fetched and compressed while there is demand
+    // for them: a request is waiting for the next image, an image stream is
+    // ready for one, or the client is expected to poll for the next image
+    // soon. Otherwise, the next frame is compressed as soon as the previous
+    // compressed image has been sent.
+    bool demandDriven = false;
+
+    // If nonzero, the JPEG quality (10..100) used while the user is
+    // interacting with the window (see ImageCompressor::notifyInteraction),
+    // if it is lower than the normal quality. Once the input has been quiet
+    // for a while, a full frame is compressed at the normal quality.
+    int interactionQuality = 0;
+
+    // If true (and the client supports PNG), each compressed image (a full
+    // frame or a tile) that would be encoded as JPEG is instead encoded as a
+    // lossless indexed-color PNG if it has at most 256 distinct colors, which
+    // is typical for text and UI content. As tile clients composite the tiles
+    // on top of the previous frame, text changed on a page with photos is
+    // sent losslessly while the photos stay JPEG.
+    bool hybrid = false;
+
+    // Which JPEG images are encoded as progressive JPEGs, which browsers show
+    // as a coarse image first while the rest is received: none, all, or (in
+    // Auto mode) those compressed while the automatic quality mode has
+    // lowered the quality because of a slow connection. Images smaller than
+    // ProgressiveJPEGMinPixels are never progressive, as they arrive quickly
+    // anyway.
+    enum ProgressiveJPEG {ProgressiveNever, ProgressiveAuto, ProgressiveAlways};
+    ProgressiveJPEG progressiveJPEG = ProgressiveNever;
+    static constexpr uint64_t ProgressiveJPEGMinPixels = 320 * 240;
+
+    // Encoder settings of the JPEG images (progressive is set per image as
+    // described above). If jpegAutoSubsampling is set, the chroma
+    // subsampling is instead chosen by the quality of each image: 4:4:4 at
+    // quality 80 and above, where the user has asked for readable text,
+    // 4:2:2 at 50..79 and 4:2:0 below.
+    JPEGOptions jpeg;
+    bool jpegAutoSubsampling = false;
+
+    // The number of image requests a pipelining client may keep in flight at
+    // a time (see ImageCompressor::sendCompressedImagePipelined); 1 disables
+    // pipelining.
+    size_t pipelineDepth = 1;
+    static constexpr size_t MaxPipelineDepth = 8;
+
+    // The number of frames of a window (1..MaxCompressionDepth) that may be
+    // compressed or waiting to be sent at a time. With a depth above 1, the
+    // next frame is fetched and compressed in the pool while the previous
+    // ones are still being compressed or sent, which raises the frame rate
+    // when the compression time limits it; a frame that finishes after a
+    // newer one is dropped. Tile clients always use depth 1, as each tile is
+    // relative to the frame before it.
+    size_t compressionDepth = 1;
+    static constexpr size_t MaxCompressionDepth = 4;
+
+    // Budgets of each window, measured over the latest BudgetPeriod: frames
+    // compressed per second, bytes of image data sent per second and
+    // milliseconds of compression time per second (0 disables a budget).
+    // While a window is over a budget, its next frame is postponed until the
+    // usage is back within all the budgets, which lowers the frame rate; the
+    // byte budget also steps the quality down while it is exceeded (and back
+    // up once the usage is well below it). A window that has used most of a
+    // budget has its compressions queued after those of the other windows in
+    // the compressor pool, so that the windows within their budgets share the
+    // compression threads fairly.
+    int budgetFPS = 0;
+    uint64_t budgetBytesPerSecond = 0;
+    int budgetCompressionMsPerSecond = 0;
+    static constexpr steady_clock::duration BudgetPeriod = milliseconds(1000);
+
+    // Policy applied while the program reports that the window is playing
+    // media (see ImageCompressor::setMediaPlaying): the quality is capped to
+    // videoQuality (10..100, which also replaces PNG with JPEG) and the frame
+    // rate to videoFPS like budgetFPS (0 disables either cap). Once playback
+    // stops, a full frame is compressed at the normal quality.
+    int videoQuality = 50;
+    int videoFPS = 15;
+
+    // If set, the compressed images are looked up from and added to the given
+    // cache shared by all the windows, and an image with the same content and
+    // encoder parameters as a cached one is not compressed again.
+    shared_ptr<FrameCache> frameCache;
+
+    // If enabled, the images of at least TileCachingMinBytes sent to tile
+    // clients are sent as redirects to a URL derived from the content of the
+    // image (see ImageCompressor::sendCompressedTileNow), which is served with
+    // long-lived cache headers: only by the client (Private) or also by shared
+    // proxy caches (Public). A client that shows recurring content, such as a
+    // menu opened again or a view switched back to, then loads the image from
+    // its own cache or a proxy instead of receiving it again.
+    enum TileCaching {TileCachingOff, TileCachingPrivate, TileCachingPublic};
+    TileCaching tileCaching = TileCachingOff;
+    static constexpr uint64_t TileCachingMinBytes = 2048;
+};
+
+// Memory held by the buffers of an ImageCompressor in bytes: our copy of the
+// latest frame, the shared frame of the program that we keep referencing
+// (allocated by the program, but kept from being reused), and the compressed
+// images kept for sending (whose data may be shared with the frame cache).
+struct ImageCompressorMemory {
+    uint64_t frameBytes = 0;
+    uint64_t sharedFrameBytes = 0;
+    uint64_t compressedBytes = 0;
+
+    uint64_t total() const {
+        return frameBytes + sharedFrameBytes + compressedBytes;
+    }
+};
+
+// Performance statistics of an ImageCompressor since its creation.
+struct ImageCompressorStats {
+    uint64_t framesFetched = 0;
+    uint64_t framesCompressed = 0;
+
+    // Compressed frames that were discarded without being sent, or that had
+    // already been made outdated by a newer update when they were sent.
+    uint64_t framesWasted = 0;
+
+    uint64_t imagesSent = 0;
+    uint64_t bytesSent = 0;
+
+    // Responses to tile clients that already showed the latest image, sent
+    // to deliver changed signals or on timeout (not counted in imagesSent).
+    uint64_t emptyTilesSent = 0;
+    DurationStats compressionTime;
+
+    // Time from receiving an image request to sending the response.
+    DurationStats requestWaitTime;
+
+    // The quality used for compressing the next frame (101 for PNG).
+    int quality = 0;
+
+    // Usage over the latest budget period (see ImageCompressorOptions) and
+    // the number of times the next frame was postponed because a budget was
+    // exceeded.
+    double frameRate = 0.0;
+    double byteRate = 0.0;
+    double compressionMsRate = 0.0;
+    uint64_t budgetThrottles = 0;
+
+    // Images sent to tile clients as redirects to cacheable URLs, and the
+    // requests for those URLs that reached us (the rest were served by the
+    // caches of the client or a proxy, or are in transit).
+    uint64_t cachedTileRedirects = 0;
+    uint64_t cachedTileRequests = 0;
+
+    // True while the window is playing media.
+    bool mediaPlaying = false;
+
+    ImageCompressorMemory memory;
+};
+
+class CompressorPool;
+class CompressorQueue;
 class DelayedTaskTag;
 class HTTPRequest;
 
@@ -31,25 +207,48 @@ class HTTPRequest;
 // run asynchronously: when an updated image is available, the service is
 // notified by calling updateNotify(); when it is ready to begin compressing it,
 // it uses the onImageCompressorFetchImage event handler to fetch the most
-// recent image. At most one image is being compressed at a time in a separate
-// background thread. At most one HTTP request is kept waiting for a new image
-// to complete at a time; the previous requests are responded to upon each
-// sendCompressedImage* call.
+// recent image. At most compressionDepth (see ImageCompressorOptions) images
+// are being compressed or waiting to be sent at a time. At most one HTTP
+// request is kept waiting for a new image to complete at a time; the previous
+// requests are responded to upon each sendCompressedImage* call. Alternatively,
+// the images may be pushed to the client through an image stream
+// (sendCompressedImageStream). In demand-driven mode (see
+// ImageCompressorOptions), the compressor is only ready to begin compressing
+// when there is demand for a new image. The service keeps track of the region
+// of the image that has changed since the previous fetch (the damage region)
+// and only copies that part when fetching the image. The compression itself is
+// run in the given CompressorPool, shared with the other windows.
 class ImageCompressor : public enable_shared_from_this<ImageCompressor> {
 SHARED_ONLY_CLASS(ImageCompressor);
 public:
     ImageCompressor(CKey,
         weak_ptr<ImageCompressorEventHandler> eventHandler,
+        shared_ptr<CompressorPool> compressorPool,
+        ImageCompressorOptions compressorOptions,
         steady_clock::duration sendTimeout,
-        int quality
+        int quality,
+        bool allowPNG
     );
     ~ImageCompressor();
 
-    // Supported values: 10..100 for JPEG and 101 for PNG.
+    // Supported values: 10..100 for JPEG, 101 for PNG (only if allowPNG was
+    // set in the constructor) and AutoQuality for choosing the quality
+    // automatically based on how fast the client receives the images.
+    static constexpr int AutoQuality = 102;
+
     int quality();
     void setQuality(MCE, int quality);
 
+    // Notify the compressor that the image has changed. If dirtyRect is given,
+    // only the pixels inside it have changed; otherwise the whole image is
+    // assumed to have changed.
     void updateNotify(MCE);
+    void updateNotify(MCE, Rect dirtyRect);
+
+    // Attribute trace traceId of given window (see trace.hpp) to the next
+    // fetched frame that differs from the previous one; the stages of
+    // fetching, compressing and sending the frame are reported for it.
+    void addTrace(uint64_t window, uint64_t traceId);
 
     // Send the most recent compressed image immediately.
     void sendCompressedImageNow(MCE, shared_ptr<HTTPRequest> httpRequest);
@@ -58,11 +257,94 @@ public:
     // sendTimeout (given in constructor) is reached.
     void sendCompressedImageWait(MCE, shared_ptr<HTTPRequest> httpRequest);
 
+    // Variant of sendCompressedImageWait for clients that keep up to
+    // pipelineDepth (see ImageCompressorOptions) image requests in flight to
+    // hide the round-trip time. The requests are answered in the order of
+    // arrival, each with a newer compressed image than the previous one
+    // (updated images that are tiles or lack the current signals are not
+    // used); if more requests arrive, the oldest one is answered immediately
+    // with the latest image, as is each request that has waited for
+    // sendTimeout.
+    void sendCompressedImagePipelined(MCE,
+        shared_ptr<HTTPRequest> httpRequest
+    );
+
+    // Variants of sendCompressedImage* for clients that composite partial
+    // images (tiles) on top of the frames they already show. Each compressed
+    // image is either a full frame or a tile that contains the changed region
+    // of a frame relative to the previous frame; the compressor only produces
+    // tiles while the client keeps up with the frames. baseFrameIdx is the
+    // index of the frame currently shown by the client (0 if none); if the
+    // latest compressed image is a tile that cannot be composited on top of
+    // it, the request waits for a full frame. After the image has been sent,
+    // sentFunc is called with the index of the frame, the rectangle of the
+    // frame covered by the image, a flag telling whether it is a tile and the
+    // scroll shift (if any) that the client must apply to the previous frame
+    // before compositing the tile on top of it. If the client already shows
+    // the latest frame, an empty tile (with an empty rectangle) is sent
+    // instead; the images sent to tile clients do not carry the signals in
+    // their size, so they should be signaled along with the tile position.
+    // If tile caching is enabled (see ImageCompressorOptions::tileCaching),
+    // a large image is instead sent as a redirect to cachedTilePath followed
+    // by the content key of the image, for which the request should be passed
+    // to sendCachedTile.
+    typedef function<void(uint64_t, Rect, bool, optional<ScrollShift>)>
+        TileSentFunc;
+    void sendCompressedTileNow(MCE,
+        shared_ptr<HTTPRequest> httpRequest,
+        uint64_t baseFrameIdx,
+        TileSentFunc sentFunc,
+        string cachedTilePath
+    );
+    void sendCompressedTileWait(MCE,
+        shared_ptr<HTTPRequest> httpRequest,
+        uint64_t baseFrameIdx,
+        TileSentFunc sentFunc,
+        string cachedTilePath
+    );
+
+    // Responds to a request for the cacheable URL of a tile image with given
+    // content key (32 hex digits), with status 404 if the image is no longer
+    // available. Only the images of the latest MaxCachedTiles redirects are
+    // kept, as the client fetches each image right after the redirect.
+    void sendCachedTile(shared_ptr<HTTPRequest> httpRequest, string key);
+    static constexpr size_t MaxCachedTiles = 16;
+
+    // Start pushing the compressed images to the client through an image
+    // stream sent as the response to given request, which must support
+    // streaming; the previous stream (if any) is closed. The most recent
+    // compressed image is pushed immediately, and after that, each new
+    // compressed image is pushed once the client has received the previous
+    // one. The stream always carries full frames (never tiles).
+    void sendCompressedImageStream(MCE, shared_ptr<HTTPRequest> httpRequest);
+
+    // Closes the current image stream (if any).
+    void closeStream();
+
+    // True if there is an image stream that has not ended.
+    bool isStreaming();
+
+    // Notify the compressor that the user has interacted with the window. If
+    // interaction quality is enabled, the frames are compressed using it
+    // until no interaction has been notified for a quiet period.
+    void notifyInteraction(MCE);
+
+    // Tells the compressor whether the window is playing media, which
+    // switches it to the video policy given by the videoQuality and videoFPS
+    // options while playing.
+    void setMediaPlaying(MCE, bool playing);
+
     // Make sure that the compressor will never call onImageCompressorFetchImage
     // again (effectively stopping the compressor from starting to compress new
     // images).
     void stopFetching();
 
+    // While fetching is paused, the compressor does not fetch or compress new
+    // images; the updates notified in the meantime are fetched once fetching
+    // is resumed. The requests are still responded to using the latest
+    // compressed image.
+    void setFetchingPaused(MCE, bool paused);
+
     // Flush possible pending sendCompressedImageWait request with the latest
     // image available immediately.
     void flush(MCE);
@@ -73,6 +355,7 @@ public:
     static constexpr int IframeSignalFalse = 1;
     static constexpr int IframeSignalCount = 2;
 
+    int iframeSignal();
     void setIframeSignal(MCE, int signal);
 
     static constexpr int CursorSignalHand = 0;
@@ -80,41 +363,287 @@ public:
     static constexpr int CursorSignalText = 2;
     static constexpr int CursorSignalCount = 3;
 
+    int cursorSignal();
     void setCursorSignal(MCE, int signal);
 
+    ImageCompressorStats stats();
+
+    ImageCompressorMemory memoryUsage();
+
+    // Releases the buffers that are only needed for sending the next frames
+    // efficiently: our copy of the frame (the next frame is then fetched in
+    // full), the reference to the shared frame of the program and the images
+    // of the cacheable tile URLs. Meant for windows whose fetching is paused;
+    // does nothing while compressions are running, as they may be reading the
+    // frame.
+    void shrinkBuffers();
+
 private:
-    void afterConstruct_(shared_ptr<ImageCompressor> self);
+    struct TileRequest {
+        uint64_t baseFrameIdx;
+        TileSentFunc sentFunc;
+        string cachedTilePath;
+    };
+
+    // Sends compressedImage_ as the response to a tile request, as a redirect
+    // to its cacheable URL if tile caching applies to it.
+    void sendTileImage_(
+        shared_ptr<HTTPRequest> httpRequest,
+        const TileRequest& tileRequest
+    );
+
+    void send_(MCE,
+        shared_ptr<HTTPRequest> httpRequest,
+        bool wait,
+        optional<TileRequest> tileRequest,
+        steady_clock::time_point requestTime
+    );
+
+    // Updates the automatic quality and demand-driven poll interval estimates
+    // upon receiving an image request; sample is set if the client sent the
+    // request after it had shown the previous image.
+    void requestReceived_(bool sample);
+
+    // Answers the oldest pipelined request if there is a new compressed image
+    // for it, and schedules the timeout of the oldest remaining request.
+    void servePipeline_(MCE);
+
+    // Updates frame_ to contain the latest image and returns the region of it
+    // that changed.
+    Rect fetchImage_(MCE);
+
+    // True if the size of compressedImage_ carries the current signals.
+    bool compressedImageHasSignals_();
 
-    typedef function<void(shared_ptr<HTTPRequest>)> CompressedImage;
+    // Expands the changed region of the current frame to a tile rectangle
+    // (whose size carries the signals if the frame carries them).
+    Rect computeTileRect_(Rect changed);
 
-    tuple<vector<uint8_t>, size_t, size_t> fetchImage_(MCE);
+    // Makes sure that the client learns about changed signals, either by
+    // compressing a new image or by responding to a waiting tile request.
+    void signalsChanged_(MCE);
+
+    // Pushes compressedImage_ to the image stream if it is ready for it and
+    // the image has not been pushed yet.
+    void pushStream_(MCE);
+    void streamImageWritten_(MCE, uint64_t streamIdx);
 
     void pump_(MCE);
-    void compressTaskDone_(MCE, CompressedImage compressedImage);
+    void compressTaskDone_(MCE,
+        CompressedImage compressedImage,
+        uint64_t frameIdx,
+        Rect rect,
+        bool isTile,
+        optional<ScrollShift> shift,
+        steady_clock::duration compressionTime,
+        optional<FrameCacheKey> contentKey
+    );
+
+    // The quality used for compressing the next frame, and the quality that
+    // would be used if the user was not interacting with the window.
+    int compressionQuality_();
+    int normalQuality_();
+
+    // True if a JPEG image of given pixel count compressed at given quality
+    // should be progressive (see ImageCompressorOptions::progressiveJPEG).
+    bool useProgressiveJPEG_(int quality, uint64_t pixelCount);
+
+    // The JPEG encoder settings for an image of given pixel count compressed
+    // at given quality.
+    JPEGOptions jpegOptions_(int quality, uint64_t pixelCount);
+
+    // Called once the interaction has been quiet for the quiet period.
+    void endInteraction_(MCE);
+
+    // True if there is demand for a new compressed image in demand-driven
+    // mode (see ImageCompressorOptions::demandDriven).
+    bool hasDemand_();
+
+    // In demand-driven mode, schedules the compression of the next frame to
+    // start shortly before the client is expected to poll for it after an
+    // image has been sent.
+    void schedulePrefetch_(MCE);
+
+    // Returns true if the usage is within all the budgets. Otherwise, steps
+    // the byte budget quality cap down if needed and schedules pump_ to be
+    // called again once the usage is back within the budgets.
+    bool checkBudgets_(MCE);
+
+    // True if the usage has reached BudgetLowPriorityFraction of some budget.
+    bool nearBudget_();
+
+    // The frame rate budget in effect: budgetFPS_, further capped by
+    // videoFPS_ while media is playing (0 if neither applies).
+    int fpsLimit_();
+
+    // Update the automatic quality using the time it took the client to
+    // receive and show an image of given size (for image streams, the time it
+    // took to write the image to the connection, which is limited by the
+    // transfer rate once the socket buffers are full).
+    void updateAutoQuality_(steady_clock::duration latency, uint64_t size);
 
     weak_ptr<ImageCompressorEventHandler> eventHandler_;
     steady_clock::duration sendTimeout_;
     int quality_;
+    bool allowPNG_;
+    bool hybrid_;
+    ImageCompressorOptions::ProgressiveJPEG progressiveJPEG_;
+    JPEGOptions jpegBaseOptions_;
+    bool jpegAutoSubsampling_;
+    shared_ptr<FrameCache> frameCache_;
+    ImageCompressorOptions::TileCaching tileCaching_;
+    bool demandDriven_;
+
+    // State of the interaction quality: interacting_ is set until the quiet
+    // period after the last notifyInteraction call (tracked by
+    // interactionTag_) has passed, and lowQualityCompressed_ is set if a frame
+    // has been compressed below the normal quality since the last refinement.
+    int interactionQuality_;
+    bool interacting_;
+    shared_ptr<DelayedTaskTag> interactionTag_;
+    bool lowQualityCompressed_;
+
+    // The video policy (see ImageCompressorOptions) and whether it is in
+    // effect.
+    int videoQuality_;
+    int videoFPS_;
+    bool mediaPlaying_;
+
+    // State of the automatic quality mode: the current index in the quality
+    // ladder, the send time and size of the previous image sent (if it was
+    // sent in automatic mode), and the smoothed latency estimate computed from
+    // autoQualitySampleCount_ samples since the last change.
+    size_t autoQualityIdx_;
+    optional<pair<steady_clock::time_point, uint64_t>> autoQualitySample_;
+    double autoQualityLatencyMs_;
+    int autoQualitySampleCount_;
+
+    // The time of the latest input (notifyInteraction call or immediate image
+    // request); the frames compressed within the quiet period after it are
+    // given priority over the other windows in the compressor pool.
+    optional<steady_clock::time_point> lastInputTime_;
+
+    // The budgets (see ImageCompressorOptions) and the usage measured against
+    // them. While the next frame is postponed by a budget, budgetTag_ is the
+    // pending retry. budgetQualityCap_ is the highest quality allowed by the
+    // byte budget (101 if it does not restrict the quality).
+    int budgetFPS_;
+    uint64_t budgetBytesPerSecond_;
+    int budgetCompressionMsPerSecond_;
+    RateMeter frameMeter_;
+    RateMeter byteMeter_;
+    RateMeter compressionMeter_;
+    shared_ptr<DelayedTaskTag> budgetTag_;
+    int budgetQualityCap_;
 
     int iframeSignal_;
     int cursorSignal_;
 
+    shared_ptr<CompressorQueue> compressorQueue_;
     shared_ptr<PNGCompressor> pngCompressor_;
+    size_t jpegStripCount_;
+    JPEGParallelFor jpegParallelFor_;
 
-    thread compressorThread_;
-    mutex compressorMutex_;
-    condition_variable compressorCv_;
-    bool compressorShutdownScheduled_;
-    bool compressorTaskScheduled_;
-    function<void()> compressorTask_;
+    // Our copy of the latest fetched image (with signal padding), reused
+    // between fetches such that only the damaged region is copied. Only
+    // modified in fetchImage_; if compressions of previous frames may still be
+    // reading it, it is copied first.
+    shared_ptr<vector<uint8_t>> frame_;
+    size_t frameWidth_;
+    size_t frameHeight_;
+
+    // The latest fetched image as (image, pitch) that stays valid while
+    // frameOwner_ is held. Points either to frame_ or, if frameShared_ is set,
+    // directly to a shared image given by the event handler (cropped to carry
+    // the signals).
+    const uint8_t* frameImage_;
+    size_t framePitch_;
+    shared_ptr<const void> frameOwner_;
+    bool frameShared_;
+
+    // Set if the size of the latest fetched image carries the signals, which
+    // is the case unless it is fetched for a tile client.
+    bool frameHasSignals_;
+
+    // Damage region accumulated since the previous fetch.
+    Rect dirtyRect_;
+    bool fullyDirty_;
+
+    // Fingerprints of the rows of the previous frame if the GUI was drawn on
+    // top of it (empty otherwise).
+    vector<uint64_t> guiRowFingerprints_;
 
     shared_ptr<DelayedTaskTag> waitTag_;
+    bool waitPending_;
+
+    // The pipelined requests waiting for an image as (request, arrival time)
+    // in the order of arrival, and the timeout of the oldest one.
+    size_t pipelineDepth_;
+    deque<pair<shared_ptr<HTTPRequest>, steady_clock::time_point>> pipeline_;
+    shared_ptr<DelayedTaskTag> pipelineTag_;
+
     CompressedImage compressedImage_;
 
+    // The content key of compressedImage_ (if computed) and the images of the
+    // latest redirects to cacheable tile URLs as (key in hex, image).
+    optional<FrameCacheKey> compressedKey_;
+    deque<pair<string, CompressedImage>> cachedTiles_;
+
+    // State of the demand-driven mode: smoothed estimates of the time from
+    // sending an image to the next request of the client and of the time
+    // taken by a compression (both zero until measured), the time the
+    // previous image was sent to a polling client, and the pending prefetch
+    // (prefetchDue_ is set once its time has been reached).
+    double pollIntervalEstimateMs_;
+    double compressionTimeEstimateMs_;
+    optional<steady_clock::time_point> lastPollSendTime_;
+    shared_ptr<DelayedTaskTag> prefetchTag_;
+    bool prefetchDue_;
+
+    // The current image stream, identified by streamIdx_. If streamReady_ is
+    // set, the stream has no image in transit; streamNeedsImage_ is set if
+    // compressedImage_ has not been pushed to the stream.
+    shared_ptr<ImageStream> stream_;
+    uint64_t streamIdx_;
+    bool streamReady_;
+    bool streamNeedsImage_;
+
+    // Index of the latest fetched frame and the frame index, covered rectangle,
+    // tile flag, scroll shift and quality of compressedImage_. If a fetched
+    // frame is identical to the previous one, it is not compressed again.
+    uint64_t frameIdx_;
+    uint64_t compressedFrameIdx_;
+    Rect compressedRect_;
+    bool compressedIsTile_;
+    optional<ScrollShift> compressedShift_;
+    int compressedQuality_;
+
+    // The index of the frame most recently sent to a tile client (0 if none);
+    // the next frame is compressed as a tile relative to it if possible.
+    uint64_t tileClientFrameIdx_;
+    bool fullFrameNeeded_;
+
+    // Detects scrolling between consecutive frames sent to a tile client. The
+    // columns left out of a scroll shift are not covered by the tile sent
+    // with it; pendingResidue_ is the region of the frame that still has to
+    // be sent in a follow-up tile.
+    ScrollDetector scrollDetector_;
+    Rect pendingResidue_;
+
+    // Traces added with addTrace waiting for the next fetched frame.
+    TraceList pendingTraces_;
+
     bool fetchingStopped_;
+    bool fetchingPaused_;
     bool imageUpdated_;
     bool compressedImageUpdated_;
-    bool compressionInProgress_;
+
+    // The number of compressions running in the pool and the maximum number
+    // of frames compressed or waiting to be sent at a time.
+    size_t compressionsInFlight_;
+    size_t compressionDepth_;
+
+    ImageCompressorStats stats_;
 };
 
 }
@@ -0,0 +1,103 @@
+#include "image_stream.hpp"
+
+#include "http.hpp"
+
+namespace retrojsvice {
+
+namespace {
+
+const char* Boundary = "retrojsviceimage";
+
+}
+
+ImageStream::ImageStream(CKey, function<void()> readyFunc) {
+    readyFunc_ = move(readyFunc);
+    ended_ = false;
+}
+
+void ImageStream::start(shared_ptr<HTTPRequest> request) {
+    REQUIRE_API_THREAD();
+
+    shared_ptr<ImageStream> self = shared_from_this();
+    request->sendStreamResponse(
+        200,
+        string("multipart/x-mixed-replace; boundary=") + Boundary,
+        [self](ostream& out) {
+            self->run_(out);
+        }
+    );
+}
+
+void ImageStream::push(CompressedImage image) {
+    REQUIRE_API_THREAD();
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        REQUIRE(!pending_.has_value());
+        if(ended_) {
+            return;
+        }
+        pending_ = move(image);
+    }
+    cv_.notify_one();
+}
+
+void ImageStream::close() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        ended_ = true;
+    }
+    cv_.notify_one();
+}
+
+bool ImageStream::ended() {
+    lock_guard<mutex> lock(mutex_);
+    return ended_;
+}
+
+void ImageStream::run_(ostream& out) {
+    // Some clients only show a part once the boundary following it has been
+    // received, so we write the boundary immediately after each image
+    bool ok = true;
+    try {
+        out << "--" << Boundary << "\r\n";
+        out.flush();
+        ok = out.good();
+    } catch(const exception&) {
+        ok = false;
+    }
+
+    unique_lock<mutex> lock(mutex_);
+    while(ok) {
+        cv_.wait(lock, [&]() { return ended_ || pending_.has_value(); });
+        if(ended_) {
+            break;
+        }
+        CompressedImage image = move(*pending_);
+        pending_.reset();
+        lock.unlock();
+
+        try {
+            out << "Content-Type: " << image.contentType << "\r\n";
+            out << "Content-Length: " << image.size << "\r\n\r\n";
+            image.write(out);
+            out << "\r\n--" << Boundary << "\r\n";
+            out.flush();
+            ok = out.good();
+        } catch(const exception&) {
+            ok = false;
+        }
+
+        if(ok) {
+            readyFunc_();
+        }
+        lock.lock();
+    }
+    pending_.reset();
+    ended_ = true;
+    lock.unlock();
+
+    readyFunc_();
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "http.hpp"
+
+namespace retrojsvice {
+
+// A compressed image ready to be sent. The write function writes the size
+// bytes of the image; it may be called any number of times from any thread.
+// If buffers is nonempty, it holds the same bytes, and HTTP responses send
+// them directly to the socket (see HTTPRequest::sendBuffers).
+struct CompressedImage {
+    string contentType;
+    uint64_t size;
+    function<void(ostream&)> write;
+    vector<ResponseBuffer> buffers;
+};
+
+// Server-push image stream that sends images to the client as the parts of a
+// single long-lived multipart/x-mixed-replace HTTP response; each part
+// replaces the previous image shown by the client. The images are pushed in
+// the API thread and written by the HTTP server thread running the body of
+// the response. At most one image is in transit at a time: after push, the
+// next image may only be pushed once readyFunc has been called.
+class ImageStream : public enable_shared_from_this<ImageStream> {
+SHARED_ONLY_CLASS(ImageStream);
+public:
+    // readyFunc is called in the HTTP server thread each time an image has
+    // been written and flushed to the client, and once more after the stream
+    // has ended; it should only post a task to the API thread.
+    ImageStream(CKey, function<void()> readyFunc);
+
+    // Starts the stream as the response to given request, which must support
+    // streaming (see HTTPRequest::supportsStreaming).
+    void start(shared_ptr<HTTPRequest> request);
+
+    // Queues an image to be written to the stream. Must not be called while
+    // the previously pushed image is still in transit.
+    void push(CompressedImage image);
+
+    // Ends the stream, closing the connection once the image in transit (if
+    // any) has been written. May be called from any thread.
+    void close();
+
+    // True if the stream has been closed or writing to it has failed. May be
+    // called from any thread.
+    bool ended();
+
+private:
+    void run_(ostream& out);
+
+    function<void()> readyFunc_;
+
+    mutex mutex_;
+    condition_variable cv_;
+    optional<CompressedImage> pending_;
+    bool ended_;
+};
+
+}
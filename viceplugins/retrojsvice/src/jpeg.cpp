@@ -1,8 +1,9 @@
 #include "jpeg.hpp"
 
-#include "jpeg.hpp"
-
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <vector>
 
@@ -23,64 +24,439 @@ static void check(
 
 #define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
 
+namespace {
+
+// The MCU size in pixels for given chroma subsampling: the MCUs span two
+// luma blocks in the directions in which the chroma channels are subsampled.
+size_t mcuWidth(JPEGOptions::Subsampling subsampling) {
+    return subsampling == JPEGOptions::Subsampling444 ? 8 : 16;
+}
+size_t mcuHeight(JPEGOptions::Subsampling subsampling) {
+    return subsampling == JPEGOptions::Subsampling420 ? 16 : 8;
+}
+
+// Quantization tables used with JPEGOptions::screenTables (in natural order,
+// scaled by the quality like the standard tables). Compared to the standard
+// tables, the steps grow slowly with the frequency, so that sharp edges keep
+// their ringing-free shape, and the chroma table is close to the luma table
+// so that colored text is not smeared.
+const unsigned int ScreenLumaTable[64] = {
+    16, 17, 18, 20, 22, 25, 28, 32,
+    17, 18, 20, 22, 25, 28, 32, 36,
+    18, 20, 22, 25, 28, 32, 36, 40,
+    20, 22, 25, 28, 32, 36, 40, 45,
+    22, 25, 28, 32, 36, 40, 45, 50,
+    25, 28, 32, 36, 40, 45, 50, 56,
+    28, 32, 36, 40, 45, 50, 56, 62,
+    32, 36, 40, 45, 50, 56, 62, 68
+};
+const unsigned int ScreenChromaTable[64] = {
+    17, 18, 20, 23, 26, 30, 34, 39,
+    18, 20, 23, 26, 30, 34, 39, 44,
+    20, 23, 26, 30, 34, 39, 44, 50,
+    23, 26, 30, 34, 39, 44, 50, 56,
+    26, 30, 34, 39, 44, 50, 56, 63,
+    30, 34, 39, 44, 50, 56, 63, 70,
+    34, 39, 44, 50, 56, 63, 70, 78,
+    39, 44, 50, 56, 63, 70, 78, 86
+};
+
+// The strips are kept large enough for the parallelism to pay off.
+const size_t MinStripMCURows = 4;
+
+// Positions of the segments in a JPEG produced by libjpeg: the height field
+// of the SOF segment, the SOS segment and the entropy-coded data following it
+// (ending at the EOI marker).
+struct JPEGLayout {
+    size_t sofHeightPos;
+    size_t sosPos;
+    size_t scanPos;
+    size_t scanEndPos;
+};
+
+JPEGLayout parseJPEGLayout(const JPEGData& jpeg) {
+    const uint8_t* data = jpeg.data.get();
+    size_t length = jpeg.length;
+    CHECK(length >= 4 && data[0] == 0xFF && data[1] == 0xD8);
+
+    JPEGLayout layout;
+    bool sofFound = false;
+    size_t pos = 2;
+    while(true) {
+        CHECK(pos + 4 <= length && data[pos] == 0xFF);
+        uint8_t marker = data[pos + 1];
+        size_t segmentLength = ((size_t)data[pos + 2] << 8) | (size_t)data[pos + 3];
+        CHECK(pos + 2 + segmentLength <= length);
+
+        if(marker >= 0xC0 && marker <= 0xC2) {
+            layout.sofHeightPos = pos + 5;
+            sofFound = true;
+        }
+        if(marker == 0xDA) {
+            layout.sosPos = pos;
+            layout.scanPos = pos + 2 + segmentLength;
+            break;
+        }
+        pos += 2 + segmentLength;
+    }
+    CHECK(sofFound);
+
+    CHECK(data[length - 2] == 0xFF && data[length - 1] == 0xD9);
+    layout.scanEndPos = length - 2;
+    CHECK(layout.scanPos <= layout.scanEndPos);
+
+    return layout;
+}
+
+// libjpeg compression object, reused for all the images compressed in a
+// thread to avoid setting up the compressor and its memory pools for every
+// image (with strips and tiles, there are many small images per frame).
+class ThreadCompressor {
+public:
+    ThreadCompressor() {
+        ctx_.err = jpeg_std_error(&errorManager_);
+        jpeg_create_compress(&ctx_);
+        lastPixelCount_ = 0;
+        lastLength_ = 0;
+    }
+    ~ThreadCompressor() {
+        jpeg_destroy_compress(&ctx_);
+    }
+
+    ThreadCompressor(const ThreadCompressor&) = delete;
+    ThreadCompressor& operator=(const ThreadCompressor&) = delete;
+
+    JPEGData compress(
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch,
+        int quality,
+        const JPEGOptions& options
+    ) {
+        // Start with an output buffer sized according to the previous image
+        // compressed in this thread (relative to the pixel count) instead of
+        // letting libjpeg grow it from 4 KiB by repeated reallocation
+        size_t pixelCount = width * height;
+        size_t initialLength = 4096;
+        if(lastPixelCount_ > 0) {
+            initialLength = std::max(
+                initialLength,
+                (size_t)((double)lastLength_ * (double)pixelCount /
+                    (double)lastPixelCount_ * 1.25)
+            );
+        }
+        uint8_t* initialBuf = (uint8_t*)malloc(initialLength);
+        CHECK(initialBuf != nullptr);
+
+        uint8_t* outputBuf = initialBuf;
+        unsigned long outputLength = initialLength;
+        jpeg_mem_dest(&ctx_, &outputBuf, &outputLength);
+
+        ctx_.image_width = width;
+        ctx_.image_height = height;
+#ifdef JCS_EXTENSIONS
+        // libjpeg-turbo can read the BGRX pixels directly from the image
+        ctx_.input_components = 4;
+        ctx_.in_color_space = JCS_EXT_BGRX;
+#else
+        ctx_.input_components = 3;
+        ctx_.in_color_space = JCS_RGB;
+#endif
+
+        jpeg_set_defaults(&ctx_);
+        jpeg_set_quality(&ctx_, quality, true);
+        if(options.screenTables) {
+            int scale = jpeg_quality_scaling(quality);
+            jpeg_add_quant_table(&ctx_, 0, ScreenLumaTable, scale, true);
+            jpeg_add_quant_table(&ctx_, 1, ScreenChromaTable, scale, true);
+        }
+
+        // jpeg_set_defaults sets up 4:2:0 subsampling
+        if(options.subsampling != JPEGOptions::Subsampling420) {
+            ctx_.comp_info[0].v_samp_factor = 1;
+            if(options.subsampling == JPEGOptions::Subsampling444) {
+                ctx_.comp_info[0].h_samp_factor = 1;
+            }
+        }
+
+        // The strip-parallel compression relies on all the images using the
+        // same standard Huffman tables; progressive images and images with
+        // optimized coding are never split into strips
+        ctx_.optimize_coding = options.optimizeCoding || options.progressive;
+        if(options.progressive) {
+            jpeg_simple_progression(&ctx_);
+        }
+        if(
+            options.dctMethod == JPEGOptions::DCTFast ||
+            (options.dctMethod == JPEGOptions::DCTAuto && quality <= 90)
+        ) {
+            ctx_.dct_method = JDCT_IFAST;
+        } else {
+            ctx_.dct_method = JDCT_ISLOW;
+        }
+
+        jpeg_start_compress(&ctx_, true);
+
+#ifdef JCS_EXTENSIONS
+        // Pass all the rows at once to avoid the per-call overhead
+        rowPointers_.resize(height);
+        for(size_t y = 0; y < height; ++y) {
+            rowPointers_[y] = (JSAMPROW)(image + 4 * pitch * y);
+        }
+        while(ctx_.next_scanline < height) {
+            (void)jpeg_write_scanlines(
+                &ctx_,
+                rowPointers_.data() + ctx_.next_scanline,
+                height - ctx_.next_scanline
+            );
+        }
+#else
+        row_.resize(3 * width);
+        JSAMPROW rowPointer[1];
+        rowPointer[0] = row_.data();
+
+        while(ctx_.next_scanline < height) {
+            const uint8_t* src = image + 4 * pitch * ctx_.next_scanline;
+            uint8_t* dest = row_.data();
+            for(size_t x = 0; x < width; ++x) {
+                *(dest + 0) = *(src + 2);
+                *(dest + 1) = *(src + 1);
+                *(dest + 2) = *(src + 0);
+                src += 4;
+                dest += 3;
+            }
+            (void)jpeg_write_scanlines(&ctx_, rowPointer, 1);
+        }
+#endif
+
+        jpeg_finish_compress(&ctx_);
+
+        // If the initial buffer was too small, libjpeg has replaced it with a
+        // buffer of its own and left ours for us to free
+        if(outputBuf != initialBuf) {
+            free(initialBuf);
+        }
+
+        lastPixelCount_ = pixelCount;
+        lastLength_ = outputLength;
+
+        JPEGData jpegData;
+        jpegData.data.reset(outputBuf);
+        jpegData.length = outputLength;
+        return jpegData;
+    }
+
+private:
+    struct jpeg_compress_struct ctx_;
+    struct jpeg_error_mgr errorManager_;
+
+    size_t lastPixelCount_;
+    size_t lastLength_;
+
+#ifdef JCS_EXTENSIONS
+    std::vector<JSAMPROW> rowPointers_;
+#else
+    std::vector<uint8_t> row_;
+#endif
+};
+
+class LibJPEGTurboBackend : public JPEGBackend {
+public:
+    virtual const char* name() const override {
+        return "libjpeg-turbo";
+    }
+
+    // The library is linked into the plugin, so it is always available
+    virtual bool probe() override {
+        return true;
+    }
+
+    virtual bool supportsStrips() const override {
+        return true;
+    }
+
+    virtual JPEGData compress(
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch,
+        int quality,
+        const JPEGOptions& options
+    ) override {
+        thread_local ThreadCompressor compressor;
+        return compressor.compress(
+            image, width, height, pitch, quality, options
+        );
+    }
+};
+
+// The registered backends in order of preference.
+const std::vector<JPEGBackend*>& backends() {
+    static LibJPEGTurboBackend libJPEGTurbo;
+    static const std::vector<JPEGBackend*> ret = {&libJPEGTurbo};
+    return ret;
+}
+
+std::atomic<JPEGBackend*> selectedBackend(nullptr);
+
+JPEGBackend* backend() {
+    JPEGBackend* ret = selectedBackend.load(std::memory_order_acquire);
+    if(ret == nullptr) {
+        CHECK(selectJPEGBackend("auto"));
+        ret = selectedBackend.load(std::memory_order_acquire);
+    }
+    return ret;
+}
+
+}
+
+std::vector<std::string> jpegBackendNames() {
+    std::vector<std::string> names;
+    for(JPEGBackend* backend : backends()) {
+        names.push_back(backend->name());
+    }
+    return names;
+}
+
+bool selectJPEGBackend(const std::string& name) {
+    for(JPEGBackend* backend : backends()) {
+        if(name == "auto" || name == backend->name()) {
+            if(backend->probe()) {
+                selectedBackend.store(backend, std::memory_order_release);
+                return true;
+            }
+            if(name != "auto") {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+const char* selectedJPEGBackendName() {
+    return backend()->name();
+}
+
 JPEGData compressJPEG(
     const uint8_t* image,
     size_t width,
     size_t height,
     size_t pitch,
-    int quality
+    int quality,
+    JPEGOptions options
 ) {
     CHECK(width > 0 && height > 0);
     CHECK(quality >= 1 && quality <= 100);
 
-    struct jpeg_compress_struct jpegCtx;
-
-    struct jpeg_error_mgr jpegErrorManager;
-    jpegCtx.err = jpeg_std_error(&jpegErrorManager);
+    return backend()->compress(
+        image, width, height, pitch, quality, options
+    );
+}
 
-    jpeg_create_compress(&jpegCtx);
+JPEGData compressJPEG(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    int quality,
+    size_t stripCount,
+    JPEGParallelFor parallelFor,
+    JPEGOptions options
+) {
+    CHECK(width > 0 && height > 0);
 
-    uint8_t* outputBuf = nullptr;
-    unsigned long outputLength = 0;
-    jpeg_mem_dest(&jpegCtx, &outputBuf, &outputLength);
+    if(
+        options.progressive ||
+        options.optimizeCoding ||
+        !backend()->supportsStrips()
+    ) {
+        return compressJPEG(image, width, height, pitch, quality, options);
+    }
 
-    jpegCtx.image_width = width;
-    jpegCtx.image_height = height;
-    jpegCtx.input_components = 3;
-    jpegCtx.in_color_space = JCS_RGB;
+    // The restart interval (the number of MCUs in a strip) is limited to 16
+    // bits
+    size_t mcuW = mcuWidth(options.subsampling);
+    size_t mcuH = mcuHeight(options.subsampling);
+    size_t mcuRowCount = (height + mcuH - 1) / mcuH;
+    size_t mcusPerRow = (width + mcuW - 1) / mcuW;
+    size_t stripMCURows = (mcuRowCount + std::max(stripCount, (size_t)1) - 1) /
+        std::max(stripCount, (size_t)1);
+    stripMCURows = std::max(stripMCURows, MinStripMCURows);
+    stripMCURows = std::min(stripMCURows, (size_t)65535 / mcusPerRow);
+    CHECK(stripMCURows > 0);
 
-    jpeg_set_defaults(&jpegCtx);
-    jpeg_set_quality(&jpegCtx, quality, true);
-    if(quality <= 90) {
-        jpegCtx.dct_method = JDCT_IFAST;
+    size_t stripHeight = mcuH * stripMCURows;
+    size_t actualStripCount = (height + stripHeight - 1) / stripHeight;
+    if(actualStripCount <= 1 || !parallelFor) {
+        return compressJPEG(image, width, height, pitch, quality, options);
     }
 
-    jpeg_start_compress(&jpegCtx, true);
+    // Each strip is compressed as a separate JPEG; as a JPEG starts with zero
+    // DC predictions and its entropy-coded data is padded to a byte boundary
+    // at the end, the data of the strips can be joined using restart markers
+    std::vector<JPEGData> strips(actualStripCount);
+    parallelFor(actualStripCount, [&](size_t i) {
+        size_t startY = i * stripHeight;
+        size_t endY = std::min(startY + stripHeight, height);
+        strips[i] = compressJPEG(
+            image + 4 * pitch * startY,
+            width,
+            endY - startY,
+            pitch,
+            quality,
+            options
+        );
+    });
 
-    std::vector<uint8_t> row(3 * width);
-    JSAMPROW rowPointer[1];
-    rowPointer[0] = row.data();
-
-    while(jpegCtx.next_scanline < height) {
-        const uint8_t* src = image + 4 * pitch * jpegCtx.next_scanline;
-        uint8_t* dest = row.data();
-        for(size_t x = 0; x < width; ++x) {
-            *(dest + 0) = *(src + 2);
-            *(dest + 1) = *(src + 1);
-            *(dest + 2) = *(src + 0);
-            src += 4;
-            dest += 3;
-        }
-        (void)jpeg_write_scanlines(&jpegCtx, rowPointer, 1);
+    std::vector<JPEGLayout> layouts;
+    for(const JPEGData& strip : strips) {
+        layouts.push_back(parseJPEGLayout(strip));
     }
 
-    jpeg_finish_compress(&jpegCtx);
+    // The headers are taken from the first strip, adding a DRI segment
+    // specifying the restart interval before the SOS segment.
+    const JPEGLayout& first = layouts[0];
+    size_t length = first.scanPos + 6;
+    for(size_t i = 0; i < actualStripCount; ++i) {
+        length += layouts[i].scanEndPos - layouts[i].scanPos + 2;
+    }
 
+    uint8_t* output = (uint8_t*)malloc(length);
+    CHECK(output != nullptr);
     JPEGData jpegData;
-    jpegData.data.reset(outputBuf);
-    jpegData.length = outputLength;
+    jpegData.data.reset(output);
+    jpegData.length = length;
 
-    jpeg_destroy_compress(&jpegCtx);
+    const uint8_t* firstData = strips[0].data.get();
+    uint8_t* pos = output;
+    memcpy(pos, firstData, first.sosPos);
+    output[first.sofHeightPos] = (uint8_t)(height >> 8);
+    output[first.sofHeightPos + 1] = (uint8_t)height;
+    pos += first.sosPos;
+
+    size_t restartInterval = mcusPerRow * stripMCURows;
+    const uint8_t dri[6] = {
+        0xFF, 0xDD, 0, 4, (uint8_t)(restartInterval >> 8), (uint8_t)restartInterval
+    };
+    memcpy(pos, dri, 6);
+    pos += 6;
+
+    memcpy(pos, firstData + first.sosPos, first.scanPos - first.sosPos);
+    pos += first.scanPos - first.sosPos;
+
+    for(size_t i = 0; i < actualStripCount; ++i) {
+        const JPEGLayout& layout = layouts[i];
+        size_t scanLength = layout.scanEndPos - layout.scanPos;
+        memcpy(pos, strips[i].data.get() + layout.scanPos, scanLength);
+        pos += scanLength;
+
+        // Restart markers RST0..RST7 between the strips, EOI at the end
+        pos[0] = 0xFF;
+        pos[1] = i + 1 == actualStripCount ? 0xD9 : (uint8_t)(0xD0 + i % 8);
+        pos += 2;
+    }
+    CHECK(pos == output + length);
 
     return jpegData;
 }
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cstdlib>
+#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 struct JPEGData {
     struct Free {
@@ -16,6 +19,81 @@ struct JPEGData {
     size_t length;
 };
 
+// Encoder settings for compressJPEG.
+struct JPEGOptions {
+    // Resolution of the chroma channels relative to the luma channel: full
+    // (4:4:4), half horizontally (4:2:2) or half in both directions (4:2:0).
+    // Subsampling makes the images smaller but blurs the edges of colored
+    // text.
+    enum Subsampling {Subsampling444, Subsampling422, Subsampling420};
+    Subsampling subsampling = Subsampling420;
+
+    // DCT implementation used by libjpeg. In Auto mode, the fast integer DCT
+    // is used at quality 90 and below and the accurate integer DCT above.
+    enum DCTMethod {DCTAuto, DCTFast, DCTAccurate};
+    DCTMethod dctMethod = DCTAuto;
+
+    // If true, the Huffman tables are optimized for each image, which makes
+    // it a few percent smaller but needs an extra pass over the image data.
+    bool optimizeCoding = false;
+
+    // If true, the standard quantization tables (tuned for photos) are
+    // replaced by flatter tables that keep more of the high frequencies and
+    // the chroma detail, so that text and UI edges stay sharper at the same
+    // quality setting (at the cost of larger images).
+    bool screenTables = false;
+
+    // If true, the image is encoded as a progressive JPEG with optimized
+    // Huffman tables, which is somewhat smaller and is shown by the browser
+    // as a coarse version first while the rest is received, but is slower to
+    // compress.
+    bool progressive = false;
+};
+
+// Encoder implementation used by compressJPEG. The backends are registered in
+// jpeg.cpp in order of preference; libjpeg-turbo is currently the only one.
+class JPEGBackend {
+public:
+    virtual ~JPEGBackend() {}
+
+    // Name used to select the backend (option jpeg-encoder) and in the logs.
+    virtual const char* name() const = 0;
+
+    // Returns true if the backend can be used in this process (for example,
+    // the required library or device is available). Called by
+    // selectJPEGBackend.
+    virtual bool probe() = 0;
+
+    // Returns true if the separately compressed strips of an image can be
+    // joined into a single JPEG (see the strip-parallel compressJPEG), which
+    // requires output that uses the same tables for every strip.
+    virtual bool supportsStrips() const = 0;
+
+    // Same contract as compressJPEG; may be called from multiple threads
+    // concurrently.
+    virtual JPEGData compress(
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch,
+        int quality,
+        const JPEGOptions& options
+    ) = 0;
+};
+
+// Names of the registered JPEG encoder backends in order of preference.
+std::vector<std::string> jpegBackendNames();
+
+// Selects the backend used by compressJPEG: the registered backend with given
+// name, or if name is "auto", the first registered backend that passes its
+// probe. Returns false if the backend does not exist or fails its probe. Should
+// be called at startup before compressing images; if it has not been called,
+// the first compressJPEG call selects "auto".
+bool selectJPEGBackend(const std::string& name);
+
+// Name of the backend used by compressJPEG.
+const char* selectedJPEGBackendName();
+
 // Compress given image into JPEG. The image data should be in a format where
 // for all 0 <= y < height and 0 <= x < width, image[4 * (y * pitch + x) + c]
 // is the value for color blue, green and red for c = 0, 1, 2, respectively.
@@ -25,5 +103,31 @@ JPEGData compressJPEG(
     size_t width,
     size_t height,
     size_t pitch,
-    int quality = 80
+    int quality = 80,
+    JPEGOptions options = {}
+);
+
+// Function that calls func(i) for all 0 <= i < count, possibly in parallel,
+// and returns once all the calls have returned.
+typedef std::function<
+    void(size_t count, std::function<void(size_t)> func)
+> JPEGParallelFor;
+
+// Variant of compressJPEG that splits the image into at most stripCount
+// horizontal strips of whole MCU rows, compresses them in parallel using
+// parallelFor and joins them into a single JPEG separated by restart markers.
+// The decoded image is the same as with compressJPEG. Small images are
+// compressed in a single strip. The strips can only be joined if they share
+// the same Huffman tables, so progressive images, images with optimized
+// coding and images compressed by a backend that does not support strips are
+// always compressed in a single strip.
+JPEGData compressJPEG(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    int quality,
+    size_t stripCount,
+    JPEGParallelFor parallelFor,
+    JPEGOptions options = {}
 );
@@ -0,0 +1,290 @@
+#include "multipart.hpp"
+
+#include "upload.hpp"
+
+namespace retrojsvice {
+
+namespace {
+
+// Limits for the parts of the body that are buffered in memory.
+const size_t MaxPartHeaderSize = 16 * 1024;
+const size_t MaxParamSize = 1024 * 1024;
+
+string toLower(string str) {
+    for(char& c : str) {
+        c = tolower(c);
+    }
+    return str;
+}
+
+string trim(const string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if(start == string::npos) {
+        return "";
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
+
+// Parses a header value of form 'value; param1=value1; param2="value2"' into
+// the lowercase main value and the parameters with lowercase names.
+void parseHeaderValue(
+    const string& header,
+    string& value,
+    map<string, string>& params
+) {
+    size_t pos = header.find(';');
+    value = toLower(trim(header.substr(0, pos)));
+
+    while(pos < header.size()) {
+        ++pos;
+        size_t eq = header.find_first_of("=;", pos);
+        if(eq == string::npos || header[eq] == ';') {
+            pos = eq;
+            continue;
+        }
+        string name = toLower(trim(header.substr(pos, eq - pos)));
+
+        pos = header.find_first_not_of(" \t", eq + 1);
+        string paramValue;
+        if(pos != string::npos && header[pos] == '"') {
+            ++pos;
+            while(pos < header.size() && header[pos] != '"') {
+                if(header[pos] == '\\' && pos + 1 < header.size()) {
+                    ++pos;
+                }
+                paramValue.push_back(header[pos]);
+                ++pos;
+            }
+            pos = header.find(';', pos);
+        } else {
+            size_t end = header.find(';', pos);
+            if(pos != string::npos) {
+                paramValue = trim(header.substr(pos, end - pos));
+            }
+            pos = end;
+        }
+        params.emplace(move(name), move(paramValue));
+    }
+}
+
+}
+
+optional<string> MultipartFormParser::parseBoundary(const string& contentType) {
+    string value;
+    map<string, string> params;
+    parseHeaderValue(contentType, value, params);
+
+    optional<string> empty;
+    if(value != "multipart/form-data") {
+        return empty;
+    }
+    auto it = params.find("boundary");
+    if(it == params.end() || it->second.empty() || it->second.size() > 200) {
+        return empty;
+    }
+    return it->second;
+}
+
+MultipartFormParser::MultipartFormParser(
+    string boundary,
+    shared_ptr<UploadStorage> storage,
+    uint64_t maxFileSize
+) {
+    REQUIRE(!boundary.empty());
+
+    delimiter_ = "\r\n--" + boundary;
+    storage_ = storage;
+    maxFileSize_ = maxFileSize;
+
+    // The delimiter of the first boundary may be at the start of the body
+    // without a preceding line break
+    state_ = Preamble;
+    buf_ = "\r\n";
+
+    fileSize_ = 0;
+    fileSizeExceeded_ = false;
+}
+
+MultipartFormParser::~MultipartFormParser() {}
+
+bool MultipartFormParser::feed(const char* data, size_t size) {
+    if(state_ == Failed) {
+        return false;
+    }
+    if(state_ == Epilogue) {
+        return true;
+    }
+
+    buf_.append(data, size);
+    if(!process_()) {
+        state_ = Failed;
+        writer_.reset();
+        return false;
+    }
+    return true;
+}
+
+bool MultipartFormParser::fileSizeExceeded() {
+    return fileSizeExceeded_;
+}
+
+bool MultipartFormParser::finish() {
+    return state_ == Epilogue;
+}
+
+const vector<pair<string, string>>& MultipartFormParser::params() {
+    return params_;
+}
+
+map<string, shared_ptr<FileUpload>>& MultipartFormParser::files() {
+    return files_;
+}
+
+bool MultipartFormParser::process_() {
+    while(true) {
+        if(state_ == Preamble || state_ == Body) {
+            // Pass on the data that cannot be a part of the next delimiter
+            size_t pos = buf_.find(delimiter_);
+            size_t dataEnd = pos;
+            if(pos == string::npos) {
+                dataEnd = buf_.size() - min(buf_.size(), delimiter_.size() - 1);
+            }
+            if(state_ == Body && dataEnd != 0 && !partData_(buf_.data(), dataEnd)) {
+                return false;
+            }
+            if(pos == string::npos) {
+                buf_.erase(0, dataEnd);
+                return true;
+            }
+            buf_.erase(0, pos + delimiter_.size());
+            if(state_ == Body && !endPart_()) {
+                return false;
+            }
+            state_ = Delimiter;
+        } else if(state_ == Delimiter) {
+            // The delimiter is followed by "--" for the final boundary, and
+            // otherwise by optional whitespace and a line break
+            if(buf_.size() < 2) {
+                return true;
+            }
+            if(buf_.compare(0, 2, "--") == 0) {
+                state_ = Epilogue;
+                buf_.clear();
+                return true;
+            }
+            size_t pos = buf_.find("\r\n");
+            if(pos == string::npos) {
+                return buf_.size() <= MaxPartHeaderSize;
+            }
+            if(buf_.find_first_not_of(" \t") != pos) {
+                return false;
+            }
+            buf_.erase(0, pos + 2);
+            state_ = Headers;
+        } else if(state_ == Headers) {
+            if(buf_.size() < 2) {
+                return true;
+            }
+            string headers;
+            if(buf_.compare(0, 2, "\r\n") == 0) {
+                buf_.erase(0, 2);
+            } else {
+                size_t pos = buf_.find("\r\n\r\n");
+                if(pos == string::npos) {
+                    return buf_.size() <= MaxPartHeaderSize;
+                }
+                headers = buf_.substr(0, pos + 2);
+                buf_.erase(0, pos + 4);
+            }
+            if(!beginPart_(headers)) {
+                return false;
+            }
+            state_ = Body;
+        } else {
+            REQUIRE(state_ == Epilogue);
+            buf_.clear();
+            return true;
+        }
+    }
+}
+
+bool MultipartFormParser::beginPart_(const string& headers) {
+    name_.reset();
+    value_.clear();
+    writer_.reset();
+
+    string disposition;
+    map<string, string> params;
+
+    size_t pos = 0;
+    while(pos < headers.size()) {
+        size_t end = headers.find("\r\n", pos);
+        if(end == string::npos) {
+            end = headers.size();
+        }
+        string line = headers.substr(pos, end - pos);
+        pos = end + 2;
+
+        size_t colon = line.find(':');
+        if(colon == string::npos) {
+            return false;
+        }
+        if(toLower(trim(line.substr(0, colon))) == "content-disposition") {
+            parseHeaderValue(line.substr(colon + 1), disposition, params);
+        }
+    }
+
+    // Parts that are not form data or that have an empty file name (no file
+    // selected) are skipped
+    if(disposition != "form-data") {
+        return true;
+    }
+    string name = params["name"];
+    auto filenameIt = params.find("filename");
+    if(filenameIt == params.end()) {
+        name_ = name;
+    } else if(!filenameIt->second.empty()) {
+        name_ = name;
+        REQUIRE(storage_);
+        writer_ = storage_->startUpload(filenameIt->second);
+    }
+    return true;
+}
+
+bool MultipartFormParser::partData_(const char* data, size_t size) {
+    if(writer_) {
+        fileSize_ += size;
+        if(maxFileSize_ != 0 && fileSize_ > maxFileSize_) {
+            fileSizeExceeded_ = true;
+            return false;
+        }
+        return writer_->write(data, size);
+    }
+    if(name_.has_value()) {
+        if(value_.size() + size > MaxParamSize) {
+            WARNING_LOG("Form parameter '", *name_, "' is too large");
+            return false;
+        }
+        value_.append(data, size);
+    }
+    return true;
+}
+
+bool MultipartFormParser::endPart_() {
+    if(writer_) {
+        shared_ptr<FileUpload> file = writer_->finish();
+        writer_.reset();
+        if(!file) {
+            return false;
+        }
+        files_.emplace(*name_, file);
+    } else if(name_.has_value()) {
+        params_.emplace_back(*name_, move(value_));
+    }
+    name_.reset();
+    value_.clear();
+    return true;
+}
+
+}
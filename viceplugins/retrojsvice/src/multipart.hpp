@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+class FileUpload;
+class UploadStorage;
+class UploadWriter;
+
+// Streaming parser for multipart/form-data request bodies. The body is fed to
+// the parser in arbitrary pieces as it is received; the file parts are written
+// directly to the upload storage and the other parts are collected as form
+// parameters. Not thread-safe.
+class MultipartFormParser {
+public:
+    // Returns the boundary from the value of the Content-Type header of the
+    // request, or an empty optional if the content type is not
+    // multipart/form-data.
+    static optional<string> parseBoundary(const string& contentType);
+
+    // The total size of the uploaded files is limited to maxFileSize bytes
+    // (0 for unlimited).
+    MultipartFormParser(
+        string boundary,
+        shared_ptr<UploadStorage> storage,
+        uint64_t maxFileSize
+    );
+    ~MultipartFormParser();
+
+    DISABLE_COPY_MOVE(MultipartFormParser);
+
+    // Returns false if the body is malformed or writing an uploaded file
+    // failed; in that case, the parser may not be used anymore, and the
+    // parameters and files parsed so far remain available.
+    bool feed(const char* data, size_t size);
+
+    // True if feed failed because the uploaded files exceeded maxFileSize.
+    bool fileSizeExceeded();
+
+    // Called after the whole body has been fed; returns false if the body
+    // ended before the final boundary.
+    bool finish();
+
+    const vector<pair<string, string>>& params();
+    map<string, shared_ptr<FileUpload>>& files();
+
+private:
+    bool process_();
+    bool beginPart_(const string& headers);
+    bool partData_(const char* data, size_t size);
+    bool endPart_();
+
+    string delimiter_;
+    shared_ptr<UploadStorage> storage_;
+    uint64_t maxFileSize_;
+
+    enum {Preamble, Delimiter, Headers, Body, Epilogue, Failed} state_;
+    string buf_;
+
+    // The current part in state Body: a file part has writer_ set, and other
+    // parts with a name are collected to value_.
+    optional<string> name_;
+    string value_;
+    shared_ptr<UploadWriter> writer_;
+
+    uint64_t fileSize_;
+    bool fileSizeExceeded_;
+
+    vector<pair<string, string>> params_;
+    map<string, shared_ptr<FileUpload>> files_;
+};
+
+}
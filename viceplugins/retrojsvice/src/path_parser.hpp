@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+// Parser for matching HTTP request paths against routes one component at a
+// time without allocating memory. Each match function consumes the matched
+// part of the path and returns true if it matched; after a failed match, the
+// position of the parser is unspecified, so a new parser should be used for
+// each route. Typical usage:
+//
+//   PathParser parser(path);
+//   uint64_t idx;
+//   if(parser.literal("/close/") && parser.number(idx) && parser.atEnd()) {
+//       ...
+//   }
+class PathParser {
+public:
+    // The path must outlive the parser.
+    PathParser(const string& path)
+        : pos_(path.begin()),
+          end_(path.end())
+    {}
+
+    // Consumes given literal string.
+    bool literal(const char* str) {
+        while(*str != '\0') {
+            if(pos_ == end_ || *pos_ != *str) {
+                return false;
+            }
+            ++pos_;
+            ++str;
+        }
+        return true;
+    }
+
+    // Consumes a nonempty decimal number followed by '/' (such as "123/").
+    // Fails if the number does not fit in the result type.
+    bool number(uint64_t& val) {
+        val = 0;
+        string::const_iterator start = pos_;
+        while(pos_ != end_ && *pos_ >= '0' && *pos_ <= '9') {
+            uint64_t digit = (uint64_t)(*pos_ - '0');
+            if(val > ((uint64_t)-1 - digit) / 10) {
+                return false;
+            }
+            val = 10 * val + digit;
+            ++pos_;
+        }
+        return pos_ != start && literal("/");
+    }
+    bool number(int& val) {
+        uint64_t val64;
+        if(!number(val64) || val64 > (uint64_t)INT_MAX) {
+            return false;
+        }
+        val = (int)val64;
+        return true;
+    }
+
+    // Consumes the rest of the path, which must be a possibly empty list of
+    // event items of form [A-Z0-9_-]+/ (such as "MDN_0_5_6/KP_65/"), and
+    // stores its range to (begin, end).
+    bool eventList(string::const_iterator& begin, string::const_iterator& end) {
+        begin = pos_;
+        bool itemEmpty = true;
+        for(; pos_ != end_; ++pos_) {
+            char c = *pos_;
+            if(c == '/') {
+                if(itemEmpty) {
+                    return false;
+                }
+                itemEmpty = true;
+            } else if(
+                (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                c == '_' || c == '-'
+            ) {
+                itemEmpty = false;
+            } else {
+                return false;
+            }
+        }
+        end = pos_;
+        return itemEmpty;
+    }
+
+    // Consumes the rest of the path.
+    bool rest() {
+        pos_ = end_;
+        return true;
+    }
+
+    bool atEnd() {
+        return pos_ == end_;
+    }
+
+private:
+    string::const_iterator pos_;
+    string::const_iterator end_;
+};
+
+}
@@ -27,14 +27,38 @@ SOFTWARE.
 #include <algorithm>
 #include <array>
 #include <cstring>
-#include <future>
 #include <iostream>
-#include <thread>
+#include <mutex>
 #include <utility>
 
 #include <arpa/inet.h>
 
+// The deflate implementation is selected at build time: stock zlib by default
+// or zlib-ng (using its native API) if PNG_DEFLATE_ZLIB_NG is defined.
+#ifdef PNG_DEFLATE_ZLIB_NG
+#include <zlib-ng.h>
+#define ZLIB_FUNC(name) zng_ ## name
+typedef zng_stream ZStream;
+typedef size_t ZSize;
+#else
 #include <zlib.h>
+#define ZLIB_FUNC(name) name
+typedef z_stream ZStream;
+typedef uLongf ZSize;
+#endif
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define PNG_X86_DISPATCH
+#endif
 
 static void check(
     bool condVal,
@@ -70,6 +94,10 @@ std::array<uint32_t, 256> computeCRCTable() {
 }
 const std::array<uint32_t, 256> crcTable = computeCRCTable();
 
+// Updates the CRC32 state crc (not inverted) by size bytes of data using the
+// fastest kernel supported by the CPU.
+uint32_t updateCRC32(uint32_t crc, const uint8_t* data, size_t size);
+
 class ChunkWriter {
 public:
     ChunkWriter(std::vector<uint8_t>& buf, const char type[4])
@@ -81,9 +109,9 @@ public:
         write(type, 4);
     }
     void registerWrite(size_t startPos) {
-        for(size_t i = startPos; i < buf_.size(); ++i) {
-            crc32_ = crcTable[(crc32_ ^ buf_[i]) & 0xff] ^ (crc32_ >> 8);
-        }
+        crc32_ = updateCRC32(
+            crc32_, buf_.data() + startPos, buf_.size() - startPos
+        );
     }
     void write(const void* data, size_t size) {
         size_t pos = buf_.size();
@@ -117,22 +145,342 @@ private:
     uint32_t crc32_;
 };
 
-struct Result;
+// Thread-safe pool of byte buffers reused between compressions to avoid the
+// allocation and first-touch page fault costs of fresh large buffers. The free
+// buffers are kept in lists by size class (capacity rounded down to a power of
+// two); at most maxBuffersPerClass buffers are kept in each list.
+class BufferPool {
+public:
+    BufferPool(size_t maxBuffersPerClass)
+        : maxBuffersPerClass_(maxBuffersPerClass)
+    {}
+
+    // Returns an empty buffer with capacity at least minCapacity.
+    std::vector<uint8_t> acquire(size_t minCapacity) {
+        size_t sizeClass = 0;
+        while(((size_t)1 << sizeClass) < minCapacity) {
+            ++sizeClass;
+        }
+        CHECK(sizeClass < ClassCount);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            // Buffers of the next size class are also accepted to make use of
+            // buffers that have grown slightly past a class boundary
+            for(size_t c = sizeClass; c < std::min(sizeClass + 2, ClassCount); ++c) {
+                std::vector<std::vector<uint8_t>>& freeList = freeLists_[c];
+                for(size_t i = freeList.size(); i-- > 0;) {
+                    if(freeList[i].capacity() >= minCapacity) {
+                        std::vector<uint8_t> buf = std::move(freeList[i]);
+                        freeList.erase(freeList.begin() + i);
+                        return buf;
+                    }
+                }
+            }
+        }
+
+        std::vector<uint8_t> buf;
+        buf.reserve((size_t)1 << sizeClass);
+        return buf;
+    }
+
+    void release(std::vector<uint8_t> buf) {
+        size_t capacity = buf.capacity();
+        if(capacity == 0) {
+            return;
+        }
+        size_t sizeClass = 0;
+        while(((size_t)2 << sizeClass) <= capacity && sizeClass + 1 < ClassCount) {
+            ++sizeClass;
+        }
+
+        buf.clear();
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::vector<uint8_t>>& freeList = freeLists_[sizeClass];
+        if(freeList.size() < maxBuffersPerClass_) {
+            freeList.push_back(std::move(buf));
+        }
+    }
+
+private:
+    static constexpr size_t ClassCount = 48;
+
+    size_t maxBuffersPerClass_;
+    std::mutex mutex_;
+    std::array<std::vector<std::vector<uint8_t>>, ClassCount> freeLists_;
+};
+
+// Deflate stream that is initialized once and reset for each compression, so
+// that the internal state of zlib (window, hash tables and pending buffer,
+// hundreds of kilobytes in total) is not allocated and freed for every stripe.
+class Deflater {
+public:
+    Deflater(int level) {
+        // At the lowest level, plain run-length encoding is the fastest
+        // option; at the higher levels, we use the strategy tuned for filtered
+        // data
+        int strategy = level == 1 ? Z_RLE : Z_FILTERED;
+
+        zStream_.zalloc = nullptr;
+        zStream_.zfree = nullptr;
+        zStream_.opaque = nullptr;
+        CHECK(ZLIB_FUNC(deflateInit2)(
+            &zStream_, level, Z_DEFLATED, 15, 8, strategy
+        ) == Z_OK);
+    }
+    ~Deflater() {
+        int res = ZLIB_FUNC(deflateEnd)(&zStream_);
+        CHECK(res == Z_OK || res == Z_DATA_ERROR);
+    }
+
+    Deflater(const Deflater&) = delete;
+    Deflater& operator=(const Deflater&) = delete;
+
+    // Returns the stream reset to the start of a new ZLIB stream.
+    ZStream& reset() {
+        CHECK(ZLIB_FUNC(deflateReset)(&zStream_) == Z_OK);
+        return zStream_;
+    }
+
+private:
+    ZStream zStream_;
+};
+
+// Thread-safe pool of Deflaters with a fixed compression level. At most one
+// deflater per stripe being compressed is in use at a time, so the pool stays
+// small and all the released deflaters are kept.
+class DeflaterPool {
+public:
+    DeflaterPool(int level)
+        : level_(level)
+    {}
+
+    std::unique_ptr<Deflater> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(!freeList_.empty()) {
+                std::unique_ptr<Deflater> deflater = std::move(freeList_.back());
+                freeList_.pop_back();
+                return deflater;
+            }
+        }
+        return std::unique_ptr<Deflater>(new Deflater(level_));
+    }
+
+    void release(std::unique_ptr<Deflater> deflater) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        freeList_.push_back(std::move(deflater));
+    }
+
+private:
+    int level_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Deflater>> freeList_;
+};
+
+// Open-addressing hash table of at most MaxColors distinct pixel colors, each
+// given as the blue, green and red bytes of the pixel packed into a 24-bit
+// integer (blue in the lowest byte), mapping the colors to their indices in
+// the order of insertion. Lookups are safe to do from multiple threads at the
+// same time.
+class ColorTable {
+public:
+    static constexpr size_t MaxColors = 256;
+
+    ColorTable()
+        : count_(0)
+    {
+        slots_.fill(EmptySlot);
+    }
+
+    static uint32_t pixelColor(const uint8_t* pixel) {
+        return
+            (uint32_t)pixel[0] |
+            ((uint32_t)pixel[1] << 8) |
+            ((uint32_t)pixel[2] << 16);
+    }
+
+    // Returns false if the color is not in the table and the table is full.
+    bool insert(uint32_t color) {
+        for(size_t slot = hash_(color); ; slot = (slot + 1) % SlotCount) {
+            uint64_t val = slots_[slot];
+            if(val == EmptySlot) {
+                if(count_ == MaxColors) {
+                    return false;
+                }
+                slots_[slot] = ((uint64_t)count_ << 32) | color;
+                colors_[count_++] = color;
+                return true;
+            }
+            if((uint32_t)val == color) {
+                return true;
+            }
+        }
+    }
+
+    // The color must be in the table.
+    uint8_t indexOf(uint32_t color) const {
+        for(size_t slot = hash_(color); ; slot = (slot + 1) % SlotCount) {
+            uint64_t val = slots_[slot];
+            CHECK(val != EmptySlot);
+            if((uint32_t)val == color) {
+                return (uint8_t)(val >> 32);
+            }
+        }
+    }
+
+    size_t count() const {
+        return count_;
+    }
+    uint32_t color(size_t idx) const {
+        return colors_[idx];
+    }
+
+private:
+    // The table is kept at most a quarter full to keep the probe sequences
+    // short.
+    static constexpr size_t SlotCount = 4 * MaxColors;
+    static constexpr uint64_t EmptySlot = ~(uint64_t)0;
+
+    static size_t hash_(uint32_t color) {
+        return (size_t)((color * UINT32_C(0x9e3779b1)) >> 22) % SlotCount;
+    }
+
+    std::array<uint64_t, SlotCount> slots_;
+    std::array<uint32_t, MaxColors> colors_;
+    size_t count_;
+};
+
+// Inserts the colors of lines [startY, endY) of the image into the table.
+// Returns false if the table got full, in which case the image has more than
+// ColorTable::MaxColors colors. Runs of pixels of the same color are skipped
+// without lookups, four pixels at a time if SSE2 is available.
+bool collectColors(
+    const uint8_t* image,
+    size_t width,
+    size_t pitch,
+    size_t startY,
+    size_t endY,
+    ColorTable& table
+) {
+    if(startY == endY || width == 0) {
+        return true;
+    }
+    uint32_t prevColor = ColorTable::pixelColor(&image[4 * startY * pitch]);
+    if(!table.insert(prevColor)) {
+        return false;
+    }
+    for(size_t y = startY; y < endY; ++y) {
+        const uint8_t* line = &image[4 * y * pitch];
+        size_t x = 0;
+#ifdef __SSE2__
+        // On x86, the BGRA bytes of a pixel read as a little-endian integer
+        // are the color in its low 24 bits
+        const __m128i colorMask = _mm_set1_epi32(0x00ffffff);
+        __m128i prev = _mm_set1_epi32((int)prevColor);
+        for(; x + 4 <= width; x += 4) {
+            __m128i val = _mm_and_si128(
+                _mm_loadu_si128((const __m128i*)(line + 4 * x)), colorMask
+            );
+            if(_mm_movemask_epi8(_mm_cmpeq_epi32(val, prev)) == 0xffff) {
+                continue;
+            }
+            for(size_t i = x; i < x + 4; ++i) {
+                uint32_t color = ColorTable::pixelColor(line + 4 * i);
+                if(color != prevColor) {
+                    if(!table.insert(color)) {
+                        return false;
+                    }
+                    prevColor = color;
+                }
+            }
+            prev = _mm_set1_epi32((int)prevColor);
+        }
+#endif
+        for(; x < width; ++x) {
+            uint32_t color = ColorTable::pixelColor(line + 4 * x);
+            if(color != prevColor) {
+                if(!table.insert(color)) {
+                    return false;
+                }
+                prevColor = color;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the smallest PNG bit depth that can index given number of colors.
+int paletteBitDepth(size_t colorCount) {
+    if(colorCount <= 2) {
+        return 1;
+    } else if(colorCount <= 4) {
+        return 2;
+    } else if(colorCount <= 16) {
+        return 4;
+    } else {
+        return 8;
+    }
+}
+
+// Converts width pixels from BGRA to palette indices packed bitDepth bits per
+// pixel, the leftmost pixel in the highest bits of each byte as required by
+// PNG. Writes exactly (width * bitDepth + 7) / 8 bytes to dest.
+void packIndices(
+    const uint8_t* src,
+    size_t width,
+    const ColorTable& palette,
+    int bitDepth,
+    uint8_t* dest
+) {
+    uint32_t prevColor = palette.color(0);
+    uint8_t prevIdx = 0;
+    auto lookup = [&](size_t x) {
+        uint32_t color = ColorTable::pixelColor(src + 4 * x);
+        if(color != prevColor) {
+            prevColor = color;
+            prevIdx = palette.indexOf(color);
+        }
+        return prevIdx;
+    };
+
+    if(bitDepth == 8) {
+        for(size_t x = 0; x < width; ++x) {
+            dest[x] = lookup(x);
+        }
+        return;
+    }
+
+    size_t pixelsPerByte = 8 / bitDepth;
+    size_t byteCount = (width + pixelsPerByte - 1) / pixelsPerByte;
+    for(size_t i = 0; i < byteCount; ++i) {
+        uint8_t byte = 0;
+        size_t endX = std::min(width, (i + 1) * pixelsPerByte);
+        int shift = 8;
+        for(size_t x = i * pixelsPerByte; x < endX; ++x) {
+            shift -= bitDepth;
+            byte |= (uint8_t)(lookup(x) << shift);
+        }
+        dest[i] = byte;
+    }
+}
 
 struct JobData {
+    BufferPool* bufferPool;
+    DeflaterPool* deflaterPool;
     const uint8_t* image;
     size_t width;
     size_t pitch;
     size_t startY;
     size_t endY;
     bool endStream;
-};
+    bool adaptiveFilter;
 
-struct Job {
-    bool shutdown;
-    std::promise<Result> resultPromise;
-    std::future<Job> nextJobFuture;
-    JobData data;
+    // If set, the image is encoded using the palette with given bit depth
+    // instead of RGB.
+    const ColorTable* palette;
+    int bitDepth;
 };
 
 struct Result {
@@ -141,10 +489,36 @@ struct Result {
     std::vector<uint8_t> chunk;
 };
 
-struct Worker {
-    std::thread thread;
-    std::promise<Job> jobPromise;
-};
+// The scanline kernels operate on lines of RGB bytes. The three bytes before
+// each line (the left neighbor of the first pixel) must be readable and zero.
+// Swizzle kernels may write up to LineSlack bytes past the end of the line;
+// filter kernels write exactly size bytes to dest.
+constexpr size_t LineSlack = 16;
+
+typedef void (*SwizzleFunc)(const uint8_t* src, size_t width, uint8_t* dest);
+typedef void (*FilterFunc)(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+);
+typedef uint64_t (*CostFunc)(const uint8_t* data, size_t size);
+typedef uint32_t (*CRCFunc)(uint32_t crc, const uint8_t* data, size_t size);
+
+uint32_t crc32Scalar(uint32_t crc, const uint8_t* data, size_t size) {
+    for(size_t i = 0; i < size; ++i) {
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Converts width pixels from BGRA to RGB.
+void swizzleScalar(const uint8_t* src, size_t width, uint8_t* dest) {
+    for(size_t x = 0; x < width; ++x) {
+        dest[0] = src[2];
+        dest[1] = src[1];
+        dest[2] = src[0];
+        src += 4;
+        dest += 3;
+    }
+}
 
 int paeth(int leftVal, int upVal, int upLeftVal) {
     int p = leftVal + upVal - upLeftVal;
@@ -160,6 +534,355 @@ int paeth(int leftVal, int upVal, int upLeftVal) {
     }
 }
 
+void noneFilter(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+) {
+    memcpy(dest, line, size);
+}
+
+void subFilter(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+) {
+    for(size_t i = 0; i < size; ++i) {
+        dest[i] = (uint8_t)(line[i] - line[i - 3]);
+    }
+}
+
+void upFilter(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+) {
+    for(size_t i = 0; i < size; ++i) {
+        dest[i] = (uint8_t)(line[i] - upLine[i]);
+    }
+}
+
+void paethFilterScalar(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+) {
+    for(size_t i = 0; i < size; ++i) {
+        int pred = paeth(line[i - 3], upLine[i], upLine[i - 3]);
+        dest[i] = (uint8_t)(line[i] - pred);
+    }
+}
+
+// Estimated cost of a filtered line for choosing the filter: the sum of the
+// absolute values of the bytes interpreted as signed, as suggested by the PNG
+// specification.
+uint64_t filterCostScalar(const uint8_t* data, size_t size) {
+    uint64_t cost = 0;
+    for(size_t i = 0; i < size; ++i) {
+        uint8_t val = data[i];
+        cost += val < 128 ? val : 256 - val;
+    }
+    return cost;
+}
+
+#ifdef __SSE2__
+
+// Computes the Paeth predictors for 8 values given as 16-bit integers.
+inline __m128i paethPredictSSE2(__m128i left, __m128i up, __m128i upLeft) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i upDiff = _mm_sub_epi16(up, upLeft);
+    __m128i leftDiff = _mm_sub_epi16(left, upLeft);
+    __m128i sumDiff = _mm_add_epi16(upDiff, leftDiff);
+
+    // The distances from p = left + up - upLeft to left, up and upLeft
+    __m128i pLeft = _mm_max_epi16(upDiff, _mm_sub_epi16(zero, upDiff));
+    __m128i pUp = _mm_max_epi16(leftDiff, _mm_sub_epi16(zero, leftDiff));
+    __m128i pUpLeft = _mm_max_epi16(sumDiff, _mm_sub_epi16(zero, sumDiff));
+
+    __m128i notLeft = _mm_or_si128(
+        _mm_cmpgt_epi16(pLeft, pUp), _mm_cmpgt_epi16(pLeft, pUpLeft)
+    );
+    __m128i useUpLeft = _mm_cmpgt_epi16(pUp, pUpLeft);
+    __m128i upOrUpLeft = _mm_or_si128(
+        _mm_andnot_si128(useUpLeft, up), _mm_and_si128(useUpLeft, upLeft)
+    );
+    return _mm_or_si128(
+        _mm_andnot_si128(notLeft, left), _mm_and_si128(notLeft, upOrUpLeft)
+    );
+}
+
+void paethFilterSSE2(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16) {
+        __m128i val = _mm_loadu_si128((const __m128i*)(line + i));
+        __m128i left = _mm_loadu_si128((const __m128i*)(line + i - 3));
+        __m128i up = _mm_loadu_si128((const __m128i*)(upLine + i));
+        __m128i upLeft = _mm_loadu_si128((const __m128i*)(upLine + i - 3));
+
+        __m128i predLow = paethPredictSSE2(
+            _mm_unpacklo_epi8(left, zero),
+            _mm_unpacklo_epi8(up, zero),
+            _mm_unpacklo_epi8(upLeft, zero)
+        );
+        __m128i predHigh = paethPredictSSE2(
+            _mm_unpackhi_epi8(left, zero),
+            _mm_unpackhi_epi8(up, zero),
+            _mm_unpackhi_epi8(upLeft, zero)
+        );
+        __m128i pred = _mm_packus_epi16(predLow, predHigh);
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_sub_epi8(val, pred));
+    }
+    paethFilterScalar(line + i, upLine + i, size - i, dest + i);
+}
+
+uint64_t filterCostSSE2(const uint8_t* data, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16) {
+        __m128i val = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i absVal = _mm_min_epu8(val, _mm_sub_epi8(zero, val));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(absVal, zero));
+    }
+    uint64_t parts[2];
+    _mm_storeu_si128((__m128i*)parts, sum);
+    return parts[0] + parts[1] + filterCostScalar(data + i, size - i);
+}
+
+#endif
+
+#ifdef __ARM_FEATURE_CRC32
+
+// The CRC32 instructions of ARMv8 use the same polynomial as PNG.
+uint32_t crc32ARMv8(uint32_t crc, const uint8_t* data, size_t size) {
+    for(; size > 0 && ((uintptr_t)data & 7) != 0; --size) {
+        crc = __crc32b(crc, *data++);
+    }
+    for(; size >= 8; size -= 8) {
+        uint64_t val;
+        memcpy(&val, data, 8);
+        crc = __crc32d(crc, val);
+        data += 8;
+    }
+    for(; size > 0; --size) {
+        crc = __crc32b(crc, *data++);
+    }
+    return crc;
+}
+
+#endif
+
+#ifdef PNG_X86_DISPATCH
+
+// The CRC32 instruction of SSE4.2 uses the Castagnoli polynomial, which is
+// different from the one used by PNG, so we compute the CRC by folding the
+// data using carry-less multiplication instead, as described in the Intel
+// white paper "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction". The data is folded four 16-byte blocks at a time into 128
+// bits, which are then reduced to 32 bits using Barrett reduction; the
+// constants are the ones for the bit-reflected PNG polynomial.
+// Folds the 128-bit CRC accumulator acc over the next block val using the
+// constant pair k.
+__attribute__((target("pclmul")))
+inline __m128i crcFoldPCLMUL(__m128i acc, __m128i val, __m128i k) {
+    return _mm_xor_si128(
+        _mm_xor_si128(
+            _mm_clmulepi64_si128(acc, k, 0x00),
+            _mm_clmulepi64_si128(acc, k, 0x11)
+        ),
+        val
+    );
+}
+
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32PCLMUL(uint32_t crc, const uint8_t* data, size_t size) {
+    if(size < 64) {
+        return crc32Scalar(crc, data, size);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)data);
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    data += 64;
+    size -= 64;
+
+    for(; size >= 64; size -= 64) {
+        x1 = crcFoldPCLMUL(x1, _mm_loadu_si128((const __m128i*)data), k1k2);
+        x2 = crcFoldPCLMUL(x2, _mm_loadu_si128((const __m128i*)(data + 16)), k1k2);
+        x3 = crcFoldPCLMUL(x3, _mm_loadu_si128((const __m128i*)(data + 32)), k1k2);
+        x4 = crcFoldPCLMUL(x4, _mm_loadu_si128((const __m128i*)(data + 48)), k1k2);
+        data += 64;
+    }
+
+    x1 = crcFoldPCLMUL(x1, x2, k3k4);
+    x1 = crcFoldPCLMUL(x1, x3, k3k4);
+    x1 = crcFoldPCLMUL(x1, x4, k3k4);
+    for(; size >= 16; size -= 16) {
+        x1 = crcFoldPCLMUL(x1, _mm_loadu_si128((const __m128i*)data), k3k4);
+        data += 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return crc32Scalar(crc, data, size);
+}
+
+__attribute__((target("ssse3")))
+void swizzleSSSE3(const uint8_t* src, size_t width, uint8_t* dest) {
+    // Four BGRA pixels to 12 bytes of RGB; the last 4 bytes of each store
+    // are overwritten by the next store or fall into the line slack
+    const __m128i shuffle = _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+    );
+    size_t x = 0;
+    for(; x + 4 <= width; x += 4) {
+        __m128i val = _mm_loadu_si128((const __m128i*)(src + 4 * x));
+        _mm_storeu_si128(
+            (__m128i*)(dest + 3 * x), _mm_shuffle_epi8(val, shuffle)
+        );
+    }
+    swizzleScalar(src + 4 * x, width - x, dest + 3 * x);
+}
+
+// Same as paethPredictSSE2 for 16 values.
+__attribute__((target("avx2")))
+inline __m256i paethPredictAVX2(__m256i left, __m256i up, __m256i upLeft) {
+    __m256i upDiff = _mm256_sub_epi16(up, upLeft);
+    __m256i leftDiff = _mm256_sub_epi16(left, upLeft);
+    __m256i pLeft = _mm256_abs_epi16(upDiff);
+    __m256i pUp = _mm256_abs_epi16(leftDiff);
+    __m256i pUpLeft = _mm256_abs_epi16(_mm256_add_epi16(upDiff, leftDiff));
+
+    __m256i notLeft = _mm256_or_si256(
+        _mm256_cmpgt_epi16(pLeft, pUp), _mm256_cmpgt_epi16(pLeft, pUpLeft)
+    );
+    __m256i useUpLeft = _mm256_cmpgt_epi16(pUp, pUpLeft);
+    __m256i upOrUpLeft = _mm256_blendv_epi8(up, upLeft, useUpLeft);
+    return _mm256_blendv_epi8(left, upOrUpLeft, notLeft);
+}
+
+// Unpacking and packing are done within 128-bit lanes, so the byte order is
+// preserved.
+__attribute__((target("avx2")))
+void paethFilterAVX2(
+    const uint8_t* line, const uint8_t* upLine, size_t size, uint8_t* dest
+) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32) {
+        __m256i val = _mm256_loadu_si256((const __m256i*)(line + i));
+        __m256i left = _mm256_loadu_si256((const __m256i*)(line + i - 3));
+        __m256i up = _mm256_loadu_si256((const __m256i*)(upLine + i));
+        __m256i upLeft = _mm256_loadu_si256((const __m256i*)(upLine + i - 3));
+
+        __m256i predLow = paethPredictAVX2(
+            _mm256_unpacklo_epi8(left, zero),
+            _mm256_unpacklo_epi8(up, zero),
+            _mm256_unpacklo_epi8(upLeft, zero)
+        );
+        __m256i predHigh = paethPredictAVX2(
+            _mm256_unpackhi_epi8(left, zero),
+            _mm256_unpackhi_epi8(up, zero),
+            _mm256_unpackhi_epi8(upLeft, zero)
+        );
+        __m256i pred = _mm256_packus_epi16(predLow, predHigh);
+        _mm256_storeu_si256((__m256i*)(dest + i), _mm256_sub_epi8(val, pred));
+    }
+    paethFilterSSE2(line + i, upLine + i, size - i, dest + i);
+}
+
+#endif
+
+// The kernels used by the compressor, selected at startup based on the
+// instruction sets supported by the CPU.
+struct Kernels {
+    SwizzleFunc swizzle;
+    FilterFunc paethFilter;
+    CostFunc filterCost;
+    CRCFunc crc32;
+};
+
+Kernels selectKernels() {
+    Kernels kernels;
+    kernels.swizzle = swizzleScalar;
+    kernels.paethFilter = paethFilterScalar;
+    kernels.filterCost = filterCostScalar;
+    kernels.crc32 = crc32Scalar;
+#ifdef __SSE2__
+    kernels.paethFilter = paethFilterSSE2;
+    kernels.filterCost = filterCostSSE2;
+#endif
+#ifdef __ARM_FEATURE_CRC32
+    kernels.crc32 = crc32ARMv8;
+#endif
+#ifdef PNG_X86_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3")) {
+        kernels.swizzle = swizzleSSSE3;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        kernels.paethFilter = paethFilterAVX2;
+    }
+    if(
+        __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("sse4.1")
+    ) {
+        kernels.crc32 = crc32PCLMUL;
+    }
+#endif
+    return kernels;
+}
+const Kernels kernels = selectKernels();
+
+uint32_t updateCRC32(uint32_t crc, const uint8_t* data, size_t size) {
+    return kernels.crc32(crc, data, size);
+}
+
+// Filters the line into dest using the filter type with the smallest
+// estimated cost and returns the filter type. The scratch buffer must have
+// room for size bytes.
+uint8_t adaptiveFilter(
+    const uint8_t* line,
+    const uint8_t* upLine,
+    size_t size,
+    uint8_t* dest,
+    uint8_t* scratch
+) {
+    kernels.paethFilter(line, upLine, size, dest);
+    uint8_t bestType = 4;
+    uint64_t bestCost = kernels.filterCost(dest, size);
+
+    const std::pair<uint8_t, FilterFunc> candidates[] = {
+        {0, noneFilter},
+        {1, subFilter},
+        {2, upFilter}
+    };
+    for(const std::pair<uint8_t, FilterFunc>& candidate : candidates) {
+        candidate.second(line, upLine, size, scratch);
+        uint64_t cost = kernels.filterCost(scratch, size);
+        if(cost < bestCost) {
+            bestType = candidate.first;
+            bestCost = cost;
+            memcpy(dest, scratch, size);
+        }
+    }
+    return bestType;
+}
+
 Result runJob(JobData jobData) {
     const uint8_t* image = jobData.image;
     size_t width = jobData.width;
@@ -171,108 +894,134 @@ Result runJob(JobData jobData) {
     CHECK(startY < endY);
 
     size_t heightOut = endY - startY;
-    size_t uncompressedBytes = heightOut * (1 + 3 * width);
+    const ColorTable* palette = jobData.palette;
+    size_t lineSize =
+        palette != nullptr ? (width * jobData.bitDepth + 7) / 8 : 3 * width;
+    size_t uncompressedBytes = heightOut * (1 + lineSize);
+
+    std::vector<uint8_t> rawData =
+        jobData.bufferPool->acquire(uncompressedBytes);
+    rawData.resize(uncompressedBytes);
+
+    // Buffers for the current and the previous line converted to RGB (or
+    // palette indices) and for trying out filters, each with the zero bytes
+    // and slack required by the kernels. The line above the first line of the
+    // image is all zeros.
+    size_t lineStride = 3 + lineSize + LineSlack;
+    std::vector<uint8_t> lineData =
+        jobData.bufferPool->acquire(3 * lineStride);
+    lineData.assign(3 * lineStride, 0);
+    uint8_t* line = lineData.data() + 3;
+    uint8_t* upLine = line + lineStride;
+    uint8_t* scratch = upLine + lineStride;
+
+    auto convertLine = [&](size_t y, uint8_t* dest) {
+        if(palette != nullptr) {
+            packIndices(
+                &image[4 * y * pitch], width, *palette, jobData.bitDepth, dest
+            );
+        } else {
+            kernels.swizzle(&image[4 * y * pitch], width, dest);
+        }
+    };
 
-    std::vector<uint8_t> rawData;
-    rawData.reserve(uncompressedBytes);
+    if(startY > 0) {
+        convertLine(startY - 1, upLine);
+    }
 
+    uint8_t* outPos = rawData.data();
     for(size_t y = startY; y < endY; ++y) {
-        const uint8_t* imagePos = &image[4 * y * pitch];
-        if(y == 0) {
-            // First line is filtered by left subtraction
-            rawData.push_back(1);
-            int leftVal[3] = {0, 0, 0};
-            for(size_t x = 0; x < width; ++x) {
-                for(size_t c = 0; c < 3; ++c) {
-                    int val = *(imagePos + 2 - c);
-                    rawData.push_back((uint8_t)(val - leftVal[c]));
-                    leftVal[c] = val;
+        convertLine(y, line);
+
+        uint8_t* filterType = outPos;
+        uint8_t* filtered = outPos + 1;
+        if(palette != nullptr) {
+            // The PNG specification recommends no filtering for indexed
+            // images, as the differences of the indices are meaningless; in
+            // adaptive mode, the Up filter is also tried, as it turns lines
+            // repeating the previous one into zeros
+            *filterType = 0;
+            noneFilter(line, upLine, lineSize, filtered);
+            if(jobData.adaptiveFilter) {
+                upFilter(line, upLine, lineSize, scratch);
+                if(
+                    kernels.filterCost(scratch, lineSize) <
+                    kernels.filterCost(filtered, lineSize)
+                ) {
+                    *filterType = 2;
+                    memcpy(filtered, scratch, lineSize);
                 }
-                imagePos += 4;
             }
+        } else if(jobData.adaptiveFilter) {
+            *filterType = adaptiveFilter(
+                line, upLine, lineSize, filtered, scratch
+            );
+        } else if(y == 0) {
+            // First line is filtered by left subtraction
+            *filterType = 1;
+            subFilter(line, upLine, lineSize, filtered);
         } else {
             // The rest of the lines are filtered using Paeth
-            const uint8_t* upImagePos = imagePos - 4 * pitch;
-            rawData.push_back(4);
-            int leftVal[3] = {0, 0, 0};
-            int upLeftVal[3] = {0, 0, 0};
-            for(size_t x = 0; x < width; ++x) {
-                for(size_t c = 0; c < 3; ++c) {
-                    int val = *(imagePos + 2 - c);
-                    int upVal = *(upImagePos + 2 - c);
-                    int pred = paeth(leftVal[c], upVal, upLeftVal[c]);
-                    rawData.push_back((uint8_t)(val - pred));
-                    leftVal[c] = val;
-                    upLeftVal[c] = upVal;
-                }
-                imagePos += 4;
-                upImagePos += 4;
-            }
+            *filterType = 4;
+            kernels.paethFilter(line, upLine, lineSize, filtered);
         }
+        outPos += 1 + lineSize;
+
+        std::swap(line, upLine);
     }
 
-    CHECK(rawData.size() == uncompressedBytes);
+    jobData.bufferPool->release(std::move(lineData));
 
-    z_stream zStream;
-    zStream.zalloc = nullptr;
-    zStream.zfree = nullptr;
-    zStream.opaque = nullptr;
-    CHECK(deflateInit2(&zStream, 1, Z_DEFLATED, 15, 8, Z_RLE) == Z_OK);
+    CHECK(outPos == rawData.data() + uncompressedBytes);
+
+    std::unique_ptr<Deflater> deflater = jobData.deflaterPool->acquire();
+    ZStream& zStream = deflater->reset();
 
     zStream.avail_in = uncompressedBytes;
     zStream.next_in = rawData.data();
 
-    std::vector<uint8_t> chunk;
+    // The output buffer is preallocated to the worst-case size of the ZLIB
+    // stream with room for the empty block written by a sync flush, so that a
+    // single deflate call normally suffices; the chunk also needs room for its
+    // header and CRC
+    size_t outBound =
+        (size_t)ZLIB_FUNC(deflateBound)(&zStream, uncompressedBytes) + 16;
+    std::vector<uint8_t> chunk = jobData.bufferPool->acquire(outBound + 12);
     ChunkWriter writer(chunk, "IDAT");
     size_t zStreamStart = chunk.size();
+    chunk.resize(zStreamStart + outBound);
 
-    bool headerRead = false;
-    bool bufErrorSeen = false;
+    zStream.avail_out = outBound;
+    zStream.next_out = chunk.data() + zStreamStart;
+
+    int flush = endStream ? Z_FINISH : Z_SYNC_FLUSH;
     while(true) {
-        size_t blockSize = headerRead ? 8192 : 64;
+        int res = ZLIB_FUNC(deflate)(&zStream, flush);
+        CHECK(res == Z_OK || res == Z_STREAM_END);
+        if(endStream ? res == Z_STREAM_END : zStream.avail_out != 0) {
+            break;
+        }
 
+        // The output did not fit into the bound (should not happen); grow the
+        // buffer and continue
         size_t pos = chunk.size();
-        chunk.resize(pos + blockSize);
-
-        zStream.avail_out = blockSize;
+        chunk.resize(pos + 8192);
+        zStream.avail_out = 8192;
         zStream.next_out = chunk.data() + pos;
-
-        int flush;
-        if(bufErrorSeen) {
-            flush = endStream ? Z_FINISH : Z_SYNC_FLUSH;;
-        } else {
-            flush = Z_NO_FLUSH;
-        }
-        int res = deflate(&zStream, flush);
-        CHECK(res == Z_OK || res == Z_STREAM_END || res == Z_BUF_ERROR);
-
-        chunk.resize(chunk.size() - zStream.avail_out);
-
-        if(!headerRead && chunk.size() >= zStreamStart + 2) {
-            // Check ZLIB header
-            CHECK((chunk[zStreamStart] & 0xf) == 8); // deflate compression
-            CHECK((chunk[zStreamStart] >> 4) == 7); // 32K window size
-            CHECK(!(chunk[zStreamStart + 1] & 32)); // no preset dictionary
-            chunk.erase(chunk.begin() + zStreamStart, chunk.begin() + zStreamStart + 2);
-            headerRead = true;
-        }
-
-        if(bufErrorSeen) {
-            if(res == Z_STREAM_END || res == Z_BUF_ERROR) {
-                break;
-            }
-        } else {
-            if(res == Z_BUF_ERROR) {
-                bufErrorSeen = true;
-            }
-        }
     }
-    CHECK(headerRead);
+    chunk.resize(chunk.size() - zStream.avail_out);
+
+    // Check ZLIB header
+    CHECK(chunk.size() >= zStreamStart + 2);
+    CHECK((chunk[zStreamStart] & 0xf) == 8); // deflate compression
+    CHECK((chunk[zStreamStart] >> 4) == 7); // 32K window size
+    CHECK(!(chunk[zStreamStart + 1] & 32)); // no preset dictionary
+    chunk.erase(chunk.begin() + zStreamStart, chunk.begin() + zStreamStart + 2);
 
     uint32_t adler32 = zStream.adler;
-    
-    int res = deflateEnd(&zStream);
-    CHECK(res == Z_OK || res == Z_DATA_ERROR);
+    jobData.deflaterPool->release(std::move(deflater));
+
+    jobData.bufferPool->release(std::move(rawData));
 
     // Remove Adler32 value from the end of data
     if(endStream) {
@@ -286,96 +1035,131 @@ Result runJob(JobData jobData) {
     return {uncompressedBytes, adler32, std::move(chunk)};
 }
 
-void workerThread(std::future<Job> jobFuture) {
-    while(true) {
-        Job job = jobFuture.get();
-        if(job.shutdown) {
-            break;
-        }
-        jobFuture = std::move(job.nextJobFuture);
-        job.resultPromise.set_value(runJob(std::move(job.data)));
-    }
-}
-
 }
 
 class PNGCompressor::Impl {
 public:
-    Impl(size_t threadCount);
-    ~Impl();
+    Impl(size_t stripeCount, ParallelFor parallelFor, PNGOptions options);
 
-    std::vector<std::vector<uint8_t>> compress(
+    std::shared_ptr<const std::vector<std::vector<uint8_t>>> compress(
         const uint8_t* image,
         size_t width,
         size_t height,
-        size_t pitch
+        size_t pitch,
+        bool indexedOnly
     );
 
 private:
-    std::vector<Worker> workers_;
+    size_t stripeCount_;
+    ParallelFor parallelFor_;
+    PNGOptions options_;
+    std::shared_ptr<BufferPool> bufferPool_;
+    DeflaterPool deflaterPool_;
 };
 
-PNGCompressor::Impl::Impl(size_t threadCount) {
-    CHECK(threadCount >= 1);
-    for(size_t i = 1; i < threadCount; ++i) {
-        std::promise<Job> jobPromise;
-        std::future<Job> jobFuture = jobPromise.get_future();
-        std::thread thread([jobFuture{std::move(jobFuture)}]() mutable {
-            workerThread(std::move(jobFuture));
-        });
-        workers_.push_back({std::move(thread), std::move(jobPromise)});
-    }
-}
-PNGCompressor::Impl::~Impl() {
-    for(Worker& worker : workers_) {
-        Job job;
-        job.shutdown = true;
-        worker.jobPromise.set_value(std::move(job));
-        worker.thread.join();
+PNGCompressor::Impl::Impl(
+    size_t stripeCount,
+    ParallelFor parallelFor,
+    PNGOptions options
+)
+    : stripeCount_(stripeCount),
+      parallelFor_(std::move(parallelFor)),
+      options_(options),
+      // Enough buffers for the scanlines and outputs of a compression in
+      // progress and the outputs of two previous images still being sent
+      bufferPool_(std::make_shared<BufferPool>(4 * stripeCount)),
+      deflaterPool_(options.compressionLevel)
+{
+    CHECK(stripeCount >= 1);
+    CHECK(options_.compressionLevel >= 1 && options_.compressionLevel <= 9);
+    if(!parallelFor_) {
+        parallelFor_ = [](size_t count, std::function<void(size_t)> func) {
+            for(size_t i = 0; i < count; ++i) {
+                func(i);
+            }
+        };
     }
 }
 
-std::vector<std::vector<uint8_t>> PNGCompressor::Impl::compress(
+std::shared_ptr<const std::vector<std::vector<uint8_t>>>
+PNGCompressor::Impl::compress(
     const uint8_t* image,
     size_t width,
     size_t height,
-    size_t pitch
+    size_t pitch,
+    bool indexedOnly
 ) {
     CHECK(width > 0 && height > 0);
 
-    size_t threadCount = std::min(workers_.size() + 1, height);
+    size_t stripeCount = std::min(stripeCount_, height);
+
+    // Count the colors of the stripes in parallel and merge them into the
+    // palette
+    std::unique_ptr<ColorTable> palette;
+    if(options_.palette || indexedOnly) {
+        std::vector<ColorTable> stripeColors(stripeCount);
+        std::vector<char> stripeOk(stripeCount);
+        parallelFor_(stripeCount, [&](size_t i) {
+            stripeOk[i] = collectColors(
+                image,
+                width,
+                pitch,
+                height * i / stripeCount,
+                height * (i + 1) / stripeCount,
+                stripeColors[i]
+            );
+        });
+
+        palette.reset(new ColorTable());
+        for(size_t i = 0; i < stripeCount && palette; ++i) {
+            const ColorTable& colors = stripeColors[i];
+            for(size_t j = 0; j < colors.count() && stripeOk[i]; ++j) {
+                stripeOk[i] = palette->insert(colors.color(j));
+            }
+            if(!stripeOk[i]) {
+                palette.reset();
+            }
+        }
+    }
+    if(indexedOnly && !palette) {
+        return {};
+    }
+    int bitDepth = palette ? paletteBitDepth(palette->count()) : 8;
 
-    std::vector<JobData> jobDatas(threadCount);
-    for(size_t i = 0; i < threadCount; ++i) {
+    std::vector<JobData> jobDatas(stripeCount);
+    for(size_t i = 0; i < stripeCount; ++i) {
         JobData& jobData = jobDatas[i];
+        jobData.bufferPool = bufferPool_.get();
+        jobData.deflaterPool = &deflaterPool_;
         jobData.image = image;
         jobData.width = width;
         jobData.pitch = pitch;
-        jobData.startY = height * i / threadCount;
-        jobData.endY = height * (i + 1) / threadCount;
-        jobData.endStream = i + 1 == threadCount;
-    }
-
-    std::vector<std::future<Result>> resultFutures(threadCount - 1);
-    for(size_t i = 1; i < threadCount; ++i) {
-        std::promise<Job> nextJobPromise;
-        Job job;
-        job.shutdown = false;
-        resultFutures[i - 1] = job.resultPromise.get_future();
-        job.nextJobFuture = nextJobPromise.get_future();
-        job.data = std::move(jobDatas[i]);
-
-        workers_[i - 1].jobPromise.set_value(std::move(job));
-        workers_[i - 1].jobPromise = std::move(nextJobPromise);
-    }
-
-    std::vector<Result> results(threadCount);
-    results[0] = runJob(std::move(jobDatas[0]));
-    for(size_t i = 1; i < threadCount; ++i) {
-        results[i] = resultFutures[i - 1].get();
+        jobData.startY = height * i / stripeCount;
+        jobData.endY = height * (i + 1) / stripeCount;
+        jobData.endStream = i + 1 == stripeCount;
+        jobData.adaptiveFilter = options_.adaptiveFilter;
+        jobData.palette = palette.get();
+        jobData.bitDepth = bitDepth;
     }
 
-    std::vector<std::vector<uint8_t>> chunks;
+    std::vector<Result> results(stripeCount);
+    parallelFor_(stripeCount, [&](size_t i) {
+        results[i] = runJob(jobDatas[i]);
+    });
+
+    // The chunk buffers are returned to the pool once the caller drops the
+    // result, which may happen in any thread and after we have been destroyed
+    std::shared_ptr<BufferPool> bufferPool = bufferPool_;
+    std::shared_ptr<std::vector<std::vector<uint8_t>>> chunksPtr(
+        new std::vector<std::vector<uint8_t>>(),
+        [bufferPool](std::vector<std::vector<uint8_t>>* chunks) {
+            for(std::vector<uint8_t>& chunk : *chunks) {
+                bufferPool->release(std::move(chunk));
+            }
+            delete chunks;
+        }
+    );
+    std::vector<std::vector<uint8_t>>& chunks = *chunksPtr;
     std::vector<uint8_t> headerData;
 
     // PNG signature
@@ -392,13 +1176,23 @@ std::vector<std::vector<uint8_t>> PNGCompressor::Impl::compress(
         ChunkWriter writer(headerData, "IHDR");
         writer.writeU32(width);
         writer.writeU32(height);
-        writer.writeU8(8); // bit depth 8
-        writer.writeU8(2); // color type RGB
+        writer.writeU8((uint8_t)bitDepth);
+        writer.writeU8(palette ? 3 : 2); // color type indexed or RGB
         writer.writeU8(0); // compression method standard
         writer.writeU8(0); // filter method standard
         writer.writeU8(0); // no interlace
         writer.finish();
     }
+    if(palette) {
+        ChunkWriter writer(headerData, "PLTE");
+        for(size_t i = 0; i < palette->count(); ++i) {
+            uint32_t color = palette->color(i);
+            writer.writeU8((uint8_t)(color >> 16));
+            writer.writeU8((uint8_t)(color >> 8));
+            writer.writeU8((uint8_t)color);
+        }
+        writer.finish();
+    }
     {
         ChunkWriter writer(headerData, "IDAT");
 
@@ -421,7 +1215,9 @@ std::vector<std::vector<uint8_t>> PNGCompressor::Impl::compress(
         // Combined adler32 value terminates the ZLIB stream
         uint32_t adler32 = 1;
         for(const Result& result : results) {
-            adler32 = adler32_combine(adler32, result.adler32, result.uncompressedBytes);
+            adler32 = ZLIB_FUNC(adler32_combine)(
+                adler32, result.adler32, result.uncompressedBytes
+            );
         }
         writer.writeU32(adler32);
 
@@ -433,20 +1229,78 @@ std::vector<std::vector<uint8_t>> PNGCompressor::Impl::compress(
     }
     chunks.push_back(std::move(footerData));
 
-    return chunks;
+    return chunksPtr;
 }
 
-PNGCompressor::PNGCompressor(size_t threadCount)
-    : impl_(new Impl(threadCount))
+PNGCompressor::PNGCompressor(
+    size_t stripeCount,
+    ParallelFor parallelFor,
+    PNGOptions options
+)
+    : impl_(new Impl(stripeCount, std::move(parallelFor), options))
 {}
 
 PNGCompressor::~PNGCompressor() {}
 
-std::vector<std::vector<uint8_t>> PNGCompressor::compress(
+std::shared_ptr<const std::vector<std::vector<uint8_t>>>
+PNGCompressor::compress(
     const uint8_t* image,
     size_t width,
     size_t height,
     size_t pitch
 ) {
-    return impl_->compress(image, width, height, pitch);
+    return impl_->compress(image, width, height, pitch, false);
+}
+
+std::shared_ptr<const std::vector<std::vector<uint8_t>>>
+PNGCompressor::compressIndexed(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch
+) {
+    return impl_->compress(image, width, height, pitch, true);
+}
+
+std::vector<uint8_t> createBlankPNG(size_t width, size_t height) {
+    CHECK(width > 0 && height > 0);
+
+    // Each line consists of the filter type byte (0 = none) followed by the
+    // bits of the pixels, all set to 1 (white)
+    size_t lineBytes = 1 + (width + 7) / 8;
+    std::vector<uint8_t> rawData(height * lineBytes, (uint8_t)255);
+    for(size_t y = 0; y < height; ++y) {
+        rawData[y * lineBytes] = 0;
+    }
+
+    ZSize compressedSize = ZLIB_FUNC(compressBound)(rawData.size());
+    std::vector<uint8_t> compressed(compressedSize);
+    CHECK(ZLIB_FUNC(compress2)(
+        compressed.data(), &compressedSize,
+        rawData.data(), rawData.size(),
+        9
+    ) == Z_OK);
+
+    std::vector<uint8_t> png = {137, 80, 78, 71, 13, 10, 26, 10};
+    {
+        ChunkWriter writer(png, "IHDR");
+        writer.writeU32(width);
+        writer.writeU32(height);
+        writer.writeU8(1); // bit depth 1
+        writer.writeU8(0); // color type grayscale
+        writer.writeU8(0); // compression method standard
+        writer.writeU8(0); // filter method standard
+        writer.writeU8(0); // no interlace
+        writer.finish();
+    }
+    {
+        ChunkWriter writer(png, "IDAT");
+        writer.write(compressed.data(), compressedSize);
+        writer.finish();
+    }
+    {
+        ChunkWriter writer(png, "IEND");
+        writer.finish();
+    }
+    return png;
 }
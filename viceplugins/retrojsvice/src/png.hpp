@@ -25,23 +25,71 @@ SOFTWARE.
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <vector>
 
+struct PNGOptions {
+    // If true, the filter of each image line is chosen among None, Sub, Up
+    // and Paeth by the smallest estimated cost, which usually produces
+    // smaller images at the cost of slower compression. Otherwise, Paeth is
+    // used for all lines except the first.
+    bool adaptiveFilter = false;
+
+    // Deflate compression level 1..9. Level 1 uses run-length encoding only,
+    // which is by far the fastest; the higher levels produce smaller images
+    // using more CPU time.
+    int compressionLevel = 1;
+
+    // If true, images with at most 256 distinct colors (typical for text-heavy
+    // pages) are encoded losslessly as indexed-color images with a palette,
+    // using 1, 2, 4 or 8 bits per pixel depending on the number of colors;
+    // other images are encoded as RGB. Counting the colors stops as soon as
+    // the limit is exceeded.
+    bool palette = true;
+};
+
 class PNGCompressor {
 public:
-    PNGCompressor(size_t threadCount);
+    // Function that calls func(i) for all 0 <= i < count, possibly in
+    // parallel, and returns once all the calls have returned.
+    typedef std::function<
+        void(size_t count, std::function<void(size_t)> func)
+    > ParallelFor;
+
+    // The image is split into stripeCount horizontal stripes that are
+    // compressed independently using parallelFor. If parallelFor is empty,
+    // the stripes are compressed sequentially in the calling thread.
+    PNGCompressor(
+        size_t stripeCount,
+        ParallelFor parallelFor = {},
+        PNGOptions options = {}
+    );
     ~PNGCompressor();
 
     // Compress given image into PNG. The image data should be in a format where
     // for all 0 <= y < height and 0 <= x < width, image[4 * (y * pitch + x) + c]
     // is the value for color blue, green and red for c = 0, 1, 2, respectively.
     // The resulting compressed PNG data can be obtained by concatenating the
-    // returned chunks.
+    // returned chunks. The buffers are recycled for later compressions once the
+    // returned pointer is released, which is allowed in any thread, also after
+    // the compressor has been destroyed.
     // 
-    // This function is not safe to call from multiple threads at the same time
-    // for the same PNGCompressor object.
-    std::vector<std::vector<uint8_t>> compress(
+    // This function is safe to call from multiple threads at the same time if
+    // the given parallelFor is.
+    std::shared_ptr<const std::vector<std::vector<uint8_t>>> compress(
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch
+    );
+
+    // Like compress, but only succeeds if the image has at most 256 distinct
+    // colors, in which case it is encoded as an indexed-color image even if
+    // PNGOptions::palette is not set; otherwise, returns null without
+    // compressing the image (only the colors are counted, which stops as soon
+    // as the limit is exceeded).
+    std::shared_ptr<const std::vector<std::vector<uint8_t>>> compressIndexed(
         const uint8_t* image,
         size_t width,
         size_t height,
@@ -52,3 +100,8 @@ private:
     class Impl;
     std::unique_ptr<Impl> impl_;
 };
+
+// Returns a white PNG image of given size. The image is encoded as a 1-bit
+// grayscale image, so the result is small even for large sizes; this makes it
+// suitable for signaling values to the client through image dimensions.
+std::vector<uint8_t> createBlankPNG(size_t width, size_t height);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+// Rectangle [startX, endX) x [startY, endY). Empty rectangle is represented by
+// [0, 0) x [0, 0)
+struct Rect {
+    int startX;
+    int endX;
+    int startY;
+    int endY;
+
+    Rect() {
+        startX = 0;
+        endX = 0;
+        startY = 0;
+        endY = 0;
+    }
+    Rect(int pStartX, int pEndX, int pStartY, int pEndY) {
+        startX = pStartX;
+        endX = pEndX;
+        startY = pStartY;
+        endY = pEndY;
+
+        if(startX >= endX || startY >= endY) {
+            startX = 0;
+            endX = 0;
+            startY = 0;
+            endY = 0;
+        }
+    }
+
+    bool isEmpty() const {
+        return startX >= endX || startY >= endY;
+    }
+
+    static Rect translate(Rect rect, int dx, int dy) {
+        return Rect(
+            rect.startX + dx,
+            rect.endX + dx,
+            rect.startY + dy,
+            rect.endY + dy
+        );
+    }
+
+    static Rect intersection(Rect rect1, Rect rect2) {
+        return Rect(
+            max(rect1.startX, rect2.startX),
+            min(rect1.endX, rect2.endX),
+            max(rect1.startY, rect2.startY),
+            min(rect1.endY, rect2.endY)
+        );
+    }
+
+    // Smallest rectangle containing both rectangles (empty rectangles are
+    // ignored)
+    static Rect boundingBox(Rect rect1, Rect rect2) {
+        if(rect1.isEmpty()) {
+            return rect2;
+        }
+        if(rect2.isEmpty()) {
+            return rect1;
+        }
+        return Rect(
+            min(rect1.startX, rect2.startX),
+            max(rect1.endX, rect2.endX),
+            min(rect1.startY, rect2.startY),
+            max(rect1.endY, rect2.endY)
+        );
+    }
+
+    // Returns true if other is contained in this rectangle (the empty rectangle
+    // is contained in every rectangle)
+    bool contains(Rect other) const {
+        return other.isEmpty() || (
+            other.startX >= startX && other.endX <= endX &&
+            other.startY >= startY && other.endY <= endY
+        );
+    }
+};
+
+}
@@ -0,0 +1,171 @@
+#include "scroll_detector.hpp"
+
+namespace retrojsvice {
+
+namespace {
+
+// The number of columns at the right edge left out of the line hashes.
+const size_t EdgeMargin = 32;
+
+// A shift is only reported if it covers at least this many lines and at least
+// MinVotes lines with a unique hash agree on it.
+const int MinShiftLines = 16;
+const int MinVotes = 8;
+
+// Hash of the colors of the first width pixels of the line (the alpha bytes
+// are ignored). Like the frame fingerprints in ImageCompressor, four
+// independent lanes are mixed in parallel.
+uint64_t hashLine(const uint8_t* line, size_t width) {
+    const uint64_t Prime = UINT64_C(0x9e3779b97f4a7c15);
+    const uint64_t ColorMask = UINT64_C(0x00ffffff00ffffff);
+    uint64_t lanes[4] = {1, 2, 3, 4};
+
+    const uint8_t* pos = line;
+    size_t blockCount = width / 8;
+    for(size_t i = 0; i < blockCount; ++i) {
+        for(int j = 0; j < 4; ++j) {
+            uint64_t word;
+            memcpy(&word, pos + 8 * j, 8);
+            lanes[j] = (lanes[j] ^ (word & ColorMask)) * Prime;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+        pos += 32;
+    }
+
+    uint64_t ret = (uint64_t)width;
+    for(int j = 0; j < 4; ++j) {
+        ret = (ret ^ lanes[j]) * Prime;
+    }
+    for(size_t x = 8 * blockCount; x < width; ++x) {
+        uint32_t pixel;
+        memcpy(&pixel, line + 4 * x, 4);
+        ret = (ret ^ (uint64_t)(pixel & 0xffffff)) * Prime;
+    }
+    return ret ^ (ret >> 32);
+}
+
+}
+
+ScrollDetector::ScrollDetector() {
+    width_ = 0;
+    height_ = 0;
+    hashWidth_ = 0;
+}
+
+optional<ScrollShift> ScrollDetector::update(
+    const uint8_t* image,
+    size_t width,
+    size_t height,
+    size_t pitch,
+    Rect changed,
+    bool detect
+) {
+    if(width != width_ || height != height_ || hashes_.size() != height) {
+        width_ = width;
+        height_ = height;
+        hashWidth_ = width > 2 * EdgeMargin ? width - EdgeMargin : width;
+        hashes_.resize(height);
+        for(size_t y = 0; y < height; ++y) {
+            hashes_[y] = hashLine(image + 4 * y * pitch, hashWidth_);
+        }
+        return {};
+    }
+
+    int startY = max(changed.startY, 0);
+    int endY = min(changed.endY, (int)height);
+    if(changed.isEmpty() || startY >= endY) {
+        return {};
+    }
+
+    prevHashes_.assign(hashes_.begin() + startY, hashes_.begin() + endY);
+    for(int y = startY; y < endY; ++y) {
+        hashes_[y] = hashLine(image + 4 * (size_t)y * pitch, hashWidth_);
+    }
+
+    if(!detect || endY - startY < MinShiftLines) {
+        return {};
+    }
+    return detect_(startY, endY);
+}
+
+void ScrollDetector::reset() {
+    width_ = 0;
+    height_ = 0;
+    hashes_.clear();
+    prevHashes_.clear();
+}
+
+optional<ScrollShift> ScrollDetector::detect_(int startY, int endY) {
+    int count = endY - startY;
+
+    // Find the previous lines whose hash is unique within the changed lines;
+    // each new line that matches one of them votes for a shift
+    vector<pair<uint64_t, int>> prevLines(count);
+    for(int i = 0; i < count; ++i) {
+        prevLines[i] = make_pair(prevHashes_[i], i);
+    }
+    sort(prevLines.begin(), prevLines.end());
+
+    map<int, int> votes;
+    for(int i = 0; i < count; ++i) {
+        uint64_t hash = hashes_[startY + i];
+        auto it = lower_bound(
+            prevLines.begin(),
+            prevLines.end(),
+            make_pair(hash, INT_MIN)
+        );
+        if(it == prevLines.end() || it->first != hash) {
+            continue;
+        }
+        auto next = it + 1;
+        if(next != prevLines.end() && next->first == hash) {
+            continue;
+        }
+        if(it->second != i) {
+            ++votes[it->second - i];
+        }
+    }
+
+    int dy = 0;
+    int bestVotes = 0;
+    for(const pair<const int, int>& item : votes) {
+        if(item.second > bestVotes) {
+            dy = item.first;
+            bestVotes = item.second;
+        }
+    }
+    if(bestVotes < MinVotes) {
+        return {};
+    }
+
+    // The shifted band is the longest run of lines that match with the shift
+    int bestStart = 0;
+    int bestLength = 0;
+    int runStart = 0;
+    for(int i = 0; i <= count; ++i) {
+        bool match =
+            i < count &&
+            i + dy >= 0 &&
+            i + dy < count &&
+            hashes_[startY + i] == prevHashes_[i + dy];
+        if(!match) {
+            if(i - runStart > bestLength) {
+                bestStart = runStart;
+                bestLength = i - runStart;
+            }
+            runStart = i + 1;
+        }
+    }
+    if(bestLength < MinShiftLines) {
+        return {};
+    }
+
+    return ScrollShift{
+        (int)hashWidth_,
+        startY + bestStart,
+        startY + bestStart + bestLength,
+        dy
+    };
+}
+
+}
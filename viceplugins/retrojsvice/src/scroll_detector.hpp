@@ -0,0 +1,58 @@
+#pragma once
+
+#include "rect.hpp"
+
+namespace retrojsvice {
+
+// Vertical shift of a band of lines between two frames: for all
+// startY <= y < endY and 0 <= x < endX, the pixel (x, y) of the new frame
+// equals the pixel (x, y + dy) of the previous frame.
+struct ScrollShift {
+    int endX;
+    int startY;
+    int endY;
+    int dy;
+};
+
+// Detects scrolling between consecutive frames by comparing hashes of their
+// lines. The columns near the right edge are left out of the hashes, as they
+// typically contain a scrollbar that changes when the content is scrolled;
+// the shift always covers all the other columns. The detector is not
+// thread-safe.
+class ScrollDetector {
+public:
+    ScrollDetector();
+    DISABLE_COPY_MOVE(ScrollDetector);
+
+    // Updates the detector to given frame, which may only differ from the
+    // frame given in the previous call within the lines covered by changed,
+    // unless the size of the frame changed. If detect is true and the
+    // changed lines of the new frame are mostly a shifted copy of the lines
+    // of the previous frame, returns the shift.
+    optional<ScrollShift> update(
+        const uint8_t* image,
+        size_t width,
+        size_t height,
+        size_t pitch,
+        Rect changed,
+        bool detect
+    );
+
+    // Forgets the previous frame, so that the next update hashes all the
+    // lines.
+    void reset();
+
+private:
+    optional<ScrollShift> detect_(int startY, int endY);
+
+    size_t width_;
+    size_t height_;
+    size_t hashWidth_;
+
+    // The hashes of the lines of the latest frame, and the previous hashes of
+    // the lines changed by the latest update.
+    vector<uint64_t> hashes_;
+    vector<uint64_t> prevHashes_;
+};
+
+}
@@ -1,9 +1,16 @@
 #include "secrets.hpp"
 
+#include <Poco/Crypto/DigestEngine.h>
+
+#include <sys/random.h>
+
 namespace retrojsvice {
 
 namespace {
 
+// Block size of SHA-256, used as the HMAC block size.
+const size_t HMACBlockSize = 64;
+
 bool passwordsEqual_(const void* a, const void* b, size_t size) {
     const unsigned char* x = (const unsigned char*)a;
     const unsigned char* y = (const unsigned char*)b;
@@ -70,4 +77,88 @@ vector<int> SecretGenerator::generateSnakeOilCipherKey() {
     return key;
 }
 
+string SecretGenerator::generateHMACKey() {
+    REQUIRE_API_THREAD();
+
+    // The key is read directly from the kernel CSPRNG instead of rng_, as the
+    // state of the Mersenne Twister can be recovered from its output (such as
+    // the CSRF tokens), which would allow forging session tokens
+    string key(32, '\0');
+    size_t pos = 0;
+    while(pos < key.size()) {
+        ssize_t count = getrandom(&key[pos], key.size() - pos, 0);
+        if(count > 0) {
+            pos += (size_t)count;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            PANIC("Reading random bytes for HMAC key failed: ", strerror(errno));
+        }
+    }
+    return key;
+}
+
+SessionTokenSigner::SessionTokenSigner(CKey,
+    string key,
+    steady_clock::duration lifetime
+)
+    : key_(move(key)),
+      lifetime_(lifetime),
+      hasher_(make_unique<Poco::Crypto::DigestEngine>("SHA256"))
+{
+    REQUIRE(!key_.empty() && key_.size() <= HMACBlockSize);
+    key_.resize(HMACBlockSize, '\0');
+}
+
+SessionTokenSigner::~SessionTokenSigner() {}
+
+string SessionTokenSigner::issue() {
+    REQUIRE_API_THREAD();
+
+    int64_t expiry = duration_cast<milliseconds>(
+        (steady_clock::now() + lifetime_).time_since_epoch()
+    ).count();
+    string data = toString(expiry);
+    return data + "-" + sign_(data);
+}
+
+bool SessionTokenSigner::verify(const string& token) {
+    REQUIRE_API_THREAD();
+
+    size_t sep = token.find('-');
+    if(sep == string::npos) {
+        return false;
+    }
+    string data = token.substr(0, sep);
+    optional<int64_t> expiry = parseString<int64_t>(data);
+    if(!expiry.has_value()) {
+        return false;
+    }
+
+    if(!passwordsEqual(token.substr(sep + 1), sign_(data))) {
+        return false;
+    }
+
+    int64_t now = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    return now < *expiry;
+}
+
+string SessionTokenSigner::sign_(const string& data) {
+    // HMAC(K, m) = H((K ^ opad) || H((K ^ ipad) || m))
+    string inner = key_;
+    string outer = key_;
+    for(size_t i = 0; i < HMACBlockSize; ++i) {
+        inner[i] ^= 0x36;
+        outer[i] ^= 0x5C;
+    }
+
+    hasher_->update(inner.data(), inner.size());
+    hasher_->update(data.data(), data.size());
+    Poco::Crypto::DigestEngine::Digest innerDigest = hasher_->digest();
+
+    hasher_->update(outer.data(), outer.size());
+    hasher_->update(innerDigest.data(), innerDigest.size());
+    return Poco::Crypto::DigestEngine::digestToHex(hasher_->digest());
+}
+
 }
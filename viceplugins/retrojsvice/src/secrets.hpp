@@ -2,6 +2,14 @@
 
 #include "common.hpp"
 
+namespace Poco {
+namespace Crypto {
+
+class DigestEngine;
+
+}
+}
+
 namespace retrojsvice {
 
 bool passwordsEqual(string a, string b);
@@ -17,8 +25,34 @@ public:
     // 2000..2500 integers in range 0..255
     vector<int> generateSnakeOilCipherKey();
 
+    // 32 random bytes from the kernel CSPRNG (getrandom(2))
+    string generateHMACKey();
+
 private:
     mt19937 rng_;
 };
 
+// Issues and verifies the values of the session cookies that let clients skip
+// the HTTP basic authentication after it has succeeded once. A value consists
+// of the expiry time and its HMAC-SHA256 signature with a random key, so it
+// is only valid in this process until it expires.
+class SessionTokenSigner {
+SHARED_ONLY_CLASS(SessionTokenSigner);
+public:
+    SessionTokenSigner(CKey, string key, steady_clock::duration lifetime);
+    ~SessionTokenSigner();
+
+    string issue();
+
+    // The signature is compared in constant time.
+    bool verify(const string& token);
+
+private:
+    string sign_(const string& data);
+
+    string key_;
+    steady_clock::duration lifetime_;
+    unique_ptr<Poco::Crypto::DigestEngine> hasher_;
+};
+
 }
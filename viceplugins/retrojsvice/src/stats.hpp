@@ -0,0 +1,114 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+// Statistics of a series of durations for the stats page: the total count and
+// sum of all the samples and the quantiles of the most recent SampleCount
+// samples.
+class DurationStats {
+public:
+    static constexpr size_t SampleCount = 256;
+
+    DurationStats()
+        : count_(0),
+          sumSeconds_(0.0)
+    {}
+
+    void add(steady_clock::duration duration) {
+        double seconds =
+            (double)duration_cast<microseconds>(duration).count()
+            / 1e6;
+        if(samples_.size() < SampleCount) {
+            samples_.push_back(seconds);
+        } else {
+            samples_[(size_t)(count_ % SampleCount)] = seconds;
+        }
+        ++count_;
+        sumSeconds_ += seconds;
+    }
+
+    uint64_t count() const {
+        return count_;
+    }
+    double sumSeconds() const {
+        return sumSeconds_;
+    }
+
+    // Returns the q-quantile (0 <= q <= 1) of the recent samples in seconds,
+    // or 0 if there are no samples.
+    double quantileSeconds(double q) const {
+        if(samples_.empty()) {
+            return 0.0;
+        }
+        vector<double> sorted = samples_;
+        size_t idx = min(
+            (size_t)(q * (double)(sorted.size() - 1) + 0.5), sorted.size() - 1
+        );
+        nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+        return sorted[idx];
+    }
+
+private:
+    uint64_t count_;
+    double sumSeconds_;
+    vector<double> samples_;
+};
+
+// Sum of the amounts added within the latest period of given length, used for
+// measuring rates against budgets (for example, bytes sent in the last
+// second).
+class RateMeter {
+public:
+    explicit RateMeter(steady_clock::duration period)
+        : period_(period),
+          sum_(0.0)
+    {}
+
+    void add(steady_clock::time_point time, double amount) {
+        samples_.emplace_back(time, amount);
+        sum_ += amount;
+    }
+
+    // The sum of the amounts added within the period before now.
+    double total(steady_clock::time_point now) {
+        prune_(now);
+        return samples_.empty() ? 0.0 : sum_;
+    }
+
+    // The earliest time at which the total drops below limit if nothing more
+    // is added (now if it already is below).
+    steady_clock::time_point belowLimitTime(
+        steady_clock::time_point now, double limit
+    ) {
+        prune_(now);
+        double sum = sum_;
+        steady_clock::time_point time = now;
+        for(const pair<steady_clock::time_point, double>& sample : samples_) {
+            if(sum < limit) {
+                break;
+            }
+            sum -= sample.second;
+            time = max(now, sample.first + period_);
+        }
+        return time;
+    }
+
+private:
+    void prune_(steady_clock::time_point now) {
+        while(!samples_.empty() && samples_.front().first + period_ <= now) {
+            sum_ -= samples_.front().second;
+            samples_.pop_front();
+        }
+        if(samples_.empty()) {
+            sum_ = 0.0;
+        }
+    }
+
+    steady_clock::duration period_;
+    double sum_;
+    deque<pair<steady_clock::time_point, double>> samples_;
+};
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+// Move-only type-erased callable for the tasks posted using postTask. Callables
+// of at most InlineSize bytes (such as lambdas capturing a few pointers) are
+// stored inline without allocating memory.
+class Task {
+public:
+    static constexpr size_t InlineSize = 64;
+
+    Task() : ops_(nullptr) {}
+
+    template <
+        typename F,
+        typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>
+    >
+    Task(F&& func) {
+        typedef std::decay_t<F> T;
+        if constexpr(
+            sizeof(T) <= InlineSize &&
+            alignof(T) <= alignof(std::max_align_t) &&
+            std::is_nothrow_move_constructible_v<T>
+        ) {
+            new(storage_) T(forward<F>(func));
+            ops_ = &InlineOps<T>;
+        } else {
+            *(T**)storage_ = new T(forward<F>(func));
+            ops_ = &HeapOps<T>;
+        }
+    }
+
+    Task(Task&& other) noexcept : ops_(other.ops_) {
+        if(ops_ != nullptr) {
+            ops_->move(other.storage_, storage_);
+            other.ops_ = nullptr;
+        }
+    }
+    Task& operator=(Task&& other) noexcept {
+        if(this != &other) {
+            reset();
+            ops_ = other.ops_;
+            if(ops_ != nullptr) {
+                ops_->move(other.storage_, storage_);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    ~Task() {
+        reset();
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    explicit operator bool() const {
+        return ops_ != nullptr;
+    }
+
+    void operator()() {
+        REQUIRE(ops_ != nullptr);
+        ops_->call(storage_);
+    }
+
+    void reset() {
+        if(ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*call)(void* storage);
+        // Move-constructs the callable to dst and destroys src.
+        void (*move)(void* src, void* dst);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename T>
+    static constexpr Ops InlineOps = {
+        [](void* storage) { (*(T*)storage)(); },
+        [](void* src, void* dst) {
+            new(dst) T(std::move(*(T*)src));
+            ((T*)src)->~T();
+        },
+        [](void* storage) { ((T*)storage)->~T(); }
+    };
+
+    template <typename T>
+    static constexpr Ops HeapOps = {
+        [](void* storage) { (**(T**)storage)(); },
+        [](void* src, void* dst) { *(T**)dst = *(T**)src; },
+        [](void* storage) { delete *(T**)storage; }
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[InlineSize];
+    const Ops* ops_;
+};
+
+}
@@ -1,5 +1,7 @@
 #include "task_queue.hpp"
 
+#include "probe.hpp"
+
 namespace retrojsvice {
 
 namespace {
@@ -12,8 +14,9 @@ TaskQueue::TaskQueue(CKey, weak_ptr<TaskQueueEventHandler> eventHandler) {
     REQUIRE_API_THREAD();
 
     eventHandler_ = eventHandler;
+    taskHead_.store(nullptr);
+    runTasksPending_.store(false);
     state_ = Running;
-    runTasksPending_ = false;
     runningTasks_ = false;
 
     // Initialization is completed in afterConstruct_
@@ -28,8 +31,9 @@ void TaskQueue::runTasks(MCE) {
 
     REQUIRE(!runningTasks_);
     runningTasks_ = true;
+    PROBE(run_tasks_start);
 
-    vector<function<void()>> tasksToRun;
+    TaskNode* taskList;
     steady_clock::time_point now = steady_clock::now();
     bool runDelayedTasks;
     bool shutdownPending;
@@ -37,41 +41,48 @@ void TaskQueue::runTasks(MCE) {
         lock_guard lock(mutex_);
         REQUIRE(state_ != ShutdownComplete);
 
-        runTasksPending_ = false;
+        // Clear the flag before taking the tasks, such that tasks posted after
+        // this will trigger a new onTaskQueueNeedsRunTasks call
+        runTasksPending_.store(false);
 
-        swap(tasks_, tasksToRun);
+        taskList = taskHead_.exchange(nullptr);
 
-        runDelayedTasks =
-            !delayedTasks_.empty() &&
-            delayedTasks_.begin()->first <= now;
+        delayedTasks_.advance(now);
+        runDelayedTasks = delayedTasks_.hasDue();
 
         shutdownPending = state_ == ShutdownPending;
     }
 
-    for(function<void()>& task : tasksToRun) {
-        task();
-        task = []() {};
+    // Reverse the list to run the tasks in the order they were posted
+    TaskNode* reversed = nullptr;
+    while(taskList != nullptr) {
+        TaskNode* next = taskList->next;
+        taskList->next = reversed;
+        reversed = taskList;
+        taskList = next;
+    }
+    uint64_t taskCount = 0;
+    while(reversed != nullptr) {
+        TaskNode* node = reversed;
+        reversed = node->next;
+        node->task();
+        delete node;
+        ++taskCount;
     }
 
     if(runDelayedTasks) {
         while(true) {
-            function<void()> task;
+            Task task;
             {
                 lock_guard lock(mutex_);
-                if(delayedTasks_.empty() || delayedTasks_.begin()->first > now) {
+                TimerWheel::Node* node = delayedTasks_.popDue();
+                if(node == nullptr) {
                     break;
                 }
-
-                weak_ptr<DelayedTaskTag> tagWeak;
-                tie(tagWeak, task) = delayedTasks_.begin()->second;
-                delayedTasks_.erase(delayedTasks_.begin());
-
-                shared_ptr<DelayedTaskTag> tag = tagWeak.lock();
-                REQUIRE(tag);
-                REQUIRE(tag->inQueue_);
-                tag->inQueue_ = false;
+                task = move(node->task);
             }
             task();
+            ++taskCount;
         }
     }
 
@@ -80,7 +91,11 @@ void TaskQueue::runTasks(MCE) {
         lock_guard lock(mutex_);
         REQUIRE(state_ == ShutdownPending);
 
-        if(tasks_.empty() && delayedTasks_.empty()) {
+        TaskNode* expected = nullptr;
+        if(
+            delayedTasks_.empty() &&
+            taskHead_.compare_exchange_strong(expected, closedMarker_())
+        ) {
             state_ = ShutdownComplete;
             shutdownComplete = true;
         }
@@ -98,6 +113,7 @@ void TaskQueue::runTasks(MCE) {
         }
     }
 
+    PROBE(run_tasks_end, taskCount);
     runningTasks_ = false;
 }
 
@@ -123,23 +139,33 @@ void TaskQueue::afterConstruct_(shared_ptr<TaskQueue> self) {
         while(true) {
             if(self->state_ == ShutdownComplete) {
                 break;
-            } else if(self->delayedTasks_.empty() || self->runTasksPending_) {
+            } else if(self->delayedTasks_.empty() || self->runTasksPending_.load()) {
                 self->delayThreadCv_.wait(lock);
             } else {
                 steady_clock::time_point now = steady_clock::now();
-                steady_clock::time_point wakeup = self->delayedTasks_.begin()->first;
-                if(wakeup <= now) {
-                    self->runTasksPending_ = true;
-                    self->needsRunTasks_();
+                self->delayedTasks_.advance(now);
+                optional<steady_clock::time_point> wakeup =
+                    self->delayedTasks_.nextAdvanceTime();
+                if(self->delayedTasks_.hasDue()) {
+                    if(!self->runTasksPending_.exchange(true)) {
+                        self->needsRunTasks_();
+                    }
                     self->delayThreadCv_.wait(lock);
+                } else if(wakeup) {
+                    self->delayThreadCv_.wait_for(lock, *wakeup - now);
                 } else {
-                    self->delayThreadCv_.wait_for(lock, wakeup - now);
+                    self->delayThreadCv_.wait(lock);
                 }
             }
         }
     });
 }
 
+TaskQueue::TaskNode* TaskQueue::closedMarker_() {
+    static TaskNode marker = {nullptr, Task()};
+    return &marker;
+}
+
 void TaskQueue::needsRunTasks_() {
     if(shared_ptr<TaskQueueEventHandler> eventHandler = eventHandler_.lock()) {
         eventHandler->onTaskQueueNeedsRunTasks();
@@ -162,17 +188,22 @@ ActiveTaskQueueLock::~ActiveTaskQueueLock() {
     activeTaskQueue.reset();
 }
 
-void postTask(function<void()> func) {
+void postTask(Task task) {
     REQUIRE(activeTaskQueue);
-
-    lock_guard lock(activeTaskQueue->mutex_);
-    REQUIRE(activeTaskQueue->state_ != TaskQueue::ShutdownComplete);
-
-    activeTaskQueue->tasks_.push_back(func);
-
-    if(!activeTaskQueue->runTasksPending_) {
-        activeTaskQueue->runTasksPending_ = true;
-        activeTaskQueue->needsRunTasks_();
+    TaskQueue& queue = *activeTaskQueue;
+
+    TaskQueue::TaskNode* node = new TaskQueue::TaskNode {nullptr, move(task)};
+    TaskQueue::TaskNode* head = queue.taskHead_.load(memory_order_relaxed);
+    do {
+        // Posting after shutdown has completed is not allowed
+        REQUIRE(head != TaskQueue::closedMarker_());
+        node->next = head;
+    } while(!queue.taskHead_.compare_exchange_weak(
+        head, node, std::memory_order_release, memory_order_relaxed
+    ));
+
+    if(!queue.runTasksPending_.exchange(true)) {
+        queue.needsRunTasks_();
     }
 }
 
@@ -181,9 +212,9 @@ DelayedTaskTag::DelayedTaskTag(CKey, CKey) {}
 DelayedTaskTag::~DelayedTaskTag() {
     {
         lock_guard lock(taskQueue_->mutex_);
-        if(inQueue_) {
+        if(node_.linked()) {
             REQUIRE(taskQueue_->state_ != TaskQueue::ShutdownComplete);
-            taskQueue_->delayedTasks_.erase(iter_);
+            taskQueue_->delayedTasks_.remove(&node_);
         }
     }
     taskQueue_->delayThreadCv_.notify_one();
@@ -192,45 +223,41 @@ DelayedTaskTag::~DelayedTaskTag() {
 void DelayedTaskTag::expedite() {
     REQUIRE_API_THREAD();
 
-    function<void()> func = []() {};
+    Task func;
 
     {
         lock_guard lock(taskQueue_->mutex_);
-        if(inQueue_) {
+        if(node_.linked()) {
             REQUIRE(taskQueue_->state_ != TaskQueue::ShutdownComplete);
-            func = iter_->second.second;
-            taskQueue_->delayedTasks_.erase(iter_);
-            inQueue_ = false;
+            func = move(node_.task);
+            taskQueue_->delayedTasks_.remove(&node_);
         }
     }
     taskQueue_->delayThreadCv_.notify_one();
 
-    func();
+    if(func) {
+        func();
+    }
 }
 
 shared_ptr<DelayedTaskTag> postDelayedTask(
     steady_clock::duration delay,
-    function<void()> func
+    Task func
 ) {
     REQUIRE(activeTaskQueue);
 
     steady_clock::time_point time = steady_clock::now() + delay;
 
-    shared_ptr<DelayedTaskTag> tag;
+    // The tag holds the wheel node, so no other allocation is needed
+    shared_ptr<DelayedTaskTag> tag =
+        DelayedTaskTag::create(DelayedTaskTag::CKey());
+    tag->taskQueue_ = activeTaskQueue;
+    tag->node_.task = move(func);
     {
         lock_guard lock(activeTaskQueue->mutex_);
         REQUIRE(activeTaskQueue->state_ != TaskQueue::ShutdownComplete);
 
-        tag = DelayedTaskTag::create(DelayedTaskTag::CKey());
-
-        auto iter = activeTaskQueue->delayedTasks_.emplace(
-            time,
-            pair<weak_ptr<DelayedTaskTag>, function<void()>>(tag, func)
-        );
-
-        tag->taskQueue_ = activeTaskQueue;
-        tag->inQueue_ = true;
-        tag->iter_ = iter;
+        activeTaskQueue->delayedTasks_.insert(&tag->node_, time);
     }
 
     activeTaskQueue->delayThreadCv_.notify_one();
@@ -1,6 +1,7 @@
 #pragma once
 
-#include "common.hpp"
+#include "task.hpp"
+#include "timer_wheel.hpp"
 
 namespace retrojsvice {
 
@@ -61,27 +62,48 @@ private:
 
     void needsRunTasks_();
 
+    struct TaskNode {
+        TaskNode* next;
+        Task task;
+    };
+
+    // Marker stored in taskHead_ once the shutdown has completed, making
+    // further postTask calls panic.
+    static TaskNode* closedMarker_();
+
     weak_ptr<TaskQueueEventHandler> eventHandler_;
 
+    // The tasks posted using postTask form a lock-free stack (the most recently
+    // posted task first); runTasks takes the whole stack at once and runs the
+    // tasks in reverse order.
+    atomic<TaskNode*> taskHead_;
+
+    // Set when the event handler has been asked to call runTasks and runTasks
+    // has not yet started; used to coalesce the onTaskQueueNeedsRunTasks
+    // calls. Only cleared while holding mutex_, so that the delay thread does
+    // not miss the notification when it is cleared.
+    atomic<bool> runTasksPending_;
+
     mutex mutex_;
     enum {Running, ShutdownPending, ShutdownComplete} state_;
-    bool runTasksPending_;
-    vector<function<void()>> tasks_;
-    multimap<
-        steady_clock::time_point,
-        pair<weak_ptr<DelayedTaskTag>, function<void()>>
-    > delayedTasks_;
+
+    // The tasks posted using postDelayedTask; the nodes are stored in the
+    // corresponding DelayedTaskTags. The delay thread advances the wheel and
+    // requests runTasks when there are due tasks, and runTasks runs the due
+    // tasks one at a time so that a task may still cancel the other tasks due
+    // at the same time.
+    TimerWheel delayedTasks_;
 
     thread delayThread_;
     condition_variable delayThreadCv_;
 
     bool runningTasks_;
 
-    friend void postTask(function<void()> func);
+    friend void postTask(Task task);
     friend class DelayedTaskTag;
     friend shared_ptr<DelayedTaskTag> postDelayedTask(
         steady_clock::duration delay,
-        function<void()> func
+        Task func
     );
 };
 
@@ -96,7 +118,7 @@ public:
     DISABLE_COPY_MOVE(ActiveTaskQueueLock);
 };
 
-void postTask(function<void()> func);
+void postTask(Task task);
 
 template <typename T, typename... Args>
 void postTask(shared_ptr<T> ptr, void (T::*func)(Args...), Args... args) {
@@ -117,7 +139,7 @@ void postTask(weak_ptr<T> weakPtr, void (T::*func)(Args...), Args... args) {
 // Object returned by postDelayedTask. If the object is destructed and the delay
 // for the task has not yet been reached, the task will be cancelled.
 class DelayedTaskTag {
-SHARED_ONLY_CLASS(DelayedTaskTag);
+SHARED_ONLY_POOLED_CLASS(DelayedTaskTag);
 public:
     // Private constructor
     DelayedTaskTag(CKey, CKey);
@@ -130,22 +152,21 @@ public:
 
 private:
     shared_ptr<TaskQueue> taskQueue_;
-    bool inQueue_;
-    multimap<
-        steady_clock::time_point,
-        pair<weak_ptr<DelayedTaskTag>, function<void()>>
-    >::iterator iter_;
+
+    // The node of the task in taskQueue_->delayedTasks_; linked while the
+    // task is pending.
+    TimerWheel::Node node_;
 
     friend class TaskQueue;
     friend shared_ptr<DelayedTaskTag> postDelayedTask(
         steady_clock::duration delay,
-        function<void()> func
+        Task func
     );
 };
 
 shared_ptr<DelayedTaskTag> postDelayedTask(
     steady_clock::duration delay,
-    function<void()> func
+    Task func
 );
 
 template <typename T, typename... Args>
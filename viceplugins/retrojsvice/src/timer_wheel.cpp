@@ -0,0 +1,234 @@
+#include "timer_wheel.hpp"
+
+namespace retrojsvice {
+
+TimerWheel::TimerWheel() {
+    epoch_ = steady_clock::now();
+    currentTick_ = 0;
+    for(int level = 0; level < Levels; ++level) {
+        occupied_[level] = 0;
+    }
+    wheelCount_ = 0;
+    count_ = 0;
+}
+
+void TimerWheel::insert(Node* node, steady_clock::time_point time) {
+    REQUIRE(!node->linked());
+
+    if(wheelCount_ == 0) {
+        // Nothing to cascade; skip the idle ticks so that advance does not
+        // have to step through them
+        currentTick_ = max(currentTick_, floorTick_(steady_clock::now()));
+    }
+
+    node->tick = max(ceilTick_(time), currentTick_);
+    place_(node);
+    ++wheelCount_;
+    ++count_;
+}
+
+void TimerWheel::remove(Node* node) {
+    REQUIRE(node->linked());
+
+    if(node->list != &due_) {
+        --wheelCount_;
+    }
+    --count_;
+    unlink_(node);
+}
+
+void TimerWheel::advance(steady_clock::time_point now) {
+    uint64_t nowTick = floorTick_(now);
+
+    while(currentTick_ <= nowTick) {
+        if(wheelCount_ == 0) {
+            currentTick_ = nowTick + 1;
+            break;
+        }
+
+        // Expire the level 0 slots up to nowTick in the current slot range
+        uint64_t rangeStart = currentTick_ & ~SlotMask;
+        uint64_t last = min(nowTick, rangeStart + SlotMask);
+        uint64_t mask =
+            (~(uint64_t)0 << (currentTick_ & SlotMask)) &
+            (~(uint64_t)0 >> (SlotMask - (last & SlotMask)));
+        uint64_t expired = occupied_[0] & mask;
+        occupied_[0] &= ~expired;
+        while(expired != 0) {
+            List& slot = slots_[0][__builtin_ctzll(expired)];
+            expired &= expired - 1;
+
+            for(Node* node = slot.first; node != nullptr; node = node->next) {
+                node->list = &due_;
+                --wheelCount_;
+            }
+            if(due_.last == nullptr) {
+                due_.first = slot.first;
+            } else {
+                due_.last->next = slot.first;
+                slot.first->prev = due_.last;
+            }
+            due_.last = slot.last;
+            slot.first = nullptr;
+            slot.last = nullptr;
+        }
+
+        currentTick_ = last + 1;
+        if((currentTick_ & SlotMask) == 0) {
+            cascade_();
+        }
+    }
+}
+
+TimerWheel::Node* TimerWheel::popDue() {
+    Node* node = due_.first;
+    if(node != nullptr) {
+        --count_;
+        unlink_(node);
+    }
+    return node;
+}
+
+optional<steady_clock::time_point> TimerWheel::nextAdvanceTime() const {
+    if(wheelCount_ == 0) {
+        return {};
+    }
+
+    uint64_t pending =
+        occupied_[0] & (~(uint64_t)0 << (currentTick_ & SlotMask));
+    if(pending != 0) {
+        uint64_t tick =
+            (currentTick_ & ~SlotMask) + (uint64_t)__builtin_ctzll(pending);
+        return tickTime_(tick);
+    }
+
+    // The nodes in the higher levels are always in slots after the current
+    // one, and the earliest of them can only expire after its slot has been
+    // cascaded
+    uint64_t best = (uint64_t)-1;
+    for(int level = 1; level < Levels; ++level) {
+        int shift = level * SlotBits;
+        uint64_t pos = (currentTick_ >> shift) & SlotMask;
+        if(pos == SlotMask) {
+            continue;
+        }
+        pending = occupied_[level] & (~(uint64_t)0 << (pos + 1));
+        if(pending != 0) {
+            uint64_t tick =
+                ((currentTick_ >> (shift + SlotBits)) << (shift + SlotBits)) +
+                ((uint64_t)__builtin_ctzll(pending) << shift);
+            best = min(best, tick);
+        }
+    }
+    if(overflow_.first != nullptr) {
+        int shift = Levels * SlotBits;
+        best = min(best, ((currentTick_ >> shift) + 1) << shift);
+    }
+    REQUIRE(best != (uint64_t)-1);
+    return tickTime_(best);
+}
+
+uint64_t TimerWheel::floorTick_(steady_clock::time_point time) const {
+    if(time <= epoch_) {
+        return 0;
+    }
+    return (uint64_t)((time - epoch_) / TickLength);
+}
+
+uint64_t TimerWheel::ceilTick_(steady_clock::time_point time) const {
+    uint64_t tick = floorTick_(time);
+    if(tickTime_(tick) < time) {
+        ++tick;
+    }
+    return tick;
+}
+
+steady_clock::time_point TimerWheel::tickTime_(uint64_t tick) const {
+    return epoch_ + (steady_clock::rep)tick * TickLength;
+}
+
+void TimerWheel::place_(Node* node) {
+    REQUIRE(node->tick >= currentTick_);
+
+    // The level is determined by the highest slot group in which the expiry
+    // tick differs from the current tick
+    uint64_t diff = node->tick ^ currentTick_;
+    int level = 0;
+    while(level < Levels && (diff >> ((level + 1) * SlotBits)) != 0) {
+        ++level;
+    }
+
+    if(level == Levels) {
+        pushBack_(overflow_, node);
+    } else {
+        uint64_t slot = (node->tick >> (level * SlotBits)) & SlotMask;
+        pushBack_(slots_[level][slot], node);
+        occupied_[level] |= (uint64_t)1 << slot;
+    }
+}
+
+void TimerWheel::cascade_() {
+    // Cascade from the highest level to make sure that the nodes moved from
+    // the higher levels are not moved again
+    auto reinsert = [&](List& list) {
+        Node* node = list.first;
+        list.first = nullptr;
+        list.last = nullptr;
+        while(node != nullptr) {
+            Node* next = node->next;
+            node->prev = nullptr;
+            node->next = nullptr;
+            node->list = nullptr;
+            place_(node);
+            node = next;
+        }
+    };
+
+    if((currentTick_ & (((uint64_t)1 << (Levels * SlotBits)) - 1)) == 0) {
+        reinsert(overflow_);
+    }
+    for(int level = Levels - 1; level >= 1; --level) {
+        int shift = level * SlotBits;
+        if((currentTick_ & (((uint64_t)1 << shift) - 1)) == 0) {
+            uint64_t slot = (currentTick_ >> shift) & SlotMask;
+            occupied_[level] &= ~((uint64_t)1 << slot);
+            reinsert(slots_[level][slot]);
+        }
+    }
+}
+
+void TimerWheel::pushBack_(List& list, Node* node) {
+    node->list = &list;
+    node->prev = list.last;
+    node->next = nullptr;
+    if(list.last == nullptr) {
+        list.first = node;
+    } else {
+        list.last->next = node;
+    }
+    list.last = node;
+}
+
+void TimerWheel::unlink_(Node* node) {
+    List& list = *node->list;
+    if(node->prev == nullptr) {
+        list.first = node->next;
+    } else {
+        node->prev->next = node->next;
+    }
+    if(node->next == nullptr) {
+        list.last = node->prev;
+    } else {
+        node->next->prev = node->prev;
+    }
+    node->prev = nullptr;
+    node->next = nullptr;
+    node->list = nullptr;
+
+    if(list.first == nullptr && &list != &due_ && &list != &overflow_) {
+        size_t idx = (size_t)(&list - &slots_[0][0]);
+        occupied_[idx / Slots] &= ~((uint64_t)1 << (idx % Slots));
+    }
+}
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "task.hpp"
+
+namespace retrojsvice {
+
+// Hierarchical timer wheel holding the tasks posted using postDelayedTask. Time
+// is divided into ticks of TickLength; the wheel has Levels levels of Slots
+// slots each, the slots of level k spanning Slots^k ticks. A timer is placed to
+// the lowest level in which its expiry tick and the current tick of the wheel
+// fall into the same slot range of the next level; when the current tick
+// crosses the boundary of such a range, the timers in the corresponding slot
+// are moved (cascaded) to lower levels. Timers beyond the range of the highest
+// level are kept in a separate overflow list.
+//
+// The timers are intrusive Nodes owned by the caller, and both insertion and
+// removal take constant time without allocating memory. Expired timers are
+// moved in batches to a due list by advance, from which they are taken in
+// expiry order using popDue. The wheel is not thread-safe.
+class TimerWheel {
+public:
+    static constexpr steady_clock::duration TickLength = milliseconds(1);
+
+    struct List;
+
+    struct Node {
+        Node* prev = nullptr;
+        Node* next = nullptr;
+        List* list = nullptr;
+        uint64_t tick = 0;
+        Task task;
+
+        // True if the node is in the wheel (including the due list).
+        bool linked() const {
+            return list != nullptr;
+        }
+    };
+
+    struct List {
+        Node* first = nullptr;
+        Node* last = nullptr;
+    };
+
+    TimerWheel();
+    DISABLE_COPY_MOVE(TimerWheel);
+
+    // Inserts unlinked node to expire at given time (rounded up to the next
+    // tick, so the node never expires early).
+    void insert(Node* node, steady_clock::time_point time);
+
+    // Removes linked node from the wheel or the due list.
+    void remove(Node* node);
+
+    // Moves all the nodes expired by given time to the due list.
+    void advance(steady_clock::time_point now);
+
+    bool hasDue() const {
+        return due_.first != nullptr;
+    }
+
+    // Removes and returns the first node in the due list; returns nullptr if
+    // the list is empty.
+    Node* popDue();
+
+    // True if there are no nodes in the wheel or the due list.
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    // Returns the earliest time at which advance may have to be called for
+    // the nodes not yet in the due list to make progress (either the expiry
+    // time of a node or a cascading time), or empty if there are no such
+    // nodes.
+    optional<steady_clock::time_point> nextAdvanceTime() const;
+
+private:
+    static constexpr int Levels = 4;
+    static constexpr int SlotBits = 6;
+    static constexpr int Slots = 1 << SlotBits;
+    static constexpr uint64_t SlotMask = Slots - 1;
+
+    uint64_t floorTick_(steady_clock::time_point time) const;
+    uint64_t ceilTick_(steady_clock::time_point time) const;
+    steady_clock::time_point tickTime_(uint64_t tick) const;
+
+    // Links node to the level and slot determined by node->tick relative to
+    // currentTick_.
+    void place_(Node* node);
+
+    // Called when currentTick_ has reached the start of a new level 0 slot
+    // range to cascade the slots whose range started at currentTick_.
+    void cascade_();
+
+    void pushBack_(List& list, Node* node);
+    void unlink_(Node* node);
+
+    steady_clock::time_point epoch_;
+
+    // All ticks before currentTick_ have been processed.
+    uint64_t currentTick_;
+
+    List slots_[Levels][Slots];
+    uint64_t occupied_[Levels];
+    List overflow_;
+    List due_;
+
+    // Number of nodes in the wheel (count_ also includes the due list).
+    size_t wheelCount_;
+    size_t count_;
+};
+
+}
@@ -0,0 +1,51 @@
+#include "trace.hpp"
+
+namespace retrojsvice {
+
+namespace {
+
+mutex traceCallbackMutex;
+function<void(uint64_t, uint64_t, const char*, const char*)> traceCallback;
+atomic<bool> tracing(false);
+atomic<uint64_t> nextTraceId(1);
+
+}
+
+void setTraceCallback(
+    function<void(uint64_t, uint64_t, const char*, const char*)> callback
+) {
+    lock_guard<mutex> lock(traceCallbackMutex);
+    tracing = (bool)callback;
+    traceCallback = callback;
+}
+
+bool isTracing() {
+    return tracing;
+}
+
+uint64_t newTraceId() {
+    return nextTraceId++;
+}
+
+void traceStage(
+    uint64_t window,
+    uint64_t traceId,
+    const char* stage,
+    const string& details
+) {
+    if(!tracing) {
+        return;
+    }
+    lock_guard<mutex> lock(traceCallbackMutex);
+    if(traceCallback) {
+        traceCallback(window, traceId, stage, details.c_str());
+    }
+}
+
+void traceStage(const TraceList& traces, const char* stage, const string& details) {
+    for(const pair<uint64_t, uint64_t>& trace : traces) {
+        traceStage(trace.first, trace.second, stage, details);
+    }
+}
+
+}
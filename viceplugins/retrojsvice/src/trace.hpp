@@ -0,0 +1,32 @@
+#pragma once
+
+#include "common.hpp"
+
+namespace retrojsvice {
+
+// Input latency tracing through the Trace API extension. When the program has
+// enabled tracing, each batch of input events relayed to the program gets a
+// trace ID, and the stages of the trace ("input", "fetch", "compressed",
+// "sent") are reported to the program through the trace callback. All the
+// functions are thread-safe.
+
+// (window, traceId) pairs.
+typedef vector<pair<uint64_t, uint64_t>> TraceList;
+
+// Set the callback to an empty function to disable tracing.
+void setTraceCallback(
+    function<void(uint64_t, uint64_t, const char*, const char*)> callback
+);
+
+bool isTracing();
+uint64_t newTraceId();
+
+void traceStage(
+    uint64_t window,
+    uint64_t traceId,
+    const char* stage,
+    const string& details = ""
+);
+void traceStage(const TraceList& traces, const char* stage, const string& details = "");
+
+}
@@ -2,6 +2,7 @@
 
 #include <Poco/Crypto/DigestEngine.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 
 namespace retrojsvice {
@@ -90,82 +91,173 @@ UploadStorage::~UploadStorage() {
     REQUIRE(files_.empty());
 }
 
-shared_ptr<FileUpload> UploadStorage::upload(
-    string name,
-    istream& dataStream
+shared_ptr<UploadWriter> UploadStorage::startUpload(string name) {
+    return UploadWriter::create(shared_from_this(), move(name));
+}
+
+namespace {
+
+// The data is written in blocks of this size, keeping the file offsets of the
+// writes aligned to the file system blocks.
+const size_t UploadWriteBlockSize = 1 << 20;
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while(size) {
+        ssize_t count = ::write(fd, data, size);
+        if(count > 0) {
+            data += count;
+            size -= (size_t)count;
+        } else if(count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+UploadWriter::UploadWriter(CKey,
+    shared_ptr<UploadStorage> storage,
+    string name
 ) {
-    uint64_t idx = nextIdx_.fetch_add(1, memory_order_relaxed);
-
-    string path = tempDir_->path() + "/" + toString(idx);
-
-    ofstream fp;
-    fp.open(path);
-    REQUIRE(fp.good());
-
-    Poco::Crypto::DigestEngine hasher("SHA256");
-
-    bool ok = true;
-    try {
-        const size_t BufSize = 1 << 16;
-        char buf[BufSize];
-        while(!dataStream.eof()) {
-            dataStream.read(buf, BufSize);
-            if(
-                dataStream.bad() ||
-                (dataStream.fail() != dataStream.eof())
-            ) {
-                WARNING_LOG("Reading file upload stream failed");
-                ok = false;
-                break;
-            }
+    storage_ = storage;
+    name_ = move(name);
+
+    uint64_t idx = storage_->nextIdx_.fetch_add(1, memory_order_relaxed);
+    const string& dirPath = storage_->tempDir_->path();
+    path_ = dirPath + "/" + toString(idx);
+
+    linked_ = false;
+    failed_ = false;
+    finished_ = false;
+    size_ = 0;
+
+    fd_ = open(dirPath.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+    if(fd_ == -1) {
+        // O_TMPFILE is not supported by all file systems
+        fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if(fd_ == -1) {
+            WARNING_LOG("Creating temporary file ", path_, " failed: ", strerror(errno));
+            failed_ = true;
+        } else {
+            linked_ = true;
+        }
+    }
+
+    buf_.resize(UploadWriteBlockSize);
+    bufPos_ = 0;
+    hasher_ = make_unique<Poco::Crypto::DigestEngine>("SHA256");
+}
+
+UploadWriter::~UploadWriter() {
+    if(!finished_) {
+        discard_();
+    }
+}
+
+bool UploadWriter::write(const char* data, size_t size) {
+    REQUIRE(!finished_);
 
-            size_t readCount = dataStream.gcount();
-            REQUIRE(readCount >= 0 && readCount <= BufSize);
+    if(failed_) {
+        return false;
+    }
 
-            hasher.update(buf, readCount);
+    hasher_->update(data, size);
+    size_ += size;
 
-            fp.write(buf, readCount);
-            REQUIRE(fp.good());
+    while(size) {
+        size_t count = min(size, buf_.size() - bufPos_);
+        memcpy(buf_.data() + bufPos_, data, count);
+        bufPos_ += count;
+        data += count;
+        size -= count;
+
+        if(bufPos_ == buf_.size() && !flush_()) {
+            return false;
         }
-    } catch(...) {
-        WARNING_LOG("Reading file upload stream failed with exception");
-        ok = false;
     }
+    return true;
+}
 
-    fp.close();
-    REQUIRE(fp.good());
+uint64_t UploadWriter::size() {
+    return size_;
+}
+
+shared_ptr<FileUpload> UploadWriter::finish() {
+    REQUIRE(!finished_);
+    finished_ = true;
 
-    if(!ok) {
-        unlinkFile(path);
+    if(failed_ || !flush_()) {
+        discard_();
         shared_ptr<FileUpload> empty;
         return empty;
     }
 
-    string hash = hasher.digestToHex(hasher.digest());
+    string hash = hasher_->digestToHex(hasher_->digest());
 
     shared_ptr<FileUpload> ret;
     {
-        lock_guard<mutex> lock(mutex_);
-        auto it = files_.find(hash);
+        lock_guard<mutex> lock(storage_->mutex_);
+        auto it = storage_->files_.find(hash);
         shared_ptr<FileUpload::Impl> impl;
-        if(it == files_.end()) {
-            impl = FileUpload::Impl::create(
-                shared_from_this(),
-                move(name),
-                move(path),
-                hash
-            );
-            REQUIRE(files_.emplace(hash, impl).second);
+        if(it == storage_->files_.end()) {
+            if(!linked_) {
+                string fdPath = "/proc/self/fd/" + toString(fd_);
+                if(linkat(
+                    AT_FDCWD, fdPath.c_str(), AT_FDCWD, path_.c_str(), AT_SYMLINK_FOLLOW
+                )) {
+                    WARNING_LOG(
+                        "Linking temporary file to ", path_, " failed: ", strerror(errno)
+                    );
+                    discard_();
+                    shared_ptr<FileUpload> empty;
+                    return empty;
+                }
+                linked_ = true;
+            }
+            close(fd_);
+            fd_ = -1;
+
+            impl = FileUpload::Impl::create(storage_, move(name_), path_, hash);
+            REQUIRE(storage_->files_.emplace(hash, impl).second);
         } else {
             impl = it->second.lock();
             REQUIRE(impl);
-            unlinkFile(path);
+            discard_();
         }
         ret = FileUpload::create(impl);
     }
     return ret;
 }
 
+bool UploadWriter::flush_() {
+    if(failed_) {
+        return false;
+    }
+    if(bufPos_ != 0) {
+        if(!writeAll(fd_, buf_.data(), bufPos_)) {
+            WARNING_LOG("Writing file upload to ", path_, " failed: ", strerror(errno));
+            failed_ = true;
+            return false;
+        }
+        bufPos_ = 0;
+    }
+    return true;
+}
+
+void UploadWriter::discard_() {
+    if(fd_ != -1) {
+        close(fd_);
+        fd_ = -1;
+    }
+    if(linked_) {
+        unlinkFile(path_);
+        linked_ = false;
+    }
+}
+
 string extractUploadFilename(string src) {
     string ret;
     for(char c : src) {
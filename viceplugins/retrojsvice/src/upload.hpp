@@ -2,8 +2,16 @@
 
 #include "common.hpp"
 
+namespace Poco {
+namespace Crypto {
+    class DigestEngine;
+}
+}
+
 namespace retrojsvice {
 
+class UploadStorage;
+
 class TempDir {
 SHARED_ONLY_CLASS(TempDir);
 public:
@@ -34,6 +42,51 @@ private:
     shared_ptr<Impl> impl_;
 
     friend class UploadStorage;
+    friend class UploadWriter;
+};
+
+// Writer for a file upload whose data is received in pieces, created using
+// UploadStorage::startUpload. The data is buffered and written to the file in
+// large blocks, and where supported, the file is created as an unnamed
+// temporary file (O_TMPFILE) that is only linked to the storage directory
+// once the upload is finished, so that partial uploads never appear in the
+// directory. If the writer is destroyed before finish is called, the upload
+// is discarded. Not thread-safe.
+class UploadWriter {
+SHARED_ONLY_CLASS(UploadWriter);
+public:
+    UploadWriter(CKey, shared_ptr<UploadStorage> storage, string name);
+    ~UploadWriter();
+
+    // Returns false if writing failed; after that, the upload can only be
+    // discarded.
+    bool write(const char* data, size_t size);
+
+    // Number of bytes written so far.
+    uint64_t size();
+
+    // Completes the upload, returning the file upload object (deduplicated
+    // with the other uploads of the storage) or an empty pointer if writing
+    // the file failed. No other member functions may be called afterwards.
+    shared_ptr<FileUpload> finish();
+
+private:
+    bool flush_();
+    void discard_();
+
+    shared_ptr<UploadStorage> storage_;
+    string name_;
+    string path_;
+
+    int fd_;
+    bool linked_;
+    bool failed_;
+    bool finished_;
+    uint64_t size_;
+
+    vector<char> buf_;
+    size_t bufPos_;
+    unique_ptr<Poco::Crypto::DigestEngine> hasher_;
 };
 
 // Shared storage for file uploads that deduplicates files that have the same
@@ -45,10 +98,8 @@ public:
 
     ~UploadStorage();
 
-    // Returns the file upload object if the reading the file from dataStream
-    // succeeds (badbit is not raised and no exceptions are thrown). Otherwise,
-    // returns an empty pointer.
-    shared_ptr<FileUpload> upload(string name, istream& dataStream);
+    // Starts a new upload of file with given name; see UploadWriter.
+    shared_ptr<UploadWriter> startUpload(string name);
 
 private:
     shared_ptr<TempDir> tempDir_;
@@ -57,6 +108,7 @@ private:
     map<string, weak_ptr<FileUpload::Impl>> files_;
 
     friend class FileUpload;
+    friend class UploadWriter;
 };
 
 string extractUploadFilename(string src);
@@ -364,7 +364,15 @@ API_FUNC_START
     REQUIRE(apiVersion == (uint64_t)1000001);
 
     string nameStr = name;
-    if(nameStr == "URINavigation") {
+    if(
+        nameStr == "URINavigation" ||
+        nameStr == "DirtyRect" ||
+        nameStr == "SharedFrame" ||
+        nameStr == "InputBatch" ||
+        nameStr == "WindowVisibility" ||
+        nameStr == "Trace" ||
+        nameStr == "MediaState"
+    ) {
         return 1;
     } else {
         return 0;
@@ -379,4 +387,52 @@ API_EXPORT void vicePluginAPI_URINavigation_enable(
 )
 WRAP_CTX_EXT_API(URINavigation_enable, callbacks);
 
+API_EXPORT void vicePluginAPI_DirtyRect_notifyWindowViewChanged(
+    VicePluginAPI_Context* ctx,
+    uint64_t window,
+    size_t x,
+    size_t y,
+    size_t width,
+    size_t height
+)
+WRAP_CTX_EXT_API(DirtyRect_notifyWindowViewChanged, window, x, y, width, height);
+
+API_EXPORT void vicePluginAPI_SharedFrame_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_SharedFrame_Callbacks callbacks
+)
+WRAP_CTX_EXT_API(SharedFrame_enable, callbacks);
+
+API_EXPORT void vicePluginAPI_InputBatch_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_InputBatch_Callbacks callbacks
+)
+WRAP_CTX_EXT_API(InputBatch_enable, callbacks);
+
+API_EXPORT void vicePluginAPI_WindowVisibility_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_WindowVisibility_Callbacks callbacks
+)
+WRAP_CTX_EXT_API(WindowVisibility_enable, callbacks);
+
+API_EXPORT void vicePluginAPI_Trace_enable(
+    VicePluginAPI_Context* ctx,
+    VicePluginAPI_Trace_Callbacks callbacks
+)
+WRAP_CTX_EXT_API(Trace_enable, callbacks);
+
+API_EXPORT void vicePluginAPI_Trace_windowViewTraced(
+    VicePluginAPI_Context* ctx,
+    uint64_t window,
+    uint64_t traceId
+)
+WRAP_CTX_EXT_API(Trace_windowViewTraced, window, traceId);
+
+API_EXPORT void vicePluginAPI_MediaState_setWindowMediaPlaying(
+    VicePluginAPI_Context* ctx,
+    uint64_t window,
+    int playing
+)
+WRAP_CTX_EXT_API(MediaState_setWindowMediaPlaying, window, playing);
+
 }
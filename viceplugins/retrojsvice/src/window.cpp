@@ -5,25 +5,43 @@
 #include "html.hpp"
 #include "http.hpp"
 #include "key.hpp"
+#include "path_parser.hpp"
+#include "png.hpp"
 #include "secrets.hpp"
+#include "trace.hpp"
 #include "upload.hpp"
 
 namespace retrojsvice {
 
 namespace {
 
-regex imagePathRegex(
-    "/image/([0-9]+)/([0-9]+)/([01])/([0-9]+)/([0-9]+)/([0-9]+)/(([A-Z0-9_-]+/)*)"
-);
-regex iframePathRegex(
-    "/iframe/([0-9]+)/[0-9]+/"
-);
-regex downloadPathRegex(
-    "/download/([0-9]+)/.*"
-);
-regex closePathRegex(
-    "/close/([0-9]+)/"
-);
+void sendBlankPNG(shared_ptr<HTTPRequest> request, size_t width, size_t height) {
+    shared_ptr<vector<uint8_t>> png =
+        make_shared<vector<uint8_t>>(createBlankPNG(width, height));
+    request->sendResponse(
+        200,
+        "image/png",
+        png->size(),
+        [png](ostream& out) {
+            out.write((const char*)png->data(), png->size());
+        }
+    );
+}
+
+// Control message of given type with given URL as a JSON object; the URLs are
+// generated by us, so only the characters special in JSON strings need to be
+// escaped.
+string controlMessageJSON(const string& type, const string& url) {
+    string ret = "{\"type\":\"" + type + "\",\"url\":\"";
+    for(char c : url) {
+        if(c == '"' || c == '\\') {
+            ret.push_back('\\');
+        }
+        ret.push_back(c);
+    }
+    ret += "\"}";
+    return ret;
+}
 
 }
 
@@ -31,13 +49,18 @@ Window::Window(CKey,
     shared_ptr<WindowEventHandler> eventHandler,
     uint64_t handle,
     shared_ptr<SecretGenerator> secretGen,
+    shared_ptr<CompressorPool> compressorPool,
+    ImageCompressorOptions compressorOptions,
     string programName,
     bool allowPNG,
+    bool allowImageStream,
     int initialQuality
 ) {
     REQUIRE_API_THREAD();
     REQUIRE(handle);
-    REQUIRE(initialQuality >= 10 && initialQuality <= 101);
+    REQUIRE(
+        initialQuality >= 10 && initialQuality <= ImageCompressor::AutoQuality
+    );
 
     if(!allowPNG && initialQuality == 101) {
         initialQuality = 100;
@@ -45,8 +68,11 @@ Window::Window(CKey,
 
     programName_ = move(programName);
     allowPNG_ = allowPNG;
+    allowImageStream_ = allowImageStream;
     initialQuality_ = initialQuality;
     secretGen_ = secretGen;
+    compressorPool_ = compressorPool;
+    compressorOptions_ = compressorOptions;
     snakeOilKeyCipherKey_ = secretGen_->generateSnakeOilCipherKey();
 
     eventHandler_ = eventHandler;
@@ -70,7 +96,10 @@ Window::Window(CKey,
 
     lastNavigateOperationTime_ = steady_clock::now();
 
+    hidden_ = false;
+
     inFileUploadMode_ = false;
+    uploadModeGUI_ = UploadModeGUI::create();
 
     // Initialization is completed in afterConstruct_
 }
@@ -89,6 +118,23 @@ void Window::close() {
     // event handlers
     imageCompressor_->stopFetching();
     imageCompressor_->flush(mce);
+    imageCompressor_->closeStream();
+
+    if(pendingTilePosRequest_.has_value()) {
+        pendingTilePosRequest_->second->sendTextResponse(
+            400, "ERROR: Window has been closed\n"
+        );
+        pendingTilePosRequest_.reset();
+    }
+    sentTiles_.clear();
+
+    if(pendingEventsRequest_) {
+        pendingEventsRequest_->sendTextResponse(
+            400, "ERROR: Window has been closed\n"
+        );
+        pendingEventsRequest_.reset();
+    }
+    eventsWaitTag_.reset();
 
     REQUIRE(eventHandler_);
     eventHandler_.reset();
@@ -97,6 +143,11 @@ void Window::close() {
         iframeQueue_.pop();
     }
     downloads_.clear();
+
+    if(uploadProgress_) {
+        uploadProgress_->cancel();
+        uploadProgress_.reset();
+    }
 }
 
 void Window::handleInitialForwardHTTPRequest(shared_ptr<HTTPRequest> request) {
@@ -131,54 +182,214 @@ void Window::handleHTTPRequest(MCE, shared_ptr<HTTPRequest> request) {
     }
 
     string method = request->method();
-    smatch match;
 
     if(method == "GET" && path == "/") {
         handleMainPageRequest_(mce, request);
         return;
     }
 
-    if(method == "GET" && regex_match(path, match, imagePathRegex)) {
-        REQUIRE(match.size() >= 8);
-        optional<uint64_t> mainIdx = parseString<uint64_t>(match[1]);
-        optional<uint64_t> imgIdx = parseString<uint64_t>(match[2]);
-        optional<int> immediate = parseString<int>(match[3]);
-        optional<int> width = parseString<int>(match[4]);
-        optional<int> height = parseString<int>(match[5]);
-        optional<uint64_t> startEventIdx = parseString<uint64_t>(match[6]);
-        string eventStr = match[7];
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, imgIdx, startEventIdx;
+        int immediate, width, height;
+        string::const_iterator eventsBegin, eventsEnd;
+        if(
+            parser.literal("/image/") &&
+            parser.number(mainIdx) &&
+            parser.number(imgIdx) &&
+            parser.number(immediate) && immediate <= 2 &&
+            parser.number(width) &&
+            parser.number(height) &&
+            parser.number(startEventIdx) &&
+            parser.eventList(eventsBegin, eventsEnd)
+        ) {
+            handleImageRequest_(
+                mce,
+                request,
+                mainIdx,
+                imgIdx,
+                immediate,
+                width,
+                height,
+                startEventIdx,
+                eventsBegin,
+                eventsEnd
+            );
+            return;
+        }
+    }
 
-        if(mainIdx && imgIdx && immediate && width && height && startEventIdx) {
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, imgIdx, baseImgIdx, startEventIdx;
+        int immediate, width, height;
+        string::const_iterator eventsBegin, eventsEnd;
+        if(
+            parser.literal("/tile/") &&
+            parser.number(mainIdx) &&
+            parser.number(imgIdx) &&
+            parser.number(immediate) && immediate <= 1 &&
+            parser.number(width) &&
+            parser.number(height) &&
+            parser.number(baseImgIdx) &&
+            parser.number(startEventIdx) &&
+            parser.eventList(eventsBegin, eventsEnd)
+        ) {
             handleImageRequest_(
                 mce,
                 request,
-                *mainIdx,
-                *imgIdx,
-                *immediate,
-                *width,
-                *height,
-                *startEventIdx,
-                move(eventStr)
+                mainIdx,
+                imgIdx,
+                immediate,
+                width,
+                height,
+                startEventIdx,
+                eventsBegin,
+                eventsEnd,
+                baseImgIdx
             );
             return;
         }
     }
 
-    if(method == "GET" && regex_match(path, match, iframePathRegex)) {
-        REQUIRE(match.size() == 2);
-        optional<uint64_t> mainIdx = parseString<uint64_t>(match[1]);
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, nonce;
+        if(
+            parser.literal("/stream/") &&
+            parser.number(mainIdx) &&
+            parser.number(nonce) &&
+            parser.atEnd()
+        ) {
+            handleStreamRequest_(mce, request, mainIdx);
+            return;
+        }
+    }
+
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, reqIdx, startEventIdx;
+        int immediate, width, height;
+        string::const_iterator eventsBegin, eventsEnd;
+        if(
+            parser.literal("/events/") &&
+            parser.number(mainIdx) &&
+            parser.number(reqIdx) &&
+            parser.number(immediate) && immediate <= 1 &&
+            parser.number(width) &&
+            parser.number(height) &&
+            parser.number(startEventIdx) &&
+            parser.eventList(eventsBegin, eventsEnd)
+        ) {
+            handleEventsRequest_(
+                mce,
+                request,
+                mainIdx,
+                reqIdx,
+                immediate,
+                width,
+                height,
+                startEventIdx,
+                eventsBegin,
+                eventsEnd
+            );
+            return;
+        }
+    }
 
-        if(mainIdx) {
-            handleIframeRequest_(mce, request, *mainIdx);
+    if(method == "POST") {
+        PathParser parser(path);
+        uint64_t mainIdx, startEventIdx;
+        if(
+            parser.literal("/input/") &&
+            parser.number(mainIdx) &&
+            parser.number(startEventIdx) &&
+            parser.atEnd()
+        ) {
+            handleInputRequest_(mce, request, mainIdx, startEventIdx);
             return;
         }
     }
 
-    if(method == "GET" && regex_match(path, match, downloadPathRegex)) {
-        REQUIRE(match.size() == 2);
-        optional<uint64_t> downloadIdx = parseString<uint64_t>(match[1]);
-        if(downloadIdx) {
-            auto it = downloads_.find(*downloadIdx);
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, imgIdx;
+        if(
+            parser.literal("/tilepos/") &&
+            parser.number(mainIdx) &&
+            parser.number(imgIdx) &&
+            parser.atEnd()
+        ) {
+            handleTilePosRequest_(request, mainIdx, imgIdx);
+            return;
+        }
+    }
+
+    if(method == "GET") {
+        const string CachedTilePrefix = "/ctile/";
+        if(
+            path.size() == CachedTilePrefix.size() + 32 &&
+            path.compare(0, CachedTilePrefix.size(), CachedTilePrefix) == 0
+        ) {
+            imageCompressor_->sendCachedTile(
+                request, path.substr(CachedTilePrefix.size())
+            );
+            return;
+        }
+    }
+
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, imgIdx, part;
+        if(
+            parser.literal("/tileshift/") &&
+            parser.number(mainIdx) &&
+            parser.number(imgIdx) &&
+            parser.number(part) &&
+            parser.atEnd()
+        ) {
+            handleTileShiftRequest_(request, mainIdx, imgIdx, part);
+            return;
+        }
+    }
+
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, nonce;
+        if(
+            parser.literal("/iframe/") &&
+            parser.number(mainIdx) &&
+            parser.number(nonce) &&
+            parser.atEnd()
+        ) {
+            handleIframeRequest_(mce, request, mainIdx);
+            return;
+        }
+    }
+
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx, nonce;
+        if(
+            parser.literal("/control/") &&
+            parser.number(mainIdx) &&
+            parser.number(nonce) &&
+            parser.atEnd()
+        ) {
+            handleControlRequest_(mce, request, mainIdx);
+            return;
+        }
+    }
+
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t downloadIdx;
+        if(
+            parser.literal("/download/") &&
+            parser.number(downloadIdx) &&
+            parser.rest()
+        ) {
+            auto it = downloads_.find(downloadIdx);
             if(it == downloads_.end()) {
                 request->sendTextResponse(400, "ERROR: Outdated download index");
             } else {
@@ -200,12 +411,11 @@ void Window::handleHTTPRequest(MCE, shared_ptr<HTTPRequest> request) {
         return;
     }
 
-    if(method == "GET" && regex_match(path, match, closePathRegex)) {
-        REQUIRE(match.size() == 2);
-        optional<uint64_t> mainIdx = parseString<uint64_t>(match[1]);
-
-        if(mainIdx) {
-            handleCloseRequest_(request, *mainIdx);
+    if(method == "GET") {
+        PathParser parser(path);
+        uint64_t mainIdx;
+        if(parser.literal("/close/") && parser.number(mainIdx) && parser.atEnd()) {
+            handleCloseRequest_(request, mainIdx);
             return;
         }
     }
@@ -229,6 +439,32 @@ void Window::handleHTTPRequest(MCE, shared_ptr<HTTPRequest> request) {
     request->sendTextResponse(400, "ERROR: Invalid request URI or method");
 }
 
+void Window::handleUploadProgress(shared_ptr<HTTPUploadProgress> progress) {
+    REQUIRE_API_THREAD();
+
+    const string& fullPath = progress->path();
+    if(
+        fullPath.size() < pathPrefix_.size() ||
+        !passwordsEqual(fullPath.substr(0, pathPrefix_.size()), pathPrefix_) ||
+        fullPath.substr(pathPrefix_.size()) != "/upload/"
+    ) {
+        return;
+    }
+
+    if(closed_ || !inFileUploadMode_) {
+        // The upload would be discarded anyway
+        progress->cancel();
+        return;
+    }
+
+    if(uploadProgress_ && uploadProgress_ != progress) {
+        // Only the latest upload is shown
+        uploadProgress_->cancel();
+    }
+    uploadProgress_ = progress;
+    notifyViewChanged();
+}
+
 shared_ptr<Window> Window::createPopup(uint64_t popupHandle) {
     REQUIRE_API_THREAD();
     REQUIRE(!closed_);
@@ -239,8 +475,11 @@ shared_ptr<Window> Window::createPopup(uint64_t popupHandle) {
         eventHandler_,
         popupHandle,
         secretGen_,
+        compressorPool_,
+        compressorOptions_,
         programName_,
         allowPNG_,
+        allowImageStream_,
         imageCompressor_->quality()
     );
 
@@ -249,15 +488,20 @@ shared_ptr<Window> Window::createPopup(uint64_t popupHandle) {
         if(self->closed_ || popupWindow->closed_) {
             return;
         }
-        self->addIframe_(mce,
+        self->addIframe_(mce, {
             [self, popupWindow](shared_ptr<HTTPRequest> request) {
                 request->sendHTMLResponse(
                     200,
                     writePopupIframeHTML,
                     {self->programName_, popupWindow->pathPrefix_}
                 );
+            },
+            [popupWindow]() {
+                return controlMessageJSON(
+                    "popup", popupWindow->pathPrefix_ + "/prev/"
+                );
             }
-        );
+        });
     });
 
     return popupWindow;
@@ -267,6 +511,8 @@ void Window::notifyViewChanged() {
     REQUIRE_API_THREAD();
     REQUIRE(!closed_);
 
+    ++stats_.viewChanges;
+
     shared_ptr<Window> self = shared_from_this();
     postTask([self]() {
         if(!self->closed_) {
@@ -275,6 +521,46 @@ void Window::notifyViewChanged() {
     });
 }
 
+void Window::notifyViewChanged(Rect dirtyRect) {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    ++stats_.viewChanges;
+
+    shared_ptr<Window> self = shared_from_this();
+    postTask([self, dirtyRect]() {
+        if(!self->closed_) {
+            self->imageCompressor_->updateNotify(mce, dirtyRect);
+        }
+    });
+}
+
+void Window::traceView(uint64_t traceId) {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    // Posted as a task to keep the order with the view change notifications
+    shared_ptr<Window> self = shared_from_this();
+    uint64_t handle = handle_;
+    postTask([self, handle, traceId]() {
+        if(!self->closed_) {
+            self->imageCompressor_->addTrace(handle, traceId);
+        }
+    });
+}
+
+void Window::setMediaPlaying(bool playing) {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    shared_ptr<Window> self = shared_from_this();
+    postTask([self, playing]() {
+        if(!self->closed_) {
+            self->imageCompressor_->setMediaPlaying(mce, playing);
+        }
+    });
+}
+
 void Window::setCursor(int cursorSignal) {
     REQUIRE_API_THREAD();
     REQUIRE(!closed_);
@@ -290,6 +576,7 @@ void Window::setCursor(int cursorSignal) {
     postTask([self, cursorSignal]() {
         if(!self->closed_) {
             self->imageCompressor_->setCursorSignal(mce, cursorSignal);
+            self->flushEventsRequest_();
         }
     });
 }
@@ -305,18 +592,32 @@ optional<pair<vector<string>, size_t>> Window::qualitySelectorQuery() {
     if(allowPNG_) {
         labels.push_back("PNG");
     }
-    return pair<vector<string>, size_t>(
-        move(labels), (size_t)(imageCompressor_->quality() - 10)
-    );
+    labels.push_back("Aut");
+
+    int quality = imageCompressor_->quality();
+    size_t currentIdx;
+    if(quality == ImageCompressor::AutoQuality) {
+        currentIdx = labels.size() - 1;
+    } else {
+        currentIdx = (size_t)(quality - 10);
+    }
+    return pair<vector<string>, size_t>(move(labels), currentIdx);
 }
 
 void Window::qualityChanged(size_t qualityIdx) {
     REQUIRE_API_THREAD();
     REQUIRE(!closed_);
 
-    int quality = (int)qualityIdx + 10;
-    REQUIRE(quality >= 10);
-    REQUIRE(quality <= (allowPNG_ ? 101 : 100));
+    // The automatic quality option follows the fixed qualities
+    size_t autoIdx = allowPNG_ ? 92 : 91;
+    REQUIRE(qualityIdx <= autoIdx);
+
+    int quality;
+    if(qualityIdx == autoIdx) {
+        quality = ImageCompressor::AutoQuality;
+    } else {
+        quality = (int)qualityIdx + 10;
+    }
 
     postTask([quality, imageCompressor{imageCompressor_}]() {
         imageCompressor->setQuality(mce, quality);
@@ -332,15 +633,18 @@ void Window::clipboardButtonPressed() {
         if(self->closed_) {
             return;
         }
-        self->addIframe_(mce,
+        self->addIframe_(mce, {
             [self](shared_ptr<HTTPRequest> request) {
                 request->sendHTMLResponse(
                     200,
                     writeClipboardIframeHTML,
                     {self->programName_}
                 );
+            },
+            []() {
+                return controlMessageJSON("clipboard", "/clipboard/");
             }
-        );
+        });
     });
 }
 
@@ -354,10 +658,10 @@ void Window::putFileDownload(shared_ptr<FileDownload> file) {
             return;
         }
 
-        self->addIframe_(mce, [self, file](shared_ptr<HTTPRequest> request) {
-            // Some browsers use multiple requests to download a file. Thus, we
-            // add the file to downloads_ to be kept a certain period of time,
-            // and forward the client to the actual download page.
+        // Some browsers use multiple requests to download a file. Thus, we
+        // add the file to downloads_ to be kept a certain period of time,
+        // and forward the client to the actual download page.
+        auto addDownload = [self, file]() {
             uint64_t downloadIdx = ++self->curDownloadIdx_;
 
             shared_ptr<DelayedTaskTag> tag = postDelayedTask(
@@ -367,19 +671,62 @@ void Window::putFileDownload(shared_ptr<FileDownload> file) {
                 }
             );
             REQUIRE(self->downloads_.insert({downloadIdx, {file, tag}}).second);
+            return downloadIdx;
+        };
 
-            request->sendHTMLResponse(
-                200, writeDownloadIframeHTML, {
-                    self->programName_,
-                    self->pathPrefix_,
-                    downloadIdx,
-                    file->name()
-                }
-            );
+        self->addIframe_(mce, {
+            [self, file, addDownload](shared_ptr<HTTPRequest> request) {
+                uint64_t downloadIdx = addDownload();
+                request->sendHTMLResponse(
+                    200, writeDownloadIframeHTML, {
+                        self->programName_,
+                        self->pathPrefix_,
+                        downloadIdx,
+                        file->name()
+                    }
+                );
+            },
+            [self, file, addDownload]() {
+                uint64_t downloadIdx = addDownload();
+                return controlMessageJSON(
+                    "download",
+                    self->pathPrefix_ + "/download/" + toString(downloadIdx) +
+                        "/" + file->name()
+                );
+            }
         });
     });
 }
 
+WindowStats Window::stats() {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    WindowStats ret = stats_;
+    ret.curEventIdx = curEventIdx_;
+    ret.hidden = hidden_;
+    ret.compressor = imageCompressor_->stats();
+    return ret;
+}
+
+ImageCompressorMemory Window::memoryUsage() {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    return imageCompressor_->memoryUsage();
+}
+
+void Window::shrinkIdleBuffers() {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    // While the window is hidden, its fetching is paused, and the buffers
+    // are rebuilt once a client polls the window again
+    if(hidden_) {
+        imageCompressor_->shrinkBuffers();
+    }
+}
+
 bool Window::startFileUpload() {
     REQUIRE_API_THREAD();
     REQUIRE(!closed_);
@@ -396,15 +743,20 @@ bool Window::startFileUpload() {
         if(self->closed_ || !self->inFileUploadMode_) {
             return;
         }
-        self->addIframe_(mce,
+        self->addIframe_(mce, {
             [self](shared_ptr<HTTPRequest> request) {
                 request->sendHTMLResponse(
                     200,
                     writeUploadIframeHTML,
                     {self->programName_, self->pathPrefix_}
                 );
+            },
+            [self]() {
+                return controlMessageJSON(
+                    "upload", self->pathPrefix_ + "/upload/"
+                );
             }
-        );
+        });
     });
 
     return true;
@@ -415,40 +767,70 @@ void Window::cancelFileUpload() {
     REQUIRE(!closed_);
     REQUIRE(inFileUploadMode_);
 
-    inFileUploadMode_ = false;
-    notifyViewChanged();
+    endFileUploadMode_();
 }
 
 void Window::onImageCompressorFetchImage(
-    function<void(const uint8_t*, size_t, size_t, size_t)> func
+    PutImageFunc func
 ) {
     REQUIRE_API_THREAD();
 
     if(closed_) {
         vector<uint8_t> data(4, (uint8_t)255);
-        func(data.data(), 1, 1, 1);
+        func(data.data(), 1, 1, 1, nullptr);
+    } else if(inFileUploadMode_) {
+        // The GUI is drawn on top of the image, so the compressor needs its
+        // own copy of it even if the image is shared
+        REQUIRE(eventHandler_);
+        eventHandler_->onWindowFetchImage(handle_,
+            [&func](
+                const uint8_t* image,
+                size_t width,
+                size_t height,
+                size_t pitch,
+                shared_ptr<const void> owner
+            ) {
+                func(image, width, height, pitch, nullptr);
+            }
+        );
     } else {
         REQUIRE(eventHandler_);
         eventHandler_->onWindowFetchImage(handle_, func);
     }
 }
 
-void Window::onImageCompressorRenderGUI(
+bool Window::onImageCompressorRenderGUI(
     vector<uint8_t>& data, size_t width, size_t height
 ) {
     REQUIRE_API_THREAD();
 
     if(!closed_ && inFileUploadMode_) {
-        renderUploadModeGUI(data, width, height, fileUploadModeButtonDown_);
+        optional<double> progress;
+        if(uploadProgress_ && uploadProgress_->totalBytes() != 0) {
+            progress =
+                (double)uploadProgress_->receivedBytes() /
+                (double)uploadProgress_->totalBytes();
+        }
+        uploadModeGUI_->render(
+            data, width, height, fileUploadModeButtonDown_, progress
+        );
+        return true;
     }
+    return false;
 }
 
 void Window::afterConstruct_(shared_ptr<Window> self) {
     imageCompressor_ = ImageCompressor::create(
-        self, milliseconds(2000), initialQuality_
+        self,
+        compressorPool_,
+        compressorOptions_,
+        milliseconds(2000),
+        initialQuality_,
+        allowPNG_
     );
 
     updateInactivityTimeout_();
+    updateHideTimeout_(mce);
     notifyViewChanged();
 }
 
@@ -484,6 +866,45 @@ void Window::inactivityTimeoutReached_(MCE, bool shortened) {
     selfClose_(mce);
 }
 
+void Window::updateHideTimeout_(MCE) {
+    REQUIRE_API_THREAD();
+    if(closed_) return;
+
+    setHidden_(mce, false);
+
+    // A client polling the images sends a new image request at least every
+    // few seconds, as the image compressor responds to a waiting request
+    // within its send timeout (2s)
+    hideTimeoutTag_ = postDelayedTask(
+        milliseconds(5000),
+        weak_ptr<Window>(shared_from_this()),
+        &Window::hideTimeoutReached_,
+        mce
+    );
+}
+
+void Window::hideTimeoutReached_(MCE) {
+    REQUIRE_API_THREAD();
+    if(closed_) return;
+
+    setHidden_(mce, true);
+}
+
+void Window::setHidden_(MCE, bool hidden) {
+    REQUIRE_API_THREAD();
+    REQUIRE(!closed_);
+
+    if(hidden == hidden_) {
+        return;
+    }
+    hidden_ = hidden;
+
+    imageCompressor_->setFetchingPaused(mce, hidden);
+
+    REQUIRE(eventHandler_);
+    eventHandler_->onWindowVisibilityChanged(handle_, !hidden);
+}
+
 int Window::decodeKey_(uint64_t eventIdx, int key) {
     REQUIRE(!snakeOilKeyCipherKey_.empty());
     size_t i = (size_t)eventIdx % snakeOilKeyCipherKey_.size();
@@ -500,11 +921,11 @@ bool Window::handleTokenizedEvent_(MCE,
 
     auto keyDown = [&](int key) {
         keysDown_.insert(key);
-        eventHandler_->onWindowKeyDown(handle_, key);
+        inputEvents_.push_back({InputEvent::KeyDown, 0, 0, 0, 0, key});
     };
     auto keyUp = [&](int key) {
         if(keysDown_.erase(key)) {
-            eventHandler_->onWindowKeyUp(handle_, key);
+            inputEvents_.push_back({InputEvent::KeyUp, 0, 0, 0, 0, key});
         }
     };
 
@@ -525,9 +946,9 @@ bool Window::handleTokenizedEvent_(MCE,
             }
         } else {
             if(mouseButtonsDown_.insert(button).second) {
-                eventHandler_->onWindowMouseDown(handle_, x, y, button);
+                inputEvents_.push_back({InputEvent::MouseDown, x, y, button, 0, 0});
             }
-            eventHandler_->onWindowMouseMove(handle_, x, y);
+            inputEvents_.push_back({InputEvent::MouseMove, x, y, 0, 0, 0});
         }
         return true;
     }
@@ -536,7 +957,7 @@ bool Window::handleTokenizedEvent_(MCE,
         int y = args[1];
         int button = args[2];
         if(mouseButtonsDown_.erase(button)) {
-            eventHandler_->onWindowMouseUp(handle_, x, y, button);
+            inputEvents_.push_back({InputEvent::MouseUp, x, y, button, 0, 0});
         }
         if(inFileUploadMode_) {
             if(button == 0 && fileUploadModeButtonPressed_) {
@@ -547,11 +968,12 @@ bool Window::handleTokenizedEvent_(MCE,
                 if(isOverUploadModeCancelButton(
                     (size_t)x, (size_t)y, (size_t)width_, (size_t)height_
                 )) {
+                    flushInputEvents_();
                     selfCancelFileUpload_(mce);
                 }
             }
         } else {
-            eventHandler_->onWindowMouseMove(handle_, x, y);
+            inputEvents_.push_back({InputEvent::MouseMove, x, y, 0, 0, 0});
         }
         return true;
     }
@@ -569,7 +991,7 @@ bool Window::handleTokenizedEvent_(MCE,
                 }
             }
         } else {
-            eventHandler_->onWindowMouseMove(handle_, x, y);
+            inputEvents_.push_back({InputEvent::MouseMove, x, y, 0, 0, 0});
         }
         return true;
     }
@@ -590,7 +1012,7 @@ bool Window::handleTokenizedEvent_(MCE,
     if(name == "MDBL" && argCount == 2) {
         int x = args[0];
         int y = args[1];
-        eventHandler_->onWindowMouseDoubleClick(handle_, x, y, 0);
+        inputEvents_.push_back({InputEvent::MouseDoubleClick, x, y, 0, 0, 0});
         return true;
     }
     if(name == "MWH" && argCount == 3) {
@@ -598,13 +1020,13 @@ bool Window::handleTokenizedEvent_(MCE,
         int y = args[1];
         int delta = args[2];
         delta = max(-180, min(180, delta));
-        eventHandler_->onWindowMouseWheel(handle_, x, y, delta);
+        inputEvents_.push_back({InputEvent::MouseWheel, x, y, 0, delta, 0});
         return true;
     }
     if(name == "MOUT" && argCount == 2) {
         int x = args[0];
         int y = args[1];
-        eventHandler_->onWindowMouseLeave(handle_, x, y);
+        inputEvents_.push_back({InputEvent::MouseLeave, x, y, 0, 0, 0});
         return true;
     }
 
@@ -624,7 +1046,7 @@ bool Window::handleTokenizedEvent_(MCE,
         return true;
     }
     if(name == "FOUT" && argCount == 0) {
-        eventHandler_->onWindowLoseFocus(handle_);
+        inputEvents_.push_back({InputEvent::LoseFocus, 0, 0, 0, 0, 0});
         return true;
     }
     return false;
@@ -677,7 +1099,11 @@ bool Window::handleEvent_(MCE,
     return ok && handleTokenizedEvent_(mce, eventIdx, name, argCount, args);
 }
 
-void Window::handleEvents_(MCE, uint64_t startIdx, string eventStr) {
+void Window::handleEvents_(MCE,
+    uint64_t startIdx,
+    string::const_iterator begin,
+    string::const_iterator end
+) {
     REQUIRE_API_THREAD();
     if(closed_) return;
 
@@ -692,25 +1118,18 @@ void Window::handleEvents_(MCE, uint64_t startIdx, string eventStr) {
     uint64_t eventIdx = startIdx;
     if(eventIdx > curEventIdx_) {
         WARNING_LOG(eventIdx - curEventIdx_, " events skipped in window ", handle_);
+        stats_.eventsLost += eventIdx - curEventIdx_;
         curEventIdx_ = eventIdx;
     }
 
-    string::const_iterator begin = eventStr.begin();
-    string::const_iterator end = eventStr.end();
-
-    string::const_iterator itemEnd = begin;
-    while(true) {
-        string::const_iterator itemBegin = itemEnd;
-        while(true) {
-            if(itemEnd >= end) {
-                return;
-            }
-            if(*itemEnd == '/') {
-                ++itemEnd;
-                break;
-            }
-            ++itemEnd;
+    // The input events caused by the items are relayed as a single batch
+    bool eventsHandled = false;
+    string::const_iterator itemBegin = begin;
+    for(string::const_iterator pos = begin; pos < end; ++pos) {
+        if(*pos != '/') {
+            continue;
         }
+        string::const_iterator itemEnd = pos + 1;
 
         if(eventIdx == curEventIdx_) {
             if(!handleEvent_(mce, eventIdx, itemBegin, itemEnd)) {
@@ -721,9 +1140,36 @@ void Window::handleEvents_(MCE, uint64_t startIdx, string eventStr) {
             }
             ++eventIdx;
             curEventIdx_ = eventIdx;
+            ++stats_.eventsHandled;
+            eventsHandled = true;
         } else {
             ++eventIdx;
+            ++stats_.eventsReplayed;
+        }
+        itemBegin = itemEnd;
+    }
+
+    flushInputEvents_();
+
+    if(eventsHandled) {
+        imageCompressor_->notifyInteraction(mce);
+    }
+}
+
+void Window::flushInputEvents_() {
+    if(!inputEvents_.empty()) {
+        REQUIRE(eventHandler_);
+        if(isTracing()) {
+            traceStage(
+                handle_,
+                newTraceId(),
+                "input",
+                toString(inputEvents_.size()) + " events up to index " +
+                    toString(curEventIdx_)
+            );
         }
+        eventHandler_->onWindowInputEvents(handle_, inputEvents_);
+        inputEvents_.clear();
     }
 }
 
@@ -747,6 +1193,7 @@ void Window::navigate_(MCE, int direction) {
 
 void Window::handleMainPageRequest_(MCE, shared_ptr<HTTPRequest> request) {
     updateInactivityTimeout_();
+    updateHideTimeout_(mce);
 
     if(preMainVisited_) {
         ++curMainIdx_;
@@ -761,19 +1208,19 @@ void Window::handleMainPageRequest_(MCE, shared_ptr<HTTPRequest> request) {
         if(curMainIdx_ > 1) {
             // Make sure that no mouse buttons or keys are stuck down and the
             // focus and mouseover state is reset
-            REQUIRE(eventHandler_);
             while(!mouseButtonsDown_.empty()) {
                 int button = *mouseButtonsDown_.begin();
                 mouseButtonsDown_.erase(mouseButtonsDown_.begin());
-                eventHandler_->onWindowMouseUp(handle_, 0, 0, button);
+                inputEvents_.push_back({InputEvent::MouseUp, 0, 0, button, 0, 0});
             }
             while(!keysDown_.empty()) {
                 int key = *keysDown_.begin();
                 keysDown_.erase(keysDown_.begin());
-                eventHandler_->onWindowKeyUp(handle_, key);
+                inputEvents_.push_back({InputEvent::KeyUp, 0, 0, 0, 0, key});
             }
-            eventHandler_->onWindowMouseLeave(handle_, 0, 0);
-            eventHandler_->onWindowLoseFocus(handle_);
+            inputEvents_.push_back({InputEvent::MouseLeave, 0, 0, 0, 0, 0});
+            inputEvents_.push_back({InputEvent::LoseFocus, 0, 0, 0, 0, 0});
+            flushInputEvents_();
         }
 
         snakeOilKeyCipherKey_ = secretGen_->generateSnakeOilCipherKey();
@@ -800,12 +1247,30 @@ void Window::handleMainPageRequest_(MCE, shared_ptr<HTTPRequest> request) {
 
         curImgIdx_ = 0;
         curEventIdx_ = 0;
+        sentTiles_.clear();
+        if(pendingTilePosRequest_.has_value()) {
+            pendingTilePosRequest_->second->sendTextResponse(
+                400, "ERROR: Outdated request"
+            );
+            pendingTilePosRequest_.reset();
+        }
+        if(pendingEventsRequest_) {
+            pendingEventsRequest_->sendTextResponse(
+                400, "ERROR: Outdated request"
+            );
+            pendingEventsRequest_.reset();
+        }
+        eventsWaitTag_.reset();
+        imageCompressor_->closeStream();
+
         request->sendHTMLResponse(200, writeMainHTML, {
             programName_,
             pathPrefix_,
             curMainIdx_,
             validNonCharKeyList,
-            snakeOilKeyCipherKeyWrites
+            snakeOilKeyCipherKeyWrites,
+            allowImageStream_,
+            (uint64_t)compressorOptions_.pipelineDepth
         });
     } else {
         request->sendHTMLResponse(
@@ -823,41 +1288,330 @@ void Window::handleImageRequest_(MCE,
     int width,
     int height,
     uint64_t startEventIdx,
-    string eventStr
+    string::const_iterator eventsBegin,
+    string::const_iterator eventsEnd,
+    optional<uint64_t> tileBaseImgIdx
 ) {
     if(mainIdx != curMainIdx_ || imgIdx <= curImgIdx_) {
         request->sendTextResponse(400, "ERROR: Outdated request");
     } else {
         updateInactivityTimeout_();
+        updateHideTimeout_(mce);
+        ++stats_.imageRequests;
 
-        handleEvents_(mce, startEventIdx, move(eventStr));
+        handleEvents_(mce, startEventIdx, eventsBegin, eventsEnd);
         curImgIdx_ = imgIdx;
+        updateSize_(width, height);
+
+        if(tileBaseImgIdx.has_value()) {
+            uint64_t baseFrameIdx = 0;
+            auto it = sentTiles_.find(*tileBaseImgIdx);
+            if(it != sentTiles_.end()) {
+                baseFrameIdx = get<0>(it->second);
+            }
+
+            shared_ptr<Window> self = shared_from_this();
+            ImageCompressor::TileSentFunc sentFunc =
+                [self, mainIdx, imgIdx](
+                    uint64_t frameIdx,
+                    Rect rect,
+                    bool isTile,
+                    optional<ScrollShift> shift
+                ) {
+                    self->tileSent_(
+                        mainIdx, imgIdx, frameIdx, rect, isTile, shift
+                    );
+                };
+
+            // The cacheable tile URLs (see handleHTTPRequest) do not depend
+            // on the main page index, so that they stay valid across reloads
+            string cachedTilePath = pathPrefix_ + "/ctile/";
+            if(immediate) {
+                imageCompressor_->sendCompressedTileNow(
+                    mce, request, baseFrameIdx, sentFunc, cachedTilePath
+                );
+            } else {
+                imageCompressor_->sendCompressedTileWait(
+                    mce, request, baseFrameIdx, sentFunc, cachedTilePath
+                );
+            }
+        } else {
+            if(immediate == 2) {
+                // Pipelined request (see main.html)
+                imageCompressor_->sendCompressedImagePipelined(mce, request);
+            } else if(immediate) {
+                imageCompressor_->sendCompressedImageNow(mce, request);
+            } else {
+                imageCompressor_->sendCompressedImageWait(mce, request);
+            }
+        }
+    }
+}
 
-        width = min(max(width, 1), 16384);
-        height = min(max(height, 1), 16384);
+void Window::handleStreamRequest_(MCE,
+    shared_ptr<HTTPRequest> request,
+    uint64_t mainIdx
+) {
+    if(mainIdx != curMainIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+    } else if(!allowImageStream_ || !request->supportsStreaming()) {
+        // The client falls back to polling the images
+        request->sendTextResponse(503, "ERROR: Image stream not available\n");
+    } else {
+        updateInactivityTimeout_();
+        updateHideTimeout_(mce);
 
-        if(width != width_ || height != height_) {
-            width_ = width;
-            height_ = height;
+        imageCompressor_->sendCompressedImageStream(mce, request);
+        flushEventsRequest_();
+    }
+}
 
-            REQUIRE(eventHandler_);
-            eventHandler_->onWindowResize(
-                handle_,
-                (size_t)width,
-                (size_t)height
+void Window::handleEventsRequest_(MCE,
+    shared_ptr<HTTPRequest> request,
+    uint64_t mainIdx,
+    uint64_t reqIdx,
+    int immediate,
+    int width,
+    int height,
+    uint64_t startEventIdx,
+    string::const_iterator eventsBegin,
+    string::const_iterator eventsEnd
+) {
+    // The events requests share the index sequence of the image requests, as
+    // the client switches to polling the images if the stream fails
+    if(mainIdx != curMainIdx_ || reqIdx <= curImgIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+        return;
+    }
+
+    updateInactivityTimeout_();
+    updateHideTimeout_(mce);
+
+    handleEvents_(mce, startEventIdx, eventsBegin, eventsEnd);
+    curImgIdx_ = reqIdx;
+    updateSize_(width, height);
+
+    flushEventsRequest_();
+    if(immediate) {
+        sendSignals_(request);
+    } else {
+        // Wait for the signals to change; the timeout is shorter than the
+        // retry interval of the client
+        pendingEventsRequest_ = request;
+        eventsWaitTag_ = postDelayedTask(
+            milliseconds(2000),
+            weak_ptr<Window>(shared_from_this()),
+            &Window::flushEventsRequest_
+        );
+    }
+}
+
+void Window::handleInputRequest_(MCE,
+    shared_ptr<HTTPRequest> request,
+    uint64_t mainIdx,
+    uint64_t startEventIdx
+) {
+    if(mainIdx != curMainIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+        return;
+    }
+
+    // The body is validated in place like the event lists in the paths
+    const string& body = request->body();
+    PathParser parser(body);
+    string::const_iterator eventsBegin, eventsEnd;
+    if(!parser.eventList(eventsBegin, eventsEnd)) {
+        request->sendTextResponse(400, "ERROR: Invalid event list");
+        return;
+    }
+
+    updateInactivityTimeout_();
+    updateHideTimeout_(mce);
+
+    handleEvents_(mce, startEventIdx, eventsBegin, eventsEnd);
+    request->sendTextResponse(200, "OK");
+}
+
+void Window::flushEventsRequest_() {
+    REQUIRE_API_THREAD();
+
+    eventsWaitTag_.reset();
+    if(!closed_ && pendingEventsRequest_) {
+        shared_ptr<HTTPRequest> request = pendingEventsRequest_;
+        pendingEventsRequest_.reset();
+        sendSignals_(request);
+    }
+}
+
+void Window::sendSignals_(shared_ptr<HTTPRequest> request) {
+    // The signals are carried in the size of the image in the same way as in
+    // the images sent to the client. If the image stream has ended, the width
+    // is increased by IframeSignalCount to tell the client to restart it.
+    size_t width = (size_t)(
+        (imageCompressor_->isStreaming() ? 1 : 2) *
+            ImageCompressor::IframeSignalCount +
+        imageCompressor_->iframeSignal()
+    );
+    size_t height = (size_t)(
+        ImageCompressor::CursorSignalCount + imageCompressor_->cursorSignal()
+    );
+    sendBlankPNG(request, width, height);
+}
+
+void Window::updateSize_(int width, int height) {
+    width = min(max(width, 1), 16384);
+    height = min(max(height, 1), 16384);
+
+    if(width != width_ || height != height_) {
+        width_ = width;
+        height_ = height;
+
+        REQUIRE(eventHandler_);
+        eventHandler_->onWindowResize(
+            handle_,
+            (size_t)width,
+            (size_t)height
+        );
+
+        if(inFileUploadMode_) {
+            notifyViewChanged();
+        }
+    }
+}
+
+void Window::handleTilePosRequest_(
+    shared_ptr<HTTPRequest> request,
+    uint64_t mainIdx,
+    uint64_t imgIdx
+) {
+    if(mainIdx != curMainIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+        return;
+    }
+
+    auto it = sentTiles_.find(imgIdx);
+    if(it != sentTiles_.end()) {
+        sendTilePos_(
+            request,
+            get<1>(it->second),
+            get<2>(it->second),
+            get<3>(it->second).has_value()
+        );
+        return;
+    }
+
+    // The tile may not have been sent yet; in that case, we wait for it. We
+    // only keep the latest such request.
+    if(imgIdx < curImgIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+    } else {
+        if(pendingTilePosRequest_.has_value()) {
+            pendingTilePosRequest_->second->sendTextResponse(
+                400, "ERROR: Outdated request"
             );
+        }
+        pendingTilePosRequest_ = make_pair(imgIdx, request);
+    }
+}
 
-            if(inFileUploadMode_) {
-                notifyViewChanged();
-            }
+void Window::tileSent_(
+    uint64_t mainIdx,
+    uint64_t imgIdx,
+    uint64_t frameIdx,
+    Rect rect,
+    bool isTile,
+    optional<ScrollShift> shift
+) {
+    REQUIRE_API_THREAD();
+
+    if(closed_ || mainIdx != curMainIdx_) {
+        return;
+    }
+
+    sentTiles_[imgIdx] = {frameIdx, rect, isTile, shift};
+
+    // Only the latest few tiles may be referred to by the client
+    const size_t MaxSentTiles = 8;
+    while(sentTiles_.size() > MaxSentTiles) {
+        sentTiles_.erase(sentTiles_.begin());
+    }
+
+    if(
+        pendingTilePosRequest_.has_value() &&
+        pendingTilePosRequest_->first <= imgIdx
+    ) {
+        shared_ptr<HTTPRequest> request = pendingTilePosRequest_->second;
+        if(pendingTilePosRequest_->first == imgIdx) {
+            sendTilePos_(request, rect, isTile, shift.has_value());
+        } else {
+            request->sendTextResponse(400, "ERROR: Outdated request");
         }
+        pendingTilePosRequest_.reset();
+    }
+}
 
-        if(immediate) {
-            imageCompressor_->sendCompressedImageNow(mce, request);
+void Window::sendTilePos_(
+    shared_ptr<HTTPRequest> request,
+    Rect rect,
+    bool isTile,
+    bool hasShift
+) {
+    // The position of a tile is signaled in the size of an image: a tile at
+    // (x, y) is encoded as (x + 2, 2y + 1), or (x + 2, 2y + 2) if the client
+    // must first fetch the scroll shift of the tile using /tileshift/, a full
+    // frame as (1, 1) and an empty tile as (1, 2). As the images sent to tile
+    // clients do not carry the signals, the encoded width is multiplied by
+    // IframeSignalCount and the encoded height by CursorSignalCount, and the
+    // current signals are added to them.
+    size_t width = 1;
+    size_t height = 1;
+    if(isTile) {
+        if(rect.isEmpty()) {
+            height = 2;
         } else {
-            imageCompressor_->sendCompressedImageWait(mce, request);
+            width = (size_t)rect.startX + 2;
+            height = 2 * (size_t)rect.startY + (hasShift ? 2 : 1);
         }
     }
+    width = (size_t)ImageCompressor::IframeSignalCount * width +
+        (size_t)imageCompressor_->iframeSignal();
+    height = (size_t)ImageCompressor::CursorSignalCount * height +
+        (size_t)imageCompressor_->cursorSignal();
+
+    sendBlankPNG(request, width, height);
+}
+
+void Window::handleTileShiftRequest_(
+    shared_ptr<HTTPRequest> request,
+    uint64_t mainIdx,
+    uint64_t imgIdx,
+    uint64_t part
+) {
+    if(mainIdx != curMainIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+        return;
+    }
+
+    auto it = sentTiles_.find(imgIdx);
+    if(it == sentTiles_.end() || !get<3>(it->second).has_value() || part > 1) {
+        request->sendTextResponse(400, "ERROR: Invalid tile shift request");
+        return;
+    }
+    ScrollShift shift = *get<3>(it->second);
+
+    // The shift is signaled in the sizes of two images: the first one has
+    // size (endX, startY + 1) and the second one has size
+    // (endY - startY, 2|dy| + s), where s is 1 if dy < 0 and 0 otherwise.
+    size_t width, height;
+    if(part == 0) {
+        width = (size_t)shift.endX;
+        height = (size_t)shift.startY + 1;
+    } else {
+        width = (size_t)(shift.endY - shift.startY);
+        height = 2 * (size_t)abs(shift.dy) + (shift.dy < 0 ? 1 : 0);
+    }
+
+    sendBlankPNG(request, width, height);
 }
 
 void Window::handleIframeRequest_(MCE,
@@ -871,7 +1625,7 @@ void Window::handleIframeRequest_(MCE,
     } else {
         updateInactivityTimeout_();
 
-        function<void(shared_ptr<HTTPRequest>)> iframe = iframeQueue_.front();
+        IframeAction action = iframeQueue_.front();
         iframeQueue_.pop();
 
         if(iframeQueue_.empty()) {
@@ -880,11 +1634,55 @@ void Window::handleIframeRequest_(MCE,
             );
         }
 
-        iframe(request);
+        action.iframe(request);
     }
 }
 
+void Window::handleControlRequest_(MCE,
+    shared_ptr<HTTPRequest> request,
+    uint64_t mainIdx
+) {
+    if(mainIdx != curMainIdx_) {
+        request->sendTextResponse(400, "ERROR: Outdated request");
+        return;
+    }
+
+    if(!iframeQueue_.empty()) {
+        updateInactivityTimeout_();
+    }
+
+    string body = "[";
+    while(!iframeQueue_.empty()) {
+        IframeAction action = iframeQueue_.front();
+        iframeQueue_.pop();
+        if(body.size() > 1) {
+            body.push_back(',');
+        }
+        body += action.control();
+    }
+    body += "]";
+    imageCompressor_->setIframeSignal(mce, ImageCompressor::IframeSignalFalse);
+
+    request->sendResponse(
+        200,
+        "application/json",
+        body.size(),
+        [body{move(body)}](ostream& out) {
+            out << body;
+        }
+    );
+}
+
 void Window::handleUploadPostRequest_(MCE, shared_ptr<HTTPRequest> request) {
+    // The upload can only have been cancelled by the window itself (see
+    // handleUploadProgress) after the upload mode ended
+    if(request->uploadCancelled()) {
+        request->sendHTMLResponse(
+            200, writeUploadCancelHTML, {programName_}
+        );
+        return;
+    }
+
     if(request->getFormParam("csrftoken") != uploadCSRFToken_) {
         request->sendTextResponse(403, "ERROR: Invalid CSRF token\n");
         return;
@@ -893,6 +1691,12 @@ void Window::handleUploadPostRequest_(MCE, shared_ptr<HTTPRequest> request) {
     string mode = request->getFormParam("mode");
     if(mode == "upload") {
         if(inFileUploadMode_) {
+            // The upload has been received, so there is no progress to show
+            if(uploadProgress_) {
+                uploadProgress_.reset();
+                notifyViewChanged();
+            }
+
             shared_ptr<FileUpload> file = request->getFormFile("file");
             if(file) {
                 string name = request->getFormParam("filename");
@@ -994,11 +1798,12 @@ void Window::handleGotoURIRequest_(MCE, shared_ptr<HTTPRequest> request, string
     request->sendHTMLResponse(200, writeNewWindowHTML, {programName_, pathPrefix_});
 }
 
-void Window::addIframe_(MCE, function<void(shared_ptr<HTTPRequest>)> iframe) {
+void Window::addIframe_(MCE, IframeAction action) {
     REQUIRE(!closed_);
 
-    iframeQueue_.push(iframe);
+    iframeQueue_.push(move(action));
     imageCompressor_->setIframeSignal(mce, ImageCompressor::IframeSignalTrue);
+    flushEventsRequest_();
 }
 
 void Window::completeFileUpload_(MCE,
@@ -1007,8 +1812,7 @@ void Window::completeFileUpload_(MCE,
     REQUIRE(!closed_);
     REQUIRE(inFileUploadMode_);
 
-    inFileUploadMode_ = false;
-    notifyViewChanged();
+    endFileUploadMode_();
 
     name = extractUploadFilename(move(name));
 
@@ -1020,11 +1824,19 @@ void Window::selfCancelFileUpload_(MCE) {
     REQUIRE(!closed_);
     REQUIRE(inFileUploadMode_);
 
-    inFileUploadMode_ = false;
-    notifyViewChanged();
+    endFileUploadMode_();
 
     REQUIRE(eventHandler_);
     eventHandler_->onWindowCancelFileUpload(handle_);
 }
 
+void Window::endFileUploadMode_() {
+    inFileUploadMode_ = false;
+    if(uploadProgress_) {
+        uploadProgress_->cancel();
+        uploadProgress_.reset();
+    }
+    notifyViewChanged();
+}
+
 }
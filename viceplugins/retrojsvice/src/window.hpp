@@ -7,6 +7,49 @@ namespace retrojsvice {
 
 class FileUpload;
 
+// Input event relayed from the client to the program. The fields that are not
+// relevant for the type of the event are zero. The wheel delta is positive for
+// scrolling up.
+struct InputEvent {
+    enum Type {
+        MouseDown,
+        MouseUp,
+        MouseMove,
+        MouseDoubleClick,
+        MouseWheel,
+        MouseLeave,
+        KeyDown,
+        KeyUp,
+        LoseFocus
+    };
+    Type type;
+    int x;
+    int y;
+    int button;
+    int delta;
+    int key;
+};
+
+// Performance statistics of a window since its creation.
+struct WindowStats {
+    // Number of view change notifications received from the program.
+    uint64_t viewChanges = 0;
+
+    uint64_t imageRequests = 0;
+
+    // Number of input events handled, received again and ignored (replayed
+    // by the client) and skipped (lost in the client-to-server direction).
+    // curEventIdx is the index of the next event expected from the client.
+    uint64_t eventsHandled = 0;
+    uint64_t eventsReplayed = 0;
+    uint64_t eventsLost = 0;
+    uint64_t curEventIdx = 0;
+
+    bool hidden = false;
+
+    ImageCompressorStats compressor;
+};
+
 class WindowEventHandler {
 public:
     // Called when window closes itself (i.e. is not closed by a call to
@@ -17,7 +60,7 @@ public:
     // See ImageCompressorEventHandler::onImageCompressorFetchImage
     virtual void onWindowFetchImage(
         uint64_t window,
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ) = 0;
 
     virtual void onWindowResize(
@@ -26,30 +69,32 @@ public:
         size_t height
     ) = 0;
 
-    virtual void onWindowMouseDown(uint64_t window, int x, int y, int button) = 0;
-    virtual void onWindowMouseUp(uint64_t window, int x, int y, int button) = 0;
-    virtual void onWindowMouseMove(uint64_t window, int x, int y) = 0;
-    virtual void onWindowMouseDoubleClick(uint64_t window, int x, int y, int button) = 0;
-    virtual void onWindowMouseWheel(uint64_t window, int x, int y, int delta) = 0;
-    virtual void onWindowMouseLeave(uint64_t window, int x, int y) = 0;
-
-    virtual void onWindowKeyDown(uint64_t window, int key) = 0;
-    virtual void onWindowKeyUp(uint64_t window, int key) = 0;
-
-    virtual void onWindowLoseFocus(uint64_t window) = 0;
+    // Called with the input events received from the client in one request
+    // (in order).
+    virtual void onWindowInputEvents(
+        uint64_t window,
+        const vector<InputEvent>& events
+    ) = 0;
 
     virtual void onWindowNavigate(uint64_t window, int direction) = 0;
     virtual void onWindowNavigateToURI(uint64_t window, string uri) = 0;
 
+    // Called when the window becomes hidden (no client has requested images
+    // for a while) or visible again. The window is initially visible.
+    virtual void onWindowVisibilityChanged(uint64_t window, bool visible) = 0;
+
     virtual void onWindowUploadFile(
         uint64_t window, string name, shared_ptr<FileUpload> file
     ) = 0;
     virtual void onWindowCancelFileUpload(uint64_t window) = 0;
 };
 
+class CompressorPool;
 class FileDownload;
 class HTTPRequest;
+class HTTPUploadProgress;
 class SecretGenerator;
+class UploadModeGUI;
 
 // Must be closed before destruction (as signaled by the onWindowClose, caused
 // by the Window itself or initiated using Window::close)
@@ -63,8 +108,11 @@ public:
         shared_ptr<WindowEventHandler> eventHandler,
         uint64_t handle,
         shared_ptr<SecretGenerator> secretGen,
+        shared_ptr<CompressorPool> compressorPool,
+        ImageCompressorOptions compressorOptions,
         string programName,
         bool allowPNG,
+        bool allowImageStream,
         int initialQuality
     );
     ~Window();
@@ -77,9 +125,22 @@ public:
     void handleInitialForwardHTTPRequest(shared_ptr<HTTPRequest> request);
     void handleHTTPRequest(MCE, shared_ptr<HTTPRequest> request);
 
+    // Called while the body of a file upload request to the window is being
+    // received (see HTTPServerEventHandler::onHTTPServerUploadProgress).
+    void handleUploadProgress(shared_ptr<HTTPUploadProgress> progress);
+
     shared_ptr<Window> createPopup(uint64_t popupHandle);
 
+    // If dirtyRect is given, only the pixels inside it have changed.
     void notifyViewChanged();
+    void notifyViewChanged(Rect dirtyRect);
+
+    // The next view change reflects given input trace (see trace.hpp).
+    void traceView(uint64_t traceId);
+
+    // Switches the image compressor to the video policy while the program
+    // reports that the window is playing media.
+    void setMediaPlaying(bool playing);
 
     void setCursor(int cursorSignal);
 
@@ -90,14 +151,22 @@ public:
 
     void putFileDownload(shared_ptr<FileDownload> file);
 
+    WindowStats stats();
+
+    // Memory held by the image buffers of the window (see
+    // ImageCompressorMemory), and releasing them if no client is polling the
+    // window.
+    ImageCompressorMemory memoryUsage();
+    void shrinkIdleBuffers();
+
     bool startFileUpload();
     void cancelFileUpload();
 
     // ImageCompressorEventHandler:
     virtual void onImageCompressorFetchImage(
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ) override;
-    virtual void onImageCompressorRenderGUI(
+    virtual bool onImageCompressorRenderGUI(
         vector<uint8_t>& data, size_t width, size_t height
     ) override;
 
@@ -110,6 +179,12 @@ private:
     void updateInactivityTimeout_(bool shorten = false);
     void inactivityTimeoutReached_(MCE, bool shortened);
 
+    // Called whenever the client shows signs of displaying the window; makes
+    // the window visible and restarts the timeout after which it is hidden.
+    void updateHideTimeout_(MCE);
+    void hideTimeoutReached_(MCE);
+    void setHidden_(MCE, bool hidden);
+
     int decodeKey_(uint64_t eventIdx, int key);
     bool handleTokenizedEvent_(MCE,
         uint64_t eventIdx,
@@ -122,7 +197,14 @@ private:
         string::const_iterator begin,
         string::const_iterator end
     );
-    void handleEvents_(MCE, uint64_t startIdx, string eventStr);
+    void handleEvents_(MCE,
+        uint64_t startIdx,
+        string::const_iterator begin,
+        string::const_iterator end
+    );
+
+    // Relays the input events in inputEvents_ to the event handler.
+    void flushInputEvents_();
 
     void navigate_(MCE, int direction);
 
@@ -135,7 +217,76 @@ private:
         int width,
         int height,
         uint64_t startEventIdx,
-        string eventStr
+        string::const_iterator eventsBegin,
+        string::const_iterator eventsEnd,
+        optional<uint64_t> tileBaseImgIdx = {}
+    );
+    void handleStreamRequest_(MCE,
+        shared_ptr<HTTPRequest> request,
+        uint64_t mainIdx
+    );
+
+    // Events requests are used by the clients that receive the images through
+    // an image stream; the response carries only the signals. Unless
+    // immediate is set, the response waits until the signals change or a
+    // timeout is reached.
+    void handleEventsRequest_(MCE,
+        shared_ptr<HTTPRequest> request,
+        uint64_t mainIdx,
+        uint64_t reqIdx,
+        int immediate,
+        int width,
+        int height,
+        uint64_t startEventIdx,
+        string::const_iterator eventsBegin,
+        string::const_iterator eventsEnd
+    );
+    void flushEventsRequest_();
+    void sendSignals_(shared_ptr<HTTPRequest> request);
+
+    // Input requests carry long event batches in the POST body (in the same
+    // format as in the paths of the image requests) for the clients that
+    // support XMLHttpRequest, avoiding long URLs.
+    void handleInputRequest_(MCE,
+        shared_ptr<HTTPRequest> request,
+        uint64_t mainIdx,
+        uint64_t startEventIdx
+    );
+
+    // Resizes the window to the viewport size reported by the client.
+    void updateSize_(int width, int height);
+
+    void handleTilePosRequest_(
+        shared_ptr<HTTPRequest> request,
+        uint64_t mainIdx,
+        uint64_t imgIdx
+    );
+    void tileSent_(
+        uint64_t mainIdx,
+        uint64_t imgIdx,
+        uint64_t frameIdx,
+        Rect rect,
+        bool isTile,
+        optional<ScrollShift> shift
+    );
+    void sendTilePos_(
+        shared_ptr<HTTPRequest> request,
+        Rect rect,
+        bool isTile,
+        bool hasShift
+    );
+    void handleTileShiftRequest_(
+        shared_ptr<HTTPRequest> request,
+        uint64_t mainIdx,
+        uint64_t imgIdx,
+        uint64_t part
+    );
+    // Responds with a JSON array of the control messages of all the queued
+    // iframe actions, which saves the client an iframe load and a page render
+    // per action.
+    void handleControlRequest_(MCE,
+        shared_ptr<HTTPRequest> request,
+        uint64_t mainIdx
     );
     void handleIframeRequest_(MCE,
         shared_ptr<HTTPRequest> request,
@@ -150,15 +301,27 @@ private:
     void handleNextPageRequest_(MCE, shared_ptr<HTTPRequest> request);
     void handleGotoURIRequest_(MCE, shared_ptr<HTTPRequest> request, string uri);
 
-    void addIframe_(MCE, function<void(shared_ptr<HTTPRequest>)> iframe);
+    // An action queued for the client, performed either by loading an iframe
+    // page rendered by iframe or, by clients that use the control channel
+    // (see handleControlRequest_), as the control message given by control as
+    // a JSON object. Only one of the two functions is called per action.
+    struct IframeAction {
+        function<void(shared_ptr<HTTPRequest>)> iframe;
+        function<string()> control;
+    };
+    void addIframe_(MCE, IframeAction action);
 
     void completeFileUpload_(MCE, string name, shared_ptr<FileUpload> file);
     void selfCancelFileUpload_(MCE);
+    void endFileUploadMode_();
 
     string programName_;
     bool allowPNG_;
+    bool allowImageStream_;
     int initialQuality_;
     shared_ptr<SecretGenerator> secretGen_;
+    shared_ptr<CompressorPool> compressorPool_;
+    ImageCompressorOptions compressorOptions_;
 
     // The key codes sent by the client are XOR "encrypted" using this key. Note
     // that THIS DOES NOT PROVIDE SECURITY from sniffers, because the key is
@@ -186,6 +349,10 @@ private:
     set<int> mouseButtonsDown_;
     set<int> keysDown_;
 
+    // Input events waiting to be relayed by flushInputEvents_; the buffer is
+    // reused between batches.
+    vector<InputEvent> inputEvents_;
+
     bool prePrevVisited_;
     bool preMainVisited_;
     bool navigationInProgress_;
@@ -204,6 +371,22 @@ private:
     // twice as it cannot know for sure which requests make it through.
     uint64_t curEventIdx_;
 
+    // For the latest image requests of tile clients: the image index mapped to
+    // (the index of the frame sent by the image compressor, the rectangle of the
+    // frame covered by the image, was the image a tile, the scroll shift to
+    // apply before compositing the tile). Used to tell the client where to
+    // composite the tiles and to let the image compressor know which frame the
+    // client is showing.
+    map<uint64_t, tuple<uint64_t, Rect, bool, optional<ScrollShift>>>
+        sentTiles_;
+
+    // Tile position request waiting for the corresponding tile to be sent.
+    optional<pair<uint64_t, shared_ptr<HTTPRequest>>> pendingTilePosRequest_;
+
+    // Events request waiting for the signals to change.
+    shared_ptr<HTTPRequest> pendingEventsRequest_;
+    shared_ptr<DelayedTaskTag> eventsWaitTag_;
+
     // Downloads whose iframe has been loaded; the actual file is kept available
     // until a timeout has expired.
     map<
@@ -214,13 +397,25 @@ private:
 
     shared_ptr<DelayedTaskTag> inactivityTimeoutTag_;
 
+    // While the window is hidden, the image compressor does not fetch new
+    // images and the program is told that it may stop rendering the window.
+    bool hidden_;
+    shared_ptr<DelayedTaskTag> hideTimeoutTag_;
+
     steady_clock::time_point lastNavigateOperationTime_;
 
-    queue<function<void(shared_ptr<HTTPRequest>)>> iframeQueue_;
+    queue<IframeAction> iframeQueue_;
 
     bool inFileUploadMode_;
     bool fileUploadModeButtonPressed_;
     bool fileUploadModeButtonDown_;
+    shared_ptr<UploadModeGUI> uploadModeGUI_;
+
+    // The upload currently being received in file upload mode; cancelled if
+    // the upload mode ends before the upload completes.
+    shared_ptr<HTTPUploadProgress> uploadProgress_;
+
+    WindowStats stats_;
 };
 
 }
@@ -1,30 +1,33 @@
 #include "window_manager.hpp"
 
 #include "http.hpp"
+#include "path_parser.hpp"
 
 namespace retrojsvice {
 
-namespace {
-
-regex windowPathRegex("/([0-9]+)/.*");
-
-}
-
 WindowManager::WindowManager(CKey,
     shared_ptr<WindowManagerEventHandler> eventHandler,
     shared_ptr<SecretGenerator> secretGen,
+    shared_ptr<CompressorPool> compressorPool,
+    ImageCompressorOptions compressorOptions,
     string programName,
-    int defaultQuality
+    int defaultQuality,
+    bool allowImageStream
 ) {
     REQUIRE_API_THREAD();
-    REQUIRE(defaultQuality >= 10 && defaultQuality <= 101);
+    REQUIRE(
+        defaultQuality >= 10 && defaultQuality <= ImageCompressor::AutoQuality
+    );
 
     eventHandler_ = eventHandler;
     closed_ = false;
 
     secretGen_ = secretGen;
+    compressorPool_ = compressorPool;
+    compressorOptions_ = compressorOptions;
     programName_ = move(programName);
     defaultQuality_ = defaultQuality;
+    allowImageStream_ = allowImageStream;
 }
 
 WindowManager::~WindowManager() {
@@ -75,25 +78,40 @@ void WindowManager::handleHTTPRequest(MCE, shared_ptr<HTTPRequest> request) {
         return;
     }
 
-    smatch match;
-    if(regex_match(path, match, windowPathRegex)) {
-        REQUIRE(match.size() == 2);
-        optional<uint64_t> handle = parseString<uint64_t>(match[1]);
-        if(handle) {
-            auto it = windows_.find(*handle);
-            if(it != windows_.end()) {
-                shared_ptr<Window> window = it->second;
-                window->handleHTTPRequest(mce, request);
-            } else {
-                request->sendTextResponse(400, "ERROR: Invalid window handle\n");
-            }
-            return;
+    PathParser parser(path);
+    uint64_t handle;
+    if(parser.literal("/") && parser.number(handle) && parser.rest()) {
+        auto it = windows_.find(handle);
+        if(it != windows_.end()) {
+            shared_ptr<Window> window = it->second;
+            window->handleHTTPRequest(mce, request);
+        } else {
+            request->sendTextResponse(400, "ERROR: Invalid window handle\n");
         }
+        return;
     }
 
     request->sendTextResponse(400, "ERROR: Invalid request URI or method\n");
 }
 
+void WindowManager::handleUploadProgress(shared_ptr<HTTPUploadProgress> progress) {
+    REQUIRE_API_THREAD();
+
+    if(closed_) {
+        progress->cancel();
+        return;
+    }
+
+    PathParser parser(progress->path());
+    uint64_t handle;
+    if(parser.literal("/") && parser.number(handle) && parser.rest()) {
+        auto it = windows_.find(handle);
+        if(it != windows_.end()) {
+            it->second->handleUploadProgress(progress);
+        }
+    }
+}
+
 bool WindowManager::createPopupWindow(
     uint64_t parentWindow,
     uint64_t popupWindow,
@@ -147,6 +165,30 @@ void WindowManager::notifyViewChanged(uint64_t window) {
     it->second->notifyViewChanged();
 }
 
+void WindowManager::notifyViewChanged(uint64_t window, Rect dirtyRect) {
+    REQUIRE_API_THREAD();
+
+    auto it = windows_.find(window);
+    REQUIRE(it != windows_.end());
+    it->second->notifyViewChanged(dirtyRect);
+}
+
+void WindowManager::traceView(uint64_t window, uint64_t traceId) {
+    REQUIRE_API_THREAD();
+
+    auto it = windows_.find(window);
+    REQUIRE(it != windows_.end());
+    it->second->traceView(traceId);
+}
+
+void WindowManager::setMediaPlaying(uint64_t window, bool playing) {
+    REQUIRE_API_THREAD();
+
+    auto it = windows_.find(window);
+    REQUIRE(it != windows_.end());
+    it->second->setMediaPlaying(playing);
+}
+
 void WindowManager::setCursor(uint64_t window, int cursorSignal) {
     REQUIRE_API_THREAD();
 
@@ -197,6 +239,40 @@ void WindowManager::putFileDownload(
     it->second->putFileDownload(file);
 }
 
+vector<pair<uint64_t, WindowStats>> WindowManager::stats() {
+    REQUIRE_API_THREAD();
+
+    vector<pair<uint64_t, WindowStats>> ret;
+    if(!closed_) {
+        for(const auto& item : windows_) {
+            ret.emplace_back(item.first, item.second->stats());
+        }
+    }
+    return ret;
+}
+
+uint64_t WindowManager::memoryUsage() {
+    REQUIRE_API_THREAD();
+
+    uint64_t ret = 0;
+    if(!closed_) {
+        for(const auto& item : windows_) {
+            ret += item.second->memoryUsage().total();
+        }
+    }
+    return ret;
+}
+
+void WindowManager::shrinkIdleBuffers() {
+    REQUIRE_API_THREAD();
+
+    if(!closed_) {
+        for(const auto& item : windows_) {
+            item.second->shrinkIdleBuffers();
+        }
+    }
+}
+
 bool WindowManager::startFileUpload(uint64_t window) {
     REQUIRE_API_THREAD();
 
@@ -233,7 +309,7 @@ void WindowManager::onWindowClose(uint64_t window) {
 FORWARD_WINDOW_EVENT(
     onWindowFetchImage(
         uint64_t window,
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ),
     onWindowManagerFetchImage(window, func)
 )
@@ -242,40 +318,8 @@ FORWARD_WINDOW_EVENT(
     onWindowManagerResizeWindow(window, width, height)
 )
 FORWARD_WINDOW_EVENT(
-    onWindowMouseDown(uint64_t window, int x, int y, int button),
-    onWindowManagerMouseDown(window, x, y, button)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowMouseUp(uint64_t window, int x, int y, int button),
-    onWindowManagerMouseUp(window, x, y, button)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowMouseMove(uint64_t window, int x, int y),
-    onWindowManagerMouseMove(window, x, y)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowMouseDoubleClick(uint64_t window, int x, int y, int button),
-    onWindowManagerMouseDoubleClick(window, x, y, button)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowMouseWheel(uint64_t window, int x, int y, int delta),
-    onWindowManagerMouseWheel(window, x, y, delta)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowMouseLeave(uint64_t window, int x, int y),
-    onWindowManagerMouseLeave(window, x, y)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowKeyDown(uint64_t window, int key),
-    onWindowManagerKeyDown(window, key)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowKeyUp(uint64_t window, int key),
-    onWindowManagerKeyUp(window, key)
-)
-FORWARD_WINDOW_EVENT(
-    onWindowLoseFocus(uint64_t window),
-    onWindowManagerLoseFocus(window)
+    onWindowInputEvents(uint64_t window, const vector<InputEvent>& events),
+    onWindowManagerInputEvents(window, events)
 )
 FORWARD_WINDOW_EVENT(
     onWindowNavigate(uint64_t window, int direction),
@@ -285,6 +329,10 @@ FORWARD_WINDOW_EVENT(
     onWindowNavigateToURI(uint64_t window, string uri),
     onWindowManagerNavigateToURI(window, move(uri))
 )
+FORWARD_WINDOW_EVENT(
+    onWindowVisibilityChanged(uint64_t window, bool visible),
+    onWindowManagerVisibilityChanged(window, visible)
+)
 FORWARD_WINDOW_EVENT(
     onWindowUploadFile(
         uint64_t window, string name, shared_ptr<FileUpload> file
@@ -308,6 +356,14 @@ bool hasPNGSupport(string userAgent) {
         userAgent.find("windows 16-bit") == string::npos;
 }
 
+bool hasImageStreamSupport(string userAgent) {
+    // Internet Explorer has never supported multipart/x-mixed-replace images
+    for(char& c : userAgent) {
+        c = tolower(c);
+    }
+    return userAgent.find("msie ") == string::npos;
+}
+
 }
 
 void WindowManager::handleNewWindowRequest_(MCE, shared_ptr<HTTPRequest> request, optional<string> uri) {
@@ -331,12 +387,17 @@ void WindowManager::handleNewWindowRequest_(MCE, shared_ptr<HTTPRequest> request
             REQUIRE(!windows_.count(handle));
 
             bool allowPNG = hasPNGSupport(request->userAgent());
+            bool allowImageStream =
+                allowImageStream_ && hasImageStreamSupport(request->userAgent());
             shared_ptr<Window> window = Window::create(
                 shared_from_this(),
                 handle,
                 secretGen_,
+                compressorPool_,
+                compressorOptions_,
                 programName_,
                 allowPNG,
+                allowImageStream,
                 defaultQuality_
             );
             REQUIRE(windows_.emplace(handle, window).second);
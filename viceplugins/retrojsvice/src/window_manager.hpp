@@ -13,7 +13,7 @@ public:
     // See ImageCompressorEventHandler::onImageCompressorFetchImage
     virtual void onWindowManagerFetchImage(
         uint64_t window,
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ) = 0;
 
     virtual void onWindowManagerResizeWindow(
@@ -22,28 +22,16 @@ public:
         size_t height
     ) = 0;
 
-    virtual void onWindowManagerMouseDown(
-        uint64_t window, int x, int y, int button
-    ) = 0;
-    virtual void onWindowManagerMouseUp(
-        uint64_t window, int x, int y, int button
-    ) = 0;
-    virtual void onWindowManagerMouseMove(uint64_t window, int x, int y) = 0;
-    virtual void onWindowManagerMouseDoubleClick(
-        uint64_t window, int x, int y, int button
-    ) = 0;
-    virtual void onWindowManagerMouseWheel(
-        uint64_t window, int x, int y, int delta
+    virtual void onWindowManagerInputEvents(
+        uint64_t window,
+        const vector<InputEvent>& events
     ) = 0;
-    virtual void onWindowManagerMouseLeave(uint64_t window, int x, int y) = 0;
-
-    virtual void onWindowManagerKeyDown(uint64_t window, int key) = 0;
-    virtual void onWindowManagerKeyUp(uint64_t window, int key) = 0;
-
-    virtual void onWindowManagerLoseFocus(uint64_t window) = 0;
 
     virtual void onWindowManagerNavigate(uint64_t window, int direction) = 0;
     virtual void onWindowManagerNavigateToURI(uint64_t window, string uri) = 0;
+    virtual void onWindowManagerVisibilityChanged(
+        uint64_t window, bool visible
+    ) = 0;
 
     virtual void onWindowManagerUploadFile(
         uint64_t window, string name, shared_ptr<FileUpload> file
@@ -52,7 +40,9 @@ public:
 };
 
 class FileDownload;
+class CompressorPool;
 class HTTPRequest;
+class HTTPUploadProgress;
 class SecretGenerator;
 
 // Must be closed with close() prior to destruction.
@@ -65,8 +55,11 @@ public:
     WindowManager(CKey,
         shared_ptr<WindowManagerEventHandler> eventHandler,
         shared_ptr<SecretGenerator> secretGen,
+        shared_ptr<CompressorPool> compressorPool,
+        ImageCompressorOptions compressorOptions,
         string programName,
-        int defaultQuality
+        int defaultQuality,
+        bool allowImageStream
     );
     ~WindowManager();
 
@@ -77,6 +70,7 @@ public:
     void close(MCE);
 
     void handleHTTPRequest(MCE, shared_ptr<HTTPRequest> request);
+    void handleUploadProgress(shared_ptr<HTTPUploadProgress> progress);
 
     bool createPopupWindow(
         uint64_t parentWindow,
@@ -85,6 +79,9 @@ public:
     );
     void closeWindow(uint64_t window);
     void notifyViewChanged(uint64_t window);
+    void notifyViewChanged(uint64_t window, Rect dirtyRect);
+    void traceView(uint64_t window, uint64_t traceId);
+    void setMediaPlaying(uint64_t window, bool playing);
 
     void setCursor(uint64_t window, int cursorSignal);
 
@@ -98,6 +95,14 @@ public:
 
     void putFileDownload(uint64_t window, shared_ptr<FileDownload> file);
 
+    // Returns the statistics of all the open windows ordered by handle.
+    vector<pair<uint64_t, WindowStats>> stats();
+
+    // Total memory held by the image buffers of all the windows, and
+    // releasing the buffers of the windows that no client is polling.
+    uint64_t memoryUsage();
+    void shrinkIdleBuffers();
+
     bool startFileUpload(uint64_t window);
     void cancelFileUpload(uint64_t window);
 
@@ -105,32 +110,22 @@ public:
     virtual void onWindowClose(uint64_t window) override;
     virtual void onWindowFetchImage(
         uint64_t window,
-        function<void(const uint8_t*, size_t, size_t, size_t)> func
+        PutImageFunc func
     ) override;
     virtual void onWindowResize(
         uint64_t window,
         size_t width,
         size_t height
     ) override;
-    virtual void onWindowMouseDown(
-        uint64_t window, int x, int y, int button
-    ) override;
-    virtual void onWindowMouseUp(
-        uint64_t window, int x, int y, int button
-    ) override;
-    virtual void onWindowMouseMove(uint64_t window, int x, int y) override;
-    virtual void onWindowMouseDoubleClick(
-        uint64_t window, int x, int y, int button
-    ) override;
-    virtual void onWindowMouseWheel(
-        uint64_t window, int x, int y, int delta
+    virtual void onWindowInputEvents(
+        uint64_t window,
+        const vector<InputEvent>& events
     ) override;
-    virtual void onWindowMouseLeave(uint64_t window, int x, int y) override;
-    virtual void onWindowKeyDown(uint64_t window, int key) override;
-    virtual void onWindowKeyUp(uint64_t window, int key) override;
-    virtual void onWindowLoseFocus(uint64_t window) override;
     virtual void onWindowNavigate(uint64_t window, int direction) override;
     virtual void onWindowNavigateToURI(uint64_t window, string uri) override;
+    virtual void onWindowVisibilityChanged(
+        uint64_t window, bool visible
+    ) override;
     virtual void onWindowUploadFile(
         uint64_t window, string name, shared_ptr<FileUpload> file
     ) override;
@@ -145,8 +140,11 @@ private:
     map<uint64_t, shared_ptr<Window>> windows_;
 
     shared_ptr<SecretGenerator> secretGen_;
+    shared_ptr<CompressorPool> compressorPool_;
+    ImageCompressorOptions compressorOptions_;
     string programName_;
     int defaultQuality_;
+    bool allowImageStream_;
 };
 
 }